@@ -0,0 +1,755 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <gio/gio.h>
+#include <libremote-display/remote-display.h>
+#include <libremote-display/remote-display-mock-airplay.h>
+#include "test-util.h"
+
+#define SERVICE_DOMAIN    "_airplay._tcp.local"
+#define FLEET_HOST_NAME   "fleet.local"
+#define RECORD_TTL        120                  /* seconds */
+#define PER_PACKET        8                    /* services per mDNS reply */
+#define STEP_TIMEOUT      120                  /* seconds */
+#define SEEK_TARGET       10000.0              /* ms */
+
+#define TYPE_A            1
+#define TYPE_PTR          12
+#define TYPE_TXT          16
+#define TYPE_SRV          33
+
+static char *sizes = NULL;
+static char *script = NULL;
+static int rounds = 1;
+static int latency = 0;
+static int media_size = 1024;
+
+static const GOptionEntry entries[] = {
+	{ "devices", 'n', 0, G_OPTION_ARG_STRING, &sizes, "Fleet sizes to step through (default: 10,50,100)", "N,N,..." },
+	{ "script", 's', 0, G_OPTION_ARG_STRING, &script, "Commands each device runs, among play, pause, seek and stop (default: play,pause,play,seek,stop)", "CMD,CMD,..." },
+	{ "rounds", 'r', 0, G_OPTION_ARG_INT, &rounds, "Times each device runs the script", NULL },
+	{ "latency", 'l', 0, G_OPTION_ARG_INT, &latency, "Delay the simulated receivers' replies", "MS" },
+	{ "size", 0, 0, G_OPTION_ARG_INT, &media_size, "Size of the media file to serve", "KB" },
+	{ NULL }
+};
+
+/* A simulated receiver. It lives in the fleet thread, so that the
+ * main thread only runs the manager, the devices and their hosts */
+typedef struct {
+	char *device_id;
+	char *name;
+	guint16 port;
+	GAsyncQueue *events;                   /* gint64 send times, oldest first */
+	RemoteDisplayMockAirplay *mock;        /* Only used in the fleet thread */
+} Receiver;
+
+typedef struct {
+	GThread *thread;
+	GMainContext *context;
+	GMainLoop *loop;
+	GSocket *socket;                       /* The mDNS responder */
+	GSource *source;
+	GPtrArray *receivers;                  /* Only used in the fleet thread */
+} Fleet;
+
+typedef struct {
+	RemoteDisplayDevice *device;
+	Receiver *receiver;
+	guint command;
+	gboolean opened;
+	gint64 start;
+} Client;
+
+typedef struct {
+	guint n_devices;
+	GMainLoop *loop;
+	GHashTable *receivers;                 /* key = device ID, value = Receiver */
+	GHashTable *clients;                   /* key = device ID, value = Client */
+	char **commands;
+	char *uri;
+	gboolean discovered;
+	guint n_done;
+	guint failures;
+	GArray *command_samples;
+	GArray *event_samples;
+} Step;
+
+static Fleet fleet;
+
+/* The main thread's CPU time, without the fleet thread's */
+static gint64
+get_cpu_time (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (gint64) ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+static gsize
+get_rss (void)
+{
+	char *contents;
+	char **fields;
+	gsize rss = 0;
+
+	if (!g_file_get_contents ("/proc/self/statm", &contents, NULL, NULL))
+		return 0;
+	fields = g_strsplit (contents, " ", -1);
+	if (fields[0] && fields[1])
+		rss = g_ascii_strtoull (fields[1], NULL, 10) * sysconf (_SC_PAGESIZE);
+	g_strfreev (fields);
+	g_free (contents);
+
+	return rss;
+}
+
+static void
+append_receiver (GByteArray *packet,
+		 Receiver   *receiver)
+{
+	GByteArray *rdata;
+	char **txt;
+	guint i;
+
+	test_dns_append_name (packet, NULL, SERVICE_DOMAIN);
+	rdata = g_byte_array_new ();
+	test_dns_append_name (rdata, receiver->name, SERVICE_DOMAIN);
+	test_dns_append_record (packet, TYPE_PTR, RECORD_TTL, rdata);
+	g_byte_array_unref (rdata);
+
+	test_dns_append_name (packet, receiver->name, SERVICE_DOMAIN);
+	rdata = g_byte_array_new ();
+	test_dns_append_uint16 (rdata, 0);
+	test_dns_append_uint16 (rdata, 0);
+	test_dns_append_uint16 (rdata, receiver->port);
+	test_dns_append_name (rdata, NULL, FLEET_HOST_NAME);
+	test_dns_append_record (packet, TYPE_SRV, RECORD_TTL, rdata);
+	g_byte_array_unref (rdata);
+
+	test_dns_append_name (packet, receiver->name, SERVICE_DOMAIN);
+	rdata = g_byte_array_new ();
+	txt = remote_display_mock_airplay_get_txt (receiver->mock);
+	for (i = 0; txt[i] != NULL; i++)
+		test_dns_append_label (rdata, txt[i]);
+	g_strfreev (txt);
+	test_dns_append_record (packet, TYPE_TXT, RECORD_TTL, rdata);
+	g_byte_array_unref (rdata);
+}
+
+static void
+send_reply (GSocketAddress *querier,
+	    guint           first,
+	    guint           last)
+{
+	GByteArray *packet, *rdata;
+	guint8 loopback[] = { 127, 0, 0, 1 };
+	guint n_records, i;
+
+	packet = test_dns_new_response ();
+
+	for (i = first; i < last; i++)
+		append_receiver (packet, g_ptr_array_index (fleet.receivers, i));
+
+	/* All the receivers are on the same host */
+	test_dns_append_name (packet, NULL, FLEET_HOST_NAME);
+	rdata = g_byte_array_new ();
+	g_byte_array_append (rdata, loopback, sizeof(loopback));
+	test_dns_append_record (packet, TYPE_A, RECORD_TTL, rdata);
+	g_byte_array_unref (rdata);
+
+	n_records = (last - first) * 3 + 1;
+	packet->data[6] = n_records >> 8;
+	packet->data[7] = n_records & 0xff;
+
+	g_socket_send_to (fleet.socket, querier, (const char *) packet->data, packet->len, NULL, NULL);
+	g_byte_array_unref (packet);
+}
+
+/* Every PTR query for AirPlay receivers gets all of them, without
+ * looking at the known answers, so that the querier does the work */
+static gboolean
+responder_cb (GSocket      *socket,
+	      GIOCondition  condition,
+	      gpointer      user_data)
+{
+	guint8 buffer[9000];
+	GSocketAddress *from = NULL;
+	GString *name;
+	gsize offset = 12;
+	gssize len;
+	guint i;
+
+	len = g_socket_receive_from (socket, &from, (char *) buffer, sizeof(buffer), NULL, NULL);
+	if (len <= 12 || (buffer[2] & 0x80) || ((buffer[4] << 8) | buffer[5]) == 0) {
+		g_clear_object (&from);
+		return G_SOURCE_CONTINUE;
+	}
+
+	/* The first question, which is never compressed */
+	name = g_string_new (NULL);
+	while (offset < (gsize) len && buffer[offset] != 0 && offset + 1 + buffer[offset] < (gsize) len) {
+		if (name->len > 0)
+			g_string_append_c (name, '.');
+		g_string_append_len (name, (const char *) buffer + offset + 1, buffer[offset]);
+		offset += buffer[offset] + 1;
+	}
+	if (offset + 3 <= (gsize) len &&
+	    ((buffer[offset + 1] << 8) | buffer[offset + 2]) == TYPE_PTR &&
+	    g_ascii_strcasecmp (name->str, SERVICE_DOMAIN) == 0) {
+		for (i = 0; i < fleet.receivers->len; i += PER_PACKET)
+			send_reply (from, i, MIN (i + PER_PACKET, fleet.receivers->len));
+	}
+	g_string_free (name, TRUE);
+	g_object_unref (from);
+
+	return G_SOURCE_CONTINUE;
+}
+
+static gpointer
+fleet_thread_func (gpointer user_data)
+{
+	g_main_context_push_thread_default (fleet.context);
+	g_main_loop_run (fleet.loop);
+	g_main_context_pop_thread_default (fleet.context);
+
+	return NULL;
+}
+
+static guint16
+fleet_start (void)
+{
+	GSocketAddress *address, *bound;
+	GInetAddress *loopback;
+	GError *error = NULL;
+	guint16 port;
+
+	fleet.context = g_main_context_new ();
+	fleet.loop = g_main_loop_new (fleet.context, FALSE);
+	fleet.receivers = g_ptr_array_new ();
+
+	fleet.socket = g_socket_new (G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_DATAGRAM,
+				     G_SOCKET_PROTOCOL_UDP, &error);
+	if (!fleet.socket)
+		g_error ("Failed to create the responder socket: %s", error->message);
+	g_socket_set_blocking (fleet.socket, FALSE);
+	loopback = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+	address = g_inet_socket_address_new (loopback, 0);
+	if (!g_socket_bind (fleet.socket, address, FALSE, &error))
+		g_error ("Failed to bind the responder socket: %s", error->message);
+	bound = g_socket_get_local_address (fleet.socket, NULL);
+	port = g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (bound));
+	g_object_unref (bound);
+	g_object_unref (address);
+	g_object_unref (loopback);
+
+	fleet.source = g_socket_create_source (fleet.socket, G_IO_IN, NULL);
+	g_source_set_callback (fleet.source, (GSourceFunc) responder_cb, NULL, NULL);
+	g_source_attach (fleet.source, fleet.context);
+
+	fleet.thread = g_thread_new ("fleet", fleet_thread_func, NULL);
+
+	return port;
+}
+
+typedef struct {
+	GSourceFunc func;
+	gpointer data;
+	GMutex lock;
+	GCond cond;
+	gboolean done;
+} FleetCall;
+
+static gboolean
+fleet_call_cb (gpointer user_data)
+{
+	FleetCall *call = user_data;
+
+	call->func (call->data);
+	g_mutex_lock (&call->lock);
+	call->done = TRUE;
+	g_cond_signal (&call->cond);
+	g_mutex_unlock (&call->lock);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Runs @func in the fleet thread, and waits for it */
+static void
+fleet_call (GSourceFunc func,
+	    gpointer    data)
+{
+	FleetCall call = { func, data, };
+
+	g_mutex_init (&call.lock);
+	g_cond_init (&call.cond);
+	g_main_context_invoke (fleet.context, fleet_call_cb, &call);
+	g_mutex_lock (&call.lock);
+	while (!call.done)
+		g_cond_wait (&call.cond, &call.lock);
+	g_mutex_unlock (&call.lock);
+	g_mutex_clear (&call.lock);
+	g_cond_clear (&call.cond);
+}
+
+static void
+event_cb (RemoteDisplayMockAirplay *mock,
+	  const char               *state,
+	  Receiver                 *receiver)
+{
+	gint64 now = g_get_monotonic_time ();
+	gint64 *event;
+
+	event = g_malloc (sizeof(now));
+	memcpy (event, &now, sizeof(now));
+	g_async_queue_push (receiver->events, event);
+}
+
+static gboolean
+add_receivers_cb (gpointer user_data)
+{
+	GPtrArray *added = user_data;
+	GError *error = NULL;
+	guint i;
+
+	for (i = 0; i < added->len; i++) {
+		Receiver *receiver = g_ptr_array_index (added, i);
+
+		receiver->mock = remote_display_mock_airplay_new (receiver->device_id);
+		remote_display_mock_airplay_set_latency (receiver->mock, latency);
+		if (!remote_display_mock_airplay_start (receiver->mock, &error))
+			g_error ("Failed to start receiver %s: %s", receiver->name, error->message);
+		receiver->port = remote_display_mock_airplay_get_port (receiver->mock);
+		g_signal_connect (receiver->mock, "event", G_CALLBACK (event_cb), receiver);
+		g_ptr_array_add (fleet.receivers, receiver);
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+sum_bytes_cb (gpointer user_data)
+{
+	guint64 *bytes = user_data;
+	guint i;
+
+	*bytes = 0;
+	for (i = 0; i < fleet.receivers->len; i++) {
+		Receiver *receiver = g_ptr_array_index (fleet.receivers, i);
+		RemoteDisplayMockAirplayStats stats;
+
+		remote_display_mock_airplay_get_stats (receiver->mock, &stats);
+		*bytes += stats.bytes_fetched;
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+stop_fleet_cb (gpointer user_data)
+{
+	guint i;
+
+	for (i = 0; i < fleet.receivers->len; i++) {
+		Receiver *receiver = g_ptr_array_index (fleet.receivers, i);
+
+		g_clear_object (&receiver->mock);
+	}
+	g_source_destroy (fleet.source);
+	g_main_loop_quit (fleet.loop);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+receiver_free (Receiver *receiver)
+{
+	g_async_queue_unref (receiver->events);
+	g_free (receiver->device_id);
+	g_free (receiver->name);
+	g_free (receiver);
+}
+
+/* Grows the fleet to @n receivers */
+static void
+grow_fleet (Step *step,
+	    guint n)
+{
+	GPtrArray *added;
+	guint i;
+
+	added = g_ptr_array_new ();
+	for (i = g_hash_table_size (step->receivers); i < n; i++) {
+		Receiver *receiver;
+
+		receiver = g_new0 (Receiver, 1);
+		receiver->device_id = g_strdup_printf ("02:00:00:%02X:%02X:%02X",
+						       (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+		receiver->name = g_strdup_printf ("Fleet %04u", i);
+		receiver->events = g_async_queue_new_full (g_free);
+		g_hash_table_insert (step->receivers, receiver->device_id, receiver);
+		g_ptr_array_add (added, receiver);
+	}
+	fleet_call (add_receivers_cb, added);
+	g_ptr_array_unref (added);
+}
+
+static void
+add_sample (GArray *samples,
+	    gint64  start)
+{
+	gdouble ms;
+
+	ms = (g_get_monotonic_time () - start) / 1000.0;
+	g_array_append_val (samples, ms);
+}
+
+static void run_command (Step *step, Client *client);
+
+static void
+command_cb (GObject      *source_object,
+	    GAsyncResult *result,
+	    gpointer      user_data)
+{
+	Step *step = user_data;
+	RemoteDisplayDevice *device = REMOTE_DISPLAY_DEVICE (source_object);
+	GError *error = NULL;
+	Client *client;
+	gpointer tag;
+	char *id;
+
+	tag = g_task_get_source_tag (G_TASK (result));
+	if (tag == remote_display_device_open_and_play_async)
+		remote_display_device_open_and_play_finish (device, result, &error);
+	else if (tag == remote_display_device_play_async)
+		remote_display_device_play_finish (device, result, &error);
+	else if (tag == remote_display_device_pause_async)
+		remote_display_device_pause_finish (device, result, &error);
+	else if (tag == remote_display_device_seek_async)
+		remote_display_device_seek_finish (device, result, &error);
+	else
+		remote_display_device_stop_finish (device, result, &error);
+
+	g_object_get (G_OBJECT (device), "id", &id, NULL);
+	client = step->clients ? g_hash_table_lookup (step->clients, id) : NULL;
+	g_free (id);
+
+	/* Finished after the step timed out */
+	if (!client) {
+		g_clear_error (&error);
+		return;
+	}
+
+	if (error) {
+		g_debug ("Command failed: %s", error->message);
+		g_error_free (error);
+		step->failures++;
+	} else {
+		add_sample (step->command_samples, client->start);
+	}
+	run_command (step, client);
+}
+
+static void
+run_command (Step   *step,
+	     Client *client)
+{
+	const char *command;
+	guint n_commands;
+
+	n_commands = g_strv_length (step->commands);
+	if (client->command == n_commands * rounds) {
+		step->n_done++;
+		if (step->n_done == step->n_devices)
+			g_main_loop_quit (step->loop);
+		return;
+	}
+	command = step->commands[client->command % n_commands];
+	client->command++;
+	client->start = g_get_monotonic_time ();
+
+	if (g_str_equal (command, "play") && !client->opened) {
+		client->opened = TRUE;
+		remote_display_device_open_and_play_async (client->device, step->uri, 0,
+							   NULL, command_cb, step);
+	} else if (g_str_equal (command, "play")) {
+		remote_display_device_play_async (client->device, NULL, command_cb, step);
+	} else if (g_str_equal (command, "pause")) {
+		remote_display_device_pause_async (client->device, NULL, command_cb, step);
+	} else if (g_str_equal (command, "seek")) {
+		remote_display_device_seek_async (client->device, SEEK_TARGET, NULL, command_cb, step);
+	} else {
+		/* The next play opens the media again */
+		client->opened = FALSE;
+		remote_display_device_stop_async (client->device, NULL, command_cb, step);
+	}
+}
+
+static void
+state_changed_cb (RemoteDisplayDevice      *device,
+		  RemoteDisplayDeviceState  state,
+		  Client                   *client)
+{
+	Step *step = g_object_get_data (G_OBJECT (device), "step");
+	gint64 *sent;
+
+	/* Events arrive in the order they were sent */
+	sent = g_async_queue_try_pop (client->receiver->events);
+	if (!sent)
+		return;
+	add_sample (step->event_samples, *sent);
+	g_free (sent);
+}
+
+static void
+device_appeared_cb (RemoteDisplayManager *manager,
+		    RemoteDisplayDevice  *device,
+		    Step                 *step)
+{
+	Receiver *receiver;
+	Client *client;
+	char *id;
+
+	g_object_get (G_OBJECT (device), "id", &id, NULL);
+	receiver = id ? g_hash_table_lookup (step->receivers, id) : NULL;
+	if (!receiver ||
+	    !(remote_display_device_get_capabilities (device) & REMOTE_DISPLAY_DEVICE_CAPABILITIES_VIDEO) ||
+	    g_hash_table_contains (step->clients, id)) {
+		g_free (id);
+		return;
+	}
+
+	client = g_new0 (Client, 1);
+	client->device = g_object_ref (device);
+	client->receiver = receiver;
+	g_hash_table_insert (step->clients, id, client);
+	g_object_set_data (G_OBJECT (device), "step", step);
+	g_signal_connect (device, "state-changed", G_CALLBACK (state_changed_cb), client);
+
+	if (g_hash_table_size (step->clients) == step->n_devices) {
+		step->discovered = TRUE;
+		g_main_loop_quit (step->loop);
+	}
+}
+
+static void
+client_free (Client *client)
+{
+	g_signal_handlers_disconnect_by_func (client->device, state_changed_cb, client);
+	g_object_unref (client->device);
+	g_free (client);
+}
+
+static gboolean
+step_timeout_cb (gpointer user_data)
+{
+	Step *step = user_data;
+
+	g_print ("Timed out with %u devices\n", step->n_devices);
+	g_main_loop_quit (step->loop);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+run_step (Step  *step,
+	  guint  n_devices)
+{
+	RemoteDisplayManager *manager;
+	GHashTableIter iter;
+	gpointer value;
+	gint64 start, cpu_start, script_start;
+	gsize rss_start, rss_discovered;
+	guint64 bytes_start, bytes_end;
+	gdouble discovery_ms, cpu_ms, script_s;
+	guint timeout_id;
+
+	grow_fleet (step, n_devices);
+	step->n_devices = n_devices;
+	step->n_done = 0;
+	step->failures = 0;
+	step->discovered = FALSE;
+	g_array_set_size (step->command_samples, 0);
+	g_array_set_size (step->event_samples, 0);
+	step->clients = g_hash_table_new_full (g_str_hash, g_str_equal,
+					       g_free, (GDestroyNotify) client_free);
+
+	/* Left over from the previous step */
+	g_hash_table_iter_init (&iter, step->receivers);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		Receiver *receiver = value;
+		gpointer sent;
+
+		while ((sent = g_async_queue_try_pop (receiver->events)) != NULL)
+			g_free (sent);
+	}
+
+	rss_start = get_rss ();
+	cpu_start = get_cpu_time ();
+	start = g_get_monotonic_time ();
+	timeout_id = g_timeout_add_seconds (STEP_TIMEOUT, step_timeout_cb, step);
+
+	manager = g_object_new (REMOTE_DISPLAY_TYPE_MANAGER, NULL);
+	g_signal_connect (manager, "device-appeared", G_CALLBACK (device_appeared_cb), step);
+	g_main_loop_run (step->loop);
+	discovery_ms = (g_get_monotonic_time () - start) / 1000.0;
+	rss_discovered = get_rss ();
+
+	fleet_call (sum_bytes_cb, &bytes_start);
+	script_start = g_get_monotonic_time ();
+	if (step->discovered) {
+		g_hash_table_iter_init (&iter, step->clients);
+		while (g_hash_table_iter_next (&iter, NULL, &value))
+			run_command (step, value);
+		g_main_loop_run (step->loop);
+	}
+	script_s = (g_get_monotonic_time () - script_start) / (gdouble) G_USEC_PER_SEC;
+	fleet_call (sum_bytes_cb, &bytes_end);
+	cpu_ms = (get_cpu_time () - cpu_start) / 1000.0;
+	g_source_remove (timeout_id);
+
+	g_print ("%7u %12.1f %10.1f %10.1f %9.2f %9.2f %9.2f %9.2f %10.2f %8u\n",
+		 n_devices,
+		 step->discovered ? discovery_ms : -1.0,
+		 cpu_ms,
+		 rss_discovered > rss_start ? (rss_discovered - rss_start) / 1024.0 / n_devices : 0.0,
+		 test_percentile (step->command_samples, 50),
+		 test_percentile (step->command_samples, 99),
+		 test_percentile (step->event_samples, 50),
+		 test_percentile (step->event_samples, 99),
+		 script_s > 0 ? (bytes_end - bytes_start) / script_s / (1024 * 1024) : 0.0,
+		 step->failures);
+
+	g_clear_pointer (&step->clients, g_hash_table_destroy);
+	g_object_unref (manager);
+}
+
+static int
+compare_sizes (gconstpointer a,
+	       gconstpointer b)
+{
+	return (int) *(const guint *) a - (int) *(const guint *) b;
+}
+
+int main (int argc, char **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	GArray *steps;
+	Step step = { 0, };
+	char **strv, *path, *data;
+	guint16 port;
+	char *target;
+	guint i;
+	int fd;
+
+	context = g_option_context_new ("- simulate a fleet of AirPlay receivers");
+	g_option_context_add_main_entries (context, entries, NULL);
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		g_print ("Failed to parse options: %s\n", error->message);
+		g_error_free (error);
+		return 1;
+	}
+	g_option_context_free (context);
+
+	steps = g_array_new (FALSE, FALSE, sizeof (guint));
+	strv = g_strsplit (sizes ? sizes : "10,50,100", ",", -1);
+	for (i = 0; strv[i] != NULL; i++) {
+		guint n = atoi (strv[i]);
+		if (n > 0 && n <= 0xffffff)
+			g_array_append_val (steps, n);
+	}
+	g_strfreev (strv);
+	g_array_sort (steps, compare_sizes);
+
+	step.commands = g_strsplit (script ? script : "play,pause,play,seek,stop", ",", -1);
+	for (i = 0; step.commands[i] != NULL; i++) {
+		if (!g_str_equal (step.commands[i], "play") &&
+		    !g_str_equal (step.commands[i], "pause") &&
+		    !g_str_equal (step.commands[i], "seek") &&
+		    !g_str_equal (step.commands[i], "stop")) {
+			g_print ("Unknown command '%s'\n", step.commands[i]);
+			return 1;
+		}
+	}
+	if (steps->len == 0 || step.commands[0] == NULL || rounds < 1 || media_size < 1) {
+		g_print ("Invalid fleet sizes, script, rounds or size\n");
+		return 1;
+	}
+
+	/* The media every receiver fetches from its device's host */
+	fd = g_file_open_tmp ("bench-fleet-XXXXXX.mp4", &path, &error);
+	if (fd < 0) {
+		g_print ("Failed to create media file: %s\n", error->message);
+		g_error_free (error);
+		return 1;
+	}
+	close (fd);
+	data = g_malloc0 (media_size * 1024);
+	g_file_set_contents (path, data, media_size * 1024, NULL);
+	g_free (data);
+	step.uri = g_filename_to_uri (path, NULL, NULL);
+
+	/* Discover the simulated receivers only, and start from
+	 * scratch every time */
+	port = fleet_start ();
+	target = g_strdup_printf ("127.0.0.1:%u", port);
+	g_setenv ("REMOTE_DISPLAY_MDNS", "native", TRUE);
+	g_setenv ("REMOTE_DISPLAY_MDNS_TARGET", target, TRUE);
+	g_setenv ("REMOTE_DISPLAY_CACHE", "", TRUE);
+	g_free (target);
+
+	step.loop = g_main_loop_new (NULL, FALSE);
+	step.receivers = g_hash_table_new_full (g_str_hash, g_str_equal,
+						NULL, (GDestroyNotify) receiver_free);
+	step.command_samples = g_array_new (FALSE, FALSE, sizeof (gdouble));
+	step.event_samples = g_array_new (FALSE, FALSE, sizeof (gdouble));
+
+	g_print ("%7s %12s %10s %10s %9s %9s %9s %9s %10s %8s\n",
+		 "devices", "discovery_ms", "cpu_ms", "kb/device",
+		 "cmd_p50", "cmd_p99", "event_p50", "event_p99", "host_MB/s", "failures");
+	for (i = 0; i < steps->len; i++)
+		run_step (&step, g_array_index (steps, guint, i));
+
+	fleet_call (stop_fleet_cb, NULL);
+	g_thread_join (fleet.thread);
+	g_source_unref (fleet.source);
+	g_object_unref (fleet.socket);
+	g_ptr_array_unref (fleet.receivers);
+	g_main_loop_unref (fleet.loop);
+	g_main_context_unref (fleet.context);
+
+	g_hash_table_destroy (step.receivers);
+	g_array_unref (step.command_samples);
+	g_array_unref (step.event_samples);
+	g_main_loop_unref (step.loop);
+	g_strfreev (step.commands);
+	g_free (step.uri);
+	g_unlink (path);
+	g_free (path);
+	g_array_unref (steps);
+
+	return 0;
+}
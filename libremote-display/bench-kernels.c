@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libremote-display/remote-display-kernels.h>
+
+static int width = 1920;
+static int height = 1080;
+static int iterations = 100;
+
+static const GOptionEntry entries[] = {
+	{ "width", 'w', 0, G_OPTION_ARG_INT, &width, "Frame width", NULL },
+	{ "height", 'h', 0, G_OPTION_ARG_INT, &height, "Frame height", NULL },
+	{ "iterations", 'i', 0, G_OPTION_ARG_INT, &iterations, "Number of runs per kernel", NULL },
+	{ NULL }
+};
+
+static void
+report (const RemoteDisplayKernels *kernels,
+	const char                 *kernel,
+	GTimer                     *timer,
+	guint                       pixels)
+{
+	double elapsed;
+
+	elapsed = g_timer_elapsed (timer, NULL);
+	g_print ("%-8s %-14s %10.1f Mpix/s\n",
+		 kernels->name, kernel,
+		 (double) pixels * iterations / elapsed / 1000000.0);
+}
+
+int main (int argc, char **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	guint8 *src, *y, *u, *v, *half;
+	GTimer *timer;
+	int impl, i;
+	gsize size;
+
+	context = g_option_context_new ("- benchmark pixel kernels");
+	g_option_context_add_main_entries (context, entries, NULL);
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		g_print ("Failed to parse options: %s\n", error->message);
+		g_error_free (error);
+		return 1;
+	}
+	g_option_context_free (context);
+
+	if (width < 2 || height < 2 || iterations < 1) {
+		g_print ("Invalid dimensions or iterations\n");
+		return 1;
+	}
+	width &= ~1;
+	height &= ~1;
+
+	size = (gsize) width * height;
+	src = g_malloc (size * 4);
+	for (i = 0; i < (int) (size * 4); i++)
+		src[i] = g_random_int ();
+	y = g_malloc (size);
+	u = g_malloc (size / 2);
+	v = g_malloc (size / 4);
+	half = g_malloc (size / 4);
+
+	g_print ("%dx%d, %d iterations\n", width, height, iterations);
+
+	timer = g_timer_new ();
+	for (impl = 0; impl < REMOTE_DISPLAY_KERNELS_NUM_IMPLS; impl++) {
+		const RemoteDisplayKernels *kernels;
+
+		kernels = remote_display_kernels_get (impl);
+		if (kernels == NULL)
+			continue;
+
+		g_timer_start (timer);
+		for (i = 0; i < iterations; i++)
+			kernels->rgbx_to_i420 (src, width * 4, TRUE, width, height,
+					       y, width, u, width / 2, v, width / 2);
+		report (kernels, "bgrx_to_i420", timer, size);
+
+		g_timer_start (timer);
+		for (i = 0; i < iterations; i++)
+			kernels->rgbx_to_nv12 (src, width * 4, TRUE, width, height,
+					       y, width, u, width);
+		report (kernels, "bgrx_to_nv12", timer, size);
+
+		g_timer_start (timer);
+		for (i = 0; i < iterations; i++)
+			kernels->halve_plane (y, width, width / 2, height / 2, half, width / 2);
+		report (kernels, "halve_plane", timer, size);
+	}
+
+	/* Uses the default kernels, for halving */
+	g_timer_start (timer);
+	for (i = 0; i < iterations; i++)
+		remote_display_kernels_scale_plane (y, width, width, height,
+						    half, width / 3, width / 3, height / 3);
+	report (remote_display_kernels_get_default (), "scale_plane", timer, size);
+
+	g_timer_destroy (timer);
+	g_free (src);
+	g_free (y);
+	g_free (u);
+	g_free (v);
+	g_free (half);
+
+	return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include <string.h>
+
+#include <libremote-display/remote-display-alac.h>
+
+/* Syntax element types */
+#define ID_CPE 1                               /* Channel pair */
+#define ID_END 7
+
+typedef struct {
+	guint8 *out;
+	guint64 acc;
+	guint n_bits;
+} BitWriter;
+
+static inline void
+put_bits (BitWriter *w,
+	  guint32    value,
+	  guint      n_bits)
+{
+	w->acc = (w->acc << n_bits) | value;
+	w->n_bits += n_bits;
+	while (w->n_bits >= 8) {
+		w->n_bits -= 8;
+		*w->out++ = w->acc >> w->n_bits;
+	}
+}
+
+static inline void
+flush_bits (BitWriter *w)
+{
+	if (w->n_bits > 0)
+		*w->out++ = w->acc << (8 - w->n_bits);
+	w->n_bits = 0;
+}
+
+/**
+ * remote_display_alac_encode:
+ * @samples: interleaved stereo samples, in host endianness
+ * @n_frames: the number of frames in @samples, at most
+ *   %REMOTE_DISPLAY_ALAC_FRAMES_PER_PACKET
+ * @out: a buffer of at least %REMOTE_DISPLAY_ALAC_MAX_PACKET_SIZE bytes
+ *
+ * Return value: the size of the packet written to @out.
+ **/
+gsize
+remote_display_alac_encode (const gint16 *samples,
+			    guint         n_frames,
+			    guint8       *out)
+{
+	BitWriter w = { out, 0, 0 };
+	gboolean partial;
+	guint i;
+
+	g_return_val_if_fail (n_frames <= REMOTE_DISPLAY_ALAC_FRAMES_PER_PACKET, 0);
+
+	partial = (n_frames != REMOTE_DISPLAY_ALAC_FRAMES_PER_PACKET);
+
+	put_bits (&w, ID_CPE, 3);
+	put_bits (&w, 0, 4);                   /* Element instance tag */
+	put_bits (&w, 0, 12);                  /* Unused */
+	put_bits (&w, partial, 1);             /* Sample count follows */
+	put_bits (&w, 0, 2);                   /* No shifted-out bytes */
+	put_bits (&w, 1, 1);                   /* Not compressed */
+	if (partial)
+		put_bits (&w, n_frames, 32);
+
+	for (i = 0; i < n_frames; i++) {
+		guint32 pair;
+
+		pair = ((guint32) (guint16) samples[i * 2] << 16) | (guint16) samples[i * 2 + 1];
+		put_bits (&w, pair, 32);
+	}
+
+	put_bits (&w, ID_END, 3);
+	flush_bits (&w);
+
+	return w.out - out;
+}
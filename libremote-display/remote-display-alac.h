@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#ifndef __REMOTE_DISPLAY_ALAC_H__
+#define __REMOTE_DISPLAY_ALAC_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* ALAC packets for 16-bit stereo at 44.1kHz, as RAOP receivers
+ * expect them. Frames are stored verbatim ("escape" frames), which
+ * every decoder supports, and costs next to no CPU, so a single
+ * sender can feed many receivers. */
+
+#define REMOTE_DISPLAY_ALAC_FRAMES_PER_PACKET 352
+#define REMOTE_DISPLAY_ALAC_SAMPLE_RATE       44100
+#define REMOTE_DISPLAY_ALAC_CHANNELS          2
+
+/* Header and optional sample count, samples, end tag */
+#define REMOTE_DISPLAY_ALAC_MAX_PACKET_SIZE \
+	((23 + 32 + REMOTE_DISPLAY_ALAC_FRAMES_PER_PACKET * 32 + 3 + 7) / 8)
+
+/* The "fmtp" SDP attribute describing the stream */
+#define REMOTE_DISPLAY_ALAC_FMTP "352 0 16 40 10 14 2 255 0 0 44100"
+
+gsize remote_display_alac_encode (const gint16 *samples,
+				  guint         n_frames,
+				  guint8       *out);
+
+G_END_DECLS
+
+#endif /* __REMOTE_DISPLAY_ALAC_H__ */
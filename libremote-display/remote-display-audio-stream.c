@@ -0,0 +1,1413 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <gio/gio.h>
+
+#include <libremote-display/remote-display-error.h>
+#include <libremote-display/remote-display-audio-stream.h>
+#include <libremote-display/remote-display-device-airplay.h>
+#include <libremote-display/remote-display-device-raop.h>
+#include <libremote-display/remote-display-device-private.h>
+#include <libremote-display/remote-display-alac.h>
+
+#define USER_AGENT            "iTunes/7.6.2 (Windows; N;)"
+#define CONNECT_TIMEOUT       5                    /* seconds */
+#define RTSP_TIMEOUT          5                    /* seconds */
+#define SAMPLE_RATE           REMOTE_DISPLAY_ALAC_SAMPLE_RATE
+#define PACKET_FRAMES         REMOTE_DISPLAY_ALAC_FRAMES_PER_PACKET
+#define DEFAULT_LATENCY       11025                /* frames, when the receiver doesn't say */
+#define FIFO_FRAMES           (SAMPLE_RATE * 2)
+#define PREBUFFER_FRAMES      (SAMPLE_RATE / 10)
+#define SEND_AHEAD            (20 * 1000)          /* µs */
+#define PACING_INTERVAL       4                    /* ms */
+#define MAX_LATE              G_USEC_PER_SEC
+#define SYNC_INTERVAL         G_USEC_PER_SEC
+#define RETRANSMIT_PACKETS    256                  /* about 2 seconds, must divide 65536 */
+#define RTP_HEADER_SIZE       12
+#define MAX_RTP_PACKET_SIZE   (RTP_HEADER_SIZE + REMOTE_DISPLAY_ALAC_MAX_PACKET_SIZE)
+#define PAYLOAD_TYPE          96
+#define NTP_EPOCH_OFFSET      G_GUINT64_CONSTANT (2208988800)
+
+/* Control and timing packet types, without the marker bit */
+typedef enum {
+	RAOP_TIMING_REQUEST     = 0x52,
+	RAOP_TIMING_REPLY       = 0x53,
+	RAOP_SYNC               = 0x54,
+	RAOP_RETRANSMIT_REQUEST = 0x55,
+	RAOP_RETRANSMIT_REPLY   = 0x56
+} RaopPacketType;
+
+typedef struct {
+	guint16 seq;
+	gsize size;
+	guint8 data[MAX_RTP_PACKET_SIZE];
+} SentPacket;
+
+struct _RemoteDisplayAudioStream {
+	GObject parent_instance;
+
+	RemoteDisplayDevice *device;
+	GMainContext *context;                 /* Where signals get emitted */
+
+	GThread *thread;
+	GCancellable *cancellable;
+	GSocketAddress *address;
+
+	/* Shared with the streaming thread, protected by lock */
+	GMutex lock;
+	gint16 *fifo;                          /* Ring of interleaved frames */
+	guint fifo_start;
+	guint fifo_len;
+	gboolean stopping;
+	GSource *stopped_source;               /* Emits "stopped" */
+	gdouble volume;
+	gboolean volume_changed;
+	guint latency;                         /* Receiver's, in frames */
+	guint64 packets_sent;
+	guint64 packets_resent;
+	guint64 underruns;
+
+	/* Only used from the streaming thread */
+	GMainLoop *loop;
+	GError *error;
+	GSocketConnection *connection;
+	GDataInputStream *rtsp_input;
+	GOutputStream *rtsp_output;
+	GSource *rtsp_source;                  /* Notices the receiver going away */
+	guint cseq;
+	char *url;
+	char *client_instance;
+	char *session;
+	GSocket *data_socket;
+	GSocket *control_socket;
+	GSocket *timing_socket;
+	GSocketAddress *server_control_address;
+	guint16 seq;
+	guint32 rtptime;
+	guint32 ssrc;
+	gboolean started;
+	gint64 start_time;
+	guint32 start_rtptime;
+	guint64 packets_since_start;
+	gint64 last_sync;
+	gboolean first_sync_sent;
+	SentPacket *sent;                      /* Kept for retransmissions */
+
+	/* Volume changes are sent without waiting for the reply */
+	gboolean volume_pending;
+	gint64 volume_sent;
+	guint volume_status;
+	gsize volume_reply_length;
+	GCancellable *volume_cancellable;
+};
+
+G_DEFINE_TYPE (RemoteDisplayAudioStream, remote_display_audio_stream, G_TYPE_OBJECT);
+
+enum {
+	STOPPED,
+	NUM_SIGS
+};
+
+static guint signals[NUM_SIGS] = {0,};
+
+typedef struct {
+	RemoteDisplayAudioStream *stream;
+	GError *error;
+} StoppedReport;
+
+static void
+stopped_report_free (StoppedReport *report)
+{
+	g_object_unref (report->stream);
+	g_clear_error (&report->error);
+	g_free (report);
+}
+
+static gboolean
+emit_stopped_cb (gpointer user_data)
+{
+	StoppedReport *report = user_data;
+	RemoteDisplayAudioStream *stream = report->stream;
+
+	g_mutex_lock (&stream->lock);
+	g_clear_pointer (&stream->stopped_source, g_source_unref);
+	g_mutex_unlock (&stream->lock);
+
+	/* The thread is only returning, so that it can be started again */
+	g_thread_join (stream->thread);
+	stream->thread = NULL;
+
+	g_signal_emit (stream, signals[STOPPED], 0, report->error);
+	return G_SOURCE_REMOVE;
+}
+
+static void
+report_stopped (RemoteDisplayAudioStream *stream,
+		GError                   *error)
+{
+	StoppedReport *report;
+	GSource *source;
+
+	/* Not reported once stopped by remote_display_audio_stream_stop() */
+	g_mutex_lock (&stream->lock);
+	if (stream->stopping) {
+		g_mutex_unlock (&stream->lock);
+		g_clear_error (&error);
+		return;
+	}
+
+	report = g_new0 (StoppedReport, 1);
+	report->stream = g_object_ref (stream);
+	report->error = error;
+
+	source = g_idle_source_new ();
+	g_source_set_callback (source, emit_stopped_cb, report, (GDestroyNotify) stopped_report_free);
+	g_source_attach (source, stream->context);
+	stream->stopped_source = source;
+	g_mutex_unlock (&stream->lock);
+}
+
+static guint64
+ntp_now (void)
+{
+	gint64 now;
+	guint64 secs, frac;
+
+	now = g_get_real_time ();
+	secs = now / G_USEC_PER_SEC + NTP_EPOCH_OFFSET;
+	frac = ((guint64) (now % G_USEC_PER_SEC) << 32) / G_USEC_PER_SEC;
+
+	return (secs << 32) | frac;
+}
+
+static void
+write_be16 (guint8  *dest,
+	    guint16  value)
+{
+	value = GUINT16_TO_BE (value);
+	memcpy (dest, &value, 2);
+}
+
+static void
+write_be32 (guint8  *dest,
+	    guint32  value)
+{
+	value = GUINT32_TO_BE (value);
+	memcpy (dest, &value, 4);
+}
+
+static void
+write_be64 (guint8  *dest,
+	    guint64  value)
+{
+	value = GUINT64_TO_BE (value);
+	memcpy (dest, &value, 8);
+}
+
+static guint16
+read_be16 (const guint8 *src)
+{
+	guint16 value;
+
+	memcpy (&value, src, 2);
+	return GUINT16_FROM_BE (value);
+}
+
+/* Stops the streaming loop, keeping the first error */
+static void
+stream_fail (RemoteDisplayAudioStream *stream,
+	     GError                   *error)
+{
+	if (stream->error == NULL)
+		stream->error = error;
+	else
+		g_clear_error (&error);
+	g_main_loop_quit (stream->loop);
+}
+
+static GString *
+rtsp_format_request (RemoteDisplayAudioStream *stream,
+		     const char               *method,
+		     const char               *extra_headers,
+		     const char               *content_type,
+		     const char               *body)
+{
+	GString *request;
+
+	request = g_string_new (NULL);
+	g_string_append_printf (request, "%s %s RTSP/1.0\r\n", method, stream->url);
+	g_string_append_printf (request, "CSeq: %u\r\n", ++stream->cseq);
+	g_string_append (request, "User-Agent: " USER_AGENT "\r\n");
+	g_string_append_printf (request, "Client-Instance: %s\r\n", stream->client_instance);
+	if (stream->session)
+		g_string_append_printf (request, "Session: %s\r\n", stream->session);
+	if (extra_headers)
+		g_string_append (request, extra_headers);
+	if (body) {
+		g_string_append_printf (request, "Content-Type: %s\r\n", content_type);
+		g_string_append_printf (request, "Content-Length: %" G_GSIZE_FORMAT "\r\n", strlen (body));
+	}
+	g_string_append (request, "\r\n");
+	if (body)
+		g_string_append (request, body);
+
+	return request;
+}
+
+static gboolean
+rtsp_check_status (const char  *method,
+		   guint        status,
+		   GError     **error)
+{
+	switch (status) {
+	case 200:
+		return TRUE;
+	case 401:
+		g_set_error_literal (error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_NOT_SUPPORTED,
+				     "Receiver requires a password");
+		break;
+	case 453:
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_BUSY,
+				     "Receiver is busy");
+		break;
+	default:
+		g_set_error (error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_INTERNAL_SERVER,
+			     "%s failed with status %u", method, status);
+	}
+
+	return FALSE;
+}
+
+static gboolean
+rtsp_request (RemoteDisplayAudioStream  *stream,
+	      const char                *method,
+	      const char                *extra_headers,
+	      const char                *content_type,
+	      const char                *body,
+	      GCancellable              *cancellable,
+	      GHashTable               **reply_headers,
+	      GError                   **error)
+{
+	GSocket *socket;
+	GString *request;
+	GHashTable *headers = NULL;
+	char *line;
+	const char *content_length;
+	guint status;
+	gboolean ret = FALSE;
+
+	/* Only time out while waiting for a reply, the socket is
+	 * watched for the receiver closing it the rest of the time */
+	socket = g_socket_connection_get_socket (stream->connection);
+	g_socket_set_timeout (socket, RTSP_TIMEOUT);
+
+	request = rtsp_format_request (stream, method, extra_headers, content_type, body);
+	if (!g_output_stream_write_all (stream->rtsp_output, request->str, request->len,
+					NULL, cancellable, error))
+		goto out;
+
+	line = g_data_input_stream_read_line (stream->rtsp_input, NULL, cancellable, error);
+	if (!line) {
+		if (error && *error == NULL)
+			g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED,
+					     "Connection closed by the receiver");
+		goto out;
+	}
+	if (sscanf (line, "RTSP/1.0 %u", &status) != 1) {
+		g_set_error (error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_PARSE,
+			     "Invalid RTSP reply '%s'", line);
+		g_free (line);
+		goto out;
+	}
+	g_free (line);
+
+	headers = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+	while (TRUE) {
+		char *colon;
+
+		line = g_data_input_stream_read_line (stream->rtsp_input, NULL, cancellable, error);
+		if (!line) {
+			if (error && *error == NULL)
+				g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED,
+						     "Connection closed by the receiver");
+			goto out;
+		}
+		if (*line == '\0') {
+			g_free (line);
+			break;
+		}
+		colon = strchr (line, ':');
+		if (colon) {
+			*colon = '\0';
+			g_hash_table_insert (headers,
+					     g_ascii_strdown (g_strstrip (line), -1),
+					     g_strdup (g_strstrip (colon + 1)));
+		}
+		g_free (line);
+	}
+
+	/* We don't use any reply bodies */
+	content_length = g_hash_table_lookup (headers, "content-length");
+	if (content_length && strtoul (content_length, NULL, 10) > 0) {
+		if (g_input_stream_skip (G_INPUT_STREAM (stream->rtsp_input),
+					 strtoul (content_length, NULL, 10),
+					 cancellable, error) < 0)
+			goto out;
+	}
+
+	ret = rtsp_check_status (method, status, error);
+
+out:
+	g_socket_set_timeout (socket, 0);
+	g_string_free (request, TRUE);
+	if (ret && reply_headers)
+		*reply_headers = headers;
+	else if (headers)
+		g_hash_table_destroy (headers);
+
+	return ret;
+}
+
+static GSocket *
+bind_udp_socket (GSocketFamily   family,
+		 guint16        *port,
+		 GError        **error)
+{
+	GSocket *socket;
+	GInetAddress *any;
+	GSocketAddress *address;
+	gboolean ret;
+
+	socket = g_socket_new (family, G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_UDP, error);
+	if (!socket)
+		return NULL;
+	g_socket_set_blocking (socket, FALSE);
+
+	any = g_inet_address_new_any (family);
+	address = g_inet_socket_address_new (any, 0);
+	ret = g_socket_bind (socket, address, TRUE, error);
+	g_object_unref (address);
+	g_object_unref (any);
+	if (!ret) {
+		g_object_unref (socket);
+		return NULL;
+	}
+
+	if (port) {
+		address = g_socket_get_local_address (socket, error);
+		if (!address) {
+			g_object_unref (socket);
+			return NULL;
+		}
+		*port = g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (address));
+		g_object_unref (address);
+	}
+
+	return socket;
+}
+
+/* Parses "server_port=6000;control_port=6001" style parameters */
+static guint16
+get_transport_port (const char *transport,
+		    const char *name)
+{
+	char **params;
+	guint16 port = 0;
+	guint i;
+
+	params = g_strsplit (transport, ";", -1);
+	for (i = 0; params[i] != NULL; i++) {
+		if (g_str_has_prefix (params[i], name) &&
+		    params[i][strlen (name)] == '=') {
+			port = strtoul (params[i] + strlen (name) + 1, NULL, 10);
+			break;
+		}
+	}
+	g_strfreev (params);
+
+	return port;
+}
+
+static char *
+address_to_uri_host (GInetAddress *address)
+{
+	char *str, *ret;
+
+	str = g_inet_address_to_string (address);
+	if (g_inet_address_get_family (address) != G_SOCKET_FAMILY_IPV6)
+		return str;
+	ret = g_strdup_printf ("[%s]", str);
+	g_free (str);
+	return ret;
+}
+
+static gboolean
+setup_session (RemoteDisplayAudioStream  *stream,
+	       GError                   **error)
+{
+	GSocketAddress *local, *remote;
+	GInetAddress *local_address, *remote_address;
+	GSocketFamily family;
+	GSocketAddress *data_address;
+	GHashTable *headers = NULL;
+	const char *transport, *audio_latency;
+	char *local_str, *remote_str, *host, *sdp, *str;
+	const char *ip_version;
+	guint16 control_port, timing_port, server_port, server_control_port;
+	guint32 session_id;
+	gboolean ret = FALSE;
+
+	local = g_socket_connection_get_local_address (stream->connection, error);
+	if (!local)
+		return FALSE;
+	remote = g_socket_connection_get_remote_address (stream->connection, error);
+	if (!remote) {
+		g_object_unref (local);
+		return FALSE;
+	}
+	local_address = g_inet_socket_address_get_address (G_INET_SOCKET_ADDRESS (local));
+	remote_address = g_inet_socket_address_get_address (G_INET_SOCKET_ADDRESS (remote));
+	family = g_inet_address_get_family (local_address);
+
+	stream->control_socket = bind_udp_socket (family, &control_port, error);
+	if (!stream->control_socket)
+		goto out;
+	stream->timing_socket = bind_udp_socket (family, &timing_port, error);
+	if (!stream->timing_socket)
+		goto out;
+	stream->data_socket = bind_udp_socket (family, NULL, error);
+	if (!stream->data_socket)
+		goto out;
+
+	session_id = g_random_int ();
+	local_str = g_inet_address_to_string (local_address);
+	remote_str = g_inet_address_to_string (remote_address);
+	host = address_to_uri_host (local_address);
+	stream->url = g_strdup_printf ("rtsp://%s/%u", host, session_id);
+	g_free (host);
+	stream->client_instance = g_strdup_printf ("%08X%08X", g_random_int (), g_random_int ());
+
+	ip_version = (family == G_SOCKET_FAMILY_IPV6) ? "IP6" : "IP4";
+	sdp = g_strdup_printf ("v=0\r\n"
+			       "o=iTunes %u 0 IN %s %s\r\n"
+			       "s=iTunes\r\n"
+			       "c=IN %s %s\r\n"
+			       "t=0 0\r\n"
+			       "m=audio 0 RTP/AVP %d\r\n"
+			       "a=rtpmap:%d AppleLossless\r\n"
+			       "a=fmtp:%d " REMOTE_DISPLAY_ALAC_FMTP "\r\n",
+			       session_id, ip_version, local_str,
+			       ip_version, remote_str,
+			       PAYLOAD_TYPE, PAYLOAD_TYPE, PAYLOAD_TYPE);
+	g_free (local_str);
+	g_free (remote_str);
+	ret = rtsp_request (stream, "ANNOUNCE", NULL, "application/sdp", sdp,
+			    stream->cancellable, NULL, error);
+	g_free (sdp);
+	if (!ret)
+		goto out;
+
+	str = g_strdup_printf ("Transport: RTP/AVP/UDP;unicast;interleaved=0-1;mode=record;"
+			       "control_port=%u;timing_port=%u\r\n",
+			       control_port, timing_port);
+	ret = rtsp_request (stream, "SETUP", str, NULL, NULL,
+			    stream->cancellable, &headers, error);
+	g_free (str);
+	if (!ret)
+		goto out;
+	ret = FALSE;
+
+	stream->session = g_strdup (g_hash_table_lookup (headers, "session"));
+	transport = g_hash_table_lookup (headers, "transport");
+	server_port = transport ? get_transport_port (transport, "server_port") : 0;
+	server_control_port = transport ? get_transport_port (transport, "control_port") : 0;
+	g_hash_table_destroy (headers);
+	headers = NULL;
+	if (!stream->session || server_port == 0) {
+		g_set_error_literal (error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_PARSE,
+				     "Receiver didn't send a session or transport");
+		goto out;
+	}
+
+	data_address = g_inet_socket_address_new (remote_address, server_port);
+	ret = g_socket_connect (stream->data_socket, data_address, stream->cancellable, error);
+	g_object_unref (data_address);
+	if (!ret)
+		goto out;
+	ret = FALSE;
+	if (server_control_port != 0)
+		stream->server_control_address = g_inet_socket_address_new (remote_address, server_control_port);
+
+	stream->seq = g_random_int ();
+	stream->rtptime = g_random_int ();
+	stream->ssrc = g_random_int ();
+	str = g_strdup_printf ("Range: npt=0-\r\n"
+			       "RTP-Info: seq=%u;rtptime=%u\r\n",
+			       stream->seq, stream->rtptime);
+	ret = rtsp_request (stream, "RECORD", str, NULL, NULL,
+			    stream->cancellable, &headers, error);
+	g_free (str);
+	if (!ret)
+		goto out;
+
+	audio_latency = g_hash_table_lookup (headers, "audio-latency");
+	g_mutex_lock (&stream->lock);
+	stream->latency = audio_latency ? strtoul (audio_latency, NULL, 10) : DEFAULT_LATENCY;
+	if (stream->latency == 0)
+		stream->latency = DEFAULT_LATENCY;
+	/* Always tell the receiver about the volume */
+	stream->volume_changed = TRUE;
+	g_mutex_unlock (&stream->lock);
+	g_hash_table_destroy (headers);
+
+out:
+	g_object_unref (local);
+	g_object_unref (remote);
+
+	return ret;
+}
+
+static gboolean rtsp_closed_cb (GSocket      *socket,
+				GIOCondition  condition,
+				gpointer      user_data);
+
+static void
+watch_rtsp (RemoteDisplayAudioStream *stream)
+{
+	GSocket *socket;
+
+	socket = g_socket_connection_get_socket (stream->connection);
+	stream->rtsp_source = g_socket_create_source (socket, G_IO_IN | G_IO_HUP | G_IO_ERR, NULL);
+	g_source_set_callback (stream->rtsp_source, (GSourceFunc) rtsp_closed_cb, stream, NULL);
+	g_source_attach (stream->rtsp_source, g_main_context_get_thread_default ());
+}
+
+static void
+unwatch_rtsp (RemoteDisplayAudioStream *stream)
+{
+	if (!stream->rtsp_source)
+		return;
+	g_source_destroy (stream->rtsp_source);
+	g_clear_pointer (&stream->rtsp_source, g_source_unref);
+}
+
+static void
+volume_reply_done (RemoteDisplayAudioStream *stream,
+		   GError                   *error)
+{
+	stream->volume_pending = FALSE;
+	if (!error)
+		rtsp_check_status ("SET_PARAMETER", stream->volume_status, &error);
+	if (error) {
+		stream_fail (stream, error);
+		return;
+	}
+	watch_rtsp (stream);
+}
+
+static void
+volume_reply_skipped_cb (GObject      *source_object,
+			 GAsyncResult *result,
+			 gpointer      user_data)
+{
+	GError *error = NULL;
+
+	g_input_stream_skip_finish (G_INPUT_STREAM (source_object), result, &error);
+	volume_reply_done (user_data, error);
+}
+
+static void
+volume_reply_line_cb (GObject      *source_object,
+		      GAsyncResult *result,
+		      gpointer      user_data)
+{
+	RemoteDisplayAudioStream *stream = user_data;
+	GError *error = NULL;
+	char *line;
+
+	line = g_data_input_stream_read_line_finish (G_DATA_INPUT_STREAM (source_object),
+						     result, NULL, &error);
+	if (!line) {
+		if (!error)
+			error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED,
+						     "Connection closed by the receiver");
+		volume_reply_done (stream, error);
+		return;
+	}
+
+	if (stream->volume_status == 0) {
+		if (sscanf (line, "RTSP/1.0 %u", &stream->volume_status) != 1) {
+			error = g_error_new (REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_PARSE,
+					     "Invalid RTSP reply '%s'", line);
+			g_free (line);
+			volume_reply_done (stream, error);
+			return;
+		}
+	} else if (*line == '\0') {
+		g_free (line);
+		if (stream->volume_reply_length > 0)
+			g_input_stream_skip_async (G_INPUT_STREAM (stream->rtsp_input),
+						   stream->volume_reply_length, G_PRIORITY_DEFAULT,
+						   stream->volume_cancellable,
+						   volume_reply_skipped_cb, stream);
+		else
+			volume_reply_done (stream, NULL);
+		return;
+	} else if (g_ascii_strncasecmp (line, "Content-Length:", strlen ("Content-Length:")) == 0) {
+		stream->volume_reply_length = strtoul (line + strlen ("Content-Length:"), NULL, 10);
+	}
+	g_free (line);
+
+	g_data_input_stream_read_line_async (stream->rtsp_input, G_PRIORITY_DEFAULT,
+					     stream->volume_cancellable,
+					     volume_reply_line_cb, stream);
+}
+
+/* Sends the volume without waiting for the reply, which would hold
+ * up the audio, the reply is read as it comes in */
+static gboolean
+send_volume (RemoteDisplayAudioStream  *stream,
+	     gdouble                    volume,
+	     GError                   **error)
+{
+	GSocket *socket;
+	GString *request;
+	char *body;
+	gdouble db;
+	gboolean ret;
+
+	/* Receivers take -30 to 0 dB, with -144 to mute */
+	db = (volume <= 0.0) ? -144.0 : 30.0 * (MIN (volume, 1.0) - 1.0);
+	body = g_strdup_printf ("volume: %.6f\r\n", db);
+	request = rtsp_format_request (stream, "SET_PARAMETER", NULL, "text/parameters", body);
+	g_free (body);
+
+	socket = g_socket_connection_get_socket (stream->connection);
+	g_socket_set_timeout (socket, RTSP_TIMEOUT);
+	ret = g_output_stream_write_all (stream->rtsp_output, request->str, request->len,
+					 NULL, stream->cancellable, error);
+	g_socket_set_timeout (socket, 0);
+	g_string_free (request, TRUE);
+	if (!ret)
+		return FALSE;
+
+	/* The reply is read instead of watching for the receiver going away */
+	unwatch_rtsp (stream);
+	stream->volume_pending = TRUE;
+	stream->volume_sent = g_get_monotonic_time ();
+	stream->volume_status = 0;
+	stream->volume_reply_length = 0;
+	g_data_input_stream_read_line_async (stream->rtsp_input, G_PRIORITY_DEFAULT,
+					     stream->volume_cancellable,
+					     volume_reply_line_cb, stream);
+
+	return TRUE;
+}
+
+/* Sends packets to the receiver, UDP errors mean the receiver went
+ * away, except for full buffers, where the packet is lost, and will
+ * get retransmitted if the receiver cares */
+static gboolean
+send_udp (GSocket         *socket,
+	  GSocketAddress  *address,
+	  const guint8    *data,
+	  gsize            size,
+	  GError         **error)
+{
+	GError *local_error = NULL;
+
+	if (g_socket_send_to (socket, address, (const char *) data, size, NULL, &local_error) < 0) {
+		if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+			g_error_free (local_error);
+			return TRUE;
+		}
+		g_propagate_error (error, local_error);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+send_audio_packet (RemoteDisplayAudioStream  *stream,
+		   GError                   **error)
+{
+	gint16 samples[PACKET_FRAMES * REMOTE_DISPLAY_ALAC_CHANNELS];
+	SentPacket *packet;
+	guint n_frames, first;
+
+	g_mutex_lock (&stream->lock);
+	n_frames = MIN (stream->fifo_len, PACKET_FRAMES);
+	first = MIN (n_frames, FIFO_FRAMES - stream->fifo_start);
+	memcpy (samples, stream->fifo + stream->fifo_start * REMOTE_DISPLAY_ALAC_CHANNELS,
+		first * REMOTE_DISPLAY_ALAC_CHANNELS * sizeof (gint16));
+	memcpy (samples + first * REMOTE_DISPLAY_ALAC_CHANNELS, stream->fifo,
+		(n_frames - first) * REMOTE_DISPLAY_ALAC_CHANNELS * sizeof (gint16));
+	stream->fifo_start = (stream->fifo_start + n_frames) % FIFO_FRAMES;
+	stream->fifo_len -= n_frames;
+	if (n_frames < PACKET_FRAMES)
+		stream->underruns++;
+	g_mutex_unlock (&stream->lock);
+
+	/* Keep the timeline going with silence if we ran dry */
+	memset (samples + n_frames * REMOTE_DISPLAY_ALAC_CHANNELS, 0,
+		(PACKET_FRAMES - n_frames) * REMOTE_DISPLAY_ALAC_CHANNELS * sizeof (gint16));
+
+	packet = &stream->sent[stream->seq % RETRANSMIT_PACKETS];
+	packet->seq = stream->seq;
+	packet->data[0] = 0x80;
+	packet->data[1] = PAYLOAD_TYPE | (stream->packets_since_start == 0 ? 0x80 : 0);
+	write_be16 (packet->data + 2, stream->seq);
+	write_be32 (packet->data + 4, stream->rtptime);
+	write_be32 (packet->data + 8, stream->ssrc);
+	packet->size = RTP_HEADER_SIZE +
+		remote_display_alac_encode (samples, PACKET_FRAMES, packet->data + RTP_HEADER_SIZE);
+
+	if (!send_udp (stream->data_socket, NULL, packet->data, packet->size, error))
+		return FALSE;
+
+	stream->seq++;
+	stream->rtptime += PACKET_FRAMES;
+	stream->packets_since_start++;
+
+	g_mutex_lock (&stream->lock);
+	stream->packets_sent++;
+	g_mutex_unlock (&stream->lock);
+
+	return TRUE;
+}
+
+/* Tells the receiver which RTP time is being played now, so that
+ * it can play it "latency" later */
+static gboolean
+send_sync (RemoteDisplayAudioStream  *stream,
+	   gint64                     now,
+	   GError                   **error)
+{
+	guint8 packet[20];
+	guint32 rtptime;
+	guint latency;
+
+	if (!stream->server_control_address)
+		return TRUE;
+
+	g_mutex_lock (&stream->lock);
+	latency = stream->latency;
+	g_mutex_unlock (&stream->lock);
+
+	rtptime = stream->start_rtptime +
+		(guint32) ((now - stream->start_time) * SAMPLE_RATE / G_USEC_PER_SEC);
+
+	packet[0] = stream->first_sync_sent ? 0x80 : 0x90;
+	packet[1] = 0x80 | RAOP_SYNC;
+	write_be16 (packet + 2, 7);
+	write_be32 (packet + 4, rtptime - latency);
+	write_be64 (packet + 8, ntp_now ());
+	write_be32 (packet + 16, rtptime);
+	stream->first_sync_sent = TRUE;
+	stream->last_sync = now;
+
+	return send_udp (stream->control_socket, stream->server_control_address,
+			 packet, sizeof(packet), error);
+}
+
+static gboolean
+pacing_cb (gpointer user_data)
+{
+	RemoteDisplayAudioStream *stream = user_data;
+	GError *error = NULL;
+	gboolean volume_changed;
+	gdouble volume;
+	gint64 now;
+
+	now = g_get_monotonic_time ();
+
+	/* Only one volume change in flight at a time, later ones wait */
+	g_mutex_lock (&stream->lock);
+	volume_changed = stream->volume_changed && !stream->volume_pending;
+	if (volume_changed)
+		stream->volume_changed = FALSE;
+	volume = stream->volume;
+	/* Wait for a little audio to be queued up, so that the writer
+	 * being late once in a while doesn't cause drop outs */
+	if (!stream->started && stream->fifo_len >= PREBUFFER_FRAMES) {
+		stream->started = TRUE;
+		stream->start_time = now;
+		stream->start_rtptime = stream->rtptime;
+		stream->packets_since_start = 0;
+	}
+	g_mutex_unlock (&stream->lock);
+
+	if (volume_changed && !send_volume (stream, volume, &error))
+		goto fail;
+	if (stream->volume_pending &&
+	    now - stream->volume_sent > RTSP_TIMEOUT * G_USEC_PER_SEC) {
+		error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+					     "Receiver didn't answer the volume change");
+		goto fail;
+	}
+
+	if (!stream->started)
+		return G_SOURCE_CONTINUE;
+
+	/* We were held up for too long, bursting out everything that's
+	 * late would overflow the receiver, restart the timeline instead */
+	if (stream->start_time +
+	    (gint64) (stream->packets_since_start * PACKET_FRAMES * G_USEC_PER_SEC / SAMPLE_RATE) <
+	    now - MAX_LATE) {
+		stream->start_time = now;
+		stream->start_rtptime = stream->rtptime;
+		stream->packets_since_start = 0;
+		stream->first_sync_sent = FALSE;
+	}
+
+	/* Send everything that's due, and a little more, so that us
+	 * being scheduled late doesn't starve the receiver */
+	while (stream->start_time +
+	       (gint64) (stream->packets_since_start * PACKET_FRAMES * G_USEC_PER_SEC / SAMPLE_RATE) <=
+	       now + SEND_AHEAD) {
+		if (!send_audio_packet (stream, &error))
+			goto fail;
+	}
+
+	if (!stream->first_sync_sent || now - stream->last_sync >= SYNC_INTERVAL) {
+		if (!send_sync (stream, now, &error))
+			goto fail;
+	}
+
+	return G_SOURCE_CONTINUE;
+
+fail:
+	stream_fail (stream, error);
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+control_cb (GSocket      *socket,
+	    GIOCondition  condition,
+	    gpointer      user_data)
+{
+	RemoteDisplayAudioStream *stream = user_data;
+	guint8 packet[64];
+	gssize size;
+
+	while ((size = g_socket_receive (socket, (char *) packet, sizeof(packet), NULL, NULL)) > 0) {
+		guint16 first, count, i;
+
+		if (size < 8 || (packet[1] & 0x7f) != RAOP_RETRANSMIT_REQUEST)
+			continue;
+
+		first = read_be16 (packet + 4);
+		count = read_be16 (packet + 6);
+		for (i = 0; i < count && i < RETRANSMIT_PACKETS; i++) {
+			guint8 reply[4 + MAX_RTP_PACKET_SIZE];
+			SentPacket *sent;
+			guint16 seq = first + i;
+
+			/* Too old, already overwritten */
+			sent = &stream->sent[seq % RETRANSMIT_PACKETS];
+			if (sent->size == 0 || sent->seq != seq)
+				continue;
+
+			reply[0] = 0x80;
+			reply[1] = 0x80 | RAOP_RETRANSMIT_REPLY;
+			write_be16 (reply + 2, 1);
+			memcpy (reply + 4, sent->data, sent->size);
+			if (!send_udp (socket, stream->server_control_address,
+				       reply, 4 + sent->size, NULL))
+				break;
+
+			g_mutex_lock (&stream->lock);
+			stream->packets_resent++;
+			g_mutex_unlock (&stream->lock);
+		}
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+timing_cb (GSocket      *socket,
+	   GIOCondition  condition,
+	   gpointer      user_data)
+{
+	guint8 packet[32];
+	GSocketAddress *address;
+	gssize size;
+
+	while ((size = g_socket_receive_from (socket, &address, (char *) packet,
+					      sizeof(packet), NULL, NULL)) >= 0) {
+		guint8 reply[32];
+
+		if (size == 32 && (packet[1] & 0x7f) == RAOP_TIMING_REQUEST) {
+			guint64 received;
+
+			received = ntp_now ();
+			reply[0] = 0x80;
+			reply[1] = 0x80 | RAOP_TIMING_REPLY;
+			write_be16 (reply + 2, 7);
+			memset (reply + 4, 0, 4);
+			/* Reference time is the request's send time */
+			memcpy (reply + 8, packet + 24, 8);
+			write_be64 (reply + 16, received);
+			write_be64 (reply + 24, ntp_now ());
+			send_udp (socket, address, reply, sizeof(reply), NULL);
+		}
+		g_object_unref (address);
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+/* The receiver doesn't send anything unprompted on the RTSP
+ * connection, so this fires when it goes away */
+static gboolean
+rtsp_closed_cb (GSocket      *socket,
+		GIOCondition  condition,
+		gpointer      user_data)
+{
+	RemoteDisplayAudioStream *stream = user_data;
+	GError *error = NULL;
+	char buf[256];
+	gssize size;
+
+	if (condition & G_IO_IN) {
+		size = g_socket_receive_with_blocking (socket, buf, sizeof(buf), FALSE, NULL, &error);
+		if (size > 0 || g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+			g_clear_error (&error);
+			return G_SOURCE_CONTINUE;
+		}
+		g_clear_error (&error);
+	}
+
+	stream_fail (stream, g_error_new_literal (G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED,
+						  "Connection closed by the receiver"));
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+cancelled_cb (GCancellable *cancellable,
+	      gpointer      user_data)
+{
+	RemoteDisplayAudioStream *stream = user_data;
+
+	g_main_loop_quit (stream->loop);
+	return G_SOURCE_REMOVE;
+}
+
+static void
+add_socket_source (RemoteDisplayAudioStream *stream,
+		   GMainContext             *context,
+		   GSocket                  *socket,
+		   GIOCondition              condition,
+		   GSocketSourceFunc         func)
+{
+	GSource *source;
+
+	source = g_socket_create_source (socket, condition, NULL);
+	g_source_set_callback (source, (GSourceFunc) func, stream, NULL);
+	g_source_attach (source, context);
+	g_source_unref (source);
+}
+
+static gpointer
+audio_stream_thread (gpointer user_data)
+{
+	RemoteDisplayAudioStream *stream = user_data;
+	GMainContext *context;
+	GSocketClient *client;
+	GSource *source;
+	GError *error = NULL;
+
+	context = g_main_context_new ();
+	g_main_context_push_thread_default (context);
+	stream->loop = g_main_loop_new (context, FALSE);
+	stream->sent = g_new0 (SentPacket, RETRANSMIT_PACKETS);
+	stream->volume_cancellable = g_cancellable_new ();
+
+	client = g_socket_client_new ();
+	g_socket_client_set_timeout (client, CONNECT_TIMEOUT);
+	stream->connection = g_socket_client_connect (client, G_SOCKET_CONNECTABLE (stream->address),
+						      stream->cancellable, &error);
+	g_object_unref (client);
+	if (!stream->connection)
+		goto out;
+
+	stream->rtsp_input = g_data_input_stream_new (g_io_stream_get_input_stream (G_IO_STREAM (stream->connection)));
+	g_data_input_stream_set_newline_type (stream->rtsp_input, G_DATA_STREAM_NEWLINE_TYPE_CR_LF);
+	stream->rtsp_output = g_io_stream_get_output_stream (G_IO_STREAM (stream->connection));
+
+	if (!setup_session (stream, &error))
+		goto out;
+
+	source = g_timeout_source_new (PACING_INTERVAL);
+	g_source_set_priority (source, G_PRIORITY_HIGH);
+	g_source_set_callback (source, pacing_cb, stream, NULL);
+	g_source_attach (source, context);
+	g_source_unref (source);
+
+	add_socket_source (stream, context, stream->control_socket, G_IO_IN, control_cb);
+	add_socket_source (stream, context, stream->timing_socket, G_IO_IN, timing_cb);
+	watch_rtsp (stream);
+
+	source = g_cancellable_source_new (stream->cancellable);
+	g_source_set_callback (source, (GSourceFunc) cancelled_cb, stream, NULL);
+	g_source_attach (source, context);
+	g_source_unref (source);
+
+	g_main_loop_run (stream->loop);
+
+	/* Let a volume change in flight finish before tearing down */
+	if (stream->volume_pending) {
+		g_cancellable_cancel (stream->volume_cancellable);
+		while (stream->volume_pending)
+			g_main_context_iteration (context, TRUE);
+	}
+	unwatch_rtsp (stream);
+
+	error = stream->error;
+	stream->error = NULL;
+
+	/* Best effort, the stream might be stopping because the
+	 * receiver went away */
+	if (!error || !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED))
+		rtsp_request (stream, "TEARDOWN", NULL, NULL, NULL, NULL, NULL, NULL);
+
+out:
+	if (error && g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+		g_clear_error (&error);
+	if (stream->connection)
+		g_io_stream_close (G_IO_STREAM (stream->connection), NULL, NULL);
+	g_clear_object (&stream->rtsp_input);
+	stream->rtsp_output = NULL;
+	g_clear_object (&stream->connection);
+	g_clear_object (&stream->data_socket);
+	g_clear_object (&stream->control_socket);
+	g_clear_object (&stream->timing_socket);
+	g_clear_object (&stream->server_control_address);
+	g_clear_pointer (&stream->url, g_free);
+	g_clear_pointer (&stream->client_instance, g_free);
+	g_clear_pointer (&stream->session, g_free);
+	g_clear_pointer (&stream->sent, g_free);
+	g_clear_object (&stream->volume_cancellable);
+	g_clear_pointer (&stream->loop, g_main_loop_unref);
+	g_main_context_pop_thread_default (context);
+	g_main_context_unref (context);
+
+	report_stopped (stream, error);
+
+	return NULL;
+}
+
+/* Before the reference count gets to zero, as the streaming
+ * thread might still take a reference to report stopping */
+static void
+remote_display_audio_stream_dispose (GObject *object)
+{
+	remote_display_audio_stream_stop (REMOTE_DISPLAY_AUDIO_STREAM (object));
+
+	G_OBJECT_CLASS (remote_display_audio_stream_parent_class)->dispose (object);
+}
+
+static void
+remote_display_audio_stream_finalize (GObject *object)
+{
+	RemoteDisplayAudioStream *stream = REMOTE_DISPLAY_AUDIO_STREAM (object);
+
+	g_clear_object (&stream->device);
+	g_clear_object (&stream->cancellable);
+	g_clear_pointer (&stream->context, g_main_context_unref);
+	g_clear_object (&stream->address);
+	g_free (stream->fifo);
+	g_mutex_clear (&stream->lock);
+
+	G_OBJECT_CLASS (remote_display_audio_stream_parent_class)->finalize (object);
+}
+
+static void
+remote_display_audio_stream_class_init (RemoteDisplayAudioStreamClass *klass)
+{
+	GObjectClass *o_class = (GObjectClass *)klass;
+
+	o_class->dispose = remote_display_audio_stream_dispose;
+	o_class->finalize = remote_display_audio_stream_finalize;
+
+	/**
+	 * RemoteDisplayAudioStream::stopped:
+	 * @stream: the audio stream
+	 * @error: (nullable): the reason streaming stopped, or %NULL
+	 *
+	 * Emitted when streaming stops on its own, because of an
+	 * error or the receiver going away, not when
+	 * remote_display_audio_stream_stop() is called.
+	 **/
+	signals[STOPPED] = g_signal_new ("stopped",
+					 REMOTE_DISPLAY_TYPE_AUDIO_STREAM,
+					 G_SIGNAL_RUN_FIRST,
+					 0, NULL, NULL,
+					 g_cclosure_marshal_generic,
+					 G_TYPE_NONE,
+					 1, G_TYPE_ERROR);
+}
+
+static void
+remote_display_audio_stream_init (RemoteDisplayAudioStream *stream)
+{
+	g_mutex_init (&stream->lock);
+	stream->fifo = g_new (gint16, FIFO_FRAMES * REMOTE_DISPLAY_ALAC_CHANNELS);
+	stream->volume = 1.0;
+	stream->latency = DEFAULT_LATENCY;
+}
+
+RemoteDisplayAudioStream *
+remote_display_audio_stream_new (RemoteDisplayDevice *device)
+{
+	RemoteDisplayAudioStream *stream;
+
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_DEVICE (device), NULL);
+
+	stream = g_object_new (REMOTE_DISPLAY_TYPE_AUDIO_STREAM, NULL);
+	stream->device = g_object_ref (device);
+
+	return stream;
+}
+
+/**
+ * remote_display_audio_stream_start:
+ * @stream: a #RemoteDisplayAudioStream
+ * @error: a #GError
+ *
+ * Connects to the receiver and starts streaming. The audio
+ * written with remote_display_audio_stream_write() is buffered,
+ * encoded and paced by a separate thread. Playback starts once a
+ * little audio is buffered, and silence is sent whenever the
+ * buffer runs dry.
+ *
+ * Return value: %TRUE if streaming was started.
+ **/
+gboolean
+remote_display_audio_stream_start (RemoteDisplayAudioStream  *stream,
+				   GError                   **error)
+{
+	RemoteDisplayDevice *device;
+
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_AUDIO_STREAM (stream), FALSE);
+	g_return_val_if_fail (stream->thread == NULL, FALSE);
+
+	/* AirPlay receivers stream audio through their RAOP service */
+	device = stream->device;
+	if (REMOTE_DISPLAY_IS_DEVICE_AIRPLAY (device) &&
+	    remote_display_device_airplay_get_raop (REMOTE_DISPLAY_DEVICE_AIRPLAY (device)))
+		device = remote_display_device_airplay_get_raop (REMOTE_DISPLAY_DEVICE_AIRPLAY (device));
+
+	if (!REMOTE_DISPLAY_IS_DEVICE_RAOP (device) ||
+	    !(remote_display_device_get_capabilities (device) & REMOTE_DISPLAY_DEVICE_CAPABILITIES_AUDIO)) {
+		g_set_error_literal (error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_NOT_SUPPORTED,
+				     "Device does not support audio streaming");
+		return FALSE;
+	}
+	if (remote_display_device_get_password_protected (device)) {
+		g_set_error_literal (error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_NOT_SUPPORTED,
+				     "Password protected receivers are not supported");
+		return FALSE;
+	}
+
+	g_clear_object (&stream->address);
+	stream->address = remote_display_device_get_best_address (device, 0);
+	if (!stream->address) {
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_HOST_UNREACHABLE,
+				     "Device has no known address");
+		return FALSE;
+	}
+	stream->stopping = FALSE;
+	stream->started = FALSE;
+	stream->first_sync_sent = FALSE;
+	g_clear_object (&stream->cancellable);
+	stream->cancellable = g_cancellable_new ();
+	g_clear_pointer (&stream->context, g_main_context_unref);
+	stream->context = g_main_context_ref_thread_default ();
+
+	stream->thread = g_thread_try_new ("remote-display-audio", audio_stream_thread, stream, error);
+	if (!stream->thread)
+		return FALSE;
+
+	return TRUE;
+}
+
+/**
+ * remote_display_audio_stream_stop:
+ * @stream: a #RemoteDisplayAudioStream
+ *
+ * Stops streaming, and drops any audio that wasn't sent yet.
+ **/
+void
+remote_display_audio_stream_stop (RemoteDisplayAudioStream *stream)
+{
+	GSource *source;
+
+	g_return_if_fail (REMOTE_DISPLAY_IS_AUDIO_STREAM (stream));
+
+	if (!stream->thread)
+		return;
+
+	g_mutex_lock (&stream->lock);
+	stream->stopping = TRUE;
+	stream->fifo_start = 0;
+	stream->fifo_len = 0;
+	source = stream->stopped_source;
+	stream->stopped_source = NULL;
+	g_mutex_unlock (&stream->lock);
+
+	/* Stopped on its own, but not reported yet */
+	if (source) {
+		g_source_destroy (source);
+		g_source_unref (source);
+	}
+
+	g_cancellable_cancel (stream->cancellable);
+	g_thread_join (stream->thread);
+	stream->thread = NULL;
+}
+
+/**
+ * remote_display_audio_stream_write:
+ * @stream: a #RemoteDisplayAudioStream
+ * @samples: interleaved stereo 16-bit samples at 44.1kHz, in host endianness
+ * @n_frames: the number of frames in @samples
+ *
+ * Queues audio to be sent. This never blocks, if the buffer is
+ * full, only part of the audio gets queued, and the caller should
+ * try writing the rest later.
+ *
+ * Return value: the number of frames queued.
+ **/
+gsize
+remote_display_audio_stream_write (RemoteDisplayAudioStream *stream,
+				   const gint16             *samples,
+				   gsize                     n_frames)
+{
+	guint end, first;
+
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_AUDIO_STREAM (stream), 0);
+	g_return_val_if_fail (samples != NULL || n_frames == 0, 0);
+
+	g_mutex_lock (&stream->lock);
+	n_frames = MIN (n_frames, FIFO_FRAMES - stream->fifo_len);
+	end = (stream->fifo_start + stream->fifo_len) % FIFO_FRAMES;
+	first = MIN (n_frames, FIFO_FRAMES - end);
+	memcpy (stream->fifo + end * REMOTE_DISPLAY_ALAC_CHANNELS, samples,
+		first * REMOTE_DISPLAY_ALAC_CHANNELS * sizeof (gint16));
+	memcpy (stream->fifo, samples + first * REMOTE_DISPLAY_ALAC_CHANNELS,
+		(n_frames - first) * REMOTE_DISPLAY_ALAC_CHANNELS * sizeof (gint16));
+	stream->fifo_len += n_frames;
+	g_mutex_unlock (&stream->lock);
+
+	return n_frames;
+}
+
+/**
+ * remote_display_audio_stream_set_volume:
+ * @stream: a #RemoteDisplayAudioStream
+ * @volume: the volume, between 0.0 (muted) and 1.0
+ **/
+void
+remote_display_audio_stream_set_volume (RemoteDisplayAudioStream *stream,
+					gdouble                   volume)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_AUDIO_STREAM (stream));
+
+	g_mutex_lock (&stream->lock);
+	stream->volume = CLAMP (volume, 0.0, 1.0);
+	stream->volume_changed = TRUE;
+	g_mutex_unlock (&stream->lock);
+}
+
+/**
+ * remote_display_audio_stream_get_delay:
+ * @stream: a #RemoteDisplayAudioStream
+ *
+ * Return value: how long until audio written now gets played by
+ * the receiver, in microseconds.
+ **/
+gint64
+remote_display_audio_stream_get_delay (RemoteDisplayAudioStream *stream)
+{
+	gint64 ret;
+
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_AUDIO_STREAM (stream), 0);
+
+	g_mutex_lock (&stream->lock);
+	ret = (gint64) (stream->fifo_len + stream->latency) * G_USEC_PER_SEC / SAMPLE_RATE;
+	g_mutex_unlock (&stream->lock);
+
+	return ret;
+}
+
+guint64
+remote_display_audio_stream_get_packets_sent (RemoteDisplayAudioStream *stream)
+{
+	guint64 ret;
+
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_AUDIO_STREAM (stream), 0);
+
+	g_mutex_lock (&stream->lock);
+	ret = stream->packets_sent;
+	g_mutex_unlock (&stream->lock);
+
+	return ret;
+}
+
+guint64
+remote_display_audio_stream_get_packets_resent (RemoteDisplayAudioStream *stream)
+{
+	guint64 ret;
+
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_AUDIO_STREAM (stream), 0);
+
+	g_mutex_lock (&stream->lock);
+	ret = stream->packets_resent;
+	g_mutex_unlock (&stream->lock);
+
+	return ret;
+}
+
+/**
+ * remote_display_audio_stream_get_underruns:
+ * @stream: a #RemoteDisplayAudioStream
+ *
+ * Return value: the number of packets that had to be padded with
+ * silence because not enough audio was written in time.
+ **/
+guint64
+remote_display_audio_stream_get_underruns (RemoteDisplayAudioStream *stream)
+{
+	guint64 ret;
+
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_AUDIO_STREAM (stream), 0);
+
+	g_mutex_lock (&stream->lock);
+	ret = stream->underruns;
+	g_mutex_unlock (&stream->lock);
+
+	return ret;
+}
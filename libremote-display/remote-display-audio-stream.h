@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#ifndef __REMOTE_DISPLAY_AUDIO_STREAM_H__
+#define __REMOTE_DISPLAY_AUDIO_STREAM_H__
+
+#include <glib-object.h>
+#include <gio/gio.h>
+#include <libremote-display/remote-display-device.h>
+
+G_BEGIN_DECLS
+
+#define REMOTE_DISPLAY_TYPE_AUDIO_STREAM remote_display_audio_stream_get_type ()
+G_DECLARE_FINAL_TYPE (RemoteDisplayAudioStream, remote_display_audio_stream, REMOTE_DISPLAY, AUDIO_STREAM, GObject)
+
+RemoteDisplayAudioStream *remote_display_audio_stream_new                (RemoteDisplayDevice       *device);
+gboolean                  remote_display_audio_stream_start              (RemoteDisplayAudioStream  *stream,
+									  GError                   **error);
+void                      remote_display_audio_stream_stop               (RemoteDisplayAudioStream  *stream);
+gsize                     remote_display_audio_stream_write              (RemoteDisplayAudioStream  *stream,
+									  const gint16              *samples,
+									  gsize                      n_frames);
+void                      remote_display_audio_stream_set_volume         (RemoteDisplayAudioStream  *stream,
+									  gdouble                    volume);
+gint64                    remote_display_audio_stream_get_delay          (RemoteDisplayAudioStream  *stream);
+guint64                   remote_display_audio_stream_get_packets_sent   (RemoteDisplayAudioStream  *stream);
+guint64                   remote_display_audio_stream_get_packets_resent (RemoteDisplayAudioStream  *stream);
+guint64                   remote_display_audio_stream_get_underruns      (RemoteDisplayAudioStream  *stream);
+
+G_END_DECLS
+
+#endif /* __REMOTE_DISPLAY_AUDIO_STREAM_H__ */
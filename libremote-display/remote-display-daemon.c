@@ -0,0 +1,114 @@
+#include "config.h"
+#include <locale.h>
+#include <glib.h>
+#include <gio/gio.h>
+#include <libremote-display/remote-display.h>
+#include <libremote-display/remote-display-service.h>
+
+/* Owns the session's RemoteDisplayManager, so that applications
+ * using the library with the "use-service" property share its
+ * discovery, cache and connections to the devices */
+
+static GMainLoop *loop = NULL;
+static RemoteDisplayService *service = NULL;
+
+static void
+bus_acquired_cb (GDBusConnection *connection,
+		 const char      *name,
+		 gpointer         user_data)
+{
+	GError *error = NULL;
+
+	if (!remote_display_service_export (service, connection, &error)) {
+		g_printerr ("Failed to export the service: %s\n", error->message);
+		g_error_free (error);
+		g_main_loop_quit (loop);
+	}
+}
+
+static void
+name_acquired_cb (GDBusConnection *connection,
+		  const char      *name,
+		  gpointer         user_data)
+{
+	g_debug ("Acquired %s", name);
+}
+
+static void
+name_lost_cb (GDBusConnection *connection,
+	      const char      *name,
+	      gpointer         user_data)
+{
+	if (connection)
+		g_printerr ("Lost the name %s, another instance is running\n", name);
+	else
+		g_printerr ("Cannot connect to the session bus\n");
+	g_main_loop_quit (loop);
+}
+
+int main (int argc, char **argv)
+{
+	GError *error = NULL;
+	GOptionContext *context;
+	gboolean replace = FALSE;
+	int metrics_port = -1;
+	const GOptionEntry entries[] = {
+		{ "replace", 'r', 0, G_OPTION_ARG_NONE, &replace, "Replace the running instance", NULL },
+		{ "metrics-port", 0, 0, G_OPTION_ARG_INT, &metrics_port, "Serve metrics for Prometheus on a local port, 0 for any", "PORT" },
+		{ NULL }
+	};
+	RemoteDisplayManager *manager;
+	GBusNameOwnerFlags flags;
+	guint owner_id;
+
+	setlocale (LC_ALL, "");
+
+	context = g_option_context_new ("- share remote display discovery");
+	g_option_context_add_main_entries (context, entries, GETTEXT_PACKAGE);
+	if (g_option_context_parse (context, &argc, &argv, &error) == FALSE) {
+		g_printerr ("Option parsing failed: %s\n", error->message);
+		return 1;
+	}
+	g_option_context_free (context);
+
+	/* We are the service */
+	g_unsetenv ("REMOTE_DISPLAY_SERVICE");
+
+	manager = g_object_new (REMOTE_DISPLAY_TYPE_MANAGER,
+				"discovery-thread", TRUE,
+				NULL);
+	if (metrics_port >= 0) {
+		char *uri;
+
+		uri = remote_display_manager_serve_metrics (manager, metrics_port, &error);
+		if (!uri) {
+			g_printerr ("Failed to serve metrics: %s\n", error->message);
+			g_error_free (error);
+			return 1;
+		}
+		g_print ("Serving metrics on %s\n", uri);
+		g_free (uri);
+	}
+	service = remote_display_service_new (manager);
+
+	flags = G_BUS_NAME_OWNER_FLAGS_ALLOW_REPLACEMENT;
+	if (replace)
+		flags |= G_BUS_NAME_OWNER_FLAGS_REPLACE;
+	owner_id = g_bus_own_name (G_BUS_TYPE_SESSION,
+				   REMOTE_DISPLAY_DBUS_NAME,
+				   flags,
+				   bus_acquired_cb,
+				   name_acquired_cb,
+				   name_lost_cb,
+				   NULL, NULL);
+
+	loop = g_main_loop_new (NULL, FALSE);
+	g_main_loop_run (loop);
+
+	g_bus_unown_name (owner_id);
+	g_object_unref (service);
+	g_object_unref (manager);
+	g_main_loop_unref (loop);
+
+	return 0;
+}
@@ -19,17 +19,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
-#include <net/if.h>
-
-#define _GNU_SOURCE     /* To get defns of NI_MAXSERV and NI_MAXHOST */
-#include <arpa/inet.h>
 #include <sys/socket.h>
-#include <netdb.h>
-#include <ifaddrs.h>
 #include <stdio.h>
-#include <stdlib.h>
 #include <unistd.h>
-#include <linux/if_link.h>
 
 #include <gio/gio.h>
 #include <libsoup/soup.h>
@@ -42,24 +34,36 @@
 #include <libremote-display/remote-display-device-private.h>
 #include <libremote-display/remote-display-private.h>
 #include <libremote-display/remote-display-device-airplay.h>
+#include <libremote-display/remote-display-device-raop.h>
 #include <libremote-display/remote-display-host.h>
+#include <libremote-display/remote-display-netif.h>
+#include <libremote-display/remote-display-error.h>
+#include <libremote-display/remote-display-trace.h>
+#include <libremote-display/remote-display-probes.h>
 
 struct _RemoteDisplayDeviceAirplay {
 	GObject parent_instance;
 
 	GCancellable *cancellable;
 	RemoteDisplayHost *host;
+	RemoteDisplayNetif *netif;
+	gulong netif_changed_id;
+	guint ifindex;
+	GSocketFamily family;
 
 	char *hostname;
 	guint port;
 	guint features;
 	char *password;
 
+	RemoteDisplayDevice *raop; /* The receiver's audio service */
+
 	gboolean connected;
 	char *session_id;
 	SoupServer *server;
 	SoupSession *session;
 	GQueue *actions;
+	gpointer current;          /* The action in flight */
 };
 
 /* Note, those names match AirPlay commands, not
@@ -71,10 +75,23 @@ typedef enum {
 	REMOTE_DISPLAY_DEVICE_ACTION_STOP
 } RemoteDisplayDeviceActionType;
 
+#ifdef HAVE_SDT_PROBES
+/* For the probes */
+static const char *action_names[] = {
+	"play",
+	"scrub",
+	"rate",
+	"stop"
+};
+#endif
+
 typedef struct {
 	RemoteDisplayDeviceActionType type;
 	char *uri;
 	gfloat value;
+	GTask *task;               /* NULL if nobody is waiting for it */
+	SoupMessage *msg;          /* While in flight */
+	GSource *cancel_source;
 } RemoteDisplayDeviceAirplayAction;
 
 G_DEFINE_TYPE (RemoteDisplayDeviceAirplay, remote_display_device_airplay, REMOTE_DISPLAY_TYPE_DEVICE);
@@ -84,10 +101,43 @@ static void remote_display_airplay_clear_session (RemoteDisplayDeviceAirplay *de
 static void
 action_free (RemoteDisplayDeviceAirplayAction *action)
 {
+	if (action->cancel_source) {
+		g_source_destroy (action->cancel_source);
+		g_source_unref (action->cancel_source);
+	}
+	g_clear_object (&action->task);
 	g_free (action->uri);
 	g_free (action);
 }
 
+/* Takes ownership of @error */
+static void
+action_complete (RemoteDisplayDeviceAirplayAction *action,
+		 GError                           *error)
+{
+	if (action->task && error)
+		g_task_return_error (action->task, error);
+	else if (action->task)
+		g_task_return_boolean (action->task, TRUE);
+	else if (error) {
+		g_warning ("Call failed: %s", error->message);
+		g_error_free (error);
+	}
+	action_free (action);
+}
+
+static void
+fail_actions (RemoteDisplayDeviceAirplay *device,
+	      const GError               *error)
+{
+	RemoteDisplayDeviceAirplayAction *action;
+
+	while ((action = g_queue_pop_head (device->actions)) != NULL) {
+		remote_display_device_add_command_failure (REMOTE_DISPLAY_DEVICE (device));
+		action_complete (action, g_error_copy (error));
+	}
+}
+
 static void
 remote_display_device_airplay_finalize (GObject *object)
 {
@@ -97,12 +147,19 @@ remote_display_device_airplay_finalize (GObject *object)
 		g_cancellable_cancel (device->cancellable);
 		g_object_unref (device->cancellable);
 	}
+	/* Aborts the action in flight */
+	remote_display_airplay_clear_session (device);
 	if (device->actions)
 		g_queue_free_full (device->actions, (GDestroyNotify) action_free);
 
+	if (device->netif_changed_id != 0)
+		g_signal_handler_disconnect (device->netif, device->netif_changed_id);
+	g_clear_object (&device->netif);
+	g_clear_object (&device->host);
+	g_clear_object (&device->raop);
+
 	g_free (device->hostname);
 	g_free (device->password);
-	remote_display_airplay_clear_session (device);
 
 	G_OBJECT_CLASS (remote_display_device_airplay_parent_class)->finalize (object);
 }
@@ -131,18 +188,28 @@ remote_display_airplay_clear_session (RemoteDisplayDeviceAirplay *device)
 }
 
 static SoupMessage *
-remote_display_airplay_create_message (RemoteDisplayDeviceAirplay *device,
-				       const char          *method,
-				       const char          *path)
+remote_display_airplay_create_message (RemoteDisplayDeviceAirplay  *device,
+				       const char                  *method,
+				       const char                  *path,
+				       GError                     **error)
 {
+	const RemoteDisplayCandidate *candidate;
 	SoupMessage *msg;
-	char *uri;
+	char *uri, *host;
 	GTimeVal date;
 	char *date_str;
 
 	g_return_val_if_fail (*path == '/', NULL);
 
-	uri = g_strdup_printf ("http://%s:%d%s", device->hostname, device->port, path);
+	candidate = remote_display_device_get_best_candidate (REMOTE_DISPLAY_DEVICE (device));
+	if (!candidate) {
+		g_set_error_literal (error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_UNREACHABLE,
+				     "The device isn't on the network any more");
+		return NULL;
+	}
+	host = remote_display_candidate_to_uri_host (candidate);
+	uri = g_strdup_printf ("http://%s:%d%s", host, candidate->port, path);
+	g_free (host);
 	msg = soup_message_new (method, uri);
 	g_free (uri);
 	soup_message_headers_append (msg->request_headers, "X-Apple-Session-ID", device->session_id);
@@ -154,6 +221,15 @@ remote_display_airplay_create_message (RemoteDisplayDeviceAirplay *device,
 	return msg;
 }
 
+static char *
+get_trace_id (RemoteDisplayDeviceAirplay *device)
+{
+	char *id;
+
+	g_object_get (G_OBJECT (device), "id", &id, NULL);
+	return id;
+}
+
 static void
 server_cb (SoupServer *server,
 	   SoupMessage *msg,
@@ -189,6 +265,13 @@ server_cb (SoupServer *server,
 		return;
 	}
 	plist_get_string_val (p_state, &str);
+	REMOTE_DISPLAY_PROBE2 (event, device, str);
+
+	if (remote_display_trace_is_recording ()) {
+		char *id = get_trace_id (device);
+		remote_display_trace_record_event (id, str);
+		g_free (id);
+	}
 
 	if (g_strcmp0 (str, "loading") == 0)
 		state = REMOTE_DISPLAY_DEVICE_STATE_LOADING;
@@ -208,6 +291,7 @@ server_cb (SoupServer *server,
 	free (str);
 	plist_free (plist);
 
+	remote_display_device_mark_alive (REMOTE_DISPLAY_DEVICE (device));
 	g_signal_emit_by_name (G_OBJECT (device), "state-changed", state);
 	soup_message_set_status (msg, 200);
 }
@@ -220,48 +304,134 @@ action_cb (SoupSession *session,
 	   gpointer user_data)
 {
 	RemoteDisplayDeviceAirplay *device = user_data;
+	RemoteDisplayDeviceAirplayAction *action;
+	GError *error = NULL;
 	guint status;
 
-	g_object_get (G_OBJECT (msg), SOUP_MESSAGE_STATUS_CODE, &status, NULL);
-	if (status != 200) {
-		g_warning ("Call failed: %d", status);
+	/* Already failed if the device went away */
+	action = device->current;
+	if (!action)
 		return;
+	device->current = NULL;
+
+	g_object_get (G_OBJECT (msg), SOUP_MESSAGE_STATUS_CODE, &status, NULL);
+	REMOTE_DISPLAY_PROBE3 (action_complete, device, action_names[action->type], status);
+	if (remote_display_trace_is_recording ()) {
+		char *id = get_trace_id (device);
+		remote_display_trace_record_reply (id, status);
+		g_free (id);
+	}
+
+	if (status == SOUP_STATUS_CANCELLED) {
+		error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_CANCELLED,
+					     "Operation was cancelled");
+	} else if (SOUP_STATUS_IS_TRANSPORT_ERROR (status)) {
+		remote_display_device_mark_failed (REMOTE_DISPLAY_DEVICE (device));
+		error = g_error_new (REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_UNREACHABLE,
+				     "Failed to reach the device: %s", soup_status_get_phrase (status));
+	} else {
+		remote_display_device_mark_alive (REMOTE_DISPLAY_DEVICE (device));
+		if (status != 200)
+			error = g_error_new (REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_COMMAND_FAILED,
+					     "The device refused the command: %d %s",
+					     status, msg->reason_phrase);
 	}
 
+	if (error && !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+		remote_display_device_add_command_failure (REMOTE_DISPLAY_DEVICE (device));
+
+	/* The next ones might still work */
+	action_complete (action, error);
 	pop_action_queue (device);
 }
 
+static gboolean
+action_cancelled_cb (GCancellable *cancellable,
+		     gpointer      user_data)
+{
+	RemoteDisplayDeviceAirplay *device = user_data;
+	RemoteDisplayDeviceAirplayAction *action = device->current;
+
+	/* action_cb completes it */
+	soup_session_cancel_message (device->session, action->msg, SOUP_STATUS_CANCELLED);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Actions are sent one at a time, in order */
 static void
 pop_action_queue (RemoteDisplayDeviceAirplay *device)
 {
-	RemoteDisplayDeviceAirplayAction *action;
+	RemoteDisplayDeviceAirplayAction *action = NULL;
 	SoupMessage *msg;
+	GError *error = NULL;
+	char *params = NULL;
 
-	action = g_queue_pop_head (device->actions);
-	if (!action)
+	/* Still connecting, revhttp_cb will send the queue */
+	if (!device->session)
 		return;
 
+	while (!action) {
+		/* Completing a cancelled action might have sent another one */
+		if (device->current)
+			return;
+		action = g_queue_pop_head (device->actions);
+		if (!action)
+			return;
+		if (action->task && g_task_return_error_if_cancelled (action->task)) {
+			action_free (action);
+			action = NULL;
+		}
+	}
+
 	if (action->type == REMOTE_DISPLAY_DEVICE_ACTION_PLAY) {
-		char *params;
-		msg = remote_display_airplay_create_message (device, "POST", "/play");
+		msg = remote_display_airplay_create_message (device, "POST", "/play", &error);
 		params = g_strdup_printf ("Content-Location: %s\nStart-Position: %lf\n", action->uri, action->value);
-		soup_message_set_request (msg, "text/parameters", SOUP_MEMORY_TAKE, params, strlen(params));
 	} else if (action->type == REMOTE_DISPLAY_DEVICE_ACTION_SCRUB) {
 		char *path;
 		path = g_strdup_printf ("/scrub?position=%lf", action->value);
-		msg = remote_display_airplay_create_message (device, "POST", path);
+		msg = remote_display_airplay_create_message (device, "POST", path, &error);
 		g_free (path);
 	} else if (action->type == REMOTE_DISPLAY_DEVICE_ACTION_RATE) {
 		char *path;
 		path = g_strdup_printf ("/rate?value=%lf", action->value);
-		msg = remote_display_airplay_create_message (device, "POST", path);
+		msg = remote_display_airplay_create_message (device, "POST", path, &error);
 		g_free (path);
 	} else if (action->type == REMOTE_DISPLAY_DEVICE_ACTION_STOP) {
-		msg = remote_display_airplay_create_message (device, "POST", "/stop");
+		msg = remote_display_airplay_create_message (device, "POST", "/stop", &error);
 	} else {
 		g_assert_not_reached ();
 	}
 
+	if (!msg) {
+		g_free (params);
+		fail_actions (device, error);
+		remote_display_device_add_command_failure (REMOTE_DISPLAY_DEVICE (device));
+		action_complete (action, error);
+		return;
+	}
+	if (params)
+		soup_message_set_request (msg, "text/parameters", SOUP_MEMORY_COPY, params, strlen(params));
+
+	if (remote_display_trace_is_recording ()) {
+		char *id, *path;
+
+		id = get_trace_id (device);
+		path = soup_uri_to_string (soup_message_get_uri (msg), TRUE);
+		remote_display_trace_record_request (id, msg->method, path, params);
+		g_free (path);
+		g_free (id);
+	}
+	g_free (params);
+
+	REMOTE_DISPLAY_PROBE2 (action_send, device, action_names[action->type]);
+	action->msg = msg;
+	device->current = action;
+	if (action->task && g_task_get_cancellable (action->task)) {
+		action->cancel_source = g_cancellable_source_new (g_task_get_cancellable (action->task));
+		g_source_set_callback (action->cancel_source, (GSourceFunc) action_cancelled_cb, device, NULL);
+		g_source_attach (action->cancel_source, NULL);
+	}
 	soup_session_queue_message (device->session, msg, action_cb, device);
 }
 
@@ -272,7 +442,7 @@ revhttp_cb (GObject *object,
 {
 	RemoteDisplayDeviceAirplay *device = user_data;
 	SoupSession *session = SOUP_SESSION (object);
-	GError *error = NULL;
+	GError *error = NULL, *fail_error;
 	SoupServer *server;
 
 	server = soup_session_reverse_http_connect_finish (session, result, &error);
@@ -282,11 +452,17 @@ revhttp_cb (GObject *object,
 			return;
 		}
 		g_warning ("Reverse HTTP failed: %s", error->message);
-		g_error_free (error);
 		remote_display_airplay_clear_session (device);
+		remote_display_device_mark_failed (REMOTE_DISPLAY_DEVICE (device));
+		fail_error = g_error_new (REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_UNREACHABLE,
+					  "Failed to reach the device: %s", error->message);
+		fail_actions (device, fail_error);
+		g_error_free (fail_error);
+		g_error_free (error);
 		return;
 	}
 	g_debug ("Connected AirPlay reverse HTTP");
+	remote_display_device_mark_alive (REMOTE_DISPLAY_DEVICE (device));
 	device->server = server;
 	soup_server_add_handler (device->server, NULL, server_cb, device, NULL);
 
@@ -299,6 +475,141 @@ revhttp_cb (GObject *object,
 	//g_object_set (G_OBJECT (session), SOUP_SESSION_USER_AGENT, "Quicktime/7.2.0", NULL);
 }
 
+typedef struct {
+	SoupMessage *msg;
+	GSource *cancel_source;
+} PlaybackInfoRequest;
+
+static void
+playback_info_request_free (PlaybackInfoRequest *request)
+{
+	if (request->cancel_source) {
+		g_source_destroy (request->cancel_source);
+		g_source_unref (request->cancel_source);
+	}
+	g_free (request);
+}
+
+static gboolean
+playback_info_cancelled_cb (GCancellable *cancellable,
+			    gpointer      user_data)
+{
+	GTask *task = user_data;
+	RemoteDisplayDeviceAirplay *device = g_task_get_source_object (task);
+	PlaybackInfoRequest *request = g_task_get_task_data (task);
+
+	/* playback_info_cb completes it */
+	soup_session_cancel_message (device->session, request->msg, SOUP_STATUS_CANCELLED);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+playback_info_cb (SoupSession *session,
+		  SoupMessage *msg,
+		  gpointer     user_data)
+{
+	GTask *task = user_data;
+	PlaybackInfoRequest *request = g_task_get_task_data (task);
+	RemoteDisplayAirplayPlaybackInfo *info;
+	plist_t plist, item;
+	guint status;
+
+	/* The message is done with, whoever still holds the task */
+	if (request->cancel_source) {
+		g_source_destroy (request->cancel_source);
+		g_clear_pointer (&request->cancel_source, g_source_unref);
+	}
+
+	g_object_get (G_OBJECT (msg), SOUP_MESSAGE_STATUS_CODE, &status, NULL);
+	if (status != 200) {
+		g_task_return_new_error (task, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_INTERNAL_SERVER,
+					 "Failed to get playback info: %d", status);
+		g_object_unref (task);
+		return;
+	}
+
+	plist = NULL;
+	plist_from_xml (msg->response_body->data, msg->response_body->length, &plist);
+	if (!plist)
+		plist_from_bin (msg->response_body->data, msg->response_body->length, &plist);
+	if (!plist) {
+		g_task_return_new_error (task, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_PARSE,
+					 "Failed to parse playback info");
+		g_object_unref (task);
+		return;
+	}
+
+	/* Missing items mean nothing is loaded yet */
+	info = g_new0 (RemoteDisplayAirplayPlaybackInfo, 1);
+	item = plist_dict_get_item (plist, "position");
+	if (item)
+		plist_get_real_val (item, &info->position);
+	item = plist_dict_get_item (plist, "duration");
+	if (item)
+		plist_get_real_val (item, &info->duration);
+	item = plist_dict_get_item (plist, "rate");
+	if (item)
+		plist_get_real_val (item, &info->rate);
+	plist_free (plist);
+
+	g_task_return_pointer (task, info, g_free);
+	g_object_unref (task);
+}
+
+void
+remote_display_device_airplay_get_playback_info_async (RemoteDisplayDeviceAirplay *device,
+						       GCancellable               *cancellable,
+						       GAsyncReadyCallback         callback,
+						       gpointer                    user_data)
+{
+	PlaybackInfoRequest *request;
+	SoupMessage *msg;
+	GError *error = NULL;
+	GTask *task;
+
+	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE_AIRPLAY (device));
+
+	task = g_task_new (device, cancellable, callback, user_data);
+	if (!device->session) {
+		g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_CONNECTED,
+					 "Nothing is playing on the device");
+		g_object_unref (task);
+		return;
+	}
+
+	msg = remote_display_airplay_create_message (device, "GET", "/playback-info", &error);
+	if (!msg) {
+		g_task_return_error (task, error);
+		g_object_unref (task);
+		return;
+	}
+	request = g_new0 (PlaybackInfoRequest, 1);
+	request->msg = msg;
+	g_task_set_task_data (task, request, (GDestroyNotify) playback_info_request_free);
+	if (cancellable) {
+		request->cancel_source = g_cancellable_source_new (cancellable);
+		g_source_set_callback (request->cancel_source, (GSourceFunc) playback_info_cancelled_cb, task, NULL);
+		g_source_attach (request->cancel_source, NULL);
+	}
+	soup_session_queue_message (device->session, msg, playback_info_cb, task);
+}
+
+/**
+ * remote_display_device_airplay_get_playback_info_finish:
+ *
+ * Return value: (transfer full): the playback info, free with g_free()
+ **/
+RemoteDisplayAirplayPlaybackInfo *
+remote_display_device_airplay_get_playback_info_finish (RemoteDisplayDeviceAirplay  *device,
+							GAsyncResult                *result,
+							GError                     **error)
+{
+	g_return_val_if_fail (g_task_is_valid (result, device), NULL);
+
+	return g_task_propagate_pointer (G_TASK (result), error);
+}
+
 void
 remote_display_device_airplay_set_password (RemoteDisplayDeviceAirplay *device,
 					    const char                 *password)
@@ -309,117 +620,101 @@ remote_display_device_airplay_set_password (RemoteDisplayDeviceAirplay *device,
 	device->password = g_strdup (password);
 }
 
-static GSocketAddress *
-avahi_address_to_gsocket_address (const AvahiAddress *address,
-				  AvahiIfIndex        interface)
-{
-	/* Note that this zeroes out the port, as we don't know which
-	 * port the requests are going to be coming from */
-	switch (address->proto) {
-	case AVAHI_PROTO_INET: {
-		struct sockaddr_in sockaddr4;
-		sockaddr4.sin_family = AF_INET;
-		sockaddr4.sin_port = htons (0);
-		/* ->address is already in network byte order */
-		sockaddr4.sin_addr.s_addr = address->data.ipv4.address;
-		return g_socket_address_new_from_native (&sockaddr4, sizeof(struct sockaddr_in));
-		}
-		break;
-	case AVAHI_PROTO_INET6: {
-		struct sockaddr_in6 sockaddr6;
-		sockaddr6.sin6_family = AF_INET6;
-		sockaddr6.sin6_port = htons (0);
-		memcpy (sockaddr6.sin6_addr.s6_addr, address->data.ipv6.address, 16);
-		sockaddr6.sin6_flowinfo = 0;
-		sockaddr6.sin6_scope_id = interface;
-		return g_socket_address_new_from_native (&sockaddr6, sizeof(struct sockaddr_in6));
-		}
-		break;
-	default:
-		g_assert_not_reached ();
-	}
+const char *
+remote_display_device_airplay_get_hostname (RemoteDisplayDeviceAirplay *device)
+{
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_DEVICE_AIRPLAY (device), NULL);
+
+	return device->hostname;
 }
 
-static GInetAddress *
-avahi_address_to_address (const AvahiAddress *address,
-			  AvahiIfIndex        interface)
+/* AirPlay receivers also advertise a RAOP service for audio,
+ * which is folded into the AirPlay device rather than shown
+ * as a device of its own */
+void
+remote_display_device_airplay_set_raop (RemoteDisplayDeviceAirplay *device,
+					RemoteDisplayDevice        *raop)
 {
-	GSocketAddress *sock_addr;
-	GInetAddress *addr;
+	RemoteDisplayDeviceCapabilities caps;
 
-	sock_addr = avahi_address_to_gsocket_address (address, interface);
-	if (!sock_addr)
-		return NULL;
+	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE_AIRPLAY (device));
+	g_return_if_fail (raop == NULL || REMOTE_DISPLAY_IS_DEVICE_RAOP (raop));
 
-	addr = g_inet_socket_address_get_address (G_INET_SOCKET_ADDRESS (sock_addr));
-	g_object_ref (addr);
-	g_object_unref (sock_addr);
+	if (raop)
+		g_object_ref (raop);
+	g_clear_object (&device->raop);
+	device->raop = raop;
 
-	return addr;
+	caps = remote_display_device_get_capabilities (REMOTE_DISPLAY_DEVICE (device));
+	caps &= ~REMOTE_DISPLAY_DEVICE_CAPABILITIES_AUDIO;
+	if (raop)
+		caps |= remote_display_device_get_capabilities (raop) & REMOTE_DISPLAY_DEVICE_CAPABILITIES_AUDIO;
+	remote_display_device_set_capabilities (REMOTE_DISPLAY_DEVICE (device), caps);
 }
 
-static int
-avahi_protocol_to_family (AvahiProtocol protocol)
+RemoteDisplayDevice *
+remote_display_device_airplay_get_raop (RemoteDisplayDeviceAirplay *device)
 {
-	switch (protocol) {
-	case AVAHI_PROTO_INET:
-		return AF_INET;
-		break;
-	case AVAHI_PROTO_INET6:
-		return AF_INET6;
-		break;
-	default:
-		g_assert_not_reached ();
-	}
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_DEVICE_AIRPLAY (device), NULL);
+
+	return device->raop;
 }
 
-static GInetAddress *
-get_local_address (AvahiIfIndex  interface,
-		   AvahiProtocol protocol)
+static void
+local_address_changed_cb (RemoteDisplayNetif         *netif,
+			  guint                       ifindex,
+			  GSocketFamily               family,
+			  RemoteDisplayDeviceAirplay *device)
 {
-	GInetAddress *address = NULL;
-	struct ifaddrs *ifaddr, *ifa;
-	int n;
-	char ifname[IF_NAMESIZE];
+	GInetAddress *address;
 
-	if (!if_indextoname (interface, (char *) &ifname)) {
-		g_warning ("if_indextoname failed for %d", interface);
-		return NULL;
-	}
+	if (!device->host || ifindex != device->ifindex || family != device->family)
+		return;
 
-	if (getifaddrs (&ifaddr) == -1) {
-		g_warning ("getifaddrs failed");
-		return NULL;
-	}
+	/* Keep the old one until the interface gets a new address */
+	address = remote_display_netif_lookup (netif, ifindex, family);
+	if (!address)
+		return;
 
-	for (ifa = ifaddr, n = 0; ifa != NULL; ifa = ifa->ifa_next, n++) {
-		char host[NI_MAXHOST];
-		int family, s;
+	g_debug ("Local address for '%s' changed, rebinding",
+		 remote_display_device_get_name (REMOTE_DISPLAY_DEVICE (device)));
+	g_object_set (G_OBJECT (device->host), "local-address", address, NULL);
+	g_object_unref (address);
+}
 
-		if (ifa->ifa_addr == NULL)
-			continue;
-		if (g_strcmp0 (ifa->ifa_name, ifname) != 0)
-			continue;
-		family = ifa->ifa_addr->sa_family;
-		if (family != avahi_protocol_to_family (protocol))
-			continue;
+static RemoteDisplayDeviceCapabilities
+features_to_capabilities (guint features)
+{
+	RemoteDisplayDeviceCapabilities caps;
 
-		s = getnameinfo (ifa->ifa_addr,
-				 (family == AF_INET) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6),
-				 host, NI_MAXHOST,
-				 NULL, 0, NI_NUMERICHOST);
-		if (s != 0) {
-			g_warning ("Failed to get address from interface details");
-			continue;
-		}
+	caps = REMOTE_DISPLAY_DEVICE_CAPABILITIES_NONE;
+	if (features & AIRPLAY_VIDEO_SUPPORT)
+		caps |= REMOTE_DISPLAY_DEVICE_CAPABILITIES_VIDEO;
+	if (features & AIRPLAY_PHOTO_SUPPORT)
+		caps |= REMOTE_DISPLAY_DEVICE_CAPABILITIES_PHOTO;
+	if (features & AIRPLAY_VIDEO_SCREEN_SUPPORT)
+		caps |= REMOTE_DISPLAY_DEVICE_CAPABILITIES_SCREEN;
 
-		address = g_inet_address_new_from_string (host);
-		break;
-	}
+	return caps;
+}
+
+/* The capabilities a device would have, without creating it */
+RemoteDisplayDeviceCapabilities
+remote_display_device_airplay_get_txt_capabilities (AvahiStringList *txt)
+{
+	AvahiStringList *l;
+	guint features = 0x0;
+	char *value;
 
-	freeifaddrs (ifaddr);
+	l = avahi_string_list_find (txt, "features");
+	if (!l)
+		return REMOTE_DISPLAY_DEVICE_CAPABILITIES_NONE;
+	avahi_string_list_get_pair (l, NULL, &value, NULL);
+	if (value)
+		features = strtol (value, NULL, 16);
+	avahi_free (value);
 
-	return address;
+	return features_to_capabilities (features);
 }
 
 RemoteDisplayDevice *
@@ -438,14 +733,18 @@ remote_display_device_airplay_new (AvahiIfIndex        interface,
 	gboolean password_protected = FALSE;
 	RemoteDisplayDeviceCapabilities caps;
 	GInetAddress *remote_address, *local_address;
+	RemoteDisplayNetif *netif;
 
-	remote_address = avahi_address_to_address (address, interface);
+	remote_address = remote_display_avahi_address_to_address (address);
 	if (!remote_address) {
 		g_warning ("Couldn't get remote address");
 		return NULL;
 	}
-	local_address = get_local_address (interface, protocol);
+	netif = remote_display_netif_get ();
+	local_address = remote_display_netif_lookup (netif, interface,
+						     remote_display_avahi_protocol_to_family (protocol));
 	if (!local_address) {
+		g_object_unref (netif);
 		g_clear_object (&remote_address);
 		g_warning ("Couldn't get local address");
 		return NULL;
@@ -475,16 +774,14 @@ remote_display_device_airplay_new (AvahiIfIndex        interface,
 
 	if (!device_id || !features) {
 		g_debug ("Device '%s' is missing metadata, not adding", name);
+		g_free (device_id);
+		g_object_unref (remote_address);
+		g_object_unref (local_address);
+		g_object_unref (netif);
 		return NULL;
 	}
 
-	caps = REMOTE_DISPLAY_DEVICE_CAPABILITIES_NONE;
-	if (features & AIRPLAY_VIDEO_SUPPORT)
-		caps |= REMOTE_DISPLAY_DEVICE_CAPABILITIES_VIDEO;
-	if (features & AIRPLAY_PHOTO_SUPPORT)
-		caps |= REMOTE_DISPLAY_DEVICE_CAPABILITIES_PHOTO;
-	if (features & AIRPLAY_VIDEO_SCREEN_SUPPORT)
-		caps |= REMOTE_DISPLAY_DEVICE_CAPABILITIES_SCREEN;
+	caps = features_to_capabilities (features);
 
 	device = g_object_new (REMOTE_DISPLAY_TYPE_DEVICE_AIRPLAY, NULL);
 	remote_display_device_set_name (REMOTE_DISPLAY_DEVICE (device), name);
@@ -497,29 +794,161 @@ remote_display_device_airplay_new (AvahiIfIndex        interface,
 	device->hostname = g_strdup (host_name);
 	device->port = port;
 	device->features = features;
-	device->host = remote_display_host_new (remote_address, local_address);
-	g_clear_object (&remote_address);
+	device->netif = netif;
+	device->netif_changed_id = g_signal_connect (netif, "changed",
+						     G_CALLBACK (local_address_changed_cb), device);
 	g_clear_object (&local_address);
 
+	/* This sets up the host as well */
+	remote_display_device_add_candidate (REMOTE_DISPLAY_DEVICE (device), interface,
+					     remote_address, host_name, port);
+	g_clear_object (&remote_address);
+
 	return REMOTE_DISPLAY_DEVICE (device);
 }
 
+static void
+file_served_cb (RemoteDisplayHost          *host,
+		const char                 *uri,
+		RemoteDisplayDeviceAirplay *device)
+{
+	g_signal_emit_by_name (G_OBJECT (device), "media-served", uri);
+}
+
+/* Fails everything in progress, and forgets about the host and
+ * the session, when there's no way left to reach the device */
+static void
+remote_display_airplay_drop_session (RemoteDisplayDeviceAirplay *device)
+{
+	RemoteDisplayDeviceAirplayAction *action;
+	GError *error;
+
+	g_debug ("'%s' can't be reached any more",
+		 remote_display_device_get_name (REMOTE_DISPLAY_DEVICE (device)));
+
+	error = g_error_new_literal (REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_UNREACHABLE,
+				     "The device isn't on the network any more");
+	fail_actions (device, error);
+	/* action_cb ignores the message once it's aborted */
+	action = device->current;
+	device->current = NULL;
+	if (action) {
+		remote_display_device_add_command_failure (REMOTE_DISPLAY_DEVICE (device));
+		action_complete (action, g_error_copy (error));
+	}
+	g_error_free (error);
+
+	/* A new connection gets a new cancellable */
+	g_cancellable_cancel (device->cancellable);
+	g_object_unref (device->cancellable);
+	device->cancellable = g_cancellable_new ();
+	remote_display_airplay_clear_session (device);
+
+	g_clear_object (&device->host);
+}
+
+/* Called when the preferred way to reach the device changed, the
+ * local end of the host needs to be on the same interface. @device
+ * might not have any left */
+void
+remote_display_device_airplay_candidate_changed (RemoteDisplayDeviceAirplay *device)
+{
+	const RemoteDisplayCandidate *candidate;
+	GInetAddress *local_address;
+	GSocketFamily family;
+
+	candidate = remote_display_device_get_best_candidate (REMOTE_DISPLAY_DEVICE (device));
+	if (!candidate) {
+		remote_display_airplay_drop_session (device);
+		return;
+	}
+
+	family = g_inet_address_get_family (candidate->address);
+	local_address = remote_display_netif_lookup (device->netif, candidate->ifindex, family);
+	if (!local_address) {
+		g_debug ("No local address on interface %u, keeping the previous one",
+			 candidate->ifindex);
+		return;
+	}
+
+	device->ifindex = candidate->ifindex;
+	device->family = family;
+	if (!device->host) {
+		device->host = remote_display_host_new (candidate->address, local_address);
+		/* Receivers only play MP4s */
+		g_object_set (G_OBJECT (device->host), "remux", TRUE, NULL);
+		g_signal_connect_object (device->host, "file-served",
+					 G_CALLBACK (file_served_cb), device, 0);
+	} else {
+		g_object_set (G_OBJECT (device->host),
+			      "remote-address", candidate->address,
+			      "local-address", local_address,
+			      NULL);
+	}
+	g_object_unref (local_address);
+}
+
+static RemoteDisplayDeviceAirplayAction *
+new_action (RemoteDisplayDeviceAirplay    *device,
+	    RemoteDisplayDeviceActionType  type,
+	    GTask                         *task)
+{
+	RemoteDisplayDeviceAirplayAction *action;
+
+	/* There's nothing to control until something was opened, the
+	 * actions without a task are kept for when it is */
+	if (task && !device->session_id && type != REMOTE_DISPLAY_DEVICE_ACTION_PLAY) {
+		g_task_return_new_error (task, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_NOT_CONNECTED,
+					 "Nothing is playing on the device");
+		g_object_unref (task);
+		return NULL;
+	}
+
+	action = g_new0 (RemoteDisplayDeviceAirplayAction, 1);
+	action->type = type;
+	action->task = task;
+	REMOTE_DISPLAY_PROBE2 (action_enqueue, device, action_names[type]);
+
+	return action;
+}
+
 void
 remote_display_device_airplay_open_and_play (RemoteDisplayDeviceAirplay *device,
-					     const char          *uri,
-					     gdouble              orig_position)
+					     const char                 *uri,
+					     gdouble                     orig_position,
+					     GTask                      *task)
 {
 	RemoteDisplayDeviceCapabilities caps;
 	RemoteDisplayDeviceAirplayAction *action;
+	GError *error = NULL;
+	char *served_uri;
 
 	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE_AIRPLAY (device));
 
 	g_object_get (G_OBJECT (device), "capabilities", &caps, NULL);
 	g_return_if_fail (caps & REMOTE_DISPLAY_DEVICE_CAPABILITIES_VIDEO);
 
-	action = g_new0 (RemoteDisplayDeviceAirplayAction, 1);
-	action->type = REMOTE_DISPLAY_DEVICE_ACTION_PLAY;
-	action->uri = remote_display_host_file (device->host, uri, NULL);
+	/* The host is dropped along with the last way to reach the device */
+	if (device->host) {
+		served_uri = remote_display_host_file (device->host, uri, &error);
+	} else {
+		g_set_error_literal (&error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_UNREACHABLE,
+				     "The device isn't on the network any more");
+		served_uri = NULL;
+	}
+	if (!served_uri) {
+		if (task) {
+			g_task_return_error (task, error);
+			g_object_unref (task);
+		} else {
+			g_warning ("Failed to serve '%s': %s", uri, error->message);
+			g_error_free (error);
+		}
+		return;
+	}
+
+	action = new_action (device, REMOTE_DISPLAY_DEVICE_ACTION_PLAY, task);
+	action->uri = served_uri;
 	action->value = orig_position;
 
 	g_queue_push_tail (device->actions, action);
@@ -530,9 +959,16 @@ remote_display_device_airplay_open_and_play (RemoteDisplayDeviceAirplay *device,
 
 		device->session_id = g_uuid_string_random ();
 
+		msg = remote_display_airplay_create_message (device, "POST", "/reverse", &error);
+		if (!msg) {
+			g_clear_pointer (&device->session_id, g_free);
+			fail_actions (device, error);
+			g_error_free (error);
+			return;
+		}
+
 		session = soup_session_new ();
 		//FIXME set user-agent
-		msg = remote_display_airplay_create_message (device, "POST", "/reverse");
 		soup_message_headers_append (msg->request_headers, "X-Apple-Purpose", "event");
 
 		soup_session_reverse_http_connect_async (session, msg, device->cancellable, revhttp_cb, device);
@@ -545,7 +981,8 @@ remote_display_device_airplay_open_and_play (RemoteDisplayDeviceAirplay *device,
 
 static void
 remote_display_device_airplay_rate (RemoteDisplayDeviceAirplay *device,
-				    gfloat                      rate)
+				    gfloat                      rate,
+				    GTask                      *task)
 {
 	RemoteDisplayDeviceCapabilities caps;
 	RemoteDisplayDeviceAirplayAction *action;
@@ -555,8 +992,9 @@ remote_display_device_airplay_rate (RemoteDisplayDeviceAirplay *device,
 	g_object_get (G_OBJECT (device), "capabilities", &caps, NULL);
 	g_return_if_fail (caps & REMOTE_DISPLAY_DEVICE_CAPABILITIES_VIDEO);
 
-	action = g_new0 (RemoteDisplayDeviceAirplayAction, 1);
-	action->type = REMOTE_DISPLAY_DEVICE_ACTION_RATE;
+	action = new_action (device, REMOTE_DISPLAY_DEVICE_ACTION_RATE, task);
+	if (!action)
+		return;
 	action->value = rate;
 
 	g_queue_push_tail (device->actions, action);
@@ -564,19 +1002,22 @@ remote_display_device_airplay_rate (RemoteDisplayDeviceAirplay *device,
 }
 
 void
-remote_display_device_airplay_play (RemoteDisplayDeviceAirplay *device)
+remote_display_device_airplay_play (RemoteDisplayDeviceAirplay *device,
+				    GTask                      *task)
 {
-	remote_display_device_airplay_rate (device, 1.0);
+	remote_display_device_airplay_rate (device, 1.0, task);
 }
 
 void
-remote_display_device_airplay_pause (RemoteDisplayDeviceAirplay *device)
+remote_display_device_airplay_pause (RemoteDisplayDeviceAirplay *device,
+				     GTask                      *task)
 {
-	remote_display_device_airplay_rate (device, 0.0);
+	remote_display_device_airplay_rate (device, 0.0, task);
 }
 
 void
-remote_display_device_airplay_stop (RemoteDisplayDeviceAirplay *device)
+remote_display_device_airplay_stop (RemoteDisplayDeviceAirplay *device,
+				    GTask                      *task)
 {
 	RemoteDisplayDeviceCapabilities caps;
 	RemoteDisplayDeviceAirplayAction *action;
@@ -586,8 +1027,9 @@ remote_display_device_airplay_stop (RemoteDisplayDeviceAirplay *device)
 	g_object_get (G_OBJECT (device), "capabilities", &caps, NULL);
 	g_return_if_fail (caps & REMOTE_DISPLAY_DEVICE_CAPABILITIES_VIDEO);
 
-	action = g_new0 (RemoteDisplayDeviceAirplayAction, 1);
-	action->type = REMOTE_DISPLAY_DEVICE_ACTION_STOP;
+	action = new_action (device, REMOTE_DISPLAY_DEVICE_ACTION_STOP, task);
+	if (!action)
+		return;
 
 	g_queue_push_tail (device->actions, action);
 	pop_action_queue (device);
@@ -595,7 +1037,8 @@ remote_display_device_airplay_stop (RemoteDisplayDeviceAirplay *device)
 
 void
 remote_display_device_airplay_seek (RemoteDisplayDeviceAirplay *device,
-				    gdouble                     position_ms)
+				    gdouble                     position_ms,
+				    GTask                      *task)
 {
 	RemoteDisplayDeviceCapabilities caps;
 	RemoteDisplayDeviceAirplayAction *action;
@@ -605,8 +1048,9 @@ remote_display_device_airplay_seek (RemoteDisplayDeviceAirplay *device,
 	g_object_get (G_OBJECT (device), "capabilities", &caps, NULL);
 	g_return_if_fail (caps & REMOTE_DISPLAY_DEVICE_CAPABILITIES_VIDEO);
 
-	action = g_new0 (RemoteDisplayDeviceAirplayAction, 1);
-	action->type = REMOTE_DISPLAY_DEVICE_ACTION_SCRUB;
+	action = new_action (device, REMOTE_DISPLAY_DEVICE_ACTION_SCRUB, task);
+	if (!action)
+		return;
 	action->value = position_ms;
 
 	g_queue_push_tail (device->actions, action);
@@ -625,3 +1069,11 @@ remote_display_device_airplay_add_to_string (RemoteDisplayDeviceAirplay *device,
 
 	return g_string_free (s, FALSE);
 }
+
+guint
+remote_display_device_airplay_get_pending_actions (RemoteDisplayDeviceAirplay *device)
+{
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_DEVICE_AIRPLAY (device), 0);
+
+	return g_queue_get_length (device->actions) + (device->current ? 1 : 0);
+}
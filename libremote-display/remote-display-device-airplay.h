@@ -29,6 +29,13 @@ G_BEGIN_DECLS
 #define REMOTE_DISPLAY_TYPE_DEVICE_AIRPLAY remote_display_device_airplay_get_type ()
 G_DECLARE_FINAL_TYPE (RemoteDisplayDeviceAirplay, remote_display_device_airplay, REMOTE_DISPLAY, DEVICE_AIRPLAY, RemoteDisplayDevice)
 
+/* Positions and durations in seconds */
+typedef struct {
+	gdouble position;
+	gdouble duration;
+	gdouble rate;
+} RemoteDisplayAirplayPlaybackInfo;
+
 RemoteDisplayDevice *remote_display_device_airplay_new           (AvahiIfIndex                interface,
 								  AvahiProtocol               protocol,
 								  const char                 *name,
@@ -36,18 +43,41 @@ RemoteDisplayDevice *remote_display_device_airplay_new           (AvahiIfIndex
 								  const char                 *host_name,
 								  const AvahiAddress         *address,
 								  guint16                     port);
+RemoteDisplayDeviceCapabilities
+                     remote_display_device_airplay_get_txt_capabilities (AvahiStringList *txt);
 char                *remote_display_device_airplay_add_to_string (RemoteDisplayDeviceAirplay *device,
 								  GString                    *s);
+/* The tasks are completed once the device accepted the command,
+ * they can be %NULL if nobody is waiting for that */
 void                 remote_display_device_airplay_open_and_play (RemoteDisplayDeviceAirplay *device,
 								  const char                 *uri,
-								  gdouble                     orig_position);
-void                 remote_display_device_airplay_play          (RemoteDisplayDeviceAirplay *device);
-void                 remote_display_device_airplay_pause         (RemoteDisplayDeviceAirplay *device);
-void                 remote_display_device_airplay_stop          (RemoteDisplayDeviceAirplay *device);
+								  gdouble                     orig_position,
+								  GTask                      *task);
+void                 remote_display_device_airplay_play          (RemoteDisplayDeviceAirplay *device,
+								  GTask                      *task);
+void                 remote_display_device_airplay_pause         (RemoteDisplayDeviceAirplay *device,
+								  GTask                      *task);
+void                 remote_display_device_airplay_stop          (RemoteDisplayDeviceAirplay *device,
+								  GTask                      *task);
 void                 remote_display_device_airplay_seek          (RemoteDisplayDeviceAirplay *device,
-								  gdouble                     position_ms);
+								  gdouble                     position_ms,
+								  GTask                      *task);
 void                 remote_display_device_airplay_set_password  (RemoteDisplayDeviceAirplay *device,
 								  const char                 *password);
+const char          *remote_display_device_airplay_get_hostname  (RemoteDisplayDeviceAirplay *device);
+void                 remote_display_device_airplay_set_raop      (RemoteDisplayDeviceAirplay *device,
+								  RemoteDisplayDevice        *raop);
+RemoteDisplayDevice *remote_display_device_airplay_get_raop      (RemoteDisplayDeviceAirplay *device);
+void                 remote_display_device_airplay_candidate_changed (RemoteDisplayDeviceAirplay *device);
+guint                remote_display_device_airplay_get_pending_actions (RemoteDisplayDeviceAirplay *device);
+void                 remote_display_device_airplay_get_playback_info_async  (RemoteDisplayDeviceAirplay   *device,
+									     GCancellable                 *cancellable,
+									     GAsyncReadyCallback           callback,
+									     gpointer                      user_data);
+RemoteDisplayAirplayPlaybackInfo *
+                     remote_display_device_airplay_get_playback_info_finish (RemoteDisplayDeviceAirplay   *device,
+									     GAsyncResult                 *result,
+									     GError                      **error);
 
 G_END_DECLS
 
@@ -0,0 +1,1171 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <gio/gio.h>
+#include <libsoup/soup.h>
+
+#include <libremote-display/remote-display-device.h>
+#include <libremote-display/remote-display-device-private.h>
+#include <libremote-display/remote-display-device-dlna.h>
+#include <libremote-display/remote-display-host.h>
+#include <libremote-display/remote-display-error.h>
+#include <libremote-display/remote-display-probes.h>
+
+#define AVTRANSPORT_TYPE       "urn:schemas-upnp-org:service:AVTransport:"
+#define RENDERING_CONTROL_TYPE "urn:schemas-upnp-org:service:RenderingControl:"
+#define DESCRIPTION_MAX_AGE    (30 * 60)       /* seconds */
+#define SUBSCRIPTION_TIMEOUT   1800            /* seconds */
+
+/* What we use from a device description, shared between
+ * the devices created from the same location */
+typedef struct {
+	gint ref_count;
+	gint64 fetched;
+
+	char *name;
+	char *udn;
+	char *model;
+	char *avtransport_type;
+	char *avtransport_control;
+	char *avtransport_event;
+	char *rendering_control_type;
+	char *rendering_control;
+} DlnaDescription;
+
+struct _RemoteDisplayDlnaContext {
+	gint ref_count;
+	SoupSession *session;
+	/* key = location, value = DlnaDescription */
+	GHashTable *descriptions;
+};
+
+struct _RemoteDisplayDeviceDlna {
+	RemoteDisplayDevice parent_instance;
+
+	RemoteDisplayDlnaContext *context;
+	char *location;
+	DlnaDescription *desc;
+	RemoteDisplayHost *host;
+	RemoteDisplayDeviceState state;
+	guint pending_actions;
+
+	/* GENA subscription to AVTransport */
+	char *callback_uri;
+	char *sid;
+	gboolean subscribing;
+	guint renew_id;
+};
+
+G_DEFINE_TYPE (RemoteDisplayDeviceDlna, remote_display_device_dlna, REMOTE_DISPLAY_TYPE_DEVICE);
+
+static void ensure_subscribed (RemoteDisplayDeviceDlna *device);
+
+static DlnaDescription *
+description_ref (DlnaDescription *desc)
+{
+	desc->ref_count++;
+	return desc;
+}
+
+static void
+description_unref (DlnaDescription *desc)
+{
+	if (--desc->ref_count > 0)
+		return;
+
+	g_free (desc->name);
+	g_free (desc->udn);
+	g_free (desc->model);
+	g_free (desc->avtransport_type);
+	g_free (desc->avtransport_control);
+	g_free (desc->avtransport_event);
+	g_free (desc->rendering_control_type);
+	g_free (desc->rendering_control);
+	g_free (desc);
+}
+
+/**
+ * remote_display_dlna_context_new:
+ *
+ * Creates what the renderers found by one manager share. All their
+ * requests go through one session, and one persistent connection
+ * per renderer. Actions are queued back-to-back without waiting
+ * for the application, and stay in order.
+ *
+ * Return value: (transfer full): a new #RemoteDisplayDlnaContext
+ **/
+RemoteDisplayDlnaContext *
+remote_display_dlna_context_new (void)
+{
+	RemoteDisplayDlnaContext *context;
+
+	context = g_new0 (RemoteDisplayDlnaContext, 1);
+	context->ref_count = 1;
+	context->session = soup_session_new_with_options (SOUP_SESSION_MAX_CONNS_PER_HOST, 1,
+							  NULL);
+	context->descriptions = g_hash_table_new_full (g_str_hash, g_str_equal,
+						       g_free, (GDestroyNotify) description_unref);
+
+	return context;
+}
+
+RemoteDisplayDlnaContext *
+remote_display_dlna_context_ref (RemoteDisplayDlnaContext *context)
+{
+	context->ref_count++;
+	return context;
+}
+
+void
+remote_display_dlna_context_unref (RemoteDisplayDlnaContext *context)
+{
+	if (--context->ref_count > 0)
+		return;
+
+	g_object_unref (context->session);
+	g_hash_table_destroy (context->descriptions);
+	g_free (context);
+}
+
+static const char *
+local_name (const char *element_name)
+{
+	const char *colon;
+
+	colon = strrchr (element_name, ':');
+	return colon ? colon + 1 : element_name;
+}
+
+typedef struct {
+	DlnaDescription *desc;
+	GString *text;
+	char *base;
+	guint device_depth;
+
+	gboolean in_service;
+	char *service_type;
+	char *control_url;
+	char *event_url;
+} DescriptionParser;
+
+static void
+description_start_element (GMarkupParseContext  *context,
+			   const char           *element_name,
+			   const char          **attribute_names,
+			   const char          **attribute_values,
+			   gpointer              user_data,
+			   GError              **error)
+{
+	DescriptionParser *parser = user_data;
+	const char *name = local_name (element_name);
+
+	if (g_str_equal (name, "device")) {
+		parser->device_depth++;
+	} else if (g_str_equal (name, "service")) {
+		parser->in_service = TRUE;
+		g_clear_pointer (&parser->service_type, g_free);
+		g_clear_pointer (&parser->control_url, g_free);
+		g_clear_pointer (&parser->event_url, g_free);
+	}
+	g_string_truncate (parser->text, 0);
+}
+
+static void
+description_text (GMarkupParseContext  *context,
+		  const char           *text,
+		  gsize                 text_len,
+		  gpointer              user_data,
+		  GError              **error)
+{
+	DescriptionParser *parser = user_data;
+
+	g_string_append_len (parser->text, text, text_len);
+}
+
+static void
+set_once (char       **field,
+	  const char  *value)
+{
+	if (*field == NULL && *value != '\0')
+		*field = g_strdup (value);
+}
+
+static void
+description_end_element (GMarkupParseContext  *context,
+			 const char           *element_name,
+			 gpointer              user_data,
+			 GError              **error)
+{
+	DescriptionParser *parser = user_data;
+	DlnaDescription *desc = parser->desc;
+	const char *name = local_name (element_name);
+	char *text;
+
+	text = g_strstrip (g_strdup (parser->text->str));
+	g_string_truncate (parser->text, 0);
+
+	if (g_str_equal (name, "device")) {
+		parser->device_depth--;
+	} else if (g_str_equal (name, "URLBase")) {
+		set_once (&parser->base, text);
+	} else if (parser->in_service) {
+		if (g_str_equal (name, "serviceType"))
+			set_once (&parser->service_type, text);
+		else if (g_str_equal (name, "controlURL"))
+			set_once (&parser->control_url, text);
+		else if (g_str_equal (name, "eventSubURL"))
+			set_once (&parser->event_url, text);
+		else if (g_str_equal (name, "service")) {
+			/* Services can be in embedded devices as well, and
+			 * broken descriptions can miss the type */
+			if (parser->service_type &&
+			    g_str_has_prefix (parser->service_type, AVTRANSPORT_TYPE) &&
+			    !desc->avtransport_control && parser->control_url) {
+				desc->avtransport_type = g_strdup (parser->service_type);
+				desc->avtransport_control = g_strdup (parser->control_url);
+				desc->avtransport_event = g_strdup (parser->event_url);
+			} else if (parser->service_type &&
+				   g_str_has_prefix (parser->service_type, RENDERING_CONTROL_TYPE) &&
+				   !desc->rendering_control && parser->control_url) {
+				desc->rendering_control_type = g_strdup (parser->service_type);
+				desc->rendering_control = g_strdup (parser->control_url);
+			}
+			parser->in_service = FALSE;
+		}
+	} else if (parser->device_depth == 1) {
+		/* The root device's */
+		if (g_str_equal (name, "friendlyName"))
+			set_once (&desc->name, text);
+		else if (g_str_equal (name, "UDN"))
+			set_once (&desc->udn, text);
+		else if (g_str_equal (name, "modelName"))
+			set_once (&desc->model, text);
+	}
+
+	g_free (text);
+}
+
+static char *
+resolve_url (SoupURI    *base,
+	     const char *url)
+{
+	SoupURI *uri;
+	char *ret;
+
+	if (!url)
+		return NULL;
+	uri = soup_uri_new_with_base (base, url);
+	if (!uri)
+		return NULL;
+	ret = soup_uri_to_string (uri, FALSE);
+	soup_uri_free (uri);
+
+	return ret;
+}
+
+static void
+resolve_in_place (SoupURI  *base,
+		  char    **url)
+{
+	char *resolved;
+
+	resolved = resolve_url (base, *url);
+	g_free (*url);
+	*url = resolved;
+}
+
+static DlnaDescription *
+parse_description (const char  *location,
+		   const char  *data,
+		   gsize        len,
+		   GError     **error)
+{
+	const GMarkupParser markup_parser = {
+		description_start_element,
+		description_end_element,
+		description_text,
+		NULL,
+		NULL
+	};
+	GMarkupParseContext *context;
+	DescriptionParser parser;
+	SoupURI *base;
+	gboolean ret;
+
+	memset (&parser, 0, sizeof(parser));
+	parser.desc = g_new0 (DlnaDescription, 1);
+	parser.desc->ref_count = 1;
+	parser.text = g_string_new (NULL);
+
+	context = g_markup_parse_context_new (&markup_parser, 0, &parser, NULL);
+	ret = g_markup_parse_context_parse (context, data, len, error) &&
+		g_markup_parse_context_end_parse (context, error);
+	g_markup_parse_context_free (context);
+
+	g_string_free (parser.text, TRUE);
+	g_free (parser.service_type);
+	g_free (parser.control_url);
+	g_free (parser.event_url);
+
+	if (ret && (!parser.desc->udn || !parser.desc->avtransport_control)) {
+		g_set_error (error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_NOT_SUPPORTED,
+			     "Device at %s is not a media renderer", location);
+		ret = FALSE;
+	}
+	if (!ret) {
+		g_free (parser.base);
+		description_unref (parser.desc);
+		return NULL;
+	}
+
+	/* URLBase is deprecated, but still around */
+	base = soup_uri_new (parser.base ? parser.base : location);
+	g_free (parser.base);
+	resolve_in_place (base, &parser.desc->avtransport_control);
+	resolve_in_place (base, &parser.desc->avtransport_event);
+	resolve_in_place (base, &parser.desc->rendering_control);
+	soup_uri_free (base);
+
+	if (!parser.desc->name)
+		parser.desc->name = g_strdup (parser.desc->model ? parser.desc->model : parser.desc->udn);
+	parser.desc->fetched = g_get_monotonic_time ();
+
+	return parser.desc;
+}
+
+/* Finds the first element named @element, and gets the value
+ * of @attribute, or its text if @attribute is %NULL */
+typedef struct {
+	const char *element;
+	const char *attribute;
+	gboolean inside;
+	GString *text;
+	char *value;
+} FindContext;
+
+static void
+find_start_element (GMarkupParseContext  *context,
+		    const char           *element_name,
+		    const char          **attribute_names,
+		    const char          **attribute_values,
+		    gpointer              user_data,
+		    GError              **error)
+{
+	FindContext *find = user_data;
+	guint i;
+
+	if (find->value || !g_str_equal (local_name (element_name), find->element))
+		return;
+
+	if (!find->attribute) {
+		find->inside = TRUE;
+		return;
+	}
+
+	for (i = 0; attribute_names[i]; i++) {
+		if (g_str_equal (attribute_names[i], find->attribute)) {
+			find->value = g_strdup (attribute_values[i]);
+			break;
+		}
+	}
+}
+
+static void
+find_end_element (GMarkupParseContext  *context,
+		  const char           *element_name,
+		  gpointer              user_data,
+		  GError              **error)
+{
+	FindContext *find = user_data;
+
+	if (!find->inside)
+		return;
+	find->inside = FALSE;
+	find->value = g_strdup (find->text->str);
+}
+
+static void
+find_text (GMarkupParseContext  *context,
+	   const char           *text,
+	   gsize                 text_len,
+	   gpointer              user_data,
+	   GError              **error)
+{
+	FindContext *find = user_data;
+
+	if (find->inside)
+		g_string_append_len (find->text, text, text_len);
+}
+
+static char *
+find_in_xml (const char *data,
+	     gssize      len,
+	     const char *element,
+	     const char *attribute)
+{
+	const GMarkupParser markup_parser = {
+		find_start_element,
+		find_end_element,
+		find_text,
+		NULL,
+		NULL
+	};
+	GMarkupParseContext *context;
+	FindContext find;
+
+	memset (&find, 0, sizeof(find));
+	find.element = element;
+	find.attribute = attribute;
+	find.text = g_string_new (NULL);
+
+	context = g_markup_parse_context_new (&markup_parser, 0, &find, NULL);
+	if (!g_markup_parse_context_parse (context, data, len, NULL) ||
+	    !g_markup_parse_context_end_parse (context, NULL))
+		g_clear_pointer (&find.value, g_free);
+	g_markup_parse_context_free (context);
+	g_string_free (find.text, TRUE);
+
+	return find.value;
+}
+
+static void
+unsubscribe_cb (SoupSession *session,
+		SoupMessage *msg,
+		gpointer     user_data)
+{
+	g_object_unref (user_data);
+}
+
+static void
+remote_display_device_dlna_finalize (GObject *object)
+{
+	RemoteDisplayDeviceDlna *device = REMOTE_DISPLAY_DEVICE_DLNA (object);
+
+	if (device->renew_id != 0)
+		g_source_remove (device->renew_id);
+
+	/* The session is kept until this went out */
+	if (device->sid) {
+		SoupMessage *msg;
+
+		msg = soup_message_new ("UNSUBSCRIBE", device->desc->avtransport_event);
+		soup_message_headers_append (msg->request_headers, "SID", device->sid);
+		soup_session_queue_message (device->context->session, msg, unsubscribe_cb,
+					    g_object_ref (device->context->session));
+	}
+
+	g_clear_object (&device->host);
+	g_clear_pointer (&device->desc, description_unref);
+	g_clear_pointer (&device->context, remote_display_dlna_context_unref);
+	g_free (device->location);
+	g_free (device->callback_uri);
+	g_free (device->sid);
+
+	G_OBJECT_CLASS (remote_display_device_dlna_parent_class)->finalize (object);
+}
+
+static void
+remote_display_device_dlna_class_init (RemoteDisplayDeviceDlnaClass *klass)
+{
+	GObjectClass *o_class = (GObjectClass *)klass;
+
+	o_class->finalize = remote_display_device_dlna_finalize;
+}
+
+static void
+remote_display_device_dlna_init (RemoteDisplayDeviceDlna *device)
+{
+	device->state = REMOTE_DISPLAY_DEVICE_STATE_STOPPED;
+}
+
+/* The local address the renderer can reach us at, found by
+ * connecting a UDP socket, which doesn't send anything */
+static GInetAddress *
+get_local_address (GInetAddress  *remote_address,
+		   GError       **error)
+{
+	GSocketAddress *remote, *local;
+	GInetAddress *ret = NULL;
+	GSocket *socket;
+
+	socket = g_socket_new (g_inet_address_get_family (remote_address),
+			       G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_UDP, error);
+	if (!socket)
+		return NULL;
+
+	remote = g_inet_socket_address_new (remote_address, 9);
+	if (g_socket_connect (socket, remote, NULL, error)) {
+		local = g_socket_get_local_address (socket, error);
+		if (local) {
+			ret = g_object_ref (g_inet_socket_address_get_address (G_INET_SOCKET_ADDRESS (local)));
+			g_object_unref (local);
+		}
+	}
+	g_object_unref (remote);
+	g_object_unref (socket);
+
+	return ret;
+}
+
+static void
+file_served_cb (RemoteDisplayHost       *host,
+		const char              *uri,
+		RemoteDisplayDeviceDlna *device)
+{
+	g_signal_emit_by_name (G_OBJECT (device), "media-served", uri);
+}
+
+static RemoteDisplayDevice *
+device_new (RemoteDisplayDlnaContext  *context,
+	    const char                *location,
+	    DlnaDescription           *desc,
+	    GError                   **error)
+{
+	RemoteDisplayDeviceDlna *device;
+	GInetAddress *remote_address, *local_address;
+	SoupURI *uri;
+
+	uri = soup_uri_new (location);
+	remote_address = g_inet_address_new_from_string (soup_uri_get_host (uri));
+	if (!remote_address) {
+		g_set_error (error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_NOT_SUPPORTED,
+			     "Device description at %s isn't on an IP address", location);
+		soup_uri_free (uri);
+		return NULL;
+	}
+
+	local_address = get_local_address (remote_address, error);
+	if (!local_address) {
+		g_object_unref (remote_address);
+		soup_uri_free (uri);
+		return NULL;
+	}
+
+	device = g_object_new (REMOTE_DISPLAY_TYPE_DEVICE_DLNA, NULL);
+	remote_display_device_set_name (REMOTE_DISPLAY_DEVICE (device), desc->name);
+	remote_display_device_set_id (REMOTE_DISPLAY_DEVICE (device), desc->udn);
+	remote_display_device_set_capabilities (REMOTE_DISPLAY_DEVICE (device),
+						REMOTE_DISPLAY_DEVICE_CAPABILITIES_VIDEO);
+	remote_display_device_add_candidate (REMOTE_DISPLAY_DEVICE (device), 0, remote_address,
+					     soup_uri_get_host (uri), soup_uri_get_port (uri));
+
+	device->context = remote_display_dlna_context_ref (context);
+	device->location = g_strdup (location);
+	device->desc = description_ref (desc);
+	device->host = remote_display_host_new (remote_address, local_address);
+	g_signal_connect_object (device->host, "file-served",
+				 G_CALLBACK (file_served_cb), device, 0);
+
+	g_object_unref (remote_address);
+	g_object_unref (local_address);
+	soup_uri_free (uri);
+
+	return REMOTE_DISPLAY_DEVICE (device);
+}
+
+typedef struct {
+	RemoteDisplayDlnaContext *context;
+	char *location;
+} DescriptionFetch;
+
+static void
+description_fetch_free (DescriptionFetch *fetch)
+{
+	remote_display_dlna_context_unref (fetch->context);
+	g_free (fetch->location);
+	g_free (fetch);
+}
+
+static void
+description_cb (SoupSession *session,
+		SoupMessage *msg,
+		gpointer     user_data)
+{
+	GTask *task = user_data;
+	DescriptionFetch *fetch = g_task_get_task_data (task);
+	const char *location = fetch->location;
+	RemoteDisplayDevice *device;
+	DlnaDescription *desc;
+	GError *error = NULL;
+
+	if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code)) {
+		g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+					 "Failed to fetch device description from %s: %d",
+					 location, msg->status_code);
+		g_object_unref (task);
+		return;
+	}
+
+	desc = parse_description (location, msg->response_body->data,
+				  msg->response_body->length, &error);
+	if (!desc) {
+		g_task_return_error (task, error);
+		g_object_unref (task);
+		return;
+	}
+
+	g_hash_table_insert (fetch->context->descriptions, g_strdup (location), description_ref (desc));
+
+	device = device_new (fetch->context, location, desc, &error);
+	description_unref (desc);
+	if (device)
+		g_task_return_pointer (task, device, g_object_unref);
+	else
+		g_task_return_error (task, error);
+	g_object_unref (task);
+}
+
+/**
+ * remote_display_device_dlna_new_async:
+ * @context: the #RemoteDisplayDlnaContext the device will use
+ * @location: the URL of the device description, from SSDP
+ * @cancellable: a #GCancellable
+ * @callback: called when the device is ready
+ * @user_data: data for @callback
+ *
+ * Fetches the description of a media renderer, and creates a
+ * device for it. Descriptions are cached for a while, so that
+ * renderers announcing themselves again don't get fetched again.
+ **/
+void
+remote_display_device_dlna_new_async (RemoteDisplayDlnaContext *context,
+				      const char               *location,
+				      GCancellable             *cancellable,
+				      GAsyncReadyCallback       callback,
+				      gpointer                  user_data)
+{
+	DescriptionFetch *fetch;
+	DlnaDescription *desc;
+	SoupMessage *msg;
+	GTask *task;
+
+	g_return_if_fail (context != NULL);
+	g_return_if_fail (location != NULL);
+
+	task = g_task_new (NULL, cancellable, callback, user_data);
+	fetch = g_new0 (DescriptionFetch, 1);
+	fetch->context = remote_display_dlna_context_ref (context);
+	fetch->location = g_strdup (location);
+	g_task_set_task_data (task, fetch, (GDestroyNotify) description_fetch_free);
+
+	desc = g_hash_table_lookup (context->descriptions, location);
+	if (desc &&
+	    g_get_monotonic_time () - desc->fetched < (gint64) DESCRIPTION_MAX_AGE * G_USEC_PER_SEC) {
+		RemoteDisplayDevice *device;
+		GError *error = NULL;
+
+		device = device_new (context, location, desc, &error);
+		if (device)
+			g_task_return_pointer (task, device, g_object_unref);
+		else
+			g_task_return_error (task, error);
+		g_object_unref (task);
+		return;
+	}
+
+	msg = soup_message_new ("GET", location);
+	if (!msg) {
+		g_task_return_new_error (task, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_INVALID_ARGUMENTS,
+					 "Invalid device description location '%s'", location);
+		g_object_unref (task);
+		return;
+	}
+	soup_session_queue_message (context->session, msg, description_cb, task);
+}
+
+RemoteDisplayDevice *
+remote_display_device_dlna_new_finish (GAsyncResult  *result,
+				       GError       **error)
+{
+	g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+
+	return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+typedef struct {
+	RemoteDisplayDeviceDlna *device;
+	const char *action;
+	GTask *task;               /* NULL if nobody is waiting for it */
+	SoupMessage *msg;
+	GSource *cancel_source;
+} DlnaAction;
+
+static void
+action_cb (SoupSession *session,
+	   SoupMessage *msg,
+	   gpointer     user_data)
+{
+	DlnaAction *data = user_data;
+	RemoteDisplayDeviceDlna *device = data->device;
+	GError *error = NULL;
+
+	REMOTE_DISPLAY_PROBE3 (action_complete, device, data->action, msg->status_code);
+	if (msg->status_code == SOUP_STATUS_CANCELLED) {
+		error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_CANCELLED,
+					     "Operation was cancelled");
+	} else if (SOUP_STATUS_IS_TRANSPORT_ERROR (msg->status_code)) {
+		remote_display_device_mark_failed (REMOTE_DISPLAY_DEVICE (device));
+		error = g_error_new (REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_UNREACHABLE,
+				     "Failed to reach the device: %s",
+				     soup_status_get_phrase (msg->status_code));
+	} else {
+		remote_display_device_mark_alive (REMOTE_DISPLAY_DEVICE (device));
+		if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code)) {
+			char *code;
+
+			code = find_in_xml (msg->response_body->data, msg->response_body->length,
+					    "errorCode", NULL);
+			error = g_error_new (REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_COMMAND_FAILED,
+					     "Call %s to '%s' failed: %d (UPnP error %s)",
+					     soup_message_headers_get_one (msg->request_headers, "SOAPAction"),
+					     remote_display_device_get_name (REMOTE_DISPLAY_DEVICE (device)),
+					     msg->status_code, code ? code : "unknown");
+			g_free (code);
+		}
+	}
+
+	device->pending_actions--;
+	if (error && !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+		remote_display_device_add_command_failure (REMOTE_DISPLAY_DEVICE (device));
+
+	if (data->task && error)
+		g_task_return_error (data->task, error);
+	else if (data->task)
+		g_task_return_boolean (data->task, TRUE);
+	else if (error) {
+		g_debug ("%s", error->message);
+		g_error_free (error);
+	}
+
+	if (data->cancel_source) {
+		g_source_destroy (data->cancel_source);
+		g_source_unref (data->cancel_source);
+	}
+	g_clear_object (&data->task);
+	g_object_unref (device);
+	g_free (data);
+}
+
+static gboolean
+action_cancelled_cb (GCancellable *cancellable,
+		     gpointer      user_data)
+{
+	DlnaAction *data = user_data;
+
+	/* action_cb completes it */
+	soup_session_cancel_message (data->device->context->session, data->msg, SOUP_STATUS_CANCELLED);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Arguments are name and value pairs, ended by %NULL. The task,
+ * if any, is completed once the device accepted the command. */
+static void
+send_action (RemoteDisplayDeviceDlna *device,
+	     GTask                   *task,
+	     const char              *control_url,
+	     const char              *service_type,
+	     const char              *action,
+	     ...)
+{
+	DlnaAction *data;
+	SoupMessage *msg;
+	GString *body;
+	const char *name;
+	char *soap_action;
+	va_list args;
+
+	body = g_string_new ("<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+			     "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+			     "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+			     "<s:Body>");
+	g_string_append_printf (body, "<u:%s xmlns:u=\"%s\"><InstanceID>0</InstanceID>",
+				action, service_type);
+	va_start (args, action);
+	while ((name = va_arg (args, const char *)) != NULL) {
+		char *value;
+
+		value = g_markup_escape_text (va_arg (args, const char *), -1);
+		g_string_append_printf (body, "<%s>%s</%s>", name, value, name);
+		g_free (value);
+	}
+	va_end (args);
+	g_string_append_printf (body, "</u:%s></s:Body></s:Envelope>", action);
+
+	msg = soup_message_new ("POST", control_url);
+	soap_action = g_strdup_printf ("\"%s#%s\"", service_type, action);
+	soup_message_headers_append (msg->request_headers, "SOAPAction", soap_action);
+	g_free (soap_action);
+	soup_message_set_request (msg, "text/xml; charset=\"utf-8\"", SOUP_MEMORY_TAKE,
+				  body->str, body->len);
+	g_string_free (body, FALSE);
+
+	data = g_new0 (DlnaAction, 1);
+	data->device = g_object_ref (device);
+	data->action = action;
+	data->task = task;
+	data->msg = msg;
+	if (task && g_task_get_cancellable (task)) {
+		data->cancel_source = g_cancellable_source_new (g_task_get_cancellable (task));
+		g_source_set_callback (data->cancel_source, (GSourceFunc) action_cancelled_cb, data, NULL);
+		g_source_attach (data->cancel_source, NULL);
+	}
+	REMOTE_DISPLAY_PROBE2 (action_send, device, action);
+	device->pending_actions++;
+	soup_session_queue_message (device->context->session, msg, action_cb, data);
+}
+
+static void
+set_state (RemoteDisplayDeviceDlna  *device,
+	   RemoteDisplayDeviceState  state)
+{
+	if (device->state == state)
+		return;
+	device->state = state;
+	g_signal_emit_by_name (G_OBJECT (device), "state-changed", state);
+}
+
+static void
+event_cb (SoupServer        *server,
+	  SoupMessage       *msg,
+	  const char        *path,
+	  GHashTable        *query,
+	  SoupClientContext *client,
+	  gpointer           user_data)
+{
+	RemoteDisplayDeviceDlna *device = user_data;
+	const char *sid;
+	char *last_change, *transport_state;
+
+	if (g_strcmp0 (msg->method, "NOTIFY") != 0) {
+		soup_message_set_status (msg, SOUP_STATUS_METHOD_NOT_ALLOWED);
+		return;
+	}
+
+	/* The first event can arrive before the reply to SUBSCRIBE */
+	sid = soup_message_headers_get_one (msg->request_headers, "SID");
+	if (!sid || (device->sid ? g_strcmp0 (sid, device->sid) != 0 : !device->subscribing)) {
+		soup_message_set_status (msg, SOUP_STATUS_PRECONDITION_FAILED);
+		return;
+	}
+	soup_message_set_status (msg, SOUP_STATUS_OK);
+
+	/* LastChange is an escaped XML document of its own */
+	last_change = find_in_xml (msg->request_body->data, msg->request_body->length,
+				   "LastChange", NULL);
+	if (!last_change)
+		return;
+	transport_state = find_in_xml (last_change, -1, "TransportState", "val");
+	g_free (last_change);
+	if (!transport_state)
+		return;
+
+	if (g_str_equal (transport_state, "PLAYING"))
+		set_state (device, REMOTE_DISPLAY_DEVICE_STATE_PLAYING);
+	else if (g_str_equal (transport_state, "PAUSED_PLAYBACK"))
+		set_state (device, REMOTE_DISPLAY_DEVICE_STATE_PAUSED);
+	else if (g_str_equal (transport_state, "TRANSITIONING"))
+		set_state (device, REMOTE_DISPLAY_DEVICE_STATE_LOADING);
+	else if (g_str_equal (transport_state, "STOPPED") ||
+		 g_str_equal (transport_state, "NO_MEDIA_PRESENT"))
+		set_state (device, REMOTE_DISPLAY_DEVICE_STATE_STOPPED);
+	else
+		g_debug ("Unhandled transport state '%s'", transport_state);
+
+	g_free (transport_state);
+}
+
+static guint
+parse_timeout (const char *timeout)
+{
+	if (!timeout || !g_str_has_prefix (timeout, "Second-"))
+		return SUBSCRIPTION_TIMEOUT;
+	return MAX (atoi (timeout + strlen ("Second-")), 60);
+}
+
+static gboolean renew_cb (gpointer user_data);
+
+static void
+subscribe_cb (SoupSession *session,
+	      SoupMessage *msg,
+	      gpointer     user_data)
+{
+	RemoteDisplayDeviceDlna *device = user_data;
+	const char *sid;
+
+	device->subscribing = FALSE;
+	sid = soup_message_headers_get_one (msg->response_headers, "SID");
+	if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code) || !sid) {
+		g_debug ("Failed to subscribe to '%s' events: %d",
+			 remote_display_device_get_name (REMOTE_DISPLAY_DEVICE (device)),
+			 msg->status_code);
+		g_clear_pointer (&device->sid, g_free);
+		g_object_unref (device);
+		return;
+	}
+
+	g_free (device->sid);
+	device->sid = g_strdup (sid);
+	if (device->renew_id != 0)
+		g_source_remove (device->renew_id);
+	device->renew_id = g_timeout_add_seconds (parse_timeout (soup_message_headers_get_one (msg->response_headers, "TIMEOUT")) / 2,
+						  renew_cb, device);
+	g_object_unref (device);
+}
+
+static void
+subscribe (RemoteDisplayDeviceDlna *device)
+{
+	SoupMessage *msg;
+	char *timeout;
+
+	msg = soup_message_new ("SUBSCRIBE", device->desc->avtransport_event);
+	if (device->sid) {
+		soup_message_headers_append (msg->request_headers, "SID", device->sid);
+	} else {
+		char *callback;
+
+		callback = g_strdup_printf ("<%s>", device->callback_uri);
+		soup_message_headers_append (msg->request_headers, "CALLBACK", callback);
+		soup_message_headers_append (msg->request_headers, "NT", "upnp:event");
+		g_free (callback);
+	}
+	timeout = g_strdup_printf ("Second-%d", SUBSCRIPTION_TIMEOUT);
+	soup_message_headers_append (msg->request_headers, "TIMEOUT", timeout);
+	g_free (timeout);
+
+	device->subscribing = TRUE;
+	soup_session_queue_message (device->context->session, msg, subscribe_cb, g_object_ref (device));
+}
+
+static gboolean
+renew_cb (gpointer user_data)
+{
+	RemoteDisplayDeviceDlna *device = user_data;
+
+	/* A failed renewal clears the SID, and the next
+	 * action subscribes from scratch */
+	device->renew_id = 0;
+	subscribe (device);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+ensure_subscribed (RemoteDisplayDeviceDlna *device)
+{
+	GError *error = NULL;
+
+	if (device->sid || device->subscribing || !device->desc->avtransport_event)
+		return;
+
+	if (!device->callback_uri) {
+		char *path, *uuid;
+
+		uuid = g_uuid_string_random ();
+		path = g_strdup_printf ("/event/%s", uuid);
+		device->callback_uri = remote_display_host_add_handler (device->host, path,
+									event_cb, device, &error);
+		g_free (path);
+		g_free (uuid);
+		if (!device->callback_uri) {
+			g_warning ("Failed to listen for events: %s", error->message);
+			g_error_free (error);
+			return;
+		}
+	}
+
+	subscribe (device);
+}
+
+static char *
+format_time (gdouble position_ms)
+{
+	guint64 ms = position_ms;
+
+	return g_strdup_printf ("%u:%02u:%02u.%03u",
+				(guint) (ms / 3600000),
+				(guint) (ms / 60000 % 60),
+				(guint) (ms / 1000 % 60),
+				(guint) (ms % 1000));
+}
+
+/* Lots of renderers refuse URIs without DIDL-Lite metadata */
+static char *
+create_metadata (const char *uri,
+		 const char *served_uri)
+{
+	char *basename, *content_type, *mime_type, *ret;
+
+	basename = g_path_get_basename (uri);
+	content_type = g_content_type_guess (basename, NULL, 0, NULL);
+	mime_type = g_content_type_get_mime_type (content_type);
+
+	ret = g_markup_printf_escaped ("<DIDL-Lite xmlns=\"urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/\" "
+				       "xmlns:dc=\"http://purl.org/dc/elements/1.1/\" "
+				       "xmlns:upnp=\"urn:schemas-upnp-org:metadata-1-0/upnp/\">"
+				       "<item id=\"0\" parentID=\"-1\" restricted=\"1\">"
+				       "<dc:title>%s</dc:title>"
+				       "<upnp:class>object.item.videoItem</upnp:class>"
+				       "<res protocolInfo=\"http-get:*:%s:*\">%s</res>"
+				       "</item></DIDL-Lite>",
+				       basename, mime_type ? mime_type : "*", served_uri);
+
+	g_free (basename);
+	g_free (content_type);
+	g_free (mime_type);
+
+	return ret;
+}
+
+/* The task is completed with the last of the commands, as the
+ * renderer handles them in order */
+void
+remote_display_device_dlna_open_and_play (RemoteDisplayDeviceDlna *device,
+					  const char              *uri,
+					  gdouble                  position_ms,
+					  GTask                   *task)
+{
+	GError *error = NULL;
+	char *served_uri, *metadata;
+
+	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE_DLNA (device));
+
+	served_uri = remote_display_host_file (device->host, uri, &error);
+	if (!served_uri) {
+		if (task) {
+			g_task_return_error (task, error);
+			g_object_unref (task);
+		} else {
+			g_warning ("Failed to serve '%s': %s", uri, error->message);
+			g_error_free (error);
+		}
+		return;
+	}
+
+	ensure_subscribed (device);
+
+	metadata = create_metadata (uri, served_uri);
+	send_action (device, NULL, device->desc->avtransport_control, device->desc->avtransport_type,
+		     "SetAVTransportURI",
+		     "CurrentURI", served_uri,
+		     "CurrentURIMetaData", metadata,
+		     NULL);
+	g_free (metadata);
+	g_free (served_uri);
+
+	if (position_ms > 0)
+		remote_display_device_dlna_seek (device, position_ms, NULL);
+	remote_display_device_dlna_play (device, task);
+}
+
+void
+remote_display_device_dlna_play (RemoteDisplayDeviceDlna *device,
+				 GTask                   *task)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE_DLNA (device));
+
+	ensure_subscribed (device);
+	send_action (device, task, device->desc->avtransport_control, device->desc->avtransport_type,
+		     "Play", "Speed", "1", NULL);
+}
+
+void
+remote_display_device_dlna_pause (RemoteDisplayDeviceDlna *device,
+				  GTask                   *task)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE_DLNA (device));
+
+	send_action (device, task, device->desc->avtransport_control, device->desc->avtransport_type,
+		     "Pause", NULL);
+}
+
+void
+remote_display_device_dlna_stop (RemoteDisplayDeviceDlna *device,
+				 GTask                   *task)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE_DLNA (device));
+
+	send_action (device, task, device->desc->avtransport_control, device->desc->avtransport_type,
+		     "Stop", NULL);
+}
+
+void
+remote_display_device_dlna_seek (RemoteDisplayDeviceDlna *device,
+				 gdouble                  position_ms,
+				 GTask                   *task)
+{
+	char *target;
+
+	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE_DLNA (device));
+
+	target = format_time (position_ms);
+	send_action (device, task, device->desc->avtransport_control, device->desc->avtransport_type,
+		     "Seek", "Unit", "REL_TIME", "Target", target, NULL);
+	g_free (target);
+}
+
+/**
+ * remote_display_device_dlna_set_volume:
+ * @device: a #RemoteDisplayDeviceDlna
+ * @volume: the volume, between 0.0 and 1.0
+ **/
+void
+remote_display_device_dlna_set_volume (RemoteDisplayDeviceDlna *device,
+				       gdouble                  volume)
+{
+	char *value;
+
+	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE_DLNA (device));
+
+	if (!device->desc->rendering_control) {
+		g_debug ("'%s' has no volume control",
+			 remote_display_device_get_name (REMOTE_DISPLAY_DEVICE (device)));
+		return;
+	}
+
+	value = g_strdup_printf ("%d", (int) (CLAMP (volume, 0.0, 1.0) * 100.0 + 0.5));
+	send_action (device, NULL, device->desc->rendering_control, device->desc->rendering_control_type,
+		     "SetVolume", "Channel", "Master", "DesiredVolume", value, NULL);
+	g_free (value);
+}
+
+char *
+remote_display_device_dlna_add_to_string (RemoteDisplayDeviceDlna *device,
+					  GString                 *s)
+{
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_DEVICE_DLNA (device), NULL);
+
+	g_string_append_printf (s, "\tLocation: %s\n", device->location);
+	if (device->desc->model)
+		g_string_append_printf (s, "\tModel: %s\n", device->desc->model);
+
+	return g_string_free (s, FALSE);
+}
+
+guint
+remote_display_device_dlna_get_pending_actions (RemoteDisplayDeviceDlna *device)
+{
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_DEVICE_DLNA (device), 0);
+
+	return device->pending_actions;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#ifndef __REMOTE_DISPLAY_DEVICE_DLNA_H__
+#define __REMOTE_DISPLAY_DEVICE_DLNA_H__
+
+#include <glib-object.h>
+#include <gio/gio.h>
+#include <libremote-display/remote-display-device.h>
+
+G_BEGIN_DECLS
+
+#define DLNA_RENDERER_TYPE "urn:schemas-upnp-org:device:MediaRenderer:1"
+
+#define REMOTE_DISPLAY_TYPE_DEVICE_DLNA remote_display_device_dlna_get_type ()
+G_DECLARE_FINAL_TYPE (RemoteDisplayDeviceDlna, remote_display_device_dlna, REMOTE_DISPLAY, DEVICE_DLNA, RemoteDisplayDevice)
+
+/* What the renderers found by one manager share */
+typedef struct _RemoteDisplayDlnaContext RemoteDisplayDlnaContext;
+
+RemoteDisplayDlnaContext *remote_display_dlna_context_new   (void);
+RemoteDisplayDlnaContext *remote_display_dlna_context_ref   (RemoteDisplayDlnaContext *context);
+void                      remote_display_dlna_context_unref (RemoteDisplayDlnaContext *context);
+
+void                 remote_display_device_dlna_new_async     (RemoteDisplayDlnaContext *context,
+							       const char               *location,
+							       GCancellable             *cancellable,
+							       GAsyncReadyCallback       callback,
+							       gpointer                  user_data);
+RemoteDisplayDevice *remote_display_device_dlna_new_finish    (GAsyncResult             *result,
+							       GError                  **error);
+char                *remote_display_device_dlna_add_to_string (RemoteDisplayDeviceDlna  *device,
+							       GString                  *s);
+/* The tasks are completed once the device accepted the command,
+ * they can be %NULL if nobody is waiting for that */
+void                 remote_display_device_dlna_open_and_play (RemoteDisplayDeviceDlna  *device,
+							       const char               *uri,
+							       gdouble                   position_ms,
+							       GTask                    *task);
+void                 remote_display_device_dlna_play          (RemoteDisplayDeviceDlna  *device,
+							       GTask                    *task);
+void                 remote_display_device_dlna_pause         (RemoteDisplayDeviceDlna  *device,
+							       GTask                    *task);
+void                 remote_display_device_dlna_stop          (RemoteDisplayDeviceDlna  *device,
+							       GTask                    *task);
+void                 remote_display_device_dlna_seek          (RemoteDisplayDeviceDlna  *device,
+							       gdouble                   position_ms,
+							       GTask                    *task);
+void                 remote_display_device_dlna_set_volume    (RemoteDisplayDeviceDlna  *device,
+							       gdouble                   volume);
+guint                remote_display_device_dlna_get_pending_actions (RemoteDisplayDeviceDlna *device);
+
+G_END_DECLS
+
+#endif /* __REMOTE_DISPLAY_DEVICE_DLNA_H__ */
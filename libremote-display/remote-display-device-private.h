@@ -20,14 +20,13 @@
 #define __REMOTE_DISPLAY_DEVICE_PRIVATE_H__
 
 #include <glib-object.h>
+#include <gio/gio.h>
 #include <libremote-display/remote-display-device.h>
 #include <avahi-common/strlst.h>
+#include <avahi-common/address.h>
 
 G_BEGIN_DECLS
 
-//#define REMOTE_DISPLAY_TYPE_DEVICE_DLNA remote_display_device_dlna_get_type ()
-//G_DECLARE_FINAL_TYPE (RemoteDisplayDeviceDlna, remote_display_device_dlna, REMOTE_DISPLAY, DEVICE_DLNA, RemoteDisplayDevice)
-
 void remote_display_device_set_name (RemoteDisplayDevice *device,
 				     const char          *name);
 void remote_display_device_set_id (RemoteDisplayDevice *device,
@@ -38,8 +37,39 @@ void remote_display_device_set_password_protected (RemoteDisplayDevice *device,
 						   gboolean             password_protected);
 void remote_display_device_set_capabilities (RemoteDisplayDevice             *device,
 					     RemoteDisplayDeviceCapabilities  caps);
+void remote_display_device_set_provisional (RemoteDisplayDevice *device,
+					    gboolean             provisional);
+void remote_display_device_mark_alive (RemoteDisplayDevice *device);
+void remote_display_device_mark_failed (RemoteDisplayDevice *device);
+void remote_display_device_check_liveness (RemoteDisplayDevice *device);
+void remote_display_device_add_command_failure (RemoteDisplayDevice *device);
+guint remote_display_device_get_command_failures (RemoteDisplayDevice *device);
+guint remote_display_device_get_pending_actions (RemoteDisplayDevice *device);
+
+/* One way to reach a device, a device has one per interface
+ * and address family it was resolved on */
+typedef struct {
+	guint ifindex;
+	GInetAddress *address;
+	char *hostname;
+	guint16 port;
+} RemoteDisplayCandidate;
+
+void remote_display_device_add_candidate (RemoteDisplayDevice *device,
+					  guint                ifindex,
+					  GInetAddress        *address,
+					  const char          *hostname,
+					  guint16              port);
+guint remote_display_device_remove_candidate (RemoteDisplayDevice *device,
+					      guint                ifindex,
+					      GSocketFamily        family);
+const RemoteDisplayCandidate *remote_display_device_get_best_candidate (RemoteDisplayDevice *device);
+GSocketAddress *remote_display_device_get_best_address (RemoteDisplayDevice *device,
+							guint16              port);
+char *remote_display_candidate_to_uri_host (const RemoteDisplayCandidate *candidate);
 
-//RemoteDisplayDevice *remote_display_device_dlna_new    (const char      *name);
+GInetAddress *remote_display_avahi_address_to_address (const AvahiAddress *address);
+GSocketFamily remote_display_avahi_protocol_to_family (AvahiProtocol protocol);
 
 G_END_DECLS
 
@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <gio/gio.h>
+
+#include <libremote-display/remote-display-device.h>
+#include <libremote-display/remote-display-device-private.h>
+#include <libremote-display/remote-display-device-proxy.h>
+#include <libremote-display/remote-display-error.h>
+#include <libremote-display/remote-display-service.h>
+
+struct _RemoteDisplayDeviceProxy {
+	RemoteDisplayDevice parent_instance;
+
+	GDBusConnection *connection;
+	char *owner;
+	char *id;
+	guint pending_actions;
+};
+
+G_DEFINE_TYPE (RemoteDisplayDeviceProxy, remote_display_device_proxy, REMOTE_DISPLAY_TYPE_DEVICE);
+
+static void
+remote_display_device_proxy_finalize (GObject *object)
+{
+	RemoteDisplayDeviceProxy *device = REMOTE_DISPLAY_DEVICE_PROXY (object);
+
+	g_clear_object (&device->connection);
+	g_free (device->owner);
+	g_free (device->id);
+
+	G_OBJECT_CLASS (remote_display_device_proxy_parent_class)->finalize (object);
+}
+
+static void
+remote_display_device_proxy_class_init (RemoteDisplayDeviceProxyClass *klass)
+{
+	GObjectClass *o_class = (GObjectClass *)klass;
+
+	o_class->finalize = remote_display_device_proxy_finalize;
+}
+
+static void
+remote_display_device_proxy_init (RemoteDisplayDeviceProxy *device)
+{
+}
+
+RemoteDisplayDevice *
+remote_display_device_proxy_new (GDBusConnection *connection,
+				 const char      *owner,
+				 GVariant        *info)
+{
+	RemoteDisplayDeviceProxy *device;
+	const char *id;
+
+	g_return_val_if_fail (G_IS_DBUS_CONNECTION (connection), NULL);
+	g_return_val_if_fail (g_variant_is_of_type (info, G_VARIANT_TYPE ("(ssubb)")), NULL);
+
+	g_variant_get_child (info, 0, "&s", &id);
+
+	device = g_object_new (REMOTE_DISPLAY_TYPE_DEVICE_PROXY, NULL);
+	device->connection = g_object_ref (connection);
+	device->owner = g_strdup (owner);
+	device->id = g_strdup (id);
+
+	remote_display_device_set_id (REMOTE_DISPLAY_DEVICE (device), id);
+	remote_display_device_proxy_update (device, info);
+
+	return REMOTE_DISPLAY_DEVICE (device);
+}
+
+void
+remote_display_device_proxy_update (RemoteDisplayDeviceProxy *device,
+				    GVariant                 *info)
+{
+	const char *name;
+	guint caps;
+	gboolean password_protected, provisional;
+
+	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE_PROXY (device));
+	g_return_if_fail (g_variant_is_of_type (info, G_VARIANT_TYPE ("(ssubb)")));
+
+	g_variant_get (info, "(s&subb)", NULL, &name, &caps, &password_protected, &provisional);
+
+	remote_display_device_set_name (REMOTE_DISPLAY_DEVICE (device), name);
+	remote_display_device_set_password_protected (REMOTE_DISPLAY_DEVICE (device), password_protected);
+	remote_display_device_set_provisional (REMOTE_DISPLAY_DEVICE (device), provisional);
+	/* Mirroring and audio streams need to reach the device
+	 * from this process, only media playback goes through
+	 * the service */
+	remote_display_device_set_capabilities (REMOTE_DISPLAY_DEVICE (device),
+						caps & REMOTE_DISPLAY_DEVICE_CAPABILITIES_VIDEO);
+}
+
+static void
+call_cb (GObject      *source_object,
+	 GAsyncResult *result,
+	 gpointer      user_data)
+{
+	GTask *task = user_data;
+	RemoteDisplayDeviceProxy *device;
+	GVariant *ret;
+	GError *error = NULL;
+
+	device = REMOTE_DISPLAY_DEVICE_PROXY (g_task_get_source_object (task));
+	device->pending_actions--;
+
+	ret = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), result, &error);
+	if (ret) {
+		g_variant_unref (ret);
+		g_task_return_boolean (task, TRUE);
+	} else {
+		g_dbus_error_strip_remote_error (error);
+		if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			remote_display_device_add_command_failure (REMOTE_DISPLAY_DEVICE (device));
+		g_task_return_error (task, error);
+	}
+	g_object_unref (task);
+}
+
+/* Tasks the caller doesn't wait for still hold the device,
+ * and report failures as warnings */
+static void
+warn_cb (GObject      *source_object,
+	 GAsyncResult *result,
+	 gpointer      user_data)
+{
+	GError *error = NULL;
+
+	if (!g_task_propagate_boolean (G_TASK (result), &error)) {
+		g_warning ("%s", error->message);
+		g_error_free (error);
+	}
+}
+
+/* Takes ownership of the task */
+static void
+call_method (RemoteDisplayDeviceProxy *device,
+	     const char               *method,
+	     GVariant                 *parameters,
+	     GTask                    *task)
+{
+	if (!task)
+		task = g_task_new (device, NULL, warn_cb, NULL);
+
+	device->pending_actions++;
+	g_dbus_connection_call (device->connection,
+				device->owner,
+				REMOTE_DISPLAY_DBUS_PATH,
+				REMOTE_DISPLAY_DBUS_INTERFACE,
+				method,
+				parameters,
+				NULL,
+				G_DBUS_CALL_FLAGS_NONE,
+				-1,
+				g_task_get_cancellable (task),
+				call_cb,
+				task);
+}
+
+void
+remote_display_device_proxy_open_and_play (RemoteDisplayDeviceProxy *device,
+					   const char               *uri,
+					   gdouble                   position_ms,
+					   GTask                    *task)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE_PROXY (device));
+
+	call_method (device, "OpenAndPlay",
+		     g_variant_new ("(sst)", device->id, uri, (guint64) position_ms),
+		     task);
+}
+
+void
+remote_display_device_proxy_play (RemoteDisplayDeviceProxy *device,
+				  GTask                    *task)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE_PROXY (device));
+
+	call_method (device, "Play", g_variant_new ("(s)", device->id), task);
+}
+
+void
+remote_display_device_proxy_pause (RemoteDisplayDeviceProxy *device,
+				   GTask                    *task)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE_PROXY (device));
+
+	call_method (device, "Pause", g_variant_new ("(s)", device->id), task);
+}
+
+void
+remote_display_device_proxy_stop (RemoteDisplayDeviceProxy *device,
+				  GTask                    *task)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE_PROXY (device));
+
+	call_method (device, "Stop", g_variant_new ("(s)", device->id), task);
+}
+
+void
+remote_display_device_proxy_seek (RemoteDisplayDeviceProxy *device,
+				  gdouble                   position_ms,
+				  GTask                    *task)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE_PROXY (device));
+
+	call_method (device, "Seek", g_variant_new ("(sd)", device->id, position_ms), task);
+}
+
+guint
+remote_display_device_proxy_get_pending_actions (RemoteDisplayDeviceProxy *device)
+{
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_DEVICE_PROXY (device), 0);
+
+	return device->pending_actions;
+}
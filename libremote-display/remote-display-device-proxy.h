@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __REMOTE_DISPLAY_DEVICE_PROXY_H__
+#define __REMOTE_DISPLAY_DEVICE_PROXY_H__
+
+#include <glib-object.h>
+#include <gio/gio.h>
+#include <libremote-display/remote-display-device.h>
+
+G_BEGIN_DECLS
+
+#define REMOTE_DISPLAY_TYPE_DEVICE_PROXY remote_display_device_proxy_get_type ()
+G_DECLARE_FINAL_TYPE (RemoteDisplayDeviceProxy, remote_display_device_proxy, REMOTE_DISPLAY, DEVICE_PROXY, RemoteDisplayDevice)
+
+/* A device of the D-Bus service, @info is of type (ssubb) */
+RemoteDisplayDevice *remote_display_device_proxy_new           (GDBusConnection          *connection,
+								const char               *owner,
+								GVariant                 *info);
+/* From the service's DeviceChanged signal */
+void                 remote_display_device_proxy_update        (RemoteDisplayDeviceProxy *device,
+								GVariant                 *info);
+/* The tasks are completed once the service's device accepted
+ * the command, they can be %NULL if nobody is waiting for that.
+ * Cancelling a task only stops waiting for the reply, the
+ * service still sends the command to the receiver */
+void                 remote_display_device_proxy_open_and_play (RemoteDisplayDeviceProxy *device,
+								const char               *uri,
+								gdouble                   position_ms,
+								GTask                    *task);
+void                 remote_display_device_proxy_play          (RemoteDisplayDeviceProxy *device,
+								GTask                    *task);
+void                 remote_display_device_proxy_pause         (RemoteDisplayDeviceProxy *device,
+								GTask                    *task);
+void                 remote_display_device_proxy_stop          (RemoteDisplayDeviceProxy *device,
+								GTask                    *task);
+void                 remote_display_device_proxy_seek          (RemoteDisplayDeviceProxy *device,
+								gdouble                   position_ms,
+								GTask                    *task);
+guint                remote_display_device_proxy_get_pending_actions (RemoteDisplayDeviceProxy *device);
+
+G_END_DECLS
+
+#endif /* __REMOTE_DISPLAY_DEVICE_PROXY_H__ */
@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <avahi-glib/glib-malloc.h>
+#include <avahi-common/strlst.h>
+
+#include <libremote-display/remote-display-device.h>
+#include <libremote-display/remote-display-device-private.h>
+#include <libremote-display/remote-display-device-raop.h>
+#include <libremote-display/remote-display-alac.h>
+
+/* "et" values */
+#define RAOP_ENCRYPTION_NONE "0"
+/* "cn" values */
+#define RAOP_CODEC_ALAC      "1"
+
+struct _RemoteDisplayDeviceRaop {
+	GObject parent_instance;
+
+	char *hostname;
+	guint16 port;
+	char *model;
+	char *encryption_types;
+	char *codecs;
+};
+
+G_DEFINE_TYPE (RemoteDisplayDeviceRaop, remote_display_device_raop, REMOTE_DISPLAY_TYPE_DEVICE);
+
+static void
+remote_display_device_raop_finalize (GObject *object)
+{
+	RemoteDisplayDeviceRaop *device = REMOTE_DISPLAY_DEVICE_RAOP (object);
+
+	g_free (device->hostname);
+	g_free (device->model);
+	g_free (device->encryption_types);
+	g_free (device->codecs);
+
+	G_OBJECT_CLASS (remote_display_device_raop_parent_class)->finalize (object);
+}
+
+static void
+remote_display_device_raop_class_init (RemoteDisplayDeviceRaopClass *klass)
+{
+	GObjectClass *o_class = (GObjectClass *)klass;
+
+	o_class->finalize = remote_display_device_raop_finalize;
+}
+
+static void
+remote_display_device_raop_init (RemoteDisplayDeviceRaop *device)
+{
+}
+
+/* Whether the comma-separated list contains item, a missing
+ * list meaning the receiver didn't tell, so we assume it does */
+static gboolean
+list_contains (const char *list,
+	       const char *item)
+{
+	char **items;
+	gboolean ret = FALSE;
+	guint i;
+
+	if (list == NULL)
+		return TRUE;
+
+	items = g_strsplit (list, ",", -1);
+	for (i = 0; items[i] != NULL; i++) {
+		if (g_strcmp0 (g_strstrip (items[i]), item) == 0) {
+			ret = TRUE;
+			break;
+		}
+	}
+	g_strfreev (items);
+
+	return ret;
+}
+
+static gboolean
+value_matches (const char *value,
+	       guint       expected)
+{
+	return value == NULL || strtoul (value, NULL, 10) == expected;
+}
+
+RemoteDisplayDevice *
+remote_display_device_raop_new (AvahiIfIndex        interface,
+				AvahiProtocol       protocol,
+				const char         *name,
+				AvahiStringList    *txt,
+				const char         *host_name,
+				const AvahiAddress *address,
+				guint16             port)
+{
+	RemoteDisplayDeviceRaop *device;
+	AvahiStringList *l;
+	const char *at;
+	char *device_id;
+	char *model = NULL, *encryption_types = NULL, *codecs = NULL;
+	char *sample_size = NULL, *sample_rate = NULL, *channels = NULL;
+	gboolean password_protected = FALSE;
+	RemoteDisplayDeviceCapabilities caps;
+	GInetAddress *remote_address;
+
+	/* Service names are the hardware address and the user-visible
+	 * name separated by an '@' */
+	at = strchr (name, '@');
+	if (!at || at == name || at[1] == '\0') {
+		g_debug ("RAOP service '%s' has an invalid name, not adding", name);
+		return NULL;
+	}
+	device_id = g_strndup (name, at - name);
+
+	for (l = txt; l != NULL; l = avahi_string_list_get_next (l)) {
+		char *key, *value;
+
+		avahi_string_list_get_pair (l, &key, &value, NULL);
+		if (!key || !value) {
+			g_clear_pointer (&key, avahi_free);
+			g_clear_pointer (&value, avahi_free);
+			continue;
+		}
+
+		if (g_strcmp0 (key, "et") == 0)
+			encryption_types = g_strdup (value);
+		else if (g_strcmp0 (key, "cn") == 0)
+			codecs = g_strdup (value);
+		else if (g_strcmp0 (key, "am") == 0)
+			model = g_strdup (value);
+		else if (g_strcmp0 (key, "pw") == 0)
+			password_protected = (g_strcmp0 (value, "true") == 0);
+		else if (g_strcmp0 (key, "ss") == 0)
+			sample_size = g_strdup (value);
+		else if (g_strcmp0 (key, "sr") == 0)
+			sample_rate = g_strdup (value);
+		else if (g_strcmp0 (key, "ch") == 0)
+			channels = g_strdup (value);
+
+		avahi_free (key);
+		avahi_free (value);
+	}
+
+	/* We can only stream unencrypted ALAC, in the one format
+	 * every receiver supports */
+	caps = REMOTE_DISPLAY_DEVICE_CAPABILITIES_NONE;
+	if (list_contains (encryption_types, RAOP_ENCRYPTION_NONE) &&
+	    list_contains (codecs, RAOP_CODEC_ALAC) &&
+	    value_matches (sample_size, 16) &&
+	    value_matches (sample_rate, REMOTE_DISPLAY_ALAC_SAMPLE_RATE) &&
+	    value_matches (channels, REMOTE_DISPLAY_ALAC_CHANNELS))
+		caps |= REMOTE_DISPLAY_DEVICE_CAPABILITIES_AUDIO;
+	else
+		g_debug ("RAOP device '%s' doesn't support unencrypted ALAC (et: %s, cn: %s)",
+			 name, encryption_types, codecs);
+
+	g_free (sample_size);
+	g_free (sample_rate);
+	g_free (channels);
+
+	device = g_object_new (REMOTE_DISPLAY_TYPE_DEVICE_RAOP, NULL);
+	remote_display_device_set_name (REMOTE_DISPLAY_DEVICE (device), at + 1);
+	remote_display_device_set_id (REMOTE_DISPLAY_DEVICE (device), device_id);
+	g_free (device_id);
+	remote_display_device_set_password_protected (REMOTE_DISPLAY_DEVICE (device), password_protected);
+	remote_display_device_set_capabilities (REMOTE_DISPLAY_DEVICE (device), caps);
+
+	device->hostname = g_strdup (host_name);
+	device->port = port;
+	device->model = model;
+	device->encryption_types = encryption_types;
+	device->codecs = codecs;
+
+	remote_address = remote_display_avahi_address_to_address (address);
+	if (remote_address) {
+		remote_display_device_add_candidate (REMOTE_DISPLAY_DEVICE (device), interface,
+						     remote_address, host_name, port);
+		g_object_unref (remote_address);
+	}
+
+	return REMOTE_DISPLAY_DEVICE (device);
+}
+
+const char *
+remote_display_device_raop_get_hostname (RemoteDisplayDeviceRaop *device)
+{
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_DEVICE_RAOP (device), NULL);
+
+	return device->hostname;
+}
+
+guint16
+remote_display_device_raop_get_port (RemoteDisplayDeviceRaop *device)
+{
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_DEVICE_RAOP (device), 0);
+
+	return device->port;
+}
+
+char *
+remote_display_device_raop_add_to_string (RemoteDisplayDeviceRaop *device,
+					  GString                 *s)
+{
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_DEVICE_RAOP (device), NULL);
+
+	g_string_append_printf (s, "\tHostname: %s\n", device->hostname);
+	g_string_append_printf (s, "\tPort: %d\n", device->port);
+	if (device->model)
+		g_string_append_printf (s, "\tModel: %s\n", device->model);
+	g_string_append_printf (s, "\tEncryption types: %s\n", device->encryption_types ? device->encryption_types : "unknown");
+	g_string_append_printf (s, "\tCodecs: %s\n", device->codecs ? device->codecs : "unknown");
+
+	return g_string_free (s, FALSE);
+}
@@ -27,6 +27,9 @@
 #include <libremote-display/remote-display.h>
 #include <libremote-display/remote-display-device-private.h>
 #include <libremote-display/remote-display-device-airplay.h>
+#include <libremote-display/remote-display-device-raop.h>
+#include <libremote-display/remote-display-device-dlna.h>
+#include <libremote-display/remote-display-device-proxy.h>
 #include <libremote-display/remote-display-private.h>
 
 struct _RemoteDisplayDevicePrivate {
@@ -36,14 +39,35 @@ struct _RemoteDisplayDevicePrivate {
 	gboolean password_protected;           /* Always FALSE for DLNA */
 	RemoteDisplayDeviceCapabilities caps;
 	RemoteDisplayDeviceState last_state;
+	gboolean provisional;                  /* From the cache, not seen yet */
+
+	GPtrArray *candidates;                 /* RemoteDisplayCandidate */
+	RemoteDisplayCandidate *best;
+	guint race_id;
+	GCancellable *race_cancellable;
+
+	RemoteDisplayDeviceReachability reachability;
+	gint64 last_alive;                     /* Last sign of life, from any connection */
+	gint64 last_probe;
+	guint probe_failures;
+	GCancellable *probe_cancellable;       /* Set while probing */
+
+	guint command_failures;                /* Not counting cancelled ones */
 };
 
+#define RACE_DELAY   200                       /* ms, lets the other resolvers finish */
+#define RACE_TIMEOUT 2                         /* seconds */
+#define LIVENESS_IDLE  15                      /* seconds without activity before probing */
+#define PROBE_TIMEOUT  2                       /* seconds */
+#define PROBE_FAILURES 2                       /* failed probes in a row before giving up */
+
 #define GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE ((obj), REMOTE_DISPLAY_TYPE_DEVICE, RemoteDisplayDevicePrivate))
 
 G_DEFINE_TYPE_WITH_PRIVATE (RemoteDisplayDevice, remote_display_device, G_TYPE_OBJECT);
 
 enum {
 	STATE_CHANGED,
+	MEDIA_SERVED,
 	NUM_SIGS
 };
 
@@ -53,7 +77,9 @@ enum {
 	PROP_ID,
 	PROP_ICON,
 	PROP_PASSWORD_PROTECTED,
-	PROP_CAPS
+	PROP_CAPS,
+	PROP_PROVISIONAL,
+	PROP_REACHABILITY
 };
 
 static guint signals[NUM_SIGS] = {0,};
@@ -67,6 +93,14 @@ remote_display_device_finalize (GObject *object)
 	g_free (priv->id);
 	g_clear_object (&priv->icon);
 
+	if (priv->race_id != 0)
+		g_source_remove (priv->race_id);
+	g_clear_object (&priv->race_cancellable);
+	if (priv->probe_cancellable)
+		g_cancellable_cancel (priv->probe_cancellable);
+	g_clear_object (&priv->probe_cancellable);
+	g_ptr_array_free (priv->candidates, TRUE);
+
 	G_OBJECT_CLASS (remote_display_device_parent_class)->finalize (object);
 }
 
@@ -97,6 +131,12 @@ remote_display_device_get_property (GObject    *object,
 	case PROP_CAPS:
 		g_value_set_uint (value, priv->caps);
 		break;
+	case PROP_PROVISIONAL:
+		g_value_set_boolean (value, priv->provisional);
+		break;
+	case PROP_REACHABILITY:
+		g_value_set_enum (value, priv->reachability);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 	}
@@ -146,6 +186,21 @@ remote_display_device_class_init (RemoteDisplayDeviceClass *klass)
 							    REMOTE_DISPLAY_DEVICE_CAPABILITIES_NONE, G_MAXUINT,
 							    REMOTE_DISPLAY_DEVICE_CAPABILITIES_NONE,
 							    G_PARAM_READABLE));
+	g_object_class_install_property (o_class,
+					 PROP_PROVISIONAL,
+					 g_param_spec_boolean ("provisional",
+							      "Provisional",
+							      "Whether the device comes from the discovery cache, and wasn't seen on the network yet",
+							      FALSE,
+							      G_PARAM_READABLE));
+	g_object_class_install_property (o_class,
+					 PROP_REACHABILITY,
+					 g_param_spec_enum ("reachability",
+							    "Reachability",
+							    "Whether the device answered recently",
+							    REMOTE_DISPLAY_TYPE_DISPLAY_DEVICE_REACHABILITY,
+							    REMOTE_DISPLAY_DEVICE_REACHABILITY_UNKNOWN,
+							    G_PARAM_READABLE));
 
 	signals[STATE_CHANGED] = g_signal_new ("state-changed",
 					       REMOTE_DISPLAY_TYPE_DEVICE,
@@ -154,11 +209,165 @@ remote_display_device_class_init (RemoteDisplayDeviceClass *klass)
 					       g_cclosure_marshal_generic,
 					       G_TYPE_NONE,
 					       1, REMOTE_DISPLAY_TYPE_DISPLAY_DEVICE_STATE);
+
+	/**
+	 * RemoteDisplayDevice::media-served:
+	 * @device: the #RemoteDisplayDevice
+	 * @uri: the URI passed to remote_display_device_open_and_play()
+	 *
+	 * Emitted when the device started fetching a local file it
+	 * was asked to play, once per call to
+	 * remote_display_device_open_and_play(), however many
+	 * requests the device makes to seek or buffer.
+	 **/
+	signals[MEDIA_SERVED] = g_signal_new ("media-served",
+					      REMOTE_DISPLAY_TYPE_DEVICE,
+					      G_SIGNAL_RUN_LAST,
+					      0, NULL, NULL,
+					      g_cclosure_marshal_generic,
+					      G_TYPE_NONE,
+					      1, G_TYPE_STRING);
+}
+
+static void
+candidate_free (RemoteDisplayCandidate *candidate)
+{
+	g_object_unref (candidate->address);
+	g_free (candidate->hostname);
+	g_free (candidate);
 }
 
 static void
 remote_display_device_init (RemoteDisplayDevice *device)
 {
+	RemoteDisplayDevicePrivate *priv = GET_PRIVATE (device);
+
+	priv->candidates = g_ptr_array_new_with_free_func ((GDestroyNotify) candidate_free);
+}
+
+typedef enum {
+	COMMAND_OPEN_AND_PLAY,
+	COMMAND_PLAY,
+	COMMAND_PAUSE,
+	COMMAND_STOP,
+	COMMAND_SEEK
+} Command;
+
+/* Takes ownership of the task */
+static void
+send_command (RemoteDisplayDevice *device,
+	      Command              command,
+	      const char          *uri,
+	      gdouble              position_ms,
+	      GTask               *task)
+{
+	if (REMOTE_DISPLAY_IS_DEVICE_AIRPLAY (device)) {
+		RemoteDisplayDeviceAirplay *airplay = REMOTE_DISPLAY_DEVICE_AIRPLAY (device);
+
+		switch (command) {
+		case COMMAND_OPEN_AND_PLAY:
+			remote_display_device_airplay_open_and_play (airplay, uri, position_ms, task);
+			break;
+		case COMMAND_PLAY:
+			remote_display_device_airplay_play (airplay, task);
+			break;
+		case COMMAND_PAUSE:
+			remote_display_device_airplay_pause (airplay, task);
+			break;
+		case COMMAND_STOP:
+			remote_display_device_airplay_stop (airplay, task);
+			break;
+		case COMMAND_SEEK:
+			remote_display_device_airplay_seek (airplay, position_ms, task);
+			break;
+		}
+	} else if (REMOTE_DISPLAY_IS_DEVICE_DLNA (device)) {
+		RemoteDisplayDeviceDlna *dlna = REMOTE_DISPLAY_DEVICE_DLNA (device);
+
+		switch (command) {
+		case COMMAND_OPEN_AND_PLAY:
+			remote_display_device_dlna_open_and_play (dlna, uri, position_ms, task);
+			break;
+		case COMMAND_PLAY:
+			remote_display_device_dlna_play (dlna, task);
+			break;
+		case COMMAND_PAUSE:
+			remote_display_device_dlna_pause (dlna, task);
+			break;
+		case COMMAND_STOP:
+			remote_display_device_dlna_stop (dlna, task);
+			break;
+		case COMMAND_SEEK:
+			remote_display_device_dlna_seek (dlna, position_ms, task);
+			break;
+		}
+	} else if (REMOTE_DISPLAY_IS_DEVICE_PROXY (device)) {
+		RemoteDisplayDeviceProxy *proxy = REMOTE_DISPLAY_DEVICE_PROXY (device);
+
+		switch (command) {
+		case COMMAND_OPEN_AND_PLAY:
+			remote_display_device_proxy_open_and_play (proxy, uri, position_ms, task);
+			break;
+		case COMMAND_PLAY:
+			remote_display_device_proxy_play (proxy, task);
+			break;
+		case COMMAND_PAUSE:
+			remote_display_device_proxy_pause (proxy, task);
+			break;
+		case COMMAND_STOP:
+			remote_display_device_proxy_stop (proxy, task);
+			break;
+		case COMMAND_SEEK:
+			remote_display_device_proxy_seek (proxy, position_ms, task);
+			break;
+		}
+	} else {
+		g_assert_not_reached ();
+	}
+}
+
+static void
+send_command_async (RemoteDisplayDevice *device,
+		    Command              command,
+		    const char          *uri,
+		    gdouble              position_ms,
+		    GCancellable        *cancellable,
+		    GAsyncReadyCallback  callback,
+		    gpointer             user_data,
+		    gpointer             source_tag)
+{
+	GTask *task;
+
+	task = g_task_new (device, cancellable, callback, user_data);
+	g_task_set_source_tag (task, source_tag);
+
+	/* RAOP receivers only play audio streams, and can't be controlled */
+	if (!(remote_display_device_get_capabilities (device) & REMOTE_DISPLAY_DEVICE_CAPABILITIES_VIDEO)) {
+		g_task_return_new_error (task, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_NOT_SUPPORTED,
+					 "Device '%s' does not support media playback",
+					 remote_display_device_get_name (device));
+		g_object_unref (task);
+		return;
+	}
+
+	if (g_task_return_error_if_cancelled (task)) {
+		g_object_unref (task);
+		return;
+	}
+
+	send_command (device, command, uri, position_ms, task);
+}
+
+static gboolean
+send_command_finish (RemoteDisplayDevice  *device,
+		     GAsyncResult         *result,
+		     gpointer              source_tag,
+		     GError              **error)
+{
+	g_return_val_if_fail (g_task_is_valid (result, device), FALSE);
+	g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) == source_tag, FALSE);
+
+	return g_task_propagate_boolean (G_TASK (result), error);
 }
 
 void
@@ -169,11 +378,7 @@ remote_display_device_open_and_play (RemoteDisplayDevice *device,
 	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE (device));
 	g_return_if_fail (remote_display_device_get_capabilities (device) & REMOTE_DISPLAY_DEVICE_CAPABILITIES_VIDEO);
 
-	if (REMOTE_DISPLAY_IS_DEVICE_AIRPLAY (device)) {
-		remote_display_device_airplay_open_and_play (REMOTE_DISPLAY_DEVICE_AIRPLAY (device), uri, position_ms);
-	} else {
-		g_assert_not_reached ();
-	}
+	send_command (device, COMMAND_OPEN_AND_PLAY, uri, position_ms, NULL);
 }
 
 void
@@ -182,11 +387,7 @@ remote_display_device_play (RemoteDisplayDevice *device)
 	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE (device));
 	g_return_if_fail (remote_display_device_get_capabilities (device) & REMOTE_DISPLAY_DEVICE_CAPABILITIES_VIDEO);
 
-	if (REMOTE_DISPLAY_IS_DEVICE_AIRPLAY (device)) {
-		remote_display_device_airplay_play (REMOTE_DISPLAY_DEVICE_AIRPLAY (device));
-	} else {
-		g_assert_not_reached ();
-	}
+	send_command (device, COMMAND_PLAY, NULL, 0, NULL);
 }
 
 void
@@ -195,11 +396,7 @@ remote_display_device_pause (RemoteDisplayDevice *device)
 	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE (device));
 	g_return_if_fail (remote_display_device_get_capabilities (device) & REMOTE_DISPLAY_DEVICE_CAPABILITIES_VIDEO);
 
-	if (REMOTE_DISPLAY_IS_DEVICE_AIRPLAY (device)) {
-		remote_display_device_airplay_pause (REMOTE_DISPLAY_DEVICE_AIRPLAY (device));
-	} else {
-		g_assert_not_reached ();
-	}
+	send_command (device, COMMAND_PAUSE, NULL, 0, NULL);
 }
 
 void
@@ -208,11 +405,7 @@ remote_display_device_stop (RemoteDisplayDevice *device)
 	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE (device));
 	g_return_if_fail (remote_display_device_get_capabilities (device) & REMOTE_DISPLAY_DEVICE_CAPABILITIES_VIDEO);
 
-	if (REMOTE_DISPLAY_IS_DEVICE_AIRPLAY (device)) {
-		remote_display_device_airplay_stop (REMOTE_DISPLAY_DEVICE_AIRPLAY (device));
-	} else {
-		g_assert_not_reached ();
-	}
+	send_command (device, COMMAND_STOP, NULL, 0, NULL);
 }
 
 void
@@ -222,11 +415,136 @@ remote_display_device_seek (RemoteDisplayDevice *device,
 	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE (device));
 	g_return_if_fail (remote_display_device_get_capabilities (device) & REMOTE_DISPLAY_DEVICE_CAPABILITIES_VIDEO);
 
-	if (REMOTE_DISPLAY_IS_DEVICE_AIRPLAY (device)) {
-		remote_display_device_airplay_seek (REMOTE_DISPLAY_DEVICE_AIRPLAY (device), position_ms);
-	} else {
-		g_assert_not_reached ();
-	}
+	send_command (device, COMMAND_SEEK, NULL, position_ms, NULL);
+}
+
+/**
+ * remote_display_device_open_and_play_async:
+ * @device: a #RemoteDisplayDevice
+ * @uri: the URI of the media to play
+ * @position_ms: the position to start playing from, in milliseconds
+ * @cancellable: (nullable): a #GCancellable, or %NULL
+ * @callback: called when the device accepted, or refused, the command
+ * @user_data: data for @callback
+ *
+ * Asynchronous version of remote_display_device_open_and_play(). The
+ * operation fails with %REMOTE_DISPLAY_ERROR_NOT_SUPPORTED if the device
+ * cannot play media, %REMOTE_DISPLAY_ERROR_UNREACHABLE if it could not be
+ * contacted, and %REMOTE_DISPLAY_ERROR_COMMAND_FAILED if it refused the
+ * command.
+ **/
+void
+remote_display_device_open_and_play_async (RemoteDisplayDevice *device,
+					   const char          *uri,
+					   guint64              position_ms,
+					   GCancellable        *cancellable,
+					   GAsyncReadyCallback  callback,
+					   gpointer             user_data)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE (device));
+	g_return_if_fail (uri != NULL);
+
+	send_command_async (device, COMMAND_OPEN_AND_PLAY, uri, position_ms,
+			    cancellable, callback, user_data,
+			    remote_display_device_open_and_play_async);
+}
+
+gboolean
+remote_display_device_open_and_play_finish (RemoteDisplayDevice  *device,
+					    GAsyncResult         *result,
+					    GError              **error)
+{
+	return send_command_finish (device, result,
+				    remote_display_device_open_and_play_async, error);
+}
+
+void
+remote_display_device_play_async (RemoteDisplayDevice *device,
+				  GCancellable        *cancellable,
+				  GAsyncReadyCallback  callback,
+				  gpointer             user_data)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE (device));
+
+	send_command_async (device, COMMAND_PLAY, NULL, 0,
+			    cancellable, callback, user_data,
+			    remote_display_device_play_async);
+}
+
+gboolean
+remote_display_device_play_finish (RemoteDisplayDevice  *device,
+				   GAsyncResult         *result,
+				   GError              **error)
+{
+	return send_command_finish (device, result,
+				    remote_display_device_play_async, error);
+}
+
+void
+remote_display_device_pause_async (RemoteDisplayDevice *device,
+				   GCancellable        *cancellable,
+				   GAsyncReadyCallback  callback,
+				   gpointer             user_data)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE (device));
+
+	send_command_async (device, COMMAND_PAUSE, NULL, 0,
+			    cancellable, callback, user_data,
+			    remote_display_device_pause_async);
+}
+
+gboolean
+remote_display_device_pause_finish (RemoteDisplayDevice  *device,
+				    GAsyncResult         *result,
+				    GError              **error)
+{
+	return send_command_finish (device, result,
+				    remote_display_device_pause_async, error);
+}
+
+void
+remote_display_device_stop_async (RemoteDisplayDevice *device,
+				  GCancellable        *cancellable,
+				  GAsyncReadyCallback  callback,
+				  gpointer             user_data)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE (device));
+
+	send_command_async (device, COMMAND_STOP, NULL, 0,
+			    cancellable, callback, user_data,
+			    remote_display_device_stop_async);
+}
+
+gboolean
+remote_display_device_stop_finish (RemoteDisplayDevice  *device,
+				   GAsyncResult         *result,
+				   GError              **error)
+{
+	return send_command_finish (device, result,
+				    remote_display_device_stop_async, error);
+}
+
+void
+remote_display_device_seek_async (RemoteDisplayDevice *device,
+				  gdouble              position_ms,
+				  GCancellable        *cancellable,
+				  GAsyncReadyCallback  callback,
+				  gpointer             user_data)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE (device));
+
+	send_command_async (device, COMMAND_SEEK, NULL, position_ms,
+			    cancellable, callback, user_data,
+			    remote_display_device_seek_async);
+}
+
+gboolean
+remote_display_device_seek_finish (RemoteDisplayDevice  *device,
+				   GAsyncResult         *result,
+				   GError              **error)
+{
+	return send_command_finish (device, result,
+				    remote_display_device_seek_async, error);
 }
 
 RemoteDisplayDeviceCapabilities
@@ -253,11 +571,39 @@ remote_display_device_set_password (RemoteDisplayDevice *device,
 #endif
 }
 
+gboolean
+remote_display_device_get_password_protected (RemoteDisplayDevice *device)
+{
+	RemoteDisplayDevicePrivate *priv;
+
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_DEVICE (device), FALSE);
+
+	priv = GET_PRIVATE (device);
+	return priv->password_protected;
+}
+
+/**
+ * remote_display_device_get_reachability:
+ * @device: a #RemoteDisplayDevice
+ *
+ * Return value: whether @device answered recently. Devices that
+ * stop answering disappear from the #RemoteDisplayManager without
+ * waiting for them to go away from the network.
+ **/
+RemoteDisplayDeviceReachability
+remote_display_device_get_reachability (RemoteDisplayDevice *device)
+{
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_DEVICE (device), REMOTE_DISPLAY_DEVICE_REACHABILITY_UNKNOWN);
+
+	return GET_PRIVATE (device)->reachability;
+}
+
 char *
 remote_display_device_to_string (RemoteDisplayDevice *device)
 {
 	GString *s;
 	RemoteDisplayDevicePrivate *priv;
+	guint i;
 
 	g_return_val_if_fail (REMOTE_DISPLAY_IS_DEVICE (device), NULL);
 
@@ -281,13 +627,31 @@ remote_display_device_to_string (RemoteDisplayDevice *device)
 		if (priv->caps & REMOTE_DISPLAY_DEVICE_CAPABILITIES_PHOTO)
 			g_string_append (s, "Photo ");
 		if (priv->caps & REMOTE_DISPLAY_DEVICE_CAPABILITIES_SCREEN)
-			g_string_append (s, "Screen");
+			g_string_append (s, "Screen ");
+		if (priv->caps & REMOTE_DISPLAY_DEVICE_CAPABILITIES_AUDIO)
+			g_string_append (s, "Audio");
 		g_string_append (s, "\n");
 	}
 	g_string_append_printf (s, "\tPassword protected: %s\n", priv->password_protected ? "true" : "false");
+	if (priv->provisional)
+		g_string_append (s, "\tProvisional: true\n");
+	for (i = 0; i < priv->candidates->len; i++) {
+		RemoteDisplayCandidate *candidate = g_ptr_array_index (priv->candidates, i);
+		char *address;
+
+		address = g_inet_address_to_string (candidate->address);
+		g_string_append_printf (s, "\tAddress: %s (interface %u)%s\n",
+					address, candidate->ifindex,
+					candidate == priv->best ? " (preferred)" : "");
+		g_free (address);
+	}
 
 	if (REMOTE_DISPLAY_IS_DEVICE_AIRPLAY (device))
 		return remote_display_device_airplay_add_to_string (REMOTE_DISPLAY_DEVICE_AIRPLAY (device), s);
+	if (REMOTE_DISPLAY_IS_DEVICE_RAOP (device))
+		return remote_display_device_raop_add_to_string (REMOTE_DISPLAY_DEVICE_RAOP (device), s);
+	if (REMOTE_DISPLAY_IS_DEVICE_DLNA (device))
+		return remote_display_device_dlna_add_to_string (REMOTE_DISPLAY_DEVICE_DLNA (device), s);
 
 	return g_string_free (s, FALSE);
 }
@@ -352,5 +716,530 @@ remote_display_device_set_capabilities (RemoteDisplayDevice             *device,
 	g_return_val_if_fail (REMOTE_DISPLAY_IS_DEVICE (device), FALSE);
 
 	priv = GET_PRIVATE (device);
+	if (priv->caps == caps)
+		return;
 	priv->caps = caps;
+	g_object_notify (G_OBJECT (device), "capabilities");
+}
+
+void
+remote_display_device_set_provisional (RemoteDisplayDevice *device,
+				       gboolean             provisional)
+{
+	RemoteDisplayDevicePrivate *priv;
+
+	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE (device));
+
+	priv = GET_PRIVATE (device);
+	if (priv->provisional == provisional)
+		return;
+	priv->provisional = provisional;
+	g_object_notify (G_OBJECT (device), "provisional");
+}
+
+static RemoteDisplayCandidate *
+find_candidate (RemoteDisplayDevicePrivate *priv,
+		guint                       ifindex,
+		GSocketFamily               family,
+		guint                      *index)
+{
+	guint i;
+
+	for (i = 0; i < priv->candidates->len; i++) {
+		RemoteDisplayCandidate *candidate = g_ptr_array_index (priv->candidates, i);
+
+		if (candidate->ifindex == ifindex &&
+		    g_inet_address_get_family (candidate->address) == family) {
+			if (index)
+				*index = i;
+			return candidate;
+		}
+	}
+
+	return NULL;
+}
+
+static void
+set_best_candidate (RemoteDisplayDevice    *device,
+		    RemoteDisplayCandidate *candidate)
+{
+	RemoteDisplayDevicePrivate *priv = GET_PRIVATE (device);
+	char *address;
+
+	if (priv->best == candidate)
+		return;
+	priv->best = candidate;
+	if (!candidate)
+		return;
+
+	address = g_inet_address_to_string (candidate->address);
+	g_debug ("Using %s on interface %u for '%s'", address, candidate->ifindex, priv->name);
+	g_free (address);
+
+	if (REMOTE_DISPLAY_IS_DEVICE_AIRPLAY (device))
+		remote_display_device_airplay_candidate_changed (REMOTE_DISPLAY_DEVICE_AIRPLAY (device));
+}
+
+static GSocketAddress *
+candidate_to_socket_address (const RemoteDisplayCandidate *candidate,
+			     guint16                       port)
+{
+	guint32 scope_id = 0;
+
+	/* Link-local IPv6 addresses need to know which interface to use */
+	if (g_inet_address_get_family (candidate->address) == G_SOCKET_FAMILY_IPV6)
+		scope_id = candidate->ifindex;
+
+	return g_object_new (G_TYPE_INET_SOCKET_ADDRESS,
+			     "address", candidate->address,
+			     "port", port ? port : candidate->port,
+			     "scope-id", scope_id,
+			     NULL);
+}
+
+typedef struct {
+	RemoteDisplayDevice *device;
+	GCancellable *cancellable;
+	guint ifindex;
+	GSocketFamily family;
+	gint64 started;
+} RaceAttempt;
+
+static void
+race_cb (GObject      *source,
+	 GAsyncResult *result,
+	 gpointer      user_data)
+{
+	RaceAttempt *attempt = user_data;
+	RemoteDisplayDevicePrivate *priv = GET_PRIVATE (attempt->device);
+	GSocketConnection *connection;
+	GError *error = NULL;
+
+	connection = g_socket_client_connect_finish (G_SOCKET_CLIENT (source), result, &error);
+	if (connection) {
+		RemoteDisplayCandidate *candidate;
+
+		/* The first one to connect wins, and stops the others */
+		candidate = find_candidate (priv, attempt->ifindex, attempt->family, NULL);
+		if (candidate && !g_cancellable_is_cancelled (attempt->cancellable)) {
+			g_debug ("Interface %u connected to '%s' first, in %" G_GINT64_FORMAT " µs",
+				 attempt->ifindex, priv->name, g_get_monotonic_time () - attempt->started);
+			g_cancellable_cancel (attempt->cancellable);
+			set_best_candidate (attempt->device, candidate);
+		}
+		remote_display_device_mark_alive (attempt->device);
+		g_io_stream_close (G_IO_STREAM (connection), NULL, NULL);
+		g_object_unref (connection);
+	} else {
+		if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			g_debug ("Failed to connect to '%s' on interface %u: %s",
+				 priv->name, attempt->ifindex, error->message);
+		g_error_free (error);
+	}
+
+	g_object_unref (attempt->cancellable);
+	g_object_unref (attempt->device);
+	g_free (attempt);
+}
+
+static gboolean
+race_timeout_cb (gpointer user_data)
+{
+	RemoteDisplayDevice *device = user_data;
+	RemoteDisplayDevicePrivate *priv = GET_PRIVATE (device);
+	GSocketClient *client;
+	guint i;
+
+	priv->race_id = 0;
+	if (priv->race_cancellable) {
+		g_cancellable_cancel (priv->race_cancellable);
+		g_object_unref (priv->race_cancellable);
+	}
+	priv->race_cancellable = g_cancellable_new ();
+
+	client = g_socket_client_new ();
+	g_socket_client_set_timeout (client, RACE_TIMEOUT);
+	for (i = 0; i < priv->candidates->len; i++) {
+		RemoteDisplayCandidate *candidate = g_ptr_array_index (priv->candidates, i);
+		GSocketAddress *address;
+		RaceAttempt *attempt;
+
+		attempt = g_new0 (RaceAttempt, 1);
+		attempt->device = g_object_ref (device);
+		attempt->cancellable = g_object_ref (priv->race_cancellable);
+		attempt->ifindex = candidate->ifindex;
+		attempt->family = g_inet_address_get_family (candidate->address);
+		attempt->started = g_get_monotonic_time ();
+
+		address = candidate_to_socket_address (candidate, 0);
+		g_socket_client_connect_async (client, G_SOCKET_CONNECTABLE (address),
+					       priv->race_cancellable, race_cb, attempt);
+		g_object_unref (address);
+	}
+	g_object_unref (client);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+schedule_race (RemoteDisplayDevice *device)
+{
+	RemoteDisplayDevicePrivate *priv = GET_PRIVATE (device);
+
+	if (priv->race_id != 0)
+		g_source_remove (priv->race_id);
+	priv->race_id = 0;
+
+	if (priv->candidates->len < 2)
+		return;
+	priv->race_id = g_timeout_add (RACE_DELAY, race_timeout_cb, device);
+}
+
+static void
+set_reachability (RemoteDisplayDevice             *device,
+		  RemoteDisplayDeviceReachability  reachability)
+{
+	RemoteDisplayDevicePrivate *priv = GET_PRIVATE (device);
+
+	if (priv->reachability == reachability)
+		return;
+	priv->reachability = reachability;
+	g_object_notify (G_OBJECT (device), "reachability");
+}
+
+/**
+ * remote_display_device_mark_alive:
+ * @device: a #RemoteDisplayDevice
+ *
+ * Called when @device answered on any connection, which saves
+ * probing it for a while.
+ **/
+void
+remote_display_device_mark_alive (RemoteDisplayDevice *device)
+{
+	RemoteDisplayDevicePrivate *priv;
+
+	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE (device));
+
+	priv = GET_PRIVATE (device);
+	priv->last_alive = g_get_monotonic_time ();
+	priv->probe_failures = 0;
+	set_reachability (device, REMOTE_DISPLAY_DEVICE_REACHABILITY_REACHABLE);
+}
+
+static void start_probe (RemoteDisplayDevice *device);
+
+static void
+probe_cb (GObject      *source,
+	  GAsyncResult *result,
+	  gpointer      user_data)
+{
+	RemoteDisplayDevice *device = user_data;
+	RemoteDisplayDevicePrivate *priv = GET_PRIVATE (device);
+	GSocketConnection *connection;
+	GError *error = NULL;
+
+	connection = g_socket_client_connect_finish (G_SOCKET_CLIENT (source), result, &error);
+	if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		g_error_free (error);
+		g_object_unref (device);
+		return;
+	}
+	g_clear_object (&priv->probe_cancellable);
+
+	if (connection) {
+		remote_display_device_mark_alive (device);
+		g_io_stream_close (G_IO_STREAM (connection), NULL, NULL);
+		g_object_unref (connection);
+	} else {
+		g_debug ("Probing '%s' failed: %s", priv->name, error->message);
+		g_error_free (error);
+
+		/* One lost SYN shouldn't make the device disappear */
+		if (++priv->probe_failures < PROBE_FAILURES)
+			start_probe (device);
+		else
+			set_reachability (device, REMOTE_DISPLAY_DEVICE_REACHABILITY_UNREACHABLE);
+	}
+
+	g_object_unref (device);
+}
+
+/* Connecting to the service port is enough to know that the
+ * device is still there, without talking its protocol */
+static void
+start_probe (RemoteDisplayDevice *device)
+{
+	RemoteDisplayDevicePrivate *priv = GET_PRIVATE (device);
+	GSocketAddress *address;
+	GSocketClient *client;
+
+	if (priv->probe_cancellable || !priv->best)
+		return;
+
+	priv->last_probe = g_get_monotonic_time ();
+	priv->probe_cancellable = g_cancellable_new ();
+
+	client = g_socket_client_new ();
+	g_socket_client_set_timeout (client, PROBE_TIMEOUT);
+	address = candidate_to_socket_address (priv->best, 0);
+	g_socket_client_connect_async (client, G_SOCKET_CONNECTABLE (address),
+				       priv->probe_cancellable, probe_cb, g_object_ref (device));
+	g_object_unref (address);
+	g_object_unref (client);
+}
+
+/**
+ * remote_display_device_mark_failed:
+ * @device: a #RemoteDisplayDevice
+ *
+ * Called when a connection to @device failed, to check straight
+ * away whether the device is still there.
+ **/
+void
+remote_display_device_mark_failed (RemoteDisplayDevice *device)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE (device));
+
+	start_probe (device);
+}
+
+/* Called by the backends when the device refused a command, or
+ * couldn't be reached to send it */
+void
+remote_display_device_add_command_failure (RemoteDisplayDevice *device)
+{
+	RemoteDisplayDevicePrivate *priv;
+
+	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE (device));
+
+	priv = GET_PRIVATE (device);
+	priv->command_failures++;
+}
+
+guint
+remote_display_device_get_command_failures (RemoteDisplayDevice *device)
+{
+	RemoteDisplayDevicePrivate *priv;
+
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_DEVICE (device), 0);
+
+	priv = GET_PRIVATE (device);
+	return priv->command_failures;
+}
+
+/* The commands queued or in flight */
+guint
+remote_display_device_get_pending_actions (RemoteDisplayDevice *device)
+{
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_DEVICE (device), 0);
+
+	if (REMOTE_DISPLAY_IS_DEVICE_AIRPLAY (device))
+		return remote_display_device_airplay_get_pending_actions (REMOTE_DISPLAY_DEVICE_AIRPLAY (device));
+	if (REMOTE_DISPLAY_IS_DEVICE_DLNA (device))
+		return remote_display_device_dlna_get_pending_actions (REMOTE_DISPLAY_DEVICE_DLNA (device));
+	if (REMOTE_DISPLAY_IS_DEVICE_PROXY (device))
+		return remote_display_device_proxy_get_pending_actions (REMOTE_DISPLAY_DEVICE_PROXY (device));
+	return 0;
+}
+
+/**
+ * remote_display_device_check_liveness:
+ * @device: a #RemoteDisplayDevice
+ *
+ * Probes @device if nothing was heard from it for a while. Called
+ * regularly by the #RemoteDisplayManager.
+ **/
+void
+remote_display_device_check_liveness (RemoteDisplayDevice *device)
+{
+	RemoteDisplayDevicePrivate *priv;
+	gint64 now, idle;
+
+	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE (device));
+
+	priv = GET_PRIVATE (device);
+	now = g_get_monotonic_time ();
+	idle = (gint64) LIVENESS_IDLE * G_USEC_PER_SEC;
+	if (now - priv->last_alive < idle || now - priv->last_probe < idle)
+		return;
+
+	priv->probe_failures = 0;
+	start_probe (device);
+}
+
+/**
+ * remote_display_device_add_candidate:
+ * @device: a #RemoteDisplayDevice
+ * @ifindex: the interface the device was seen on
+ * @address: the address of the device on that interface
+ * @hostname: the mDNS host name of the device
+ * @port: the port of the service
+ *
+ * Adds, or updates, a way to reach @device. When there's more than
+ * one, they are all tried in parallel and the first one to connect
+ * is used from then on.
+ **/
+void
+remote_display_device_add_candidate (RemoteDisplayDevice *device,
+				     guint                ifindex,
+				     GInetAddress        *address,
+				     const char          *hostname,
+				     guint16              port)
+{
+	RemoteDisplayDevicePrivate *priv;
+	RemoteDisplayCandidate *candidate;
+
+	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE (device));
+	g_return_if_fail (G_IS_INET_ADDRESS (address));
+
+	priv = GET_PRIVATE (device);
+
+	candidate = find_candidate (priv, ifindex, g_inet_address_get_family (address), NULL);
+	if (candidate) {
+		if (g_inet_address_equal (candidate->address, address) &&
+		    candidate->port == port)
+			return;
+
+		g_object_unref (candidate->address);
+		candidate->address = g_object_ref (address);
+		g_free (candidate->hostname);
+		candidate->hostname = g_strdup (hostname);
+		candidate->port = port;
+
+		/* Let the subclass know that the address changed */
+		if (candidate == priv->best) {
+			priv->best = NULL;
+			set_best_candidate (device, candidate);
+		}
+	} else {
+		candidate = g_new0 (RemoteDisplayCandidate, 1);
+		candidate->ifindex = ifindex;
+		candidate->address = g_object_ref (address);
+		candidate->hostname = g_strdup (hostname);
+		candidate->port = port;
+		g_ptr_array_add (priv->candidates, candidate);
+
+		if (!priv->best)
+			set_best_candidate (device, candidate);
+	}
+
+	schedule_race (device);
+}
+
+/**
+ * remote_display_device_remove_candidate:
+ * @device: a #RemoteDisplayDevice
+ * @ifindex: the interface the device went away from
+ * @family: the address family the device went away from
+ *
+ * Return value: the number of ways to reach @device left
+ **/
+guint
+remote_display_device_remove_candidate (RemoteDisplayDevice *device,
+					guint                ifindex,
+					GSocketFamily        family)
+{
+	RemoteDisplayDevicePrivate *priv;
+	RemoteDisplayCandidate *candidate;
+	guint index;
+
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_DEVICE (device), 0);
+
+	priv = GET_PRIVATE (device);
+
+	candidate = find_candidate (priv, ifindex, family, &index);
+	if (!candidate)
+		return priv->candidates->len;
+
+	if (candidate == priv->best)
+		priv->best = NULL;
+	g_ptr_array_remove_index (priv->candidates, index);
+
+	if (!priv->best && priv->candidates->len > 0)
+		set_best_candidate (device, g_ptr_array_index (priv->candidates, 0));
+	else if (!priv->best && REMOTE_DISPLAY_IS_DEVICE_AIRPLAY (device))
+		/* There's no way left to reach it */
+		remote_display_device_airplay_candidate_changed (REMOTE_DISPLAY_DEVICE_AIRPLAY (device));
+	schedule_race (device);
+
+	return priv->candidates->len;
+}
+
+const RemoteDisplayCandidate *
+remote_display_device_get_best_candidate (RemoteDisplayDevice *device)
+{
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_DEVICE (device), NULL);
+
+	return GET_PRIVATE (device)->best;
+}
+
+/**
+ * remote_display_device_get_best_address:
+ * @device: a #RemoteDisplayDevice
+ * @port: the port to connect to, or 0 for the service's
+ *
+ * Return value: (transfer full): the address to connect to @device,
+ * or %NULL if it has none.
+ **/
+GSocketAddress *
+remote_display_device_get_best_address (RemoteDisplayDevice *device,
+					guint16              port)
+{
+	RemoteDisplayDevicePrivate *priv;
+
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_DEVICE (device), NULL);
+
+	priv = GET_PRIVATE (device);
+	if (!priv->best)
+		return NULL;
+	return candidate_to_socket_address (priv->best, port);
+}
+
+char *
+remote_display_candidate_to_uri_host (const RemoteDisplayCandidate *candidate)
+{
+	char *address, *ret;
+
+	/* Zone IDs in URIs aren't widely supported, let
+	 * the resolver handle link-local addresses */
+	if (g_inet_address_get_is_link_local (candidate->address))
+		return g_strdup (candidate->hostname);
+
+	address = g_inet_address_to_string (candidate->address);
+	if (g_inet_address_get_family (candidate->address) != G_SOCKET_FAMILY_IPV6)
+		return address;
+
+	ret = g_strdup_printf ("[%s]", address);
+	g_free (address);
+	return ret;
+}
+
+GInetAddress *
+remote_display_avahi_address_to_address (const AvahiAddress *address)
+{
+	switch (address->proto) {
+	case AVAHI_PROTO_INET:
+		/* ->address is already in network byte order */
+		return g_inet_address_new_from_bytes ((const guint8 *) &address->data.ipv4.address,
+						      G_SOCKET_FAMILY_IPV4);
+	case AVAHI_PROTO_INET6:
+		return g_inet_address_new_from_bytes (address->data.ipv6.address,
+						      G_SOCKET_FAMILY_IPV6);
+	default:
+		return NULL;
+	}
+}
+
+GSocketFamily
+remote_display_avahi_protocol_to_family (AvahiProtocol protocol)
+{
+	switch (protocol) {
+	case AVAHI_PROTO_INET:
+		return G_SOCKET_FAMILY_IPV4;
+	case AVAHI_PROTO_INET6:
+		return G_SOCKET_FAMILY_IPV6;
+	default:
+		g_assert_not_reached ();
+	}
 }
@@ -46,7 +46,8 @@ typedef enum {
 	REMOTE_DISPLAY_DEVICE_CAPABILITIES_NONE   = 0,
 	REMOTE_DISPLAY_DEVICE_CAPABILITIES_VIDEO  = 1 << 1,
 	REMOTE_DISPLAY_DEVICE_CAPABILITIES_PHOTO  = 1 << 2,
-	REMOTE_DISPLAY_DEVICE_CAPABILITIES_SCREEN = 1 << 3
+	REMOTE_DISPLAY_DEVICE_CAPABILITIES_SCREEN = 1 << 3,
+	REMOTE_DISPLAY_DEVICE_CAPABILITIES_AUDIO  = 1 << 4
 } RemoteDisplayDeviceCapabilities;
 
 typedef enum {
@@ -56,11 +57,18 @@ typedef enum {
 	REMOTE_DISPLAY_DEVICE_STATE_PAUSED
 } RemoteDisplayDeviceState;
 
+typedef enum {
+	REMOTE_DISPLAY_DEVICE_REACHABILITY_UNKNOWN,
+	REMOTE_DISPLAY_DEVICE_REACHABILITY_REACHABLE,
+	REMOTE_DISPLAY_DEVICE_REACHABILITY_UNREACHABLE
+} RemoteDisplayDeviceReachability;
+
 char *remote_display_device_to_string (RemoteDisplayDevice *device);
 const char *remote_display_device_get_name (RemoteDisplayDevice *device);
 RemoteDisplayDeviceCapabilities remote_display_device_get_capabilities (RemoteDisplayDevice *device);
 void remote_display_device_set_password (RemoteDisplayDevice *device, const char *password);
 gboolean remote_display_device_get_password_protected (RemoteDisplayDevice *device);
+RemoteDisplayDeviceReachability remote_display_device_get_reachability (RemoteDisplayDevice *device);
 void remote_display_device_open_and_play (RemoteDisplayDevice *device,
 					  const char          *uri,
 					  guint64              position_ms);
@@ -70,6 +78,45 @@ void remote_display_device_stop (RemoteDisplayDevice *device);
 void remote_display_device_seek (RemoteDisplayDevice *device,
 				 gdouble              position_ms);
 
+void     remote_display_device_open_and_play_async  (RemoteDisplayDevice  *device,
+						     const char           *uri,
+						     guint64               position_ms,
+						     GCancellable         *cancellable,
+						     GAsyncReadyCallback   callback,
+						     gpointer              user_data);
+gboolean remote_display_device_open_and_play_finish (RemoteDisplayDevice  *device,
+						     GAsyncResult         *result,
+						     GError              **error);
+void     remote_display_device_play_async           (RemoteDisplayDevice  *device,
+						     GCancellable         *cancellable,
+						     GAsyncReadyCallback   callback,
+						     gpointer              user_data);
+gboolean remote_display_device_play_finish          (RemoteDisplayDevice  *device,
+						     GAsyncResult         *result,
+						     GError              **error);
+void     remote_display_device_pause_async          (RemoteDisplayDevice  *device,
+						     GCancellable         *cancellable,
+						     GAsyncReadyCallback   callback,
+						     gpointer              user_data);
+gboolean remote_display_device_pause_finish         (RemoteDisplayDevice  *device,
+						     GAsyncResult         *result,
+						     GError              **error);
+void     remote_display_device_stop_async           (RemoteDisplayDevice  *device,
+						     GCancellable         *cancellable,
+						     GAsyncReadyCallback   callback,
+						     gpointer              user_data);
+gboolean remote_display_device_stop_finish          (RemoteDisplayDevice  *device,
+						     GAsyncResult         *result,
+						     GError              **error);
+void     remote_display_device_seek_async           (RemoteDisplayDevice  *device,
+						     gdouble               position_ms,
+						     GCancellable         *cancellable,
+						     GAsyncReadyCallback   callback,
+						     gpointer              user_data);
+gboolean remote_display_device_seek_finish          (RemoteDisplayDevice  *device,
+						     GAsyncResult         *result,
+						     GError              **error);
+
 G_END_DECLS
 
 #endif /* __REMOTE_DISPLAY_DEVICE_H__ */
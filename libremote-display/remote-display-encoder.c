@@ -0,0 +1,311 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <gio/gio.h>
+
+#ifdef HAVE_X264
+#include <x264.h>
+#endif
+
+#include <libremote-display/remote-display-error.h>
+#include <libremote-display/remote-display-encoder.h>
+#include <libremote-display/remote-display-kernels.h>
+
+struct _RemoteDisplayEncoder {
+	guint width;
+	guint height;
+	guint fps;
+	guint64 pts;
+
+	/* I420 planes */
+	guint8 *planes[3];
+	guint strides[3];
+
+	GBytes *codec_data;
+#ifdef HAVE_X264
+	x264_t *x264;
+#endif
+};
+
+#ifdef HAVE_X264
+static void
+convert_rect_to_i420 (RemoteDisplayEncoder *encoder,
+		      RemoteDisplayFrame   *frame,
+		      guint                 x1,
+		      guint                 y1,
+		      guint                 x2,
+		      guint                 y2)
+{
+	const RemoteDisplayKernels *kernels;
+	const guint8 *src;
+	guint stride;
+	gboolean bgrx;
+
+	src = remote_display_frame_get_data (frame);
+	stride = remote_display_frame_get_stride (frame);
+	bgrx = (remote_display_frame_get_format (frame) == REMOTE_DISPLAY_FRAME_FORMAT_BGRX);
+
+	kernels = remote_display_kernels_get_default ();
+	kernels->rgbx_to_i420 (src + y1 * stride + x1 * 4, stride, bgrx,
+			       x2 - x1, y2 - y1,
+			       encoder->planes[0] + y1 * encoder->strides[0] + x1, encoder->strides[0],
+			       encoder->planes[1] + y1 / 2 * encoder->strides[1] + x1 / 2, encoder->strides[1],
+			       encoder->planes[2] + y1 / 2 * encoder->strides[2] + x1 / 2, encoder->strides[2]);
+}
+
+/* The I420 planes are kept from one frame to the next, so only the
+ * damaged areas need converting. Rectangles are widened to even
+ * coordinates as chroma is subsampled 2x2. */
+static void
+convert_to_i420 (RemoteDisplayEncoder    *encoder,
+		 RemoteDisplayFrame      *frame,
+		 const RemoteDisplayRect *damage,
+		 guint                    n_damage)
+{
+	guint i;
+
+	if (damage == NULL) {
+		convert_rect_to_i420 (encoder, frame, 0, 0, encoder->width, encoder->height);
+		return;
+	}
+
+	for (i = 0; i < n_damage; i++) {
+		guint x1, y1, x2, y2;
+
+		x1 = damage[i].x & ~1;
+		y1 = damage[i].y & ~1;
+		x2 = MIN ((guint) (damage[i].x + damage[i].width + 1) & ~1, encoder->width);
+		y2 = MIN ((guint) (damage[i].y + damage[i].height + 1) & ~1, encoder->height);
+		if (x1 >= x2 || y1 >= y2)
+			continue;
+		convert_rect_to_i420 (encoder, frame, x1, y1, x2, y2);
+	}
+}
+
+static GBytes *
+build_avcc (const guint8 *sps, gsize sps_len,
+	    const guint8 *pps, gsize pps_len)
+{
+	GByteArray *avcc;
+	guint8 header[8];
+
+	avcc = g_byte_array_sized_new (11 + sps_len + pps_len);
+
+	header[0] = 1;                         /* configurationVersion */
+	header[1] = sps[1];                    /* AVCProfileIndication */
+	header[2] = sps[2];                    /* profile_compatibility */
+	header[3] = sps[3];                    /* AVCLevelIndication */
+	header[4] = 0xff;                      /* lengthSizeMinusOne = 3 */
+	header[5] = 0xe1;                      /* numOfSequenceParameterSets = 1 */
+	header[6] = (sps_len >> 8) & 0xff;
+	header[7] = sps_len & 0xff;
+	g_byte_array_append (avcc, header, 8);
+	g_byte_array_append (avcc, sps, sps_len);
+
+	header[0] = 1;                         /* numOfPictureParameterSets */
+	header[1] = (pps_len >> 8) & 0xff;
+	header[2] = pps_len & 0xff;
+	g_byte_array_append (avcc, header, 3);
+	g_byte_array_append (avcc, pps, pps_len);
+
+	return g_byte_array_free_to_bytes (avcc);
+}
+#endif
+
+RemoteDisplayEncoder *
+remote_display_encoder_new (guint    width,
+			    guint    height,
+			    guint    fps,
+			    guint    bitrate_kbps,
+			    GError **error)
+{
+#ifdef HAVE_X264
+	RemoteDisplayEncoder *encoder;
+	x264_param_t param;
+	x264_nal_t *nals;
+	const guint8 *sps = NULL, *pps = NULL;
+	gsize sps_len = 0, pps_len = 0;
+	int n_nals, i;
+
+	/* 4:2:0 needs even dimensions, drop the odd line or column */
+	width &= ~1;
+	height &= ~1;
+	if (width == 0 || height == 0 || fps == 0) {
+		g_set_error (error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_INVALID_ARGUMENTS,
+			     "Invalid encoder size %dx%d@%d", width, height, fps);
+		return NULL;
+	}
+
+	x264_param_default_preset (&param, "ultrafast", "zerolatency");
+	param.i_width = width;
+	param.i_height = height;
+	param.i_csp = X264_CSP_I420;
+	param.i_fps_num = fps;
+	param.i_fps_den = 1;
+	param.i_keyint_max = fps * 2;
+	param.b_intra_refresh = 1;
+	param.b_repeat_headers = 0;
+	param.b_annexb = 0;
+	param.b_vfr_input = 0;
+	param.rc.i_rc_method = X264_RC_ABR;
+	param.rc.i_bitrate = bitrate_kbps;
+	param.rc.i_vbv_max_bitrate = bitrate_kbps;
+	/* One frame worth of VBV, so a single frame can't clog the link */
+	param.rc.i_vbv_buffer_size = MAX (bitrate_kbps / fps, 1);
+	x264_param_apply_profile (&param, "high");
+
+	encoder = g_new0 (RemoteDisplayEncoder, 1);
+	encoder->width = width;
+	encoder->height = height;
+	encoder->fps = fps;
+	encoder->x264 = x264_encoder_open (&param);
+	if (!encoder->x264) {
+		g_set_error (error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_INVALID_ARGUMENTS,
+			     "Could not create H.264 encoder for %dx%d@%d", width, height, fps);
+		g_free (encoder);
+		return NULL;
+	}
+
+	if (x264_encoder_headers (encoder->x264, &nals, &n_nals) < 0) {
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+				     "Could not get H.264 headers");
+		remote_display_encoder_free (encoder);
+		return NULL;
+	}
+	/* Skip the 4-byte length prefix of each NAL */
+	for (i = 0; i < n_nals; i++) {
+		if (nals[i].i_type == NAL_SPS) {
+			sps = nals[i].p_payload + 4;
+			sps_len = nals[i].i_payload - 4;
+		} else if (nals[i].i_type == NAL_PPS) {
+			pps = nals[i].p_payload + 4;
+			pps_len = nals[i].i_payload - 4;
+		}
+	}
+	g_assert (sps && pps);
+	encoder->codec_data = build_avcc (sps, sps_len, pps, pps_len);
+
+	encoder->strides[0] = width;
+	encoder->strides[1] = width / 2;
+	encoder->strides[2] = width / 2;
+	encoder->planes[0] = g_malloc (width * height * 3 / 2);
+	encoder->planes[1] = encoder->planes[0] + width * height;
+	encoder->planes[2] = encoder->planes[1] + width * height / 4;
+
+	return encoder;
+#else
+	g_set_error_literal (error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_NOT_SUPPORTED,
+			     "Built without H.264 encoding support");
+	return NULL;
+#endif
+}
+
+void
+remote_display_encoder_free (RemoteDisplayEncoder *encoder)
+{
+	if (!encoder)
+		return;
+
+#ifdef HAVE_X264
+	if (encoder->x264)
+		x264_encoder_close (encoder->x264);
+#endif
+	g_clear_pointer (&encoder->codec_data, g_bytes_unref);
+	g_free (encoder->planes[0]);
+	g_free (encoder);
+}
+
+guint
+remote_display_encoder_get_width (RemoteDisplayEncoder *encoder)
+{
+	return encoder->width;
+}
+
+guint
+remote_display_encoder_get_height (RemoteDisplayEncoder *encoder)
+{
+	return encoder->height;
+}
+
+GBytes *
+remote_display_encoder_get_codec_data (RemoteDisplayEncoder *encoder)
+{
+	return g_bytes_ref (encoder->codec_data);
+}
+
+/* damage is NULL if the whole frame needs converting, an empty
+ * damage list produces a frame made of skipped macroblocks */
+GBytes *
+remote_display_encoder_encode (RemoteDisplayEncoder     *encoder,
+			       RemoteDisplayFrame       *frame,
+			       const RemoteDisplayRect  *damage,
+			       guint                     n_damage,
+			       gboolean                 *keyframe,
+			       GError                  **error)
+{
+#ifdef HAVE_X264
+	x264_picture_t pic_in, pic_out;
+	x264_nal_t *nals;
+	int n_nals, size, i;
+
+	if (remote_display_frame_get_width (frame) < encoder->width ||
+	    remote_display_frame_get_height (frame) < encoder->height) {
+		g_set_error (error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_INVALID_ARGUMENTS,
+			     "Frame size %dx%d smaller than encoder size %dx%d",
+			     remote_display_frame_get_width (frame),
+			     remote_display_frame_get_height (frame),
+			     encoder->width, encoder->height);
+		return NULL;
+	}
+
+	convert_to_i420 (encoder, frame, damage, n_damage);
+
+	x264_picture_init (&pic_in);
+	pic_in.img.i_csp = X264_CSP_I420;
+	pic_in.img.i_plane = 3;
+	for (i = 0; i < 3; i++) {
+		pic_in.img.plane[i] = encoder->planes[i];
+		pic_in.img.i_stride[i] = encoder->strides[i];
+	}
+	pic_in.i_pts = encoder->pts++;
+
+	size = x264_encoder_encode (encoder->x264, &nals, &n_nals, &pic_in, &pic_out);
+	if (size < 0) {
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+				     "H.264 encoding failed");
+		return NULL;
+	}
+
+	if (keyframe)
+		*keyframe = pic_out.b_keyframe;
+
+	/* x264 guarantees that the NAL payloads are contiguous */
+	if (size == 0)
+		return g_bytes_new (NULL, 0);
+	return g_bytes_new (nals[0].p_payload, size);
+#else
+	g_set_error_literal (error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_NOT_SUPPORTED,
+			     "Built without H.264 encoding support");
+	return NULL;
+#endif
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __REMOTE_DISPLAY_ENCODER_H__
+#define __REMOTE_DISPLAY_ENCODER_H__
+
+#include <glib.h>
+#include <libremote-display/remote-display-frame-source.h>
+
+G_BEGIN_DECLS
+
+/* Software H.264 encoder tuned for latency: no B-frames, no lookahead,
+ * periodic intra refresh instead of large IDR frames. Output is AVCC
+ * (4-byte big-endian NAL lengths), codec data is an avcC record. */
+typedef struct _RemoteDisplayEncoder RemoteDisplayEncoder;
+
+RemoteDisplayEncoder *remote_display_encoder_new            (guint                  width,
+							     guint                  height,
+							     guint                  fps,
+							     guint                  bitrate_kbps,
+							     GError               **error);
+void                  remote_display_encoder_free           (RemoteDisplayEncoder  *encoder);
+guint                 remote_display_encoder_get_width      (RemoteDisplayEncoder  *encoder);
+guint                 remote_display_encoder_get_height     (RemoteDisplayEncoder  *encoder);
+GBytes               *remote_display_encoder_get_codec_data (RemoteDisplayEncoder  *encoder);
+GBytes               *remote_display_encoder_encode         (RemoteDisplayEncoder     *encoder,
+							     RemoteDisplayFrame       *frame,
+							     const RemoteDisplayRect  *damage,
+							     guint                     n_damage,
+							     gboolean                 *keyframe,
+							     GError                  **error);
+
+G_END_DECLS
+
+#endif /* __REMOTE_DISPLAY_ENCODER_H__ */
@@ -20,6 +20,7 @@
 
  */
 
+#include <gio/gio.h>
 #include <libremote-display/remote-display-error.h>
 
 /**
@@ -33,17 +34,29 @@
 /**
  * remote_display_error_quark:
  *
- * Gets the remote-display error quark.
+ * Gets the remote-display error quark. The errors keep their
+ * code when going through the D-Bus service.
  *
  * Return value: a #GQuark.
  **/
+static const GDBusErrorEntry dbus_error_entries[] = {
+	{ REMOTE_DISPLAY_ERROR_PARSE,             "org.gnome.RemoteDisplay.Error.Parse" },
+	{ REMOTE_DISPLAY_ERROR_NOT_SUPPORTED,     "org.gnome.RemoteDisplay.Error.NotSupported" },
+	{ REMOTE_DISPLAY_ERROR_INVALID_ARGUMENTS, "org.gnome.RemoteDisplay.Error.InvalidArguments" },
+	{ REMOTE_DISPLAY_ERROR_INTERNAL_SERVER,   "org.gnome.RemoteDisplay.Error.InternalServer" },
+	{ REMOTE_DISPLAY_ERROR_NOT_CONNECTED,     "org.gnome.RemoteDisplay.Error.NotConnected" },
+	{ REMOTE_DISPLAY_ERROR_UNREACHABLE,       "org.gnome.RemoteDisplay.Error.Unreachable" },
+	{ REMOTE_DISPLAY_ERROR_COMMAND_FAILED,    "org.gnome.RemoteDisplay.Error.CommandFailed" }
+};
+
 GQuark
 remote_display_error_quark (void)
 {
-	static GQuark quark;
-	if (!quark)
-		quark = g_quark_from_static_string ("remote_display_error");
+	static volatile gsize quark = 0;
+
+	g_dbus_error_register_error_domain ("remote_display_error", &quark,
+					    dbus_error_entries, G_N_ELEMENTS (dbus_error_entries));
 
-	return quark;
+	return (GQuark) quark;
 }
 
@@ -41,6 +41,9 @@ G_BEGIN_DECLS
  * @REMOTE_DISPLAY_ERROR_NOT_SUPPORTED: The request made was not supported.
  * @REMOTE_DISPLAY_ERROR_INVALID_ARGUMENTS: The request made contained invalid arguments.
  * @REMOTE_DISPLAY_ERROR_INTERNAL_SERVER: The server encountered an (possibly unrecoverable) internal error.
+ * @REMOTE_DISPLAY_ERROR_NOT_CONNECTED: The device has no media session to control.
+ * @REMOTE_DISPLAY_ERROR_UNREACHABLE: The device could not be contacted.
+ * @REMOTE_DISPLAY_ERROR_COMMAND_FAILED: The device refused the command.
  *
  * Error codes returned by remote-display functions.
  **/
@@ -48,7 +51,10 @@ typedef enum {
 	REMOTE_DISPLAY_ERROR_PARSE,
 	REMOTE_DISPLAY_ERROR_NOT_SUPPORTED,
 	REMOTE_DISPLAY_ERROR_INVALID_ARGUMENTS,
-	REMOTE_DISPLAY_ERROR_INTERNAL_SERVER
+	REMOTE_DISPLAY_ERROR_INTERNAL_SERVER,
+	REMOTE_DISPLAY_ERROR_NOT_CONNECTED,
+	REMOTE_DISPLAY_ERROR_UNREACHABLE,
+	REMOTE_DISPLAY_ERROR_COMMAND_FAILED
 } RemoteDisplayError;
 
 GQuark remote_display_error_quark (void);
@@ -0,0 +1,318 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <libremote-display/remote-display-frame-source.h>
+
+struct _RemoteDisplayFrame {
+	volatile gint ref_count;
+	RemoteDisplayFrameFormat format;
+	guint width;
+	guint height;
+	guint stride;
+	GBytes *data;
+	gint64 capture_time;                   /* monotonic, in µs */
+
+	/* If has_damage is FALSE, the whole frame should be considered
+	 * changed, otherwise only the n_damage rectangles in damage */
+	gboolean has_damage;
+	RemoteDisplayRect *damage;
+	guint n_damage;
+};
+
+G_DEFINE_BOXED_TYPE (RemoteDisplayFrame, remote_display_frame, remote_display_frame_ref, remote_display_frame_unref);
+
+typedef struct {
+	guint started;
+} RemoteDisplayFrameSourcePrivate;
+
+G_DEFINE_TYPE_WITH_PRIVATE (RemoteDisplayFrameSource, remote_display_frame_source, G_TYPE_OBJECT);
+
+#define GET_PRIVATE(obj) (remote_display_frame_source_get_instance_private (REMOTE_DISPLAY_FRAME_SOURCE (obj)))
+
+enum {
+	FRAME,
+	NUM_SIGS
+};
+
+static guint signals[NUM_SIGS] = {0,};
+
+/**
+ * remote_display_frame_new:
+ * @format: the pixel layout of @data
+ * @width: the width in pixels
+ * @height: the height in pixels
+ * @stride: the number of bytes between the start of two lines
+ * @data: the pixels, at least @stride * @height bytes
+ *
+ * Wraps captured pixels so they can be handed to a #RemoteDisplayFrameSource.
+ * The capture time is set to the current monotonic time, sources that know
+ * better should override it with remote_display_frame_set_capture_time().
+ *
+ * Return value: a new #RemoteDisplayFrame
+ **/
+RemoteDisplayFrame *
+remote_display_frame_new (RemoteDisplayFrameFormat  format,
+			  guint                     width,
+			  guint                     height,
+			  guint                     stride,
+			  GBytes                   *data)
+{
+	RemoteDisplayFrame *frame;
+
+	g_return_val_if_fail (width > 0 && height > 0, NULL);
+	g_return_val_if_fail (stride >= width * 4, NULL);
+	g_return_val_if_fail (data != NULL, NULL);
+	g_return_val_if_fail (g_bytes_get_size (data) >= (gsize) stride * height, NULL);
+
+	frame = g_new0 (RemoteDisplayFrame, 1);
+	frame->ref_count = 1;
+	frame->format = format;
+	frame->width = width;
+	frame->height = height;
+	frame->stride = stride;
+	frame->data = g_bytes_ref (data);
+	frame->capture_time = g_get_monotonic_time ();
+
+	return frame;
+}
+
+RemoteDisplayFrame *
+remote_display_frame_ref (RemoteDisplayFrame *frame)
+{
+	g_return_val_if_fail (frame != NULL, NULL);
+
+	g_atomic_int_inc (&frame->ref_count);
+	return frame;
+}
+
+void
+remote_display_frame_unref (RemoteDisplayFrame *frame)
+{
+	g_return_if_fail (frame != NULL);
+
+	if (!g_atomic_int_dec_and_test (&frame->ref_count))
+		return;
+
+	g_bytes_unref (frame->data);
+	g_free (frame->damage);
+	g_free (frame);
+}
+
+RemoteDisplayFrameFormat
+remote_display_frame_get_format (RemoteDisplayFrame *frame)
+{
+	return frame->format;
+}
+
+guint
+remote_display_frame_get_width (RemoteDisplayFrame *frame)
+{
+	return frame->width;
+}
+
+guint
+remote_display_frame_get_height (RemoteDisplayFrame *frame)
+{
+	return frame->height;
+}
+
+guint
+remote_display_frame_get_stride (RemoteDisplayFrame *frame)
+{
+	return frame->stride;
+}
+
+const guint8 *
+remote_display_frame_get_data (RemoteDisplayFrame *frame)
+{
+	return g_bytes_get_data (frame->data, NULL);
+}
+
+gint64
+remote_display_frame_get_capture_time (RemoteDisplayFrame *frame)
+{
+	return frame->capture_time;
+}
+
+void
+remote_display_frame_set_capture_time (RemoteDisplayFrame *frame,
+				       gint64              capture_time)
+{
+	frame->capture_time = capture_time;
+}
+
+/**
+ * remote_display_frame_set_damage:
+ * @frame: a #RemoteDisplayFrame
+ * @rects: (array length=n_rects) (nullable): the changed areas
+ * @n_rects: the number of rectangles in @rects
+ *
+ * Sets which parts of @frame changed since the previous frame from the
+ * same source. An empty list marks the frame as identical to the previous
+ * one. Frames without damage information are considered entirely changed.
+ *
+ * Rectangles are clipped to the frame, empty rectangles are ignored.
+ **/
+void
+remote_display_frame_set_damage (RemoteDisplayFrame      *frame,
+				 const RemoteDisplayRect *rects,
+				 guint                    n_rects)
+{
+	guint i;
+
+	g_return_if_fail (frame != NULL);
+	g_return_if_fail (rects != NULL || n_rects == 0);
+
+	g_clear_pointer (&frame->damage, g_free);
+	frame->n_damage = 0;
+	frame->has_damage = TRUE;
+
+	if (n_rects == 0)
+		return;
+
+	frame->damage = g_new (RemoteDisplayRect, n_rects);
+	for (i = 0; i < n_rects; i++) {
+		gint x1, y1, x2, y2;
+
+		x1 = CLAMP (rects[i].x, 0, (gint) frame->width);
+		y1 = CLAMP (rects[i].y, 0, (gint) frame->height);
+		x2 = CLAMP (rects[i].x + rects[i].width, 0, (gint) frame->width);
+		y2 = CLAMP (rects[i].y + rects[i].height, 0, (gint) frame->height);
+		if (x2 <= x1 || y2 <= y1)
+			continue;
+
+		frame->damage[frame->n_damage].x = x1;
+		frame->damage[frame->n_damage].y = y1;
+		frame->damage[frame->n_damage].width = x2 - x1;
+		frame->damage[frame->n_damage].height = y2 - y1;
+		frame->n_damage++;
+	}
+}
+
+/**
+ * remote_display_frame_get_damage:
+ * @frame: a #RemoteDisplayFrame
+ * @rects: (out) (array length=n_rects) (transfer none): the changed areas
+ * @n_rects: (out): the number of rectangles in @rects
+ *
+ * Return value: %FALSE if the frame carries no damage information, and
+ * should be considered entirely changed.
+ **/
+gboolean
+remote_display_frame_get_damage (RemoteDisplayFrame       *frame,
+				 const RemoteDisplayRect **rects,
+				 guint                    *n_rects)
+{
+	g_return_val_if_fail (frame != NULL, FALSE);
+
+	if (rects)
+		*rects = frame->damage;
+	if (n_rects)
+		*n_rects = frame->n_damage;
+
+	return frame->has_damage;
+}
+
+gboolean
+remote_display_frame_is_unchanged (RemoteDisplayFrame *frame)
+{
+	g_return_val_if_fail (frame != NULL, FALSE);
+
+	return frame->has_damage && frame->n_damage == 0;
+}
+
+static void
+remote_display_frame_source_class_init (RemoteDisplayFrameSourceClass *klass)
+{
+	/**
+	 * RemoteDisplayFrameSource::frame:
+	 * @source: the source
+	 * @frame: the new frame
+	 *
+	 * Emitted for every new frame. This may be emitted from any
+	 * thread, handlers must not block.
+	 **/
+	signals[FRAME] = g_signal_new ("frame",
+				       REMOTE_DISPLAY_TYPE_FRAME_SOURCE,
+				       G_SIGNAL_RUN_FIRST,
+				       0, NULL, NULL,
+				       g_cclosure_marshal_generic,
+				       G_TYPE_NONE,
+				       1, REMOTE_DISPLAY_TYPE_FRAME | G_SIGNAL_TYPE_STATIC_SCOPE);
+}
+
+static void
+remote_display_frame_source_init (RemoteDisplayFrameSource *source)
+{
+}
+
+void
+remote_display_frame_source_start (RemoteDisplayFrameSource *source)
+{
+	RemoteDisplayFrameSourcePrivate *priv;
+	RemoteDisplayFrameSourceClass *klass;
+
+	g_return_if_fail (REMOTE_DISPLAY_IS_FRAME_SOURCE (source));
+
+	priv = GET_PRIVATE (source);
+	if (priv->started++ > 0)
+		return;
+
+	klass = REMOTE_DISPLAY_FRAME_SOURCE_GET_CLASS (source);
+	if (klass->start)
+		klass->start (source);
+}
+
+void
+remote_display_frame_source_stop (RemoteDisplayFrameSource *source)
+{
+	RemoteDisplayFrameSourcePrivate *priv;
+	RemoteDisplayFrameSourceClass *klass;
+
+	g_return_if_fail (REMOTE_DISPLAY_IS_FRAME_SOURCE (source));
+
+	priv = GET_PRIVATE (source);
+	g_return_if_fail (priv->started > 0);
+	if (--priv->started > 0)
+		return;
+
+	klass = REMOTE_DISPLAY_FRAME_SOURCE_GET_CLASS (source);
+	if (klass->stop)
+		klass->stop (source);
+}
+
+/**
+ * remote_display_frame_source_push_frame:
+ * @source: a #RemoteDisplayFrameSource
+ * @frame: a #RemoteDisplayFrame
+ *
+ * Hands a new frame to the consumers of @source. Consumers take
+ * their own reference if they need to keep the frame around.
+ **/
+void
+remote_display_frame_source_push_frame (RemoteDisplayFrameSource *source,
+					RemoteDisplayFrame       *frame)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_FRAME_SOURCE (source));
+	g_return_if_fail (frame != NULL);
+
+	g_signal_emit (source, signals[FRAME], 0, frame);
+}
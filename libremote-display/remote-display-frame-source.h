@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __REMOTE_DISPLAY_FRAME_SOURCE_H__
+#define __REMOTE_DISPLAY_FRAME_SOURCE_H__
+
+#include <glib-object.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+	REMOTE_DISPLAY_FRAME_FORMAT_BGRX,
+	REMOTE_DISPLAY_FRAME_FORMAT_RGBX
+} RemoteDisplayFrameFormat;
+
+typedef struct _RemoteDisplayFrame RemoteDisplayFrame;
+
+typedef struct {
+	gint x;
+	gint y;
+	gint width;
+	gint height;
+} RemoteDisplayRect;
+
+#define REMOTE_DISPLAY_TYPE_FRAME (remote_display_frame_get_type ())
+GType                     remote_display_frame_get_type         (void) G_GNUC_CONST;
+
+RemoteDisplayFrame       *remote_display_frame_new              (RemoteDisplayFrameFormat  format,
+								 guint                     width,
+								 guint                     height,
+								 guint                     stride,
+								 GBytes                   *data);
+RemoteDisplayFrame       *remote_display_frame_ref              (RemoteDisplayFrame       *frame);
+void                      remote_display_frame_unref            (RemoteDisplayFrame       *frame);
+RemoteDisplayFrameFormat  remote_display_frame_get_format       (RemoteDisplayFrame       *frame);
+guint                     remote_display_frame_get_width        (RemoteDisplayFrame       *frame);
+guint                     remote_display_frame_get_height       (RemoteDisplayFrame       *frame);
+guint                     remote_display_frame_get_stride       (RemoteDisplayFrame       *frame);
+const guint8             *remote_display_frame_get_data         (RemoteDisplayFrame       *frame);
+gint64                    remote_display_frame_get_capture_time (RemoteDisplayFrame       *frame);
+void                      remote_display_frame_set_capture_time (RemoteDisplayFrame       *frame,
+								 gint64                    capture_time);
+void                      remote_display_frame_set_damage       (RemoteDisplayFrame       *frame,
+								 const RemoteDisplayRect  *rects,
+								 guint                     n_rects);
+gboolean                  remote_display_frame_get_damage       (RemoteDisplayFrame       *frame,
+								 const RemoteDisplayRect **rects,
+								 guint                    *n_rects);
+gboolean                  remote_display_frame_is_unchanged     (RemoteDisplayFrame       *frame);
+
+#define REMOTE_DISPLAY_TYPE_FRAME_SOURCE remote_display_frame_source_get_type ()
+G_DECLARE_DERIVABLE_TYPE (RemoteDisplayFrameSource, remote_display_frame_source, REMOTE_DISPLAY, FRAME_SOURCE, GObject)
+
+struct _RemoteDisplayFrameSourceClass
+{
+	GObjectClass parent_class;
+
+	void (* start) (RemoteDisplayFrameSource *source);
+	void (* stop)  (RemoteDisplayFrameSource *source);
+};
+
+void remote_display_frame_source_start      (RemoteDisplayFrameSource *source);
+void remote_display_frame_source_stop       (RemoteDisplayFrameSource *source);
+void remote_display_frame_source_push_frame (RemoteDisplayFrameSource *source,
+					     RemoteDisplayFrame       *frame);
+
+G_END_DECLS
+
+#endif /* __REMOTE_DISPLAY_FRAME_SOURCE_H__ */
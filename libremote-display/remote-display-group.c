@@ -0,0 +1,691 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <gio/gio.h>
+
+#include <libremote-display/remote-display-group.h>
+#include <libremote-display/remote-display-device-airplay.h>
+
+#define PRELOAD_TIMEOUT   10                       /* seconds */
+#define N_PROBES          5
+#define DISPATCH_MARGIN   (20 * 1000)              /* µs */
+#define RESYNC_INTERVAL   5                        /* seconds */
+#define DRIFT_THRESHOLD   0.080                    /* seconds */
+
+typedef enum {
+	PHASE_IDLE,
+	PHASE_PRELOADING,
+	PHASE_PROBING,
+	PHASE_LINING_UP,
+	PHASE_PLAYING,
+	PHASE_PAUSED
+} GroupPhase;
+
+typedef struct {
+	RemoteDisplayGroup *group;
+	RemoteDisplayDevice *device;
+	GCancellable *cancellable;
+	gulong state_handler_id;
+	gboolean ready;
+
+	/* Round trips, in µs */
+	gint64 rtt;                            /* Smallest seen, or -1 */
+	gint64 last_rtt;
+	gint64 probe_sent;
+	guint probes_left;
+	gboolean scrubbing;
+
+	/* From the last probe */
+	gboolean have_position;
+	gdouble position;
+	gint64 position_time;
+
+	guint dispatch_id;
+	gboolean dispatch_play;
+} GroupMember;
+
+struct _RemoteDisplayGroup {
+	GObject parent_instance;
+
+	GPtrArray *members;
+	GroupPhase phase;
+	gdouble position;                      /* Where to line up members, in seconds, or -1 */
+	guint pending_probes;
+	guint pending_scrubs;
+	guint preload_timeout_id;
+	guint resync_id;
+};
+
+G_DEFINE_TYPE (RemoteDisplayGroup, remote_display_group, G_TYPE_OBJECT);
+
+enum {
+	RESYNCED,
+	NUM_SIGS
+};
+
+static guint signals[NUM_SIGS] = {0,};
+
+static void probe_member (GroupMember *member);
+
+static void
+member_cancel (GroupMember *member)
+{
+	g_cancellable_cancel (member->cancellable);
+	g_object_unref (member->cancellable);
+	member->cancellable = g_cancellable_new ();
+	if (member->dispatch_id != 0) {
+		g_source_remove (member->dispatch_id);
+		member->dispatch_id = 0;
+	}
+}
+
+static void
+member_free (GroupMember *member)
+{
+	g_cancellable_cancel (member->cancellable);
+	g_object_unref (member->cancellable);
+	if (member->dispatch_id != 0)
+		g_source_remove (member->dispatch_id);
+	g_signal_handler_disconnect (member->device, member->state_handler_id);
+	g_object_unref (member->device);
+	g_free (member);
+}
+
+static gint64
+member_rtt (GroupMember *member)
+{
+	return member->rtt >= 0 ? member->rtt : 0;
+}
+
+static void
+cancel_all (RemoteDisplayGroup *group)
+{
+	guint i;
+
+	for (i = 0; i < group->members->len; i++)
+		member_cancel (g_ptr_array_index (group->members, i));
+	group->pending_probes = 0;
+	group->pending_scrubs = 0;
+	if (group->preload_timeout_id != 0) {
+		g_source_remove (group->preload_timeout_id);
+		group->preload_timeout_id = 0;
+	}
+	if (group->resync_id != 0) {
+		g_source_remove (group->resync_id);
+		group->resync_id = 0;
+	}
+}
+
+static gboolean
+dispatch_cb (gpointer user_data)
+{
+	GroupMember *member = user_data;
+
+	member->dispatch_id = 0;
+	if (member->dispatch_play)
+		remote_display_device_play (member->device);
+	else
+		remote_display_device_pause (member->device);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Sends the command to each member half its round trip before the
+ * common start time, so that they all get it at the same time */
+static void
+dispatch_rate (RemoteDisplayGroup *group,
+	       gboolean            play)
+{
+	gint64 max_rtt = 0;
+	gint64 now, start;
+	guint i;
+
+	for (i = 0; i < group->members->len; i++)
+		max_rtt = MAX (max_rtt, member_rtt (g_ptr_array_index (group->members, i)));
+
+	now = g_get_monotonic_time ();
+	start = now + max_rtt / 2 + DISPATCH_MARGIN;
+	for (i = 0; i < group->members->len; i++) {
+		GroupMember *member = g_ptr_array_index (group->members, i);
+		gint64 delay;
+
+		if (member->dispatch_id != 0)
+			g_source_remove (member->dispatch_id);
+		delay = start - member_rtt (member) / 2 - now;
+		member->dispatch_play = play;
+		member->dispatch_id = g_timeout_add_full (G_PRIORITY_HIGH,
+							  (delay + 500) / 1000,
+							  dispatch_cb, member, NULL);
+	}
+}
+
+static int
+compare_doubles (gconstpointer a,
+		 gconstpointer b)
+{
+	gdouble da = *(const gdouble *) a;
+	gdouble db = *(const gdouble *) b;
+
+	return (da > db) - (da < db);
+}
+
+/* Estimates where every member is now, and moves the ones that
+ * drifted away from the median */
+static void
+resync (RemoteDisplayGroup *group)
+{
+	GArray *estimates;
+	gdouble reference;
+	gint64 now;
+	guint i;
+
+	now = g_get_monotonic_time ();
+	estimates = g_array_new (FALSE, FALSE, sizeof (gdouble));
+	for (i = 0; i < group->members->len; i++) {
+		GroupMember *member = g_ptr_array_index (group->members, i);
+		gdouble estimate;
+
+		if (!member->have_position)
+			continue;
+		/* The position was read when the request arrived,
+		 * about half a round trip after it was sent */
+		estimate = member->position +
+			(gdouble) (now - member->position_time + member->last_rtt / 2) / G_USEC_PER_SEC;
+		g_array_append_val (estimates, estimate);
+	}
+
+	if (estimates->len < 2) {
+		g_array_free (estimates, TRUE);
+		return;
+	}
+
+	g_array_sort (estimates, compare_doubles);
+	reference = g_array_index (estimates, gdouble, estimates->len / 2);
+	g_array_free (estimates, TRUE);
+
+	for (i = 0; i < group->members->len; i++) {
+		GroupMember *member = g_ptr_array_index (group->members, i);
+		gdouble estimate, offset;
+
+		if (!member->have_position)
+			continue;
+		estimate = member->position +
+			(gdouble) (now - member->position_time + member->last_rtt / 2) / G_USEC_PER_SEC;
+		offset = estimate - reference;
+		if (ABS (offset) < DRIFT_THRESHOLD)
+			continue;
+
+		g_debug ("Member '%s' is %.0f ms off, resyncing",
+			 remote_display_device_get_name (member->device), offset * 1000.0);
+		/* Aim for where the others will be when the scrub arrives,
+		 * note that /scrub takes seconds, despite the argument name */
+		remote_display_device_airplay_seek (REMOTE_DISPLAY_DEVICE_AIRPLAY (member->device),
+						    reference + (gdouble) member_rtt (member) / 2 / G_USEC_PER_SEC,
+						    NULL);
+		g_signal_emit (group, signals[RESYNCED], 0, member->device, offset * 1000.0);
+	}
+}
+
+static gboolean
+resync_cb (gpointer user_data)
+{
+	RemoteDisplayGroup *group = user_data;
+	guint i;
+
+	/* Previous round still going */
+	if (group->pending_probes > 0)
+		return G_SOURCE_CONTINUE;
+
+	group->pending_probes = group->members->len;
+	for (i = 0; i < group->members->len; i++) {
+		GroupMember *member = g_ptr_array_index (group->members, i);
+
+		member->probes_left = 1;
+		probe_member (member);
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+static void
+start_playing (RemoteDisplayGroup *group)
+{
+	group->phase = PHASE_PLAYING;
+	dispatch_rate (group, TRUE);
+	if (group->resync_id == 0)
+		group->resync_id = g_timeout_add_seconds (RESYNC_INTERVAL, resync_cb, group);
+}
+
+static void
+scrub_cb (GObject      *source,
+	  GAsyncResult *result,
+	  gpointer      user_data)
+{
+	GroupMember *member = user_data;
+	RemoteDisplayGroup *group;
+	GError *error = NULL;
+
+	if (!g_task_propagate_boolean (G_TASK (result), &error)) {
+		/* The member might be gone */
+		if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+			g_error_free (error);
+			return;
+		}
+		g_debug ("Failed to line up '%s': %s",
+			 remote_display_device_get_name (member->device), error->message);
+		g_error_free (error);
+	}
+
+	member->scrubbing = FALSE;
+	group = member->group;
+	if (--group->pending_scrubs == 0)
+		start_playing (group);
+}
+
+/* Members played a little while loading, or paused at slightly
+ * different times, so they're all moved to the same position
+ * first, and only started once they all got there */
+static void
+line_up (RemoteDisplayGroup *group)
+{
+	guint i;
+
+	if (group->position < 0) {
+		GArray *positions;
+
+		positions = g_array_new (FALSE, FALSE, sizeof (gdouble));
+		for (i = 0; i < group->members->len; i++) {
+			GroupMember *member = g_ptr_array_index (group->members, i);
+
+			if (member->have_position)
+				g_array_append_val (positions, member->position);
+		}
+		if (positions->len > 0) {
+			g_array_sort (positions, compare_doubles);
+			group->position = g_array_index (positions, gdouble, positions->len / 2);
+		}
+		g_array_free (positions, TRUE);
+	}
+
+	if (group->position < 0 || group->members->len == 0) {
+		start_playing (group);
+		return;
+	}
+
+	group->phase = PHASE_LINING_UP;
+	group->pending_scrubs = group->members->len;
+	for (i = 0; i < group->members->len; i++) {
+		GroupMember *member = g_ptr_array_index (group->members, i);
+		GTask *task;
+
+		member->scrubbing = TRUE;
+		task = g_task_new (member->device, member->cancellable, scrub_cb, member);
+		/* /scrub takes seconds, despite the argument name */
+		remote_display_device_airplay_seek (REMOTE_DISPLAY_DEVICE_AIRPLAY (member->device),
+						    group->position, task);
+	}
+}
+
+static void
+probe_cb (GObject      *source,
+	  GAsyncResult *result,
+	  gpointer      user_data)
+{
+	RemoteDisplayAirplayPlaybackInfo *info;
+	GroupMember *member = user_data;
+	RemoteDisplayGroup *group;
+	GError *error = NULL;
+	gint64 now;
+
+	now = g_get_monotonic_time ();
+	info = remote_display_device_airplay_get_playback_info_finish (REMOTE_DISPLAY_DEVICE_AIRPLAY (source),
+								       result, &error);
+	if (!info) {
+		/* The member might be gone */
+		if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+			g_error_free (error);
+			return;
+		}
+		g_debug ("Failed to probe '%s': %s",
+			 remote_display_device_get_name (member->device), error->message);
+		g_error_free (error);
+		member->have_position = FALSE;
+		member->probes_left = 0;
+	} else {
+		member->last_rtt = now - member->probe_sent;
+		if (member->rtt < 0 || member->last_rtt < member->rtt)
+			member->rtt = member->last_rtt;
+		member->have_position = TRUE;
+		member->position = info->position;
+		member->position_time = now;
+		g_free (info);
+
+		if (member->probes_left > 0)
+			member->probes_left--;
+	}
+
+	if (member->probes_left > 0) {
+		probe_member (member);
+		return;
+	}
+
+	group = member->group;
+	if (--group->pending_probes > 0)
+		return;
+
+	if (group->phase == PHASE_PROBING)
+		line_up (group);
+	else if (group->phase == PHASE_PLAYING)
+		resync (group);
+}
+
+static void
+probe_member (GroupMember *member)
+{
+	member->probe_sent = g_get_monotonic_time ();
+	remote_display_device_airplay_get_playback_info_async (REMOTE_DISPLAY_DEVICE_AIRPLAY (member->device),
+							       member->cancellable,
+							       probe_cb, member);
+}
+
+/* Sequential probes, the smallest round trip is the one least
+ * affected by queueing on the way */
+static void
+start_probing (RemoteDisplayGroup *group)
+{
+	guint i;
+
+	if (group->preload_timeout_id != 0) {
+		g_source_remove (group->preload_timeout_id);
+		group->preload_timeout_id = 0;
+	}
+
+	/* Nothing to measure, the last member went away */
+	if (group->members->len == 0) {
+		line_up (group);
+		return;
+	}
+
+	group->phase = PHASE_PROBING;
+	group->pending_probes = group->members->len;
+	for (i = 0; i < group->members->len; i++) {
+		GroupMember *member = g_ptr_array_index (group->members, i);
+
+		member->probes_left = N_PROBES;
+		probe_member (member);
+	}
+}
+
+static gboolean
+all_ready (RemoteDisplayGroup *group)
+{
+	guint i;
+
+	for (i = 0; i < group->members->len; i++) {
+		GroupMember *member = g_ptr_array_index (group->members, i);
+		if (!member->ready)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static gboolean
+preload_timeout_cb (gpointer user_data)
+{
+	RemoteDisplayGroup *group = user_data;
+
+	g_debug ("Not all group members finished loading, starting anyway");
+	group->preload_timeout_id = 0;
+	start_probing (group);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+state_changed_cb (RemoteDisplayDevice      *device,
+		  RemoteDisplayDeviceState  state,
+		  GroupMember              *member)
+{
+	RemoteDisplayGroup *group = member->group;
+
+	if (group->phase != PHASE_PRELOADING)
+		return;
+	if (state != REMOTE_DISPLAY_DEVICE_STATE_PAUSED &&
+	    state != REMOTE_DISPLAY_DEVICE_STATE_PLAYING)
+		return;
+
+	member->ready = TRUE;
+	if (all_ready (group))
+		start_probing (group);
+}
+
+static void
+remote_display_group_finalize (GObject *object)
+{
+	RemoteDisplayGroup *group = REMOTE_DISPLAY_GROUP (object);
+
+	cancel_all (group);
+	g_ptr_array_free (group->members, TRUE);
+
+	G_OBJECT_CLASS (remote_display_group_parent_class)->finalize (object);
+}
+
+static void
+remote_display_group_class_init (RemoteDisplayGroupClass *klass)
+{
+	GObjectClass *o_class = (GObjectClass *)klass;
+
+	o_class->finalize = remote_display_group_finalize;
+
+	/**
+	 * RemoteDisplayGroup::resynced:
+	 * @group: the group
+	 * @device: the member that drifted
+	 * @offset: how far ahead (positive) or behind (negative)
+	 *   of the others it was, in milliseconds
+	 **/
+	signals[RESYNCED] = g_signal_new ("resynced",
+					  REMOTE_DISPLAY_TYPE_GROUP,
+					  G_SIGNAL_RUN_FIRST,
+					  0, NULL, NULL,
+					  g_cclosure_marshal_generic,
+					  G_TYPE_NONE,
+					  2, REMOTE_DISPLAY_TYPE_DEVICE, G_TYPE_DOUBLE);
+}
+
+static void
+remote_display_group_init (RemoteDisplayGroup *group)
+{
+	group->members = g_ptr_array_new_with_free_func ((GDestroyNotify) member_free);
+}
+
+RemoteDisplayGroup *
+remote_display_group_new (void)
+{
+	return g_object_new (REMOTE_DISPLAY_TYPE_GROUP, NULL);
+}
+
+static GroupMember *
+find_member (RemoteDisplayGroup  *group,
+	     RemoteDisplayDevice *device,
+	     guint               *index)
+{
+	guint i;
+
+	for (i = 0; i < group->members->len; i++) {
+		GroupMember *member = g_ptr_array_index (group->members, i);
+
+		if (member->device == device) {
+			if (index)
+				*index = i;
+			return member;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * remote_display_group_add_device:
+ * @group: a #RemoteDisplayGroup
+ * @device: a #RemoteDisplayDevice that can play videos
+ *
+ * Adds @device to the group. It will take part in the next
+ * remote_display_group_open_and_play() call.
+ **/
+void
+remote_display_group_add_device (RemoteDisplayGroup  *group,
+				 RemoteDisplayDevice *device)
+{
+	GroupMember *member;
+
+	g_return_if_fail (REMOTE_DISPLAY_IS_GROUP (group));
+	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE_AIRPLAY (device));
+	g_return_if_fail (remote_display_device_get_capabilities (device) & REMOTE_DISPLAY_DEVICE_CAPABILITIES_VIDEO);
+
+	if (find_member (group, device, NULL))
+		return;
+
+	member = g_new0 (GroupMember, 1);
+	member->group = group;
+	member->device = g_object_ref (device);
+	member->cancellable = g_cancellable_new ();
+	member->rtt = -1;
+	member->state_handler_id = g_signal_connect (device, "state-changed",
+						     G_CALLBACK (state_changed_cb), member);
+	g_ptr_array_add (group->members, member);
+}
+
+void
+remote_display_group_remove_device (RemoteDisplayGroup  *group,
+				    RemoteDisplayDevice *device)
+{
+	GroupMember *member;
+	guint index;
+
+	g_return_if_fail (REMOTE_DISPLAY_IS_GROUP (group));
+	g_return_if_fail (REMOTE_DISPLAY_IS_DEVICE (device));
+
+	member = find_member (group, device, &index);
+	if (!member)
+		return;
+
+	/* Its reply won't come anymore */
+	if (member->probes_left > 0 && group->pending_probes > 0)
+		group->pending_probes--;
+	if (member->scrubbing && group->pending_scrubs > 0)
+		group->pending_scrubs--;
+	g_ptr_array_remove_index (group->members, index);
+
+	/* It might have been the one the others were waiting for */
+	if (group->phase == PHASE_PRELOADING && all_ready (group))
+		start_probing (group);
+	else if (group->phase == PHASE_PROBING && group->pending_probes == 0)
+		line_up (group);
+	else if (group->phase == PHASE_LINING_UP && group->pending_scrubs == 0)
+		start_playing (group);
+}
+
+/**
+ * remote_display_group_open_and_play:
+ * @group: a #RemoteDisplayGroup
+ * @uri: the URI to play
+ * @position_ms: the start position, in milliseconds
+ *
+ * Loads @uri paused on every member, measures how long commands
+ * take to reach each of them, and then starts them so that
+ * playback begins at the same time everywhere. While playing,
+ * members that drift away from the others get moved back in line.
+ *
+ * AirPlay can't load media without playing it, so members start
+ * playing briefly before being paused. They're all moved back to
+ * @position_ms before being started together.
+ **/
+void
+remote_display_group_open_and_play (RemoteDisplayGroup *group,
+				    const char         *uri,
+				    guint64             position_ms)
+{
+	guint i;
+
+	g_return_if_fail (REMOTE_DISPLAY_IS_GROUP (group));
+	g_return_if_fail (uri != NULL);
+
+	cancel_all (group);
+	if (group->members->len == 0)
+		return;
+
+	group->phase = PHASE_PRELOADING;
+	group->position = position_ms / 1000.0;
+	for (i = 0; i < group->members->len; i++) {
+		GroupMember *member = g_ptr_array_index (group->members, i);
+
+		member->ready = FALSE;
+		member->have_position = FALSE;
+		remote_display_device_open_and_play (member->device, uri, position_ms);
+		remote_display_device_pause (member->device);
+	}
+
+	group->preload_timeout_id = g_timeout_add_seconds (PRELOAD_TIMEOUT, preload_timeout_cb, group);
+}
+
+void
+remote_display_group_play (RemoteDisplayGroup *group)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_GROUP (group));
+
+	if (group->phase != PHASE_PAUSED)
+		return;
+
+	/* Line the members up where most of them stopped */
+	group->position = -1;
+	start_probing (group);
+}
+
+void
+remote_display_group_pause (RemoteDisplayGroup *group)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_GROUP (group));
+
+	if (group->phase != PHASE_PLAYING)
+		return;
+
+	cancel_all (group);
+	group->phase = PHASE_PAUSED;
+	dispatch_rate (group, FALSE);
+}
+
+void
+remote_display_group_stop (RemoteDisplayGroup *group)
+{
+	guint i;
+
+	g_return_if_fail (REMOTE_DISPLAY_IS_GROUP (group));
+
+	cancel_all (group);
+	group->phase = PHASE_IDLE;
+	for (i = 0; i < group->members->len; i++) {
+		GroupMember *member = g_ptr_array_index (group->members, i);
+
+		remote_display_device_stop (member->device);
+	}
+}
@@ -21,12 +21,34 @@
 #include <gio/gio.h>
 #include <libsoup/soup.h>
 #include <libremote-display/remote-display-host.h>
+#include <libremote-display/remote-display-mp4.h>
+#include <libremote-display/remote-display-probes.h>
+#include <libremote-display/remote-display-remux.h>
 
+/* How much of a remuxed file to queue ahead of the socket */
+#define REMUX_WINDOW (2 * 1024 * 1024)
+
+/* Referenced by the requests being answered, as hosting the same
+ * URI again replaces the file */
 typedef struct {
+	gint ref_count;
 	GMappedFile *mapped_file;
 	char *uri;
 	char *path;
 	char *mime_type;
+	/* Checked once mapped, MP4s with the moov box at the end
+	 * are served as if it was at the start */
+	gboolean faststart_checked;
+	RemoteDisplayMp4Faststart faststart;
+	/* Matroska and MPEG-TS files get indexed in a thread, and
+	 * served as fragmented MP4, when the host remuxes */
+	gboolean remux_checked;
+	gboolean indexing;
+	GList *waiting;                        /* of SoupMessage, paused */
+	RemoteDisplayRemux *remux;
+	/* Receivers fetch files in many requests, when seeking
+	 * or buffering, but it's only announced once */
+	gboolean served;
 } RemoteDisplayHostFile;
 
 struct _RemoteDisplayHostPrivate {
@@ -34,6 +56,7 @@ struct _RemoteDisplayHostPrivate {
 	GInetAddress *local_address;
 	SoupServer *server;
 	gboolean server_started;
+	gboolean remux;
 	GHashTable *files;
 };
 
@@ -41,10 +64,21 @@ struct _RemoteDisplayHostPrivate {
 
 G_DEFINE_TYPE_WITH_PRIVATE (RemoteDisplayHost, remote_display_host, G_TYPE_OBJECT);
 
+enum {
+	FILE_SERVED,
+	NUM_SIGS
+};
+
+static guint signals[NUM_SIGS] = {0,};
+
+/* Shared by all the hosts, which run in the main context */
+static RemoteDisplayHostStats totals;
+
 enum {
 	PROP_0 = 0,
 	PROP_REMOTE_ADDRESS,
-	PROP_LOCAL_ADDRESS
+	PROP_LOCAL_ADDRESS,
+	PROP_REMUX
 };
 
 static void
@@ -78,11 +112,50 @@ remote_display_host_get_property (GObject    *object,
 	case PROP_LOCAL_ADDRESS:
 		g_value_set_object (value, priv->local_address);
 		break;
+	case PROP_REMUX:
+		g_value_set_boolean (value, priv->remux);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 	}
 }
 
+/* Keeps the same port if possible, so that the URIs
+ * already handed out only need a new address */
+static void
+rebind_server (RemoteDisplayHost *host)
+{
+	RemoteDisplayHostPrivate *priv = GET_PRIVATE (host);
+	GSocketAddress *addr;
+	GError *error = NULL;
+	GSList *uris;
+	guint port = 0;
+
+	uris = soup_server_get_uris (priv->server);
+	if (uris)
+		port = soup_uri_get_port (uris->data);
+	g_slist_free_full (uris, (GDestroyNotify) soup_uri_free);
+
+	soup_server_disconnect (priv->server);
+	priv->server_started = FALSE;
+
+	addr = g_inet_socket_address_new (priv->local_address, port);
+	if (!soup_server_listen (priv->server, addr, 0, &error)) {
+		g_debug ("Failed to listen on port %d again: %s", port, error->message);
+		g_clear_error (&error);
+		g_object_unref (addr);
+		addr = g_inet_socket_address_new (priv->local_address, 0);
+		if (!soup_server_listen (priv->server, addr, 0, &error)) {
+			g_warning ("Failed to listen on new local address: %s", error->message);
+			g_error_free (error);
+			g_object_unref (addr);
+			return;
+		}
+	}
+	g_object_unref (addr);
+	priv->server_started = TRUE;
+}
+
 static void
 remote_display_host_set_property (GObject      *object,
 				  guint         prop_id,
@@ -98,11 +171,16 @@ remote_display_host_set_property (GObject      *object,
 	case PROP_LOCAL_ADDRESS:
 		g_clear_object (&priv->local_address);
 		priv->local_address = g_value_dup_object (value);
+		if (priv->server_started)
+			rebind_server (REMOTE_DISPLAY_HOST (object));
 		break;
 	case PROP_REMOTE_ADDRESS:
 		g_clear_object (&priv->remote_address);
 		priv->remote_address = g_value_dup_object (value);
 		break;
+	case PROP_REMUX:
+		priv->remux = g_value_get_boolean (value);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 	}
@@ -131,15 +209,48 @@ remote_display_host_class_init (RemoteDisplayHostClass *klass)
 							      "The address of the server",
 							      G_TYPE_INET_ADDRESS,
 							      G_PARAM_READWRITE));
+	/* For receivers that only play MP4s */
+	g_object_class_install_property (o_class,
+					 PROP_REMUX,
+					 g_param_spec_boolean ("remux",
+							       "Remux",
+							       "Whether to serve Matroska and MPEG-TS files as MP4",
+							       FALSE,
+							       G_PARAM_READWRITE));
+
+	/* Emitted when the first bytes of a file were sent, once per
+	 * call to remote_display_host_file(), with the URI passed to it */
+	signals[FILE_SERVED] = g_signal_new ("file-served",
+					     REMOTE_DISPLAY_TYPE_HOST,
+					     G_SIGNAL_RUN_LAST,
+					     0, NULL, NULL,
+					     g_cclosure_marshal_generic,
+					     G_TYPE_NONE,
+					     1, G_TYPE_STRING);
+}
+
+static RemoteDisplayHostFile *
+file_ref (RemoteDisplayHostFile *file)
+{
+	file->ref_count++;
+	return file;
 }
 
 static void
-file_free (RemoteDisplayHostFile *file)
+file_unref (RemoteDisplayHostFile *file)
 {
+	if (--file->ref_count > 0)
+		return;
+
 	g_free (file->uri);
 	g_free (file->path);
 	g_free (file->mime_type);
-	g_mapped_file_unref (file->mapped_file);
+	if (file->mapped_file) {
+		totals.mapped_bytes -= g_mapped_file_get_length (file->mapped_file);
+		g_mapped_file_unref (file->mapped_file);
+	}
+	remote_display_mp4_faststart_clear (&file->faststart);
+	g_clear_pointer (&file->remux, remote_display_remux_free);
 	g_free (file);
 }
 
@@ -157,6 +268,338 @@ client_allowed (RemoteDisplayHost *host,
 	return g_inet_address_equal (remote_addr, priv->remote_address);
 }
 
+typedef struct {
+	RemoteDisplayHost *host;
+	char *key;
+	char *uri;
+	gboolean started;
+} ServedData;
+
+static void
+served_data_free (ServedData *data,
+		  GClosure   *closure)
+{
+	g_object_unref (data->host);
+	g_free (data->key);
+	g_free (data->uri);
+	g_free (data);
+}
+
+static void
+wrote_body_data_cb (SoupMessage *msg,
+		    SoupBuffer  *chunk,
+		    ServedData  *data)
+{
+	RemoteDisplayHostFile *file;
+
+	totals.bytes_served += chunk->length;
+	if (data->started)
+		return;
+	data->started = TRUE;
+	REMOTE_DISPLAY_PROBE1 (host_first_byte, msg);
+
+	/* Looked up again, as the file might have been hosted anew */
+	file = g_hash_table_lookup (GET_PRIVATE (data->host)->files, data->key);
+	if (!file || file->served)
+		return;
+	file->served = TRUE;
+	g_signal_emit (data->host, signals[FILE_SERVED], 0, data->uri);
+}
+
+#ifdef HAVE_SDT_PROBES
+static void
+finished_cb (SoupMessage *msg,
+	     gpointer     user_data)
+{
+	REMOTE_DISPLAY_PROBE3 (host_request_finish, msg, msg->status_code,
+			       msg->response_body->length);
+}
+#endif
+
+/* Parts of the file as served, in order */
+typedef struct {
+	const char *data;
+	gsize length;
+	gboolean in_moov;
+} Segment;
+
+static guint
+get_segments (RemoteDisplayHostFile *file,
+	      Segment                segments[4])
+{
+	RemoteDisplayMp4Faststart *faststart = &file->faststart;
+	const char *contents;
+	gsize length, moov_size;
+
+	contents = g_mapped_file_get_contents (file->mapped_file);
+	length = g_mapped_file_get_length (file->mapped_file);
+
+	if (!faststart->moov) {
+		segments[0] = (Segment) { contents, length, FALSE };
+		return 1;
+	}
+
+	moov_size = g_bytes_get_size (faststart->moov);
+	segments[0] = (Segment) { contents, faststart->insert_offset, FALSE };
+	segments[1] = (Segment) { g_bytes_get_data (faststart->moov, NULL), moov_size, TRUE };
+	segments[2] = (Segment) { contents + faststart->insert_offset,
+				  faststart->moov_offset - faststart->insert_offset, FALSE };
+	segments[3] = (Segment) { contents + faststart->moov_offset + moov_size,
+				  length - faststart->moov_offset - moov_size, FALSE };
+	return 4;
+}
+
+/* Appends [@start, @end) of the file as served, without copying */
+static void
+append_body (SoupMessage           *msg,
+	     RemoteDisplayHostFile *file,
+	     goffset                start,
+	     goffset                end)
+{
+	Segment segments[4];
+	SoupBuffer *buffer;
+	goffset pos, from, to;
+	guint i, n_segments;
+
+	n_segments = get_segments (file, segments);
+	for (i = 0, pos = 0; i < n_segments && pos < end; pos += segments[i].length, i++) {
+		from = MAX (start, pos);
+		to = MIN (end, pos + (goffset) segments[i].length);
+		if (from >= to)
+			continue;
+
+		if (segments[i].in_moov)
+			buffer = soup_buffer_new_with_owner (segments[i].data + (from - pos), to - from,
+							     g_bytes_ref (file->faststart.moov),
+							     (GDestroyNotify) g_bytes_unref);
+		else
+			buffer = soup_buffer_new_with_owner (segments[i].data + (from - pos), to - from,
+							     g_mapped_file_ref (file->mapped_file),
+							     (GDestroyNotify) g_mapped_file_unref);
+		soup_message_body_append_buffer (msg->response_body, buffer);
+		soup_buffer_free (buffer);
+	}
+}
+
+typedef struct {
+	RemoteDisplayHost *host;
+	RemoteDisplayHostFile *file;
+	goffset pos;
+	goffset end;
+	gsize queued;
+} RemuxStream;
+
+static void
+remux_stream_free (RemuxStream *stream,
+		   GClosure    *closure)
+{
+	g_object_unref (stream->host);
+	file_unref (stream->file);
+	g_free (stream);
+}
+
+/* Fragments are built as the socket drains, so that only a window
+ * of the remuxed file is ever in memory */
+static void
+remux_stream_fill (RemuxStream *stream,
+		   SoupMessage *msg)
+{
+	GPtrArray *chunks;
+	SoupBuffer *buffer;
+	GBytes *bytes;
+	gconstpointer data;
+	gsize size;
+	guint i;
+
+	while (stream->pos < stream->end && stream->queued < REMUX_WINDOW) {
+		chunks = g_ptr_array_new_with_free_func ((GDestroyNotify) g_bytes_unref);
+		stream->pos = remote_display_remux_read (stream->file->remux, stream->pos, stream->end, chunks);
+		for (i = 0; i < chunks->len; i++) {
+			bytes = g_ptr_array_index (chunks, i);
+			data = g_bytes_get_data (bytes, &size);
+			buffer = soup_buffer_new_with_owner (data, size, g_bytes_ref (bytes),
+							     (GDestroyNotify) g_bytes_unref);
+			soup_message_body_append_buffer (msg->response_body, buffer);
+			soup_buffer_free (buffer);
+			stream->queued += size;
+		}
+		g_ptr_array_unref (chunks);
+
+		if (stream->pos == stream->end)
+			soup_message_body_complete (msg->response_body);
+	}
+}
+
+static void
+remux_wrote_body_data_cb (SoupMessage *msg,
+			  SoupBuffer  *chunk,
+			  RemuxStream *stream)
+{
+	stream->queued -= MIN (stream->queued, chunk->length);
+	remux_stream_fill (stream, msg);
+}
+
+static void
+stream_remuxed (RemoteDisplayHost     *host,
+		SoupMessage           *msg,
+		RemoteDisplayHostFile *file,
+		goffset                start,
+		goffset                end)
+{
+	RemuxStream *stream;
+
+	stream = g_new0 (RemuxStream, 1);
+	stream->host = g_object_ref (host);
+	stream->file = file_ref (file);
+	stream->pos = start;
+	stream->end = end;
+
+	soup_message_headers_set_content_length (msg->response_headers, end - start);
+	soup_message_body_set_accumulate (msg->response_body, FALSE);
+	g_signal_connect_data (msg, "wrote-body-data", G_CALLBACK (remux_wrote_body_data_cb),
+			       stream, (GClosureNotify) remux_stream_free, 0);
+	remux_stream_fill (stream, msg);
+}
+
+/* Answers range requests here, as SoupServer would copy the whole
+ * file to do it. Receivers only ask for one range, several get
+ * coalesced into one. */
+static void
+set_response (RemoteDisplayHost     *host,
+	      SoupMessage           *msg,
+	      RemoteDisplayHostFile *file)
+{
+	goffset length, start, end;
+	SoupRange *ranges;
+	int i, n_ranges;
+	guint status;
+
+	if (file->remux)
+		length = remote_display_remux_get_length (file->remux);
+	else
+		length = g_mapped_file_get_length (file->mapped_file);
+	start = 0;
+	end = length;
+	status = SOUP_STATUS_OK;
+
+	soup_message_headers_set_content_type (msg->response_headers,
+					       file->remux ? "video/mp4" : file->mime_type, NULL);
+	soup_message_headers_replace (msg->response_headers, "Accept-Ranges", "bytes");
+
+	if (soup_message_headers_get_one (msg->request_headers, "Range")) {
+		if (!soup_message_headers_get_ranges (msg->request_headers, length, &ranges, &n_ranges)) {
+			char *content_range;
+
+			content_range = g_strdup_printf ("bytes */%" G_GINT64_FORMAT, (gint64) length);
+			soup_message_headers_replace (msg->response_headers, "Content-Range", content_range);
+			g_free (content_range);
+			soup_message_set_status (msg, SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE);
+			return;
+		}
+
+		start = ranges[0].start;
+		end = ranges[0].end + 1;
+		for (i = 1; i < n_ranges; i++) {
+			start = MIN (start, ranges[i].start);
+			end = MAX (end, ranges[i].end + 1);
+		}
+		soup_message_headers_free_ranges (msg->request_headers, ranges);
+
+		soup_message_headers_set_content_range (msg->response_headers, start, end - 1, length);
+		status = SOUP_STATUS_PARTIAL_CONTENT;
+	}
+
+	if (msg->method != SOUP_METHOD_GET)
+		soup_message_headers_set_content_length (msg->response_headers, end - start);
+	else if (file->remux)
+		stream_remuxed (host, msg, file, start, end);
+	else
+		append_body (msg, file, start, end);
+
+	soup_message_set_status (msg, status);
+}
+
+static void
+waiting_finished_cb (SoupMessage           *msg,
+		     RemoteDisplayHostFile *file)
+{
+	/* Given up on by the client */
+	file->waiting = g_list_remove (file->waiting, msg);
+}
+
+static void
+index_thread (GTask        *task,
+	      gpointer      source_object,
+	      gpointer      task_data,
+	      GCancellable *cancellable)
+{
+	RemoteDisplayRemux *remux;
+	GError *error = NULL;
+
+	remux = remote_display_remux_new (task_data, &error);
+	if (remux)
+		g_task_return_pointer (task, remux, (GDestroyNotify) remote_display_remux_free);
+	else
+		g_task_return_error (task, error);
+}
+
+static void
+indexed_cb (GObject      *source_object,
+	    GAsyncResult *result,
+	    gpointer      user_data)
+{
+	RemoteDisplayHostPrivate *priv = GET_PRIVATE (source_object);
+	RemoteDisplayHostFile *file = user_data;
+	GError *error = NULL;
+	GList *waiting, *l;
+
+	file->remux = g_task_propagate_pointer (G_TASK (result), &error);
+	if (file->remux) {
+		g_debug ("Serving '%s' as fragmented MP4", file->path);
+	} else {
+		g_debug ("Serving '%s' as is: %s", file->path, error->message);
+		g_error_free (error);
+	}
+	file->indexing = FALSE;
+	file->remux_checked = TRUE;
+
+	waiting = file->waiting;
+	file->waiting = NULL;
+	for (l = waiting; l != NULL; l = l->next) {
+		SoupMessage *msg = l->data;
+
+		g_signal_handlers_disconnect_by_func (msg, waiting_finished_cb, file);
+		set_response (REMOTE_DISPLAY_HOST (source_object), msg, file);
+		soup_server_unpause_message (priv->server, msg);
+	}
+	g_list_free (waiting);
+	file_unref (file);
+}
+
+/* Holds @msg until @file is indexed */
+static void
+wait_for_index (RemoteDisplayHost     *host,
+		SoupMessage           *msg,
+		RemoteDisplayHostFile *file)
+{
+	RemoteDisplayHostPrivate *priv = GET_PRIVATE (host);
+	GTask *task;
+
+	if (!file->indexing) {
+		file->indexing = TRUE;
+		task = g_task_new (host, NULL, indexed_cb, file_ref (file));
+		g_task_set_task_data (task, g_mapped_file_ref (file->mapped_file),
+				      (GDestroyNotify) g_mapped_file_unref);
+		g_task_run_in_thread (task, index_thread);
+		g_object_unref (task);
+	}
+
+	file->waiting = g_list_prepend (file->waiting, msg);
+	g_signal_connect_data (msg, "finished", G_CALLBACK (waiting_finished_cb),
+			       file_ref (file), (GClosureNotify) file_unref, 0);
+	soup_server_pause_message (priv->server, msg);
+}
+
 static void
 server_callback (SoupServer        *server,
 		 SoupMessage       *msg,
@@ -169,6 +612,11 @@ server_callback (SoupServer        *server,
 	RemoteDisplayHostPrivate *priv = GET_PRIVATE (host);
 	RemoteDisplayHostFile *file;
 
+	REMOTE_DISPLAY_PROBE2 (host_request_start, msg, path);
+#ifdef HAVE_SDT_PROBES
+	g_signal_connect (msg, "finished", G_CALLBACK (finished_cb), NULL);
+#endif
+
 	if (!client_allowed (host, client)) {
 		g_debug ("Client %s not allowed", soup_client_context_get_host (client));
 		soup_message_set_status (msg, SOUP_STATUS_FORBIDDEN);
@@ -200,22 +648,58 @@ server_callback (SoupServer        *server,
 			soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
 			return;
 		}
+		totals.mapped_bytes += g_mapped_file_get_length (file->mapped_file);
+	}
+
+	if (!file->faststart_checked) {
+		file->faststart_checked = TRUE;
+		if (remote_display_mp4_faststart ((const guint8 *) g_mapped_file_get_contents (file->mapped_file),
+						  g_mapped_file_get_length (file->mapped_file),
+						  &file->faststart))
+			g_debug ("Serving '%s' with its moov box first", file->path);
 	}
 
 	if (msg->method == SOUP_METHOD_GET) {
-		soup_message_set_response (msg, file->mime_type,
-					   SOUP_MEMORY_STATIC,
-					   g_mapped_file_get_contents (file->mapped_file),
-					   g_mapped_file_get_length (file->mapped_file));
-	} else {
-		soup_message_headers_set_content_type (msg->response_headers,
-						       file->mime_type, NULL);
+		ServedData *data;
+
+		data = g_new0 (ServedData, 1);
+		data->host = g_object_ref (host);
+		data->key = g_strdup (path + 1);
+		data->uri = g_strdup (file->uri);
+		g_signal_connect_data (msg, "wrote-body-data", G_CALLBACK (wrote_body_data_cb),
+				       data, (GClosureNotify) served_data_free, 0);
+	}
 
-		soup_message_headers_set_content_length (msg->response_headers,
-							 g_mapped_file_get_length (file->mapped_file));
+	if (!file->remux_checked) {
+		if (priv->remux && !file->faststart.moov &&
+		    remote_display_remux_probe ((const guint8 *) g_mapped_file_get_contents (file->mapped_file),
+						g_mapped_file_get_length (file->mapped_file))) {
+			wait_for_index (host, msg, file);
+			return;
+		}
+		file->remux_checked = TRUE;
 	}
 
-	soup_message_set_status(msg, SOUP_STATUS_OK);
+	set_response (host, msg, file);
+}
+
+static void
+request_started_cb (SoupServer        *server,
+		    SoupMessage       *msg,
+		    SoupClientContext *client,
+		    gpointer           user_data)
+{
+	totals.requests++;
+	totals.active_requests++;
+}
+
+static void
+request_done_cb (SoupServer        *server,
+		 SoupMessage       *msg,
+		 SoupClientContext *client,
+		 gpointer           user_data)
+{
+	totals.active_requests--;
 }
 
 static void
@@ -225,11 +709,16 @@ remote_display_host_init (RemoteDisplayHost *host)
 
 	priv = GET_PRIVATE (host);
 	priv->files = g_hash_table_new_full (g_str_hash, g_str_equal,
-					     g_free, (GDestroyNotify) file_free);
+					     g_free, (GDestroyNotify) file_unref);
 	priv->server = soup_server_new (NULL, NULL);
 	soup_server_add_handler (priv->server, NULL,
 				 server_callback, host, NULL);
-
+	g_signal_connect (priv->server, "request-started",
+			  G_CALLBACK (request_started_cb), NULL);
+	g_signal_connect (priv->server, "request-finished",
+			  G_CALLBACK (request_done_cb), NULL);
+	g_signal_connect (priv->server, "request-aborted",
+			  G_CALLBACK (request_done_cb), NULL);
 }
 
 RemoteDisplayHost *
@@ -266,6 +755,62 @@ get_server_uri (SoupServer *server,
 	return ret;
 }
 
+static gboolean
+ensure_listening (RemoteDisplayHost  *host,
+		  GError            **error)
+{
+	RemoteDisplayHostPrivate *priv = GET_PRIVATE (host);
+	GSocketAddress *addr;
+
+	if (priv->server_started)
+		return TRUE;
+
+	addr = g_inet_socket_address_new (priv->local_address, 0);
+	if (!soup_server_listen (priv->server, addr, 0, error)) {
+		g_object_unref (addr);
+		return FALSE;
+	}
+	g_object_unref (addr);
+	priv->server_started = TRUE;
+
+	return TRUE;
+}
+
+/**
+ * remote_display_host_add_handler:
+ * @host: a #RemoteDisplayHost
+ * @path: the path to handle, starting with a '/'
+ * @callback: the handler
+ * @user_data: data for @callback
+ * @error: a #GError
+ *
+ * Handles requests to @path, for example event callbacks from
+ * the device. Unlike files, the handler gets requests from any
+ * client, and needs to check them itself.
+ *
+ * Return value: the URI of the handler, or %NULL on error.
+ **/
+char *
+remote_display_host_add_handler (RemoteDisplayHost   *host,
+				 const char          *path,
+				 SoupServerCallback   callback,
+				 gpointer             user_data,
+				 GError             **error)
+{
+	RemoteDisplayHostPrivate *priv;
+
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_HOST (host), NULL);
+	g_return_val_if_fail (path != NULL && *path == '/', NULL);
+
+	priv = GET_PRIVATE (host);
+
+	if (!ensure_listening (host, error))
+		return NULL;
+
+	soup_server_add_handler (priv->server, path, callback, user_data, NULL);
+	return get_server_uri (priv->server, path + 1);
+}
+
 char *
 remote_display_host_file (RemoteDisplayHost *host,
 			  const char        *uri,
@@ -301,17 +846,9 @@ remote_display_host_file (RemoteDisplayHost *host,
 		return NULL;
 	}
 
-	if (!priv->server_started) {
-		GSocketAddress *addr;
-
-		addr = g_inet_socket_address_new (priv->local_address, 0);
-		if (!soup_server_listen (priv->server, addr, 0, error)) {
-			g_clear_object (&addr);
-			g_free (path);
-			return FALSE;
-		}
-		g_object_unref (addr);
-		priv->server_started = TRUE;
+	if (!ensure_listening (host, error)) {
+		g_free (path);
+		return FALSE;
 	}
 
 	checksum = g_checksum_new (G_CHECKSUM_SHA256);
@@ -319,6 +856,7 @@ remote_display_host_file (RemoteDisplayHost *host,
 	str = g_checksum_get_string (checksum);
 
 	file = g_new0 (RemoteDisplayHostFile, 1);
+	file->ref_count = 1;
 	file->uri = g_strdup (uri);
 	file->path = path;
 	file->mime_type = g_content_type_guess (file->path, NULL, 0, NULL);
@@ -330,3 +868,17 @@ remote_display_host_file (RemoteDisplayHost *host,
 
 	return ret;
 }
+
+/**
+ * remote_display_host_get_totals:
+ * @stats: (out): where to store the totals
+ *
+ * Gets what all the hosts served since the start.
+ **/
+void
+remote_display_host_get_totals (RemoteDisplayHostStats *stats)
+{
+	g_return_if_fail (stats != NULL);
+
+	*stats = totals;
+}
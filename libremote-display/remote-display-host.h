@@ -21,6 +21,7 @@
 
 #include <glib-object.h>
 #include <gio/gio.h>
+#include <libsoup/soup.h>
 
 G_BEGIN_DECLS
 
@@ -36,11 +37,24 @@ typedef struct _RemoteDisplayHostPrivate RemoteDisplayHostPrivate;
 typedef struct _RemoteDisplayHost      RemoteDisplayHost;
 typedef struct _RemoteDisplayHostClass RemoteDisplayHostClass;
 
+typedef struct {
+	guint64 requests;              /* Since the start */
+	guint64 bytes_served;          /* Since the start */
+	guint active_requests;
+	guint64 mapped_bytes;          /* Files currently mapped to be served */
+} RemoteDisplayHostStats;
+
 RemoteDisplayHost *remote_display_host_new (GInetAddress *remote_address,
 					    GInetAddress *local_address);
 char *remote_display_host_file (RemoteDisplayHost  *host,
 				const char         *uri,
 				GError            **error);
+char *remote_display_host_add_handler (RemoteDisplayHost   *host,
+				       const char          *path,
+				       SoupServerCallback   callback,
+				       gpointer             user_data,
+				       GError             **error);
+void remote_display_host_get_totals (RemoteDisplayHostStats *stats);
 
 G_END_DECLS
 
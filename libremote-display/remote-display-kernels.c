@@ -0,0 +1,935 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_NEON_KERNELS 1
+#include <arm_neon.h>
+#endif
+
+#include <libremote-display/remote-display-kernels.h>
+
+/* BT.601, limited range, 8-bit fixed point. The SIMD versions
+ * below must stay bit-exact with those. */
+#define RGB_TO_Y(r, g, b) ((( 66 * (r) + 129 * (g) +  25 * (b) + 128) >> 8) +  16)
+#define RGB_TO_U(r, g, b) (((-38 * (r) -  74 * (g) + 112 * (b) + 128) >> 8) + 128)
+#define RGB_TO_V(r, g, b) (((112 * (r) -  94 * (g) -  18 * (b) + 128) >> 8) + 128)
+
+/* Scalar reference */
+
+/* Converts columns [x1, x2) of two lines, writing chroma with a step
+ * of uv_step, so that NV12 and I420 can share the code */
+static inline void
+convert_lines_scalar (const guint8 *l0,
+		      const guint8 *l1,
+		      gboolean      bgrx,
+		      guint         x1,
+		      guint         x2,
+		      guint8       *y0,
+		      guint8       *y1,
+		      guint8       *u,
+		      guint8       *v,
+		      guint         uv_step)
+{
+	int r_off = bgrx ? 2 : 0;
+	int b_off = bgrx ? 0 : 2;
+	guint x;
+
+	for (x = x1; x < x2; x += 2) {
+		const guint8 *p0 = l0 + x * 4, *p1 = p0 + 4;
+		const guint8 *p2 = l1 + x * 4, *p3 = p2 + 4;
+		int r, g, b;
+
+		y0[x]     = RGB_TO_Y (p0[r_off], p0[1], p0[b_off]);
+		y0[x + 1] = RGB_TO_Y (p1[r_off], p1[1], p1[b_off]);
+		y1[x]     = RGB_TO_Y (p2[r_off], p2[1], p2[b_off]);
+		y1[x + 1] = RGB_TO_Y (p3[r_off], p3[1], p3[b_off]);
+
+		r = (p0[r_off] + p1[r_off] + p2[r_off] + p3[r_off] + 2) >> 2;
+		g = (p0[1] + p1[1] + p2[1] + p3[1] + 2) >> 2;
+		b = (p0[b_off] + p1[b_off] + p2[b_off] + p3[b_off] + 2) >> 2;
+		u[x / 2 * uv_step] = RGB_TO_U (r, g, b);
+		v[x / 2 * uv_step] = RGB_TO_V (r, g, b);
+	}
+}
+
+static void
+rgbx_to_i420_scalar (const guint8 *src, guint src_stride, gboolean bgrx,
+		     guint width, guint height,
+		     guint8 *y, guint y_stride,
+		     guint8 *u, guint u_stride,
+		     guint8 *v, guint v_stride)
+{
+	guint line;
+
+	for (line = 0; line < height; line += 2) {
+		convert_lines_scalar (src + line * src_stride, src + (line + 1) * src_stride, bgrx,
+				      0, width,
+				      y + line * y_stride, y + (line + 1) * y_stride,
+				      u + line / 2 * u_stride, v + line / 2 * v_stride, 1);
+	}
+}
+
+static void
+rgbx_to_nv12_scalar (const guint8 *src, guint src_stride, gboolean bgrx,
+		     guint width, guint height,
+		     guint8 *y, guint y_stride,
+		     guint8 *uv, guint uv_stride)
+{
+	guint line;
+
+	for (line = 0; line < height; line += 2) {
+		guint8 *uv_line = uv + line / 2 * uv_stride;
+
+		convert_lines_scalar (src + line * src_stride, src + (line + 1) * src_stride, bgrx,
+				      0, width,
+				      y + line * y_stride, y + (line + 1) * y_stride,
+				      uv_line, uv_line + 1, 2);
+	}
+}
+
+static inline void
+halve_line_scalar (const guint8 *s0,
+		   const guint8 *s1,
+		   guint         x1,
+		   guint         x2,
+		   guint8       *dst)
+{
+	guint x;
+
+	for (x = x1; x < x2; x++)
+		dst[x] = (s0[x * 2] + s0[x * 2 + 1] + s1[x * 2] + s1[x * 2 + 1] + 2) >> 2;
+}
+
+static void
+halve_plane_scalar (const guint8 *src, guint src_stride,
+		    guint width, guint height,
+		    guint8 *dst, guint dst_stride)
+{
+	guint line;
+
+	for (line = 0; line < height; line++) {
+		halve_line_scalar (src + line * 2 * src_stride, src + (line * 2 + 1) * src_stride,
+				   0, width, dst + line * dst_stride);
+	}
+}
+
+static const RemoteDisplayKernels kernels_scalar = {
+	REMOTE_DISPLAY_KERNELS_SCALAR,
+	"scalar",
+	rgbx_to_i420_scalar,
+	rgbx_to_nv12_scalar,
+	halve_plane_scalar
+};
+
+#ifdef HAVE_X86_KERNELS
+
+/* SSE2: 16 pixels of 2 lines at a time. Channels are extracted into
+ * 16-bit lanes. Luma is computed modulo 2^16 and shifted logically,
+ * which is exact as the sum is below 65536, chroma fits in signed
+ * 16-bit so arithmetic shifts match the scalar code. */
+
+__attribute__((target("sse2")))
+static inline void
+extract_sse2 (const guint8 *p,
+	      gboolean      bgrx,
+	      __m128i      *r,
+	      __m128i      *g,
+	      __m128i      *b)
+{
+	const __m128i mask = _mm_set1_epi32 (0xff);
+	__m128i a0, a1, c0[2], c1[2], c2[2];
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		a0 = _mm_loadu_si128 ((const __m128i *) (p + i * 32));
+		a1 = _mm_loadu_si128 ((const __m128i *) (p + i * 32 + 16));
+		c0[i] = _mm_packs_epi32 (_mm_and_si128 (a0, mask),
+					 _mm_and_si128 (a1, mask));
+		c1[i] = _mm_packs_epi32 (_mm_and_si128 (_mm_srli_epi32 (a0, 8), mask),
+					 _mm_and_si128 (_mm_srli_epi32 (a1, 8), mask));
+		c2[i] = _mm_packs_epi32 (_mm_and_si128 (_mm_srli_epi32 (a0, 16), mask),
+					 _mm_and_si128 (_mm_srli_epi32 (a1, 16), mask));
+	}
+
+	/* [0] holds pixels 0-7, [1] pixels 8-15 */
+	g[0] = c1[0];
+	g[1] = c1[1];
+	if (bgrx) {
+		b[0] = c0[0]; b[1] = c0[1];
+		r[0] = c2[0]; r[1] = c2[1];
+	} else {
+		r[0] = c0[0]; r[1] = c0[1];
+		b[0] = c2[0]; b[1] = c2[1];
+	}
+}
+
+__attribute__((target("sse2")))
+static inline __m128i
+luma_sse2 (__m128i r, __m128i g, __m128i b)
+{
+	__m128i sum;
+
+	sum = _mm_add_epi16 (_mm_mullo_epi16 (r, _mm_set1_epi16 (66)),
+			     _mm_mullo_epi16 (g, _mm_set1_epi16 (129)));
+	sum = _mm_add_epi16 (sum, _mm_mullo_epi16 (b, _mm_set1_epi16 (25)));
+	sum = _mm_add_epi16 (sum, _mm_set1_epi16 (128));
+	return _mm_add_epi16 (_mm_srli_epi16 (sum, 8), _mm_set1_epi16 (16));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i
+chroma_sse2 (__m128i r, __m128i g, __m128i b,
+	     short   cr, short cg, short cb)
+{
+	__m128i sum;
+
+	sum = _mm_add_epi16 (_mm_mullo_epi16 (r, _mm_set1_epi16 (cr)),
+			     _mm_mullo_epi16 (g, _mm_set1_epi16 (cg)));
+	sum = _mm_add_epi16 (sum, _mm_mullo_epi16 (b, _mm_set1_epi16 (cb)));
+	sum = _mm_add_epi16 (sum, _mm_set1_epi16 (128));
+	return _mm_add_epi16 (_mm_srai_epi16 (sum, 8), _mm_set1_epi16 (128));
+}
+
+/* Averages 2x2 blocks of 16 pixels wide lines into 8 values */
+__attribute__((target("sse2")))
+static inline __m128i
+average_sse2 (const __m128i *c0, const __m128i *c1)
+{
+	const __m128i ones = _mm_set1_epi16 (1);
+	__m128i lo, hi;
+
+	lo = _mm_madd_epi16 (_mm_add_epi16 (c0[0], c1[0]), ones);
+	hi = _mm_madd_epi16 (_mm_add_epi16 (c0[1], c1[1]), ones);
+	return _mm_srli_epi16 (_mm_add_epi16 (_mm_packs_epi32 (lo, hi),
+					      _mm_set1_epi16 (2)), 2);
+}
+
+__attribute__((target("sse2")))
+static inline void
+convert_block_sse2 (const guint8 *l0,
+		    const guint8 *l1,
+		    gboolean      bgrx,
+		    guint8       *y0,
+		    guint8       *y1,
+		    __m128i      *u,
+		    __m128i      *v)
+{
+	__m128i r0[2], g0[2], b0[2], r1[2], g1[2], b1[2];
+	__m128i r, g, b;
+
+	extract_sse2 (l0, bgrx, r0, g0, b0);
+	extract_sse2 (l1, bgrx, r1, g1, b1);
+
+	_mm_storeu_si128 ((__m128i *) y0,
+			  _mm_packus_epi16 (luma_sse2 (r0[0], g0[0], b0[0]),
+					    luma_sse2 (r0[1], g0[1], b0[1])));
+	_mm_storeu_si128 ((__m128i *) y1,
+			  _mm_packus_epi16 (luma_sse2 (r1[0], g1[0], b1[0]),
+					    luma_sse2 (r1[1], g1[1], b1[1])));
+
+	r = average_sse2 (r0, r1);
+	g = average_sse2 (g0, g1);
+	b = average_sse2 (b0, b1);
+	*u = chroma_sse2 (r, g, b, -38, -74, 112);
+	*v = chroma_sse2 (r, g, b, 112, -94, -18);
+}
+
+__attribute__((target("sse2")))
+static void
+rgbx_to_i420_sse2 (const guint8 *src, guint src_stride, gboolean bgrx,
+		   guint width, guint height,
+		   guint8 *y, guint y_stride,
+		   guint8 *u, guint u_stride,
+		   guint8 *v, guint v_stride)
+{
+	guint line, x, simd_width;
+
+	simd_width = width & ~15;
+	for (line = 0; line < height; line += 2) {
+		const guint8 *l0 = src + line * src_stride;
+		const guint8 *l1 = l0 + src_stride;
+		guint8 *y0 = y + line * y_stride;
+		guint8 *y1 = y0 + y_stride;
+		guint8 *u_line = u + line / 2 * u_stride;
+		guint8 *v_line = v + line / 2 * v_stride;
+
+		for (x = 0; x < simd_width; x += 16) {
+			__m128i cu, cv;
+
+			convert_block_sse2 (l0 + x * 4, l1 + x * 4, bgrx, y0 + x, y1 + x, &cu, &cv);
+			_mm_storel_epi64 ((__m128i *) (u_line + x / 2), _mm_packus_epi16 (cu, cu));
+			_mm_storel_epi64 ((__m128i *) (v_line + x / 2), _mm_packus_epi16 (cv, cv));
+		}
+		convert_lines_scalar (l0, l1, bgrx, simd_width, width, y0, y1, u_line, v_line, 1);
+	}
+}
+
+__attribute__((target("sse2")))
+static void
+rgbx_to_nv12_sse2 (const guint8 *src, guint src_stride, gboolean bgrx,
+		   guint width, guint height,
+		   guint8 *y, guint y_stride,
+		   guint8 *uv, guint uv_stride)
+{
+	guint line, x, simd_width;
+
+	simd_width = width & ~15;
+	for (line = 0; line < height; line += 2) {
+		const guint8 *l0 = src + line * src_stride;
+		const guint8 *l1 = l0 + src_stride;
+		guint8 *y0 = y + line * y_stride;
+		guint8 *y1 = y0 + y_stride;
+		guint8 *uv_line = uv + line / 2 * uv_stride;
+
+		for (x = 0; x < simd_width; x += 16) {
+			__m128i cu, cv;
+
+			convert_block_sse2 (l0 + x * 4, l1 + x * 4, bgrx, y0 + x, y1 + x, &cu, &cv);
+			_mm_storeu_si128 ((__m128i *) (uv_line + x),
+					  _mm_unpacklo_epi8 (_mm_packus_epi16 (cu, cu),
+							     _mm_packus_epi16 (cv, cv)));
+		}
+		convert_lines_scalar (l0, l1, bgrx, simd_width, width, y0, y1,
+				      uv_line, uv_line + 1, 2);
+	}
+}
+
+/* Sums horizontal pairs of bytes into 16-bit lanes */
+__attribute__((target("sse2")))
+static inline __m128i
+pair_sum_sse2 (__m128i a)
+{
+	const __m128i mask = _mm_set1_epi16 (0xff);
+
+	return _mm_add_epi16 (_mm_and_si128 (a, mask), _mm_srli_epi16 (a, 8));
+}
+
+__attribute__((target("sse2")))
+static void
+halve_plane_sse2 (const guint8 *src, guint src_stride,
+		  guint width, guint height,
+		  guint8 *dst, guint dst_stride)
+{
+	const __m128i two = _mm_set1_epi16 (2);
+	guint line, x, simd_width;
+
+	simd_width = width & ~15;
+	for (line = 0; line < height; line++) {
+		const guint8 *s0 = src + line * 2 * src_stride;
+		const guint8 *s1 = s0 + src_stride;
+		guint8 *d = dst + line * dst_stride;
+
+		for (x = 0; x < simd_width; x += 16) {
+			__m128i lo, hi;
+
+			lo = _mm_add_epi16 (pair_sum_sse2 (_mm_loadu_si128 ((const __m128i *) (s0 + x * 2))),
+					    pair_sum_sse2 (_mm_loadu_si128 ((const __m128i *) (s1 + x * 2))));
+			hi = _mm_add_epi16 (pair_sum_sse2 (_mm_loadu_si128 ((const __m128i *) (s0 + x * 2 + 16))),
+					    pair_sum_sse2 (_mm_loadu_si128 ((const __m128i *) (s1 + x * 2 + 16))));
+			lo = _mm_srli_epi16 (_mm_add_epi16 (lo, two), 2);
+			hi = _mm_srli_epi16 (_mm_add_epi16 (hi, two), 2);
+			_mm_storeu_si128 ((__m128i *) (d + x), _mm_packus_epi16 (lo, hi));
+		}
+		halve_line_scalar (s0, s1, simd_width, width, d);
+	}
+}
+
+static const RemoteDisplayKernels kernels_sse2 = {
+	REMOTE_DISPLAY_KERNELS_SSE2,
+	"sse2",
+	rgbx_to_i420_sse2,
+	rgbx_to_nv12_sse2,
+	halve_plane_sse2
+};
+
+/* AVX2: same as SSE2 with 32 pixels at a time. The pack instructions
+ * work within 128-bit lanes, so 64-bit quarters get shuffled back in
+ * order after each pack. */
+
+#define AVX2_FIX_ORDER(x) _mm256_permute4x64_epi64 ((x), 0xd8)
+
+__attribute__((target("avx2")))
+static inline void
+extract_avx2 (const guint8 *p,
+	      gboolean      bgrx,
+	      __m256i      *r,
+	      __m256i      *g,
+	      __m256i      *b)
+{
+	const __m256i mask = _mm256_set1_epi32 (0xff);
+	__m256i a0, a1, c0[2], c1[2], c2[2];
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		a0 = _mm256_loadu_si256 ((const __m256i *) (p + i * 64));
+		a1 = _mm256_loadu_si256 ((const __m256i *) (p + i * 64 + 32));
+		c0[i] = AVX2_FIX_ORDER (_mm256_packs_epi32 (_mm256_and_si256 (a0, mask),
+							    _mm256_and_si256 (a1, mask)));
+		c1[i] = AVX2_FIX_ORDER (_mm256_packs_epi32 (_mm256_and_si256 (_mm256_srli_epi32 (a0, 8), mask),
+							    _mm256_and_si256 (_mm256_srli_epi32 (a1, 8), mask)));
+		c2[i] = AVX2_FIX_ORDER (_mm256_packs_epi32 (_mm256_and_si256 (_mm256_srli_epi32 (a0, 16), mask),
+							    _mm256_and_si256 (_mm256_srli_epi32 (a1, 16), mask)));
+	}
+
+	/* [0] holds pixels 0-15, [1] pixels 16-31 */
+	g[0] = c1[0];
+	g[1] = c1[1];
+	if (bgrx) {
+		b[0] = c0[0]; b[1] = c0[1];
+		r[0] = c2[0]; r[1] = c2[1];
+	} else {
+		r[0] = c0[0]; r[1] = c0[1];
+		b[0] = c2[0]; b[1] = c2[1];
+	}
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+luma_avx2 (__m256i r, __m256i g, __m256i b)
+{
+	__m256i sum;
+
+	sum = _mm256_add_epi16 (_mm256_mullo_epi16 (r, _mm256_set1_epi16 (66)),
+				_mm256_mullo_epi16 (g, _mm256_set1_epi16 (129)));
+	sum = _mm256_add_epi16 (sum, _mm256_mullo_epi16 (b, _mm256_set1_epi16 (25)));
+	sum = _mm256_add_epi16 (sum, _mm256_set1_epi16 (128));
+	return _mm256_add_epi16 (_mm256_srli_epi16 (sum, 8), _mm256_set1_epi16 (16));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+chroma_avx2 (__m256i r, __m256i g, __m256i b,
+	     short   cr, short cg, short cb)
+{
+	__m256i sum;
+
+	sum = _mm256_add_epi16 (_mm256_mullo_epi16 (r, _mm256_set1_epi16 (cr)),
+				_mm256_mullo_epi16 (g, _mm256_set1_epi16 (cg)));
+	sum = _mm256_add_epi16 (sum, _mm256_mullo_epi16 (b, _mm256_set1_epi16 (cb)));
+	sum = _mm256_add_epi16 (sum, _mm256_set1_epi16 (128));
+	return _mm256_add_epi16 (_mm256_srai_epi16 (sum, 8), _mm256_set1_epi16 (128));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+average_avx2 (const __m256i *c0, const __m256i *c1)
+{
+	const __m256i ones = _mm256_set1_epi16 (1);
+	__m256i lo, hi;
+
+	lo = _mm256_madd_epi16 (_mm256_add_epi16 (c0[0], c1[0]), ones);
+	hi = _mm256_madd_epi16 (_mm256_add_epi16 (c0[1], c1[1]), ones);
+	return _mm256_srli_epi16 (_mm256_add_epi16 (AVX2_FIX_ORDER (_mm256_packs_epi32 (lo, hi)),
+						    _mm256_set1_epi16 (2)), 2);
+}
+
+__attribute__((target("avx2")))
+static inline void
+convert_block_avx2 (const guint8 *l0,
+		    const guint8 *l1,
+		    gboolean      bgrx,
+		    guint8       *y0,
+		    guint8       *y1,
+		    __m256i      *u,
+		    __m256i      *v)
+{
+	__m256i r0[2], g0[2], b0[2], r1[2], g1[2], b1[2];
+	__m256i r, g, b;
+
+	extract_avx2 (l0, bgrx, r0, g0, b0);
+	extract_avx2 (l1, bgrx, r1, g1, b1);
+
+	_mm256_storeu_si256 ((__m256i *) y0,
+			     AVX2_FIX_ORDER (_mm256_packus_epi16 (luma_avx2 (r0[0], g0[0], b0[0]),
+								  luma_avx2 (r0[1], g0[1], b0[1]))));
+	_mm256_storeu_si256 ((__m256i *) y1,
+			     AVX2_FIX_ORDER (_mm256_packus_epi16 (luma_avx2 (r1[0], g1[0], b1[0]),
+								  luma_avx2 (r1[1], g1[1], b1[1]))));
+
+	r = average_avx2 (r0, r1);
+	g = average_avx2 (g0, g1);
+	b = average_avx2 (b0, b1);
+	*u = chroma_avx2 (r, g, b, -38, -74, 112);
+	*v = chroma_avx2 (r, g, b, 112, -94, -18);
+}
+
+/* Packs 16 16-bit values into 16 bytes */
+__attribute__((target("avx2")))
+static inline __m128i
+pack_avx2 (__m256i a)
+{
+	return _mm256_castsi256_si128 (AVX2_FIX_ORDER (_mm256_packus_epi16 (a, a)));
+}
+
+__attribute__((target("avx2")))
+static void
+rgbx_to_i420_avx2 (const guint8 *src, guint src_stride, gboolean bgrx,
+		   guint width, guint height,
+		   guint8 *y, guint y_stride,
+		   guint8 *u, guint u_stride,
+		   guint8 *v, guint v_stride)
+{
+	guint line, x, simd_width;
+
+	simd_width = width & ~31;
+	for (line = 0; line < height; line += 2) {
+		const guint8 *l0 = src + line * src_stride;
+		const guint8 *l1 = l0 + src_stride;
+		guint8 *y0 = y + line * y_stride;
+		guint8 *y1 = y0 + y_stride;
+		guint8 *u_line = u + line / 2 * u_stride;
+		guint8 *v_line = v + line / 2 * v_stride;
+
+		for (x = 0; x < simd_width; x += 32) {
+			__m256i cu, cv;
+
+			convert_block_avx2 (l0 + x * 4, l1 + x * 4, bgrx, y0 + x, y1 + x, &cu, &cv);
+			_mm_storeu_si128 ((__m128i *) (u_line + x / 2), pack_avx2 (cu));
+			_mm_storeu_si128 ((__m128i *) (v_line + x / 2), pack_avx2 (cv));
+		}
+		convert_lines_scalar (l0, l1, bgrx, simd_width, width, y0, y1, u_line, v_line, 1);
+	}
+}
+
+__attribute__((target("avx2")))
+static void
+rgbx_to_nv12_avx2 (const guint8 *src, guint src_stride, gboolean bgrx,
+		   guint width, guint height,
+		   guint8 *y, guint y_stride,
+		   guint8 *uv, guint uv_stride)
+{
+	guint line, x, simd_width;
+
+	simd_width = width & ~31;
+	for (line = 0; line < height; line += 2) {
+		const guint8 *l0 = src + line * src_stride;
+		const guint8 *l1 = l0 + src_stride;
+		guint8 *y0 = y + line * y_stride;
+		guint8 *y1 = y0 + y_stride;
+		guint8 *uv_line = uv + line / 2 * uv_stride;
+
+		for (x = 0; x < simd_width; x += 32) {
+			__m256i cu, cv;
+			__m128i pu, pv;
+
+			convert_block_avx2 (l0 + x * 4, l1 + x * 4, bgrx, y0 + x, y1 + x, &cu, &cv);
+			pu = pack_avx2 (cu);
+			pv = pack_avx2 (cv);
+			_mm_storeu_si128 ((__m128i *) (uv_line + x), _mm_unpacklo_epi8 (pu, pv));
+			_mm_storeu_si128 ((__m128i *) (uv_line + x + 16), _mm_unpackhi_epi8 (pu, pv));
+		}
+		convert_lines_scalar (l0, l1, bgrx, simd_width, width, y0, y1,
+				      uv_line, uv_line + 1, 2);
+	}
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+pair_sum_avx2 (__m256i a)
+{
+	const __m256i mask = _mm256_set1_epi16 (0xff);
+
+	return _mm256_add_epi16 (_mm256_and_si256 (a, mask), _mm256_srli_epi16 (a, 8));
+}
+
+__attribute__((target("avx2")))
+static void
+halve_plane_avx2 (const guint8 *src, guint src_stride,
+		  guint width, guint height,
+		  guint8 *dst, guint dst_stride)
+{
+	const __m256i two = _mm256_set1_epi16 (2);
+	guint line, x, simd_width;
+
+	simd_width = width & ~31;
+	for (line = 0; line < height; line++) {
+		const guint8 *s0 = src + line * 2 * src_stride;
+		const guint8 *s1 = s0 + src_stride;
+		guint8 *d = dst + line * dst_stride;
+
+		for (x = 0; x < simd_width; x += 32) {
+			__m256i lo, hi;
+
+			lo = _mm256_add_epi16 (pair_sum_avx2 (_mm256_loadu_si256 ((const __m256i *) (s0 + x * 2))),
+					       pair_sum_avx2 (_mm256_loadu_si256 ((const __m256i *) (s1 + x * 2))));
+			hi = _mm256_add_epi16 (pair_sum_avx2 (_mm256_loadu_si256 ((const __m256i *) (s0 + x * 2 + 32))),
+					       pair_sum_avx2 (_mm256_loadu_si256 ((const __m256i *) (s1 + x * 2 + 32))));
+			lo = _mm256_srli_epi16 (_mm256_add_epi16 (lo, two), 2);
+			hi = _mm256_srli_epi16 (_mm256_add_epi16 (hi, two), 2);
+			_mm256_storeu_si256 ((__m256i *) (d + x),
+					     AVX2_FIX_ORDER (_mm256_packus_epi16 (lo, hi)));
+		}
+		halve_line_scalar (s0, s1, simd_width, width, d);
+	}
+}
+
+static const RemoteDisplayKernels kernels_avx2 = {
+	REMOTE_DISPLAY_KERNELS_AVX2,
+	"avx2",
+	rgbx_to_i420_avx2,
+	rgbx_to_nv12_avx2,
+	halve_plane_avx2
+};
+
+#endif /* HAVE_X86_KERNELS */
+
+#ifdef HAVE_NEON_KERNELS
+
+/* NEON: 16 pixels of 2 lines at a time, vld4 does the channel
+ * split for us, and widening multiplies keep luma in 16 bits */
+
+static inline void
+extract_neon (const guint8 *p,
+	      gboolean      bgrx,
+	      uint8x16_t   *r,
+	      uint8x16_t   *g,
+	      uint8x16_t   *b)
+{
+	uint8x16x4_t px;
+
+	px = vld4q_u8 (p);
+	*g = px.val[1];
+	*r = bgrx ? px.val[2] : px.val[0];
+	*b = bgrx ? px.val[0] : px.val[2];
+}
+
+static inline uint8x8_t
+luma_neon (uint8x8_t r, uint8x8_t g, uint8x8_t b)
+{
+	uint16x8_t sum;
+
+	sum = vmull_u8 (r, vdup_n_u8 (66));
+	sum = vmlal_u8 (sum, g, vdup_n_u8 (129));
+	sum = vmlal_u8 (sum, b, vdup_n_u8 (25));
+	sum = vaddq_u16 (sum, vdupq_n_u16 (128));
+	return vadd_u8 (vshrn_n_u16 (sum, 8), vdup_n_u8 (16));
+}
+
+static inline uint8x8_t
+chroma_neon (int16x8_t r, int16x8_t g, int16x8_t b,
+	     int16_t   cr, int16_t cg, int16_t cb)
+{
+	int16x8_t sum;
+
+	sum = vmulq_n_s16 (r, cr);
+	sum = vmlaq_n_s16 (sum, g, cg);
+	sum = vmlaq_n_s16 (sum, b, cb);
+	sum = vaddq_s16 (sum, vdupq_n_s16 (128));
+	sum = vaddq_s16 (vshrq_n_s16 (sum, 8), vdupq_n_s16 (128));
+	return vqmovun_s16 (sum);
+}
+
+/* (a0 + a1 + b0 + b1 + 2) >> 2 for horizontal pairs of two lines */
+static inline int16x8_t
+average_neon (uint8x16_t c0, uint8x16_t c1)
+{
+	uint16x8_t sum;
+
+	sum = vpaddlq_u8 (c0);
+	sum = vpadalq_u8 (sum, c1);
+	return vreinterpretq_s16_u16 (vrshrq_n_u16 (sum, 2));
+}
+
+static inline void
+convert_block_neon (const guint8 *l0,
+		    const guint8 *l1,
+		    gboolean      bgrx,
+		    guint8       *y0,
+		    guint8       *y1,
+		    uint8x8_t    *u,
+		    uint8x8_t    *v)
+{
+	uint8x16_t r0, g0, b0, r1, g1, b1;
+	int16x8_t r, g, b;
+
+	extract_neon (l0, bgrx, &r0, &g0, &b0);
+	extract_neon (l1, bgrx, &r1, &g1, &b1);
+
+	vst1q_u8 (y0, vcombine_u8 (luma_neon (vget_low_u8 (r0), vget_low_u8 (g0), vget_low_u8 (b0)),
+				   luma_neon (vget_high_u8 (r0), vget_high_u8 (g0), vget_high_u8 (b0))));
+	vst1q_u8 (y1, vcombine_u8 (luma_neon (vget_low_u8 (r1), vget_low_u8 (g1), vget_low_u8 (b1)),
+				   luma_neon (vget_high_u8 (r1), vget_high_u8 (g1), vget_high_u8 (b1))));
+
+	r = average_neon (r0, r1);
+	g = average_neon (g0, g1);
+	b = average_neon (b0, b1);
+	*u = chroma_neon (r, g, b, -38, -74, 112);
+	*v = chroma_neon (r, g, b, 112, -94, -18);
+}
+
+static void
+rgbx_to_i420_neon (const guint8 *src, guint src_stride, gboolean bgrx,
+		   guint width, guint height,
+		   guint8 *y, guint y_stride,
+		   guint8 *u, guint u_stride,
+		   guint8 *v, guint v_stride)
+{
+	guint line, x, simd_width;
+
+	simd_width = width & ~15;
+	for (line = 0; line < height; line += 2) {
+		const guint8 *l0 = src + line * src_stride;
+		const guint8 *l1 = l0 + src_stride;
+		guint8 *y0 = y + line * y_stride;
+		guint8 *y1 = y0 + y_stride;
+		guint8 *u_line = u + line / 2 * u_stride;
+		guint8 *v_line = v + line / 2 * v_stride;
+
+		for (x = 0; x < simd_width; x += 16) {
+			uint8x8_t cu, cv;
+
+			convert_block_neon (l0 + x * 4, l1 + x * 4, bgrx, y0 + x, y1 + x, &cu, &cv);
+			vst1_u8 (u_line + x / 2, cu);
+			vst1_u8 (v_line + x / 2, cv);
+		}
+		convert_lines_scalar (l0, l1, bgrx, simd_width, width, y0, y1, u_line, v_line, 1);
+	}
+}
+
+static void
+rgbx_to_nv12_neon (const guint8 *src, guint src_stride, gboolean bgrx,
+		   guint width, guint height,
+		   guint8 *y, guint y_stride,
+		   guint8 *uv, guint uv_stride)
+{
+	guint line, x, simd_width;
+
+	simd_width = width & ~15;
+	for (line = 0; line < height; line += 2) {
+		const guint8 *l0 = src + line * src_stride;
+		const guint8 *l1 = l0 + src_stride;
+		guint8 *y0 = y + line * y_stride;
+		guint8 *y1 = y0 + y_stride;
+		guint8 *uv_line = uv + line / 2 * uv_stride;
+
+		for (x = 0; x < simd_width; x += 16) {
+			uint8x8x2_t cuv;
+
+			convert_block_neon (l0 + x * 4, l1 + x * 4, bgrx, y0 + x, y1 + x,
+					    &cuv.val[0], &cuv.val[1]);
+			vst2_u8 (uv_line + x, cuv);
+		}
+		convert_lines_scalar (l0, l1, bgrx, simd_width, width, y0, y1,
+				      uv_line, uv_line + 1, 2);
+	}
+}
+
+static void
+halve_plane_neon (const guint8 *src, guint src_stride,
+		  guint width, guint height,
+		  guint8 *dst, guint dst_stride)
+{
+	guint line, x, simd_width;
+
+	simd_width = width & ~15;
+	for (line = 0; line < height; line++) {
+		const guint8 *s0 = src + line * 2 * src_stride;
+		const guint8 *s1 = s0 + src_stride;
+		guint8 *d = dst + line * dst_stride;
+
+		for (x = 0; x < simd_width; x += 16) {
+			uint16x8_t lo, hi;
+
+			lo = vpadalq_u8 (vpaddlq_u8 (vld1q_u8 (s0 + x * 2)), vld1q_u8 (s1 + x * 2));
+			hi = vpadalq_u8 (vpaddlq_u8 (vld1q_u8 (s0 + x * 2 + 16)), vld1q_u8 (s1 + x * 2 + 16));
+			vst1q_u8 (d + x, vcombine_u8 (vrshrn_n_u16 (lo, 2), vrshrn_n_u16 (hi, 2)));
+		}
+		halve_line_scalar (s0, s1, simd_width, width, d);
+	}
+}
+
+static const RemoteDisplayKernels kernels_neon = {
+	REMOTE_DISPLAY_KERNELS_NEON,
+	"neon",
+	rgbx_to_i420_neon,
+	rgbx_to_nv12_neon,
+	halve_plane_neon
+};
+
+#endif /* HAVE_NEON_KERNELS */
+
+/**
+ * remote_display_kernels_get:
+ * @impl: the implementation to get
+ *
+ * Return value: the kernels for @impl, or %NULL if they are not
+ * available in this build, or not supported by this CPU.
+ **/
+const RemoteDisplayKernels *
+remote_display_kernels_get (RemoteDisplayKernelsImpl impl)
+{
+	switch (impl) {
+	case REMOTE_DISPLAY_KERNELS_SCALAR:
+		return &kernels_scalar;
+#ifdef HAVE_X86_KERNELS
+	case REMOTE_DISPLAY_KERNELS_SSE2:
+		__builtin_cpu_init ();
+		return __builtin_cpu_supports ("sse2") ? &kernels_sse2 : NULL;
+	case REMOTE_DISPLAY_KERNELS_AVX2:
+		__builtin_cpu_init ();
+		return __builtin_cpu_supports ("avx2") ? &kernels_avx2 : NULL;
+#endif
+#ifdef HAVE_NEON_KERNELS
+	case REMOTE_DISPLAY_KERNELS_NEON:
+		return &kernels_neon;
+#endif
+	default:
+		return NULL;
+	}
+}
+
+static gpointer
+pick_kernels (G_GNUC_UNUSED gpointer data)
+{
+	const RemoteDisplayKernels *kernels = NULL;
+	const char *env;
+	int impl;
+
+	/* Allow forcing an implementation, for debugging */
+	env = g_getenv ("REMOTE_DISPLAY_KERNELS");
+	if (env != NULL) {
+		for (impl = 0; impl < REMOTE_DISPLAY_KERNELS_NUM_IMPLS; impl++) {
+			kernels = remote_display_kernels_get (impl);
+			if (kernels && g_strcmp0 (kernels->name, env) == 0)
+				return (gpointer) kernels;
+		}
+		g_warning ("Kernels '%s' not available, using the fastest ones", env);
+	}
+
+	for (impl = REMOTE_DISPLAY_KERNELS_NUM_IMPLS - 1; impl >= 0; impl--) {
+		kernels = remote_display_kernels_get (impl);
+		if (kernels)
+			break;
+	}
+
+	g_debug ("Using %s pixel kernels", kernels->name);
+	return (gpointer) kernels;
+}
+
+const RemoteDisplayKernels *
+remote_display_kernels_get_default (void)
+{
+	static GOnce once = G_ONCE_INIT;
+
+	g_once (&once, pick_kernels, NULL);
+	return once.retval;
+}
+
+static void
+scale_plane_bilinear (const guint8 *src,
+		      guint         src_stride,
+		      guint         src_width,
+		      guint         src_height,
+		      guint8       *dst,
+		      guint         dst_stride,
+		      guint         dst_width,
+		      guint         dst_height)
+{
+	guint x, y;
+	int *x_pos;
+
+	/* Sample centres, in 1/256th of source pixels */
+	x_pos = g_new (int, dst_width);
+	for (x = 0; x < dst_width; x++) {
+		int pos = (int) (((guint64) (2 * x + 1) * src_width * 256) / (2 * dst_width)) - 128;
+		x_pos[x] = CLAMP (pos, 0, (int) (src_width - 1) * 256);
+	}
+
+	for (y = 0; y < dst_height; y++) {
+		const guint8 *s0, *s1;
+		guint8 *d = dst + y * dst_stride;
+		int pos, wy;
+
+		pos = (int) (((guint64) (2 * y + 1) * src_height * 256) / (2 * dst_height)) - 128;
+		pos = CLAMP (pos, 0, (int) (src_height - 1) * 256);
+		wy = pos & 0xff;
+		s0 = src + (pos >> 8) * src_stride;
+		s1 = src + MIN ((guint) (pos >> 8) + 1, src_height - 1) * src_stride;
+
+		for (x = 0; x < dst_width; x++) {
+			guint x0 = x_pos[x] >> 8;
+			guint x1 = MIN (x0 + 1, src_width - 1);
+			int wx = x_pos[x] & 0xff;
+			int top, bottom;
+
+			top = s0[x0] * (256 - wx) + s0[x1] * wx;
+			bottom = s1[x0] * (256 - wx) + s1[x1] * wx;
+			d[x] = (top * (256 - wy) + bottom * wy + 32768) >> 16;
+		}
+	}
+
+	g_free (x_pos);
+}
+
+/**
+ * remote_display_kernels_scale_plane:
+ *
+ * Resamples an 8-bit plane. Large downscales are done by halving
+ * the plane with the box filter as often as possible, which is fast
+ * and doesn't alias, then finishing off with a bilinear filter.
+ **/
+void
+remote_display_kernels_scale_plane (const guint8 *src,
+				    guint         src_stride,
+				    guint         src_width,
+				    guint         src_height,
+				    guint8       *dst,
+				    guint         dst_stride,
+				    guint         dst_width,
+				    guint         dst_height)
+{
+	const RemoteDisplayKernels *kernels;
+	guint8 *tmp = NULL;
+
+	g_return_if_fail (src_width > 0 && src_height > 0);
+	g_return_if_fail (dst_width > 0 && dst_height > 0);
+
+	kernels = remote_display_kernels_get_default ();
+	while (src_width / 2 >= dst_width && src_height / 2 >= dst_height) {
+		guint8 *halved;
+		guint w = src_width / 2, h = src_height / 2;
+
+		halved = g_malloc ((gsize) w * h);
+		kernels->halve_plane (src, src_stride, w, h, halved, w);
+		g_free (tmp);
+		tmp = halved;
+		src = halved;
+		src_stride = src_width = w;
+		src_height = h;
+	}
+
+	if (src_width == dst_width && src_height == dst_height) {
+		guint y;
+
+		for (y = 0; y < dst_height; y++)
+			memcpy (dst + y * dst_stride, src + y * src_stride, dst_width);
+	} else {
+		scale_plane_bilinear (src, src_stride, src_width, src_height,
+				      dst, dst_stride, dst_width, dst_height);
+	}
+
+	g_free (tmp);
+}
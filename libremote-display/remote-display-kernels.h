@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __REMOTE_DISPLAY_KERNELS_H__
+#define __REMOTE_DISPLAY_KERNELS_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Pixel conversion and resampling kernels, with SIMD implementations
+ * picked at runtime. All the implementations produce output that is
+ * bit-exact with the scalar one.
+ *
+ * Conversions use BT.601 limited range, and need even widths and
+ * heights. Chroma is the average of each 2x2 block. */
+
+typedef enum {
+	REMOTE_DISPLAY_KERNELS_SCALAR,
+	REMOTE_DISPLAY_KERNELS_SSE2,
+	REMOTE_DISPLAY_KERNELS_AVX2,
+	REMOTE_DISPLAY_KERNELS_NEON,
+	REMOTE_DISPLAY_KERNELS_NUM_IMPLS
+} RemoteDisplayKernelsImpl;
+
+typedef struct {
+	RemoteDisplayKernelsImpl impl;
+	const char *name;
+
+	/* 32-bit RGBx or BGRx (bgrx set) to planar 4:2:0 */
+	void (* rgbx_to_i420) (const guint8 *src, guint src_stride, gboolean bgrx,
+			       guint width, guint height,
+			       guint8 *y, guint y_stride,
+			       guint8 *u, guint u_stride,
+			       guint8 *v, guint v_stride);
+	/* 32-bit RGBx or BGRx (bgrx set) to semi-planar 4:2:0 */
+	void (* rgbx_to_nv12) (const guint8 *src, guint src_stride, gboolean bgrx,
+			       guint width, guint height,
+			       guint8 *y, guint y_stride,
+			       guint8 *uv, guint uv_stride);
+	/* 2:1 box filter on an 8-bit plane, width and height are
+	 * the destination's */
+	void (* halve_plane)  (const guint8 *src, guint src_stride,
+			       guint width, guint height,
+			       guint8 *dst, guint dst_stride);
+} RemoteDisplayKernels;
+
+const RemoteDisplayKernels *remote_display_kernels_get         (RemoteDisplayKernelsImpl  impl);
+const RemoteDisplayKernels *remote_display_kernels_get_default (void);
+
+void remote_display_kernels_scale_plane (const guint8 *src,
+					 guint         src_stride,
+					 guint         src_width,
+					 guint         src_height,
+					 guint8       *dst,
+					 guint         dst_stride,
+					 guint         dst_width,
+					 guint         dst_height);
+
+G_END_DECLS
+
+#endif /* __REMOTE_DISPLAY_KERNELS_H__ */
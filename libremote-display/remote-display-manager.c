@@ -23,150 +23,2243 @@
 #include <avahi-glib/glib-malloc.h>
 #include <avahi-glib/glib-watch.h>
 #include <avahi-common/simple-watch.h>
+#include <avahi-common/error.h>
+#include <libsoup/soup.h>
 
 #include <libremote-display/remote-display-manager.h>
+#include <libremote-display/remote-display-enum-types.h>
 #include <libremote-display/remote-display-device.h>
 #include <libremote-display/remote-display-device-private.h>
 #include <libremote-display/remote-display-device-airplay.h>
+#include <libremote-display/remote-display-device-raop.h>
+#include <libremote-display/remote-display-device-dlna.h>
+#include <libremote-display/remote-display-device-proxy.h>
+#include <libremote-display/remote-display-service.h>
+#include <libremote-display/remote-display-ssdp.h>
+#include <libremote-display/remote-display-mdns.h>
+#include <libremote-display/remote-display-probes.h>
+#include <libremote-display/remote-display-host.h>
+
+#define AIRPLAY_SERVICE "_airplay._tcp"
+#define RAOP_SERVICE    "_raop._tcp"
+
+#define CACHE_SAVE_DELAY 2                     /* seconds */
+#define CACHE_MAX_AGE    (30 * 24 * 60 * 60)   /* seconds */
+#define RETRACT_GRACE    3                     /* seconds after browsing settled */
+#define RETRACT_TIMEOUT  15                    /* seconds after startup */
+#define MAX_RESOLVERS    8                     /* running at once */
+#define RESOLVE_TIMEOUT  5                     /* seconds */
+#define RESOLVE_ATTEMPTS 2
+#define CHANGES_DELAY    250                   /* milliseconds */
+#define LIVENESS_INTERVAL 5                    /* seconds */
+#define EVENTS_DELAY     50                    /* milliseconds, to gather discovery results */
+#define EVENTS_PER_DISPATCH 32
+
+typedef struct {
+	guint ifindex;
+	GSocketFamily family;
+} CachedCandidate;
 
 struct _RemoteDisplayManagerPrivate {
-	GHashTable *known_devices; /* key = name, value = RemoteDisplayDevice */
+	GHashTable *known_devices; /* key = device key, value = RemoteDisplayDevice */
+	guint64 gone_failures;     /* Command failures of the devices no longer known */
+	GHashTable *services;      /* key = service key, value = device key */
+	GHashTable *hidden;        /* Devices that stopped answering, already announced as gone */
+	guint liveness_id;
+
+	/* AIRPLAY support */
+
+	/* Browsing and resolving happen in the discovery context, which
+	 * is the manager's, unless it has its own thread */
+	GMainContext *context;
+	GMainContext *discovery_context;
+	GMainLoop *discovery_loop;
+	GThread *discovery_thread;
+	gboolean use_discovery_thread;
+	GMutex lock;               /* Protects events, events_source, favourites and the filter */
+	GQueue *events;            /* DiscoveryEvent for the manager's context */
+	GSource *events_source;
+	gint n_resolves;           /* Atomic, resolves not finished yet */
+
+	/* Avahi <-> GLib adaptors */
+	AvahiGLibPoll *poll;
+	/* Avahi client */
+	AvahiClient *client;
+	/* Service browsers */
+	AvahiServiceBrowser *browser;
+	AvahiServiceBrowser *raop_browser;
+	/* Built-in queriers, when not using the Avahi daemon */
+	RemoteDisplayMdns *mdns;
+	RemoteDisplayMdns *raop_mdns;
+	/* Pending resolvers, key = service key, value = Resolve */
+	GHashTable *resolvers;
+	GQueue *resolve_queue;     /* Resolves waiting for a slot, most wanted first */
+	guint n_resolving;
+	GHashTable *last_seen;     /* key = "type/name", value = gint64 */
+	char **favourites;
+	gboolean airplay_browsed;  /* The browsers went through the network */
+	gboolean raop_browsed;
+
+	/* Filter, and how much work it saved */
+	RemoteDisplayDeviceCapabilities filter_caps;
+	GPatternSpec *filter_name;
+	gint resolves_skipped;     /* Atomic */
+	GHashTable *skipped_devices; /* Receivers the filter kept out, under the lock */
+
+	/* Discovery cache */
+	char *cache_path;
+	GKeyFile *cache;
+	guint cache_save_id;
+	GPtrArray *cached_keys;    /* Device keys to announce */
+	guint announce_id;
+	GHashTable *provisional;   /* key = device key, value = GArray of CachedCandidate */
+	guint retract_id;
+	gint64 retract_deadline;
+
+	/* DLNA support */
+	RemoteDisplaySsdp *ssdp;
+	RemoteDisplayDlnaContext *dlna_context;
+	/* Descriptions being fetched, key = device key, value = GCancellable */
+	GHashTable *dlna_pending;
+
+	/* Visible devices, and indexes over them */
+	GPtrArray *visible;
+	GHashTable *by_id;         /* key = device ID, value = device */
+	GHashTable *by_name;       /* key = device name, value = GPtrArray of devices */
+	GPtrArray **by_capability; /* One per RemoteDisplayDeviceCapabilities bit */
+	guint n_capabilities;
+	guint64 stamp;
+
+	/* Coalesced changes, for "devices-changed" */
+	GPtrArray *added;
+	GPtrArray *removed;
+	guint changes_id;
+
+	SoupServer *metrics_server;
+
+	/* Client of the D-Bus service, instead of discovering */
+	gboolean use_service;
+	guint service_watch_id;
+	GDBusConnection *service_connection;
+	char *service_owner;
+	guint service_signal_id;
+	GCancellable *service_cancellable;
+};
+
+#define GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE ((obj), REMOTE_DISPLAY_TYPE_MANAGER, RemoteDisplayManagerPrivate))
+
+G_DEFINE_TYPE (RemoteDisplayManager, remote_display_manager, G_TYPE_OBJECT);
+
+enum {
+	PROP_0 = 0,
+	PROP_DISCOVERY_THREAD,
+	PROP_USE_SERVICE
+};
+
+enum {
+	DEVICE_APPEARED,
+	DEVICE_DISAPPEARED,
+	DEVICES_CHANGED,
+	NUM_SIGS
+};
+
+static guint signals[NUM_SIGS] = {0,};
+
+typedef struct {
+	RemoteDisplayManager *self;
+	char *service_key;
+	AvahiIfIndex interface;
+	AvahiProtocol protocol;
+	char *name;
+	char *type;
+	char *domain;
+	gint64 priority;
+	guint attempts;
+	AvahiServiceResolver *resolver;        /* NULL while queued */
+	GSource *timeout;
+} Resolve;
+
+typedef enum {
+	DISCOVERY_EVENT_FOUND,
+	DISCOVERY_EVENT_REMOVED,
+	DISCOVERY_EVENT_ALL_FOR_NOW
+} DiscoveryEventType;
+
+/* A browsing or resolving result, handed from the
+ * discovery context to the manager's */
+typedef struct {
+	DiscoveryEventType type;
+	AvahiIfIndex interface;
+	AvahiProtocol protocol;
+	char *name;
+	char *service_type;
+	char *host_name;
+	AvahiAddress address;
+	guint16 port;
+	AvahiStringList *txt;
+	char *service_key;
+	char *device_key;
+} DiscoveryEvent;
+
+/* Timers run where the manager was created, as the events do */
+static guint
+attach_source (RemoteDisplayManager *self,
+	       GSource              *source,
+	       GSourceFunc           func)
+{
+	guint id;
+
+	g_source_set_callback (source, func, self, NULL);
+	id = g_source_attach (source, self->priv->context);
+	g_source_unref (source);
+
+	return id;
+}
+
+static void
+remove_source (RemoteDisplayManager *self,
+	       guint                *id)
+{
+	if (*id == 0)
+		return;
+	g_source_destroy (g_main_context_find_source_by_id (self->priv->context, *id));
+	*id = 0;
+}
+
+static gboolean
+changes_cb (gpointer user_data)
+{
+	RemoteDisplayManager *self = user_data;
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	GPtrArray *added, *removed;
+
+	priv->changes_id = 0;
+
+	added = priv->added;
+	removed = priv->removed;
+	priv->added = g_ptr_array_new_with_free_func (g_object_unref);
+	priv->removed = g_ptr_array_new_with_free_func (g_object_unref);
+
+	if (added->len > 0 || removed->len > 0)
+		g_signal_emit (self, signals[DEVICES_CHANGED], 0, added, removed);
+
+	g_ptr_array_unref (added);
+	g_ptr_array_unref (removed);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+index_add (GHashTable          *index,
+	   const char          *key,
+	   RemoteDisplayDevice *device)
+{
+	GPtrArray *array;
+
+	if (!key)
+		return;
+	array = g_hash_table_lookup (index, key);
+	if (!array) {
+		array = g_ptr_array_new ();
+		g_hash_table_insert (index, g_strdup (key), array);
+	}
+	g_ptr_array_add (array, device);
+}
+
+static void
+index_remove (GHashTable          *index,
+	      const char          *key,
+	      RemoteDisplayDevice *device)
+{
+	GPtrArray *array;
+
+	if (!key)
+		return;
+	array = g_hash_table_lookup (index, key);
+	if (!array)
+		return;
+	g_ptr_array_remove_fast (array, device);
+	if (array->len == 0)
+		g_hash_table_remove (index, key);
+}
+
+static void
+update_indexes (RemoteDisplayManager *self,
+		RemoteDisplayDevice  *device,
+		gboolean              appeared)
+{
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	RemoteDisplayDeviceCapabilities caps;
+	char *id;
+	guint i;
+
+	g_object_get (device, "id", &id, NULL);
+	caps = remote_display_device_get_capabilities (device);
+
+	if (appeared) {
+		g_ptr_array_add (priv->visible, g_object_ref (device));
+		if (id)
+			g_hash_table_insert (priv->by_id, g_strdup (id), device);
+		index_add (priv->by_name, remote_display_device_get_name (device), device);
+	} else {
+		/* IDs are unique, but don't drop another device's entry */
+		if (id && g_hash_table_lookup (priv->by_id, id) == device)
+			g_hash_table_remove (priv->by_id, id);
+		index_remove (priv->by_name, remote_display_device_get_name (device), device);
+	}
+	for (i = 0; i < priv->n_capabilities; i++) {
+		if (!(caps & (1 << i)))
+			continue;
+		if (appeared)
+			g_ptr_array_add (priv->by_capability[i], device);
+		else
+			g_ptr_array_remove_fast (priv->by_capability[i], device);
+	}
+	/* Last, as it holds the reference */
+	if (!appeared)
+		g_ptr_array_remove_fast (priv->visible, device);
+
+	priv->stamp++;
+	g_free (id);
+}
+
+static void
+queue_change (RemoteDisplayManager *self,
+	      RemoteDisplayDevice  *device,
+	      gboolean              appeared)
+{
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	GPtrArray *same, *other;
+
+	update_indexes (self, device, appeared);
+
+	same = appeared ? priv->added : priv->removed;
+	other = appeared ? priv->removed : priv->added;
+
+	/* Coming and going within the same batch cancel out */
+	if (!g_ptr_array_remove (other, device))
+		g_ptr_array_add (same, g_object_ref (device));
+
+	if (priv->changes_id == 0)
+		priv->changes_id = attach_source (self, g_timeout_source_new (CHANGES_DELAY), changes_cb);
+}
+
+/* Devices that stop answering are announced as gone straight
+ * away, and back if they answer again, as Avahi can take minutes
+ * to notice that a receiver was switched off */
+static void
+reachability_changed_cb (RemoteDisplayDevice  *device,
+			 GParamSpec           *pspec,
+			 RemoteDisplayManager *self)
+{
+	RemoteDisplayManagerPrivate *priv = self->priv;
+
+	switch (remote_display_device_get_reachability (device)) {
+	case REMOTE_DISPLAY_DEVICE_REACHABILITY_UNREACHABLE:
+		if (!g_hash_table_add (priv->hidden, device))
+			break;
+		g_debug ("'%s' stopped answering", remote_display_device_get_name (device));
+		queue_change (self, device, FALSE);
+		g_signal_emit (self, signals[DEVICE_DISAPPEARED], 0, device);
+		break;
+	case REMOTE_DISPLAY_DEVICE_REACHABILITY_REACHABLE:
+		if (!g_hash_table_remove (priv->hidden, device))
+			break;
+		g_debug ("'%s' is answering again", remote_display_device_get_name (device));
+		queue_change (self, device, TRUE);
+		g_signal_emit (self, signals[DEVICE_APPEARED], 0, device);
+		break;
+	default:
+		break;
+	}
+}
+
+/* Such as when an AirPlay receiver's RAOP service shows up */
+static void
+capabilities_changed_cb (RemoteDisplayDevice  *device,
+			 GParamSpec           *pspec,
+			 RemoteDisplayManager *self)
+{
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	RemoteDisplayDeviceCapabilities caps;
+	guint i;
+
+	/* Hidden devices aren't indexed */
+	if (g_hash_table_contains (priv->hidden, device))
+		return;
+
+	caps = remote_display_device_get_capabilities (device);
+	for (i = 0; i < priv->n_capabilities; i++) {
+		g_ptr_array_remove_fast (priv->by_capability[i], device);
+		if (caps & (1 << i))
+			g_ptr_array_add (priv->by_capability[i], device);
+	}
+	priv->stamp++;
+}
+
+static void
+device_appeared (RemoteDisplayManager *self,
+		 RemoteDisplayDevice  *device)
+{
+	g_signal_connect (device, "notify::reachability",
+			  G_CALLBACK (reachability_changed_cb), self);
+	g_signal_connect (device, "notify::capabilities",
+			  G_CALLBACK (capabilities_changed_cb), self);
+	queue_change (self, device, TRUE);
+	g_signal_emit (self, signals[DEVICE_APPEARED], 0, device);
+}
+
+static void
+device_disappeared (RemoteDisplayManager *self,
+		    RemoteDisplayDevice  *device)
+{
+	g_signal_handlers_disconnect_by_func (device, reachability_changed_cb, self);
+	g_signal_handlers_disconnect_by_func (device, capabilities_changed_cb, self);
+	if (g_hash_table_remove (self->priv->hidden, device))
+		return;
+	queue_change (self, device, FALSE);
+	g_signal_emit (self, signals[DEVICE_DISAPPEARED], 0, device);
+}
+
+/* Called before dropping @device from the known devices,
+ * so that the failures total doesn't go down */
+static void
+keep_failures (RemoteDisplayManager *self,
+	       RemoteDisplayDevice  *device)
+{
+	self->priv->gone_failures += remote_display_device_get_command_failures (device);
+}
+
+static gboolean
+liveness_cb (gpointer user_data)
+{
+	RemoteDisplayManager *self = user_data;
+	GHashTableIter iter;
+	gpointer value;
+
+	g_hash_table_iter_init (&iter, self->priv->known_devices);
+	while (g_hash_table_iter_next (&iter, NULL, &value))
+		remote_display_device_check_liveness (value);
+
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+cache_save_cb (gpointer user_data)
+{
+	RemoteDisplayManager *self = user_data;
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	GError *error = NULL;
+	char *dir;
+
+	priv->cache_save_id = 0;
+
+	dir = g_path_get_dirname (priv->cache_path);
+	g_mkdir_with_parents (dir, 0700);
+	g_free (dir);
+
+	if (!g_key_file_save_to_file (priv->cache, priv->cache_path, &error)) {
+		g_debug ("Failed to save discovery cache: %s", error->message);
+		g_error_free (error);
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Remembers enough about the service to create the device
+ * again on the next run, without waiting for Avahi */
+static void
+cache_add_service (RemoteDisplayManager *self,
+		   const char           *device_key,
+		   AvahiIfIndex          interface,
+		   AvahiProtocol         protocol,
+		   const char           *name,
+		   const char           *type,
+		   const char           *host_name,
+		   const AvahiAddress   *address,
+		   guint16               port,
+		   AvahiStringList      *txt)
+{
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	char address_str[AVAHI_ADDRESS_STR_MAX];
+	char **candidates, *candidate, *prefix;
+	GPtrArray *array, *records;
+	AvahiStringList *l;
+	guint i;
+
+	if (!priv->cache)
+		return;
+
+	g_key_file_set_string (priv->cache, device_key, "Type", type);
+	g_key_file_set_string (priv->cache, device_key, "Name", name);
+	g_key_file_set_string (priv->cache, device_key, "Hostname", host_name);
+	g_key_file_set_integer (priv->cache, device_key, "Port", port);
+	g_key_file_set_int64 (priv->cache, device_key, "LastSeen", g_get_real_time () / G_USEC_PER_SEC);
+
+	records = g_ptr_array_new_with_free_func (g_free);
+	for (l = txt; l != NULL; l = avahi_string_list_get_next (l)) {
+		const char *text = (const char *) avahi_string_list_get_text (l);
+		gsize size = avahi_string_list_get_size (l);
+
+		if (g_utf8_validate (text, size, NULL))
+			g_ptr_array_add (records, g_strndup (text, size));
+	}
+	g_key_file_set_string_list (priv->cache, device_key, "Txt",
+				    (const char * const *) records->pdata, records->len);
+	g_ptr_array_free (records, TRUE);
+
+	/* One per interface and protocol */
+	avahi_address_snprint (address_str, sizeof(address_str), address);
+	prefix = g_strdup_printf ("%d,%d,", interface, protocol);
+	candidate = g_strdup_printf ("%s%s", prefix, address_str);
+	array = g_ptr_array_new_with_free_func (g_free);
+	g_ptr_array_add (array, candidate);
+	candidates = g_key_file_get_string_list (priv->cache, device_key, "Candidates", NULL, NULL);
+	for (i = 0; candidates && candidates[i]; i++) {
+		if (!g_str_has_prefix (candidates[i], prefix))
+			g_ptr_array_add (array, g_strdup (candidates[i]));
+	}
+	g_strfreev (candidates);
+	g_free (prefix);
+	g_key_file_set_string_list (priv->cache, device_key, "Candidates",
+				    (const char * const *) array->pdata, array->len);
+	g_ptr_array_free (array, TRUE);
+
+	if (priv->cache_save_id == 0)
+		priv->cache_save_id = attach_source (self, g_timeout_source_new_seconds (CACHE_SAVE_DELAY),
+						     cache_save_cb);
+}
+
+static gboolean
+parse_cached_candidate (const char    *str,
+			AvahiIfIndex  *interface,
+			AvahiProtocol *protocol,
+			AvahiAddress  *address)
+{
+	char **parts;
+	gboolean ret;
+
+	parts = g_strsplit (str, ",", 3);
+	ret = g_strv_length (parts) == 3 &&
+		avahi_address_parse (parts[2], AVAHI_PROTO_UNSPEC, address) != NULL;
+	if (ret) {
+		*interface = atoi (parts[0]);
+		*protocol = atoi (parts[1]);
+	}
+	g_strfreev (parts);
+
+	return ret;
+}
+
+static RemoteDisplayDevice *
+cache_load_device (RemoteDisplayManager *self,
+		   const char           *device_key)
+{
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	RemoteDisplayDevice *device = NULL;
+	char *type, *name, *host_name;
+	char **records, **candidates;
+	AvahiStringList *txt = NULL;
+	GArray *cached;
+	guint16 port;
+	guint i;
+
+	type = g_key_file_get_string (priv->cache, device_key, "Type", NULL);
+	name = g_key_file_get_string (priv->cache, device_key, "Name", NULL);
+	host_name = g_key_file_get_string (priv->cache, device_key, "Hostname", NULL);
+	port = g_key_file_get_integer (priv->cache, device_key, "Port", NULL);
+	records = g_key_file_get_string_list (priv->cache, device_key, "Txt", NULL, NULL);
+	candidates = g_key_file_get_string_list (priv->cache, device_key, "Candidates", NULL, NULL);
+	if (!type || !name || !host_name || !candidates)
+		goto out;
+
+	for (i = 0; records && records[i]; i++)
+		txt = avahi_string_list_add (txt, records[i]);
+
+	cached = g_array_new (FALSE, FALSE, sizeof (CachedCandidate));
+	for (i = 0; candidates[i]; i++) {
+		AvahiIfIndex interface;
+		AvahiProtocol protocol;
+		AvahiAddress address;
+		CachedCandidate c;
+
+		if (!parse_cached_candidate (candidates[i], &interface, &protocol, &address))
+			continue;
+
+		/* The interface might not be there anymore */
+		if (!device) {
+			if (g_strcmp0 (type, RAOP_SERVICE) == 0)
+				device = remote_display_device_raop_new (interface, protocol, name, txt, host_name, &address, port);
+			else
+				device = remote_display_device_airplay_new (interface, protocol, name, txt, host_name, &address, port);
+			if (!device)
+				continue;
+			REMOTE_DISPLAY_PROBE3 (device_new, device, name, "cache");
+		} else {
+			GInetAddress *remote_address;
+
+			remote_address = remote_display_avahi_address_to_address (&address);
+			if (!remote_address)
+				continue;
+			remote_display_device_add_candidate (device, interface, remote_address, host_name, port);
+			g_object_unref (remote_address);
+		}
+
+		c.ifindex = interface;
+		c.family = remote_display_avahi_protocol_to_family (protocol);
+		g_array_append_val (cached, c);
+	}
+
+	if (device) {
+		remote_display_device_set_provisional (device, TRUE);
+		g_hash_table_insert (priv->provisional, g_strdup (device_key), cached);
+	} else {
+		g_array_free (cached, TRUE);
+	}
+
+out:
+	avahi_string_list_free (txt);
+	g_strfreev (records);
+	g_strfreev (candidates);
+	g_free (type);
+	g_free (name);
+	g_free (host_name);
+
+	return device;
+}
+
+/* AirPlay receivers also advertise their audio through a RAOP
+ * service named after their MAC address, which is what their
+ * AirPlay device ID is, with colons */
+static char *
+get_raop_twin_key (const char *device_key)
+{
+	GString *key;
+	const char *p;
+
+	if (!g_str_has_prefix (device_key, AIRPLAY_SERVICE "/"))
+		return NULL;
+
+	key = g_string_new (RAOP_SERVICE "/");
+	for (p = device_key + strlen (AIRPLAY_SERVICE "/"); *p; p++) {
+		if (*p != ':')
+			g_string_append_c (key, g_ascii_toupper (*p));
+	}
+
+	return g_string_free (key, FALSE);
+}
+
+/* The AirPlay device whose RAOP service @device_key is */
+static RemoteDisplayDevice *
+find_airplay_twin (RemoteDisplayManager *self,
+		   const char           *device_key)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+
+	if (!g_str_has_prefix (device_key, RAOP_SERVICE "/"))
+		return NULL;
+
+	g_hash_table_iter_init (&iter, self->priv->known_devices);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		char *twin_key;
+		gboolean found;
+
+		twin_key = get_raop_twin_key (key);
+		found = twin_key && g_ascii_strcasecmp (twin_key, device_key) == 0;
+		g_free (twin_key);
+		if (found)
+			return value;
+	}
+
+	return NULL;
+}
+
+static gboolean
+is_announced (RemoteDisplayManager *self,
+	      RemoteDisplayDevice  *device)
+{
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	guint i;
+
+	if (g_hash_table_contains (priv->hidden, device))
+		return TRUE;
+	for (i = 0; i < priv->visible->len; i++) {
+		if (g_ptr_array_index (priv->visible, i) == device)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Folds the audio-only device an AirPlay receiver was known
+ * as, until its AirPlay service showed up, into it */
+static void
+attach_raop_twin (RemoteDisplayManager *self,
+		  RemoteDisplayDevice  *device,
+		  const char           *device_key)
+{
+	RemoteDisplayDevice *raop;
+	char *twin_key;
+
+	twin_key = get_raop_twin_key (device_key);
+	if (!twin_key)
+		return;
+
+	raop = g_hash_table_lookup (self->priv->known_devices, twin_key);
+	if (raop) {
+		g_debug ("'%s' is an AirPlay receiver, folding its RAOP device into it",
+			 remote_display_device_get_name (device));
+		if (is_announced (self, raop))
+			device_disappeared (self, raop);
+		remote_display_device_airplay_set_raop (REMOTE_DISPLAY_DEVICE_AIRPLAY (device), raop);
+	}
+	g_free (twin_key);
+}
+
+/* The device is gone, but an AirPlay receiver's RAOP service
+ * can outlive its AirPlay one, and the other way around */
+static void
+forget_device (RemoteDisplayManager *self,
+	       RemoteDisplayDevice  *device,
+	       const char           *device_key)
+{
+	RemoteDisplayDevice *twin = NULL;
+
+	if (REMOTE_DISPLAY_IS_DEVICE_AIRPLAY (device))
+		twin = remote_display_device_airplay_get_raop (REMOTE_DISPLAY_DEVICE_AIRPLAY (device));
+
+	if (twin) {
+		device_disappeared (self, device);
+		g_object_ref (twin);
+		remote_display_device_airplay_set_raop (REMOTE_DISPLAY_DEVICE_AIRPLAY (device), NULL);
+		device_appeared (self, twin);
+		g_object_unref (twin);
+	} else {
+		twin = find_airplay_twin (self, device_key);
+		if (twin && remote_display_device_airplay_get_raop (REMOTE_DISPLAY_DEVICE_AIRPLAY (twin)) == device)
+			remote_display_device_airplay_set_raop (REMOTE_DISPLAY_DEVICE_AIRPLAY (twin), NULL);
+		else
+			device_disappeared (self, device);
+	}
+	keep_failures (self, device);
+	g_hash_table_remove (self->priv->known_devices, device_key);
+}
+
+/* Each receiver is only counted once, however many services,
+ * interfaces and announcements the filter turned away */
+static void
+add_skipped_device (RemoteDisplayManager *self,
+		    const char           *device_key)
+{
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	char *key, *id;
+
+	if (!device_key)
+		return;
+
+	/* AirPlay receivers are counted with their RAOP service */
+	if (g_str_has_prefix (device_key, RAOP_SERVICE "/")) {
+		id = g_ascii_strup (device_key + strlen (RAOP_SERVICE "/"), -1);
+		key = g_strconcat (RAOP_SERVICE "/", id, NULL);
+		g_free (id);
+	} else {
+		key = get_raop_twin_key (device_key);
+		if (!key)
+			key = g_strdup (device_key);
+	}
+
+	g_mutex_lock (&priv->lock);
+	g_hash_table_add (priv->skipped_devices, key);
+	g_mutex_unlock (&priv->lock);
+}
+
+static guint
+get_skipped_devices (RemoteDisplayManager *self)
+{
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	guint ret;
+
+	g_mutex_lock (&priv->lock);
+	ret = g_hash_table_size (priv->skipped_devices);
+	g_mutex_unlock (&priv->lock);
+
+	return ret;
+}
+
+static gboolean
+device_matches_filter (RemoteDisplayManager *self,
+		       RemoteDisplayDevice  *device)
+{
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	RemoteDisplayDeviceCapabilities caps;
+	gboolean ret;
+
+	caps = remote_display_device_get_capabilities (device);
+	g_mutex_lock (&priv->lock);
+	ret = (caps & priv->filter_caps) == priv->filter_caps &&
+		(!priv->filter_name ||
+		 g_pattern_match_string (priv->filter_name, remote_display_device_get_name (device)));
+	g_mutex_unlock (&priv->lock);
+
+	return ret;
+}
+
+static gboolean
+announce_cached_cb (gpointer user_data)
+{
+	RemoteDisplayManager *self = user_data;
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	guint i, pass;
+
+	priv->announce_id = 0;
+	/* RAOP devices last, to fold them into their AirPlay twin */
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < priv->cached_keys->len; i++) {
+			RemoteDisplayDevice *device, *twin;
+
+			const char *device_key = g_ptr_array_index (priv->cached_keys, i);
+
+			if (g_str_has_prefix (device_key, RAOP_SERVICE "/") != (pass == 1))
+				continue;
+			device = g_hash_table_lookup (priv->known_devices, device_key);
+			if (!device)
+				continue;
+			if (!device_matches_filter (self, device)) {
+				add_skipped_device (self, device_key);
+				keep_failures (self, device);
+				g_hash_table_remove (priv->provisional, device_key);
+				g_hash_table_remove (priv->known_devices, device_key);
+				continue;
+			}
+			twin = find_airplay_twin (self, device_key);
+			if (twin)
+				remote_display_device_airplay_set_raop (REMOTE_DISPLAY_DEVICE_AIRPLAY (twin), device);
+			else
+				device_appeared (self, device);
+		}
+	}
+	g_ptr_array_set_size (priv->cached_keys, 0);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Cached devices that didn't show up on the network
+ * once browsing settled are taken back */
+static gboolean
+retract_cb (gpointer user_data)
+{
+	RemoteDisplayManager *self = user_data;
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	GHashTableIter iter;
+	gpointer key;
+
+	/* Give the pending resolvers a chance */
+	if (g_atomic_int_get (&priv->n_resolves) > 0 &&
+	    g_get_monotonic_time () < priv->retract_deadline)
+		return G_SOURCE_CONTINUE;
+
+	priv->retract_id = 0;
+
+	g_hash_table_iter_init (&iter, priv->provisional);
+	while (g_hash_table_iter_next (&iter, &key, NULL)) {
+		RemoteDisplayDevice *device;
+
+		device = g_hash_table_lookup (priv->known_devices, key);
+		if (device) {
+			g_debug ("Cached device '%s' wasn't found, retracting",
+				 remote_display_device_get_name (device));
+			forget_device (self, device, key);
+		}
+		g_hash_table_iter_remove (&iter);
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+schedule_retract (RemoteDisplayManager *self,
+		  guint                 delay)
+{
+	RemoteDisplayManagerPrivate *priv = self->priv;
+
+	remove_source (self, &priv->retract_id);
+	if (g_hash_table_size (priv->provisional) == 0)
+		return;
+	priv->retract_id = attach_source (self, g_timeout_source_new_seconds (delay), retract_cb);
+}
+
+static void
+cache_load (RemoteDisplayManager *self)
+{
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	GError *error = NULL;
+	char **groups;
+	gint64 now;
+	guint i;
+
+	priv->cache = g_key_file_new ();
+	if (!g_key_file_load_from_file (priv->cache, priv->cache_path, G_KEY_FILE_NONE, &error)) {
+		if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+			g_debug ("Failed to load discovery cache: %s", error->message);
+		g_error_free (error);
+		return;
+	}
+
+	now = g_get_real_time () / G_USEC_PER_SEC;
+	groups = g_key_file_get_groups (priv->cache, NULL);
+	for (i = 0; groups[i]; i++) {
+		RemoteDisplayDevice *device;
+		char *name, *type;
+		gint64 last_seen;
+
+		last_seen = g_key_file_get_int64 (priv->cache, groups[i], "LastSeen", NULL);
+		if (now - last_seen > CACHE_MAX_AGE) {
+			g_key_file_remove_group (priv->cache, groups[i], NULL);
+			continue;
+		}
+
+		name = g_key_file_get_string (priv->cache, groups[i], "Name", NULL);
+		type = g_key_file_get_string (priv->cache, groups[i], "Type", NULL);
+		if (name && type) {
+			gint64 *value;
+
+			value = g_malloc (sizeof(last_seen));
+			memcpy (value, &last_seen, sizeof(last_seen));
+			g_hash_table_insert (priv->last_seen, g_strdup_printf ("%s/%s", type, name), value);
+		}
+		g_free (name);
+		g_free (type);
+
+		device = cache_load_device (self, groups[i]);
+		if (!device)
+			continue;
+		g_hash_table_insert (priv->known_devices, g_strdup (groups[i]), device);
+		g_ptr_array_add (priv->cached_keys, g_strdup (groups[i]));
+	}
+	g_strfreev (groups);
+
+	if (priv->cached_keys->len > 0)
+		priv->announce_id = attach_source (self, g_idle_source_new (), announce_cached_cb);
+	priv->retract_deadline = g_get_monotonic_time () + RETRACT_TIMEOUT * G_USEC_PER_SEC;
+	schedule_retract (self, RETRACT_TIMEOUT);
+}
+
+/* The cached device was seen on the network, keep only the
+ * addresses it was actually seen at */
+static void
+confirm_device (RemoteDisplayManager *self,
+		RemoteDisplayDevice  *device,
+		const char           *device_key,
+		AvahiIfIndex          interface,
+		AvahiProtocol         protocol)
+{
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	GSocketFamily family;
+	GArray *cached;
+	guint i;
+
+	cached = g_hash_table_lookup (priv->provisional, device_key);
+	if (!cached)
+		return;
+
+	family = remote_display_avahi_protocol_to_family (protocol);
+	for (i = 0; i < cached->len; i++) {
+		CachedCandidate *c = &g_array_index (cached, CachedCandidate, i);
+
+		if (c->ifindex != (guint) interface || c->family != family)
+			remote_display_device_remove_candidate (device, c->ifindex, c->family);
+	}
+	g_hash_table_remove (priv->provisional, device_key);
+	remote_display_device_set_provisional (device, FALSE);
+}
+
+/* A receiver shows up once per interface and address family,
+ * under the same service name */
+static char *
+get_service_key (AvahiIfIndex   interface,
+		 AvahiProtocol  protocol,
+		 const char    *type,
+		 const char    *name)
+{
+	return g_strdup_printf ("%d/%d/%s/%s", interface, protocol, type, name);
+}
+
+/* Identifies the receiver itself, whichever way it's reached */
+static char *
+get_device_key (const char      *type,
+		const char      *name,
+		AvahiStringList *txt)
+{
+	AvahiStringList *l;
+	char *value, *key;
+	const char *at;
+
+	if (g_strcmp0 (type, RAOP_SERVICE) == 0) {
+		at = strchr (name, '@');
+		if (!at)
+			return NULL;
+		value = g_strndup (name, at - name);
+		key = g_strdup_printf ("%s/%s", type, value);
+		g_free (value);
+		return key;
+	}
+
+	l = avahi_string_list_find (txt, "deviceid");
+	if (!l)
+		return NULL;
+	avahi_string_list_get_pair (l, NULL, &value, NULL);
+	if (!value)
+		return NULL;
+	key = g_strdup_printf ("%s/%s", type, value);
+	avahi_free (value);
+	return key;
+}
+
+/* The capabilities devices of that type could have, and
+ * those they have, if the TXT record is already known */
+static RemoteDisplayDeviceCapabilities
+get_type_capabilities (const char      *type,
+		       AvahiStringList *txt)
+{
+	if (g_strcmp0 (type, RAOP_SERVICE) == 0)
+		return REMOTE_DISPLAY_DEVICE_CAPABILITIES_AUDIO;
+	if (g_strcmp0 (type, DLNA_RENDERER_TYPE) == 0)
+		return REMOTE_DISPLAY_DEVICE_CAPABILITIES_VIDEO;
+	if (txt)
+		return remote_display_device_airplay_get_txt_capabilities (txt);
+	return REMOTE_DISPLAY_DEVICE_CAPABILITIES_VIDEO |
+		REMOTE_DISPLAY_DEVICE_CAPABILITIES_PHOTO |
+		REMOTE_DISPLAY_DEVICE_CAPABILITIES_SCREEN;
+}
+
+/* Checks what's known about a service so far, to
+ * avoid resolving it or creating its device */
+static gboolean
+matches_filter (RemoteDisplayManager *self,
+		const char           *type,
+		const char           *name,
+		AvahiStringList      *txt)
+{
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	RemoteDisplayDeviceCapabilities caps;
+	gboolean ret = TRUE;
+
+	/* RAOP service names are "<device ID>@<name>" */
+	if (name && g_strcmp0 (type, RAOP_SERVICE) == 0 && strchr (name, '@'))
+		name = strchr (name, '@') + 1;
+
+	caps = get_type_capabilities (type, txt);
+	g_mutex_lock (&priv->lock);
+	if ((caps & priv->filter_caps) != priv->filter_caps)
+		ret = FALSE;
+	else if (name && priv->filter_name && !g_pattern_match_string (priv->filter_name, name))
+		ret = FALSE;
+	g_mutex_unlock (&priv->lock);
+
+	return ret;
+}
+
+static void
+discovery_event_free (DiscoveryEvent *event)
+{
+	g_free (event->name);
+	g_free (event->service_type);
+	g_free (event->host_name);
+	g_clear_pointer (&event->txt, avahi_string_list_free);
+	g_free (event->service_key);
+	g_free (event->device_key);
+	g_free (event);
+}
+
+static void
+handle_found (RemoteDisplayManager *self,
+	      DiscoveryEvent       *event)
+{
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	RemoteDisplayDevice *device = NULL, *twin;
+	GInetAddress *remote_address;
+
+	if (!event->device_key) {
+		g_debug ("Service '%s' has no device ID, not adding", event->name);
+		return;
+	}
+
+	device = g_hash_table_lookup (priv->known_devices, event->device_key);
+	if (device) {
+		/* Already known through another interface, or cached */
+		remote_address = remote_display_avahi_address_to_address (&event->address);
+		if (!remote_address)
+			return;
+		remote_display_device_add_candidate (device, event->interface, remote_address,
+						     event->host_name, event->port);
+		remote_display_device_mark_alive (device);
+		g_object_unref (remote_address);
+		confirm_device (self, device, event->device_key, event->interface, event->protocol);
+		cache_add_service (self, event->device_key, event->interface, event->protocol,
+				   event->name, event->service_type, event->host_name,
+				   &event->address, event->port, event->txt);
+		g_hash_table_insert (priv->services, g_strdup (event->service_key),
+				     g_strdup (event->device_key));
+		return;
+	}
+
+	if (g_strcmp0 (event->service_type, RAOP_SERVICE) == 0)
+		device = remote_display_device_raop_new (event->interface, event->protocol, event->name,
+							 event->txt, event->host_name, &event->address, event->port);
+	else
+		device = remote_display_device_airplay_new (event->interface, event->protocol, event->name,
+							    event->txt, event->host_name, &event->address, event->port);
+	if (!device)
+		return;
+	REMOTE_DISPLAY_PROBE3 (device_new, device, event->name, "mdns");
+
+	remote_display_device_mark_alive (device);
+	cache_add_service (self, event->device_key, event->interface, event->protocol,
+			   event->name, event->service_type, event->host_name,
+			   &event->address, event->port, event->txt);
+	g_hash_table_insert (priv->known_devices, g_strdup (event->device_key), device);
+	g_hash_table_insert (priv->services, g_strdup (event->service_key),
+			     g_strdup (event->device_key));
+
+	twin = find_airplay_twin (self, event->device_key);
+	if (twin) {
+		remote_display_device_airplay_set_raop (REMOTE_DISPLAY_DEVICE_AIRPLAY (twin), device);
+		return;
+	}
+	attach_raop_twin (self, device, event->device_key);
+	device_appeared (self, device);
+}
+
+static void
+handle_removed (RemoteDisplayManager *self,
+		DiscoveryEvent       *event)
+{
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	RemoteDisplayDevice *device = NULL;
+	const char *device_key;
+
+	device_key = g_hash_table_lookup (priv->services, event->service_key);
+	if (device_key)
+		device = g_hash_table_lookup (priv->known_devices, device_key);
+	/* Only gone once it can't be reached any other way */
+	if (device &&
+	    remote_display_device_remove_candidate (device, event->interface,
+						    remote_display_avahi_protocol_to_family (event->protocol)) == 0)
+		forget_device (self, device, device_key);
+	g_hash_table_remove (priv->services, event->service_key);
+}
+
+static void
+handle_event (RemoteDisplayManager *self,
+	      DiscoveryEvent       *event)
+{
+	RemoteDisplayManagerPrivate *priv = self->priv;
+
+	switch (event->type) {
+	case DISCOVERY_EVENT_FOUND:
+		handle_found (self, event);
+		break;
+	case DISCOVERY_EVENT_REMOVED:
+		handle_removed (self, event);
+		break;
+	case DISCOVERY_EVENT_ALL_FOR_NOW: {
+			gboolean *browsed;
+
+			/* Both browsers went through what's on the network. Each
+			 * can say so more than once, after a cache flush */
+			if (g_strcmp0 (event->service_type, RAOP_SERVICE) == 0)
+				browsed = &priv->raop_browsed;
+			else
+				browsed = &priv->airplay_browsed;
+			if (*browsed)
+				break;
+			*browsed = TRUE;
+			if (priv->airplay_browsed && priv->raop_browsed)
+				schedule_retract (self, RETRACT_GRACE);
+		}
+		break;
+	default:
+		g_assert_not_reached ();
+	}
+}
+
+/* Handles a bounded number of results at a time, so that
+ * discovery storms don't hold the manager's context for long */
+static gboolean
+dispatch_events_cb (gpointer user_data)
+{
+	RemoteDisplayManager *self = user_data;
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	DiscoveryEvent *events[EVENTS_PER_DISPATCH];
+	gboolean ret = G_SOURCE_CONTINUE;
+	guint n_events, i;
+
+	g_mutex_lock (&priv->lock);
+	for (n_events = 0; n_events < EVENTS_PER_DISPATCH; n_events++) {
+		events[n_events] = g_queue_pop_head (priv->events);
+		if (!events[n_events])
+			break;
+	}
+	if (g_queue_is_empty (priv->events)) {
+		g_clear_pointer (&priv->events_source, g_source_unref);
+		ret = G_SOURCE_REMOVE;
+	}
+	g_mutex_unlock (&priv->lock);
+
+	for (i = 0; i < n_events; i++) {
+		handle_event (self, events[i]);
+		discovery_event_free (events[i]);
+	}
+
+	return ret;
+}
+
+/* Called in the discovery context */
+static void
+post_event (RemoteDisplayManager *self,
+	    DiscoveryEvent       *event)
+{
+	RemoteDisplayManagerPrivate *priv = self->priv;
+
+	if (!priv->discovery_thread) {
+		handle_event (self, event);
+		discovery_event_free (event);
+		return;
+	}
+
+	/* Results are gathered for a little while, and handed over together */
+	g_mutex_lock (&priv->lock);
+	g_queue_push_tail (priv->events, event);
+	if (!priv->events_source) {
+		priv->events_source = g_timeout_source_new (EVENTS_DELAY);
+		g_source_set_callback (priv->events_source, dispatch_events_cb, self, NULL);
+		g_source_attach (priv->events_source, priv->context);
+	}
+	g_mutex_unlock (&priv->lock);
+}
+
+static DiscoveryEvent *
+discovery_event_new (DiscoveryEventType  type,
+		     AvahiIfIndex        interface,
+		     AvahiProtocol       protocol,
+		     const char         *service_type,
+		     const char         *name)
+{
+	DiscoveryEvent *event;
+
+	event = g_new0 (DiscoveryEvent, 1);
+	event->type = type;
+	event->interface = interface;
+	event->protocol = protocol;
+	event->service_type = g_strdup (service_type);
+	event->name = g_strdup (name);
+	if (name)
+		event->service_key = get_service_key (interface, protocol, service_type, name);
+
+	return event;
+}
+
+static void schedule_resolvers (RemoteDisplayManager *self);
+
+static void
+on_resolve_callback (AvahiServiceResolver *r,
+		     AvahiIfIndex interface, AvahiProtocol protocol,
+		     AvahiResolverEvent event,
+		     const char *name, const char *type,
+		     const char *domain, const char *host_name,
+		     const AvahiAddress *address,
+		     uint16_t port,
+		     AvahiStringList *txt,
+		     AvahiLookupResultFlags flags,
+		     void *userdata)
+{
+	RemoteDisplayManager *self = REMOTE_DISPLAY_MANAGER (userdata);
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	char *service_key;
+
+	service_key = get_service_key (interface, protocol, type, name);
+
+	REMOTE_DISPLAY_PROBE3 (resolve_done, type, name, event == AVAHI_RESOLVER_FOUND ? 1 : 0);
+
+	switch (event) {
+	case AVAHI_RESOLVER_FOUND: {
+			DiscoveryEvent *found;
+
+			g_hash_table_remove (priv->resolvers, service_key);
+			if (!matches_filter (self, type, name, txt)) {
+				char *device_key;
+
+				g_debug ("Device '%s' doesn't match the filter, not adding", name);
+				device_key = get_device_key (type, name, txt);
+				add_skipped_device (self, device_key);
+				g_free (device_key);
+				break;
+			}
+
+			found = discovery_event_new (DISCOVERY_EVENT_FOUND, interface, protocol, type, name);
+			found->host_name = g_strdup (host_name);
+			found->address = *address;
+			found->port = port;
+			found->txt = avahi_string_list_copy (txt);
+			found->device_key = get_device_key (type, name, txt);
+			post_event (self, found);
+		}
+		break;
+	case AVAHI_RESOLVER_FAILURE:
+		g_debug ("Failed to resolve '%s': %s", name,
+			 avahi_strerror (avahi_client_errno (priv->client)));
+		g_hash_table_remove (priv->resolvers, service_key);
+		break;
+	default:
+		break;
+	}
+
+	g_free (service_key);
+	schedule_resolvers (self);
+}
+
+static void
+resolve_free (Resolve *resolve)
+{
+	RemoteDisplayManagerPrivate *priv = resolve->self->priv;
+
+	if (resolve->resolver) {
+		avahi_service_resolver_free (resolve->resolver);
+		priv->n_resolving--;
+	} else {
+		g_queue_remove (priv->resolve_queue, resolve);
+	}
+	if (resolve->timeout) {
+		g_source_destroy (resolve->timeout);
+		g_source_unref (resolve->timeout);
+	}
+	g_atomic_int_dec_and_test (&priv->n_resolves);
+
+	g_free (resolve->service_key);
+	g_free (resolve->name);
+	g_free (resolve->type);
+	g_free (resolve->domain);
+	g_free (resolve);
+}
+
+/* Keeps the queue in order of priority, and in order of
+ * arrival for the same priority */
+static gint
+compare_resolves (gconstpointer a,
+		  gconstpointer b,
+		  gpointer      user_data)
+{
+	const Resolve *queued = a;
+	const Resolve *resolve = b;
+
+	return queued->priority >= resolve->priority ? -1 : 1;
+}
+
+/* Favourites first, then the receivers seen most recently */
+static gint64
+get_resolve_priority (RemoteDisplayManager *self,
+		      const char           *type,
+		      const char           *name)
+{
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	const char *display_name;
+	gboolean favourite;
+	gint64 *last_seen;
+	char *key;
+
+	/* RAOP service names are "<device ID>@<name>" */
+	display_name = name;
+	if (g_strcmp0 (type, RAOP_SERVICE) == 0 && strchr (name, '@'))
+		display_name = strchr (name, '@') + 1;
+	g_mutex_lock (&priv->lock);
+	favourite = priv->favourites &&
+		g_strv_contains ((const char * const *) priv->favourites, display_name);
+	g_mutex_unlock (&priv->lock);
+	if (favourite)
+		return G_MAXINT64;
+
+	/* Only changed before discovery starts */
+	key = g_strdup_printf ("%s/%s", type, name);
+	last_seen = g_hash_table_lookup (priv->last_seen, key);
+	g_free (key);
+
+	return last_seen ? *last_seen : 0;
+}
+
+static gboolean
+resolve_timeout_cb (gpointer user_data)
+{
+	Resolve *resolve = user_data;
+	RemoteDisplayManager *self = resolve->self;
+	RemoteDisplayManagerPrivate *priv = self->priv;
+
+	REMOTE_DISPLAY_PROBE3 (resolve_done, resolve->type, resolve->name, -1);
+
+	g_clear_pointer (&resolve->timeout, g_source_unref);
+	avahi_service_resolver_free (resolve->resolver);
+	resolve->resolver = NULL;
+	priv->n_resolving--;
+
+	if (resolve->attempts < RESOLVE_ATTEMPTS) {
+		g_debug ("Resolving '%s' timed out, trying again later", resolve->name);
+		resolve->priority = G_MININT64;
+		g_queue_push_tail (priv->resolve_queue, resolve);
+	} else {
+		g_debug ("Resolving '%s' timed out", resolve->name);
+		g_hash_table_remove (priv->resolvers, resolve->service_key);
+	}
+
+	schedule_resolvers (self);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Only a few resolvers run at once, so that busy networks
+ * don't flood the daemon, and the wanted receivers come first */
+static void
+schedule_resolvers (RemoteDisplayManager *self)
+{
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	Resolve *resolve;
+
+	while (priv->n_resolving < MAX_RESOLVERS &&
+	       (resolve = g_queue_pop_head (priv->resolve_queue)) != NULL) {
+		/* Resolve to an address in the family it was seen on, so
+		 * that each interface and family gives its own candidate */
+		resolve->attempts++;
+		REMOTE_DISPLAY_PROBE3 (resolve_start, resolve->type, resolve->name, resolve->attempts);
+		resolve->resolver = avahi_service_resolver_new (priv->client,
+								resolve->interface, resolve->protocol,
+								resolve->name, resolve->type, resolve->domain,
+								resolve->protocol, 0, on_resolve_callback, self);
+		if (!resolve->resolver) {
+			g_debug ("Failed to create resolver for '%s': %s", resolve->name,
+				 avahi_strerror (avahi_client_errno (priv->client)));
+			g_hash_table_remove (priv->resolvers, resolve->service_key);
+			continue;
+		}
+
+		priv->n_resolving++;
+		resolve->timeout = g_timeout_source_new_seconds (RESOLVE_TIMEOUT);
+		g_source_set_callback (resolve->timeout, resolve_timeout_cb, resolve, NULL);
+		g_source_attach (resolve->timeout, priv->discovery_context);
+	}
+}
+
+static void
+on_browse_callback (AvahiServiceBrowser *b,
+		    AvahiIfIndex interface, AvahiProtocol protocol,
+		    AvahiBrowserEvent event,
+		    const char *name,
+		    const char *type,
+		    const char *domain,
+		    AvahiLookupResultFlags flags,
+		    void *userdata)
+{
+	RemoteDisplayManager *self = REMOTE_DISPLAY_MANAGER (userdata);
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	char *service_key;
+
+	switch (event) {
+	case AVAHI_BROWSER_NEW: {
+			Resolve *resolve;
+
+			REMOTE_DISPLAY_PROBE2 (browse_new, type, name);
+			if (!matches_filter (self, type, name, NULL)) {
+				g_atomic_int_inc (&priv->resolves_skipped);
+				break;
+			}
+
+			service_key = get_service_key (interface, protocol, type, name);
+			if (g_hash_table_contains (priv->resolvers, service_key)) {
+				g_free (service_key);
+				break;
+			}
+
+			resolve = g_new0 (Resolve, 1);
+			resolve->self = self;
+			resolve->service_key = service_key;
+			resolve->interface = interface;
+			resolve->protocol = protocol;
+			resolve->name = g_strdup (name);
+			resolve->type = g_strdup (type);
+			resolve->domain = g_strdup (domain);
+			resolve->priority = get_resolve_priority (self, type, name);
+
+			g_atomic_int_inc (&priv->n_resolves);
+			g_hash_table_insert (priv->resolvers, resolve->service_key, resolve);
+			g_queue_insert_sorted (priv->resolve_queue, resolve, compare_resolves, NULL);
+			schedule_resolvers (self);
+		}
+		break;
+	case AVAHI_BROWSER_REMOVE:
+		REMOTE_DISPLAY_PROBE2 (browse_remove, type, name);
+		service_key = get_service_key (interface, protocol, type, name);
+		if (g_hash_table_remove (priv->resolvers, service_key))
+			schedule_resolvers (self);
+		g_free (service_key);
+
+		post_event (self, discovery_event_new (DISCOVERY_EVENT_REMOVED, interface, protocol, type, name));
+		break;
+	case AVAHI_BROWSER_ALL_FOR_NOW:
+		post_event (self, discovery_event_new (DISCOVERY_EVENT_ALL_FOR_NOW, interface, protocol, type, NULL));
+		break;
+	default:
+		/* Nothing */
+		;
+	}
+}
+
+typedef struct {
+	RemoteDisplayManager *self;
+	char *device_key;
+} DlnaPending;
+
+static char *
+get_dlna_device_key (const char *usn)
+{
+	const char *end;
+
+	/* "uuid:<UDN>::urn:schemas-upnp-org:device:MediaRenderer:1" */
+	end = strstr (usn, "::");
+	return g_strdup_printf ("dlna/%.*s", end ? (int) (end - usn) : (int) strlen (usn), usn);
+}
+
+static void
+dlna_device_ready_cb (GObject      *source_object,
+		      GAsyncResult *result,
+		      gpointer      user_data)
+{
+	DlnaPending *pending = user_data;
+	RemoteDisplayManager *self = pending->self;
+	RemoteDisplayDevice *device;
+	GError *error = NULL;
+
+	device = remote_display_device_dlna_new_finish (result, &error);
+	if (!device) {
+		/* The manager might be gone if it was cancelled */
+		if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+			g_debug ("Failed to add DLNA device '%s': %s", pending->device_key, error->message);
+			g_hash_table_remove (self->priv->dlna_pending, pending->device_key);
+		}
+		g_error_free (error);
+		goto out;
+	}
+
+	g_hash_table_remove (self->priv->dlna_pending, pending->device_key);
+	if (!device_matches_filter (self, device)) {
+		add_skipped_device (self, pending->device_key);
+		g_object_unref (device);
+		goto out;
+	}
+	REMOTE_DISPLAY_PROBE3 (device_new, device, remote_display_device_get_name (device), "dlna");
+	remote_display_device_mark_alive (device);
+	g_hash_table_insert (self->priv->known_devices, g_strdup (pending->device_key), device);
+	device_appeared (self, device);
+
+out:
+	g_free (pending->device_key);
+	g_free (pending);
+}
+
+static void
+ssdp_found_cb (RemoteDisplaySsdp    *ssdp,
+	       const char           *usn,
+	       const char           *location,
+	       RemoteDisplayManager *self)
+{
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	GCancellable *cancellable;
+	DlnaPending *pending;
+	char *device_key;
+
+	REMOTE_DISPLAY_PROBE2 (browse_new, DLNA_RENDERER_TYPE, usn);
+	device_key = get_dlna_device_key (usn);
+	if (g_hash_table_contains (priv->known_devices, device_key) ||
+	    g_hash_table_contains (priv->dlna_pending, device_key)) {
+		g_free (device_key);
+		return;
+	}
+
+	/* The name is only known once the description is fetched */
+	if (!matches_filter (self, DLNA_RENDERER_TYPE, NULL, NULL)) {
+		g_atomic_int_inc (&priv->resolves_skipped);
+		g_free (device_key);
+		return;
+	}
+
+	pending = g_new0 (DlnaPending, 1);
+	pending->self = self;
+	pending->device_key = g_strdup (device_key);
+
+	cancellable = g_cancellable_new ();
+	g_hash_table_insert (priv->dlna_pending, device_key, cancellable);
+	remote_display_device_dlna_new_async (priv->dlna_context, location, cancellable,
+					      dlna_device_ready_cb, pending);
+}
+
+static void
+ssdp_lost_cb (RemoteDisplaySsdp    *ssdp,
+	      const char           *usn,
+	      RemoteDisplayManager *self)
+{
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	RemoteDisplayDevice *device;
+	GCancellable *cancellable;
+	char *device_key;
+
+	REMOTE_DISPLAY_PROBE2 (browse_remove, DLNA_RENDERER_TYPE, usn);
+	device_key = get_dlna_device_key (usn);
+
+	cancellable = g_hash_table_lookup (priv->dlna_pending, device_key);
+	if (cancellable) {
+		g_cancellable_cancel (cancellable);
+		g_hash_table_remove (priv->dlna_pending, device_key);
+	}
+
+	device = g_hash_table_lookup (priv->known_devices, device_key);
+	if (device) {
+		device_disappeared (self, device);
+		keep_failures (self, device);
+		g_hash_table_remove (priv->known_devices, device_key);
+	}
+
+	g_free (device_key);
+}
+
+static void
+cancel_pending (gpointer key,
+		gpointer value,
+		gpointer user_data)
+{
+	g_cancellable_cancel (value);
+}
+
+static void
+on_client_state_changed (AvahiClient *client, AvahiClientState state, void *user_data)
+{
+	RemoteDisplayManager *self = REMOTE_DISPLAY_MANAGER (user_data);
+	RemoteDisplayManagerPrivate *priv = self->priv;
+
+	switch (state) {
+	case AVAHI_CLIENT_S_RUNNING:
+		priv->browser = avahi_service_browser_new (client,
+							   AVAHI_IF_UNSPEC,
+							   AVAHI_PROTO_UNSPEC,
+							   AIRPLAY_SERVICE,
+							   NULL, 0,
+							   on_browse_callback, self);
+		/* Audio-only receivers only advertise RAOP */
+		priv->raop_browser = avahi_service_browser_new (client,
+								AVAHI_IF_UNSPEC,
+								AVAHI_PROTO_UNSPEC,
+								RAOP_SERVICE,
+								NULL, 0,
+								on_browse_callback, self);
+		break;
+	case AVAHI_CLIENT_S_REGISTERING:
+	case AVAHI_CLIENT_CONNECTING:
+		/* Silently do nothing */
+		break;
+	case AVAHI_CLIENT_S_COLLISION:
+	case AVAHI_CLIENT_FAILURE:
+	default:
+		g_warning ("Cannot connect to Avahi: state %d", state);
+		break;
+	}
+}
+
+static void
+mdns_found_cb (RemoteDisplayMdns     *mdns,
+	       const char            *name,
+	       guint                  ifindex,
+	       const char            *host_name,
+	       GInetAddress          *address,
+	       guint                  port,
+	       char                 **txt,
+	       RemoteDisplayManager  *self)
+{
+	AvahiStringList *txt_list;
+	DiscoveryEvent *found;
+	const char *type;
+	char *str;
+
+	type = mdns == self->priv->mdns ? AIRPLAY_SERVICE : RAOP_SERVICE;
+	/* The native querier resolves while browsing */
+	REMOTE_DISPLAY_PROBE2 (browse_new, type, name);
+	REMOTE_DISPLAY_PROBE3 (resolve_done, type, name, 1);
+	txt_list = avahi_string_list_new_from_array ((const char **) txt, -1);
+	if (!matches_filter (self, type, name, txt_list)) {
+		str = get_device_key (type, name, txt_list);
+		add_skipped_device (self, str);
+		g_free (str);
+		avahi_string_list_free (txt_list);
+		return;
+	}
+
+	found = discovery_event_new (DISCOVERY_EVENT_FOUND, ifindex, AVAHI_PROTO_INET, type, name);
+	found->host_name = g_strdup (host_name);
+	str = g_inet_address_to_string (address);
+	avahi_address_parse (str, AVAHI_PROTO_INET, &found->address);
+	g_free (str);
+	found->port = port;
+	found->txt = txt_list;
+	found->device_key = get_device_key (type, name, found->txt);
+
+	post_event (self, found);
+}
+
+static void
+mdns_removed_cb (RemoteDisplayMdns    *mdns,
+		 const char           *name,
+		 guint                 ifindex,
+		 RemoteDisplayManager *self)
+{
+	const char *type;
+
+	type = mdns == self->priv->mdns ? AIRPLAY_SERVICE : RAOP_SERVICE;
+	REMOTE_DISPLAY_PROBE2 (browse_remove, type, name);
+	post_event (self, discovery_event_new (DISCOVERY_EVENT_REMOVED, ifindex, AVAHI_PROTO_INET, type, name));
+}
+
+static void
+mdns_all_for_now_cb (RemoteDisplayMdns    *mdns,
+		     RemoteDisplayManager *self)
+{
+	const char *type;
+
+	type = mdns == self->priv->mdns ? AIRPLAY_SERVICE : RAOP_SERVICE;
+	post_event (self, discovery_event_new (DISCOVERY_EVENT_ALL_FOR_NOW, AVAHI_IF_UNSPEC, AVAHI_PROTO_INET, type, NULL));
+}
+
+static RemoteDisplayMdns *
+new_querier (RemoteDisplayManager *self,
+	     const char           *service_type)
+{
+	RemoteDisplayMdns *mdns;
+	GError *error = NULL;
+	const char *target;
+
+	mdns = remote_display_mdns_new (service_type);
+
+	/* "address:port" of a responder to query directly, such as
+	 * simulated receivers on the loopback interface */
+	target = g_getenv ("REMOTE_DISPLAY_MDNS_TARGET");
+	if (target && *target != '\0') {
+		GSocketConnectable *connectable;
+
+		connectable = g_network_address_parse (target, 5353, &error);
+		if (connectable) {
+			GInetAddress *address;
+
+			address = g_inet_address_new_from_string (g_network_address_get_hostname (G_NETWORK_ADDRESS (connectable)));
+			if (address) {
+				GSocketAddress *socket_address;
+
+				socket_address = g_inet_socket_address_new (address, g_network_address_get_port (G_NETWORK_ADDRESS (connectable)));
+				remote_display_mdns_set_target (mdns, G_INET_SOCKET_ADDRESS (socket_address));
+				g_object_unref (socket_address);
+				g_object_unref (address);
+			} else {
+				g_warning ("REMOTE_DISPLAY_MDNS_TARGET needs a numeric address, not '%s'", target);
+			}
+			g_object_unref (connectable);
+		} else {
+			g_warning ("Invalid REMOTE_DISPLAY_MDNS_TARGET '%s': %s", target, error->message);
+			g_clear_error (&error);
+		}
+	}
+	g_signal_connect (mdns, "found",
+			  G_CALLBACK (mdns_found_cb), self);
+	g_signal_connect (mdns, "removed",
+			  G_CALLBACK (mdns_removed_cb), self);
+	g_signal_connect (mdns, "all-for-now",
+			  G_CALLBACK (mdns_all_for_now_cb), self);
+	if (!remote_display_mdns_start (mdns, &error)) {
+		g_warning ("Cannot query for %s services: %s", service_type, error->message);
+		g_error_free (error);
+		g_clear_object (&mdns);
+	}
+
+	return mdns;
+}
+
+/* Client of the D-Bus service, devices are keyed by their ID */
+static char *
+get_service_device_key (const char *id)
+{
+	return g_strdup_printf ("service/%s", id);
+}
+
+static void
+service_add_device (RemoteDisplayManager *self,
+		    GVariant             *info)
+{
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	RemoteDisplayDevice *device;
+	const char *id;
+	char *device_key;
+
+	g_variant_get_child (info, 0, "&s", &id);
+	device_key = get_service_device_key (id);
+	if (g_hash_table_contains (priv->known_devices, device_key)) {
+		g_free (device_key);
+		return;
+	}
+
+	device = remote_display_device_proxy_new (priv->service_connection, priv->service_owner, info);
+	g_hash_table_insert (priv->known_devices, device_key, device);
+	REMOTE_DISPLAY_PROBE3 (device_new, device, remote_display_device_get_name (device), "service");
+	device_appeared (self, device);
+}
+
+static void
+service_remove_device (RemoteDisplayManager *self,
+		       const char           *id)
+{
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	RemoteDisplayDevice *device;
+	char *device_key;
+
+	device_key = get_service_device_key (id);
+	device = g_hash_table_lookup (priv->known_devices, device_key);
+	if (device) {
+		device_disappeared (self, device);
+		keep_failures (self, device);
+		g_hash_table_remove (priv->known_devices, device_key);
+	}
+	g_free (device_key);
+}
+
+static RemoteDisplayDevice *
+service_lookup_device (RemoteDisplayManager *self,
+		       const char           *id)
+{
+	RemoteDisplayDevice *device;
+	char *device_key;
+
+	device_key = get_service_device_key (id);
+	device = g_hash_table_lookup (self->priv->known_devices, device_key);
+	g_free (device_key);
+
+	return device;
+}
+
+static void
+service_signal_cb (GDBusConnection *connection,
+		   const char      *sender_name,
+		   const char      *object_path,
+		   const char      *interface_name,
+		   const char      *signal_name,
+		   GVariant        *parameters,
+		   gpointer         user_data)
+{
+	RemoteDisplayManager *self = user_data;
+	RemoteDisplayDevice *device;
+	const char *id, *uri;
+	guint state;
+
+	if (g_str_equal (signal_name, "DeviceAppeared") &&
+	    g_variant_is_of_type (parameters, G_VARIANT_TYPE ("((ssubb))"))) {
+		GVariant *info;
+
+		info = g_variant_get_child_value (parameters, 0);
+		service_add_device (self, info);
+		g_variant_unref (info);
+	} else if (g_str_equal (signal_name, "DeviceChanged") &&
+		   g_variant_is_of_type (parameters, G_VARIANT_TYPE ("((ssubb))"))) {
+		GVariant *info;
+
+		info = g_variant_get_child_value (parameters, 0);
+		g_variant_get_child (info, 0, "&s", &id);
+		device = service_lookup_device (self, id);
+		if (device)
+			remote_display_device_proxy_update (REMOTE_DISPLAY_DEVICE_PROXY (device), info);
+		g_variant_unref (info);
+	} else if (g_str_equal (signal_name, "DeviceDisappeared") &&
+		   g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(s)"))) {
+		g_variant_get (parameters, "(&s)", &id);
+		service_remove_device (self, id);
+	} else if (g_str_equal (signal_name, "StateChanged") &&
+		   g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(su)"))) {
+		g_variant_get (parameters, "(&su)", &id, &state);
+		device = service_lookup_device (self, id);
+		if (device)
+			g_signal_emit_by_name (G_OBJECT (device), "state-changed", state);
+	} else if (g_str_equal (signal_name, "MediaServed") &&
+		   g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(ss)"))) {
+		g_variant_get (parameters, "(&s&s)", &id, &uri);
+		device = service_lookup_device (self, id);
+		if (device)
+			g_signal_emit_by_name (G_OBJECT (device), "media-served", uri);
+	}
+}
+
+static void
+service_get_devices_cb (GObject      *source_object,
+			GAsyncResult *result,
+			gpointer      user_data)
+{
+	RemoteDisplayManager *self = user_data;
+	GVariantIter *iter;
+	GVariant *ret, *info;
+	GError *error = NULL;
+
+	ret = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), result, &error);
+	if (!ret) {
+		if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			g_warning ("Cannot get the devices of the discovery service: %s", error->message);
+		g_error_free (error);
+		return;
+	}
+
+	g_variant_get (ret, "(a(ssubb))", &iter);
+	while ((info = g_variant_iter_next_value (iter))) {
+		service_add_device (self, info);
+		g_variant_unref (info);
+	}
+	g_variant_iter_free (iter);
+	g_variant_unref (ret);
+}
+
+static void
+service_appeared_cb (GDBusConnection *connection,
+		     const char      *name,
+		     const char      *name_owner,
+		     gpointer         user_data)
+{
+	RemoteDisplayManager *self = user_data;
+	RemoteDisplayManagerPrivate *priv = self->priv;
+
+	g_debug ("Discovery service appeared as %s", name_owner);
+	priv->service_connection = g_object_ref (connection);
+	priv->service_owner = g_strdup (name_owner);
+	priv->service_cancellable = g_cancellable_new ();
+
+	/* Before listing, so that no device is missed */
+	priv->service_signal_id = g_dbus_connection_signal_subscribe (connection,
+								      name_owner,
+								      REMOTE_DISPLAY_DBUS_INTERFACE,
+								      NULL,
+								      REMOTE_DISPLAY_DBUS_PATH,
+								      NULL,
+								      G_DBUS_SIGNAL_FLAGS_NONE,
+								      service_signal_cb,
+								      self, NULL);
+	g_dbus_connection_call (connection,
+				name_owner,
+				REMOTE_DISPLAY_DBUS_PATH,
+				REMOTE_DISPLAY_DBUS_INTERFACE,
+				"GetDevices",
+				NULL,
+				G_VARIANT_TYPE ("(a(ssubb))"),
+				G_DBUS_CALL_FLAGS_NONE,
+				-1,
+				priv->service_cancellable,
+				service_get_devices_cb,
+				self);
+}
+
+static void
+service_vanished_cb (GDBusConnection *connection,
+		     const char      *name,
+		     gpointer         user_data)
+{
+	RemoteDisplayManager *self = user_data;
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	GHashTableIter iter;
+	gpointer key, value;
 
-	/* AIRPLAY support */
+	if (!priv->service_owner) {
+		g_debug ("Discovery service not available");
+		return;
+	}
 
-	/* Avahi <-> GLib adaptors */
-	AvahiGLibPoll *poll;
-	/* Avahi client */
-	AvahiClient *client;
-	/* Service browser */
-	AvahiServiceBrowser *browser;
-	/* Pending resolvers */
-	GHashTable *resolvers;
+	g_debug ("Discovery service %s went away", priv->service_owner);
+	g_cancellable_cancel (priv->service_cancellable);
+	g_clear_object (&priv->service_cancellable);
+	g_dbus_connection_signal_unsubscribe (priv->service_connection, priv->service_signal_id);
+	priv->service_signal_id = 0;
+	g_clear_object (&priv->service_connection);
+	g_clear_pointer (&priv->service_owner, g_free);
 
-	/* DLNA support */
-};
+	g_hash_table_iter_init (&iter, priv->known_devices);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		if (!g_str_has_prefix (key, "service/"))
+			continue;
+		device_disappeared (self, value);
+		keep_failures (self, value);
+		g_hash_table_iter_remove (&iter);
+	}
+}
 
-#define GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE ((obj), REMOTE_DISPLAY_TYPE_MANAGER, RemoteDisplayManagerPrivate))
+static void
+service_watch (RemoteDisplayManager *self)
+{
+	self->priv->service_watch_id = g_bus_watch_name (G_BUS_TYPE_SESSION,
+							 REMOTE_DISPLAY_DBUS_NAME,
+							 G_BUS_NAME_WATCHER_FLAGS_AUTO_START,
+							 service_appeared_cb,
+							 service_vanished_cb,
+							 self, NULL);
+}
 
-G_DEFINE_TYPE (RemoteDisplayManager, remote_display_manager, G_TYPE_OBJECT);
+static gboolean
+start_discovery_cb (gpointer user_data)
+{
+	RemoteDisplayManager *self = user_data;
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	const char *backend;
+	int error;
 
-enum {
-	DEVICE_APPEARED,
-	DEVICE_DISAPPEARED,
-	NUM_SIGS
-};
+	/* Setting REMOTE_DISPLAY_MDNS to "native" or "avahi" picks
+	 * the backend, otherwise Avahi is used if the daemon runs */
+	backend = g_getenv ("REMOTE_DISPLAY_MDNS");
+	if (g_strcmp0 (backend, "native") != 0) {
+		priv->poll = avahi_glib_poll_new (priv->discovery_context, G_PRIORITY_DEFAULT);
+		priv->client = avahi_client_new (avahi_glib_poll_get (priv->poll),
+						 AVAHI_CLIENT_NO_FAIL,
+						 on_client_state_changed,
+						 self,
+						 &error);
+		if (g_strcmp0 (backend, "avahi") == 0 ||
+		    (priv->client && avahi_client_get_state (priv->client) != AVAHI_CLIENT_CONNECTING))
+			return G_SOURCE_REMOVE;
 
-static guint signals[NUM_SIGS] = {0,};
+		g_debug ("Avahi daemon not available, using the built-in mDNS querier");
+		g_clear_pointer (&priv->client, avahi_client_free);
+		g_clear_pointer (&priv->poll, avahi_glib_poll_free);
+	}
 
-static void
-on_resolve_callback (AvahiServiceResolver *r,
-		     AvahiIfIndex interface, AvahiProtocol protocol,
-		     AvahiResolverEvent event,
-		     const char *name, const char *type,
-		     const char *domain, const char *host_name,
-		     const AvahiAddress *address,
-		     uint16_t port,
-		     AvahiStringList *txt,
-		     AvahiLookupResultFlags flags,
-		     void *userdata)
+	priv->mdns = new_querier (self, AIRPLAY_SERVICE);
+	priv->raop_mdns = new_querier (self, RAOP_SERVICE);
+
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+stop_discovery_cb (gpointer user_data)
 {
-	RemoteDisplayManager *self = REMOTE_DISPLAY_MANAGER (userdata);
+	RemoteDisplayManager *self = user_data;
 	RemoteDisplayManagerPrivate *priv = self->priv;
 
-	switch (event) {
-	case AVAHI_RESOLVER_FOUND: {
-			RemoteDisplayDevice *device;
+	g_clear_pointer (&priv->resolvers, g_hash_table_destroy);
+	g_clear_pointer (&priv->browser, avahi_service_browser_free);
+	g_clear_pointer (&priv->raop_browser, avahi_service_browser_free);
+	g_clear_pointer (&priv->client, avahi_client_free);
+	g_clear_pointer (&priv->poll, avahi_glib_poll_free);
+	if (priv->mdns)
+		g_signal_handlers_disconnect_by_data (priv->mdns, self);
+	g_clear_object (&priv->mdns);
+	if (priv->raop_mdns)
+		g_signal_handlers_disconnect_by_data (priv->raop_mdns, self);
+	g_clear_object (&priv->raop_mdns);
 
-			device = remote_display_device_airplay_new (interface, protocol, name, txt, host_name, address, port);
-			if (device) {
-				g_hash_table_insert (priv->known_devices, g_strdup (name), device);
-				g_signal_emit (self, signals[DEVICE_APPEARED], 0, device);
-			}
-			g_hash_table_remove (priv->resolvers, r);
-		}
-		break;
-	default:
-		break;
+	if (priv->discovery_loop)
+		g_main_loop_quit (priv->discovery_loop);
+
+	return G_SOURCE_REMOVE;
+}
+
+static gpointer
+discovery_thread_func (gpointer user_data)
+{
+	RemoteDisplayManager *self = user_data;
+	RemoteDisplayManagerPrivate *priv = self->priv;
+
+	g_main_context_push_thread_default (priv->discovery_context);
+	g_main_loop_run (priv->discovery_loop);
+	g_main_context_pop_thread_default (priv->discovery_context);
+
+	return NULL;
+}
+
+static gboolean
+sort_resolves_cb (gpointer user_data)
+{
+	RemoteDisplayManager *self = user_data;
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	GList *l;
+
+	for (l = priv->resolve_queue->head; l != NULL; l = l->next) {
+		Resolve *resolve = l->data;
+
+		resolve->priority = get_resolve_priority (self, resolve->type, resolve->name);
 	}
+	g_queue_sort (priv->resolve_queue, compare_resolves, NULL);
+
+	return G_SOURCE_REMOVE;
 }
 
 static void
-on_browse_callback (AvahiServiceBrowser *b,
-		    AvahiIfIndex interface, AvahiProtocol protocol,
-		    AvahiBrowserEvent event,
-		    const char *name,
-		    const char *type,
-		    const char *domain,
-		    AvahiLookupResultFlags flags,
-		    void *userdata)
+remote_display_manager_finalize (GObject *object)
 {
-	RemoteDisplayManager *self = REMOTE_DISPLAY_MANAGER (userdata);
+	RemoteDisplayManager *self = REMOTE_DISPLAY_MANAGER (object);
 	RemoteDisplayManagerPrivate *priv = self->priv;
+	guint i;
 
-	switch (event) {
-	case AVAHI_BROWSER_NEW: {
-			AvahiServiceResolver *resolver;
+	if (priv->discovery_thread) {
+		g_main_context_invoke (priv->discovery_context, stop_discovery_cb, object);
+		g_thread_join (priv->discovery_thread);
+		g_clear_pointer (&priv->discovery_loop, g_main_loop_unref);
+	} else {
+		stop_discovery_cb (object);
+	}
+	g_clear_pointer (&priv->discovery_context, g_main_context_unref);
+	if (priv->events_source) {
+		g_source_destroy (priv->events_source);
+		g_source_unref (priv->events_source);
+	}
+	g_queue_free_full (priv->events, (GDestroyNotify) discovery_event_free);
+	g_mutex_clear (&priv->lock);
 
-			resolver = avahi_service_resolver_new (priv->client,
-							       interface, protocol, name, type, domain,
-							       AVAHI_PROTO_UNSPEC, 0, on_resolve_callback, self);
-			/* TODO: error handling */
+	remove_source (self, &priv->liveness_id);
+	if (priv->known_devices) {
+		GHashTableIter iter;
+		gpointer value;
 
-			g_hash_table_insert (priv->resolvers, g_strdup (name), resolver);
+		g_hash_table_iter_init (&iter, priv->known_devices);
+		while (g_hash_table_iter_next (&iter, NULL, &value)) {
+			g_signal_handlers_disconnect_by_func (value, reachability_changed_cb, object);
+			g_signal_handlers_disconnect_by_func (value, capabilities_changed_cb, object);
 		}
-		break;
-	case AVAHI_BROWSER_REMOVE: {
-			RemoteDisplayDevice *device;
+	}
+	g_clear_pointer (&priv->hidden, g_hash_table_destroy);
+	g_clear_pointer (&priv->resolve_queue, g_queue_free);
+	g_clear_pointer (&priv->last_seen, g_hash_table_destroy);
+	g_clear_pointer (&priv->favourites, g_strfreev);
+	g_clear_pointer (&priv->filter_name, g_pattern_spec_free);
+	g_clear_pointer (&priv->skipped_devices, g_hash_table_destroy);
+	remove_source (self, &priv->changes_id);
+	g_clear_pointer (&priv->added, g_ptr_array_unref);
+	g_clear_pointer (&priv->by_id, g_hash_table_destroy);
+	g_clear_pointer (&priv->by_name, g_hash_table_destroy);
+	for (i = 0; i < priv->n_capabilities; i++)
+		g_clear_pointer (&priv->by_capability[i], g_ptr_array_unref);
+	g_clear_pointer (&priv->by_capability, g_free);
+	g_clear_pointer (&priv->visible, g_ptr_array_unref);
+	g_clear_pointer (&priv->removed, g_ptr_array_unref);
+	if (priv->ssdp)
+		g_signal_handlers_disconnect_by_data (priv->ssdp, object);
+	g_clear_object (&priv->ssdp);
+	g_hash_table_foreach (priv->dlna_pending, cancel_pending, NULL);
+	g_clear_pointer (&priv->dlna_pending, g_hash_table_destroy);
+	g_clear_pointer (&priv->dlna_context, remote_display_dlna_context_unref);
+	g_clear_pointer (&priv->services, g_hash_table_destroy);
+	g_clear_pointer (&priv->known_devices, g_hash_table_destroy);
+	g_clear_pointer (&priv->provisional, g_hash_table_destroy);
+	g_clear_pointer (&priv->cached_keys, g_ptr_array_unref);
+	remove_source (self, &priv->announce_id);
+	remove_source (self, &priv->retract_id);
+	if (priv->cache_save_id != 0) {
+		remove_source (self, &priv->cache_save_id);
+		cache_save_cb (object);
+	}
+	g_clear_pointer (&priv->cache, g_key_file_free);
+	g_free (priv->cache_path);
+	if (priv->metrics_server) {
+		soup_server_disconnect (priv->metrics_server);
+		g_clear_object (&priv->metrics_server);
+	}
+	if (priv->service_watch_id != 0)
+		g_bus_unwatch_name (priv->service_watch_id);
+	if (priv->service_cancellable) {
+		g_cancellable_cancel (priv->service_cancellable);
+		g_clear_object (&priv->service_cancellable);
+	}
+	if (priv->service_signal_id != 0)
+		g_dbus_connection_signal_unsubscribe (priv->service_connection, priv->service_signal_id);
+	g_clear_object (&priv->service_connection);
+	g_free (priv->service_owner);
+	g_clear_pointer (&priv->context, g_main_context_unref);
 
-			device = g_hash_table_lookup (priv->known_devices, name);
-			if (device) {
-				g_signal_emit (self, signals[DEVICE_DISAPPEARED], 0, device);
-				g_hash_table_remove (priv->known_devices, name);
-			}
-		}
+	G_OBJECT_CLASS (remote_display_manager_parent_class)->finalize (object);
+}
+
+static void
+remote_display_manager_set_property (GObject      *object,
+				     guint         prop_id,
+				     const GValue *value,
+				     GParamSpec   *pspec)
+{
+	RemoteDisplayManagerPrivate *priv = REMOTE_DISPLAY_MANAGER (object)->priv;
+
+	switch (prop_id) {
+	case PROP_DISCOVERY_THREAD:
+		priv->use_discovery_thread = g_value_get_boolean (value);
+		break;
+	case PROP_USE_SERVICE:
+		priv->use_service = g_value_get_boolean (value);
 		break;
 	default:
-		/* Nothing */
-		;
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 	}
 }
 
 static void
-on_client_state_changed (AvahiClient *client, AvahiClientState state, void *user_data)
+remote_display_manager_get_property (GObject    *object,
+				     guint       prop_id,
+				     GValue     *value,
+				     GParamSpec *pspec)
 {
-	RemoteDisplayManager *self = REMOTE_DISPLAY_MANAGER (user_data);
-	RemoteDisplayManagerPrivate *priv = self->priv;
+	RemoteDisplayManagerPrivate *priv = REMOTE_DISPLAY_MANAGER (object)->priv;
 
-	switch (state) {
-	case AVAHI_CLIENT_S_RUNNING:
-		priv->browser = avahi_service_browser_new (client,
-							   AVAHI_IF_UNSPEC,
-							   AVAHI_PROTO_UNSPEC,
-							   "_airplay._tcp",
-							   NULL, 0,
-							   on_browse_callback, self);
+	switch (prop_id) {
+	case PROP_DISCOVERY_THREAD:
+		g_value_set_boolean (value, priv->use_discovery_thread);
 		break;
-	case AVAHI_CLIENT_S_REGISTERING:
-	case AVAHI_CLIENT_CONNECTING:
-		/* Silently do nothing */
+	case PROP_USE_SERVICE:
+		g_value_set_boolean (value, priv->use_service);
 		break;
-	case AVAHI_CLIENT_S_COLLISION:
-	case AVAHI_CLIENT_FAILURE:
 	default:
-		g_warning ("Cannot connect to Avahi: state %d", state);
-		break;
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 	}
 }
 
 static void
-remote_display_manager_finalize (GObject *object)
+remote_display_manager_constructed (GObject *object)
 {
-	RemoteDisplayManagerPrivate *priv = REMOTE_DISPLAY_MANAGER(object)->priv;
+	RemoteDisplayManager *self = REMOTE_DISPLAY_MANAGER (object);
+	RemoteDisplayManagerPrivate *priv = self->priv;
+	GError *ssdp_error = NULL;
 
-	g_clear_pointer (&priv->resolvers, g_hash_table_destroy);
-	g_clear_pointer (&priv->browser, avahi_service_browser_free);
-	g_clear_pointer (&priv->client, avahi_client_free);
-	g_clear_pointer (&priv->poll, avahi_glib_poll_free);
+	if (g_strcmp0 (g_getenv ("REMOTE_DISPLAY_SERVICE"), "1") == 0)
+		priv->use_service = TRUE;
+	if (priv->use_service) {
+		priv->discovery_context = g_main_context_ref (priv->context);
+		service_watch (self);
+		G_OBJECT_CLASS (remote_display_manager_parent_class)->constructed (object);
+		return;
+	}
+
+	if (*priv->cache_path != '\0')
+		cache_load (self);
+
+	/* DLNA */
+	priv->ssdp = remote_display_ssdp_new (DLNA_RENDERER_TYPE);
+	g_signal_connect (priv->ssdp, "found",
+			  G_CALLBACK (ssdp_found_cb), self);
+	g_signal_connect (priv->ssdp, "lost",
+			  G_CALLBACK (ssdp_lost_cb), self);
+	if (!remote_display_ssdp_start (priv->ssdp, &ssdp_error)) {
+		g_debug ("Cannot search for DLNA devices: %s", ssdp_error->message);
+		g_error_free (ssdp_error);
+		g_clear_object (&priv->ssdp);
+	}
+
+	/* AirPlay */
+	if (priv->use_discovery_thread) {
+		priv->discovery_context = g_main_context_new ();
+		priv->discovery_loop = g_main_loop_new (priv->discovery_context, FALSE);
+		priv->discovery_thread = g_thread_new ("remote-display-discovery",
+						       discovery_thread_func, self);
+		g_main_context_invoke (priv->discovery_context, start_discovery_cb, self);
+	} else {
+		priv->discovery_context = g_main_context_ref (priv->context);
+		start_discovery_cb (self);
+	}
+
+	G_OBJECT_CLASS (remote_display_manager_parent_class)->constructed (object);
 }
 
 static void
@@ -177,6 +2270,46 @@ remote_display_manager_class_init (RemoteDisplayManagerClass *klass)
 	g_type_class_add_private (klass, sizeof (RemoteDisplayManagerPrivate));
 
 	o_class->finalize = remote_display_manager_finalize;
+	o_class->set_property = remote_display_manager_set_property;
+	o_class->get_property = remote_display_manager_get_property;
+	o_class->constructed = remote_display_manager_constructed;
+
+	/**
+	 * RemoteDisplayManager:discovery-thread:
+	 *
+	 * Whether to browse and resolve services in a separate thread.
+	 * Results are handed over to the thread-default main context
+	 * the manager was created in, a few at a time, so that busy
+	 * networks don't slow down the application.
+	 **/
+	g_object_class_install_property (o_class,
+					 PROP_DISCOVERY_THREAD,
+					 g_param_spec_boolean ("discovery-thread",
+							       "Discovery thread",
+							       "Whether to discover devices in a separate thread",
+							       FALSE,
+							       G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+	/**
+	 * RemoteDisplayManager:use-service:
+	 *
+	 * Whether to get the devices from the session's discovery
+	 * service, remote-display-daemon, which is started if needed,
+	 * instead of browsing the network. Commands to the devices
+	 * are sent through the service, and only the devices that
+	 * can play videos are available. Setting REMOTE_DISPLAY_SERVICE
+	 * to "1" in the environment has the same effect.
+	 *
+	 * Cancelling a command of those devices only stops waiting
+	 * for the service's reply, the receiver still gets it.
+	 **/
+	g_object_class_install_property (o_class,
+					 PROP_USE_SERVICE,
+					 g_param_spec_boolean ("use-service",
+							       "Use service",
+							       "Whether to get devices from the D-Bus service",
+							       FALSE,
+							       G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
 
 	signals[DEVICE_APPEARED] = g_signal_new ("device-appeared",
 						 REMOTE_DISPLAY_TYPE_MANAGER,
@@ -193,29 +2326,81 @@ remote_display_manager_class_init (RemoteDisplayManagerClass *klass)
 						    g_cclosure_marshal_generic,
 						    G_TYPE_NONE,
 						    1, G_TYPE_OBJECT);
+
+	/**
+	 * RemoteDisplayManager::devices-changed:
+	 * @manager: the #RemoteDisplayManager
+	 * @added: a #GPtrArray of the #RemoteDisplayDevice that appeared
+	 * @removed: a #GPtrArray of the #RemoteDisplayDevice that disappeared
+	 *
+	 * Emitted at most every 250 milliseconds with the devices that
+	 * appeared and disappeared since the last emission, so that
+	 * busy networks don't need updating the UI for every device.
+	 **/
+	signals[DEVICES_CHANGED] = g_signal_new ("devices-changed",
+						 REMOTE_DISPLAY_TYPE_MANAGER,
+						 G_SIGNAL_RUN_FIRST,
+						 0, NULL, NULL,
+						 g_cclosure_marshal_generic,
+						 G_TYPE_NONE,
+						 2, G_TYPE_PTR_ARRAY, G_TYPE_PTR_ARRAY);
 }
 
 static void
 remote_display_manager_init (RemoteDisplayManager *self)
 {
 	RemoteDisplayManagerPrivate *priv;
-	int error;
+	GFlagsClass *flags_class;
+	guint i;
 
 	priv = self->priv = GET_PRIVATE (self);
 
 	priv->known_devices = g_hash_table_new_full (g_str_hash, g_str_equal,
 						     g_free, g_object_unref);
+	priv->services = g_hash_table_new_full (g_str_hash, g_str_equal,
+						g_free, g_free);
+	priv->hidden = g_hash_table_new (NULL, NULL);
+	priv->visible = g_ptr_array_new_with_free_func (g_object_unref);
+	priv->by_id = g_hash_table_new_full (g_str_hash, g_str_equal,
+					     g_free, NULL);
+	priv->by_name = g_hash_table_new_full (g_str_hash, g_str_equal,
+					       g_free, (GDestroyNotify) g_ptr_array_unref);
+	flags_class = g_type_class_ref (REMOTE_DISPLAY_TYPE_DISPLAY_DEVICE_CAPABILITIES);
+	priv->n_capabilities = g_bit_storage (flags_class->mask);
+	g_type_class_unref (flags_class);
+	priv->by_capability = g_new (GPtrArray *, priv->n_capabilities);
+	for (i = 0; i < priv->n_capabilities; i++)
+		priv->by_capability[i] = g_ptr_array_new ();
+	priv->added = g_ptr_array_new_with_free_func (g_object_unref);
+	priv->removed = g_ptr_array_new_with_free_func (g_object_unref);
+	priv->last_seen = g_hash_table_new_full (g_str_hash, g_str_equal,
+						 g_free, g_free);
+	priv->skipped_devices = g_hash_table_new_full (g_str_hash, g_str_equal,
+						       g_free, NULL);
+
+	/* Setting REMOTE_DISPLAY_CACHE to an empty string disables the cache */
+	priv->cached_keys = g_ptr_array_new_with_free_func (g_free);
+	priv->provisional = g_hash_table_new_full (g_str_hash, g_str_equal,
+						   g_free, (GDestroyNotify) g_array_unref);
+	if (g_getenv ("REMOTE_DISPLAY_CACHE"))
+		priv->cache_path = g_strdup (g_getenv ("REMOTE_DISPLAY_CACHE"));
+	else
+		priv->cache_path = g_build_filename (g_get_user_cache_dir (), "libremote-display",
+						     "devices.ini", NULL);
 
 	/* AirPlay */
 	priv->resolvers = g_hash_table_new_full (g_str_hash, g_str_equal,
-						 g_free, (GDestroyNotify) avahi_service_resolver_free);
+						 NULL, (GDestroyNotify) resolve_free);
+	priv->resolve_queue = g_queue_new ();
+	priv->context = g_main_context_ref_thread_default ();
+	priv->liveness_id = attach_source (self, g_timeout_source_new_seconds (LIVENESS_INTERVAL), liveness_cb);
+	g_mutex_init (&priv->lock);
+	priv->events = g_queue_new ();
 
-	priv->poll = avahi_glib_poll_new (NULL, G_PRIORITY_DEFAULT);
-	priv->client = avahi_client_new (avahi_glib_poll_get (priv->poll),
-					 AVAHI_CLIENT_NO_FAIL,
-					 on_client_state_changed,
-					 self,
-					 &error);
+	/* DLNA */
+	priv->dlna_pending = g_hash_table_new_full (g_str_hash, g_str_equal,
+						    g_free, g_object_unref);
+	priv->dlna_context = remote_display_dlna_context_new ();
 }
 
 RemoteDisplayManager *
@@ -223,3 +2408,465 @@ remote_display_manager_new (void)
 {
 	return g_object_new (REMOTE_DISPLAY_TYPE_MANAGER, NULL);
 }
+
+/**
+ * remote_display_manager_set_favourites:
+ * @manager: a #RemoteDisplayManager
+ * @names: (allow-none): a %NULL-terminated array of device names
+ *
+ * Sets the names of the devices to resolve first when a lot of
+ * devices appear at once. Otherwise, the devices seen most
+ * recently in previous runs are resolved first.
+ **/
+void
+remote_display_manager_set_favourites (RemoteDisplayManager *manager,
+				       const char * const   *names)
+{
+	RemoteDisplayManagerPrivate *priv;
+
+	g_return_if_fail (IS_REMOTE_DISPLAY_MANAGER (manager));
+
+	priv = manager->priv;
+	g_mutex_lock (&priv->lock);
+	g_strfreev (priv->favourites);
+	priv->favourites = g_strdupv ((char **) names);
+	g_mutex_unlock (&priv->lock);
+
+	g_main_context_invoke (priv->discovery_context, sort_resolves_cb, manager);
+}
+
+/**
+ * remote_display_manager_set_filter:
+ * @manager: a #RemoteDisplayManager
+ * @caps: a mask of #RemoteDisplayDeviceCapabilities
+ * @name_pattern: (allow-none): a glob-style pattern for the device names
+ *
+ * Only devices with all the capabilities in @caps, and with names
+ * matching @name_pattern, will appear. The filter is checked as soon
+ * as possible, so that devices that won't appear aren't resolved or
+ * created, which is best done right after creating the manager.
+ * Devices that already appeared aren't affected.
+ **/
+void
+remote_display_manager_set_filter (RemoteDisplayManager            *manager,
+				   RemoteDisplayDeviceCapabilities  caps,
+				   const char                      *name_pattern)
+{
+	RemoteDisplayManagerPrivate *priv;
+
+	g_return_if_fail (IS_REMOTE_DISPLAY_MANAGER (manager));
+
+	priv = manager->priv;
+	g_mutex_lock (&priv->lock);
+	priv->filter_caps = caps;
+	g_clear_pointer (&priv->filter_name, g_pattern_spec_free);
+	if (name_pattern)
+		priv->filter_name = g_pattern_spec_new (name_pattern);
+	g_mutex_unlock (&priv->lock);
+}
+
+/**
+ * remote_display_manager_get_filter_stats:
+ * @manager: a #RemoteDisplayManager
+ * @resolves_skipped: (out) (allow-none): the number of services not resolved
+ * @devices_skipped: (out) (allow-none): the number of receivers not added
+ *
+ * Tells how much work the filter set with
+ * remote_display_manager_set_filter() avoided. Receivers are only
+ * counted once, whichever of their services were turned away.
+ **/
+void
+remote_display_manager_get_filter_stats (RemoteDisplayManager *manager,
+					 guint                *resolves_skipped,
+					 guint                *devices_skipped)
+{
+	g_return_if_fail (IS_REMOTE_DISPLAY_MANAGER (manager));
+
+	if (resolves_skipped)
+		*resolves_skipped = g_atomic_int_get (&manager->priv->resolves_skipped);
+	if (devices_skipped)
+		*devices_skipped = get_skipped_devices (manager);
+}
+
+static GPtrArray *
+copy_devices (GPtrArray *devices)
+{
+	GPtrArray *ret;
+	guint i;
+
+	ret = g_ptr_array_new_full (devices ? devices->len : 0, g_object_unref);
+	for (i = 0; devices && i < devices->len; i++)
+		g_ptr_array_add (ret, g_object_ref (g_ptr_array_index (devices, i)));
+
+	return ret;
+}
+
+/**
+ * remote_display_manager_get_devices:
+ * @manager: a #RemoteDisplayManager
+ *
+ * Return value: (transfer full) (element-type RemoteDisplayDevice): the
+ * devices currently available, in the order they appeared.
+ **/
+GPtrArray *
+remote_display_manager_get_devices (RemoteDisplayManager *manager)
+{
+	g_return_val_if_fail (IS_REMOTE_DISPLAY_MANAGER (manager), NULL);
+
+	return copy_devices (manager->priv->visible);
+}
+
+/**
+ * remote_display_manager_lookup_by_id:
+ * @manager: a #RemoteDisplayManager
+ * @id: a device ID
+ *
+ * Return value: (transfer none): the available device with the
+ * ID @id, or %NULL.
+ **/
+RemoteDisplayDevice *
+remote_display_manager_lookup_by_id (RemoteDisplayManager *manager,
+				     const char           *id)
+{
+	g_return_val_if_fail (IS_REMOTE_DISPLAY_MANAGER (manager), NULL);
+	g_return_val_if_fail (id != NULL, NULL);
+
+	return g_hash_table_lookup (manager->priv->by_id, id);
+}
+
+/**
+ * remote_display_manager_lookup_by_name:
+ * @manager: a #RemoteDisplayManager
+ * @name: a user-visible device name
+ *
+ * Names aren't unique, so there can be more than one device.
+ *
+ * Return value: (transfer full) (element-type RemoteDisplayDevice): the
+ * available devices called @name.
+ **/
+GPtrArray *
+remote_display_manager_lookup_by_name (RemoteDisplayManager *manager,
+				       const char           *name)
+{
+	g_return_val_if_fail (IS_REMOTE_DISPLAY_MANAGER (manager), NULL);
+	g_return_val_if_fail (name != NULL, NULL);
+
+	return copy_devices (g_hash_table_lookup (manager->priv->by_name, name));
+}
+
+/**
+ * remote_display_manager_lookup_by_capabilities:
+ * @manager: a #RemoteDisplayManager
+ * @caps: a mask of #RemoteDisplayDeviceCapabilities
+ *
+ * Return value: (transfer full) (element-type RemoteDisplayDevice): the
+ * available devices with all the capabilities in @caps.
+ **/
+GPtrArray *
+remote_display_manager_lookup_by_capabilities (RemoteDisplayManager            *manager,
+					       RemoteDisplayDeviceCapabilities  caps)
+{
+	RemoteDisplayManagerPrivate *priv;
+	GPtrArray *smallest = NULL;
+	GPtrArray *ret;
+	guint i;
+
+	g_return_val_if_fail (IS_REMOTE_DISPLAY_MANAGER (manager), NULL);
+
+	priv = manager->priv;
+	if (caps == REMOTE_DISPLAY_DEVICE_CAPABILITIES_NONE)
+		return copy_devices (priv->visible);
+
+	/* Only go through the devices with the rarest capability */
+	for (i = 0; i < priv->n_capabilities; i++) {
+		if ((caps & (1 << i)) &&
+		    (!smallest || priv->by_capability[i]->len < smallest->len))
+			smallest = priv->by_capability[i];
+	}
+
+	ret = g_ptr_array_new_with_free_func (g_object_unref);
+	for (i = 0; smallest && i < smallest->len; i++) {
+		RemoteDisplayDevice *device = g_ptr_array_index (smallest, i);
+
+		if ((remote_display_device_get_capabilities (device) & caps) == caps)
+			g_ptr_array_add (ret, g_object_ref (device));
+	}
+
+	return ret;
+}
+
+/**
+ * remote_display_manager_get_stamp:
+ * @manager: a #RemoteDisplayManager
+ *
+ * Returns a number that changes every time a device appears or
+ * disappears, so that views can check whether they are out of
+ * date without fetching the devices.
+ *
+ * Return value: the current change stamp.
+ **/
+guint64
+remote_display_manager_get_stamp (RemoteDisplayManager *manager)
+{
+	g_return_val_if_fail (IS_REMOTE_DISPLAY_MANAGER (manager), 0);
+
+	return manager->priv->stamp;
+}
+
+/**
+ * remote_display_manager_get_metrics:
+ * @manager: a #RemoteDisplayManager
+ *
+ * Gets counters and gauges about discovery, the devices and the
+ * files served to them, for monitoring. The dictionary has:
+ * - "devices" (u): the available devices
+ * - "devices-known" (u): including the ones not available
+ * - "resolves-in-flight" (u): mDNS services being resolved
+ * - "descriptions-in-flight" (u): DLNA descriptions being fetched
+ * - "resolves-skipped" (u), "devices-skipped" (u): see
+ *   remote_display_manager_get_filter_stats()
+ * - "pending-actions" (u): commands queued or sent to the known devices
+ * - "command-failures" (t): commands the devices refused or couldn't
+ *   be sent, since the start, including the devices that went away
+ * - "host-requests" (t), "host-bytes-served" (t): since the start
+ * - "host-active-requests" (u): file requests being answered
+ * - "host-mapped-bytes" (t): the size of the files mapped to be served
+ * - "per-device" (a(ssuu)): the ID, name, pending actions and
+ *   command failures of each known device
+ *
+ * Return value: (transfer full): a dictionary of type a{sv}, free
+ * with g_variant_unref()
+ **/
+GVariant *
+remote_display_manager_get_metrics (RemoteDisplayManager *manager)
+{
+	RemoteDisplayManagerPrivate *priv;
+	RemoteDisplayHostStats host_stats;
+	GVariantBuilder builder, devices;
+	GHashTableIter iter;
+	gpointer value;
+	guint64 failures;
+	guint pending = 0;
+
+	g_return_val_if_fail (IS_REMOTE_DISPLAY_MANAGER (manager), NULL);
+
+	priv = manager->priv;
+	failures = priv->gone_failures;
+
+	g_variant_builder_init (&devices, G_VARIANT_TYPE ("a(ssuu)"));
+	g_hash_table_iter_init (&iter, priv->known_devices);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		RemoteDisplayDevice *device = value;
+		guint device_pending, device_failures;
+		char *id;
+
+		device_pending = remote_display_device_get_pending_actions (device);
+		device_failures = remote_display_device_get_command_failures (device);
+		pending += device_pending;
+		failures += device_failures;
+
+		g_object_get (G_OBJECT (device), "id", &id, NULL);
+		g_variant_builder_add (&devices, "(ssuu)",
+				       id ? id : "",
+				       remote_display_device_get_name (device) ? remote_display_device_get_name (device) : "",
+				       device_pending, device_failures);
+		g_free (id);
+	}
+
+	remote_display_host_get_totals (&host_stats);
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+	g_variant_builder_add (&builder, "{sv}", "devices",
+			       g_variant_new_uint32 (priv->visible->len));
+	g_variant_builder_add (&builder, "{sv}", "devices-known",
+			       g_variant_new_uint32 (g_hash_table_size (priv->known_devices)));
+	g_variant_builder_add (&builder, "{sv}", "resolves-in-flight",
+			       g_variant_new_uint32 (g_atomic_int_get (&priv->n_resolves)));
+	g_variant_builder_add (&builder, "{sv}", "descriptions-in-flight",
+			       g_variant_new_uint32 (g_hash_table_size (priv->dlna_pending)));
+	g_variant_builder_add (&builder, "{sv}", "resolves-skipped",
+			       g_variant_new_uint32 (g_atomic_int_get (&priv->resolves_skipped)));
+	g_variant_builder_add (&builder, "{sv}", "devices-skipped",
+			       g_variant_new_uint32 (get_skipped_devices (manager)));
+	g_variant_builder_add (&builder, "{sv}", "pending-actions",
+			       g_variant_new_uint32 (pending));
+	g_variant_builder_add (&builder, "{sv}", "command-failures",
+			       g_variant_new_uint64 (failures));
+	g_variant_builder_add (&builder, "{sv}", "host-requests",
+			       g_variant_new_uint64 (host_stats.requests));
+	g_variant_builder_add (&builder, "{sv}", "host-bytes-served",
+			       g_variant_new_uint64 (host_stats.bytes_served));
+	g_variant_builder_add (&builder, "{sv}", "host-active-requests",
+			       g_variant_new_uint32 (host_stats.active_requests));
+	g_variant_builder_add (&builder, "{sv}", "host-mapped-bytes",
+			       g_variant_new_uint64 (host_stats.mapped_bytes));
+	g_variant_builder_add (&builder, "{sv}", "per-device",
+			       g_variant_builder_end (&devices));
+
+	return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+typedef struct {
+	const char *key;
+	const char *name;
+	const char *type;
+	const char *help;
+} MetricInfo;
+
+static const MetricInfo metrics_info[] = {
+	{ "devices", "remote_display_devices", "gauge", "Receivers available" },
+	{ "devices-known", "remote_display_devices_known", "gauge", "Receivers known, available or not" },
+	{ "resolves-in-flight", "remote_display_resolves_in_flight", "gauge", "mDNS services being resolved" },
+	{ "descriptions-in-flight", "remote_display_descriptions_in_flight", "gauge", "DLNA descriptions being fetched" },
+	{ "resolves-skipped", "remote_display_resolves_skipped_total", "counter", "Services not resolved because of the filter" },
+	{ "devices-skipped", "remote_display_devices_skipped_total", "counter", "Receivers not added because of the filter" },
+	{ "pending-actions", "remote_display_pending_actions", "gauge", "Commands queued or sent" },
+	{ "command-failures", "remote_display_command_failures_total", "counter", "Commands refused or not sent" },
+	{ "host-requests", "remote_display_host_requests_total", "counter", "Requests to the file servers" },
+	{ "host-bytes-served", "remote_display_host_bytes_served_total", "counter", "Bytes of files sent to receivers" },
+	{ "host-active-requests", "remote_display_host_active_requests", "gauge", "Requests to the file servers being answered" },
+	{ "host-mapped-bytes", "remote_display_host_mapped_bytes", "gauge", "Size of the files mapped to be served" },
+};
+
+static void
+append_label_value (GString    *str,
+		    const char *value)
+{
+	for (; *value != '\0'; value++) {
+		if (*value == '\\' || *value == '"')
+			g_string_append_c (str, '\\');
+		if (*value == '\n')
+			g_string_append (str, "\\n");
+		else
+			g_string_append_c (str, *value);
+	}
+}
+
+/* The Prometheus text exposition format */
+static char *
+metrics_to_text (GVariant *metrics)
+{
+	GVariant *devices;
+	GString *str;
+	guint i;
+
+	str = g_string_new (NULL);
+	for (i = 0; i < G_N_ELEMENTS (metrics_info); i++) {
+		GVariant *value;
+		guint64 number;
+
+		value = g_variant_lookup_value (metrics, metrics_info[i].key, NULL);
+		if (!value)
+			continue;
+		if (g_variant_is_of_type (value, G_VARIANT_TYPE_UINT32))
+			number = g_variant_get_uint32 (value);
+		else
+			number = g_variant_get_uint64 (value);
+		g_variant_unref (value);
+
+		g_string_append_printf (str, "# HELP %s %s\n# TYPE %s %s\n%s %" G_GUINT64_FORMAT "\n",
+					metrics_info[i].name, metrics_info[i].help,
+					metrics_info[i].name, metrics_info[i].type,
+					metrics_info[i].name, number);
+	}
+
+	devices = g_variant_lookup_value (metrics, "per-device", G_VARIANT_TYPE ("a(ssuu)"));
+	if (devices) {
+		GVariantIter iter;
+		const char *id, *name;
+		guint pending, failures;
+		guint n;
+
+		for (n = 0; n < 2; n++) {
+			if (n == 0)
+				g_string_append (str, "# HELP remote_display_device_pending_actions Commands queued or sent\n"
+						 "# TYPE remote_display_device_pending_actions gauge\n");
+			else
+				g_string_append (str, "# HELP remote_display_device_command_failures_total Commands refused or not sent\n"
+						 "# TYPE remote_display_device_command_failures_total counter\n");
+
+			g_variant_iter_init (&iter, devices);
+			while (g_variant_iter_next (&iter, "(&s&suu)", &id, &name, &pending, &failures)) {
+				g_string_append (str, n == 0 ?
+						 "remote_display_device_pending_actions{id=\"" :
+						 "remote_display_device_command_failures_total{id=\"");
+				append_label_value (str, id);
+				g_string_append (str, "\",name=\"");
+				append_label_value (str, name);
+				g_string_append_printf (str, "\"} %u\n", n == 0 ? pending : failures);
+			}
+		}
+		g_variant_unref (devices);
+	}
+
+	return g_string_free (str, FALSE);
+}
+
+static void
+metrics_server_cb (SoupServer        *server,
+		   SoupMessage       *msg,
+		   const char        *path,
+		   GHashTable        *query,
+		   SoupClientContext *client,
+		   gpointer           user_data)
+{
+	RemoteDisplayManager *manager = user_data;
+	GVariant *metrics;
+	char *text;
+
+	if (msg->method != SOUP_METHOD_GET) {
+		soup_message_set_status (msg, SOUP_STATUS_NOT_IMPLEMENTED);
+		return;
+	}
+
+	metrics = remote_display_manager_get_metrics (manager);
+	text = metrics_to_text (metrics);
+	g_variant_unref (metrics);
+
+	soup_message_set_response (msg, "text/plain; version=0.0.4",
+				   SOUP_MEMORY_TAKE, text, strlen (text));
+	soup_message_set_status (msg, SOUP_STATUS_OK);
+}
+
+/**
+ * remote_display_manager_serve_metrics:
+ * @manager: a #RemoteDisplayManager
+ * @port: the port to listen on, or 0 for any free one
+ * @error: a #GError
+ *
+ * Serves the metrics from remote_display_manager_get_metrics() in
+ * the Prometheus text format, on the loopback interface, for a local
+ * collector to scrape. The requests are answered in the thread-default
+ * main context of the caller, which needs to be the manager's.
+ *
+ * Return value: the URI of the metrics, or %NULL on error.
+ **/
+char *
+remote_display_manager_serve_metrics (RemoteDisplayManager  *manager,
+				      guint16                port,
+				      GError               **error)
+{
+	RemoteDisplayManagerPrivate *priv;
+	GSList *uris;
+	char *ret;
+
+	g_return_val_if_fail (IS_REMOTE_DISPLAY_MANAGER (manager), NULL);
+	g_return_val_if_fail (manager->priv->metrics_server == NULL, NULL);
+
+	priv = manager->priv;
+
+	priv->metrics_server = soup_server_new (NULL, NULL);
+	soup_server_add_handler (priv->metrics_server, "/metrics",
+				 metrics_server_cb, manager, NULL);
+	if (!soup_server_listen_local (priv->metrics_server, port,
+				       SOUP_SERVER_LISTEN_IPV4_ONLY, error)) {
+		g_clear_object (&priv->metrics_server);
+		return NULL;
+	}
+
+	uris = soup_server_get_uris (priv->metrics_server);
+	ret = g_strdup_printf ("http://127.0.0.1:%d/metrics", soup_uri_get_port (uris->data));
+	g_slist_free_full (uris, (GDestroyNotify) soup_uri_free);
+
+	return ret;
+}
@@ -21,6 +21,7 @@
 
 #include <glib-object.h>
 #include <gio/gio.h>
+#include <libremote-display/remote-display-device.h>
 
 G_BEGIN_DECLS
 
@@ -60,7 +61,27 @@ struct _RemoteDisplayManagerClass {
 
 GType remote_display_manager_get_type (void) G_GNUC_CONST;
 
-RemoteDisplayManager *remote_display_manager_new (void);
+RemoteDisplayManager *remote_display_manager_new             (void);
+void                  remote_display_manager_set_favourites (RemoteDisplayManager *manager,
+							     const char * const   *names);
+void                  remote_display_manager_set_filter     (RemoteDisplayManager            *manager,
+							     RemoteDisplayDeviceCapabilities  caps,
+							     const char                      *name_pattern);
+void                  remote_display_manager_get_filter_stats (RemoteDisplayManager *manager,
+							       guint                *resolves_skipped,
+							       guint                *devices_skipped);
+GPtrArray            *remote_display_manager_get_devices    (RemoteDisplayManager *manager);
+RemoteDisplayDevice  *remote_display_manager_lookup_by_id   (RemoteDisplayManager *manager,
+							     const char           *id);
+GPtrArray            *remote_display_manager_lookup_by_name (RemoteDisplayManager *manager,
+							     const char           *name);
+GPtrArray            *remote_display_manager_lookup_by_capabilities (RemoteDisplayManager            *manager,
+								     RemoteDisplayDeviceCapabilities  caps);
+guint64               remote_display_manager_get_stamp      (RemoteDisplayManager *manager);
+GVariant             *remote_display_manager_get_metrics    (RemoteDisplayManager *manager);
+char                 *remote_display_manager_serve_metrics  (RemoteDisplayManager  *manager,
+							     guint16                port,
+							     GError               **error);
 
 G_END_DECLS
 
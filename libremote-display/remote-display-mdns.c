@@ -0,0 +1,1185 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include <string.h>
+
+#include <gio/gio.h>
+
+#include <libremote-display/remote-display-mdns.h>
+#include <libremote-display/remote-display-netif.h>
+
+#define MDNS_ADDRESS       "224.0.0.251"
+#define MDNS_PORT          5353
+#define MDNS_DOMAIN        "local"
+#define QUERY_INTERVAL_MIN 1                   /* seconds, doubles up to max */
+#define QUERY_INTERVAL_MAX 3600                /* seconds */
+#define ALL_FOR_NOW_DELAY  1500                /* milliseconds */
+#define RESOLVE_INTERVAL   1                   /* seconds */
+#define RESOLVE_ATTEMPTS   3
+#define EXPIRY_INTERVAL    1                   /* seconds */
+#define MAX_PACKET_SIZE    9000
+#define MAX_QUERY_SIZE     1472                /* An Ethernet MTU, without the IP and UDP headers */
+#define MAX_POINTERS       16                  /* Name compression loops */
+
+#define TYPE_A             1
+#define TYPE_PTR           12
+#define TYPE_TXT           16
+#define TYPE_SRV           33
+#define CLASS_IN           1
+#define CLASS_MASK         0x7fff              /* Without the cache flush bit */
+#define FLAGS_RESPONSE     0x8000
+#define FLAGS_TRUNCATED    0x0200              /* More known answers follow */
+
+typedef struct {
+	char *name;                            /* Instance label */
+	guint ifindex;                         /* Where the replies came from */
+	guint32 ttl;                           /* Of the PTR record */
+	gint64 received;
+	gint64 expires;
+	gboolean refreshing;
+
+	char *host_name;                       /* From the SRV record */
+	guint16 port;
+	char **txt;
+	gboolean has_srv;
+	gboolean has_txt;
+	guint resolve_stage;
+	guint resolve_attempts;
+
+	gboolean announced;
+	gboolean changed;
+} MdnsService;
+
+typedef struct {
+	GInetAddress *address;
+	gint64 expires;
+} MdnsHost;
+
+typedef struct {
+	guint16 type;
+	guint32 ttl;
+	GPtrArray *owner;                      /* Labels */
+	gsize rdata;                           /* Offset in the packet */
+	guint16 rdlength;
+} MdnsRecord;
+
+struct _RemoteDisplayMdns {
+	GObject parent_instance;
+
+	char *service_type;                    /* "_airplay._tcp" */
+	char *type_domain;                     /* "_airplay._tcp.local" */
+	GInetSocketAddress *target;            /* Where queries are sent */
+	GMainContext *context;
+	RemoteDisplayNetif *netif;
+
+	GSocket *socket;
+	GSource *socket_source;
+
+	GHashTable *services;                  /* key = lowercase instance label, value = MdnsService */
+	GHashTable *hosts;                     /* key = lowercase host name, value = MdnsHost */
+
+	guint query_interval;
+	GSource *query_source;
+	GSource *resolve_source;
+	GSource *expiry_source;
+	GSource *all_for_now_source;
+};
+
+G_DEFINE_TYPE (RemoteDisplayMdns, remote_display_mdns, G_TYPE_OBJECT);
+
+enum {
+	FOUND,
+	REMOVED,
+	ALL_FOR_NOW,
+	NUM_SIGS
+};
+
+static guint signals[NUM_SIGS] = {0,};
+
+static void
+service_free (MdnsService *service)
+{
+	g_free (service->name);
+	g_free (service->host_name);
+	g_strfreev (service->txt);
+	g_free (service);
+}
+
+static void
+host_free (MdnsHost *host)
+{
+	g_object_unref (host->address);
+	g_free (host);
+}
+
+static void
+record_free (MdnsRecord *record)
+{
+	g_ptr_array_unref (record->owner);
+	g_free (record);
+}
+
+static GSource *
+add_timeout (RemoteDisplayMdns *mdns,
+	     guint              interval,
+	     GSourceFunc        func)
+{
+	GSource *source;
+
+	source = g_timeout_source_new (interval);
+	g_source_set_callback (source, func, mdns, NULL);
+	g_source_attach (source, mdns->context);
+
+	return source;
+}
+
+static void
+clear_source (GSource **source)
+{
+	if (*source == NULL)
+		return;
+	g_source_destroy (*source);
+	g_clear_pointer (source, g_source_unref);
+}
+
+/* Packets */
+
+static guint16
+read_uint16 (const guint8 *data)
+{
+	return (data[0] << 8) | data[1];
+}
+
+static guint32
+read_uint32 (const guint8 *data)
+{
+	return ((guint32) data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+/* Reads a possibly compressed name, as a list of labels */
+static GPtrArray *
+read_name (const guint8 *data,
+	   gsize         len,
+	   gsize        *offset)
+{
+	GPtrArray *labels;
+	gsize pos = *offset;
+	guint pointers = 0;
+
+	labels = g_ptr_array_new_with_free_func (g_free);
+	while (pos < len) {
+		guint8 label_len = data[pos];
+
+		if (label_len == 0) {
+			if (pointers == 0)
+				*offset = pos + 1;
+			return labels;
+		}
+
+		if ((label_len & 0xc0) == 0xc0) {
+			if (pos + 1 >= len || ++pointers > MAX_POINTERS)
+				break;
+			if (pointers == 1)
+				*offset = pos + 2;
+			pos = ((label_len & 0x3f) << 8) | data[pos + 1];
+			continue;
+		}
+
+		if ((label_len & 0xc0) != 0 || pos + 1 + label_len > len)
+			break;
+		g_ptr_array_add (labels, g_strndup ((const char *) data + pos + 1, label_len));
+		pos += 1 + label_len;
+	}
+
+	g_ptr_array_unref (labels);
+	return NULL;
+}
+
+static char *
+join_labels (GPtrArray *labels,
+	     guint      first)
+{
+	GString *str;
+	guint i;
+
+	str = g_string_new (NULL);
+	for (i = first; i < labels->len; i++) {
+		if (i > first)
+			g_string_append_c (str, '.');
+		g_string_append (str, g_ptr_array_index (labels, i));
+	}
+
+	return g_string_free (str, FALSE);
+}
+
+static gboolean
+labels_equal (GPtrArray  *labels,
+	      guint       first,
+	      const char *name)
+{
+	char *joined;
+	gboolean ret;
+
+	joined = join_labels (labels, first);
+	ret = g_ascii_strcasecmp (joined, name) == 0;
+	g_free (joined);
+
+	return ret;
+}
+
+static void
+write_uint16 (GByteArray *packet,
+	      guint16     value)
+{
+	guint8 data[2] = { value >> 8, value & 0xff };
+
+	g_byte_array_append (packet, data, sizeof(data));
+}
+
+static void
+write_uint32 (GByteArray *packet,
+	      guint32     value)
+{
+	write_uint16 (packet, value >> 16);
+	write_uint16 (packet, value & 0xffff);
+}
+
+static void
+write_label (GByteArray *packet,
+	     const char *label)
+{
+	guint8 len;
+
+	len = MIN (strlen (label), 63);
+	g_byte_array_append (packet, &len, 1);
+	g_byte_array_append (packet, (const guint8 *) label, len);
+}
+
+/* The instance label can contain dots, the rest of the name can't */
+static void
+write_name (GByteArray *packet,
+	    const char *instance,
+	    const char *name)
+{
+	char **labels;
+	guint i;
+
+	if (instance)
+		write_label (packet, instance);
+	labels = g_strsplit (name, ".", -1);
+	for (i = 0; labels[i] != NULL; i++)
+		write_label (packet, labels[i]);
+	g_strfreev (labels);
+	g_byte_array_append (packet, (const guint8 *) "", 1);
+}
+
+static GByteArray *
+new_packet (void)
+{
+	GByteArray *packet;
+
+	/* All counts are filled in by the callers */
+	packet = g_byte_array_new ();
+	g_byte_array_set_size (packet, 12);
+	memset (packet->data, 0, 12);
+
+	return packet;
+}
+
+static void
+set_count (GByteArray *packet,
+	   guint       offset,
+	   guint16     count)
+{
+	packet->data[offset] = count >> 8;
+	packet->data[offset + 1] = count & 0xff;
+}
+
+static void
+send_packet (RemoteDisplayMdns *mdns,
+	     GByteArray        *packet)
+{
+	GSocketAddress *target;
+	GError *error = NULL;
+
+	if (mdns->target) {
+		target = g_object_ref (G_SOCKET_ADDRESS (mdns->target));
+	} else {
+		GInetAddress *group;
+
+		group = g_inet_address_new_from_string (MDNS_ADDRESS);
+		target = g_inet_socket_address_new (group, MDNS_PORT);
+		g_object_unref (group);
+	}
+
+	if (g_socket_send_to (mdns->socket, target, (const char *) packet->data, packet->len, NULL, &error) < 0) {
+		g_debug ("Failed to send mDNS query: %s", error->message);
+		g_error_free (error);
+	}
+	g_object_unref (target);
+}
+
+/* Services */
+
+static void
+emit_found (RemoteDisplayMdns *mdns,
+	    MdnsService       *service,
+	    MdnsHost          *host)
+{
+	char *empty[] = { NULL };
+
+	g_debug ("mDNS found '%s' at %s:%d", service->name, service->host_name, service->port);
+	g_signal_emit (mdns, signals[FOUND], 0,
+		       service->name, service->ifindex, service->host_name, host->address,
+		       (guint) service->port, service->txt ? service->txt : empty);
+}
+
+static gboolean
+check_service (RemoteDisplayMdns *mdns,
+	       MdnsService       *service)
+{
+	MdnsHost *host = NULL;
+	char *host_key;
+
+	if (!service->has_srv || !service->has_txt)
+		return FALSE;
+	host_key = g_ascii_strdown (service->host_name, -1);
+	host = g_hash_table_lookup (mdns->hosts, host_key);
+	g_free (host_key);
+	if (!host)
+		return FALSE;
+
+	if (service->announced && service->changed) {
+		/* Moved, to another address or port */
+		g_signal_emit (mdns, signals[REMOVED], 0, service->name, service->ifindex);
+		service->announced = FALSE;
+	}
+	service->changed = FALSE;
+	if (!service->announced) {
+		service->announced = TRUE;
+		emit_found (mdns, service, host);
+	}
+
+	return TRUE;
+}
+
+static void
+remove_service (RemoteDisplayMdns *mdns,
+		const char        *key)
+{
+	MdnsService *service;
+
+	service = g_hash_table_lookup (mdns->services, key);
+	if (!service)
+		return;
+
+	g_debug ("mDNS lost '%s'", service->name);
+	if (service->announced)
+		g_signal_emit (mdns, signals[REMOVED], 0, service->name, service->ifindex);
+	g_hash_table_remove (mdns->services, key);
+}
+
+/* What to ask for next, the SRV and TXT records, then the address */
+static guint
+get_resolve_stage (MdnsService *service)
+{
+	return (!service->has_srv || !service->has_txt) ? 1 : 2;
+}
+
+static void
+send_resolve (RemoteDisplayMdns *mdns,
+	      MdnsService       *service)
+{
+	GByteArray *packet;
+	guint16 n_questions = 0;
+
+	service->resolve_stage = get_resolve_stage (service);
+	packet = new_packet ();
+	if (service->resolve_stage == 1) {
+		write_name (packet, service->name, mdns->type_domain);
+		write_uint16 (packet, TYPE_SRV);
+		write_uint16 (packet, CLASS_IN);
+		/* Compressed, pointing at the first question */
+		write_uint16 (packet, 0xc00c);
+		write_uint16 (packet, TYPE_TXT);
+		write_uint16 (packet, CLASS_IN);
+		n_questions += 2;
+	} else {
+		write_name (packet, NULL, service->host_name);
+		write_uint16 (packet, TYPE_A);
+		write_uint16 (packet, CLASS_IN);
+		n_questions++;
+	}
+	set_count (packet, 4, n_questions);
+
+	send_packet (mdns, packet);
+	g_byte_array_unref (packet);
+}
+
+/* Asks for the missing records of services that only
+ * came with their PTR record, which is what replies to
+ * busy networks' queries tend to look like */
+static gboolean
+resolve_cb (gpointer user_data)
+{
+	RemoteDisplayMdns *mdns = user_data;
+	GHashTableIter iter;
+	gpointer value;
+	gboolean pending = FALSE;
+
+	g_hash_table_iter_init (&iter, mdns->services);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		MdnsService *service = value;
+
+		if (service->announced && !service->changed)
+			continue;
+		if (service->resolve_attempts >= RESOLVE_ATTEMPTS)
+			continue;
+		service->resolve_attempts++;
+		send_resolve (mdns, service);
+		pending = TRUE;
+	}
+
+	if (!pending) {
+		g_clear_pointer (&mdns->resolve_source, g_source_unref);
+		return G_SOURCE_REMOVE;
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+static MdnsService *
+handle_ptr (RemoteDisplayMdns *mdns,
+	    const guint8      *data,
+	    gsize              len,
+	    MdnsRecord        *record,
+	    guint              ifindex)
+{
+	MdnsService *service;
+	GPtrArray *labels;
+	gsize offset = record->rdata;
+	char *key;
+
+	if (!labels_equal (record->owner, 0, mdns->type_domain))
+		return NULL;
+	labels = read_name (data, len, &offset);
+	if (!labels)
+		return NULL;
+	if (labels->len < 2 || !labels_equal (labels, 1, mdns->type_domain)) {
+		g_ptr_array_unref (labels);
+		return NULL;
+	}
+
+	key = g_ascii_strdown (g_ptr_array_index (labels, 0), -1);
+	if (record->ttl == 0) {
+		/* Goodbye */
+		remove_service (mdns, key);
+		g_free (key);
+		g_ptr_array_unref (labels);
+		return NULL;
+	}
+
+	service = g_hash_table_lookup (mdns->services, key);
+	if (!service) {
+		service = g_new0 (MdnsService, 1);
+		service->name = g_strdup (g_ptr_array_index (labels, 0));
+		g_hash_table_insert (mdns->services, key, service);
+	} else {
+		g_free (key);
+	}
+	if (service->announced && service->ifindex != ifindex) {
+		g_signal_emit (mdns, signals[REMOVED], 0, service->name, service->ifindex);
+		service->announced = FALSE;
+	}
+	service->ifindex = ifindex;
+	service->ttl = record->ttl;
+	service->received = g_get_monotonic_time ();
+	service->expires = service->received + (gint64) record->ttl * G_USEC_PER_SEC;
+	service->refreshing = FALSE;
+	g_ptr_array_unref (labels);
+
+	return service;
+}
+
+static MdnsService *
+lookup_service (RemoteDisplayMdns *mdns,
+		MdnsRecord        *record)
+{
+	MdnsService *service;
+	char *key;
+
+	if (record->owner->len < 2 || !labels_equal (record->owner, 1, mdns->type_domain))
+		return NULL;
+	key = g_ascii_strdown (g_ptr_array_index (record->owner, 0), -1);
+	service = g_hash_table_lookup (mdns->services, key);
+	g_free (key);
+
+	return service;
+}
+
+static MdnsService *
+handle_srv (RemoteDisplayMdns *mdns,
+	    const guint8      *data,
+	    gsize              len,
+	    MdnsRecord        *record)
+{
+	MdnsService *service;
+	GPtrArray *labels;
+	gsize offset = record->rdata + 6;
+	guint16 port;
+	char *host_name;
+
+	service = lookup_service (mdns, record);
+	if (!service || record->rdlength < 7)
+		return NULL;
+
+	port = read_uint16 (data + record->rdata + 4);
+	labels = read_name (data, len, &offset);
+	if (!labels)
+		return NULL;
+	host_name = join_labels (labels, 0);
+	g_ptr_array_unref (labels);
+
+	if (service->has_srv &&
+	    (service->port != port || g_ascii_strcasecmp (service->host_name, host_name) != 0))
+		service->changed = TRUE;
+	g_free (service->host_name);
+	service->host_name = host_name;
+	service->port = port;
+	service->has_srv = TRUE;
+
+	return service;
+}
+
+static gboolean
+strv_equal (char       **a,
+	    const char **b)
+{
+	guint i;
+
+	if (!a)
+		return b[0] == NULL;
+	for (i = 0; a[i] != NULL && b[i] != NULL; i++) {
+		if (strcmp (a[i], b[i]) != 0)
+			return FALSE;
+	}
+
+	return a[i] == NULL && b[i] == NULL;
+}
+
+static MdnsService *
+handle_txt (RemoteDisplayMdns *mdns,
+	    const guint8      *data,
+	    MdnsRecord        *record)
+{
+	MdnsService *service;
+	GPtrArray *strings;
+	gsize pos, end;
+
+	service = lookup_service (mdns, record);
+	if (!service)
+		return NULL;
+
+	strings = g_ptr_array_new ();
+	pos = record->rdata;
+	end = record->rdata + record->rdlength;
+	while (pos < end) {
+		guint8 str_len = data[pos];
+
+		if (pos + 1 + str_len > end)
+			break;
+		if (str_len > 0)
+			g_ptr_array_add (strings, g_strndup ((const char *) data + pos + 1, str_len));
+		pos += 1 + str_len;
+	}
+	g_ptr_array_add (strings, NULL);
+
+	if (service->has_txt &&
+	    !strv_equal (service->txt, (const char **) strings->pdata))
+		service->changed = TRUE;
+	g_strfreev (service->txt);
+	service->txt = (char **) g_ptr_array_free (strings, FALSE);
+	service->has_txt = TRUE;
+
+	return service;
+}
+
+static void
+handle_a (RemoteDisplayMdns *mdns,
+	  const guint8      *data,
+	  MdnsRecord        *record)
+{
+	GHashTableIter iter;
+	gpointer value;
+	MdnsHost *host;
+	char *host_name, *key;
+
+	if (record->rdlength != 4)
+		return;
+
+	host_name = join_labels (record->owner, 0);
+	key = g_ascii_strdown (host_name, -1);
+	host = g_hash_table_lookup (mdns->hosts, key);
+	if (host && record->ttl == 0) {
+		g_hash_table_remove (mdns->hosts, key);
+		goto out;
+	}
+	if (record->ttl == 0)
+		goto out;
+
+	if (!host) {
+		host = g_new0 (MdnsHost, 1);
+		g_hash_table_insert (mdns->hosts, g_strdup (key), host);
+	} else {
+		GInetAddress *address;
+
+		address = g_inet_address_new_from_bytes (data + record->rdata, G_SOCKET_FAMILY_IPV4);
+		if (!g_inet_address_equal (address, host->address)) {
+			/* The services on that host have moved */
+			g_hash_table_iter_init (&iter, mdns->services);
+			while (g_hash_table_iter_next (&iter, NULL, &value)) {
+				MdnsService *service = value;
+
+				if (service->host_name &&
+				    g_ascii_strcasecmp (service->host_name, host_name) == 0)
+					service->changed = TRUE;
+			}
+		}
+		g_object_unref (address);
+		g_clear_object (&host->address);
+	}
+	host->address = g_inet_address_new_from_bytes (data + record->rdata, G_SOCKET_FAMILY_IPV4);
+	host->expires = g_get_monotonic_time () + (gint64) record->ttl * G_USEC_PER_SEC;
+
+out:
+	g_free (key);
+	g_free (host_name);
+}
+
+/* The interface on the same subnet as the sender, as
+ * the socket doesn't tell us which one the packet came in on */
+static guint
+get_ifindex (RemoteDisplayMdns *mdns,
+	     GSocketAddress    *sender)
+{
+	if (!G_IS_INET_SOCKET_ADDRESS (sender))
+		return 0;
+	return remote_display_netif_find_subnet (mdns->netif,
+						 g_inet_socket_address_get_address (G_INET_SOCKET_ADDRESS (sender)));
+}
+
+static void
+handle_packet (RemoteDisplayMdns *mdns,
+	       const guint8      *data,
+	       gsize              len,
+	       GSocketAddress    *sender)
+{
+	GPtrArray *records;
+	GHashTableIter iter;
+	gpointer value;
+	gsize offset = 12;
+	guint n_questions, n_records, i;
+	guint ifindex = 0;
+	gboolean have_ifindex = FALSE;
+	gboolean incomplete = FALSE;
+
+	/* Other queriers' questions, and our own looped back */
+	if (len < 12 || !(read_uint16 (data + 2) & FLAGS_RESPONSE))
+		return;
+
+	n_questions = read_uint16 (data + 4);
+	n_records = read_uint16 (data + 6) + read_uint16 (data + 8) + read_uint16 (data + 10);
+
+	for (i = 0; i < n_questions; i++) {
+		GPtrArray *name;
+
+		name = read_name (data, len, &offset);
+		if (!name || offset + 4 > len) {
+			g_clear_pointer (&name, g_ptr_array_unref);
+			return;
+		}
+		g_ptr_array_unref (name);
+		offset += 4;
+	}
+
+	records = g_ptr_array_new_with_free_func ((GDestroyNotify) record_free);
+	for (i = 0; i < n_records; i++) {
+		MdnsRecord *record;
+		GPtrArray *owner;
+		guint16 class;
+
+		owner = read_name (data, len, &offset);
+		if (!owner || offset + 10 > len) {
+			g_clear_pointer (&owner, g_ptr_array_unref);
+			break;
+		}
+		record = g_new0 (MdnsRecord, 1);
+		record->owner = owner;
+		record->type = read_uint16 (data + offset);
+		class = read_uint16 (data + offset + 2) & CLASS_MASK;
+		record->ttl = read_uint32 (data + offset + 4);
+		record->rdlength = read_uint16 (data + offset + 8);
+		record->rdata = offset + 10;
+		if (record->rdata + record->rdlength > len) {
+			record_free (record);
+			break;
+		}
+		offset = record->rdata + record->rdlength;
+
+		if (class != CLASS_IN) {
+			record_free (record);
+			continue;
+		}
+		g_ptr_array_add (records, record);
+	}
+
+	/* The PTR records tell us about new services, and
+	 * the other records can come in any order */
+	for (i = 0; i < records->len; i++) {
+		MdnsRecord *record = g_ptr_array_index (records, i);
+
+		if (record->type != TYPE_PTR)
+			continue;
+		if (!have_ifindex) {
+			ifindex = get_ifindex (mdns, sender);
+			have_ifindex = TRUE;
+		}
+		handle_ptr (mdns, data, len, record, ifindex);
+	}
+	for (i = 0; i < records->len; i++) {
+		MdnsRecord *record = g_ptr_array_index (records, i);
+
+		switch (record->type) {
+		case TYPE_SRV:
+			handle_srv (mdns, data, len, record);
+			break;
+		case TYPE_TXT:
+			handle_txt (mdns, data, record);
+			break;
+		case TYPE_A:
+			handle_a (mdns, data, record);
+			break;
+		default:
+			/* AAAA records aren't any use on our IPv4 socket */
+			break;
+		}
+	}
+	g_ptr_array_unref (records);
+
+	g_hash_table_iter_init (&iter, mdns->services);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		MdnsService *service = value;
+
+		if (check_service (mdns, service))
+			continue;
+		/* Ask for the rest as soon as some of it arrived */
+		if (get_resolve_stage (service) > service->resolve_stage) {
+			service->resolve_attempts = 1;
+			send_resolve (mdns, service);
+		}
+		if (service->resolve_attempts < RESOLVE_ATTEMPTS)
+			incomplete = TRUE;
+	}
+	if (incomplete && !mdns->resolve_source)
+		mdns->resolve_source = add_timeout (mdns, RESOLVE_INTERVAL * 1000, resolve_cb);
+}
+
+static gboolean
+socket_read_cb (GSocket      *socket,
+		GIOCondition  condition,
+		gpointer      user_data)
+{
+	RemoteDisplayMdns *mdns = user_data;
+	guint8 buffer[MAX_PACKET_SIZE];
+	GSocketAddress *sender = NULL;
+	GError *error = NULL;
+	gssize len;
+
+	len = g_socket_receive_from (socket, &sender, (char *) buffer, sizeof(buffer), NULL, &error);
+	if (len < 0) {
+		if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+			g_debug ("Failed to read mDNS packet: %s", error->message);
+		g_error_free (error);
+		return G_SOURCE_CONTINUE;
+	}
+
+	handle_packet (mdns, buffer, len, sender);
+	g_object_unref (sender);
+
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+expiry_cb (gpointer user_data)
+{
+	RemoteDisplayMdns *mdns = user_data;
+	GHashTableIter iter;
+	gpointer key, value;
+	gboolean refresh = FALSE;
+	gint64 now;
+
+	now = g_get_monotonic_time ();
+	g_hash_table_iter_init (&iter, mdns->services);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		MdnsService *service = value;
+
+		if (service->expires <= now) {
+			g_debug ("mDNS entry '%s' expired", service->name);
+			if (service->announced)
+				g_signal_emit (mdns, signals[REMOVED], 0, service->name, service->ifindex);
+			g_hash_table_iter_remove (&iter);
+			continue;
+		}
+
+		/* Ask again at 80% of the record's lifetime */
+		if (!service->refreshing &&
+		    now >= service->received + (gint64) service->ttl * G_USEC_PER_SEC * 4 / 5) {
+			service->refreshing = TRUE;
+			refresh = TRUE;
+		}
+	}
+
+	g_hash_table_iter_init (&iter, mdns->hosts);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		MdnsHost *host = value;
+
+		if (host->expires <= now)
+			g_hash_table_iter_remove (&iter);
+	}
+
+	if (refresh)
+		remote_display_mdns_query (mdns);
+
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+all_for_now_cb (gpointer user_data)
+{
+	RemoteDisplayMdns *mdns = user_data;
+
+	g_clear_pointer (&mdns->all_for_now_source, g_source_unref);
+	g_signal_emit (mdns, signals[ALL_FOR_NOW], 0);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Queries go out at increasing intervals, the known
+ * answers keep the replies small after the first ones */
+static gboolean
+query_cb (gpointer user_data)
+{
+	RemoteDisplayMdns *mdns = user_data;
+
+	remote_display_mdns_query (mdns);
+
+	g_clear_pointer (&mdns->query_source, g_source_unref);
+	mdns->query_interval = MIN (mdns->query_interval * 2, QUERY_INTERVAL_MAX);
+	mdns->query_source = add_timeout (mdns, mdns->query_interval * 1000, query_cb);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+remote_display_mdns_finalize (GObject *object)
+{
+	RemoteDisplayMdns *mdns = REMOTE_DISPLAY_MDNS (object);
+
+	clear_source (&mdns->query_source);
+	clear_source (&mdns->resolve_source);
+	clear_source (&mdns->expiry_source);
+	clear_source (&mdns->all_for_now_source);
+	clear_source (&mdns->socket_source);
+	g_clear_object (&mdns->socket);
+	g_clear_object (&mdns->target);
+	g_hash_table_destroy (mdns->services);
+	g_hash_table_destroy (mdns->hosts);
+	g_main_context_unref (mdns->context);
+	g_object_unref (mdns->netif);
+	g_free (mdns->service_type);
+	g_free (mdns->type_domain);
+
+	G_OBJECT_CLASS (remote_display_mdns_parent_class)->finalize (object);
+}
+
+static void
+remote_display_mdns_class_init (RemoteDisplayMdnsClass *klass)
+{
+	GObjectClass *o_class = (GObjectClass *)klass;
+
+	o_class->finalize = remote_display_mdns_finalize;
+
+	/**
+	 * RemoteDisplayMdns::found:
+	 * @mdns: the mDNS querier
+	 * @name: the service instance name
+	 * @ifindex: the interface the service was seen on
+	 * @host_name: the host name of the service
+	 * @address: the #GInetAddress of the host
+	 * @port: the port of the service
+	 * @txt: the TXT record strings, as "key=value"
+	 *
+	 * Emitted when a service was resolved, and again if it
+	 * moved, after #RemoteDisplayMdns::removed.
+	 **/
+	signals[FOUND] = g_signal_new ("found",
+				       REMOTE_DISPLAY_TYPE_MDNS,
+				       G_SIGNAL_RUN_FIRST,
+				       0, NULL, NULL,
+				       g_cclosure_marshal_generic,
+				       G_TYPE_NONE,
+				       6, G_TYPE_STRING, G_TYPE_UINT, G_TYPE_STRING,
+				       G_TYPE_INET_ADDRESS, G_TYPE_UINT, G_TYPE_STRV);
+
+	/**
+	 * RemoteDisplayMdns::removed:
+	 * @mdns: the mDNS querier
+	 * @name: the service instance name
+	 * @ifindex: the interface the service was seen on
+	 **/
+	signals[REMOVED] = g_signal_new ("removed",
+					 REMOTE_DISPLAY_TYPE_MDNS,
+					 G_SIGNAL_RUN_FIRST,
+					 0, NULL, NULL,
+					 g_cclosure_marshal_generic,
+					 G_TYPE_NONE,
+					 2, G_TYPE_STRING, G_TYPE_UINT);
+
+	/**
+	 * RemoteDisplayMdns::all-for-now:
+	 * @mdns: the mDNS querier
+	 *
+	 * Emitted once the replies to the first query had time to arrive.
+	 **/
+	signals[ALL_FOR_NOW] = g_signal_new ("all-for-now",
+					     REMOTE_DISPLAY_TYPE_MDNS,
+					     G_SIGNAL_RUN_FIRST,
+					     0, NULL, NULL,
+					     g_cclosure_marshal_generic,
+					     G_TYPE_NONE, 0);
+}
+
+static void
+remote_display_mdns_init (RemoteDisplayMdns *mdns)
+{
+	mdns->services = g_hash_table_new_full (g_str_hash, g_str_equal,
+						g_free, (GDestroyNotify) service_free);
+	mdns->hosts = g_hash_table_new_full (g_str_hash, g_str_equal,
+					     g_free, (GDestroyNotify) host_free);
+	mdns->context = g_main_context_ref_thread_default ();
+	mdns->netif = remote_display_netif_get ();
+}
+
+/**
+ * remote_display_mdns_new:
+ * @service_type: the DNS-SD service type to browse, such as "_airplay._tcp"
+ *
+ * Return value: a new #RemoteDisplayMdns
+ **/
+RemoteDisplayMdns *
+remote_display_mdns_new (const char *service_type)
+{
+	RemoteDisplayMdns *mdns;
+
+	g_return_val_if_fail (service_type != NULL, NULL);
+
+	mdns = g_object_new (REMOTE_DISPLAY_TYPE_MDNS, NULL);
+	mdns->service_type = g_strdup (service_type);
+	mdns->type_domain = g_strdup_printf ("%s." MDNS_DOMAIN, service_type);
+
+	return mdns;
+}
+
+/**
+ * remote_display_mdns_set_target:
+ * @mdns: a #RemoteDisplayMdns
+ * @target: where to send queries, or %NULL for the mDNS multicast group
+ *
+ * Sending queries to a unicast address, from a port other than
+ * the mDNS one, gets unicast replies, which is useful for tests.
+ **/
+void
+remote_display_mdns_set_target (RemoteDisplayMdns  *mdns,
+				GInetSocketAddress *target)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_MDNS (mdns));
+	g_return_if_fail (mdns->socket == NULL);
+
+	g_clear_object (&mdns->target);
+	if (target)
+		mdns->target = g_object_ref (target);
+}
+
+static GSocket *
+new_socket (guint16   port,
+	    GError  **error)
+{
+	GSocketAddress *address;
+	GInetAddress *any;
+	GSocket *socket;
+	gboolean ret;
+
+	socket = g_socket_new (G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_DATAGRAM,
+			       G_SOCKET_PROTOCOL_UDP, error);
+	if (!socket)
+		return NULL;
+	g_socket_set_blocking (socket, FALSE);
+
+	any = g_inet_address_new_any (G_SOCKET_FAMILY_IPV4);
+	address = g_inet_socket_address_new (any, port);
+	ret = g_socket_bind (socket, address, port != 0, error);
+	g_object_unref (address);
+	g_object_unref (any);
+	if (!ret) {
+		g_object_unref (socket);
+		return NULL;
+	}
+
+	return socket;
+}
+
+/**
+ * remote_display_mdns_start:
+ * @mdns: a #RemoteDisplayMdns
+ * @error: a #GError
+ *
+ * Starts querying, and listening to announcements.
+ *
+ * Return value: %TRUE if querying could be started.
+ **/
+gboolean
+remote_display_mdns_start (RemoteDisplayMdns  *mdns,
+			   GError            **error)
+{
+	GError *local_error = NULL;
+
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_MDNS (mdns), FALSE);
+	g_return_val_if_fail (mdns->socket == NULL, FALSE);
+
+	/* Listening on the mDNS port gets us the multicast replies and
+	 * announcements, which we can do without if we can't share it */
+	if (!mdns->target) {
+		mdns->socket = new_socket (MDNS_PORT, &local_error);
+		if (mdns->socket) {
+			GInetAddress *group;
+
+			group = g_inet_address_new_from_string (MDNS_ADDRESS);
+			if (!g_socket_join_multicast_group (mdns->socket, group, FALSE, NULL, &local_error))
+				g_clear_object (&mdns->socket);
+			g_object_unref (group);
+		}
+		if (mdns->socket) {
+			g_socket_set_multicast_ttl (mdns->socket, 255);
+		} else {
+			g_debug ("Not listening to mDNS announcements: %s", local_error->message);
+			g_error_free (local_error);
+		}
+	}
+	if (!mdns->socket) {
+		mdns->socket = new_socket (0, error);
+		if (!mdns->socket)
+			return FALSE;
+	}
+
+	mdns->socket_source = g_socket_create_source (mdns->socket, G_IO_IN, NULL);
+	g_source_set_callback (mdns->socket_source, (GSourceFunc) socket_read_cb, mdns, NULL);
+	g_source_attach (mdns->socket_source, mdns->context);
+
+	mdns->query_interval = QUERY_INTERVAL_MIN;
+	remote_display_mdns_query (mdns);
+	mdns->query_source = add_timeout (mdns, mdns->query_interval * 1000, query_cb);
+	mdns->expiry_source = add_timeout (mdns, EXPIRY_INTERVAL * 1000, expiry_cb);
+	mdns->all_for_now_source = add_timeout (mdns, ALL_FOR_NOW_DELAY, all_for_now_cb);
+
+	return TRUE;
+}
+
+/**
+ * remote_display_mdns_query:
+ * @mdns: a #RemoteDisplayMdns
+ *
+ * Sends a new query for the service type. The services we know
+ * about are listed as known answers, so that responders only
+ * reply for them if their records are about to expire. Answers
+ * that don't fit in one packet follow in further ones, without
+ * the question, and with the truncated bit set on all but the last.
+ **/
+void
+remote_display_mdns_query (RemoteDisplayMdns *mdns)
+{
+	GByteArray *packet;
+	GHashTableIter iter;
+	gpointer value;
+	guint16 n_answers = 0;
+	gint64 now;
+
+	g_return_if_fail (REMOTE_DISPLAY_IS_MDNS (mdns));
+	g_return_if_fail (mdns->socket != NULL);
+
+	packet = new_packet ();
+	write_name (packet, NULL, mdns->type_domain);
+	write_uint16 (packet, TYPE_PTR);
+	write_uint16 (packet, CLASS_IN);
+	set_count (packet, 4, 1);
+
+	now = g_get_monotonic_time ();
+	g_hash_table_iter_init (&iter, mdns->services);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		MdnsService *service = value;
+		GByteArray *rdata;
+		gint64 remaining;
+
+		/* Known answers need more than half their lifetime left */
+		remaining = (service->expires - now) / G_USEC_PER_SEC;
+		if (remaining <= service->ttl / 2)
+			continue;
+
+		rdata = g_byte_array_new ();
+		write_label (rdata, service->name);
+		write_uint16 (rdata, 0xc00c);
+
+		if (n_answers > 0 && packet->len + 12 + rdata->len > MAX_QUERY_SIZE) {
+			/* The flags, the responders wait for the rest */
+			set_count (packet, 2, FLAGS_TRUNCATED);
+			set_count (packet, 6, n_answers);
+			send_packet (mdns, packet);
+			g_byte_array_unref (packet);
+			packet = new_packet ();
+			n_answers = 0;
+		}
+
+		/* Without a question, the first owner name takes its
+		 * place, so that the pointers still land on it */
+		if (packet->len == 12)
+			write_name (packet, NULL, mdns->type_domain);
+		else
+			write_uint16 (packet, 0xc00c);
+		write_uint16 (packet, TYPE_PTR);
+		write_uint16 (packet, CLASS_IN);
+		write_uint32 (packet, remaining);
+		write_uint16 (packet, rdata->len);
+		g_byte_array_append (packet, rdata->data, rdata->len);
+		g_byte_array_unref (rdata);
+		n_answers++;
+	}
+	set_count (packet, 6, n_answers);
+
+	send_packet (mdns, packet);
+	g_byte_array_unref (packet);
+}
@@ -0,0 +1,729 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <gio/gio.h>
+#include <plist/plist.h>
+
+#include <libremote-display/remote-display-error.h>
+#include <libremote-display/remote-display-mirror.h>
+#include <libremote-display/remote-display-encoder.h>
+#include <libremote-display/remote-display-device-airplay.h>
+#include <libremote-display/remote-display-device-private.h>
+
+#define MIRROR_PORT           7100
+#define MIRROR_FPS            30
+#define MIRROR_BITRATE_KBPS   4000
+#define MIRROR_LATENCY_MS     90
+#define CONNECT_TIMEOUT       5                    /* seconds */
+#define HEARTBEAT_INTERVAL    G_USEC_PER_SEC
+#define IDLE_REFRESH_INTERVAL (G_USEC_PER_SEC / 2)
+#define MAX_DAMAGE_RECTS      16
+#define HEADER_SIZE           128
+#define NTP_EPOCH_OFFSET      G_GUINT64_CONSTANT (2208988800)
+
+/* Stream packet payload types */
+typedef enum {
+	PAYLOAD_VIDEO      = 0,
+	PAYLOAD_CODEC_DATA = 1,
+	PAYLOAD_HEARTBEAT  = 2
+} MirrorPayloadType;
+
+struct _RemoteDisplayMirror {
+	GObject parent_instance;
+
+	RemoteDisplayDevice *device;
+	RemoteDisplayFrameSource *source;
+	gulong frame_handler_id;
+	GMainContext *context;                 /* Where signals get emitted */
+
+	GThread *thread;
+	GCancellable *cancellable;
+	GSocketAddress *address;
+	guint64 device_id;
+	guint64 session_id;
+
+	/* Shared with the streaming thread, protected by lock */
+	GMutex lock;
+	GCond cond;
+	RemoteDisplayFrame *pending;           /* Single slot, newest frame wins */
+	GArray *pending_damage;                /* Damage accumulated since the last encode */
+	gboolean pending_full_damage;
+	gboolean stopping;
+	guint64 frames_sent;
+	guint64 frames_dropped;
+	guint64 frames_skipped;
+
+	/* Only used from the streaming thread */
+	GSocketConnection *connection;
+	GOutputStream *output;
+	RemoteDisplayEncoder *encoder;
+	RemoteDisplayFrame *last_frame;
+	gint64 last_encoded;
+};
+
+/* Passed to the encoder when nothing changed */
+static const RemoteDisplayRect no_damage[1];
+
+G_DEFINE_TYPE (RemoteDisplayMirror, remote_display_mirror, G_TYPE_OBJECT);
+
+enum {
+	FRAME_SENT,
+	STOPPED,
+	NUM_SIGS
+};
+
+static guint signals[NUM_SIGS] = {0,};
+
+typedef struct {
+	RemoteDisplayMirror *mirror;
+	GThread *thread;
+	guint64 frame_number;
+	gint64 latency;
+	GError *error;
+} MirrorReport;
+
+static void
+mirror_report_free (MirrorReport *report)
+{
+	g_object_unref (report->mirror);
+	g_clear_error (&report->error);
+	g_free (report);
+}
+
+static gboolean
+emit_frame_sent_cb (gpointer user_data)
+{
+	MirrorReport *report = user_data;
+
+	g_signal_emit (report->mirror, signals[FRAME_SENT], 0,
+		       report->frame_number, report->latency);
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+emit_stopped_cb (gpointer user_data)
+{
+	MirrorReport *report = user_data;
+	RemoteDisplayMirror *mirror = report->mirror;
+
+	/* Unless remote_display_mirror_stop() was called meanwhile,
+	 * join the thread and drop its reference */
+	if (mirror->thread != report->thread)
+		return G_SOURCE_REMOVE;
+	remote_display_mirror_stop (mirror);
+
+	g_signal_emit (mirror, signals[STOPPED], 0, report->error);
+	return G_SOURCE_REMOVE;
+}
+
+static void
+report_to_context (RemoteDisplayMirror *mirror,
+		   GSourceFunc          func,
+		   guint64              frame_number,
+		   gint64               latency,
+		   GError              *error)
+{
+	MirrorReport *report;
+	GSource *source;
+
+	/* Nothing gets reported after remote_display_mirror_stop(). The
+	 * thread owns a reference, so the mirror is alive until joined. */
+	g_mutex_lock (&mirror->lock);
+	if (mirror->stopping) {
+		g_mutex_unlock (&mirror->lock);
+		g_clear_error (&error);
+		return;
+	}
+
+	report = g_new0 (MirrorReport, 1);
+	report->mirror = g_object_ref (mirror);
+	report->thread = g_thread_self ();
+	report->frame_number = frame_number;
+	report->latency = latency;
+	report->error = error;
+
+	source = g_idle_source_new ();
+	g_source_set_callback (source, func, report, (GDestroyNotify) mirror_report_free);
+	g_source_attach (source, mirror->context);
+	g_source_unref (source);
+	g_mutex_unlock (&mirror->lock);
+}
+
+static guint64
+ntp_from_monotonic (gint64 monotonic)
+{
+	gint64 now;
+	guint64 secs, frac;
+
+	now = g_get_real_time () - (g_get_monotonic_time () - monotonic);
+	secs = now / G_USEC_PER_SEC + NTP_EPOCH_OFFSET;
+	frac = ((guint64) (now % G_USEC_PER_SEC) << 32) / G_USEC_PER_SEC;
+
+	return (secs << 32) | frac;
+}
+
+static void
+write_float_le (guint8 *dest,
+		gfloat  value)
+{
+	union {
+		gfloat f;
+		guint32 u;
+	} v;
+
+	v.f = value;
+	v.u = GUINT32_TO_LE (v.u);
+	memcpy (dest, &v.u, 4);
+}
+
+static gboolean
+send_packet (RemoteDisplayMirror  *mirror,
+	     MirrorPayloadType     type,
+	     guint64               ntp_time,
+	     GBytes               *payload,
+	     GError              **error)
+{
+	guint8 header[HEADER_SIZE];
+	guint32 size32;
+	guint16 type16;
+	guint64 time64;
+	gsize size = 0;
+
+	if (payload)
+		size = g_bytes_get_size (payload);
+
+	memset (header, 0, sizeof(header));
+	size32 = GUINT32_TO_LE (size);
+	type16 = GUINT16_TO_LE (type);
+	time64 = GUINT64_TO_LE (ntp_time);
+	memcpy (header, &size32, 4);
+	memcpy (header + 4, &type16, 2);
+	memcpy (header + 8, &time64, 8);
+
+	if (type == PAYLOAD_CODEC_DATA) {
+		gfloat width, height;
+
+		width = remote_display_encoder_get_width (mirror->encoder);
+		height = remote_display_encoder_get_height (mirror->encoder);
+		/* Source and display size, we don't scale */
+		write_float_le (header + 40, width);
+		write_float_le (header + 44, height);
+		write_float_le (header + 56, width);
+		write_float_le (header + 60, height);
+	}
+
+	if (!g_output_stream_write_all (mirror->output, header, sizeof(header), NULL,
+					mirror->cancellable, error))
+		return FALSE;
+	if (size == 0)
+		return TRUE;
+	return g_output_stream_write_all (mirror->output,
+					  g_bytes_get_data (payload, NULL), size,
+					  NULL, mirror->cancellable, error);
+}
+
+static gboolean
+send_stream_request (RemoteDisplayMirror  *mirror,
+		     GError              **error)
+{
+	plist_t dict;
+	char *data = NULL;
+	uint32_t len = 0;
+	char *request;
+	gboolean ret;
+
+	dict = plist_new_dict ();
+	plist_dict_set_item (dict, "deviceID", plist_new_uint (mirror->device_id));
+	plist_dict_set_item (dict, "sessionID", plist_new_uint (mirror->session_id));
+	plist_dict_set_item (dict, "version", plist_new_string ("130.16"));
+	plist_dict_set_item (dict, "latencyMs", plist_new_uint (MIRROR_LATENCY_MS));
+	plist_to_bin (dict, &data, &len);
+	plist_free (dict);
+
+	request = g_strdup_printf ("POST /stream HTTP/1.1\r\n"
+				   "Content-Length: %u\r\n"
+				   "Content-Type: application/x-apple-binary-plist\r\n"
+				   "\r\n", len);
+	ret = g_output_stream_write_all (mirror->output, request, strlen (request),
+					 NULL, mirror->cancellable, error) &&
+	      g_output_stream_write_all (mirror->output, data, len,
+					 NULL, mirror->cancellable, error);
+	g_free (request);
+	free (data);
+
+	return ret;
+}
+
+/* Refreshes re-send the last frame, they are stamped with the
+ * time they are sent, and aren't counted as frames */
+static gboolean
+send_frame (RemoteDisplayMirror      *mirror,
+	    RemoteDisplayFrame       *frame,
+	    const RemoteDisplayRect  *damage,
+	    guint                     n_damage,
+	    gboolean                  refresh,
+	    GError                  **error)
+{
+	GBytes *data;
+	guint width, height;
+	guint64 frame_number;
+	gint64 capture_time, latency;
+	gboolean ret;
+
+	width = remote_display_frame_get_width (frame) & ~1;
+	height = remote_display_frame_get_height (frame) & ~1;
+
+	/* (Re)create the encoder on the first frame, and on size changes */
+	if (!mirror->encoder ||
+	    remote_display_encoder_get_width (mirror->encoder) != width ||
+	    remote_display_encoder_get_height (mirror->encoder) != height) {
+		GBytes *codec_data;
+
+		g_clear_pointer (&mirror->encoder, remote_display_encoder_free);
+		mirror->encoder = remote_display_encoder_new (width, height,
+							      MIRROR_FPS, MIRROR_BITRATE_KBPS,
+							      error);
+		if (!mirror->encoder)
+			return FALSE;
+
+		codec_data = remote_display_encoder_get_codec_data (mirror->encoder);
+		ret = send_packet (mirror, PAYLOAD_CODEC_DATA,
+				   ntp_from_monotonic (g_get_monotonic_time ()),
+				   codec_data, error);
+		g_bytes_unref (codec_data);
+		if (!ret)
+			return FALSE;
+
+		/* The encoder's planes are blank */
+		damage = NULL;
+		n_damage = 0;
+	}
+
+	data = remote_display_encoder_encode (mirror->encoder, frame, damage, n_damage, NULL, error);
+	if (!data)
+		return FALSE;
+	if (g_bytes_get_size (data) == 0) {
+		g_bytes_unref (data);
+		return TRUE;
+	}
+
+	if (refresh)
+		capture_time = g_get_monotonic_time ();
+	else
+		capture_time = remote_display_frame_get_capture_time (frame);
+	ret = send_packet (mirror, PAYLOAD_VIDEO, ntp_from_monotonic (capture_time), data, error);
+	g_bytes_unref (data);
+	if (!ret)
+		return FALSE;
+
+	if (mirror->last_frame != frame) {
+		g_clear_pointer (&mirror->last_frame, remote_display_frame_unref);
+		mirror->last_frame = remote_display_frame_ref (frame);
+	}
+	mirror->last_encoded = g_get_monotonic_time ();
+	if (refresh)
+		return TRUE;
+
+	/* Glass-to-wire: from capture until the kernel has the whole frame */
+	latency = g_get_monotonic_time () - capture_time;
+
+	g_mutex_lock (&mirror->lock);
+	frame_number = ++mirror->frames_sent;
+	g_mutex_unlock (&mirror->lock);
+
+	report_to_context (mirror, emit_frame_sent_cb, frame_number, latency, NULL);
+
+	return TRUE;
+}
+
+static gpointer
+mirror_thread (gpointer user_data)
+{
+	RemoteDisplayMirror *mirror = user_data;
+	GSocketClient *client;
+	GError *error = NULL;
+	GArray *damage = NULL;
+	gint64 last_sent;
+
+	client = g_socket_client_new ();
+	g_socket_client_set_timeout (client, CONNECT_TIMEOUT);
+	mirror->connection = g_socket_client_connect (client, G_SOCKET_CONNECTABLE (mirror->address),
+						      mirror->cancellable, &error);
+	g_object_unref (client);
+	if (!mirror->connection)
+		goto out;
+
+	/* Frames are written in one go, don't let Nagle hold them back */
+	g_socket_set_option (g_socket_connection_get_socket (mirror->connection),
+			     IPPROTO_TCP, TCP_NODELAY, TRUE, NULL);
+	mirror->output = g_io_stream_get_output_stream (G_IO_STREAM (mirror->connection));
+
+	if (!send_stream_request (mirror, &error))
+		goto out;
+
+	damage = g_array_new (FALSE, FALSE, sizeof (RemoteDisplayRect));
+	last_sent = g_get_monotonic_time ();
+	while (TRUE) {
+		RemoteDisplayFrame *frame;
+		gboolean full_damage;
+		gint64 deadline;
+		gboolean ret;
+
+		/* While the screen is idle, refresh at a reduced rate with
+		 * frames made of skipped macroblocks, so the receiver's
+		 * picture keeps converging thanks to the intra refresh */
+		deadline = last_sent + HEARTBEAT_INTERVAL;
+		if (mirror->last_frame)
+			deadline = MIN (deadline, mirror->last_encoded + IDLE_REFRESH_INTERVAL);
+
+		g_mutex_lock (&mirror->lock);
+		while (!mirror->pending && !mirror->stopping) {
+			if (!g_cond_wait_until (&mirror->cond, &mirror->lock, deadline))
+				break;
+		}
+		if (mirror->stopping) {
+			g_mutex_unlock (&mirror->lock);
+			break;
+		}
+		frame = mirror->pending;
+		mirror->pending = NULL;
+		full_damage = mirror->pending_full_damage;
+		mirror->pending_full_damage = FALSE;
+		g_array_set_size (damage, 0);
+		g_array_append_vals (damage, mirror->pending_damage->data, mirror->pending_damage->len);
+		g_array_set_size (mirror->pending_damage, 0);
+		g_mutex_unlock (&mirror->lock);
+
+		if (frame) {
+			if (full_damage)
+				ret = send_frame (mirror, frame, NULL, 0, FALSE, &error);
+			else
+				ret = send_frame (mirror, frame,
+						  (RemoteDisplayRect *) damage->data, damage->len,
+						  FALSE, &error);
+			remote_display_frame_unref (frame);
+		} else if (mirror->last_frame &&
+			   g_get_monotonic_time () >= mirror->last_encoded + IDLE_REFRESH_INTERVAL) {
+			ret = send_frame (mirror, mirror->last_frame, no_damage, 0, TRUE, &error);
+		} else {
+			ret = send_packet (mirror, PAYLOAD_HEARTBEAT,
+					   ntp_from_monotonic (g_get_monotonic_time ()),
+					   NULL, &error);
+		}
+		if (!ret)
+			break;
+		last_sent = g_get_monotonic_time ();
+	}
+
+out:
+	if (error && g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+		g_clear_error (&error);
+	if (mirror->connection)
+		g_io_stream_close (G_IO_STREAM (mirror->connection), NULL, NULL);
+	g_clear_object (&mirror->connection);
+	mirror->output = NULL;
+	g_clear_pointer (&mirror->encoder, remote_display_encoder_free);
+	g_clear_pointer (&mirror->last_frame, remote_display_frame_unref);
+	if (damage)
+		g_array_free (damage, TRUE);
+
+	report_to_context (mirror, emit_stopped_cb, 0, 0, error);
+
+	return NULL;
+}
+
+static void
+add_pending_damage (RemoteDisplayMirror *mirror,
+		    RemoteDisplayFrame  *frame)
+{
+	const RemoteDisplayRect *rects;
+	RemoteDisplayRect bounds;
+	guint n_rects, i;
+
+	if (mirror->pending_full_damage)
+		return;
+	if (!remote_display_frame_get_damage (frame, &rects, &n_rects)) {
+		mirror->pending_full_damage = TRUE;
+		return;
+	}
+	g_array_append_vals (mirror->pending_damage, rects, n_rects);
+	if (mirror->pending_damage->len <= MAX_DAMAGE_RECTS)
+		return;
+
+	/* Too fragmented, converting the bounding box is cheaper */
+	bounds = g_array_index (mirror->pending_damage, RemoteDisplayRect, 0);
+	for (i = 1; i < mirror->pending_damage->len; i++) {
+		RemoteDisplayRect *r = &g_array_index (mirror->pending_damage, RemoteDisplayRect, i);
+		gint x2, y2;
+
+		x2 = MAX (bounds.x + bounds.width, r->x + r->width);
+		y2 = MAX (bounds.y + bounds.height, r->y + r->height);
+		bounds.x = MIN (bounds.x, r->x);
+		bounds.y = MIN (bounds.y, r->y);
+		bounds.width = x2 - bounds.x;
+		bounds.height = y2 - bounds.y;
+	}
+	g_array_set_size (mirror->pending_damage, 0);
+	g_array_append_val (mirror->pending_damage, bounds);
+}
+
+static void
+frame_cb (RemoteDisplayFrameSource *source,
+	  RemoteDisplayFrame       *frame,
+	  RemoteDisplayMirror      *mirror)
+{
+	g_mutex_lock (&mirror->lock);
+
+	/* Nothing changed, whatever is pending or was last
+	 * encoded is still what's on screen */
+	if (remote_display_frame_is_unchanged (frame)) {
+		mirror->frames_skipped++;
+		g_mutex_unlock (&mirror->lock);
+		return;
+	}
+
+	/* Latency first: if the encoder hasn't caught up, the
+	 * frame it didn't get to is stale, replace it, but keep
+	 * its damage as the encoder never saw it */
+	if (mirror->pending) {
+		remote_display_frame_unref (mirror->pending);
+		mirror->frames_dropped++;
+	}
+	mirror->pending = remote_display_frame_ref (frame);
+	add_pending_damage (mirror, frame);
+	g_cond_signal (&mirror->cond);
+	g_mutex_unlock (&mirror->lock);
+}
+
+static void
+remote_display_mirror_finalize (GObject *object)
+{
+	RemoteDisplayMirror *mirror = REMOTE_DISPLAY_MIRROR (object);
+
+	remote_display_mirror_stop (mirror);
+
+	g_clear_object (&mirror->device);
+	g_clear_object (&mirror->source);
+	g_clear_object (&mirror->cancellable);
+	g_clear_pointer (&mirror->context, g_main_context_unref);
+	g_clear_object (&mirror->address);
+	g_array_free (mirror->pending_damage, TRUE);
+	g_mutex_clear (&mirror->lock);
+	g_cond_clear (&mirror->cond);
+
+	G_OBJECT_CLASS (remote_display_mirror_parent_class)->finalize (object);
+}
+
+static void
+remote_display_mirror_class_init (RemoteDisplayMirrorClass *klass)
+{
+	GObjectClass *o_class = (GObjectClass *)klass;
+
+	o_class->finalize = remote_display_mirror_finalize;
+
+	/**
+	 * RemoteDisplayMirror::frame-sent:
+	 * @mirror: the mirror
+	 * @frame_number: the number of frames sent so far
+	 * @latency: time between capture and the frame being written
+	 *   to the network, in microseconds
+	 **/
+	signals[FRAME_SENT] = g_signal_new ("frame-sent",
+					    REMOTE_DISPLAY_TYPE_MIRROR,
+					    G_SIGNAL_RUN_FIRST,
+					    0, NULL, NULL,
+					    g_cclosure_marshal_generic,
+					    G_TYPE_NONE,
+					    2, G_TYPE_UINT64, G_TYPE_INT64);
+
+	/**
+	 * RemoteDisplayMirror::stopped:
+	 * @mirror: the mirror
+	 * @error: (nullable): the reason streaming stopped, or %NULL
+	 *
+	 * Emitted when streaming stops on its own, because of an
+	 * error or the receiver going away, not when
+	 * remote_display_mirror_stop() is called.
+	 **/
+	signals[STOPPED] = g_signal_new ("stopped",
+					 REMOTE_DISPLAY_TYPE_MIRROR,
+					 G_SIGNAL_RUN_FIRST,
+					 0, NULL, NULL,
+					 g_cclosure_marshal_generic,
+					 G_TYPE_NONE,
+					 1, G_TYPE_ERROR);
+}
+
+static void
+remote_display_mirror_init (RemoteDisplayMirror *mirror)
+{
+	g_mutex_init (&mirror->lock);
+	g_cond_init (&mirror->cond);
+	mirror->pending_damage = g_array_new (FALSE, FALSE, sizeof (RemoteDisplayRect));
+}
+
+RemoteDisplayMirror *
+remote_display_mirror_new (RemoteDisplayDevice      *device,
+			   RemoteDisplayFrameSource *source)
+{
+	RemoteDisplayMirror *mirror;
+
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_DEVICE (device), NULL);
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_FRAME_SOURCE (source), NULL);
+
+	mirror = g_object_new (REMOTE_DISPLAY_TYPE_MIRROR, NULL);
+	mirror->device = g_object_ref (device);
+	mirror->source = g_object_ref (source);
+
+	return mirror;
+}
+
+/**
+ * remote_display_mirror_start:
+ * @mirror: a #RemoteDisplayMirror
+ * @error: a #GError
+ *
+ * Starts pulling frames from the source and streaming them to the
+ * device. Encoding and sending happens in a separate thread, frames
+ * that arrive while the previous one is still being encoded replace
+ * each other, so the pipeline never holds more than one stale frame.
+ *
+ * The streaming thread keeps a reference on @mirror until
+ * remote_display_mirror_stop() is called, or #RemoteDisplayMirror::stopped
+ * is emitted.
+ *
+ * Return value: %TRUE if streaming was started.
+ **/
+gboolean
+remote_display_mirror_start (RemoteDisplayMirror  *mirror,
+			     GError              **error)
+{
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_MIRROR (mirror), FALSE);
+	g_return_val_if_fail (mirror->thread == NULL, FALSE);
+
+	if (!REMOTE_DISPLAY_IS_DEVICE_AIRPLAY (mirror->device) ||
+	    !(remote_display_device_get_capabilities (mirror->device) & REMOTE_DISPLAY_DEVICE_CAPABILITIES_SCREEN)) {
+		g_set_error_literal (error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_NOT_SUPPORTED,
+				     "Device does not support screen mirroring");
+		return FALSE;
+	}
+
+	g_clear_object (&mirror->address);
+	mirror->address = remote_display_device_get_best_address (mirror->device, MIRROR_PORT);
+	if (!mirror->address) {
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_HOST_UNREACHABLE,
+				     "Device has no known address");
+		return FALSE;
+	}
+	mirror->device_id = ((guint64) g_random_int () << 16) ^ g_random_int ();
+	mirror->session_id = g_random_int ();
+	mirror->stopping = FALSE;
+	g_clear_object (&mirror->cancellable);
+	mirror->cancellable = g_cancellable_new ();
+	g_clear_pointer (&mirror->context, g_main_context_unref);
+	mirror->context = g_main_context_ref_thread_default ();
+
+	/* Dropped once the thread is joined */
+	mirror->thread = g_thread_try_new ("remote-display-mirror", mirror_thread,
+					   g_object_ref (mirror), error);
+	if (!mirror->thread) {
+		g_object_unref (mirror);
+		return FALSE;
+	}
+
+	mirror->frame_handler_id = g_signal_connect (mirror->source, "frame",
+						     G_CALLBACK (frame_cb), mirror);
+	remote_display_frame_source_start (mirror->source);
+
+	return TRUE;
+}
+
+void
+remote_display_mirror_stop (RemoteDisplayMirror *mirror)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_MIRROR (mirror));
+
+	if (!mirror->thread)
+		return;
+
+	remote_display_frame_source_stop (mirror->source);
+	g_signal_handler_disconnect (mirror->source, mirror->frame_handler_id);
+	mirror->frame_handler_id = 0;
+
+	g_mutex_lock (&mirror->lock);
+	mirror->stopping = TRUE;
+	g_clear_pointer (&mirror->pending, remote_display_frame_unref);
+	g_array_set_size (mirror->pending_damage, 0);
+	mirror->pending_full_damage = FALSE;
+	g_cond_signal (&mirror->cond);
+	g_mutex_unlock (&mirror->lock);
+
+	g_cancellable_cancel (mirror->cancellable);
+	g_thread_join (mirror->thread);
+	mirror->thread = NULL;
+
+	/* The thread's, which might be the last one */
+	g_object_unref (mirror);
+}
+
+guint64
+remote_display_mirror_get_frames_sent (RemoteDisplayMirror *mirror)
+{
+	guint64 ret;
+
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_MIRROR (mirror), 0);
+
+	g_mutex_lock (&mirror->lock);
+	ret = mirror->frames_sent;
+	g_mutex_unlock (&mirror->lock);
+
+	return ret;
+}
+
+guint64
+remote_display_mirror_get_frames_dropped (RemoteDisplayMirror *mirror)
+{
+	guint64 ret;
+
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_MIRROR (mirror), 0);
+
+	g_mutex_lock (&mirror->lock);
+	ret = mirror->frames_dropped;
+	g_mutex_unlock (&mirror->lock);
+
+	return ret;
+}
+
+guint64
+remote_display_mirror_get_frames_skipped (RemoteDisplayMirror *mirror)
+{
+	guint64 ret;
+
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_MIRROR (mirror), 0);
+
+	g_mutex_lock (&mirror->lock);
+	ret = mirror->frames_skipped;
+	g_mutex_unlock (&mirror->lock);
+
+	return ret;
+}
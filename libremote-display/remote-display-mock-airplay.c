@@ -0,0 +1,886 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+/* A stand-in AirPlay receiver, which answers the video protocol
+ * well enough to test RemoteDisplayDeviceAirplay against it,
+ * without needing an Apple TV on the network */
+
+#include <string.h>
+#include <stdlib.h>
+#include <net/if.h>
+
+#include <gio/gio.h>
+#include <libsoup/soup.h>
+#include <plist/plist.h>
+#include <avahi-common/address.h>
+#include <avahi-common/strlst.h>
+
+#include <libremote-display/remote-display-mock-airplay.h>
+#include <libremote-display/remote-display-device-airplay.h>
+#include <libremote-display/remote-display-private.h>
+
+#define MOCK_FEATURES     (AIRPLAY_VIDEO_SUPPORT | AIRPLAY_PHOTO_SUPPORT | \
+			   AIRPLAY_VIDEO_HLS_SUPPORT | AIRPLAY_VIDEO_AUDIO)
+#define MOCK_MODEL        "AppleTV3,2"
+#define MOCK_SRCVERS      "220.68"
+#define MOCK_DURATION     60.0                 /* seconds, whatever is played */
+#define FETCH_BUFFER_SIZE 65536
+
+typedef struct {
+	RemoteDisplayMockAirplay *mock;
+	SoupMessage *msg;
+	GSource *source;
+} DelayedReply;
+
+typedef struct {
+	guint latency_ms;
+	guint status;                          /* 0 to drop the connection */
+} ScriptedReply;
+
+struct _RemoteDisplayMockAirplay {
+	GObject parent_instance;
+
+	char *device_id;
+	SoupServer *server;
+	guint16 port;
+	GMainContext *context;                 /* Thread-default when started */
+
+	/* Fault injection */
+	GRand *rand;
+	guint latency_ms;
+	gdouble loss;
+	gdouble error_rate;
+	guint error_status;
+	GList *delayed;                        /* of DelayedReply */
+	GQueue *replies;                       /* of ScriptedReply, for the next commands */
+	gboolean push_events;
+
+	/* The connection taken over by /reverse */
+	char *session_id;
+	GIOStream *events;
+	GCancellable *events_cancellable;
+	char events_buffer[1024];
+
+	/* Playback */
+	SoupSession *session;
+	GCancellable *fetch_cancellable;
+	SoupMessage *fetch_msg;
+	char *fetch_buffer;
+	char *state;
+	gdouble position;
+	gdouble rate;
+	gint64 position_stamp;
+
+	RemoteDisplayMockAirplayStats stats;
+};
+
+G_DEFINE_TYPE (RemoteDisplayMockAirplay, remote_display_mock_airplay, G_TYPE_OBJECT);
+
+enum {
+	REQUEST,
+	EVENT,
+	NUM_SIGS
+};
+
+static guint signals[NUM_SIGS] = {0,};
+
+static void
+close_events (RemoteDisplayMockAirplay *mock)
+{
+	if (mock->events_cancellable) {
+		g_cancellable_cancel (mock->events_cancellable);
+		g_clear_object (&mock->events_cancellable);
+	}
+	if (mock->events) {
+		g_io_stream_close (mock->events, NULL, NULL);
+		g_clear_object (&mock->events);
+	}
+}
+
+static void
+cancel_fetch (RemoteDisplayMockAirplay *mock)
+{
+	if (!mock->fetch_cancellable)
+		return;
+	g_cancellable_cancel (mock->fetch_cancellable);
+	g_clear_object (&mock->fetch_cancellable);
+	g_clear_object (&mock->fetch_msg);
+}
+
+static void
+remote_display_mock_airplay_finalize (GObject *object)
+{
+	RemoteDisplayMockAirplay *mock = REMOTE_DISPLAY_MOCK_AIRPLAY (object);
+	GList *l;
+
+	for (l = mock->delayed; l != NULL; l = l->next) {
+		DelayedReply *reply = l->data;
+
+		g_source_destroy (reply->source);
+		g_source_unref (reply->source);
+		g_object_unref (reply->msg);
+		g_free (reply);
+	}
+	g_list_free (mock->delayed);
+	g_queue_free_full (mock->replies, g_free);
+
+	close_events (mock);
+	cancel_fetch (mock);
+	g_clear_object (&mock->server);
+	g_clear_object (&mock->session);
+	g_clear_pointer (&mock->context, g_main_context_unref);
+	g_rand_free (mock->rand);
+	g_free (mock->fetch_buffer);
+	g_free (mock->session_id);
+	g_free (mock->device_id);
+	g_free (mock->state);
+
+	G_OBJECT_CLASS (remote_display_mock_airplay_parent_class)->finalize (object);
+}
+
+static void
+remote_display_mock_airplay_class_init (RemoteDisplayMockAirplayClass *klass)
+{
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+	object_class->finalize = remote_display_mock_airplay_finalize;
+
+	/* Emitted for every request, before faults are injected */
+	signals[REQUEST] = g_signal_new ("request",
+					 REMOTE_DISPLAY_TYPE_MOCK_AIRPLAY,
+					 G_SIGNAL_RUN_LAST,
+					 0, NULL, NULL,
+					 g_cclosure_marshal_generic,
+					 G_TYPE_NONE,
+					 2, G_TYPE_STRING, G_TYPE_STRING);
+
+	/* Emitted once an event was written to the reverse connection */
+	signals[EVENT] = g_signal_new ("event",
+				       REMOTE_DISPLAY_TYPE_MOCK_AIRPLAY,
+				       G_SIGNAL_RUN_LAST,
+				       0, NULL, NULL,
+				       g_cclosure_marshal_generic,
+				       G_TYPE_NONE,
+				       1, G_TYPE_STRING);
+}
+
+static void
+remote_display_mock_airplay_init (RemoteDisplayMockAirplay *mock)
+{
+	mock->rand = g_rand_new_with_seed (0);
+	mock->error_status = SOUP_STATUS_INTERNAL_SERVER_ERROR;
+	mock->replies = g_queue_new ();
+	mock->push_events = TRUE;
+	mock->state = g_strdup ("stopped");
+	mock->session = soup_session_new ();
+	mock->fetch_buffer = g_malloc (FETCH_BUFFER_SIZE);
+}
+
+static gdouble
+get_position (RemoteDisplayMockAirplay *mock)
+{
+	gdouble position;
+
+	position = mock->position;
+	position += mock->rate * (g_get_monotonic_time () - mock->position_stamp) / G_USEC_PER_SEC;
+
+	return CLAMP (position, 0.0, MOCK_DURATION);
+}
+
+static void
+set_position (RemoteDisplayMockAirplay *mock,
+	      gdouble                   position,
+	      gdouble                   rate)
+{
+	mock->position = CLAMP (position, 0.0, MOCK_DURATION);
+	mock->rate = rate;
+	mock->position_stamp = g_get_monotonic_time ();
+}
+
+static void
+events_read_cb (GObject      *source_object,
+		GAsyncResult *result,
+		gpointer      user_data)
+{
+	RemoteDisplayMockAirplay *mock = user_data;
+	GError *error = NULL;
+	gssize len;
+
+	len = g_input_stream_read_finish (G_INPUT_STREAM (source_object), result, &error);
+	if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		g_error_free (error);
+		return;
+	}
+	if (len <= 0) {
+		g_debug ("Mock AirPlay event connection closed: %s",
+			 error ? error->message : "end of stream");
+		g_clear_error (&error);
+		close_events (mock);
+		return;
+	}
+
+	/* The replies to the events aren't looked at */
+	g_input_stream_read_async (G_INPUT_STREAM (source_object),
+				   mock->events_buffer, sizeof (mock->events_buffer),
+				   G_PRIORITY_DEFAULT, mock->events_cancellable,
+				   events_read_cb, mock);
+}
+
+static void
+send_event (RemoteDisplayMockAirplay *mock)
+{
+	GOutputStream *output;
+	GError *error = NULL;
+	plist_t dict;
+	char *xml, *headers;
+	uint32_t len;
+
+	if (!mock->events)
+		return;
+
+	dict = plist_new_dict ();
+	plist_dict_set_item (dict, "category", plist_new_string ("video"));
+	plist_dict_set_item (dict, "sessionID", plist_new_uint (1));
+	plist_dict_set_item (dict, "state", plist_new_string (mock->state));
+	plist_to_xml (dict, &xml, &len);
+	plist_free (dict);
+
+	headers = g_strdup_printf ("POST /event HTTP/1.1\r\n"
+				   "Content-Type: text/x-apple-plist+xml\r\n"
+				   "Content-Length: %u\r\n"
+				   "X-Apple-Session-ID: %s\r\n"
+				   "\r\n",
+				   len, mock->session_id ? mock->session_id : "");
+
+	/* Small enough to never block on a local socket */
+	output = g_io_stream_get_output_stream (mock->events);
+	if (!g_output_stream_write_all (output, headers, strlen (headers), NULL, NULL, &error) ||
+	    !g_output_stream_write_all (output, xml, len, NULL, NULL, &error)) {
+		g_debug ("Failed to send event: %s", error->message);
+		g_error_free (error);
+		close_events (mock);
+	} else {
+		mock->stats.events++;
+		g_signal_emit (mock, signals[EVENT], 0, mock->state);
+	}
+
+	g_free (headers);
+	free (xml);
+}
+
+static void
+set_state (RemoteDisplayMockAirplay *mock,
+	   const char               *state)
+{
+	g_free (mock->state);
+	mock->state = g_strdup (state);
+	if (mock->push_events)
+		send_event (mock);
+}
+
+static void
+fetch_read_cb (GObject      *source_object,
+	       GAsyncResult *result,
+	       gpointer      user_data)
+{
+	RemoteDisplayMockAirplay *mock = user_data;
+	GError *error = NULL;
+	gssize len;
+
+	len = g_input_stream_read_finish (G_INPUT_STREAM (source_object), result, &error);
+	if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		g_error_free (error);
+		g_object_unref (source_object);
+		return;
+	}
+	if (len < 0) {
+		g_debug ("Failed to fetch media: %s", error->message);
+		g_error_free (error);
+		g_object_unref (source_object);
+		set_state (mock, "stopped");
+		return;
+	}
+	if (len == 0) {
+		g_object_unref (source_object);
+		g_clear_object (&mock->fetch_cancellable);
+		g_clear_object (&mock->fetch_msg);
+		return;
+	}
+
+	/* Buffered enough to start */
+	if (g_strcmp0 (mock->state, "loading") == 0) {
+		set_position (mock, mock->position, 1.0);
+		set_state (mock, "playing");
+	}
+	mock->stats.bytes_fetched += len;
+
+	g_input_stream_read_async (G_INPUT_STREAM (source_object),
+				   mock->fetch_buffer, FETCH_BUFFER_SIZE,
+				   G_PRIORITY_DEFAULT, mock->fetch_cancellable,
+				   fetch_read_cb, mock);
+}
+
+static void
+fetch_sent_cb (GObject      *source_object,
+	       GAsyncResult *result,
+	       gpointer      user_data)
+{
+	RemoteDisplayMockAirplay *mock = user_data;
+	GInputStream *stream;
+	GError *error = NULL;
+
+	stream = soup_session_send_finish (SOUP_SESSION (source_object), result, &error);
+	if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		g_error_free (error);
+		return;
+	}
+	if (!stream) {
+		g_debug ("Failed to fetch media: %s", error->message);
+		g_error_free (error);
+		set_state (mock, "stopped");
+		return;
+	}
+	if (!SOUP_STATUS_IS_SUCCESSFUL (mock->fetch_msg->status_code)) {
+		g_debug ("Failed to fetch media: %d", mock->fetch_msg->status_code);
+		g_object_unref (stream);
+		set_state (mock, "stopped");
+		return;
+	}
+
+	g_input_stream_read_async (stream, mock->fetch_buffer, FETCH_BUFFER_SIZE,
+				   G_PRIORITY_DEFAULT, mock->fetch_cancellable,
+				   fetch_read_cb, mock);
+}
+
+static void
+start_fetch (RemoteDisplayMockAirplay *mock,
+	     const char               *uri)
+{
+	SoupMessage *msg;
+
+	cancel_fetch (mock);
+
+	msg = soup_message_new ("GET", uri);
+	if (!msg) {
+		g_debug ("Invalid media URI '%s'", uri);
+		set_state (mock, "stopped");
+		return;
+	}
+
+	mock->fetch_cancellable = g_cancellable_new ();
+	mock->fetch_msg = msg;
+	set_state (mock, "loading");
+	soup_session_send_async (mock->session, msg, mock->fetch_cancellable,
+				 fetch_sent_cb, mock);
+}
+
+static void
+set_plist_response (SoupMessage *msg,
+		    plist_t      dict)
+{
+	char *xml;
+	uint32_t len;
+
+	plist_to_xml (dict, &xml, &len);
+	soup_message_set_status (msg, SOUP_STATUS_OK);
+	soup_message_set_response (msg, "text/x-apple-plist+xml", SOUP_MEMORY_COPY, xml, len);
+	free (xml);
+}
+
+static void
+handle_play (RemoteDisplayMockAirplay *mock,
+	     SoupMessage              *msg)
+{
+	char **lines, *uri = NULL;
+	gdouble start = 0.0;
+	guint i;
+
+	/* "Content-Location: <uri>\nStart-Position: <fraction>\n" */
+	lines = g_strsplit (msg->request_body->data ? msg->request_body->data : "", "\n", -1);
+	for (i = 0; lines[i] != NULL; i++) {
+		if (g_str_has_prefix (lines[i], "Content-Location: "))
+			uri = g_strstrip (g_strdup (lines[i] + strlen ("Content-Location: ")));
+		else if (g_str_has_prefix (lines[i], "Start-Position: "))
+			start = g_ascii_strtod (lines[i] + strlen ("Start-Position: "), NULL);
+	}
+	g_strfreev (lines);
+
+	if (!uri) {
+		soup_message_set_status (msg, SOUP_STATUS_BAD_REQUEST);
+		return;
+	}
+
+	set_position (mock, start * MOCK_DURATION, 0.0);
+	start_fetch (mock, uri);
+	g_free (uri);
+	soup_message_set_status (msg, SOUP_STATUS_OK);
+}
+
+static void
+handle_rate (RemoteDisplayMockAirplay *mock,
+	     SoupMessage              *msg,
+	     GHashTable               *query)
+{
+	const char *value;
+	gdouble rate;
+
+	value = query ? g_hash_table_lookup (query, "value") : NULL;
+	if (!value) {
+		soup_message_set_status (msg, SOUP_STATUS_BAD_REQUEST);
+		return;
+	}
+	rate = g_ascii_strtod (value, NULL);
+
+	set_position (mock, get_position (mock), rate);
+	if (g_strcmp0 (mock->state, "stopped") != 0)
+		set_state (mock, rate == 0.0 ? "paused" : "playing");
+	soup_message_set_status (msg, SOUP_STATUS_OK);
+}
+
+static gboolean
+scrub_done_cb (gpointer user_data)
+{
+	RemoteDisplayMockAirplay *mock = user_data;
+
+	if (g_strcmp0 (mock->state, "loading") == 0)
+		set_state (mock, "playing");
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+handle_scrub (RemoteDisplayMockAirplay *mock,
+	      SoupMessage              *msg,
+	      GHashTable               *query)
+{
+	const char *value;
+	char *body;
+
+	if (msg->method == SOUP_METHOD_GET) {
+		body = g_strdup_printf ("duration: %f\nposition: %f\n",
+					MOCK_DURATION, get_position (mock));
+		soup_message_set_status (msg, SOUP_STATUS_OK);
+		soup_message_set_response (msg, "text/parameters", SOUP_MEMORY_TAKE,
+					   body, strlen (body));
+		return;
+	}
+
+	value = query ? g_hash_table_lookup (query, "position") : NULL;
+	if (!value) {
+		soup_message_set_status (msg, SOUP_STATUS_BAD_REQUEST);
+		return;
+	}
+
+	set_position (mock, g_ascii_strtod (value, NULL), mock->rate);
+	soup_message_set_status (msg, SOUP_STATUS_OK);
+
+	/* Receivers buffer again after seeking */
+	if (g_strcmp0 (mock->state, "playing") == 0) {
+		GSource *source;
+
+		set_state (mock, "loading");
+		source = g_idle_source_new ();
+		g_source_set_callback (source, scrub_done_cb, g_object_ref (mock), g_object_unref);
+		g_source_attach (source, mock->context);
+		g_source_unref (source);
+	}
+}
+
+static void
+handle_playback_info (RemoteDisplayMockAirplay *mock,
+		      SoupMessage              *msg)
+{
+	plist_t dict;
+
+	dict = plist_new_dict ();
+	/* Nothing loaded has no duration or position */
+	if (g_strcmp0 (mock->state, "stopped") != 0) {
+		plist_dict_set_item (dict, "duration", plist_new_real (MOCK_DURATION));
+		plist_dict_set_item (dict, "position", plist_new_real (get_position (mock)));
+	}
+	plist_dict_set_item (dict, "rate", plist_new_real (mock->rate));
+	plist_dict_set_item (dict, "readyToPlay",
+			     plist_new_bool (g_strcmp0 (mock->state, "playing") == 0 ||
+					     g_strcmp0 (mock->state, "paused") == 0));
+	set_plist_response (msg, dict);
+	plist_free (dict);
+}
+
+static void
+handle_server_info (RemoteDisplayMockAirplay *mock,
+		    SoupMessage              *msg)
+{
+	plist_t dict;
+
+	dict = plist_new_dict ();
+	plist_dict_set_item (dict, "deviceid", plist_new_string (mock->device_id));
+	plist_dict_set_item (dict, "features", plist_new_uint (MOCK_FEATURES));
+	plist_dict_set_item (dict, "model", plist_new_string (MOCK_MODEL));
+	plist_dict_set_item (dict, "protocolVersion", plist_new_string ("1.0"));
+	plist_dict_set_item (dict, "srcvers", plist_new_string (MOCK_SRCVERS));
+	set_plist_response (msg, dict);
+	plist_free (dict);
+}
+
+typedef struct {
+	RemoteDisplayMockAirplay *mock;
+	SoupClientContext *client;
+} Upgrade;
+
+static void
+upgrade_cb (SoupMessage *msg,
+	    Upgrade     *upgrade)
+{
+	RemoteDisplayMockAirplay *mock = upgrade->mock;
+
+	/* Only the last reverse connection gets events */
+	close_events (mock);
+	mock->events = soup_client_context_steal_connection (upgrade->client);
+	mock->events_cancellable = g_cancellable_new ();
+	g_input_stream_read_async (g_io_stream_get_input_stream (mock->events),
+				   mock->events_buffer, sizeof (mock->events_buffer),
+				   G_PRIORITY_DEFAULT, mock->events_cancellable,
+				   events_read_cb, mock);
+}
+
+static void
+handle_reverse (RemoteDisplayMockAirplay *mock,
+		SoupMessage              *msg,
+		SoupClientContext        *client)
+{
+	Upgrade *upgrade;
+
+	if (g_strcmp0 (soup_message_headers_get_one (msg->request_headers, "Upgrade"), "PTTH/1.0") != 0) {
+		soup_message_set_status (msg, SOUP_STATUS_BAD_REQUEST);
+		return;
+	}
+
+	g_free (mock->session_id);
+	mock->session_id = g_strdup (soup_message_headers_get_one (msg->request_headers, "X-Apple-Session-ID"));
+
+	/* Like a websocket, the connection is taken over once
+	 * the 101 is written */
+	soup_message_set_status (msg, SOUP_STATUS_SWITCHING_PROTOCOLS);
+	soup_message_headers_replace (msg->response_headers, "Upgrade", "PTTH/1.0");
+	soup_message_headers_replace (msg->response_headers, "Connection", "Upgrade");
+
+	upgrade = g_new0 (Upgrade, 1);
+	upgrade->mock = mock;
+	upgrade->client = client;
+	g_signal_connect_data (msg, "wrote-informational", G_CALLBACK (upgrade_cb),
+			       upgrade, (GClosureNotify) g_free, 0);
+}
+
+static gboolean
+delayed_reply_cb (gpointer user_data)
+{
+	DelayedReply *reply = user_data;
+	RemoteDisplayMockAirplay *mock = reply->mock;
+
+	mock->delayed = g_list_remove (mock->delayed, reply);
+	soup_server_unpause_message (mock->server, reply->msg);
+	g_object_unref (reply->msg);
+	g_source_unref (reply->source);
+	g_free (reply);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+delay_reply (RemoteDisplayMockAirplay *mock,
+	     SoupMessage              *msg,
+	     guint                     latency_ms)
+{
+	DelayedReply *reply;
+
+	reply = g_new0 (DelayedReply, 1);
+	reply->mock = mock;
+	reply->msg = g_object_ref (msg);
+	reply->source = g_timeout_source_new (latency_ms);
+	g_source_set_callback (reply->source, delayed_reply_cb, reply, NULL);
+	g_source_attach (reply->source, mock->context);
+	mock->delayed = g_list_prepend (mock->delayed, reply);
+	soup_server_pause_message (mock->server, msg);
+}
+
+static void
+server_cb (SoupServer        *server,
+	   SoupMessage       *msg,
+	   const char        *path,
+	   GHashTable        *query,
+	   SoupClientContext *client,
+	   gpointer           user_data)
+{
+	RemoteDisplayMockAirplay *mock = user_data;
+	ScriptedReply *scripted = NULL;
+	guint latency_ms;
+
+	mock->stats.requests++;
+	g_signal_emit (mock, signals[REQUEST], 0, msg->method, path);
+
+	if (g_strcmp0 (path, "/play") == 0 || g_strcmp0 (path, "/rate") == 0 ||
+	    g_strcmp0 (path, "/scrub") == 0 || g_strcmp0 (path, "/stop") == 0)
+		scripted = g_queue_pop_head (mock->replies);
+
+	/* The client sees the connection drop, and might retry */
+	if ((scripted && scripted->status == 0) ||
+	    (!scripted && mock->loss > 0.0 && g_rand_double (mock->rand) < mock->loss)) {
+		mock->stats.dropped++;
+		g_socket_shutdown (soup_client_context_get_gsocket (client), TRUE, TRUE, NULL);
+		soup_message_set_status (msg, SOUP_STATUS_INTERNAL_SERVER_ERROR);
+		g_free (scripted);
+		return;
+	}
+
+	if (scripted && !SOUP_STATUS_IS_SUCCESSFUL (scripted->status)) {
+		mock->stats.errors++;
+		soup_message_set_status (msg, scripted->status);
+	} else if (!scripted && mock->error_rate > 0.0 &&
+		   g_rand_double (mock->rand) < mock->error_rate) {
+		mock->stats.errors++;
+		soup_message_set_status (msg, mock->error_status);
+	} else if (g_strcmp0 (path, "/reverse") == 0) {
+		handle_reverse (mock, msg, client);
+	} else if (g_strcmp0 (path, "/play") == 0) {
+		handle_play (mock, msg);
+	} else if (g_strcmp0 (path, "/rate") == 0) {
+		handle_rate (mock, msg, query);
+	} else if (g_strcmp0 (path, "/scrub") == 0) {
+		handle_scrub (mock, msg, query);
+	} else if (g_strcmp0 (path, "/stop") == 0) {
+		cancel_fetch (mock);
+		set_position (mock, 0.0, 0.0);
+		set_state (mock, "stopped");
+		soup_message_set_status (msg, SOUP_STATUS_OK);
+	} else if (g_strcmp0 (path, "/playback-info") == 0) {
+		handle_playback_info (mock, msg);
+	} else if (g_strcmp0 (path, "/server-info") == 0) {
+		handle_server_info (mock, msg);
+	} else {
+		soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+	}
+
+	latency_ms = scripted ? scripted->latency_ms : mock->latency_ms;
+	if (latency_ms > 0)
+		delay_reply (mock, msg, latency_ms);
+	g_free (scripted);
+}
+
+RemoteDisplayMockAirplay *
+remote_display_mock_airplay_new (const char *device_id)
+{
+	RemoteDisplayMockAirplay *mock;
+
+	g_return_val_if_fail (device_id != NULL, NULL);
+
+	mock = g_object_new (REMOTE_DISPLAY_TYPE_MOCK_AIRPLAY, NULL);
+	mock->device_id = g_strdup (device_id);
+
+	return mock;
+}
+
+/* Listens on a random port on the loopback interface */
+gboolean
+remote_display_mock_airplay_start (RemoteDisplayMockAirplay  *mock,
+				   GError                   **error)
+{
+	GSList *uris;
+
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_MOCK_AIRPLAY (mock), FALSE);
+	g_return_val_if_fail (mock->server == NULL, FALSE);
+
+	/* Like the server, its timeouts run in the thread-default context */
+	mock->context = g_main_context_ref_thread_default ();
+	mock->server = soup_server_new (SOUP_SERVER_SERVER_HEADER, "AirTunes/" MOCK_SRCVERS, NULL);
+	soup_server_add_handler (mock->server, NULL, server_cb, mock, NULL);
+	if (!soup_server_listen_local (mock->server, 0, SOUP_SERVER_LISTEN_IPV4_ONLY, error)) {
+		g_clear_object (&mock->server);
+		return FALSE;
+	}
+
+	uris = soup_server_get_uris (mock->server);
+	mock->port = soup_uri_get_port (uris->data);
+	g_slist_free_full (uris, (GDestroyNotify) soup_uri_free);
+
+	return TRUE;
+}
+
+guint16
+remote_display_mock_airplay_get_port (RemoteDisplayMockAirplay *mock)
+{
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_MOCK_AIRPLAY (mock), 0);
+
+	return mock->port;
+}
+
+/* Faults are injected from this seed, so runs can be repeated */
+void
+remote_display_mock_airplay_set_seed (RemoteDisplayMockAirplay *mock,
+				      guint32                   seed)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_MOCK_AIRPLAY (mock));
+
+	g_rand_set_seed (mock->rand, seed);
+}
+
+void
+remote_display_mock_airplay_set_latency (RemoteDisplayMockAirplay *mock,
+					 guint                     latency_ms)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_MOCK_AIRPLAY (mock));
+
+	mock->latency_ms = latency_ms;
+}
+
+/* The probability that a request gets its connection closed */
+void
+remote_display_mock_airplay_set_loss (RemoteDisplayMockAirplay *mock,
+				      gdouble                   probability)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_MOCK_AIRPLAY (mock));
+
+	mock->loss = CLAMP (probability, 0.0, 1.0);
+}
+
+/* The probability that a request is refused with @status */
+void
+remote_display_mock_airplay_set_errors (RemoteDisplayMockAirplay *mock,
+					gdouble                   probability,
+					guint                     status)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_MOCK_AIRPLAY (mock));
+
+	mock->error_rate = CLAMP (probability, 0.0, 1.0);
+	mock->error_status = status;
+}
+
+/* The next /play, /rate, /scrub or /stop request is answered after
+ * @latency_ms with @status, or has its connection dropped if @status
+ * is 0, instead of the faults set up above */
+void
+remote_display_mock_airplay_queue_reply (RemoteDisplayMockAirplay *mock,
+					 guint                     latency_ms,
+					 guint                     status)
+{
+	ScriptedReply *reply;
+
+	g_return_if_fail (REMOTE_DISPLAY_IS_MOCK_AIRPLAY (mock));
+
+	reply = g_new0 (ScriptedReply, 1);
+	reply->latency_ms = latency_ms;
+	reply->status = status;
+	g_queue_push_tail (mock->replies, reply);
+}
+
+/* Whether state changes caused by requests send events, turn off
+ * when the events are scripted with push_state() instead */
+void
+remote_display_mock_airplay_set_push_events (RemoteDisplayMockAirplay *mock,
+					     gboolean                  push_events)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_MOCK_AIRPLAY (mock));
+
+	mock->push_events = push_events;
+}
+
+/* Sends an event, as if the state changed on the receiver */
+void
+remote_display_mock_airplay_push_state (RemoteDisplayMockAirplay *mock,
+					const char               *state)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_MOCK_AIRPLAY (mock));
+	g_return_if_fail (state != NULL);
+
+	g_free (mock->state);
+	mock->state = g_strdup (state);
+	send_event (mock);
+}
+
+const char *
+remote_display_mock_airplay_get_state (RemoteDisplayMockAirplay *mock)
+{
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_MOCK_AIRPLAY (mock), NULL);
+
+	return mock->state;
+}
+
+void
+remote_display_mock_airplay_get_stats (RemoteDisplayMockAirplay      *mock,
+				       RemoteDisplayMockAirplayStats *stats)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_MOCK_AIRPLAY (mock));
+	g_return_if_fail (stats != NULL);
+
+	*stats = mock->stats;
+}
+
+/**
+ * remote_display_mock_airplay_get_txt:
+ *
+ * Return value: (transfer full): the TXT record the receiver would
+ * advertise, free with g_strfreev()
+ **/
+char **
+remote_display_mock_airplay_get_txt (RemoteDisplayMockAirplay *mock)
+{
+	char **txt;
+
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_MOCK_AIRPLAY (mock), NULL);
+
+	txt = g_new0 (char *, 5);
+	txt[0] = g_strdup_printf ("deviceid=%s", mock->device_id);
+	txt[1] = g_strdup_printf ("features=0x%x", MOCK_FEATURES);
+	txt[2] = g_strdup ("model=" MOCK_MODEL);
+	txt[3] = g_strdup ("srcvers=" MOCK_SRCVERS);
+
+	return txt;
+}
+
+/**
+ * remote_display_mock_airplay_new_device:
+ *
+ * Creates the device that the manager would have created
+ * after resolving the receiver.
+ *
+ * Return value: (transfer full): a new #RemoteDisplayDevice
+ **/
+RemoteDisplayDevice *
+remote_display_mock_airplay_new_device (RemoteDisplayMockAirplay *mock,
+					const char               *name)
+{
+	RemoteDisplayDevice *device;
+	AvahiStringList *txt;
+	AvahiAddress address;
+	char **strings;
+
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_MOCK_AIRPLAY (mock), NULL);
+	g_return_val_if_fail (mock->port != 0, NULL);
+
+	strings = remote_display_mock_airplay_get_txt (mock);
+	txt = avahi_string_list_new_from_array ((const char **) strings, -1);
+	g_strfreev (strings);
+	avahi_address_parse ("127.0.0.1", AVAHI_PROTO_INET, &address);
+
+	device = remote_display_device_airplay_new (if_nametoindex ("lo"), AVAHI_PROTO_INET,
+						    name, txt, "localhost", &address, mock->port);
+
+	avahi_string_list_free (txt);
+
+	return device;
+}
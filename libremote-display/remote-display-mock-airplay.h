@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#ifndef __REMOTE_DISPLAY_MOCK_AIRPLAY_H__
+#define __REMOTE_DISPLAY_MOCK_AIRPLAY_H__
+
+#include <glib-object.h>
+#include <gio/gio.h>
+#include <libremote-display/remote-display-device.h>
+
+G_BEGIN_DECLS
+
+#define REMOTE_DISPLAY_TYPE_MOCK_AIRPLAY remote_display_mock_airplay_get_type ()
+G_DECLARE_FINAL_TYPE (RemoteDisplayMockAirplay, remote_display_mock_airplay, REMOTE_DISPLAY, MOCK_AIRPLAY, GObject)
+
+typedef struct {
+	guint requests;                /* All the requests, including failed ones */
+	guint dropped;                 /* Connection closed without a reply */
+	guint errors;                  /* Replied to with the injected error */
+	guint events;                  /* Pushed through the reverse connection */
+	guint64 bytes_fetched;         /* From the played URIs */
+} RemoteDisplayMockAirplayStats;
+
+RemoteDisplayMockAirplay *remote_display_mock_airplay_new          (const char                    *device_id);
+gboolean                  remote_display_mock_airplay_start        (RemoteDisplayMockAirplay      *mock,
+								    GError                       **error);
+guint16                   remote_display_mock_airplay_get_port     (RemoteDisplayMockAirplay      *mock);
+void                      remote_display_mock_airplay_set_seed     (RemoteDisplayMockAirplay      *mock,
+								    guint32                        seed);
+void                      remote_display_mock_airplay_set_latency  (RemoteDisplayMockAirplay      *mock,
+								    guint                          latency_ms);
+void                      remote_display_mock_airplay_set_loss     (RemoteDisplayMockAirplay      *mock,
+								    gdouble                        probability);
+void                      remote_display_mock_airplay_set_errors   (RemoteDisplayMockAirplay      *mock,
+								    gdouble                        probability,
+								    guint                          status);
+void                      remote_display_mock_airplay_queue_reply  (RemoteDisplayMockAirplay      *mock,
+								    guint                          latency_ms,
+								    guint                          status);
+void                      remote_display_mock_airplay_set_push_events (RemoteDisplayMockAirplay   *mock,
+								       gboolean                    push_events);
+void                      remote_display_mock_airplay_push_state   (RemoteDisplayMockAirplay      *mock,
+								    const char                    *state);
+const char               *remote_display_mock_airplay_get_state    (RemoteDisplayMockAirplay      *mock);
+void                      remote_display_mock_airplay_get_stats    (RemoteDisplayMockAirplay      *mock,
+								    RemoteDisplayMockAirplayStats *stats);
+char                    **remote_display_mock_airplay_get_txt      (RemoteDisplayMockAirplay      *mock);
+RemoteDisplayDevice      *remote_display_mock_airplay_new_device   (RemoteDisplayMockAirplay      *mock,
+								    const char                    *name);
+
+G_END_DECLS
+
+#endif /* __REMOTE_DISPLAY_MOCK_AIRPLAY_H__ */
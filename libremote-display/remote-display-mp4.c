@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <string.h>
+
+#include <libremote-display/remote-display-mp4.h>
+
+#define FOURCC(a, b, c, d) (((guint32) (a) << 24) | ((guint32) (b) << 16) | ((guint32) (c) << 8) | (guint32) (d))
+
+#define BOX_MDAT FOURCC ('m', 'd', 'a', 't')
+#define BOX_MOOV FOURCC ('m', 'o', 'o', 'v')
+#define BOX_TRAK FOURCC ('t', 'r', 'a', 'k')
+#define BOX_MDIA FOURCC ('m', 'd', 'i', 'a')
+#define BOX_MINF FOURCC ('m', 'i', 'n', 'f')
+#define BOX_STBL FOURCC ('s', 't', 'b', 'l')
+#define BOX_STCO FOURCC ('s', 't', 'c', 'o')
+#define BOX_CO64 FOURCC ('c', 'o', '6', '4')
+#define BOX_CMOV FOURCC ('c', 'm', 'o', 'v')
+
+static guint32
+read_u32 (const guint8 *p)
+{
+	guint32 v;
+
+	memcpy (&v, p, sizeof (v));
+	return GUINT32_FROM_BE (v);
+}
+
+static guint64
+read_u64 (const guint8 *p)
+{
+	guint64 v;
+
+	memcpy (&v, p, sizeof (v));
+	return GUINT64_FROM_BE (v);
+}
+
+static void
+write_u32 (guint8  *p,
+	   guint32  value)
+{
+	value = GUINT32_TO_BE (value);
+	memcpy (p, &value, sizeof (value));
+}
+
+static void
+write_u64 (guint8  *p,
+	   guint64  value)
+{
+	value = GUINT64_TO_BE (value);
+	memcpy (p, &value, sizeof (value));
+}
+
+/* Reads the header of the box at @offset, which needs to fit */
+static gboolean
+read_box (const guint8 *data,
+	  gsize         length,
+	  gsize         offset,
+	  guint32      *type,
+	  gsize        *header_size,
+	  gsize        *box_size)
+{
+	guint64 size;
+
+	if (length - offset < 8)
+		return FALSE;
+
+	size = read_u32 (data + offset);
+	*type = read_u32 (data + offset + 4);
+	*header_size = 8;
+	if (size == 1) {
+		if (length - offset < 16)
+			return FALSE;
+		size = read_u64 (data + offset + 8);
+		*header_size = 16;
+	} else if (size == 0) {
+		/* Up to the end */
+		size = length - offset;
+	}
+
+	if (size < *header_size || size > length - offset)
+		return FALSE;
+	*box_size = size;
+
+	return TRUE;
+}
+
+/* Offsets in [@start, @end) move by @shift */
+static gboolean
+patch_chunk_offsets (guint8 *data,
+		     gsize   length,
+		     gsize   entry_size,
+		     gsize   start,
+		     gsize   end,
+		     gsize   shift)
+{
+	guint32 i, n_entries;
+	guint64 offset;
+	guint8 *p;
+
+	/* Version and flags, then the entries */
+	if (length < 8)
+		return FALSE;
+	n_entries = read_u32 (data + 4);
+	if ((length - 8) / entry_size < n_entries)
+		return FALSE;
+
+	for (i = 0, p = data + 8; i < n_entries; i++, p += entry_size) {
+		offset = entry_size == 4 ? read_u32 (p) : read_u64 (p);
+		if (offset < start || offset >= end)
+			continue;
+		offset += shift;
+		if (entry_size == 4) {
+			/* Would need growing the box into co64 */
+			if (offset > G_MAXUINT32)
+				return FALSE;
+			write_u32 (p, offset);
+		} else {
+			write_u64 (p, offset);
+		}
+	}
+
+	return TRUE;
+}
+
+/* Walks the boxes that lead to the sample tables */
+static gboolean
+patch_boxes (guint8 *data,
+	     gsize   length,
+	     gsize   start,
+	     gsize   end,
+	     gsize   shift)
+{
+	gsize offset, header_size, box_size;
+	guint32 type;
+	guint8 *child;
+	gsize child_length;
+	gboolean ret = TRUE;
+
+	for (offset = 0; ret && offset < length; offset += box_size) {
+		if (!read_box (data, length, offset, &type, &header_size, &box_size))
+			return FALSE;
+		child = data + offset + header_size;
+		child_length = box_size - header_size;
+
+		switch (type) {
+		case BOX_TRAK:
+		case BOX_MDIA:
+		case BOX_MINF:
+		case BOX_STBL:
+			ret = patch_boxes (child, child_length, start, end, shift);
+			break;
+		case BOX_STCO:
+			ret = patch_chunk_offsets (child, child_length, 4, start, end, shift);
+			break;
+		case BOX_CO64:
+			ret = patch_chunk_offsets (child, child_length, 8, start, end, shift);
+			break;
+		case BOX_CMOV:
+			/* Compressed, can't be patched */
+			ret = FALSE;
+			break;
+		default:
+			break;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * remote_display_mp4_faststart:
+ * @data: the file's contents
+ * @length: the file's size
+ * @faststart: (out): where to store the layout
+ *
+ * Checks whether @data is an MP4 or QuickTime file with its moov
+ * box after the media data, and builds the patched moov box to
+ * serve before it, so that receivers don't need to seek to the
+ * end of the file before they can start playing.
+ *
+ * Return value: %TRUE if @faststart was filled in, %FALSE if the
+ * file doesn't need it, or isn't a file that can be rearranged.
+ **/
+gboolean
+remote_display_mp4_faststart (const guint8              *data,
+			      gsize                      length,
+			      RemoteDisplayMp4Faststart *faststart)
+{
+	gsize offset, header_size, box_size;
+	gsize mdat_offset = 0, moov_offset = 0, moov_size = 0;
+	gboolean have_mdat = FALSE, have_moov = FALSE;
+	guint32 type;
+	guint8 *moov;
+
+	g_return_val_if_fail (faststart != NULL, FALSE);
+
+	/* All the top-level boxes need to make sense, so that we
+	 * don't rearrange files that only look like MP4s */
+	for (offset = 0; offset < length; offset += box_size) {
+		if (!read_box (data, length, offset, &type, &header_size, &box_size))
+			return FALSE;
+		if (type == BOX_MDAT && !have_mdat) {
+			mdat_offset = offset;
+			have_mdat = TRUE;
+		} else if (type == BOX_MOOV) {
+			if (have_moov)
+				return FALSE;
+			moov_offset = offset;
+			moov_size = box_size;
+			have_moov = TRUE;
+		}
+	}
+
+	if (!have_moov || !have_mdat || moov_offset < mdat_offset)
+		return FALSE;
+
+	/* Media data between the first mdat and the moov box moves
+	 * back by the size of the moov box */
+	moov = g_malloc (moov_size);
+	memcpy (moov, data + moov_offset, moov_size);
+	read_box (moov, moov_size, 0, &type, &header_size, &box_size);
+	if (read_u32 (moov) == 0) {
+		/* Went up to the end of the file, it won't anymore */
+		if (moov_size > G_MAXUINT32) {
+			g_free (moov);
+			return FALSE;
+		}
+		write_u32 (moov, moov_size);
+	}
+	if (!patch_boxes (moov + header_size, moov_size - header_size,
+			  mdat_offset, moov_offset, moov_size)) {
+		g_free (moov);
+		return FALSE;
+	}
+
+	faststart->insert_offset = mdat_offset;
+	faststart->moov_offset = moov_offset;
+	faststart->moov = g_bytes_new_take (moov, moov_size);
+
+	return TRUE;
+}
+
+void
+remote_display_mp4_faststart_clear (RemoteDisplayMp4Faststart *faststart)
+{
+	g_clear_pointer (&faststart->moov, g_bytes_unref);
+}
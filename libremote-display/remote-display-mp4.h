@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __REMOTE_DISPLAY_MP4_H__
+#define __REMOTE_DISPLAY_MP4_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* How to serve an MP4 file with its moov box at the end as if it
+ * was at the start, before the first mdat box: the bytes before
+ * @insert_offset, @moov, then the rest of the file without the
+ * original moov box, which is @moov's size at @moov_offset. The
+ * chunk offsets in @moov are patched for that layout, so that the
+ * file keeps its size. */
+typedef struct {
+	gsize insert_offset;
+	gsize moov_offset;
+	GBytes *moov;
+} RemoteDisplayMp4Faststart;
+
+gboolean remote_display_mp4_faststart       (const guint8              *data,
+					     gsize                      length,
+					     RemoteDisplayMp4Faststart *faststart);
+void     remote_display_mp4_faststart_clear (RemoteDisplayMp4Faststart *faststart);
+
+G_END_DECLS
+
+#endif /* __REMOTE_DISPLAY_MP4_H__ */
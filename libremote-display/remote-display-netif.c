@@ -0,0 +1,618 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <ifaddrs.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include <glib-unix.h>
+
+#include <libremote-display/remote-display-netif.h>
+
+#define NETLINK_BUFFER_SIZE 16384
+
+/* Packs an interface index and an address family
+ * into a hash table key */
+#define ADDRESS_KEY(ifindex, family) GUINT_TO_POINTER (((ifindex) << 8) | ((family) & 0xff))
+#define KEY_IFINDEX(key) (GPOINTER_TO_UINT (key) >> 8)
+#define KEY_FAMILY(key) (GPOINTER_TO_UINT (key) & 0xff)
+
+typedef struct {
+	GInetAddress *address;
+	guint prefix_length;                   /* Of the subnet */
+} NetifAddress;
+
+struct _RemoteDisplayNetif {
+	GObject parent_instance;
+
+	/* ADDRESS_KEY to a GPtrArray of NetifAddress, in the
+	 * order the kernel gave them, the first one is used */
+	GHashTable *addresses;
+	/* While reloading, the addresses before the reload */
+	GHashTable *previous;
+
+	int fd;
+	guint watch_id;
+	guint32 dump_seq;
+
+	/* Only used when netlink isn't available */
+	GNetworkMonitor *monitor;
+	gulong monitor_id;
+};
+
+G_DEFINE_TYPE (RemoteDisplayNetif, remote_display_netif, G_TYPE_OBJECT);
+
+enum {
+	CHANGED,
+	NUM_SIGS
+};
+
+static guint signals[NUM_SIGS] = {0,};
+
+static void
+netif_address_free (NetifAddress *entry)
+{
+	g_object_unref (entry->address);
+	g_free (entry);
+}
+
+/* Whether the first prefix_length bits of both addresses match */
+static gboolean
+netif_address_matches (NetifAddress *entry,
+		       GInetAddress *address)
+{
+	const guint8 *a, *b;
+	guint bits, i;
+
+	/* No subnet known */
+	if (entry->prefix_length == 0)
+		return FALSE;
+	if (g_inet_address_get_family (entry->address) != g_inet_address_get_family (address))
+		return FALSE;
+
+	a = g_inet_address_to_bytes (entry->address);
+	b = g_inet_address_to_bytes (address);
+	bits = MIN (entry->prefix_length, g_inet_address_get_native_size (address) * 8);
+	for (i = 0; i < bits / 8; i++) {
+		if (a[i] != b[i])
+			return FALSE;
+	}
+	if (bits % 8 != 0) {
+		guint8 mask = 0xff << (8 - bits % 8);
+		if ((a[i] & mask) != (b[i] & mask))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static GHashTable *
+address_table_new (void)
+{
+	return g_hash_table_new_full (g_direct_hash, g_direct_equal,
+				      NULL, (GDestroyNotify) g_ptr_array_unref);
+}
+
+static GInetAddress *
+table_lookup (GHashTable *table,
+	      gpointer    key)
+{
+	GPtrArray *array;
+
+	array = g_hash_table_lookup (table, key);
+	if (!array || array->len == 0)
+		return NULL;
+	return ((NetifAddress *) g_ptr_array_index (array, 0))->address;
+}
+
+static void
+emit_changed (RemoteDisplayNetif *netif,
+	      gpointer            key)
+{
+	g_debug ("Address for interface %u, family %u changed",
+		 KEY_IFINDEX (key), KEY_FAMILY (key));
+	g_signal_emit (netif, signals[CHANGED], 0, KEY_IFINDEX (key), KEY_FAMILY (key));
+}
+
+/* Returns TRUE if the address used for the interface changed */
+static gboolean
+add_address (RemoteDisplayNetif *netif,
+	     gpointer            key,
+	     GInetAddress       *address,
+	     guint               prefix_length)
+{
+	NetifAddress *entry;
+	GPtrArray *array;
+	guint i;
+
+	array = g_hash_table_lookup (netif->addresses, key);
+	if (!array) {
+		array = g_ptr_array_new_with_free_func ((GDestroyNotify) netif_address_free);
+		g_hash_table_insert (netif->addresses, key, array);
+	}
+
+	for (i = 0; i < array->len; i++) {
+		entry = g_ptr_array_index (array, i);
+		if (g_inet_address_equal (entry->address, address)) {
+			/* The subnet can change without the address changing */
+			entry->prefix_length = prefix_length;
+			return FALSE;
+		}
+	}
+
+	entry = g_new0 (NetifAddress, 1);
+	entry->address = g_object_ref (address);
+	entry->prefix_length = prefix_length;
+	g_ptr_array_add (array, entry);
+	return array->len == 1;
+}
+
+static gboolean
+remove_address (RemoteDisplayNetif *netif,
+		gpointer            key,
+		GInetAddress       *address)
+{
+	GPtrArray *array;
+	guint i;
+
+	array = g_hash_table_lookup (netif->addresses, key);
+	if (!array)
+		return FALSE;
+
+	for (i = 0; i < array->len; i++) {
+		NetifAddress *entry = g_ptr_array_index (array, i);
+
+		if (g_inet_address_equal (entry->address, address)) {
+			g_ptr_array_remove_index (array, i);
+			return i == 0;
+		}
+	}
+
+	return FALSE;
+}
+
+/* A reload rebuilds the table from scratch, and only signals
+ * the interfaces for which the address changed once finished */
+static void
+begin_reload (RemoteDisplayNetif *netif)
+{
+	if (netif->previous) {
+		g_hash_table_remove_all (netif->addresses);
+		return;
+	}
+	netif->previous = netif->addresses;
+	netif->addresses = address_table_new ();
+}
+
+static void
+finish_reload (RemoteDisplayNetif *netif)
+{
+	GHashTable *previous;
+	GHashTableIter iter;
+	gpointer key;
+
+	previous = netif->previous;
+	netif->previous = NULL;
+	if (!previous)
+		return;
+
+	g_hash_table_iter_init (&iter, previous);
+	while (g_hash_table_iter_next (&iter, &key, NULL)) {
+		GInetAddress *old, *new;
+
+		old = table_lookup (previous, key);
+		new = table_lookup (netif->addresses, key);
+		if (old == NULL && new == NULL)
+			continue;
+		if (old == NULL || new == NULL || !g_inet_address_equal (old, new))
+			emit_changed (netif, key);
+	}
+
+	g_hash_table_iter_init (&iter, netif->addresses);
+	while (g_hash_table_iter_next (&iter, &key, NULL)) {
+		if (table_lookup (previous, key) == NULL &&
+		    table_lookup (netif->addresses, key) != NULL)
+			emit_changed (netif, key);
+	}
+
+	g_hash_table_unref (previous);
+}
+
+/* The number of leading bits set in a netmask */
+static guint
+netmask_length (const struct sockaddr *netmask)
+{
+	const guint8 *bytes;
+	guint len, i, length = 0;
+
+	if (netmask == NULL)
+		return 0;
+	if (netmask->sa_family == AF_INET) {
+		bytes = (const guint8 *) &((const struct sockaddr_in *) netmask)->sin_addr;
+		len = 4;
+	} else if (netmask->sa_family == AF_INET6) {
+		bytes = (const guint8 *) &((const struct sockaddr_in6 *) netmask)->sin6_addr;
+		len = 16;
+	} else {
+		return 0;
+	}
+
+	for (i = 0; i < len; i++) {
+		guint8 byte = bytes[i];
+
+		while (byte & 0x80) {
+			length++;
+			byte <<= 1;
+		}
+		if (bytes[i] != 0xff)
+			break;
+	}
+
+	return length;
+}
+
+static void
+load_from_getifaddrs (RemoteDisplayNetif *netif)
+{
+	struct ifaddrs *ifaddr, *ifa;
+
+	if (getifaddrs (&ifaddr) == -1) {
+		g_warning ("getifaddrs failed: %s", g_strerror (errno));
+		return;
+	}
+
+	for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
+		GInetAddress *address;
+		guint ifindex;
+		int family;
+
+		if (ifa->ifa_addr == NULL)
+			continue;
+		family = ifa->ifa_addr->sa_family;
+		if (family == AF_INET)
+			address = g_inet_address_new_from_bytes ((guint8 *) &((struct sockaddr_in *) ifa->ifa_addr)->sin_addr,
+								 G_SOCKET_FAMILY_IPV4);
+		else if (family == AF_INET6)
+			address = g_inet_address_new_from_bytes ((guint8 *) &((struct sockaddr_in6 *) ifa->ifa_addr)->sin6_addr,
+								 G_SOCKET_FAMILY_IPV6);
+		else
+			continue;
+
+		ifindex = if_nametoindex (ifa->ifa_name);
+		if (ifindex != 0)
+			add_address (netif, ADDRESS_KEY (ifindex, family), address,
+				     netmask_length (ifa->ifa_netmask));
+		g_object_unref (address);
+	}
+
+	freeifaddrs (ifaddr);
+}
+
+static void
+network_changed_cb (GNetworkMonitor    *monitor,
+		    gboolean            available,
+		    RemoteDisplayNetif *netif)
+{
+	begin_reload (netif);
+	load_from_getifaddrs (netif);
+	finish_reload (netif);
+}
+
+static gboolean
+request_dump (RemoteDisplayNetif *netif)
+{
+	struct {
+		struct nlmsghdr header;
+		struct ifaddrmsg msg;
+	} req;
+
+	memset (&req, 0, sizeof(req));
+	req.header.nlmsg_len = NLMSG_LENGTH (sizeof(struct ifaddrmsg));
+	req.header.nlmsg_type = RTM_GETADDR;
+	req.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.header.nlmsg_seq = ++netif->dump_seq;
+	req.msg.ifa_family = AF_UNSPEC;
+
+	if (send (netif->fd, &req, req.header.nlmsg_len, 0) < 0) {
+		g_warning ("Failed to request interface addresses: %s", g_strerror (errno));
+		return FALSE;
+	}
+
+	begin_reload (netif);
+	return TRUE;
+}
+
+static void
+handle_address_message (RemoteDisplayNetif *netif,
+			struct nlmsghdr    *header)
+{
+	struct ifaddrmsg *msg = NLMSG_DATA (header);
+	struct rtattr *rta;
+	const void *local = NULL, *addr = NULL;
+	GInetAddress *address;
+	gpointer key;
+	gboolean changed;
+	int len;
+
+	if (msg->ifa_family != AF_INET && msg->ifa_family != AF_INET6)
+		return;
+
+	len = IFA_PAYLOAD (header);
+	for (rta = IFA_RTA (msg); RTA_OK (rta, len); rta = RTA_NEXT (rta, len)) {
+		if (rta->rta_type == IFA_LOCAL)
+			local = RTA_DATA (rta);
+		else if (rta->rta_type == IFA_ADDRESS)
+			addr = RTA_DATA (rta);
+	}
+
+	/* On point-to-point links, IFA_ADDRESS is the remote end */
+	if (local)
+		addr = local;
+	if (!addr)
+		return;
+
+	address = g_inet_address_new_from_bytes (addr, msg->ifa_family);
+	key = ADDRESS_KEY (msg->ifa_index, msg->ifa_family);
+
+	/* Addresses still going through duplicate detection
+	 * can't be bound to yet */
+	if (header->nlmsg_type == RTM_NEWADDR &&
+	    !(msg->ifa_flags & (IFA_F_TENTATIVE | IFA_F_DADFAILED)))
+		changed = add_address (netif, key, address, msg->ifa_prefixlen);
+	else
+		changed = remove_address (netif, key, address);
+	g_object_unref (address);
+
+	if (changed && !netif->previous)
+		emit_changed (netif, key);
+}
+
+/* Returns FALSE if the socket is unusable */
+static gboolean
+read_messages (RemoteDisplayNetif *netif,
+	       int                 flags)
+{
+	guint32 buffer[NETLINK_BUFFER_SIZE / sizeof(guint32)];
+	struct nlmsghdr *header;
+	ssize_t len;
+
+	while (TRUE) {
+		len = recv (netif->fd, buffer, sizeof(buffer), flags);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return TRUE;
+			if (errno == ENOBUFS) {
+				/* We missed events, start over */
+				if (!request_dump (netif))
+					return FALSE;
+				continue;
+			}
+			g_warning ("Failed to read from netlink: %s", g_strerror (errno));
+			return FALSE;
+		}
+
+		for (header = (struct nlmsghdr *) buffer;
+		     NLMSG_OK (header, len);
+		     header = NLMSG_NEXT (header, len)) {
+			switch (header->nlmsg_type) {
+			case RTM_NEWADDR:
+			case RTM_DELADDR:
+				handle_address_message (netif, header);
+				break;
+			case NLMSG_ERROR:
+			case NLMSG_DONE:
+				if (header->nlmsg_seq == netif->dump_seq)
+					finish_reload (netif);
+				break;
+			default:
+				break;
+			}
+		}
+
+		/* The initial dump is read synchronously */
+		if (!(flags & MSG_DONTWAIT) && !netif->previous)
+			return TRUE;
+	}
+}
+
+static gboolean
+netlink_cb (gint         fd,
+	    GIOCondition condition,
+	    gpointer     user_data)
+{
+	RemoteDisplayNetif *netif = user_data;
+
+	if (!read_messages (netif, MSG_DONTWAIT)) {
+		netif->watch_id = 0;
+		return G_SOURCE_REMOVE;
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+setup_netlink (RemoteDisplayNetif *netif)
+{
+	struct sockaddr_nl addr;
+
+	netif->fd = socket (AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (netif->fd < 0)
+		return FALSE;
+
+	memset (&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+	if (bind (netif->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+	    !request_dump (netif) ||
+	    !read_messages (netif, 0)) {
+		close (netif->fd);
+		netif->fd = -1;
+		g_clear_pointer (&netif->previous, g_hash_table_unref);
+		g_hash_table_remove_all (netif->addresses);
+		return FALSE;
+	}
+
+	netif->watch_id = g_unix_fd_add (netif->fd, G_IO_IN, netlink_cb, netif);
+	return TRUE;
+}
+
+static void
+remote_display_netif_finalize (GObject *object)
+{
+	RemoteDisplayNetif *netif = REMOTE_DISPLAY_NETIF (object);
+
+	if (netif->watch_id != 0)
+		g_source_remove (netif->watch_id);
+	if (netif->fd >= 0)
+		close (netif->fd);
+	if (netif->monitor_id != 0)
+		g_signal_handler_disconnect (netif->monitor, netif->monitor_id);
+	g_clear_pointer (&netif->addresses, g_hash_table_unref);
+	g_clear_pointer (&netif->previous, g_hash_table_unref);
+
+	G_OBJECT_CLASS (remote_display_netif_parent_class)->finalize (object);
+}
+
+static void
+remote_display_netif_class_init (RemoteDisplayNetifClass *klass)
+{
+	GObjectClass *o_class = (GObjectClass *)klass;
+
+	o_class->finalize = remote_display_netif_finalize;
+
+	/**
+	 * RemoteDisplayNetif::changed:
+	 * @netif: the interface monitor
+	 * @ifindex: the interface index
+	 * @family: the #GSocketFamily of the address
+	 *
+	 * Emitted when the address that remote_display_netif_lookup()
+	 * would return for @ifindex and @family changed.
+	 **/
+	signals[CHANGED] = g_signal_new ("changed",
+					 REMOTE_DISPLAY_TYPE_NETIF,
+					 G_SIGNAL_RUN_FIRST,
+					 0, NULL, NULL,
+					 g_cclosure_marshal_generic,
+					 G_TYPE_NONE,
+					 2, G_TYPE_UINT, G_TYPE_INT);
+}
+
+static void
+remote_display_netif_init (RemoteDisplayNetif *netif)
+{
+	netif->fd = -1;
+	netif->addresses = address_table_new ();
+
+	if (setup_netlink (netif))
+		return;
+
+	g_debug ("netlink not available, using getifaddrs");
+	load_from_getifaddrs (netif);
+	netif->monitor = g_network_monitor_get_default ();
+	netif->monitor_id = g_signal_connect (netif->monitor, "network-changed",
+					      G_CALLBACK (network_changed_cb), netif);
+}
+
+/**
+ * remote_display_netif_get:
+ *
+ * Returns the interface address monitor shared by all the devices,
+ * creating it if needed. It may only be used from the main thread.
+ *
+ * Return value: (transfer full): a #RemoteDisplayNetif
+ **/
+RemoteDisplayNetif *
+remote_display_netif_get (void)
+{
+	static RemoteDisplayNetif *netif = NULL;
+
+	if (netif)
+		return g_object_ref (netif);
+
+	netif = g_object_new (REMOTE_DISPLAY_TYPE_NETIF, NULL);
+	g_object_add_weak_pointer (G_OBJECT (netif), (gpointer *) &netif);
+
+	return netif;
+}
+
+/**
+ * remote_display_netif_lookup:
+ * @netif: a #RemoteDisplayNetif
+ * @ifindex: an interface index
+ * @family: the address family wanted
+ *
+ * Return value: (transfer full): the address to use on that
+ * interface, or %NULL if it doesn't have any
+ **/
+GInetAddress *
+remote_display_netif_lookup (RemoteDisplayNetif *netif,
+			     guint               ifindex,
+			     GSocketFamily       family)
+{
+	GInetAddress *address;
+
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_NETIF (netif), NULL);
+
+	address = table_lookup (netif->addresses, ADDRESS_KEY (ifindex, family));
+	return address ? g_object_ref (address) : NULL;
+}
+
+/**
+ * remote_display_netif_find_subnet:
+ * @netif: a #RemoteDisplayNetif
+ * @address: a remote address
+ *
+ * Finds the interface with an address on the same subnet as
+ * @address, for sockets that don't tell which interface a
+ * packet came in on.
+ *
+ * Return value: the interface index, or 0 if none matches
+ **/
+guint
+remote_display_netif_find_subnet (RemoteDisplayNetif *netif,
+				  GInetAddress       *address)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	guint i;
+
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_NETIF (netif), 0);
+	g_return_val_if_fail (G_IS_INET_ADDRESS (address), 0);
+
+	g_hash_table_iter_init (&iter, netif->addresses);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		GPtrArray *array = value;
+
+		for (i = 0; i < array->len; i++) {
+			if (netif_address_matches (g_ptr_array_index (array, i), address))
+				return KEY_IFINDEX (key);
+		}
+	}
+
+	return 0;
+}
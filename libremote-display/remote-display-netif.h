@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#ifndef __REMOTE_DISPLAY_NETIF_H__
+#define __REMOTE_DISPLAY_NETIF_H__
+
+#include <glib-object.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define REMOTE_DISPLAY_TYPE_NETIF remote_display_netif_get_type ()
+G_DECLARE_FINAL_TYPE (RemoteDisplayNetif, remote_display_netif, REMOTE_DISPLAY, NETIF, GObject)
+
+RemoteDisplayNetif *remote_display_netif_get         (void);
+GInetAddress       *remote_display_netif_lookup      (RemoteDisplayNetif *netif,
+						      guint               ifindex,
+						      GSocketFamily       family);
+guint               remote_display_netif_find_subnet (RemoteDisplayNetif *netif,
+						      GInetAddress       *address);
+
+G_END_DECLS
+
+#endif /* __REMOTE_DISPLAY_NETIF_H__ */
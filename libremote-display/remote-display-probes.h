@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __REMOTE_DISPLAY_PROBES_H__
+#define __REMOTE_DISPLAY_PROBES_H__
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* Static trace points, in the "remote_display" provider, for perf,
+ * bpftrace or SystemTap. When nobody is tracing, each one is a nop
+ * instruction, and its arguments are values already at hand.
+ *
+ * Discovery, strings are the service type and name:
+ *   browse_new (type, name)
+ *   browse_remove (type, name)
+ *   resolve_start (type, name, attempt)
+ *   resolve_done (type, name, result)        1 found, 0 failed, -1 timed out
+ *   device_new (device, name, source)        "mdns", "cache", "dlna" or "service"
+ *
+ * Device control, action is the command's name:
+ *   action_enqueue (device, action)
+ *   action_send (device, action)
+ *   action_complete (device, action, status) the HTTP status
+ *   event (device, state)                    from the receiver
+ *
+ * Serving files, msg identifies the request:
+ *   host_request_start (msg, path)
+ *   host_first_byte (msg)
+ *   host_request_finish (msg, status, bytes)
+ *
+ * For example:
+ *   perf buildid-cache --add libremote-display.so
+ *   perf probe sdt_remote_display:action_send
+ */
+
+#ifdef HAVE_SDT_PROBES
+
+#include <sys/sdt.h>
+
+#define REMOTE_DISPLAY_PROBE0(name)          DTRACE_PROBE (remote_display, name)
+#define REMOTE_DISPLAY_PROBE1(name, a)       DTRACE_PROBE1 (remote_display, name, a)
+#define REMOTE_DISPLAY_PROBE2(name, a, b)    DTRACE_PROBE2 (remote_display, name, a, b)
+#define REMOTE_DISPLAY_PROBE3(name, a, b, c) DTRACE_PROBE3 (remote_display, name, a, b, c)
+
+#else
+
+#define REMOTE_DISPLAY_PROBE0(name)          do { } while (0)
+#define REMOTE_DISPLAY_PROBE1(name, a)       do { } while (0)
+#define REMOTE_DISPLAY_PROBE2(name, a, b)    do { } while (0)
+#define REMOTE_DISPLAY_PROBE3(name, a, b, c) do { } while (0)
+
+#endif /* HAVE_SDT_PROBES */
+
+#endif /* __REMOTE_DISPLAY_PROBES_H__ */
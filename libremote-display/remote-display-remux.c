@@ -0,0 +1,2014 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <string.h>
+
+#include <libremote-display/remote-display-remux.h>
+#include <libremote-display/remote-display-error.h>
+
+#define TICKS_PER_SECOND    90000       /* MPEG-TS clock, and the video timescale */
+#define FRAGMENT_DURATION   TICKS_PER_SECOND
+#define DEFAULT_FRAME_TICKS 3000        /* 30 fps */
+#define AAC_FRAME_SAMPLES   1024
+
+#define SAMPLE_FLAGS_SYNC     0x02000000  /* Depends on no other sample */
+#define SAMPLE_FLAGS_NON_SYNC 0x01010000
+
+#define NAL_IDR 5
+#define NAL_SPS 7
+#define NAL_PPS 8
+
+#define TS_PACKET_SIZE  188
+#define TS_SYNC_BYTE    0x47
+#define TS_STREAM_AAC   0x0f
+#define TS_STREAM_H264  0x1b
+
+/* Matroska element IDs, with their length marker */
+#define MKV_EBML             0x1a45dfa3
+#define MKV_SEGMENT          0x18538067
+#define MKV_SEEK_HEAD        0x114d9b74
+#define MKV_INFO             0x1549a966
+#define MKV_TIMECODE_SCALE   0x2ad7b1
+#define MKV_TRACKS           0x1654ae6b
+#define MKV_TRACK_ENTRY      0xae
+#define MKV_TRACK_NUMBER     0xd7
+#define MKV_TRACK_TYPE       0x83
+#define MKV_CODEC_ID         0x86
+#define MKV_CODEC_PRIVATE    0x63a2
+#define MKV_CONTENT_ENCODINGS 0x6d80
+#define MKV_VIDEO            0xe0
+#define MKV_PIXEL_WIDTH      0xb0
+#define MKV_PIXEL_HEIGHT     0xba
+#define MKV_AUDIO            0xe1
+#define MKV_CHANNELS         0x9f
+#define MKV_CLUSTER          0x1f43b675
+#define MKV_TIMECODE         0xe7
+#define MKV_SIMPLE_BLOCK     0xa3
+#define MKV_BLOCK_GROUP      0xa0
+#define MKV_BLOCK            0xa1
+#define MKV_REFERENCE_BLOCK  0xfb
+#define MKV_CUES             0x1c53bb6b
+#define MKV_ATTACHMENTS      0x1941a469
+#define MKV_CHAPTERS         0x1043a770
+#define MKV_TAGS             0x1254c367
+#define MKV_UNKNOWN_SIZE     G_MAXUINT64
+#define MKV_MAX_TIMECODE_SCALE 1000000000 /* ns, a second per tick */
+
+static const guint aac_sample_rates[] = {
+	96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350
+};
+
+typedef struct {
+	guint64 offset;          /* In the file, or in the elementary stream for MPEG-TS */
+	guint32 size;            /* In the source */
+	guint32 out_size;        /* In the fragmented MP4 */
+	gint64 dts;              /* In 90kHz ticks while indexing, then in the track's timescale */
+	guint32 cts;             /* Presentation offset */
+	guint32 duration;
+	gboolean keyframe;
+} Sample;
+
+/* Where a part of an MPEG-TS elementary stream is in the file */
+typedef struct {
+	guint64 es_offset;
+	guint64 file_offset;
+	guint32 length;
+} Piece;
+
+typedef struct {
+	guint32 id;
+	gboolean video;
+	guint32 timescale;
+	GArray *samples;         /* Sample, in decoding order */
+	GArray *pieces;          /* Piece, for MPEG-TS, or %NULL */
+	guint64 es_length;
+	gboolean annexb;         /* H.264 with start codes, turned into lengths */
+
+	GByteArray *config;      /* avcC for H.264, AudioSpecificConfig for AAC */
+	GByteArray *sps;
+	GByteArray *pps;
+	guint width;
+	guint height;
+	guint sample_rate;
+	guint channels;
+} Track;
+
+typedef struct {
+	goffset offset;          /* In the fragmented MP4 */
+	guint32 size;
+	guint32 moof_size;
+	guint first[2];          /* For each track */
+	guint count[2];
+} Fragment;
+
+struct _RemoteDisplayRemux {
+	GBytes *bytes;           /* The whole mapping */
+	const guint8 *data;
+	gsize length;
+
+	Track *tracks[2];        /* The video, then the audio, if any */
+	guint n_tracks;
+
+	GBytes *init;            /* ftyp and moov */
+	GArray *fragments;       /* Fragment, the seek index */
+	goffset total_length;
+};
+
+#define SAMPLE(track, i) (&g_array_index ((track)->samples, Sample, (i)))
+
+static guint16
+read_u16 (const guint8 *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static guint32
+read_u32 (const guint8 *p)
+{
+	return ((guint32) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void
+write_u32 (guint8  *p,
+	   guint32  value)
+{
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+static void
+put_u8 (GByteArray *ba,
+	guint8      value)
+{
+	g_byte_array_append (ba, &value, 1);
+}
+
+static void
+put_u16 (GByteArray *ba,
+	 guint16     value)
+{
+	guint8 p[2] = { value >> 8, value };
+
+	g_byte_array_append (ba, p, 2);
+}
+
+static void
+put_u32 (GByteArray *ba,
+	 guint32     value)
+{
+	guint8 p[4];
+
+	write_u32 (p, value);
+	g_byte_array_append (ba, p, 4);
+}
+
+static void
+put_u64 (GByteArray *ba,
+	 guint64     value)
+{
+	put_u32 (ba, value >> 32);
+	put_u32 (ba, value);
+}
+
+static void
+put_zeros (GByteArray *ba,
+	   guint       n)
+{
+	guint len = ba->len;
+
+	g_byte_array_set_size (ba, len + n);
+	memset (ba->data + len, 0, n);
+}
+
+static void
+put_fourcc (GByteArray *ba,
+	    const char *fourcc)
+{
+	g_byte_array_append (ba, (const guint8 *) fourcc, 4);
+}
+
+static guint
+box_start (GByteArray *ba,
+	   const char *type)
+{
+	guint offset = ba->len;
+
+	put_u32 (ba, 0);
+	put_fourcc (ba, type);
+	return offset;
+}
+
+static guint
+full_box_start (GByteArray *ba,
+		const char *type,
+		guint8      version,
+		guint32     flags)
+{
+	guint offset;
+
+	offset = box_start (ba, type);
+	put_u32 (ba, ((guint32) version << 24) | flags);
+	return offset;
+}
+
+static void
+box_end (GByteArray *ba,
+	 guint       offset)
+{
+	write_u32 (ba->data + offset, ba->len - offset);
+}
+
+static Track *
+track_new (guint32  id,
+	   gboolean video)
+{
+	Track *track;
+
+	track = g_new0 (Track, 1);
+	track->id = id;
+	track->video = video;
+	track->samples = g_array_new (FALSE, FALSE, sizeof (Sample));
+	return track;
+}
+
+static void
+track_free (Track *track)
+{
+	g_array_unref (track->samples);
+	if (track->pieces)
+		g_array_unref (track->pieces);
+	if (track->config)
+		g_byte_array_unref (track->config);
+	if (track->sps)
+		g_byte_array_unref (track->sps);
+	if (track->pps)
+		g_byte_array_unref (track->pps);
+	g_free (track);
+}
+
+/* H.264 */
+
+/* Returns @length if there are no more start codes */
+static gsize
+find_start_code (const guint8 *data,
+		 gsize         length,
+		 gsize         pos)
+{
+	while (pos + 3 <= length) {
+		if (data[pos + 2] > 1)
+			pos += 3;
+		else if (data[pos + 2] == 0)
+			pos++;
+		else if (data[pos] == 0 && data[pos + 1] == 0)
+			return pos;
+		else
+			pos += 3;
+	}
+	return length;
+}
+
+/* Iterates over the NAL units of an access unit with start codes */
+static gboolean
+next_nal (const guint8  *data,
+	  gsize          length,
+	  gsize         *pos,
+	  const guint8 **nal,
+	  gsize         *nal_length)
+{
+	gsize start, end;
+
+	start = find_start_code (data, length, *pos);
+	if (start >= length)
+		return FALSE;
+	start += 3;
+	end = find_start_code (data, length, start);
+	*pos = end;
+
+	/* The zero of 4-byte start codes, and trailing zeros,
+	 * aren't part of the NAL unit */
+	while (end > start && data[end - 1] == 0)
+		end--;
+	*nal = data + start;
+	*nal_length = end - start;
+
+	return TRUE;
+}
+
+/* Returns the size of the access unit with lengths instead of start
+ * codes, keeping the first parameter sets for the avcC box */
+static gsize
+scan_access_unit (Track        *track,
+		  const guint8 *data,
+		  gsize         length,
+		  gboolean     *keyframe)
+{
+	const guint8 *nal;
+	gsize nal_length, pos = 0, size = 0;
+
+	*keyframe = FALSE;
+	while (next_nal (data, length, &pos, &nal, &nal_length)) {
+		if (nal_length == 0)
+			continue;
+		switch (nal[0] & 0x1f) {
+		case NAL_IDR:
+			*keyframe = TRUE;
+			break;
+		case NAL_SPS:
+			if (!track->sps)
+				track->sps = g_byte_array_append (g_byte_array_new (), nal, nal_length);
+			break;
+		case NAL_PPS:
+			if (!track->pps)
+				track->pps = g_byte_array_append (g_byte_array_new (), nal, nal_length);
+			break;
+		default:
+			break;
+		}
+		size += 4 + nal_length;
+	}
+
+	return size;
+}
+
+/* The same walk as scan_access_unit() */
+static gsize
+write_avcc (const guint8 *data,
+	    gsize         length,
+	    guint8       *dest)
+{
+	const guint8 *nal;
+	gsize nal_length, pos = 0, size = 0;
+
+	while (next_nal (data, length, &pos, &nal, &nal_length)) {
+		if (nal_length == 0)
+			continue;
+		write_u32 (dest + size, nal_length);
+		memcpy (dest + size + 4, nal, nal_length);
+		size += 4 + nal_length;
+	}
+
+	return size;
+}
+
+typedef struct {
+	const guint8 *data;
+	gsize length;
+	gsize bit;
+} BitReader;
+
+static guint
+read_bits (BitReader *reader,
+	   guint      n)
+{
+	guint value = 0, bit;
+
+	while (n--) {
+		bit = 0;
+		if (reader->bit < reader->length * 8)
+			bit = (reader->data[reader->bit / 8] >> (7 - reader->bit % 8)) & 1;
+		reader->bit++;
+		value = (value << 1) | bit;
+	}
+
+	return value;
+}
+
+static guint
+read_ue (BitReader *reader)
+{
+	guint zeros = 0;
+
+	while (read_bits (reader, 1) == 0) {
+		if (++zeros == 32)
+			return 0;
+	}
+
+	return ((1u << zeros) - 1) + read_bits (reader, zeros);
+}
+
+static gint
+read_se (BitReader *reader)
+{
+	guint value;
+
+	value = read_ue (reader);
+	return (value & 1) ? (gint) ((value + 1) / 2) : -(gint) (value / 2);
+}
+
+static void
+skip_scaling_list (BitReader *reader,
+		   guint      size)
+{
+	gint last = 8, next = 8;
+	guint i;
+
+	for (i = 0; i < size; i++) {
+		if (next != 0)
+			next = (last + read_se (reader) + 256) % 256;
+		if (next != 0)
+			last = next;
+	}
+}
+
+/* Gets the picture size from a sequence parameter set */
+static gboolean
+parse_sps (const guint8 *nal,
+	   gsize         length,
+	   guint        *width,
+	   guint        *height)
+{
+	BitReader reader;
+	guint8 *rbsp;
+	gsize i, n = 0;
+	guint zeros = 0, profile, chroma = 1, frame_mbs_only, j, count;
+	guint mbs_width, map_units_height, crop_x, crop_y;
+	guint crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0;
+	gboolean ret;
+
+	/* Without the NAL header and the emulation prevention bytes */
+	rbsp = g_malloc (length);
+	for (i = 1; i < length; i++) {
+		if (zeros >= 2 && nal[i] == 3) {
+			zeros = 0;
+			continue;
+		}
+		zeros = nal[i] == 0 ? zeros + 1 : 0;
+		rbsp[n++] = nal[i];
+	}
+	reader.data = rbsp;
+	reader.length = n;
+	reader.bit = 0;
+
+	profile = read_bits (&reader, 8);
+	read_bits (&reader, 16);
+	read_ue (&reader);
+	if (profile == 100 || profile == 110 || profile == 122 || profile == 244 ||
+	    profile == 44 || profile == 83 || profile == 86 || profile == 118 ||
+	    profile == 128 || profile == 138 || profile == 139 || profile == 134) {
+		chroma = read_ue (&reader);
+		if (chroma == 3 && read_bits (&reader, 1))
+			chroma = 0;
+		read_ue (&reader);
+		read_ue (&reader);
+		read_bits (&reader, 1);
+		if (read_bits (&reader, 1)) {
+			for (j = 0; j < (chroma != 3 ? 8 : 12); j++) {
+				if (read_bits (&reader, 1))
+					skip_scaling_list (&reader, j < 6 ? 16 : 64);
+			}
+		}
+	}
+	read_ue (&reader);
+	switch (read_ue (&reader)) {
+	case 0:
+		read_ue (&reader);
+		break;
+	case 1:
+		read_bits (&reader, 1);
+		read_se (&reader);
+		read_se (&reader);
+		count = read_ue (&reader);
+		for (j = 0; j < count && reader.bit < reader.length * 8; j++)
+			read_se (&reader);
+		break;
+	default:
+		break;
+	}
+	read_ue (&reader);
+	read_bits (&reader, 1);
+	mbs_width = read_ue (&reader) + 1;
+	map_units_height = read_ue (&reader) + 1;
+	frame_mbs_only = read_bits (&reader, 1);
+	if (!frame_mbs_only)
+		read_bits (&reader, 1);
+	read_bits (&reader, 1);
+	if (read_bits (&reader, 1)) {
+		crop_left = read_ue (&reader);
+		crop_right = read_ue (&reader);
+		crop_top = read_ue (&reader);
+		crop_bottom = read_ue (&reader);
+	}
+
+	crop_x = (chroma == 1 || chroma == 2) ? 2 : 1;
+	crop_y = (chroma == 1 ? 2 : 1) * (2 - frame_mbs_only);
+	*width = mbs_width * 16 - crop_x * (crop_left + crop_right);
+	*height = (2 - frame_mbs_only) * map_units_height * 16 - crop_y * (crop_top + crop_bottom);
+	ret = reader.bit <= reader.length * 8 && *width <= 16384 && *height <= 16384;
+
+	g_free (rbsp);
+	return ret;
+}
+
+/* avcC from the parameter sets found in the stream */
+static gboolean
+build_avcc (Track *track)
+{
+	GByteArray *config;
+
+	if (!track->sps || !track->pps || track->sps->len < 4)
+		return FALSE;
+
+	config = g_byte_array_new ();
+	put_u8 (config, 1);
+	g_byte_array_append (config, track->sps->data + 1, 3);
+	put_u8 (config, 0xff);         /* 4-byte lengths */
+	put_u8 (config, 0xe1);         /* One SPS */
+	put_u16 (config, track->sps->len);
+	g_byte_array_append (config, track->sps->data, track->sps->len);
+	put_u8 (config, 1);
+	put_u16 (config, track->pps->len);
+	g_byte_array_append (config, track->pps->data, track->pps->len);
+	track->config = config;
+
+	if (!parse_sps (track->sps->data, track->sps->len, &track->width, &track->height))
+		track->width = track->height = 0;
+
+	return TRUE;
+}
+
+/* AAC */
+
+static gboolean
+set_audio_config (Track        *track,
+		  const guint8 *asc,
+		  gsize         length)
+{
+	guint index;
+
+	if (length < 2)
+		return FALSE;
+	index = ((asc[0] & 0x07) << 1) | (asc[1] >> 7);
+	if (index >= G_N_ELEMENTS (aac_sample_rates))
+		return FALSE;
+
+	track->sample_rate = aac_sample_rates[index];
+	track->timescale = track->sample_rate;
+	if (track->channels == 0)
+		track->channels = (asc[1] >> 3) & 0x0f;
+	track->config = g_byte_array_append (g_byte_array_new (), asc, length);
+
+	return TRUE;
+}
+
+/* MPEG-TS */
+
+typedef struct {
+	guint64 es_offset;
+	gint64 pts;
+	gint64 dts;
+	gboolean has_pts;
+} Pes;
+
+typedef struct {
+	gint64 last;
+	gint64 wrap;
+} TsClock;
+
+typedef struct {
+	Track *track;
+	gint pid;
+	GArray *pes;             /* Pes */
+	gboolean started;
+	TsClock *clock;
+} TsStream;
+
+static gsize
+get_ts_packet_size (const guint8 *data,
+		    gsize         length)
+{
+	const gsize sizes[] = { TS_PACKET_SIZE, TS_PACKET_SIZE + 4 };
+	gsize prefix;
+	guint i, k;
+
+	/* Plain, or M2TS with a time code before each packet */
+	for (i = 0; i < G_N_ELEMENTS (sizes); i++) {
+		prefix = sizes[i] - TS_PACKET_SIZE;
+		if (length < prefix + 3 * sizes[i])
+			continue;
+		for (k = 0; k < 3 && data[prefix + k * sizes[i]] == TS_SYNC_BYTE; k++)
+			;
+		if (k == 3)
+			return sizes[i];
+	}
+
+	return 0;
+}
+
+static gint64
+read_timestamp (const guint8 *p)
+{
+	return ((gint64) (p[0] & 0x0e) << 29) |
+		((gint64) p[1] << 22) |
+		((gint64) (p[2] & 0xfe) << 14) |
+		((gint64) p[3] << 7) |
+		(p[4] >> 1);
+}
+
+/* Timestamps wrap around after 26 hours. The streams of a program are
+ * interleaved closely enough to share the reference. */
+static gint64
+unwrap_timestamp (TsClock *clock,
+		  gint64   timestamp)
+{
+	const gint64 period = G_GINT64_CONSTANT (1) << 33;
+
+	timestamp += clock->wrap;
+	if (clock->last - timestamp > period / 2) {
+		clock->wrap += period;
+		timestamp += period;
+	} else if (timestamp - clock->last > period / 2) {
+		/* From before the last wrap */
+		timestamp -= period;
+	}
+	clock->last = timestamp;
+
+	return timestamp;
+}
+
+static gint
+parse_pat (const guint8 *payload,
+	   gsize         length)
+{
+	const guint8 *section;
+	gsize section_length, pos;
+
+	if (length < 1 || (gsize) payload[0] + 1 + 8 > length)
+		return -1;
+	section = payload + 1 + payload[0];
+	length -= 1 + payload[0];
+	section_length = ((section[1] & 0x0f) << 8) | section[2];
+	if (section[0] != 0x00 || section_length + 3 > length || section_length < 9)
+		return -1;
+
+	/* The first program */
+	for (pos = 8; pos + 4 <= section_length + 3 - 4; pos += 4) {
+		if (read_u16 (section + pos) != 0)
+			return read_u16 (section + pos + 2) & 0x1fff;
+	}
+
+	return -1;
+}
+
+static gboolean
+parse_pmt (const guint8 *payload,
+	   gsize         length,
+	   TsStream     *video,
+	   TsStream     *audio)
+{
+	const guint8 *section;
+	gsize section_length, pos, end;
+
+	if (length < 1 || (gsize) payload[0] + 1 + 12 > length)
+		return FALSE;
+	section = payload + 1 + payload[0];
+	length -= 1 + payload[0];
+	section_length = ((section[1] & 0x0f) << 8) | section[2];
+	if (section[0] != 0x02 || section_length + 3 > length || section_length < 13)
+		return FALSE;
+
+	end = section_length + 3 - 4;
+	for (pos = 12 + (read_u16 (section + 10) & 0x0fff); pos + 5 <= end;
+	     pos += 5 + (read_u16 (section + pos + 3) & 0x0fff)) {
+		guint8 type = section[pos];
+		gint pid = read_u16 (section + pos + 1) & 0x1fff;
+
+		if (type == TS_STREAM_H264 && video->pid < 0)
+			video->pid = pid;
+		else if (type == TS_STREAM_AAC && audio->pid < 0)
+			audio->pid = pid;
+	}
+
+	return TRUE;
+}
+
+static void
+ts_stream_add (TsStream     *stream,
+	       const guint8 *payload,
+	       gsize         length,
+	       guint64       file_offset,
+	       gboolean      unit_start)
+{
+	Track *track = stream->track;
+	Piece *last, piece;
+
+	if (unit_start) {
+		Pes pes = { 0, };
+		gsize header_length;
+		guint8 flags;
+
+		stream->started = FALSE;
+		if (length < 9 || payload[0] != 0 || payload[1] != 0 || payload[2] != 1)
+			return;
+		flags = payload[7];
+		header_length = 9 + payload[8];
+		if (header_length > length)
+			return;
+
+		if ((flags & 0x80) && payload[8] >= 5) {
+			pes.has_pts = TRUE;
+			if ((flags & 0xc0) == 0xc0 && payload[8] >= 10)
+				pes.dts = unwrap_timestamp (stream->clock, read_timestamp (payload + 14));
+			pes.pts = unwrap_timestamp (stream->clock, read_timestamp (payload + 9));
+			if ((flags & 0xc0) != 0xc0)
+				pes.dts = pes.pts;
+		}
+		pes.es_offset = track->es_length;
+		g_array_append_val (stream->pes, pes);
+		stream->started = TRUE;
+
+		payload += header_length;
+		length -= header_length;
+		file_offset += header_length;
+	}
+
+	if (!stream->started || length == 0)
+		return;
+
+	last = track->pieces->len > 0 ?
+		&g_array_index (track->pieces, Piece, track->pieces->len - 1) : NULL;
+	if (last && last->file_offset + last->length == file_offset) {
+		last->length += length;
+	} else {
+		piece.es_offset = track->es_length;
+		piece.file_offset = file_offset;
+		piece.length = length;
+		g_array_append_val (track->pieces, piece);
+	}
+	track->es_length += length;
+}
+
+/* Copies a part of an elementary stream out of its packets */
+static void
+es_copy (RemoteDisplayRemux *remux,
+	 Track              *track,
+	 guint64             es_offset,
+	 gsize               length,
+	 guint8             *dest)
+{
+	const Piece *pieces = (const Piece *) track->pieces->data;
+	guint lo = 0, hi = track->pieces->len, mid, i;
+	gsize skip, n;
+
+	/* The last piece starting at or before @es_offset */
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (pieces[mid].es_offset <= es_offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	for (i = lo; length > 0 && i < track->pieces->len; i++) {
+		skip = es_offset - pieces[i].es_offset;
+		n = MIN (length, pieces[i].length - skip);
+		memcpy (dest, remux->data + pieces[i].file_offset + skip, n);
+		dest += n;
+		length -= n;
+		es_offset += n;
+	}
+}
+
+static void
+index_ts_video (RemoteDisplayRemux *remux,
+		TsStream           *stream)
+{
+	Track *track = stream->track;
+	const Pes *pes = (const Pes *) stream->pes->data;
+	GByteArray *au;
+	Sample sample = { 0, };
+	guint64 end;
+	guint i, next;
+
+	au = g_byte_array_new ();
+	for (i = 0; i < stream->pes->len; i = next) {
+		/* Packets without timestamps continue the access unit */
+		for (next = i + 1; next < stream->pes->len && !pes[next].has_pts; next++)
+			;
+		if (!pes[i].has_pts)
+			continue;
+
+		end = next < stream->pes->len ? pes[next].es_offset : track->es_length;
+		if (end == pes[i].es_offset || end - pes[i].es_offset > G_MAXUINT32 / 2)
+			continue;
+		g_byte_array_set_size (au, end - pes[i].es_offset);
+		es_copy (remux, track, pes[i].es_offset, au->len, au->data);
+
+		sample.offset = pes[i].es_offset;
+		sample.size = au->len;
+		sample.out_size = scan_access_unit (track, au->data, au->len, &sample.keyframe);
+		sample.dts = pes[i].dts;
+		sample.cts = MAX (pes[i].pts - pes[i].dts, 0);
+		if (sample.out_size > 0)
+			g_array_append_val (track->samples, sample);
+	}
+	g_byte_array_unref (au);
+}
+
+static void
+index_ts_audio (RemoteDisplayRemux *remux,
+		TsStream           *stream)
+{
+	Track *track = stream->track;
+	const Pes *pes = (const Pes *) stream->pes->data;
+	Sample sample = { 0, };
+	guint8 header[9];
+	guint64 pos, n_samples = 0;
+	gint64 start = 0;
+	guint header_length, frame_length, index, i;
+
+	/* ADTS frames, which can straddle packets */
+	for (i = 0; i < stream->pes->len && !pes[i].has_pts; i++)
+		;
+	if (i == stream->pes->len)
+		return;
+	pos = pes[i].es_offset;
+	start = pes[i].pts;
+
+	while (pos + sizeof (header) <= track->es_length) {
+		es_copy (remux, track, pos, sizeof (header), header);
+		if (header[0] != 0xff || (header[1] & 0xf6) != 0xf0) {
+			pos++;
+			continue;
+		}
+		header_length = (header[1] & 0x01) ? 7 : 9;
+		frame_length = ((header[3] & 0x03) << 11) | (header[4] << 3) | (header[5] >> 5);
+		index = (header[2] >> 2) & 0x0f;
+		if (frame_length <= header_length || pos + frame_length > track->es_length ||
+		    index >= G_N_ELEMENTS (aac_sample_rates)) {
+			pos++;
+			continue;
+		}
+
+		if (!track->config) {
+			guint8 asc[2];
+			guint object_type = (header[2] >> 6) + 1;
+			guint channels = ((header[2] & 0x01) << 2) | (header[3] >> 6);
+
+			asc[0] = (object_type << 3) | (index >> 1);
+			asc[1] = ((index & 0x01) << 7) | (channels << 3);
+			set_audio_config (track, asc, sizeof (asc));
+		}
+
+		sample.offset = pos + header_length;
+		sample.size = sample.out_size = frame_length - header_length;
+		sample.duration = AAC_FRAME_SAMPLES * ((header[6] & 0x03) + 1);
+		sample.dts = start + n_samples * TICKS_PER_SECOND / track->sample_rate;
+		sample.keyframe = TRUE;
+		g_array_append_val (track->samples, sample);
+
+		n_samples += sample.duration;
+		pos += frame_length;
+	}
+}
+
+static gboolean
+demux_ts (RemoteDisplayRemux  *remux,
+	  GError             **error)
+{
+	TsStream streams[2] = { { 0, }, { 0, } };
+	TsStream *video = &streams[0], *audio = &streams[1];
+	TsClock clock = { 0, 0 };
+	gsize packet_size, pos, offset, length;
+	gint pmt_pid = -1;
+	gboolean have_pmt = FALSE;
+	guint i;
+
+	video->pid = audio->pid = -1;
+	video->clock = audio->clock = &clock;
+	packet_size = get_ts_packet_size (remux->data, remux->length);
+	for (pos = packet_size - TS_PACKET_SIZE; pos + TS_PACKET_SIZE <= remux->length; pos += packet_size) {
+		const guint8 *p = remux->data + pos;
+		gboolean unit_start;
+		gint pid;
+
+		/* Lost, or broken packets */
+		if (p[0] != TS_SYNC_BYTE || (p[1] & 0x80))
+			continue;
+		unit_start = (p[1] & 0x40) != 0;
+		pid = ((p[1] & 0x1f) << 8) | p[2];
+
+		offset = 4;
+		if (p[3] & 0x20)
+			offset += 1 + p[4];
+		if (!(p[3] & 0x10) || offset >= TS_PACKET_SIZE)
+			continue;
+		length = TS_PACKET_SIZE - offset;
+
+		if (pid == 0 && pmt_pid < 0 && unit_start) {
+			pmt_pid = parse_pat (p + offset, length);
+		} else if (pid == pmt_pid && !have_pmt && unit_start) {
+			have_pmt = parse_pmt (p + offset, length, video, audio);
+			if (!have_pmt)
+				continue;
+			if (video->pid < 0)
+				break;
+			video->track = track_new (1, TRUE);
+			if (audio->pid >= 0)
+				audio->track = track_new (2, FALSE);
+			for (i = 0; i < G_N_ELEMENTS (streams); i++) {
+				if (!streams[i].track)
+					continue;
+				streams[i].track->pieces = g_array_new (FALSE, FALSE, sizeof (Piece));
+				streams[i].pes = g_array_new (FALSE, FALSE, sizeof (Pes));
+			}
+		} else if (video->track && pid == video->pid) {
+			ts_stream_add (video, p + offset, length, pos + offset, unit_start);
+		} else if (audio->track && pid == audio->pid) {
+			ts_stream_add (audio, p + offset, length, pos + offset, unit_start);
+		}
+	}
+
+	if (!video->track) {
+		g_set_error_literal (error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_NOT_SUPPORTED,
+				     have_pmt ? "No H.264 video in the stream" : "No program in the stream");
+		return FALSE;
+	}
+
+	video->track->annexb = TRUE;
+	video->track->timescale = TICKS_PER_SECOND;
+	index_ts_video (remux, video);
+	remux->tracks[remux->n_tracks++] = video->track;
+	g_array_unref (video->pes);
+	if (!build_avcc (video->track)) {
+		g_set_error_literal (error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_PARSE,
+				     "No parameter sets in the video");
+		if (audio->track) {
+			track_free (audio->track);
+			g_array_unref (audio->pes);
+		}
+		return FALSE;
+	}
+
+	if (audio->track) {
+		index_ts_audio (remux, audio);
+		g_array_unref (audio->pes);
+		if (audio->track->config)
+			remux->tracks[remux->n_tracks++] = audio->track;
+		else
+			track_free (audio->track);
+	}
+
+	return TRUE;
+}
+
+/* Matroska */
+
+typedef struct {
+	guint64 timecode_scale;  /* ns */
+	guint64 video_number;
+	guint64 audio_number;
+} MkvState;
+
+typedef struct {
+	guint64 number;
+	guint64 type;
+	const guint8 *codec_id;
+	gsize codec_id_length;
+	const guint8 *codec_private;
+	gsize codec_private_length;
+	guint64 width;
+	guint64 height;
+	guint64 channels;
+	gboolean encoded;
+} MkvTrackEntry;
+
+static gboolean
+read_vint (const guint8 *data,
+	   gsize         end,
+	   gsize        *pos,
+	   guint64      *value,
+	   gboolean      is_id)
+{
+	guint length, i;
+	guint64 v;
+
+	if (*pos >= end || data[*pos] == 0)
+		return FALSE;
+	for (length = 1; !(data[*pos] & (0x80 >> (length - 1))); length++)
+		;
+	if (end - *pos < length)
+		return FALSE;
+
+	v = is_id ? data[*pos] : data[*pos] & (0xff >> length);
+	for (i = 1; i < length; i++)
+		v = (v << 8) | data[*pos + i];
+	if (!is_id && v == (G_GUINT64_CONSTANT (1) << (7 * length)) - 1)
+		v = MKV_UNKNOWN_SIZE;
+
+	*pos += length;
+	*value = v;
+	return TRUE;
+}
+
+/* Sizes past @end are clamped, for truncated files */
+static gboolean
+read_element (const guint8 *data,
+	      gsize         end,
+	      gsize        *pos,
+	      guint32      *id,
+	      guint64      *size)
+{
+	guint64 v;
+
+	if (!read_vint (data, end, pos, &v, TRUE) || v > G_MAXUINT32)
+		return FALSE;
+	*id = v;
+	if (!read_vint (data, end, pos, size, FALSE))
+		return FALSE;
+	if (*size != MKV_UNKNOWN_SIZE && *size > end - *pos)
+		*size = end - *pos;
+
+	return TRUE;
+}
+
+static guint64
+read_uint (const guint8 *data,
+	   guint64       size)
+{
+	guint64 v = 0;
+	guint i;
+
+	for (i = 0; i < size && i < 8; i++)
+		v = (v << 8) | data[i];
+	return v;
+}
+
+static gboolean
+mkv_string_has_prefix (const guint8 *str,
+		       gsize         length,
+		       const char   *prefix)
+{
+	gsize n = strlen (prefix);
+
+	return length >= n && memcmp (str, prefix, n) == 0;
+}
+
+static gboolean
+mkv_string_equal (const guint8 *str,
+		  gsize         length,
+		  const char   *s)
+{
+	/* Strings can be padded with zeros */
+	while (length > 0 && str[length - 1] == '\0')
+		length--;
+	return length == strlen (s) && memcmp (str, s, length) == 0;
+}
+
+static void
+parse_track_entry (const guint8  *data,
+		   gsize          pos,
+		   gsize          end,
+		   MkvTrackEntry *entry)
+{
+	guint32 id;
+	guint64 size;
+
+	while (pos < end && read_element (data, end, &pos, &id, &size) && size != MKV_UNKNOWN_SIZE) {
+		switch (id) {
+		case MKV_TRACK_NUMBER:
+			entry->number = read_uint (data + pos, size);
+			break;
+		case MKV_TRACK_TYPE:
+			entry->type = read_uint (data + pos, size);
+			break;
+		case MKV_CODEC_ID:
+			entry->codec_id = data + pos;
+			entry->codec_id_length = size;
+			break;
+		case MKV_CODEC_PRIVATE:
+			entry->codec_private = data + pos;
+			entry->codec_private_length = size;
+			break;
+		case MKV_CONTENT_ENCODINGS:
+			entry->encoded = TRUE;
+			break;
+		case MKV_VIDEO:
+		case MKV_AUDIO:
+			/* The elements inside don't clash */
+			parse_track_entry (data, pos, pos + size, entry);
+			break;
+		case MKV_PIXEL_WIDTH:
+			entry->width = read_uint (data + pos, size);
+			break;
+		case MKV_PIXEL_HEIGHT:
+			entry->height = read_uint (data + pos, size);
+			break;
+		case MKV_CHANNELS:
+			entry->channels = read_uint (data + pos, size);
+			break;
+		default:
+			break;
+		}
+		pos += size;
+	}
+}
+
+static void
+parse_tracks (RemoteDisplayRemux *remux,
+	      MkvState           *state,
+	      gsize               pos,
+	      gsize               end)
+{
+	MkvTrackEntry entry;
+	Track *track;
+	guint32 id;
+	guint64 size;
+
+	while (pos < end && read_element (remux->data, end, &pos, &id, &size) && size != MKV_UNKNOWN_SIZE) {
+		if (id != MKV_TRACK_ENTRY) {
+			pos += size;
+			continue;
+		}
+
+		memset (&entry, 0, sizeof (entry));
+		parse_track_entry (remux->data, pos, pos + size, &entry);
+		pos += size;
+		if (entry.encoded || entry.number == 0)
+			continue;
+
+		if (entry.type == 1 && state->video_number == 0 &&
+		    mkv_string_equal (entry.codec_id, entry.codec_id_length, "V_MPEG4/ISO/AVC") &&
+		    entry.codec_private_length >= 7 && entry.codec_private[0] == 1) {
+			track = track_new (1, TRUE);
+			track->timescale = TICKS_PER_SECOND;
+			track->config = g_byte_array_append (g_byte_array_new (),
+							     entry.codec_private,
+							     entry.codec_private_length);
+			track->width = entry.width;
+			track->height = entry.height;
+			state->video_number = entry.number;
+			remux->tracks[0] = track;
+		} else if (entry.type == 2 && state->audio_number == 0 &&
+			   mkv_string_has_prefix (entry.codec_id, entry.codec_id_length, "A_AAC")) {
+			track = track_new (2, FALSE);
+			track->channels = entry.channels;
+			if (!set_audio_config (track, entry.codec_private, entry.codec_private_length)) {
+				track_free (track);
+				continue;
+			}
+			state->audio_number = entry.number;
+			remux->tracks[1] = track;
+		}
+	}
+}
+
+static gboolean
+parse_info (RemoteDisplayRemux *remux,
+	    MkvState           *state,
+	    gsize               pos,
+	    gsize               end)
+{
+	guint32 id;
+	guint64 size;
+
+	while (pos < end && read_element (remux->data, end, &pos, &id, &size) && size != MKV_UNKNOWN_SIZE) {
+		if (id == MKV_TIMECODE_SCALE && size > 0) {
+			state->timecode_scale = read_uint (remux->data + pos, size);
+			if (state->timecode_scale == 0 || state->timecode_scale > MKV_MAX_TIMECODE_SCALE)
+				return FALSE;
+		}
+		pos += size;
+	}
+
+	return TRUE;
+}
+
+static void
+parse_block (RemoteDisplayRemux *remux,
+	     MkvState           *state,
+	     gsize               pos,
+	     gsize               end,
+	     gint64              cluster_timecode,
+	     gint                keyframe)
+{
+	const guint8 *data = remux->data;
+	guint32 sizes[256];
+	Sample sample = { 0, };
+	Track *track;
+	guint64 number, value, total = 0;
+	gint64 timecode, ticks, limit;
+	guint8 flags;
+	guint n_frames = 1, i, lacing;
+
+	if (!read_vint (data, end, &pos, &number, FALSE) || end - pos < 3)
+		return;
+	if (number == state->video_number)
+		track = remux->tracks[0];
+	else if (number == state->audio_number)
+		track = remux->tracks[1];
+	else
+		return;
+
+	/* Past that, the times in ticks would overflow */
+	limit = G_MAXINT64 / 9 / (gint64) state->timecode_scale;
+	if (cluster_timecode < 0 || cluster_timecode > limit)
+		return;
+	timecode = cluster_timecode + (gint16) read_u16 (data + pos);
+	if (timecode > limit)
+		return;
+	flags = data[pos + 2];
+	pos += 3;
+	if (keyframe < 0)
+		keyframe = (flags & 0x80) != 0;
+
+	lacing = (flags >> 1) & 0x03;
+	if (lacing != 0) {
+		if (pos >= end)
+			return;
+		n_frames = data[pos++] + 1;
+		for (i = 0; i < n_frames - 1; i++) {
+			switch (lacing) {
+			case 1:
+				/* Xiph */
+				sizes[i] = 0;
+				do {
+					if (pos >= end)
+						return;
+					sizes[i] += data[pos];
+				} while (data[pos++] == 0xff);
+				break;
+			case 2:
+				/* Fixed */
+				sizes[i] = (end - pos) / n_frames;
+				break;
+			case 3:
+				/* EBML, differences to the previous size */
+				if (i == 0) {
+					if (!read_vint (data, end, &pos, &value, FALSE))
+						return;
+					sizes[i] = value;
+				} else {
+					gsize start = pos;
+
+					if (!read_vint (data, end, &pos, &value, FALSE))
+						return;
+					value -= (G_GUINT64_CONSTANT (1) << (7 * (pos - start) - 1)) - 1;
+					sizes[i] = sizes[i - 1] + (gint64) value;
+				}
+				break;
+			}
+			total += sizes[i];
+		}
+		if (total > end - pos)
+			return;
+		sizes[n_frames - 1] = end - pos - total;
+	} else {
+		sizes[0] = end - pos;
+	}
+
+	ticks = timecode * (gint64) state->timecode_scale * 9 / 100000;
+	for (i = 0; i < n_frames; i++) {
+		sample.offset = pos;
+		sample.size = sample.out_size = sizes[i];
+		sample.keyframe = track->video ? keyframe : TRUE;
+		if (track->video) {
+			/* Presentation times, decoding times are derived later */
+			sample.dts = ticks;
+		} else {
+			sample.duration = AAC_FRAME_SAMPLES;
+			sample.dts = ticks + (gint64) i * AAC_FRAME_SAMPLES * TICKS_PER_SECOND / track->sample_rate;
+		}
+		if (sample.size > 0)
+			g_array_append_val (track->samples, sample);
+		pos += sizes[i];
+	}
+}
+
+static gboolean
+is_top_level (guint32 id)
+{
+	return id == MKV_CLUSTER || id == MKV_CUES || id == MKV_TAGS ||
+		id == MKV_INFO || id == MKV_TRACKS || id == MKV_SEEK_HEAD ||
+		id == MKV_ATTACHMENTS || id == MKV_CHAPTERS;
+}
+
+/* Returns where the cluster ended */
+static gsize
+parse_cluster (RemoteDisplayRemux *remux,
+	       MkvState           *state,
+	       gsize               pos,
+	       gsize               end,
+	       gboolean            unknown_size)
+{
+	const guint8 *data = remux->data;
+	gint64 timecode = 0;
+	guint64 size, group_size;
+	guint32 id, group_id;
+	gsize start, group_pos, block_pos, block_end;
+	gboolean reference;
+
+	while (pos < end) {
+		start = pos;
+		if (!read_element (data, end, &pos, &id, &size) || size == MKV_UNKNOWN_SIZE)
+			return end;
+		if (unknown_size && is_top_level (id))
+			return start;
+
+		switch (id) {
+		case MKV_TIMECODE:
+			timecode = read_uint (data + pos, size);
+			break;
+		case MKV_SIMPLE_BLOCK:
+			parse_block (remux, state, pos, pos + size, timecode, -1);
+			break;
+		case MKV_BLOCK_GROUP:
+			block_pos = block_end = 0;
+			reference = FALSE;
+			for (group_pos = pos; group_pos < pos + size &&
+			     read_element (data, pos + size, &group_pos, &group_id, &group_size) &&
+			     group_size != MKV_UNKNOWN_SIZE; group_pos += group_size) {
+				if (group_id == MKV_BLOCK) {
+					block_pos = group_pos;
+					block_end = group_pos + group_size;
+				} else if (group_id == MKV_REFERENCE_BLOCK) {
+					reference = TRUE;
+				}
+			}
+			if (block_end > block_pos)
+				parse_block (remux, state, block_pos, block_end, timecode, !reference);
+			break;
+		default:
+			break;
+		}
+		pos += size;
+	}
+
+	return end;
+}
+
+static gboolean
+demux_mkv (RemoteDisplayRemux  *remux,
+	   GError             **error)
+{
+	const guint8 *data = remux->data;
+	MkvState state = { 1000000, 0, 0 };
+	gsize pos = 0, end;
+	guint32 id;
+	guint64 size;
+
+	if (!read_element (data, remux->length, &pos, &id, &size) || id != MKV_EBML ||
+	    size == MKV_UNKNOWN_SIZE)
+		goto bail;
+	pos += size;
+	if (!read_element (data, remux->length, &pos, &id, &size) || id != MKV_SEGMENT)
+		goto bail;
+	end = size == MKV_UNKNOWN_SIZE ? remux->length : pos + size;
+
+	while (pos < end && read_element (data, end, &pos, &id, &size)) {
+		if (id == MKV_CLUSTER) {
+			if (!remux->tracks[0])
+				break;
+			pos = parse_cluster (remux, &state, pos,
+					     size == MKV_UNKNOWN_SIZE ? end : pos + size,
+					     size == MKV_UNKNOWN_SIZE);
+			continue;
+		}
+		if (size == MKV_UNKNOWN_SIZE)
+			break;
+
+		switch (id) {
+		case MKV_INFO:
+			if (!parse_info (remux, &state, pos, pos + size))
+				goto bail;
+			break;
+		case MKV_TRACKS:
+			parse_tracks (remux, &state, pos, pos + size);
+			break;
+		default:
+			break;
+		}
+		pos += size;
+	}
+
+	if (!remux->tracks[0]) {
+		g_set_error_literal (error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_NOT_SUPPORTED,
+				     "No H.264 video in the file");
+		return FALSE;
+	}
+	remux->n_tracks = 1;
+	if (remux->tracks[1])
+		remux->n_tracks = 2;
+
+	return TRUE;
+
+bail:
+	g_set_error_literal (error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_PARSE,
+			     "Invalid Matroska file");
+	return FALSE;
+}
+
+static gint
+compare_timestamps (gconstpointer a,
+		    gconstpointer b)
+{
+	gint64 ta = *(const gint64 *) a, tb = *(const gint64 *) b;
+
+	return ta < tb ? -1 : ta > tb;
+}
+
+/* Matroska only has presentation times. Decoding times are the
+ * same times in order, moved back enough to come first. */
+static void
+derive_decoding_times (Track *track)
+{
+	GArray *sorted;
+	gint64 delay = 0, pts;
+	guint i;
+
+	sorted = g_array_sized_new (FALSE, FALSE, sizeof (gint64), track->samples->len);
+	for (i = 0; i < track->samples->len; i++)
+		g_array_append_val (sorted, SAMPLE (track, i)->dts);
+	g_array_sort (sorted, compare_timestamps);
+
+	for (i = 0; i < track->samples->len; i++)
+		delay = MAX (delay, g_array_index (sorted, gint64, i) - SAMPLE (track, i)->dts);
+	for (i = 0; i < track->samples->len; i++) {
+		pts = SAMPLE (track, i)->dts;
+		SAMPLE (track, i)->dts = g_array_index (sorted, gint64, i) - delay;
+		SAMPLE (track, i)->cts = pts - SAMPLE (track, i)->dts;
+	}
+
+	g_array_unref (sorted);
+}
+
+/* Starts the tracks at the first keyframe, with times relative to it */
+static gboolean
+finish_tracks (RemoteDisplayRemux  *remux,
+	       gboolean             derive_dts,
+	       GError             **error)
+{
+	Track *video = remux->tracks[0];
+	Track *audio = remux->n_tracks > 1 ? remux->tracks[1] : NULL;
+	Sample *sample;
+	gint64 origin, dts;
+	guint i;
+
+	for (i = 0; i < video->samples->len && !SAMPLE (video, i)->keyframe; i++)
+		;
+	if (i == video->samples->len) {
+		g_set_error_literal (error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_PARSE,
+				     "No keyframe in the video");
+		return FALSE;
+	}
+	g_array_remove_range (video->samples, 0, i);
+
+	if (derive_dts)
+		derive_decoding_times (video);
+
+	origin = SAMPLE (video, 0)->dts;
+	for (i = 0; i < video->samples->len; i++) {
+		sample = SAMPLE (video, i);
+		if (i + 1 < video->samples->len && SAMPLE (video, i + 1)->dts > sample->dts)
+			sample->duration = SAMPLE (video, i + 1)->dts - sample->dts;
+		else
+			sample->duration = i > 0 ? SAMPLE (video, i - 1)->duration : DEFAULT_FRAME_TICKS;
+		sample->dts -= origin;
+	}
+
+	if (!audio)
+		return TRUE;
+
+	for (i = 0; i < audio->samples->len && SAMPLE (audio, i)->dts < origin; i++)
+		;
+	g_array_remove_range (audio->samples, 0, i);
+	if (audio->samples->len == 0) {
+		track_free (audio);
+		remux->tracks[1] = NULL;
+		remux->n_tracks = 1;
+		return TRUE;
+	}
+
+	/* Back to back from the first frame */
+	dts = (SAMPLE (audio, 0)->dts - origin) * audio->timescale / TICKS_PER_SECOND;
+	for (i = 0; i < audio->samples->len; i++) {
+		SAMPLE (audio, i)->dts = dts;
+		dts += SAMPLE (audio, i)->duration;
+	}
+
+	return TRUE;
+}
+
+/* The seek index: fragments start with a keyframe, every second or
+ * so, with the audio up to the next fragment's video */
+static void
+build_fragments (RemoteDisplayRemux *remux)
+{
+	Track *video = remux->tracks[0];
+	Track *audio = remux->n_tracks > 1 ? remux->tracks[1] : NULL;
+	Fragment fragment;
+	goffset offset;
+	gint64 limit;
+	guint i, t, n, start = 0, next_audio = 0;
+	guint64 mdat_size;
+
+	remux->fragments = g_array_new (FALSE, FALSE, sizeof (Fragment));
+	offset = g_bytes_get_size (remux->init);
+
+	for (i = 1; i <= video->samples->len; i++) {
+		if (i < video->samples->len &&
+		    (!SAMPLE (video, i)->keyframe ||
+		     SAMPLE (video, i)->dts - SAMPLE (video, start)->dts < FRAGMENT_DURATION))
+			continue;
+
+		memset (&fragment, 0, sizeof (fragment));
+		fragment.first[0] = start;
+		fragment.count[0] = i - start;
+		if (audio) {
+			limit = i < video->samples->len ?
+				SAMPLE (video, i)->dts * audio->timescale / TICKS_PER_SECOND : G_MAXINT64;
+			fragment.first[1] = next_audio;
+			while (next_audio < audio->samples->len && SAMPLE (audio, next_audio)->dts < limit)
+				next_audio++;
+			fragment.count[1] = next_audio - fragment.first[1];
+		}
+
+		/* moof and mfhd, then a traf with tfhd, tfdt and trun per track */
+		fragment.moof_size = 8 + 16;
+		mdat_size = 8;
+		for (t = 0; t < remux->n_tracks; t++) {
+			if (fragment.count[t] == 0)
+				continue;
+			fragment.moof_size += 8 + 16 + 20 + 20 + 16 * fragment.count[t];
+			for (n = 0; n < fragment.count[t]; n++)
+				mdat_size += SAMPLE (remux->tracks[t], fragment.first[t] + n)->out_size;
+		}
+		fragment.offset = offset;
+		fragment.size = fragment.moof_size + mdat_size;
+		g_array_append_val (remux->fragments, fragment);
+
+		offset += fragment.size;
+		start = i;
+	}
+
+	remux->total_length = offset;
+}
+
+static void
+put_matrix (GByteArray *ba)
+{
+	put_u32 (ba, 0x00010000);
+	put_zeros (ba, 12);
+	put_u32 (ba, 0x00010000);
+	put_zeros (ba, 12);
+	put_u32 (ba, 0x40000000);
+}
+
+static void
+put_sample_entry (GByteArray *ba,
+		  Track      *track)
+{
+	guint entry, box, config_length = track->config->len;
+
+	entry = box_start (ba, track->video ? "avc1" : "mp4a");
+	put_zeros (ba, 6);
+	put_u16 (ba, 1);                       /* Data reference index */
+
+	if (track->video) {
+		put_zeros (ba, 16);
+		put_u16 (ba, track->width);
+		put_u16 (ba, track->height);
+		put_u32 (ba, 0x00480000);      /* 72 dpi */
+		put_u32 (ba, 0x00480000);
+		put_zeros (ba, 4);
+		put_u16 (ba, 1);               /* Frame count */
+		put_zeros (ba, 32);            /* Compressor name */
+		put_u16 (ba, 0x0018);
+		put_u16 (ba, 0xffff);
+
+		box = box_start (ba, "avcC");
+		g_byte_array_append (ba, track->config->data, config_length);
+		box_end (ba, box);
+	} else {
+		put_zeros (ba, 8);
+		put_u16 (ba, track->channels);
+		put_u16 (ba, 16);
+		put_zeros (ba, 4);
+		put_u32 (ba, (track->sample_rate < 65536 ? track->sample_rate : 0) << 16);
+
+		box = full_box_start (ba, "esds", 0, 0);
+		put_u8 (ba, 0x03);             /* ES_Descriptor */
+		put_u8 (ba, 3 + 2 + 13 + 2 + config_length + 3);
+		put_u16 (ba, track->id);
+		put_u8 (ba, 0);
+		put_u8 (ba, 0x04);             /* DecoderConfigDescriptor */
+		put_u8 (ba, 13 + 2 + config_length);
+		put_u8 (ba, 0x40);             /* MPEG-4 audio */
+		put_u8 (ba, 0x15);             /* Audio stream */
+		put_zeros (ba, 3 + 4 + 4);
+		put_u8 (ba, 0x05);             /* DecoderSpecificInfo */
+		put_u8 (ba, config_length);
+		g_byte_array_append (ba, track->config->data, config_length);
+		put_u8 (ba, 0x06);             /* SLConfigDescriptor */
+		put_u8 (ba, 1);
+		put_u8 (ba, 0x02);
+		box_end (ba, box);
+	}
+
+	box_end (ba, entry);
+}
+
+static void
+put_trak (GByteArray *ba,
+	  Track      *track)
+{
+	guint trak, mdia, minf, dinf, stbl, box;
+
+	trak = box_start (ba, "trak");
+
+	box = full_box_start (ba, "tkhd", 0, 0x000003);
+	put_zeros (ba, 8);
+	put_u32 (ba, track->id);
+	put_zeros (ba, 4 + 4 + 8 + 2 + 2);
+	put_u16 (ba, track->video ? 0 : 0x0100);
+	put_zeros (ba, 2);
+	put_matrix (ba);
+	put_u32 (ba, track->width << 16);
+	put_u32 (ba, track->height << 16);
+	box_end (ba, box);
+
+	mdia = box_start (ba, "mdia");
+	box = full_box_start (ba, "mdhd", 0, 0);
+	put_zeros (ba, 8);
+	put_u32 (ba, track->timescale);
+	put_u32 (ba, 0);
+	put_u16 (ba, 0x55c4);                  /* "und" */
+	put_u16 (ba, 0);
+	box_end (ba, box);
+
+	box = full_box_start (ba, "hdlr", 0, 0);
+	put_u32 (ba, 0);
+	put_fourcc (ba, track->video ? "vide" : "soun");
+	put_zeros (ba, 12);
+	g_byte_array_append (ba, (const guint8 *) (track->video ? "Video" : "Audio"), 6);
+	box_end (ba, box);
+
+	minf = box_start (ba, "minf");
+	if (track->video) {
+		box = full_box_start (ba, "vmhd", 0, 0x000001);
+		put_zeros (ba, 8);
+	} else {
+		box = full_box_start (ba, "smhd", 0, 0);
+		put_zeros (ba, 4);
+	}
+	box_end (ba, box);
+
+	dinf = box_start (ba, "dinf");
+	box = full_box_start (ba, "dref", 0, 0);
+	put_u32 (ba, 1);
+	box_end (ba, full_box_start (ba, "url ", 0, 0x000001));
+	box_end (ba, box);
+	box_end (ba, dinf);
+
+	/* Empty, the samples are in the fragments */
+	stbl = box_start (ba, "stbl");
+	box = full_box_start (ba, "stsd", 0, 0);
+	put_u32 (ba, 1);
+	put_sample_entry (ba, track);
+	box_end (ba, box);
+	box = full_box_start (ba, "stts", 0, 0);
+	put_u32 (ba, 0);
+	box_end (ba, box);
+	box = full_box_start (ba, "stsc", 0, 0);
+	put_u32 (ba, 0);
+	box_end (ba, box);
+	box = full_box_start (ba, "stsz", 0, 0);
+	put_u32 (ba, 0);
+	put_u32 (ba, 0);
+	box_end (ba, box);
+	box = full_box_start (ba, "stco", 0, 0);
+	put_u32 (ba, 0);
+	box_end (ba, box);
+	box_end (ba, stbl);
+
+	box_end (ba, minf);
+	box_end (ba, mdia);
+	box_end (ba, trak);
+}
+
+static GBytes *
+build_init (RemoteDisplayRemux *remux)
+{
+	GByteArray *ba;
+	guint moov, mvex, box, t;
+
+	ba = g_byte_array_new ();
+
+	box = box_start (ba, "ftyp");
+	put_fourcc (ba, "isom");
+	put_u32 (ba, 0x200);
+	put_fourcc (ba, "isom");
+	put_fourcc (ba, "iso6");
+	put_fourcc (ba, "avc1");
+	put_fourcc (ba, "mp41");
+	box_end (ba, box);
+
+	moov = box_start (ba, "moov");
+	box = full_box_start (ba, "mvhd", 0, 0);
+	put_zeros (ba, 8);
+	put_u32 (ba, 1000);
+	put_u32 (ba, 0);
+	put_u32 (ba, 0x00010000);              /* Rate */
+	put_u16 (ba, 0x0100);                  /* Volume */
+	put_zeros (ba, 10);
+	put_matrix (ba);
+	put_zeros (ba, 24);
+	put_u32 (ba, remux->n_tracks + 1);
+	box_end (ba, box);
+
+	for (t = 0; t < remux->n_tracks; t++)
+		put_trak (ba, remux->tracks[t]);
+
+	mvex = box_start (ba, "mvex");
+	for (t = 0; t < remux->n_tracks; t++) {
+		box = full_box_start (ba, "trex", 0, 0);
+		put_u32 (ba, remux->tracks[t]->id);
+		put_u32 (ba, 1);
+		put_zeros (ba, 12);
+		box_end (ba, box);
+	}
+	box_end (ba, mvex);
+	box_end (ba, moov);
+
+	return g_byte_array_free_to_bytes (ba);
+}
+
+static void
+append_samples (RemoteDisplayRemux *remux,
+		Track              *track,
+		guint               first,
+		guint               count,
+		GPtrArray          *parts)
+{
+	const Sample *samples = SAMPLE (track, first);
+	GByteArray *au;
+	guint8 *buffer;
+	gsize total = 0, pos = 0;
+	guint64 run_end;
+	guint i, j;
+
+	/* Straight from the mapping, runs of adjacent samples at once */
+	if (!track->pieces) {
+		for (i = 0; i < count; i = j) {
+			run_end = samples[i].offset + samples[i].size;
+			for (j = i + 1; j < count && samples[j].offset == run_end; j++)
+				run_end += samples[j].size;
+			g_ptr_array_add (parts, g_bytes_new_from_bytes (remux->bytes, samples[i].offset,
+									run_end - samples[i].offset));
+		}
+		return;
+	}
+
+	for (i = 0; i < count; i++)
+		total += samples[i].out_size;
+	buffer = g_malloc (total);
+
+	au = g_byte_array_new ();
+	for (i = 0; i < count; i++) {
+		if (track->annexb) {
+			g_byte_array_set_size (au, samples[i].size);
+			es_copy (remux, track, samples[i].offset, samples[i].size, au->data);
+			pos += write_avcc (au->data, au->len, buffer + pos);
+		} else {
+			es_copy (remux, track, samples[i].offset, samples[i].size, buffer + pos);
+			pos += samples[i].size;
+		}
+	}
+	g_byte_array_unref (au);
+	g_assert (pos == total);
+
+	g_ptr_array_add (parts, g_bytes_new_take (buffer, total));
+}
+
+static GPtrArray *
+build_fragment (RemoteDisplayRemux *remux,
+		guint               index)
+{
+	const Fragment *fragment = &g_array_index (remux->fragments, Fragment, index);
+	GPtrArray *parts;
+	GByteArray *header;
+	const Sample *samples;
+	guint32 data_offset;
+	guint moof, traf, box, t, i;
+
+	parts = g_ptr_array_new_with_free_func ((GDestroyNotify) g_bytes_unref);
+	header = g_byte_array_sized_new (fragment->moof_size + 8);
+
+	moof = box_start (header, "moof");
+	box = full_box_start (header, "mfhd", 0, 0);
+	put_u32 (header, index + 1);
+	box_end (header, box);
+
+	data_offset = fragment->moof_size + 8;
+	for (t = 0; t < remux->n_tracks; t++) {
+		if (fragment->count[t] == 0)
+			continue;
+		samples = SAMPLE (remux->tracks[t], fragment->first[t]);
+
+		traf = box_start (header, "traf");
+		box = full_box_start (header, "tfhd", 0, 0x020000);    /* Offsets from the moof */
+		put_u32 (header, remux->tracks[t]->id);
+		box_end (header, box);
+		box = full_box_start (header, "tfdt", 1, 0);
+		put_u64 (header, samples[0].dts);
+		box_end (header, box);
+
+		/* Data offset, then durations, sizes, flags and offsets */
+		box = full_box_start (header, "trun", 0, 0x000f01);
+		put_u32 (header, fragment->count[t]);
+		put_u32 (header, data_offset);
+		for (i = 0; i < fragment->count[t]; i++) {
+			put_u32 (header, samples[i].duration);
+			put_u32 (header, samples[i].out_size);
+			put_u32 (header, samples[i].keyframe ? SAMPLE_FLAGS_SYNC : SAMPLE_FLAGS_NON_SYNC);
+			put_u32 (header, samples[i].cts);
+			data_offset += samples[i].out_size;
+		}
+		box_end (header, box);
+		box_end (header, traf);
+	}
+	box_end (header, moof);
+	g_assert (header->len == fragment->moof_size);
+
+	put_u32 (header, fragment->size - fragment->moof_size);
+	put_fourcc (header, "mdat");
+	g_ptr_array_add (parts, g_byte_array_free_to_bytes (header));
+
+	for (t = 0; t < remux->n_tracks; t++) {
+		if (fragment->count[t] > 0)
+			append_samples (remux, remux->tracks[t], fragment->first[t], fragment->count[t], parts);
+	}
+
+	return parts;
+}
+
+/**
+ * remote_display_remux_probe:
+ * @data: the start of a file
+ * @length: the length of @data
+ *
+ * Return value: %TRUE if @data looks like a Matroska or MPEG-TS
+ * file, which might be remuxed.
+ **/
+gboolean
+remote_display_remux_probe (const guint8 *data,
+			    gsize         length)
+{
+	if (length >= 4 && read_u32 (data) == MKV_EBML)
+		return TRUE;
+	return get_ts_packet_size (data, length) != 0;
+}
+
+/**
+ * remote_display_remux_new:
+ * @file: a Matroska or MPEG-TS file
+ * @error: a #GError
+ *
+ * Indexes the samples of @file, which reads all of MPEG-TS files,
+ * so this is better done in a thread.
+ *
+ * Return value: the remuxer, or %NULL if @file has no H.264 video
+ * or can't be parsed.
+ **/
+RemoteDisplayRemux *
+remote_display_remux_new (GMappedFile  *file,
+			  GError      **error)
+{
+	RemoteDisplayRemux *remux;
+	gboolean ret;
+
+	g_return_val_if_fail (file != NULL, NULL);
+
+	remux = g_new0 (RemoteDisplayRemux, 1);
+	remux->bytes = g_mapped_file_get_bytes (file);
+	remux->data = g_bytes_get_data (remux->bytes, &remux->length);
+
+	if (remux->length >= 4 && read_u32 (remux->data) == MKV_EBML) {
+		ret = demux_mkv (remux, error) && finish_tracks (remux, TRUE, error);
+	} else if (get_ts_packet_size (remux->data, remux->length) != 0) {
+		ret = demux_ts (remux, error) && finish_tracks (remux, FALSE, error);
+	} else {
+		g_set_error_literal (error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_NOT_SUPPORTED,
+				     "Not a Matroska or MPEG-TS file");
+		ret = FALSE;
+	}
+
+	if (!ret) {
+		remote_display_remux_free (remux);
+		return NULL;
+	}
+
+	remux->init = build_init (remux);
+	build_fragments (remux);
+
+	return remux;
+}
+
+void
+remote_display_remux_free (RemoteDisplayRemux *remux)
+{
+	guint t;
+
+	g_return_if_fail (remux != NULL);
+
+	for (t = 0; t < G_N_ELEMENTS (remux->tracks); t++) {
+		if (remux->tracks[t])
+			track_free (remux->tracks[t]);
+	}
+	if (remux->fragments)
+		g_array_unref (remux->fragments);
+	g_clear_pointer (&remux->init, g_bytes_unref);
+	g_bytes_unref (remux->bytes);
+	g_free (remux);
+}
+
+/**
+ * remote_display_remux_get_length:
+ * @remux: a #RemoteDisplayRemux
+ *
+ * Return value: the size of the fragmented MP4.
+ **/
+goffset
+remote_display_remux_get_length (RemoteDisplayRemux *remux)
+{
+	g_return_val_if_fail (remux != NULL, 0);
+
+	return remux->total_length;
+}
+
+/**
+ * remote_display_remux_read:
+ * @remux: a #RemoteDisplayRemux
+ * @start: where to start in the fragmented MP4
+ * @end: where to stop, at most
+ * @chunks: (element-type GBytes): where to add the data
+ *
+ * Builds the start of [@start, @end), up to the end of the
+ * header or of a fragment.
+ *
+ * Return value: where the data added to @chunks stops.
+ **/
+goffset
+remote_display_remux_read (RemoteDisplayRemux *remux,
+			   goffset             start,
+			   goffset             end,
+			   GPtrArray          *chunks)
+{
+	const Fragment *fragment;
+	GPtrArray *parts;
+	goffset init_length, pos, from, to;
+	gsize size;
+	guint lo, hi, mid, i;
+
+	g_return_val_if_fail (remux != NULL, start);
+	g_return_val_if_fail (start >= 0 && start < end && end <= remux->total_length, start);
+
+	init_length = g_bytes_get_size (remux->init);
+	if (start < init_length) {
+		end = MIN (end, init_length);
+		g_ptr_array_add (chunks, g_bytes_new_from_bytes (remux->init, start, end - start));
+		return end;
+	}
+
+	/* The last fragment starting at or before @start */
+	lo = 0;
+	hi = remux->fragments->len;
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (g_array_index (remux->fragments, Fragment, mid).offset <= start)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	fragment = &g_array_index (remux->fragments, Fragment, lo);
+	end = MIN (end, fragment->offset + fragment->size);
+
+	parts = build_fragment (remux, lo);
+	for (i = 0, pos = fragment->offset; i < parts->len && pos < end; i++, pos += size) {
+		size = g_bytes_get_size (g_ptr_array_index (parts, i));
+		from = MAX (start, pos);
+		to = MIN (end, pos + (goffset) size);
+		if (from < to)
+			g_ptr_array_add (chunks, g_bytes_new_from_bytes (g_ptr_array_index (parts, i),
+									 from - pos, to - from));
+	}
+	g_ptr_array_unref (parts);
+
+	return end;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __REMOTE_DISPLAY_REMUX_H__
+#define __REMOTE_DISPLAY_REMUX_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Repackages the H.264 and AAC streams of a Matroska or MPEG-TS
+ * file as fragmented MP4, without transcoding, for receivers that
+ * only play MP4s. The file is indexed once, then any range of the
+ * fragmented MP4 is built from the fragments it overlaps. */
+typedef struct _RemoteDisplayRemux RemoteDisplayRemux;
+
+gboolean            remote_display_remux_probe      (const guint8        *data,
+						     gsize                length);
+RemoteDisplayRemux *remote_display_remux_new        (GMappedFile         *file,
+						     GError             **error);
+void                remote_display_remux_free       (RemoteDisplayRemux  *remux);
+goffset             remote_display_remux_get_length (RemoteDisplayRemux  *remux);
+goffset             remote_display_remux_read       (RemoteDisplayRemux  *remux,
+						     goffset              start,
+						     goffset              end,
+						     GPtrArray           *chunks);
+
+G_END_DECLS
+
+#endif /* __REMOTE_DISPLAY_REMUX_H__ */
@@ -0,0 +1,415 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <gio/gio.h>
+
+#include <libremote-display/remote-display.h>
+#include <libremote-display/remote-display-service.h>
+
+/* Only the devices that can play videos are exported, as
+ * audio can't be streamed through the service */
+static const char introspection_xml[] =
+	"<node>"
+	"  <interface name='" REMOTE_DISPLAY_DBUS_INTERFACE "'>"
+	"    <method name='GetDevices'>"
+	"      <arg type='a(ssubb)' name='devices' direction='out'/>"
+	"    </method>"
+	"    <method name='GetMetrics'>"
+	"      <arg type='a{sv}' name='metrics' direction='out'/>"
+	"    </method>"
+	"    <method name='OpenAndPlay'>"
+	"      <arg type='s' name='id' direction='in'/>"
+	"      <arg type='s' name='uri' direction='in'/>"
+	"      <arg type='t' name='position_ms' direction='in'/>"
+	"    </method>"
+	"    <method name='Play'>"
+	"      <arg type='s' name='id' direction='in'/>"
+	"    </method>"
+	"    <method name='Pause'>"
+	"      <arg type='s' name='id' direction='in'/>"
+	"    </method>"
+	"    <method name='Stop'>"
+	"      <arg type='s' name='id' direction='in'/>"
+	"    </method>"
+	"    <method name='Seek'>"
+	"      <arg type='s' name='id' direction='in'/>"
+	"      <arg type='d' name='position_ms' direction='in'/>"
+	"    </method>"
+	"    <signal name='DeviceAppeared'>"
+	"      <arg type='(ssubb)' name='device'/>"
+	"    </signal>"
+	"    <signal name='DeviceChanged'>"
+	"      <arg type='(ssubb)' name='device'/>"
+	"    </signal>"
+	"    <signal name='DeviceDisappeared'>"
+	"      <arg type='s' name='id'/>"
+	"    </signal>"
+	"    <signal name='StateChanged'>"
+	"      <arg type='s' name='id'/>"
+	"      <arg type='u' name='state'/>"
+	"    </signal>"
+	"    <signal name='MediaServed'>"
+	"      <arg type='s' name='id'/>"
+	"      <arg type='s' name='uri'/>"
+	"    </signal>"
+	"  </interface>"
+	"</node>";
+
+struct _RemoteDisplayService {
+	GObject parent_instance;
+
+	RemoteDisplayManager *manager;
+	GHashTable *devices;       /* key = device ID, value = RemoteDisplayDevice */
+	GDBusConnection *connection;
+	guint registration_id;
+};
+
+G_DEFINE_TYPE (RemoteDisplayService, remote_display_service, G_TYPE_OBJECT);
+
+static GDBusNodeInfo *introspection_data = NULL;
+
+static char *
+get_device_id (RemoteDisplayDevice *device)
+{
+	char *id;
+
+	g_object_get (G_OBJECT (device), "id", &id, NULL);
+	return id;
+}
+
+/* id, name, capabilities, password-protected, provisional */
+static GVariant *
+device_to_variant (const char          *id,
+		   RemoteDisplayDevice *device)
+{
+	const char *name;
+	gboolean provisional;
+
+	name = remote_display_device_get_name (device);
+	g_object_get (G_OBJECT (device), "provisional", &provisional, NULL);
+
+	return g_variant_new ("(ssubb)",
+			      id,
+			      name ? name : "",
+			      remote_display_device_get_capabilities (device),
+			      remote_display_device_get_password_protected (device),
+			      provisional);
+}
+
+static void
+emit_signal (RemoteDisplayService *self,
+	     const char           *signal_name,
+	     GVariant             *parameters)
+{
+	GError *error = NULL;
+
+	if (!self->connection) {
+		g_variant_unref (g_variant_ref_sink (parameters));
+		return;
+	}
+
+	if (!g_dbus_connection_emit_signal (self->connection, NULL,
+					    REMOTE_DISPLAY_DBUS_PATH,
+					    REMOTE_DISPLAY_DBUS_INTERFACE,
+					    signal_name, parameters, &error)) {
+		g_warning ("Failed to emit %s: %s", signal_name, error->message);
+		g_error_free (error);
+	}
+}
+
+static void
+state_changed_cb (RemoteDisplayDevice      *device,
+		  RemoteDisplayDeviceState  state,
+		  RemoteDisplayService     *self)
+{
+	char *id;
+
+	id = get_device_id (device);
+	emit_signal (self, "StateChanged", g_variant_new ("(su)", id, state));
+	g_free (id);
+}
+
+static void
+media_served_cb (RemoteDisplayDevice  *device,
+		 const char           *uri,
+		 RemoteDisplayService *self)
+{
+	char *id;
+
+	id = get_device_id (device);
+	emit_signal (self, "MediaServed", g_variant_new ("(ss)", id, uri));
+	g_free (id);
+}
+
+static void
+export_device (RemoteDisplayService *self,
+	       RemoteDisplayDevice  *device)
+{
+	char *id;
+
+	id = get_device_id (device);
+	if (!id || g_hash_table_contains (self->devices, id)) {
+		g_free (id);
+		return;
+	}
+
+	g_signal_connect (device, "state-changed",
+			  G_CALLBACK (state_changed_cb), self);
+	g_signal_connect (device, "media-served",
+			  G_CALLBACK (media_served_cb), self);
+	g_hash_table_insert (self->devices, id, g_object_ref (device));
+
+	emit_signal (self, "DeviceAppeared", g_variant_new ("(@(ssubb))", device_to_variant (id, device)));
+}
+
+/* Provisional devices get confirmed, and probing can
+ * change what a device is capable of */
+static void
+device_changed_cb (RemoteDisplayDevice  *device,
+		   GParamSpec           *pspec,
+		   RemoteDisplayService *self)
+{
+	char *id;
+
+	id = get_device_id (device);
+	if (id && g_hash_table_lookup (self->devices, id) == device)
+		emit_signal (self, "DeviceChanged", g_variant_new ("(@(ssubb))", device_to_variant (id, device)));
+	else if (remote_display_device_get_capabilities (device) & REMOTE_DISPLAY_DEVICE_CAPABILITIES_VIDEO)
+		export_device (self, device);
+	g_free (id);
+}
+
+static void
+device_appeared_cb (RemoteDisplayManager *manager,
+		    RemoteDisplayDevice  *device,
+		    RemoteDisplayService *self)
+{
+	g_signal_connect (device, "notify::provisional",
+			  G_CALLBACK (device_changed_cb), self);
+	g_signal_connect (device, "notify::capabilities",
+			  G_CALLBACK (device_changed_cb), self);
+
+	if (remote_display_device_get_capabilities (device) & REMOTE_DISPLAY_DEVICE_CAPABILITIES_VIDEO)
+		export_device (self, device);
+}
+
+static void
+device_disappeared_cb (RemoteDisplayManager *manager,
+		       RemoteDisplayDevice  *device,
+		       RemoteDisplayService *self)
+{
+	char *id;
+
+	g_signal_handlers_disconnect_by_data (device, self);
+	id = get_device_id (device);
+	if (id && g_hash_table_lookup (self->devices, id) == device) {
+		g_hash_table_remove (self->devices, id);
+		emit_signal (self, "DeviceDisappeared", g_variant_new ("(s)", id));
+	}
+	g_free (id);
+}
+
+static void
+command_cb (GObject      *source_object,
+	    GAsyncResult *result,
+	    gpointer      user_data)
+{
+	GDBusMethodInvocation *invocation = user_data;
+	GError *error = NULL;
+
+	if (!g_task_propagate_boolean (G_TASK (result), &error))
+		g_dbus_method_invocation_take_error (invocation, error);
+	else
+		g_dbus_method_invocation_return_value (invocation, NULL);
+}
+
+static void
+method_call_cb (GDBusConnection       *connection,
+		const char            *sender,
+		const char            *object_path,
+		const char            *interface_name,
+		const char            *method_name,
+		GVariant              *parameters,
+		GDBusMethodInvocation *invocation,
+		gpointer               user_data)
+{
+	RemoteDisplayService *self = user_data;
+	RemoteDisplayDevice *device;
+	const char *id, *uri;
+	guint64 position;
+	gdouble position_ms;
+
+	if (g_str_equal (method_name, "GetDevices")) {
+		GVariantBuilder builder;
+		GHashTableIter iter;
+		gpointer key, value;
+
+		g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssubb)"));
+		g_hash_table_iter_init (&iter, self->devices);
+		while (g_hash_table_iter_next (&iter, &key, &value))
+			g_variant_builder_add_value (&builder, device_to_variant (key, value));
+		g_dbus_method_invocation_return_value (invocation,
+						       g_variant_new ("(a(ssubb))", &builder));
+		return;
+	}
+
+	if (g_str_equal (method_name, "GetMetrics")) {
+		GVariant *metrics;
+
+		metrics = remote_display_manager_get_metrics (self->manager);
+		g_dbus_method_invocation_return_value (invocation,
+						       g_variant_new ("(@a{sv})", metrics));
+		g_variant_unref (metrics);
+		return;
+	}
+
+	/* Everything else controls a device */
+	g_variant_get_child (parameters, 0, "&s", &id);
+	device = g_hash_table_lookup (self->devices, id);
+	if (!device) {
+		g_dbus_method_invocation_return_error (invocation, REMOTE_DISPLAY_ERROR,
+						       REMOTE_DISPLAY_ERROR_INVALID_ARGUMENTS,
+						       "No device with ID '%s'", id);
+		return;
+	}
+
+	if (g_str_equal (method_name, "OpenAndPlay")) {
+		g_variant_get (parameters, "(&s&st)", NULL, &uri, &position);
+		remote_display_device_open_and_play_async (device, uri, position, NULL,
+							   command_cb, invocation);
+	} else if (g_str_equal (method_name, "Play")) {
+		remote_display_device_play_async (device, NULL, command_cb, invocation);
+	} else if (g_str_equal (method_name, "Pause")) {
+		remote_display_device_pause_async (device, NULL, command_cb, invocation);
+	} else if (g_str_equal (method_name, "Stop")) {
+		remote_display_device_stop_async (device, NULL, command_cb, invocation);
+	} else if (g_str_equal (method_name, "Seek")) {
+		g_variant_get (parameters, "(&sd)", NULL, &position_ms);
+		remote_display_device_seek_async (device, position_ms, NULL, command_cb, invocation);
+	} else {
+		g_assert_not_reached ();
+	}
+}
+
+static const GDBusInterfaceVTable interface_vtable = {
+	method_call_cb,
+	NULL,
+	NULL
+};
+
+static void
+remote_display_service_finalize (GObject *object)
+{
+	RemoteDisplayService *self = REMOTE_DISPLAY_SERVICE (object);
+	GHashTableIter iter;
+	GPtrArray *devices;
+	gpointer value;
+	guint i;
+
+	remote_display_service_unexport (self);
+	g_signal_handlers_disconnect_by_data (self->manager, self);
+	g_hash_table_iter_init (&iter, self->devices);
+	while (g_hash_table_iter_next (&iter, NULL, &value))
+		g_signal_handlers_disconnect_by_data (value, self);
+	/* The devices not exported are watched too */
+	devices = remote_display_manager_get_devices (self->manager);
+	for (i = 0; i < devices->len; i++)
+		g_signal_handlers_disconnect_by_data (g_ptr_array_index (devices, i), self);
+	g_ptr_array_unref (devices);
+	g_clear_pointer (&self->devices, g_hash_table_destroy);
+	g_clear_object (&self->manager);
+
+	G_OBJECT_CLASS (remote_display_service_parent_class)->finalize (object);
+}
+
+static void
+remote_display_service_class_init (RemoteDisplayServiceClass *klass)
+{
+	GObjectClass *o_class = (GObjectClass *)klass;
+
+	o_class->finalize = remote_display_service_finalize;
+
+	introspection_data = g_dbus_node_info_new_for_xml (introspection_xml, NULL);
+	g_assert (introspection_data != NULL);
+}
+
+static void
+remote_display_service_init (RemoteDisplayService *self)
+{
+	self->devices = g_hash_table_new_full (g_str_hash, g_str_equal,
+					       g_free, g_object_unref);
+}
+
+RemoteDisplayService *
+remote_display_service_new (RemoteDisplayManager *manager)
+{
+	RemoteDisplayService *self;
+	GPtrArray *devices;
+	guint i;
+
+	g_return_val_if_fail (IS_REMOTE_DISPLAY_MANAGER (manager), NULL);
+
+	self = g_object_new (REMOTE_DISPLAY_TYPE_SERVICE, NULL);
+	self->manager = g_object_ref (manager);
+	g_signal_connect (manager, "device-appeared",
+			  G_CALLBACK (device_appeared_cb), self);
+	g_signal_connect (manager, "device-disappeared",
+			  G_CALLBACK (device_disappeared_cb), self);
+
+	devices = remote_display_manager_get_devices (manager);
+	for (i = 0; i < devices->len; i++)
+		device_appeared_cb (manager, g_ptr_array_index (devices, i), self);
+	g_ptr_array_unref (devices);
+
+	return self;
+}
+
+gboolean
+remote_display_service_export (RemoteDisplayService  *service,
+			       GDBusConnection       *connection,
+			       GError               **error)
+{
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_SERVICE (service), FALSE);
+	g_return_val_if_fail (G_IS_DBUS_CONNECTION (connection), FALSE);
+	g_return_val_if_fail (service->connection == NULL, FALSE);
+
+	service->registration_id = g_dbus_connection_register_object (connection,
+								      REMOTE_DISPLAY_DBUS_PATH,
+								      introspection_data->interfaces[0],
+								      &interface_vtable,
+								      service, NULL,
+								      error);
+	if (service->registration_id == 0)
+		return FALSE;
+
+	service->connection = g_object_ref (connection);
+	return TRUE;
+}
+
+void
+remote_display_service_unexport (RemoteDisplayService *service)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_SERVICE (service));
+
+	if (!service->connection)
+		return;
+
+	g_dbus_connection_unregister_object (service->connection, service->registration_id);
+	service->registration_id = 0;
+	g_clear_object (&service->connection);
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __REMOTE_DISPLAY_SERVICE_H__
+#define __REMOTE_DISPLAY_SERVICE_H__
+
+#include <glib-object.h>
+#include <gio/gio.h>
+#include <libremote-display/remote-display-manager.h>
+
+G_BEGIN_DECLS
+
+#define REMOTE_DISPLAY_DBUS_NAME      "org.gnome.RemoteDisplay"
+#define REMOTE_DISPLAY_DBUS_PATH      "/org/gnome/RemoteDisplay"
+#define REMOTE_DISPLAY_DBUS_INTERFACE "org.gnome.RemoteDisplay.Manager"
+
+#define REMOTE_DISPLAY_TYPE_SERVICE remote_display_service_get_type ()
+G_DECLARE_FINAL_TYPE (RemoteDisplayService, remote_display_service, REMOTE_DISPLAY, SERVICE, GObject)
+
+/* Exports the devices of a manager, and control over them, so
+ * that applications share one discovery instead of each
+ * browsing, resolving and probing the network */
+RemoteDisplayService *remote_display_service_new      (RemoteDisplayManager  *manager);
+gboolean              remote_display_service_export   (RemoteDisplayService  *service,
+						       GDBusConnection       *connection,
+						       GError               **error);
+void                  remote_display_service_unexport (RemoteDisplayService  *service);
+
+G_END_DECLS
+
+#endif /* __REMOTE_DISPLAY_SERVICE_H__ */
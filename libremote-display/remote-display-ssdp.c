@@ -0,0 +1,530 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <gio/gio.h>
+#include <libsoup/soup.h>
+
+#include <libremote-display/remote-display-ssdp.h>
+
+#define SSDP_ADDRESS      "239.255.255.250"
+#define SSDP_PORT         1900
+#define SEARCH_MX         2
+#define SEARCH_RETRY      1                    /* seconds, UDP gets lost */
+#define SEARCH_INTERVAL   300                  /* seconds */
+#define EXPIRY_INTERVAL   10                   /* seconds */
+#define DEFAULT_MAX_AGE   1800                 /* seconds */
+#define MAX_MESSAGE_SIZE  2048
+
+typedef struct {
+	char *location;
+	gint64 expires;
+} SsdpEntry;
+
+struct _RemoteDisplaySsdp {
+	GObject parent_instance;
+
+	char *search_target;
+	GInetSocketAddress *target;            /* Where searches are sent */
+
+	GSocket *search_socket;                /* Searches and their replies */
+	GSource *search_source;
+	GSocket *notify_socket;                /* Multicast announcements */
+	GSource *notify_source;
+
+	GHashTable *entries;                   /* key = USN, value = SsdpEntry */
+	GMainContext *context;                 /* Where it was started */
+	guint retry_id;
+	guint search_id;
+	guint expiry_id;
+};
+
+G_DEFINE_TYPE (RemoteDisplaySsdp, remote_display_ssdp, G_TYPE_OBJECT);
+
+enum {
+	FOUND,
+	LOST,
+	NUM_SIGS
+};
+
+static guint signals[NUM_SIGS] = {0,};
+
+static void
+entry_free (SsdpEntry *entry)
+{
+	g_free (entry->location);
+	g_free (entry);
+}
+
+static guint
+parse_max_age (const char *cache_control)
+{
+	const char *s;
+
+	if (!cache_control)
+		return DEFAULT_MAX_AGE;
+	s = strstr (cache_control, "max-age");
+	if (!s)
+		return DEFAULT_MAX_AGE;
+	s = strchr (s, '=');
+	if (!s)
+		return DEFAULT_MAX_AGE;
+	return MAX (atoi (s + 1), 1);
+}
+
+static void
+handle_alive (RemoteDisplaySsdp *ssdp,
+	      const char        *usn,
+	      const char        *location,
+	      guint              max_age)
+{
+	SsdpEntry *entry;
+
+	entry = g_hash_table_lookup (ssdp->entries, usn);
+	if (entry) {
+		entry->expires = g_get_monotonic_time () + (gint64) max_age * G_USEC_PER_SEC;
+		if (g_strcmp0 (entry->location, location) == 0)
+			return;
+
+		/* Moved, to another address or port */
+		g_signal_emit (ssdp, signals[LOST], 0, usn);
+		g_free (entry->location);
+		entry->location = g_strdup (location);
+		g_signal_emit (ssdp, signals[FOUND], 0, usn, location);
+		return;
+	}
+
+	entry = g_new0 (SsdpEntry, 1);
+	entry->location = g_strdup (location);
+	entry->expires = g_get_monotonic_time () + (gint64) max_age * G_USEC_PER_SEC;
+	g_hash_table_insert (ssdp->entries, g_strdup (usn), entry);
+
+	g_debug ("SSDP found '%s' at %s", usn, location);
+	g_signal_emit (ssdp, signals[FOUND], 0, usn, location);
+}
+
+static void
+handle_byebye (RemoteDisplaySsdp *ssdp,
+	       const char        *usn)
+{
+	if (!g_hash_table_contains (ssdp->entries, usn))
+		return;
+
+	g_debug ("SSDP lost '%s'", usn);
+	g_signal_emit (ssdp, signals[LOST], 0, usn);
+	g_hash_table_remove (ssdp->entries, usn);
+}
+
+/* Search replies and announcements are both HTTP over UDP */
+static void
+handle_message (RemoteDisplaySsdp *ssdp,
+		const char        *data,
+		gsize              len)
+{
+	SoupMessageHeaders *headers;
+	const char *type, *usn, *location;
+	gboolean alive = TRUE;
+
+	if (g_str_has_prefix (data, "HTTP/")) {
+		guint status;
+
+		headers = soup_message_headers_new (SOUP_MESSAGE_HEADERS_RESPONSE);
+		if (!soup_headers_parse_response (data, len, headers, NULL, &status, NULL) ||
+		    status != SOUP_STATUS_OK)
+			goto out;
+		type = soup_message_headers_get_one (headers, "ST");
+	} else {
+		char *method = NULL, *path = NULL;
+		guint status;
+
+		headers = soup_message_headers_new (SOUP_MESSAGE_HEADERS_REQUEST);
+		status = soup_headers_parse_request (data, len, headers, &method, &path, NULL);
+		if (status != SOUP_STATUS_OK || g_strcmp0 (method, "NOTIFY") != 0) {
+			/* Including other control points' searches */
+			g_free (method);
+			g_free (path);
+			goto out;
+		}
+		g_free (method);
+		g_free (path);
+
+		type = soup_message_headers_get_one (headers, "NT");
+		alive = g_strcmp0 (soup_message_headers_get_one (headers, "NTS"), "ssdp:byebye") != 0;
+	}
+
+	if (g_strcmp0 (type, ssdp->search_target) != 0)
+		goto out;
+	usn = soup_message_headers_get_one (headers, "USN");
+	if (!usn)
+		goto out;
+
+	if (alive) {
+		location = soup_message_headers_get_one (headers, "LOCATION");
+		if (location)
+			handle_alive (ssdp, usn, location,
+				      parse_max_age (soup_message_headers_get_one (headers, "CACHE-CONTROL")));
+	} else {
+		handle_byebye (ssdp, usn);
+	}
+
+out:
+	soup_message_headers_free (headers);
+}
+
+static gboolean
+socket_read_cb (GSocket      *socket,
+		GIOCondition  condition,
+		gpointer      user_data)
+{
+	RemoteDisplaySsdp *ssdp = user_data;
+	char buffer[MAX_MESSAGE_SIZE];
+	GError *error = NULL;
+	gssize len;
+
+	len = g_socket_receive (socket, buffer, sizeof(buffer) - 1, NULL, &error);
+	if (len < 0) {
+		if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+			g_debug ("Failed to read SSDP message: %s", error->message);
+		g_error_free (error);
+		return G_SOURCE_CONTINUE;
+	}
+
+	buffer[len] = '\0';
+	handle_message (ssdp, buffer, len);
+
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+expiry_cb (gpointer user_data)
+{
+	RemoteDisplaySsdp *ssdp = user_data;
+	GHashTableIter iter;
+	gpointer key, value;
+	gint64 now;
+
+	now = g_get_monotonic_time ();
+	g_hash_table_iter_init (&iter, ssdp->entries);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		SsdpEntry *entry = value;
+
+		if (entry->expires > now)
+			continue;
+		g_debug ("SSDP entry '%s' expired", (char *) key);
+		g_signal_emit (ssdp, signals[LOST], 0, key);
+		g_hash_table_iter_remove (&iter);
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+retry_cb (gpointer user_data)
+{
+	RemoteDisplaySsdp *ssdp = user_data;
+
+	ssdp->retry_id = 0;
+	remote_display_ssdp_search (ssdp);
+
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+search_cb (gpointer user_data)
+{
+	RemoteDisplaySsdp *ssdp = user_data;
+
+	remote_display_ssdp_search (ssdp);
+
+	return G_SOURCE_CONTINUE;
+}
+
+static void
+remove_timeout (RemoteDisplaySsdp *ssdp,
+		guint             *id)
+{
+	if (*id == 0)
+		return;
+	g_source_destroy (g_main_context_find_source_by_id (ssdp->context, *id));
+	*id = 0;
+}
+
+static void
+remote_display_ssdp_finalize (GObject *object)
+{
+	RemoteDisplaySsdp *ssdp = REMOTE_DISPLAY_SSDP (object);
+
+	remove_timeout (ssdp, &ssdp->retry_id);
+	remove_timeout (ssdp, &ssdp->search_id);
+	remove_timeout (ssdp, &ssdp->expiry_id);
+	if (ssdp->search_source) {
+		g_source_destroy (ssdp->search_source);
+		g_source_unref (ssdp->search_source);
+	}
+	if (ssdp->notify_source) {
+		g_source_destroy (ssdp->notify_source);
+		g_source_unref (ssdp->notify_source);
+	}
+	g_clear_object (&ssdp->search_socket);
+	g_clear_object (&ssdp->notify_socket);
+	g_clear_object (&ssdp->target);
+	g_hash_table_destroy (ssdp->entries);
+	g_free (ssdp->search_target);
+	g_clear_pointer (&ssdp->context, g_main_context_unref);
+
+	G_OBJECT_CLASS (remote_display_ssdp_parent_class)->finalize (object);
+}
+
+static void
+remote_display_ssdp_class_init (RemoteDisplaySsdpClass *klass)
+{
+	GObjectClass *o_class = (GObjectClass *)klass;
+
+	o_class->finalize = remote_display_ssdp_finalize;
+
+	/**
+	 * RemoteDisplaySsdp::found:
+	 * @ssdp: the SSDP client
+	 * @usn: the unique service name
+	 * @location: the URL of the device description
+	 **/
+	signals[FOUND] = g_signal_new ("found",
+				       REMOTE_DISPLAY_TYPE_SSDP,
+				       G_SIGNAL_RUN_FIRST,
+				       0, NULL, NULL,
+				       g_cclosure_marshal_generic,
+				       G_TYPE_NONE,
+				       2, G_TYPE_STRING, G_TYPE_STRING);
+
+	/**
+	 * RemoteDisplaySsdp::lost:
+	 * @ssdp: the SSDP client
+	 * @usn: the unique service name
+	 *
+	 * Emitted when the service said goodbye, or when it
+	 * didn't announce itself again in time.
+	 **/
+	signals[LOST] = g_signal_new ("lost",
+				      REMOTE_DISPLAY_TYPE_SSDP,
+				      G_SIGNAL_RUN_FIRST,
+				      0, NULL, NULL,
+				      g_cclosure_marshal_generic,
+				      G_TYPE_NONE,
+				      1, G_TYPE_STRING);
+}
+
+static void
+remote_display_ssdp_init (RemoteDisplaySsdp *ssdp)
+{
+	ssdp->entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+					       g_free, (GDestroyNotify) entry_free);
+}
+
+/**
+ * remote_display_ssdp_new:
+ * @search_target: the device or service type to look for
+ *
+ * Return value: a new #RemoteDisplaySsdp
+ **/
+RemoteDisplaySsdp *
+remote_display_ssdp_new (const char *search_target)
+{
+	RemoteDisplaySsdp *ssdp;
+
+	g_return_val_if_fail (search_target != NULL, NULL);
+
+	ssdp = g_object_new (REMOTE_DISPLAY_TYPE_SSDP, NULL);
+	ssdp->search_target = g_strdup (search_target);
+
+	return ssdp;
+}
+
+/**
+ * remote_display_ssdp_set_target:
+ * @ssdp: a #RemoteDisplaySsdp
+ * @target: where to send searches, or %NULL for the SSDP multicast group
+ *
+ * Sending searches to a unicast address, and not listening to
+ * multicast announcements, is useful for tests.
+ **/
+void
+remote_display_ssdp_set_target (RemoteDisplaySsdp  *ssdp,
+				GInetSocketAddress *target)
+{
+	g_return_if_fail (REMOTE_DISPLAY_IS_SSDP (ssdp));
+	g_return_if_fail (ssdp->search_socket == NULL);
+
+	g_clear_object (&ssdp->target);
+	if (target)
+		ssdp->target = g_object_ref (target);
+}
+
+static GSource *
+add_socket_source (RemoteDisplaySsdp *ssdp,
+		   GSocket           *socket)
+{
+	GSource *source;
+
+	source = g_socket_create_source (socket, G_IO_IN, NULL);
+	g_source_set_callback (source, (GSourceFunc) socket_read_cb, ssdp, NULL);
+	g_source_attach (source, ssdp->context);
+
+	return source;
+}
+
+static guint
+add_timeout (RemoteDisplaySsdp *ssdp,
+	     guint              seconds,
+	     GSourceFunc        func)
+{
+	GSource *source;
+	guint id;
+
+	source = g_timeout_source_new_seconds (seconds);
+	g_source_set_callback (source, func, ssdp, NULL);
+	id = g_source_attach (source, ssdp->context);
+	g_source_unref (source);
+
+	return id;
+}
+
+static GSocket *
+new_socket (guint16   port,
+	    gboolean  reuse,
+	    GError  **error)
+{
+	GSocketAddress *address;
+	GInetAddress *any;
+	GSocket *socket;
+	gboolean ret;
+
+	socket = g_socket_new (G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_DATAGRAM,
+			       G_SOCKET_PROTOCOL_UDP, error);
+	if (!socket)
+		return NULL;
+	g_socket_set_blocking (socket, FALSE);
+
+	any = g_inet_address_new_any (G_SOCKET_FAMILY_IPV4);
+	address = g_inet_socket_address_new (any, port);
+	ret = g_socket_bind (socket, address, reuse, error);
+	g_object_unref (address);
+	g_object_unref (any);
+	if (!ret) {
+		g_object_unref (socket);
+		return NULL;
+	}
+
+	return socket;
+}
+
+/**
+ * remote_display_ssdp_start:
+ * @ssdp: a #RemoteDisplaySsdp
+ * @error: a #GError
+ *
+ * Starts searching, and listening to announcements.
+ *
+ * Return value: %TRUE if the search could be started.
+ **/
+gboolean
+remote_display_ssdp_start (RemoteDisplaySsdp  *ssdp,
+			   GError            **error)
+{
+	GError *local_error = NULL;
+
+	g_return_val_if_fail (REMOTE_DISPLAY_IS_SSDP (ssdp), FALSE);
+	g_return_val_if_fail (ssdp->search_socket == NULL, FALSE);
+
+	g_clear_pointer (&ssdp->context, g_main_context_unref);
+	ssdp->context = g_main_context_ref_thread_default ();
+	ssdp->search_socket = new_socket (0, FALSE, error);
+	if (!ssdp->search_socket)
+		return FALSE;
+	ssdp->search_source = add_socket_source (ssdp, ssdp->search_socket);
+
+	/* Announcements are only useful on the real network, and
+	 * we can do without if another process has the port */
+	if (!ssdp->target) {
+		ssdp->notify_socket = new_socket (SSDP_PORT, TRUE, &local_error);
+		if (ssdp->notify_socket) {
+			GInetAddress *group;
+
+			group = g_inet_address_new_from_string (SSDP_ADDRESS);
+			if (!g_socket_join_multicast_group (ssdp->notify_socket, group, FALSE, NULL, &local_error))
+				g_clear_object (&ssdp->notify_socket);
+			g_object_unref (group);
+		}
+		if (ssdp->notify_socket) {
+			ssdp->notify_source = add_socket_source (ssdp, ssdp->notify_socket);
+		} else {
+			g_debug ("Not listening to SSDP announcements: %s", local_error->message);
+			g_error_free (local_error);
+		}
+	}
+
+	remote_display_ssdp_search (ssdp);
+	ssdp->retry_id = add_timeout (ssdp, SEARCH_RETRY, retry_cb);
+	ssdp->search_id = add_timeout (ssdp, SEARCH_INTERVAL, search_cb);
+	ssdp->expiry_id = add_timeout (ssdp, EXPIRY_INTERVAL, expiry_cb);
+
+	return TRUE;
+}
+
+/**
+ * remote_display_ssdp_search:
+ * @ssdp: a #RemoteDisplaySsdp
+ *
+ * Sends a new search, the replies refresh the known services.
+ **/
+void
+remote_display_ssdp_search (RemoteDisplaySsdp *ssdp)
+{
+	GSocketAddress *target;
+	GError *error = NULL;
+	char *msg;
+
+	g_return_if_fail (REMOTE_DISPLAY_IS_SSDP (ssdp));
+	g_return_if_fail (ssdp->search_socket != NULL);
+
+	if (ssdp->target) {
+		target = g_object_ref (G_SOCKET_ADDRESS (ssdp->target));
+	} else {
+		GInetAddress *group;
+
+		group = g_inet_address_new_from_string (SSDP_ADDRESS);
+		target = g_inet_socket_address_new (group, SSDP_PORT);
+		g_object_unref (group);
+	}
+
+	msg = g_strdup_printf ("M-SEARCH * HTTP/1.1\r\n"
+			       "HOST: " SSDP_ADDRESS ":%d\r\n"
+			       "MAN: \"ssdp:discover\"\r\n"
+			       "MX: %d\r\n"
+			       "ST: %s\r\n"
+			       "\r\n",
+			       SSDP_PORT, SEARCH_MX, ssdp->search_target);
+	if (g_socket_send_to (ssdp->search_socket, target, msg, strlen (msg), NULL, &error) < 0) {
+		g_debug ("Failed to send SSDP search: %s", error->message);
+		g_error_free (error);
+	}
+	g_free (msg);
+	g_object_unref (target);
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <libremote-display/remote-display-test-source.h>
+
+#define BOX_SIZE 64
+
+struct _RemoteDisplayTestSource {
+	RemoteDisplayFrameSource parent_instance;
+
+	guint width;
+	guint height;
+	guint fps;
+
+	guint timeout_id;
+	guint64 frame_count;
+	RemoteDisplayRect last_box;
+	guint32 *bars;                         /* One line of colour bars */
+};
+
+G_DEFINE_TYPE (RemoteDisplayTestSource, remote_display_test_source, REMOTE_DISPLAY_TYPE_FRAME_SOURCE);
+
+/* 75% SMPTE bars, in BGRx */
+static const guint32 bar_colours[] = {
+	0x00c0c0c0, /* grey */
+	0x00c0c000, /* yellow */
+	0x0000c0c0, /* cyan */
+	0x0000c000, /* green */
+	0x00c000c0, /* magenta */
+	0x00c00000, /* red */
+	0x000000c0, /* blue */
+};
+
+static void
+draw_box (RemoteDisplayTestSource *source,
+	  guint32                 *pixels,
+	  guint                    x,
+	  guint                    y)
+{
+	guint i, j;
+
+	for (j = y; j < y + BOX_SIZE && j < source->height; j++) {
+		for (i = x; i < x + BOX_SIZE && i < source->width; i++)
+			pixels[j * source->width + i] = 0x00ffffff;
+	}
+}
+
+static gboolean
+generate_frame_cb (gpointer user_data)
+{
+	RemoteDisplayTestSource *source = user_data;
+	RemoteDisplayFrame *frame;
+	RemoteDisplayRect damage[2];
+	guint32 *pixels;
+	GBytes *bytes;
+	guint line, x, y;
+	gsize size;
+
+	size = (gsize) source->width * source->height * 4;
+	pixels = g_malloc (size);
+	for (line = 0; line < source->height; line++)
+		memcpy (pixels + line * source->width, source->bars, source->width * 4);
+
+	/* Bounce a box around so that the encoder has some motion to chew on */
+	x = source->frame_count * 4 % (source->width > BOX_SIZE ? source->width - BOX_SIZE : 1);
+	y = source->frame_count * 2 % (source->height > BOX_SIZE ? source->height - BOX_SIZE : 1);
+	draw_box (source, pixels, x, y);
+
+	bytes = g_bytes_new_take (pixels, size);
+	frame = remote_display_frame_new (REMOTE_DISPLAY_FRAME_FORMAT_BGRX,
+					  source->width, source->height,
+					  source->width * 4, bytes);
+	g_bytes_unref (bytes);
+
+	/* Only the box moved: where it was, and where it is now */
+	damage[0] = source->last_box;
+	damage[1].x = x;
+	damage[1].y = y;
+	damage[1].width = BOX_SIZE;
+	damage[1].height = BOX_SIZE;
+	if (source->frame_count > 0)
+		remote_display_frame_set_damage (frame, damage, G_N_ELEMENTS (damage));
+	source->last_box = damage[1];
+
+	remote_display_frame_source_push_frame (REMOTE_DISPLAY_FRAME_SOURCE (source), frame);
+	remote_display_frame_unref (frame);
+
+	source->frame_count++;
+
+	return G_SOURCE_CONTINUE;
+}
+
+static void
+remote_display_test_source_start (RemoteDisplayFrameSource *frame_source)
+{
+	RemoteDisplayTestSource *source = REMOTE_DISPLAY_TEST_SOURCE (frame_source);
+
+	g_return_if_fail (source->timeout_id == 0);
+
+	/* The first frame after a restart needs to be complete */
+	source->frame_count = 0;
+
+	source->timeout_id = g_timeout_add_full (G_PRIORITY_HIGH,
+						 1000 / source->fps,
+						 generate_frame_cb,
+						 source, NULL);
+}
+
+static void
+remote_display_test_source_stop (RemoteDisplayFrameSource *frame_source)
+{
+	RemoteDisplayTestSource *source = REMOTE_DISPLAY_TEST_SOURCE (frame_source);
+
+	if (source->timeout_id != 0) {
+		g_source_remove (source->timeout_id);
+		source->timeout_id = 0;
+	}
+}
+
+static void
+remote_display_test_source_finalize (GObject *object)
+{
+	RemoteDisplayTestSource *source = REMOTE_DISPLAY_TEST_SOURCE (object);
+
+	if (source->timeout_id != 0)
+		g_source_remove (source->timeout_id);
+	g_free (source->bars);
+
+	G_OBJECT_CLASS (remote_display_test_source_parent_class)->finalize (object);
+}
+
+static void
+remote_display_test_source_class_init (RemoteDisplayTestSourceClass *klass)
+{
+	GObjectClass *o_class = (GObjectClass *)klass;
+	RemoteDisplayFrameSourceClass *source_class = (RemoteDisplayFrameSourceClass *)klass;
+
+	o_class->finalize = remote_display_test_source_finalize;
+	source_class->start = remote_display_test_source_start;
+	source_class->stop = remote_display_test_source_stop;
+}
+
+static void
+remote_display_test_source_init (RemoteDisplayTestSource *source)
+{
+}
+
+/**
+ * remote_display_test_source_new:
+ * @width: the width of the generated frames
+ * @height: the height of the generated frames
+ * @fps: the number of frames generated per second
+ *
+ * Creates a frame source that generates colour bars with a moving
+ * box, useful to test mirroring without a screen capture backend.
+ *
+ * Return value: a new #RemoteDisplayFrameSource
+ **/
+RemoteDisplayFrameSource *
+remote_display_test_source_new (guint width,
+				guint height,
+				guint fps)
+{
+	RemoteDisplayTestSource *source;
+	guint i;
+
+	g_return_val_if_fail (width > 0 && height > 0, NULL);
+	g_return_val_if_fail (fps > 0 && fps <= 1000, NULL);
+
+	source = g_object_new (REMOTE_DISPLAY_TYPE_TEST_SOURCE, NULL);
+	source->width = width;
+	source->height = height;
+	source->fps = fps;
+
+	source->bars = g_new (guint32, width);
+	for (i = 0; i < width; i++)
+		source->bars[i] = bar_colours[i * G_N_ELEMENTS (bar_colours) / width];
+
+	return REMOTE_DISPLAY_FRAME_SOURCE (source);
+}
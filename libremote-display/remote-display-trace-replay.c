@@ -0,0 +1,518 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <string.h>
+
+#include <gio/gio.h>
+#include <libsoup/soup.h>
+
+#include <libremote-display/remote-display-trace-replay.h>
+#include <libremote-display/remote-display-device.h>
+#include <libremote-display/remote-display-error.h>
+#include <libremote-display/remote-display-mock-airplay.h>
+
+void
+remote_display_trace_entry_free (RemoteDisplayTraceEntry *entry)
+{
+	g_free (entry->device);
+	g_free (entry->method);
+	g_free (entry->path);
+	g_free (entry->body);
+	g_free (entry->state);
+	g_free (entry);
+}
+
+static RemoteDisplayTraceEntry *
+parse_entry (char **fields)
+{
+	RemoteDisplayTraceEntry *entry;
+	guint n_fields;
+	char *end;
+
+	n_fields = g_strv_length (fields);
+	if (n_fields < 4)
+		return NULL;
+
+	entry = g_new0 (RemoteDisplayTraceEntry, 1);
+	entry->time = g_ascii_strtoll (fields[0], &end, 10);
+	if (*end != '\0' || entry->time < 0)
+		goto bail;
+	entry->device = g_strdup (fields[1]);
+
+	if (g_str_equal (fields[2], "request") && n_fields == 6) {
+		entry->type = REMOTE_DISPLAY_TRACE_REQUEST;
+		entry->method = g_strdup (fields[3]);
+		entry->path = g_strdup (fields[4]);
+		if (*fields[5] != '\0')
+			entry->body = g_strcompress (fields[5]);
+	} else if (g_str_equal (fields[2], "reply") && n_fields == 4) {
+		entry->type = REMOTE_DISPLAY_TRACE_REPLY;
+		entry->status = g_ascii_strtoull (fields[3], &end, 10);
+		if (*end != '\0')
+			goto bail;
+	} else if (g_str_equal (fields[2], "event") && n_fields == 4) {
+		entry->type = REMOTE_DISPLAY_TRACE_EVENT;
+		entry->state = g_strcompress (fields[3]);
+	} else {
+		goto bail;
+	}
+
+	return entry;
+
+bail:
+	remote_display_trace_entry_free (entry);
+	return NULL;
+}
+
+/**
+ * remote_display_trace_load:
+ *
+ * Return value: (transfer container): the entries, in the order
+ * they were recorded, or %NULL on error
+ **/
+GPtrArray *
+remote_display_trace_load (const char  *filename,
+			   GError     **error)
+{
+	GPtrArray *entries;
+	char *contents;
+	char **lines;
+	guint i;
+
+	g_return_val_if_fail (filename != NULL, NULL);
+
+	if (!g_file_get_contents (filename, &contents, NULL, error))
+		return NULL;
+	lines = g_strsplit (contents, "\n", -1);
+	g_free (contents);
+
+	entries = g_ptr_array_new_with_free_func ((GDestroyNotify) remote_display_trace_entry_free);
+	for (i = 0; lines[i] != NULL; i++) {
+		RemoteDisplayTraceEntry *entry;
+		char **fields;
+
+		if (*lines[i] == '\0' || *lines[i] == '#')
+			continue;
+
+		fields = g_strsplit (lines[i], "\t", -1);
+		entry = parse_entry (fields);
+		g_strfreev (fields);
+
+		if (!entry) {
+			g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+				     "Invalid entry on line %d of '%s'", i + 1, filename);
+			g_ptr_array_unref (entries);
+			entries = NULL;
+			break;
+		}
+		g_ptr_array_add (entries, entry);
+	}
+	g_strfreev (lines);
+
+	return entries;
+}
+
+/* Replay */
+
+typedef struct {
+	GPtrArray *all;                /* Keeps the entries alive */
+	GPtrArray *entries;            /* For the replayed device */
+	guint next;
+	char *uri;
+	gdouble speed;
+	gint64 start;
+	guint timeout_id;
+	GSource *cancel_source;
+	gboolean finished;
+
+	RemoteDisplayMockAirplay *mock;
+	RemoteDisplayDevice *device;
+	GQueue *pending;               /* of ReplayRequest, in the order they were sent */
+	RemoteDisplayTraceReplayResults *results;
+} Replay;
+
+typedef struct {
+	gint64 sent;
+	gdouble recorded_ms;           /* < 0 without a recorded reply */
+	guint status;
+} ReplayRequest;
+
+void
+remote_display_trace_replay_results_free (RemoteDisplayTraceReplayResults *results)
+{
+	g_array_unref (results->recorded_ms);
+	g_array_unref (results->replayed_ms);
+	g_free (results);
+}
+
+static void
+replay_free (Replay *replay)
+{
+	g_ptr_array_unref (replay->entries);
+	g_ptr_array_unref (replay->all);
+	g_free (replay->uri);
+	g_clear_object (&replay->device);
+	g_clear_object (&replay->mock);
+	g_queue_free_full (replay->pending, g_free);
+	if (replay->results)
+		remote_display_trace_replay_results_free (replay->results);
+	g_free (replay);
+}
+
+static void
+replay_return (GTask  *task,
+	       GError *error)
+{
+	Replay *replay = g_task_get_task_data (task);
+
+	if (replay->finished) {
+		if (error)
+			g_error_free (error);
+		return;
+	}
+	replay->finished = TRUE;
+	if (replay->timeout_id != 0) {
+		g_source_remove (replay->timeout_id);
+		replay->timeout_id = 0;
+	}
+	if (replay->cancel_source) {
+		g_source_destroy (replay->cancel_source);
+		g_clear_pointer (&replay->cancel_source, g_source_unref);
+	}
+
+	if (error) {
+		g_task_return_error (task, error);
+	} else {
+		g_task_return_pointer (task, replay->results,
+				       (GDestroyNotify) remote_display_trace_replay_results_free);
+		replay->results = NULL;
+	}
+	/* Drops the reference the replay held on itself */
+	g_object_unref (task);
+}
+
+static void
+command_cb (GObject      *source_object,
+	    GAsyncResult *result,
+	    gpointer      user_data)
+{
+	GTask *task = user_data;
+	Replay *replay = g_task_get_task_data (task);
+	ReplayRequest *request;
+	GError *error = NULL;
+	gboolean expected;
+
+	/* Only the result matters, not which command it was */
+	g_task_propagate_boolean (G_TASK (result), &error);
+
+	request = g_queue_pop_head (replay->pending);
+	if (replay->finished ||
+	    g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		g_clear_error (&error);
+		g_free (request);
+		g_object_unref (task);
+		return;
+	}
+
+	if (request->recorded_ms >= 0.0) {
+		gdouble replayed_ms;
+
+		replayed_ms = (g_get_monotonic_time () - request->sent) * replay->speed / 1000.0;
+		g_array_append_val (replay->results->recorded_ms, request->recorded_ms);
+		g_array_append_val (replay->results->replayed_ms, replayed_ms);
+
+		if (SOUP_STATUS_IS_TRANSPORT_ERROR (request->status))
+			expected = g_error_matches (error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_UNREACHABLE);
+		else if (request->status != SOUP_STATUS_OK)
+			expected = g_error_matches (error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_COMMAND_FAILED);
+		else
+			expected = (error == NULL);
+		if (!expected)
+			replay->results->mismatches++;
+	}
+	g_clear_error (&error);
+	g_free (request);
+
+	if (replay->next >= replay->entries->len &&
+	    g_queue_is_empty (replay->pending))
+		replay_return (task, NULL);
+	g_object_unref (task);
+}
+
+static const RemoteDisplayTraceEntry *
+find_reply (Replay *replay,
+	    guint   index)
+{
+	guint i;
+
+	/* Requests to one device are sent one at a time */
+	for (i = index + 1; i < replay->entries->len; i++) {
+		const RemoteDisplayTraceEntry *entry = g_ptr_array_index (replay->entries, i);
+
+		if (entry->type == REMOTE_DISPLAY_TRACE_REPLY)
+			return entry;
+		if (entry->type == REMOTE_DISPLAY_TRACE_REQUEST)
+			break;
+	}
+
+	return NULL;
+}
+
+static gdouble
+parse_query_value (const char *path,
+		   const char *name)
+{
+	const char *query;
+	GHashTable *form;
+	const char *value;
+	gdouble ret = 0.0;
+
+	query = strchr (path, '?');
+	if (!query)
+		return 0.0;
+	form = soup_form_decode (query + 1);
+	value = g_hash_table_lookup (form, name);
+	if (value)
+		ret = g_ascii_strtod (value, NULL);
+	g_hash_table_destroy (form);
+
+	return ret;
+}
+
+static gboolean
+send_request (GTask                         *task,
+	      guint                          index,
+	      const RemoteDisplayTraceEntry *entry)
+{
+	Replay *replay = g_task_get_task_data (task);
+	GCancellable *cancellable = g_task_get_cancellable (task);
+	const RemoteDisplayTraceEntry *reply;
+	ReplayRequest *request;
+
+	request = g_new0 (ReplayRequest, 1);
+	request->recorded_ms = -1.0;
+
+	if (g_str_has_prefix (entry->path, "/play")) {
+		const char *uri = replay->uri;
+		gdouble position = 0.0;
+		char **lines;
+		guint i;
+
+		lines = g_strsplit (entry->body ? entry->body : "", "\n", -1);
+		for (i = 0; lines[i] != NULL; i++) {
+			if (!uri && g_str_has_prefix (lines[i], "Content-Location: "))
+				uri = lines[i] + strlen ("Content-Location: ");
+			else if (g_str_has_prefix (lines[i], "Start-Position: "))
+				position = g_ascii_strtod (lines[i] + strlen ("Start-Position: "), NULL);
+		}
+		if (uri)
+			remote_display_device_open_and_play_async (replay->device, uri, position,
+								   cancellable, command_cb,
+								   g_object_ref (task));
+		g_strfreev (lines);
+		if (!uri)
+			goto unknown;
+	} else if (g_str_has_prefix (entry->path, "/rate")) {
+		if (parse_query_value (entry->path, "value") == 0.0)
+			remote_display_device_pause_async (replay->device, cancellable,
+							   command_cb, g_object_ref (task));
+		else
+			remote_display_device_play_async (replay->device, cancellable,
+							  command_cb, g_object_ref (task));
+	} else if (g_str_has_prefix (entry->path, "/scrub")) {
+		remote_display_device_seek_async (replay->device,
+						  parse_query_value (entry->path, "position"),
+						  cancellable, command_cb, g_object_ref (task));
+	} else if (g_str_has_prefix (entry->path, "/stop")) {
+		remote_display_device_stop_async (replay->device, cancellable,
+						  command_cb, g_object_ref (task));
+	} else {
+		goto unknown;
+	}
+
+	/* The receiver answers the way it did when recording, the
+	 * request only reaches it once we're back in the main loop */
+	reply = find_reply (replay, index);
+	if (reply && reply->status != SOUP_STATUS_CANCELLED) {
+		request->status = reply->status;
+		request->recorded_ms = (reply->time - entry->time) / 1000.0;
+		remote_display_mock_airplay_queue_reply (replay->mock,
+							 request->recorded_ms / replay->speed,
+							 SOUP_STATUS_IS_TRANSPORT_ERROR (reply->status) ? 0 : reply->status);
+	}
+
+	request->sent = g_get_monotonic_time ();
+	g_queue_push_tail (replay->pending, request);
+	replay->results->requests++;
+	return TRUE;
+
+unknown:
+	g_free (request);
+	return FALSE;
+}
+
+static gboolean
+replay_cb (gpointer user_data)
+{
+	GTask *task = user_data;
+	Replay *replay = g_task_get_task_data (task);
+	const RemoteDisplayTraceEntry *entry;
+	gint64 elapsed;
+
+	replay->timeout_id = 0;
+	elapsed = (g_get_monotonic_time () - replay->start) * replay->speed;
+
+	while (replay->next < replay->entries->len) {
+		guint index = replay->next;
+
+		entry = g_ptr_array_index (replay->entries, index);
+		if (entry->time > elapsed)
+			break;
+		replay->next++;
+
+		if (entry->type == REMOTE_DISPLAY_TRACE_REQUEST) {
+			if (!send_request (task, index, entry)) {
+				replay_return (task, g_error_new (REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_NOT_SUPPORTED,
+								  "Can't replay request %s %s",
+								  entry->method, entry->path));
+				return G_SOURCE_REMOVE;
+			}
+		} else if (entry->type == REMOTE_DISPLAY_TRACE_EVENT) {
+			remote_display_mock_airplay_push_state (replay->mock, entry->state);
+			replay->results->events++;
+		}
+	}
+
+	if (replay->next < replay->entries->len) {
+		entry = g_ptr_array_index (replay->entries, replay->next);
+		replay->timeout_id = g_timeout_add ((entry->time - elapsed) / replay->speed / 1000,
+						    replay_cb, task);
+	} else if (g_queue_is_empty (replay->pending)) {
+		replay_return (task, NULL);
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+replay_cancelled_cb (GCancellable *cancellable,
+		     gpointer      user_data)
+{
+	GTask *task = user_data;
+
+	replay_return (task, g_error_new_literal (G_IO_ERROR, G_IO_ERROR_CANCELLED,
+						  "Operation was cancelled"));
+
+	return G_SOURCE_REMOVE;
+}
+
+/**
+ * remote_display_trace_replay_async:
+ * @entries: as returned by remote_display_trace_load()
+ * @device: (allow-none): the ID of the device to replay, or %NULL
+ *   for the first one in the trace
+ * @uri: (allow-none): what to play instead of the recorded URIs
+ * @speed: 1.0 for the original speed, higher to accelerate
+ *
+ * Sends the recorded requests to a mock receiver at the recorded
+ * times, with the mock answering after the recorded latency and
+ * with the recorded status, and pushing the recorded events.
+ **/
+void
+remote_display_trace_replay_async (GPtrArray            *entries,
+				   const char           *device,
+				   const char           *uri,
+				   gdouble               speed,
+				   GCancellable         *cancellable,
+				   GAsyncReadyCallback   callback,
+				   gpointer              user_data)
+{
+	GTask *task;
+	Replay *replay;
+	GError *error = NULL;
+	guint i;
+
+	g_return_if_fail (entries != NULL);
+	g_return_if_fail (speed > 0.0);
+
+	task = g_task_new (NULL, cancellable, callback, user_data);
+	g_task_set_source_tag (task, remote_display_trace_replay_async);
+
+	replay = g_new0 (Replay, 1);
+	replay->all = g_ptr_array_ref (entries);
+	replay->entries = g_ptr_array_new ();
+	replay->uri = g_strdup (uri);
+	replay->speed = speed;
+	replay->pending = g_queue_new ();
+	replay->results = g_new0 (RemoteDisplayTraceReplayResults, 1);
+	replay->results->recorded_ms = g_array_new (FALSE, FALSE, sizeof (gdouble));
+	replay->results->replayed_ms = g_array_new (FALSE, FALSE, sizeof (gdouble));
+	g_task_set_task_data (task, replay, (GDestroyNotify) replay_free);
+
+	for (i = 0; i < entries->len; i++) {
+		RemoteDisplayTraceEntry *entry = g_ptr_array_index (entries, i);
+
+		if (!device)
+			device = entry->device;
+		if (g_strcmp0 (entry->device, device) == 0)
+			g_ptr_array_add (replay->entries, entry);
+	}
+	if (replay->entries->len == 0) {
+		g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+					 "Nothing to replay for '%s'", device ? device : "any device");
+		g_object_unref (task);
+		return;
+	}
+
+	/* The recorded events replace the ones the mock would send */
+	replay->mock = remote_display_mock_airplay_new (device);
+	remote_display_mock_airplay_set_push_events (replay->mock, FALSE);
+	if (!remote_display_mock_airplay_start (replay->mock, &error)) {
+		g_task_return_error (task, error);
+		g_object_unref (task);
+		return;
+	}
+	replay->device = remote_display_mock_airplay_new_device (replay->mock, "Replay");
+
+	if (cancellable) {
+		replay->cancel_source = g_cancellable_source_new (cancellable);
+		g_source_set_callback (replay->cancel_source, (GSourceFunc) replay_cancelled_cb, task, NULL);
+		g_source_attach (replay->cancel_source, NULL);
+	}
+
+	/* Start the clock at the first entry, the reference
+	 * to the task is dropped when it returns */
+	replay->start = g_get_monotonic_time ()
+		- ((RemoteDisplayTraceEntry *) g_ptr_array_index (replay->entries, 0))->time / speed;
+	replay->timeout_id = g_idle_add (replay_cb, task);
+}
+
+/**
+ * remote_display_trace_replay_finish:
+ *
+ * Return value: (transfer full): the results, free with
+ * remote_display_trace_replay_results_free()
+ **/
+RemoteDisplayTraceReplayResults *
+remote_display_trace_replay_finish (GAsyncResult  *result,
+				    GError       **error)
+{
+	g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+
+	return g_task_propagate_pointer (G_TASK (result), error);
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __REMOTE_DISPLAY_TRACE_REPLAY_H__
+#define __REMOTE_DISPLAY_TRACE_REPLAY_H__
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <libremote-display/remote-display-trace.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+	REMOTE_DISPLAY_TRACE_REQUEST,
+	REMOTE_DISPLAY_TRACE_REPLY,
+	REMOTE_DISPLAY_TRACE_EVENT
+} RemoteDisplayTraceType;
+
+typedef struct {
+	gint64 time;
+	RemoteDisplayTraceType type;
+	char *device;
+	char *method;                  /* Requests */
+	char *path;                    /* Requests, with the query */
+	char *body;                    /* Requests, NULL if empty */
+	guint status;                  /* Replies */
+	char *state;                   /* Events */
+} RemoteDisplayTraceEntry;
+
+void       remote_display_trace_entry_free       (RemoteDisplayTraceEntry *entry);
+GPtrArray *remote_display_trace_load             (const char  *filename,
+						  GError     **error);
+
+typedef struct {
+	guint requests;                /* Replayed */
+	guint mismatches;              /* Outcome differed from the recording */
+	guint events;                  /* Pushed by the mock receiver */
+	GArray *recorded_ms;           /* of gdouble, request to reply */
+	GArray *replayed_ms;           /* of gdouble, scaled back to the original speed */
+} RemoteDisplayTraceReplayResults;
+
+void       remote_display_trace_replay_results_free (RemoteDisplayTraceReplayResults *results);
+
+void       remote_display_trace_replay_async     (GPtrArray            *entries,
+						  const char           *device,
+						  const char           *uri,
+						  gdouble               speed,
+						  GCancellable         *cancellable,
+						  GAsyncReadyCallback   callback,
+						  gpointer              user_data);
+RemoteDisplayTraceReplayResults *
+           remote_display_trace_replay_finish    (GAsyncResult         *result,
+						  GError              **error);
+
+G_END_DECLS
+
+#endif /* __REMOTE_DISPLAY_TRACE_REPLAY_H__ */
@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include <libremote-display/remote-display-trace.h>
+
+#define TRACE_HEADER "# remote-display trace 1"
+
+typedef struct {
+	GMutex lock;
+	FILE *file;
+	gint64 start;
+} Recorder;
+
+static gpointer
+open_recorder (gpointer data)
+{
+	Recorder *recorder;
+	const char *filename;
+	FILE *file;
+
+	filename = g_getenv ("REMOTE_DISPLAY_RECORD");
+	if (filename == NULL || *filename == '\0')
+		return NULL;
+
+	file = g_fopen (filename, "w");
+	if (!file) {
+		g_warning ("Failed to open trace '%s': %s", filename, g_strerror (errno));
+		return NULL;
+	}
+	fprintf (file, TRACE_HEADER "\n");
+
+	recorder = g_new0 (Recorder, 1);
+	g_mutex_init (&recorder->lock);
+	recorder->file = file;
+	recorder->start = -1;
+
+	return recorder;
+}
+
+static Recorder *
+get_recorder (void)
+{
+	static GOnce once = G_ONCE_INIT;
+
+	g_once (&once, open_recorder, NULL);
+	return once.retval;
+}
+
+gboolean
+remote_display_trace_is_recording (void)
+{
+	return get_recorder () != NULL;
+}
+
+static void
+record (const char *device,
+	const char *format,
+	...)
+{
+	Recorder *recorder;
+	va_list args;
+	gint64 now;
+
+	recorder = get_recorder ();
+	if (!recorder)
+		return;
+
+	now = g_get_monotonic_time ();
+	g_mutex_lock (&recorder->lock);
+	if (recorder->start < 0)
+		recorder->start = now;
+	fprintf (recorder->file, "%" G_GINT64_FORMAT "\t%s\t",
+		 now - recorder->start, device ? device : "-");
+	va_start (args, format);
+	vfprintf (recorder->file, format, args);
+	va_end (args);
+	fputc ('\n', recorder->file);
+	/* Keep what was recorded if the application crashes */
+	fflush (recorder->file);
+	g_mutex_unlock (&recorder->lock);
+}
+
+void
+remote_display_trace_record_request (const char *device,
+				     const char *method,
+				     const char *path,
+				     const char *body)
+{
+	char *escaped;
+
+	if (!remote_display_trace_is_recording ())
+		return;
+
+	escaped = g_strescape (body ? body : "", NULL);
+	record (device, "request\t%s\t%s\t%s", method, path, escaped);
+	g_free (escaped);
+}
+
+void
+remote_display_trace_record_reply (const char *device,
+				   guint       status)
+{
+	record (device, "reply\t%u", status);
+}
+
+void
+remote_display_trace_record_event (const char *device,
+				   const char *state)
+{
+	char *escaped;
+
+	if (!remote_display_trace_is_recording ())
+		return;
+
+	escaped = g_strescape (state ? state : "", NULL);
+	record (device, "event\t%s", escaped);
+	g_free (escaped);
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __REMOTE_DISPLAY_TRACE_H__
+#define __REMOTE_DISPLAY_TRACE_H__
+
+#include <glib.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Traces of AirPlay sessions, recorded when REMOTE_DISPLAY_RECORD
+ * is set to a file name, and replayed against a mock receiver.
+ *
+ * The format is text, one entry per line, tab-separated:
+ *   <usecs> <device> request <method> <path> <escaped body>
+ *   <usecs> <device> reply <status>
+ *   <usecs> <device> event <state>
+ * Timestamps are relative to the first entry. Lines starting
+ * with '#' are comments. Loading and replaying traces is in
+ * remote-display-trace-replay.h, only built for the tests. */
+
+gboolean   remote_display_trace_is_recording     (void);
+void       remote_display_trace_record_request   (const char *device,
+						  const char *method,
+						  const char *path,
+						  const char *body);
+void       remote_display_trace_record_reply     (const char *device,
+						  guint       status);
+void       remote_display_trace_record_event     (const char *device,
+						  const char *state);
+
+G_END_DECLS
+
+#endif /* __REMOTE_DISPLAY_TRACE_H__ */
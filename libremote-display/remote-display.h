@@ -29,6 +29,11 @@
 #include <libremote-display/remote-display-enum-types.h>
 #include <libremote-display/remote-display-manager.h>
 #include <libremote-display/remote-display-device.h>
+#include <libremote-display/remote-display-frame-source.h>
+#include <libremote-display/remote-display-test-source.h>
+#include <libremote-display/remote-display-mirror.h>
+#include <libremote-display/remote-display-audio-stream.h>
+#include <libremote-display/remote-display-group.h>
 #include <libremote-display/remote-display-enum-types.h>
 
 #endif /* REMOTE_DISPLAY_H */
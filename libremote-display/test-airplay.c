@@ -0,0 +1,838 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <gio/gio.h>
+#include <libremote-display/remote-display.h>
+#include <libremote-display/remote-display-mock-airplay.h>
+#include <libremote-display/remote-display-device-private.h>
+#include <libremote-display/remote-display-device-airplay.h>
+#include <libremote-display/remote-display-host.h>
+#include <libremote-display/remote-display-remux.h>
+#include "test-util.h"
+
+#define DEVICE_ID  "58:55:CA:1A:E2:88"
+#define MEDIA_SIZE (256 * 1024)
+
+typedef struct {
+	RemoteDisplayMockAirplay *mock;
+	RemoteDisplayDevice *device;
+	RemoteDisplayDeviceState state;
+	GPtrArray *requests;
+	char *path;
+	char *uri;
+
+	gboolean done;
+	GError *error;
+} Receiver;
+
+static void
+request_cb (RemoteDisplayMockAirplay *mock,
+	    const char               *method,
+	    const char               *path,
+	    Receiver                 *receiver)
+{
+	g_ptr_array_add (receiver->requests, g_strdup (path));
+}
+
+static void
+state_changed_cb (RemoteDisplayDevice      *device,
+		  RemoteDisplayDeviceState  state,
+		  Receiver                 *receiver)
+{
+	receiver->state = state;
+}
+
+static void
+receiver_setup (Receiver *receiver)
+{
+	GError *error = NULL;
+	char *data;
+	int fd;
+
+	receiver->requests = g_ptr_array_new_with_free_func (g_free);
+	receiver->mock = remote_display_mock_airplay_new (DEVICE_ID);
+	g_signal_connect (receiver->mock, "request", G_CALLBACK (request_cb), receiver);
+	remote_display_mock_airplay_start (receiver->mock, &error);
+	g_assert_no_error (error);
+
+	receiver->device = remote_display_mock_airplay_new_device (receiver->mock, "Mock Receiver");
+	g_assert_nonnull (receiver->device);
+	g_signal_connect (receiver->device, "state-changed",
+			  G_CALLBACK (state_changed_cb), receiver);
+
+	/* Something for the receiver to fetch from the host */
+	fd = g_file_open_tmp ("test-airplay-XXXXXX.mp4", &receiver->path, &error);
+	g_assert_no_error (error);
+	close (fd);
+	data = g_malloc0 (MEDIA_SIZE);
+	g_file_set_contents (receiver->path, data, MEDIA_SIZE, &error);
+	g_assert_no_error (error);
+	g_free (data);
+	receiver->uri = g_filename_to_uri (receiver->path, NULL, &error);
+	g_assert_no_error (error);
+}
+
+static void
+receiver_teardown (Receiver *receiver)
+{
+	g_object_unref (receiver->device);
+	g_object_unref (receiver->mock);
+	g_ptr_array_unref (receiver->requests);
+	g_unlink (receiver->path);
+	g_free (receiver->path);
+	g_free (receiver->uri);
+}
+
+static void
+command_cb (GObject      *source_object,
+	    GAsyncResult *result,
+	    gpointer      user_data)
+{
+	Receiver *receiver = user_data;
+	RemoteDisplayDevice *device = REMOTE_DISPLAY_DEVICE (source_object);
+	gpointer tag;
+
+	tag = g_task_get_source_tag (G_TASK (result));
+	if (tag == remote_display_device_open_and_play_async)
+		remote_display_device_open_and_play_finish (device, result, &receiver->error);
+	else if (tag == remote_display_device_play_async)
+		remote_display_device_play_finish (device, result, &receiver->error);
+	else if (tag == remote_display_device_pause_async)
+		remote_display_device_pause_finish (device, result, &receiver->error);
+	else if (tag == remote_display_device_airplay_get_playback_info_async)
+		g_free (remote_display_device_airplay_get_playback_info_finish (REMOTE_DISPLAY_DEVICE_AIRPLAY (device),
+										result, &receiver->error));
+	else
+		g_assert_not_reached ();
+	receiver->done = TRUE;
+}
+
+static void
+wait_for_command (Receiver *receiver)
+{
+	test_wait_until (receiver->done);
+	receiver->done = FALSE;
+}
+
+static void
+open_and_play (Receiver *receiver)
+{
+	remote_display_device_open_and_play_async (receiver->device, receiver->uri, 0,
+						   NULL, command_cb, receiver);
+	wait_for_command (receiver);
+	g_assert_no_error (receiver->error);
+
+	test_wait_until (receiver->state == REMOTE_DISPLAY_DEVICE_STATE_PLAYING);
+}
+
+static void
+test_playback (void)
+{
+	Receiver receiver = { 0, };
+	RemoteDisplayMockAirplayStats stats;
+	RemoteDisplayHostStats host_stats;
+
+	receiver_setup (&receiver);
+	open_and_play (&receiver);
+
+	/* The events connection is set up before anything else */
+	g_assert_cmpuint (receiver.requests->len, ==, 2);
+	g_assert_cmpstr (g_ptr_array_index (receiver.requests, 0), ==, "/reverse");
+	g_assert_cmpstr (g_ptr_array_index (receiver.requests, 1), ==, "/play");
+
+	remote_display_mock_airplay_get_stats (receiver.mock, &stats);
+	g_assert_cmpuint (stats.events, >=, 2);
+	g_assert_cmpuint (stats.bytes_fetched, >, 0);
+	remote_display_host_get_totals (&host_stats);
+	g_assert_cmpuint (host_stats.bytes_served, >=, stats.bytes_fetched);
+	g_assert_cmpuint (host_stats.mapped_bytes, ==, MEDIA_SIZE);
+
+	remote_display_device_pause_async (receiver.device, NULL, command_cb, &receiver);
+	wait_for_command (&receiver);
+	g_assert_no_error (receiver.error);
+	g_assert_cmpstr (g_ptr_array_index (receiver.requests, 2), ==, "/rate");
+	g_assert_cmpstr (remote_display_mock_airplay_get_state (receiver.mock), ==, "paused");
+
+	receiver_teardown (&receiver);
+}
+
+static void
+test_errors (void)
+{
+	Receiver receiver = { 0, };
+	GCancellable *cancellable;
+	gint64 start;
+
+	receiver_setup (&receiver);
+
+	/* Nothing to control yet */
+	remote_display_device_pause_async (receiver.device, NULL, command_cb, &receiver);
+	wait_for_command (&receiver);
+	g_assert_error (receiver.error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_NOT_CONNECTED);
+	g_clear_error (&receiver.error);
+	g_assert_cmpuint (receiver.requests->len, ==, 0);
+
+	open_and_play (&receiver);
+
+	remote_display_mock_airplay_set_errors (receiver.mock, 1.0, 503);
+	remote_display_device_pause_async (receiver.device, NULL, command_cb, &receiver);
+	wait_for_command (&receiver);
+	g_assert_error (receiver.error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_COMMAND_FAILED);
+	g_clear_error (&receiver.error);
+	g_assert_cmpuint (remote_display_device_get_command_failures (receiver.device), ==, 1);
+	g_assert_cmpuint (remote_display_device_get_pending_actions (receiver.device), ==, 0);
+
+	/* A failed command doesn't hold up the next ones */
+	remote_display_mock_airplay_set_errors (receiver.mock, 0.0, 503);
+	remote_display_mock_airplay_set_latency (receiver.mock, 100);
+	start = g_get_monotonic_time ();
+	remote_display_device_play_async (receiver.device, NULL, command_cb, &receiver);
+	wait_for_command (&receiver);
+	g_assert_no_error (receiver.error);
+	g_assert_cmpint (g_get_monotonic_time () - start, >=, 100 * 1000);
+
+	/* Cancelling doesn't wait for the receiver to answer */
+	remote_display_mock_airplay_set_latency (receiver.mock, 5000);
+	cancellable = g_cancellable_new ();
+	start = g_get_monotonic_time ();
+	remote_display_device_airplay_get_playback_info_async (REMOTE_DISPLAY_DEVICE_AIRPLAY (receiver.device),
+							       cancellable, command_cb, &receiver);
+	g_cancellable_cancel (cancellable);
+	wait_for_command (&receiver);
+	g_assert_error (receiver.error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+	g_clear_error (&receiver.error);
+	g_assert_cmpint (g_get_monotonic_time () - start, <, G_USEC_PER_SEC);
+	g_object_unref (cancellable);
+
+	receiver_teardown (&receiver);
+}
+
+static void
+test_gone (void)
+{
+	Receiver receiver = { 0, };
+
+	receiver_setup (&receiver);
+	open_and_play (&receiver);
+
+	/* The command in flight fails when the receiver goes away */
+	remote_display_mock_airplay_set_latency (receiver.mock, 5000);
+	remote_display_device_pause_async (receiver.device, NULL, command_cb, &receiver);
+	g_assert_cmpuint (remote_display_device_remove_candidate (receiver.device, if_nametoindex ("lo"),
+								   G_SOCKET_FAMILY_IPV4), ==, 0);
+	wait_for_command (&receiver);
+	g_assert_error (receiver.error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_UNREACHABLE);
+	g_clear_error (&receiver.error);
+
+	/* And so does anything new */
+	remote_display_device_open_and_play_async (receiver.device, receiver.uri, 0,
+						   NULL, command_cb, &receiver);
+	wait_for_command (&receiver);
+	g_assert_error (receiver.error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_UNREACHABLE);
+	g_clear_error (&receiver.error);
+	remote_display_device_pause_async (receiver.device, NULL, command_cb, &receiver);
+	wait_for_command (&receiver);
+	g_assert_error (receiver.error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_NOT_CONNECTED);
+	g_clear_error (&receiver.error);
+
+	receiver_teardown (&receiver);
+}
+
+static gboolean
+started_together (Receiver *receiver)
+{
+	guint len = receiver->requests->len;
+
+	return len >= 2 &&
+		g_strcmp0 (g_ptr_array_index (receiver->requests, len - 2), "/scrub") == 0 &&
+		g_strcmp0 (g_ptr_array_index (receiver->requests, len - 1), "/rate") == 0 &&
+		g_strcmp0 (remote_display_mock_airplay_get_state (receiver->mock), "playing") == 0;
+}
+
+static void
+test_group (void)
+{
+	Receiver receivers[2] = { { 0, }, { 0, } };
+	RemoteDisplayGroup *group;
+	guint i;
+
+	group = remote_display_group_new ();
+	for (i = 0; i < G_N_ELEMENTS (receivers); i++) {
+		receiver_setup (&receivers[i]);
+		remote_display_group_add_device (group, receivers[i].device);
+	}
+	remote_display_group_open_and_play (group, receivers[0].uri, 0);
+
+	/* Loaded, paused, probed, and lined up before being started */
+	test_wait_until (started_together (&receivers[0]) && started_together (&receivers[1]));
+
+	for (i = 0; i < G_N_ELEMENTS (receivers); i++) {
+		g_assert_cmpstr (g_ptr_array_index (receivers[i].requests, 0), ==, "/reverse");
+		g_assert_cmpstr (g_ptr_array_index (receivers[i].requests, 1), ==, "/play");
+		g_assert_cmpstr (g_ptr_array_index (receivers[i].requests, 2), ==, "/rate");
+		g_assert_cmpstr (g_ptr_array_index (receivers[i].requests, 3), ==, "/playback-info");
+	}
+
+	g_object_unref (group);
+	for (i = 0; i < G_N_ELEMENTS (receivers); i++)
+		receiver_teardown (&receivers[i]);
+}
+
+/* Removing the one member that never loaded doesn't leave the
+ * others waiting for the preload timeout */
+static void
+test_group_remove (void)
+{
+	Receiver receivers[2] = { { 0, }, { 0, } };
+	RemoteDisplayGroup *group;
+	gint64 start;
+	guint i;
+
+	group = remote_display_group_new ();
+	for (i = 0; i < G_N_ELEMENTS (receivers); i++) {
+		receiver_setup (&receivers[i]);
+		remote_display_group_add_device (group, receivers[i].device);
+	}
+	remote_display_mock_airplay_set_errors (receivers[1].mock, 1.0, 503);
+	remote_display_group_open_and_play (group, receivers[0].uri, 0);
+
+	test_wait_until (receivers[0].state == REMOTE_DISPLAY_DEVICE_STATE_PAUSED &&
+			 receivers[1].requests->len > 0);
+	start = g_get_monotonic_time ();
+	remote_display_group_remove_device (group, receivers[1].device);
+	test_wait_until (started_together (&receivers[0]));
+	g_assert_cmpint (g_get_monotonic_time () - start, <, 5 * G_USEC_PER_SEC);
+
+	g_object_unref (group);
+	for (i = 0; i < G_N_ELEMENTS (receivers); i++)
+		receiver_teardown (&receivers[i]);
+}
+
+/* ftyp, mdat with 3 chunks, then moov with their offsets */
+static const guint8 tail_moov_mp4[] = {
+	0x00, 0x00, 0x00, 0x10, 'f', 't', 'y', 'p', 'i', 's', 'o', 'm', 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x14, 'm', 'd', 'a', 't', 'A', 'A', 'A', 'A', 'B', 'B', 'B', 'B', 'B', 'B', 'C', 'C',
+	0x00, 0x00, 0x00, 0x44, 'm', 'o', 'o', 'v',
+	0x00, 0x00, 0x00, 0x3c, 't', 'r', 'a', 'k',
+	0x00, 0x00, 0x00, 0x34, 'm', 'd', 'i', 'a',
+	0x00, 0x00, 0x00, 0x2c, 'm', 'i', 'n', 'f',
+	0x00, 0x00, 0x00, 0x24, 's', 't', 'b', 'l',
+	0x00, 0x00, 0x00, 0x1c, 's', 't', 'c', 'o', 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03,
+	0x00, 0x00, 0x00, 0x18, 0x00, 0x00, 0x00, 0x1c, 0x00, 0x00, 0x00, 0x22
+};
+
+static void
+fetch_cb (SoupSession *session,
+	  SoupMessage *msg,
+	  gpointer     user_data)
+{
+	gboolean *done = user_data;
+
+	*done = TRUE;
+}
+
+static SoupMessage *
+fetch (SoupSession *session,
+       const char  *uri,
+       const char  *range)
+{
+	SoupMessage *msg;
+	gboolean done = FALSE;
+
+	msg = soup_message_new ("GET", uri);
+	if (range)
+		soup_message_headers_append (msg->request_headers, "Range", range);
+	soup_session_queue_message (session, g_object_ref (msg), fetch_cb, &done);
+
+	test_wait_until (done);
+
+	return msg;
+}
+
+static void
+file_served_cb (RemoteDisplayHost *host,
+		const char        *uri,
+		guint             *n_served)
+{
+	(*n_served)++;
+}
+
+static void
+test_faststart (void)
+{
+	RemoteDisplayHost *host;
+	GInetAddress *address;
+	SoupSession *session;
+	SoupMessage *msg, *range_msg;
+	SoupBuffer *body, *range_body;
+	GError *error = NULL;
+	char *path, *file_uri, *uri;
+	guint32 offset;
+	guint n_served = 0;
+	int fd;
+
+	fd = g_file_open_tmp ("test-airplay-XXXXXX.mp4", &path, &error);
+	g_assert_no_error (error);
+	close (fd);
+	g_file_set_contents (path, (const char *) tail_moov_mp4, sizeof (tail_moov_mp4), &error);
+	g_assert_no_error (error);
+	file_uri = g_filename_to_uri (path, NULL, &error);
+	g_assert_no_error (error);
+
+	address = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+	host = remote_display_host_new (address, address);
+	g_signal_connect (host, "file-served", G_CALLBACK (file_served_cb), &n_served);
+	uri = remote_display_host_file (host, file_uri, &error);
+	g_assert_no_error (error);
+	session = soup_session_new ();
+
+	/* Same size, moov box first, and the offsets follow the chunks */
+	msg = fetch (session, uri, NULL);
+	g_assert_cmpuint (msg->status_code, ==, SOUP_STATUS_OK);
+	g_assert_cmpint (msg->response_body->length, ==, sizeof (tail_moov_mp4));
+	body = soup_message_body_flatten (msg->response_body);
+	g_assert_true (memcmp (body->data + 20, "moov", 4) == 0);
+	g_assert_true (memcmp (body->data + 88, "mdat", 4) == 0);
+	memcpy (&offset, body->data + 76, sizeof (offset));
+	g_assert_true (memcmp (body->data + GUINT32_FROM_BE (offset), "BBBBBB", 6) == 0);
+
+	/* Ranges are in the rearranged file */
+	range_msg = fetch (session, uri, "bytes=80-99");
+	g_assert_cmpuint (range_msg->status_code, ==, SOUP_STATUS_PARTIAL_CONTENT);
+	g_assert_cmpint (range_msg->response_body->length, ==, 20);
+	range_body = soup_message_body_flatten (range_msg->response_body);
+	g_assert_true (memcmp (range_body->data, body->data + 80, 20) == 0);
+	soup_buffer_free (range_body);
+	g_object_unref (range_msg);
+
+	range_msg = fetch (session, uri, "bytes=200-");
+	g_assert_cmpuint (range_msg->status_code, ==, SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE);
+	g_object_unref (range_msg);
+
+	/* Announced once for all those requests, and again
+	 * once the file is hosted for another playback */
+	g_assert_cmpuint (n_served, ==, 1);
+	g_free (uri);
+	uri = remote_display_host_file (host, file_uri, &error);
+	g_assert_no_error (error);
+	range_msg = fetch (session, uri, "bytes=0-9");
+	g_assert_cmpuint (range_msg->status_code, ==, SOUP_STATUS_PARTIAL_CONTENT);
+	g_object_unref (range_msg);
+	g_assert_cmpuint (n_served, ==, 2);
+
+	soup_buffer_free (body);
+	g_object_unref (msg);
+	g_object_unref (session);
+	g_object_unref (host);
+	g_object_unref (address);
+	g_unlink (path);
+	g_free (path);
+	g_free (file_uri);
+	g_free (uri);
+}
+
+/* PAT, PMT, then an H.264 keyframe and a frame, one packet each */
+static const guint8 ts_pat[] = {
+	0x00, 0x00, 0xb0, 0x0d, 0x00, 0x01, 0xc1, 0x00, 0x00, 0x00, 0x01, 0xe1, 0x00,
+	0x00, 0x00, 0x00, 0x00
+};
+static const guint8 ts_pmt[] = {
+	0x00, 0x02, 0xb0, 0x12, 0x00, 0x01, 0xc1, 0x00, 0x00, 0xe1, 0x01, 0xf0, 0x00,
+	0x1b, 0xe1, 0x01, 0xf0, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+static const guint8 ts_keyframe[] = {
+	0x00, 0x00, 0x01, 0xe0, 0x00, 0x00, 0x80, 0x80, 0x05, 0x21, 0x00, 0x01, 0x00, 0x01,
+	0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0xc0, 0x0d, 0xda, 0x05, 0x07, 0xe4,
+	0x00, 0x00, 0x00, 0x01, 0x68, 0xce, 0x3c, 0x80,
+	0x00, 0x00, 0x01, 0x65, 0x88, 0x84, 0x21, 0x43
+};
+static const guint8 ts_frame[] = {
+	0x00, 0x00, 0x01, 0xe0, 0x00, 0x00, 0x80, 0x80, 0x05, 0x21, 0x00, 0x01, 0x17, 0x71,
+	0x00, 0x00, 0x01, 0x41, 0x9a, 0x02, 0x03
+};
+
+static void
+append_ts_packet (GByteArray   *ts,
+		  guint16       pid,
+		  const guint8 *payload,
+		  gsize         length)
+{
+	guint8 header[6] = { 0x47, 0x40 | (pid >> 8), pid & 0xff, 0x30, 183 - length, 0x00 };
+	guint8 stuffing[184];
+
+	memset (stuffing, 0xff, sizeof (stuffing));
+	g_byte_array_append (ts, header, sizeof (header));
+	g_byte_array_append (ts, stuffing, 182 - length);
+	g_byte_array_append (ts, payload, length);
+}
+
+static void
+test_remux (void)
+{
+	RemoteDisplayHost *host;
+	GInetAddress *address;
+	SoupSession *session;
+	SoupMessage *msg, *range_msg;
+	SoupBuffer *body, *range_body;
+	RemoteDisplayHostStats stats;
+	GByteArray *ts;
+	GError *error = NULL;
+	char *path, *file_uri, *uri;
+	guint32 size, offset;
+	gboolean done = FALSE;
+	int fd;
+
+	ts = g_byte_array_new ();
+	append_ts_packet (ts, 0x0000, ts_pat, sizeof (ts_pat));
+	append_ts_packet (ts, 0x0100, ts_pmt, sizeof (ts_pmt));
+	append_ts_packet (ts, 0x0101, ts_keyframe, sizeof (ts_keyframe));
+	append_ts_packet (ts, 0x0101, ts_frame, sizeof (ts_frame));
+
+	fd = g_file_open_tmp ("test-airplay-XXXXXX.ts", &path, &error);
+	g_assert_no_error (error);
+	close (fd);
+	g_file_set_contents (path, (const char *) ts->data, ts->len, &error);
+	g_assert_no_error (error);
+	g_byte_array_unref (ts);
+	file_uri = g_filename_to_uri (path, NULL, &error);
+	g_assert_no_error (error);
+
+	address = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+	host = remote_display_host_new (address, address);
+	g_object_set (G_OBJECT (host), "remux", TRUE, NULL);
+	uri = remote_display_host_file (host, file_uri, &error);
+	g_assert_no_error (error);
+	session = soup_session_new ();
+
+	/* Served as a fragmented MP4 */
+	msg = fetch (session, uri, NULL);
+	g_assert_cmpuint (msg->status_code, ==, SOUP_STATUS_OK);
+	g_assert_cmpstr (soup_message_headers_get_content_type (msg->response_headers, NULL), ==, "video/mp4");
+	body = soup_message_body_flatten (msg->response_body);
+	g_assert_cmpint (body->length, ==, soup_message_headers_get_content_length (msg->response_headers));
+	g_assert_true (memcmp (body->data + 4, "ftyp", 4) == 0);
+	memcpy (&size, body->data, sizeof (size));
+	offset = GUINT32_FROM_BE (size);
+	g_assert_true (memcmp (body->data + offset + 4, "moov", 4) == 0);
+	memcpy (&size, body->data + offset, sizeof (size));
+	offset += GUINT32_FROM_BE (size);
+	g_assert_true (memcmp (body->data + offset + 4, "moof", 4) == 0);
+
+	/* With lengths instead of start codes */
+	range_msg = fetch (session, uri, "bytes=-8");
+	g_assert_cmpuint (range_msg->status_code, ==, SOUP_STATUS_PARTIAL_CONTENT);
+	range_body = soup_message_body_flatten (range_msg->response_body);
+	g_assert_cmpint (range_body->length, ==, 8);
+	g_assert_true (memcmp (range_body->data, "\x00\x00\x00\x04\x41\x9a\x02\x03", 8) == 0);
+	g_assert_true (memcmp (range_body->data, body->data + body->length - 8, 8) == 0);
+	soup_buffer_free (range_body);
+	g_object_unref (range_msg);
+
+	/* Hosted anew, as for another playback, while being served */
+	range_msg = soup_message_new ("GET", uri);
+	soup_session_queue_message (session, g_object_ref (range_msg), fetch_cb, &done);
+	test_wait_until ((remote_display_host_get_totals (&stats), stats.active_requests > 0));
+	g_free (remote_display_host_file (host, file_uri, &error));
+	g_assert_no_error (error);
+	test_wait_until (done);
+	g_assert_cmpuint (range_msg->status_code, ==, SOUP_STATUS_OK);
+	g_assert_cmpint (range_msg->response_body->length, ==, body->length);
+	g_object_unref (range_msg);
+
+	soup_buffer_free (body);
+	g_object_unref (msg);
+	g_object_unref (session);
+	g_object_unref (host);
+	g_object_unref (address);
+	g_unlink (path);
+	g_free (path);
+	g_free (file_uri);
+	g_free (uri);
+}
+
+/* Matroska elements, all with 8-byte sizes */
+static void
+append_element (GByteArray   *mkv,
+		guint32       id,
+		const void   *data,
+		gsize         length)
+{
+	guint8 header[12];
+	guint n = 0, i;
+
+	for (i = 4; i > 0; i--) {
+		if (n > 0 || (id >> (8 * (i - 1))) != 0)
+			header[n++] = id >> (8 * (i - 1));
+	}
+	header[n++] = 0x01;
+	for (i = 7; i > 0; i--)
+		header[n++] = (guint64) length >> (8 * (i - 1));
+	g_byte_array_append (mkv, header, n);
+	g_byte_array_append (mkv, data, length);
+}
+
+static void
+append_uint_element (GByteArray *mkv,
+		     guint32     id,
+		     guint64     value)
+{
+	guint64 be = GUINT64_TO_BE (value);
+
+	append_element (mkv, id, &be, sizeof (be));
+}
+
+static void
+append_array_element (GByteArray *mkv,
+		      guint32     id,
+		      GByteArray *child)
+{
+	append_element (mkv, id, child->data, child->len);
+	g_byte_array_unref (child);
+}
+
+static const guint8 mkv_avcc[] = {
+	0x01, 0x42, 0xc0, 0x0d, 0xff, 0xe1,
+	0x00, 0x08, 0x67, 0x42, 0xc0, 0x0d, 0xda, 0x05, 0x07, 0xe4,
+	0x01, 0x00, 0x04, 0x68, 0xce, 0x3c, 0x80
+};
+/* AAC LC, 44.1 kHz, stereo */
+static const guint8 mkv_asc[] = { 0x12, 0x10 };
+
+/* Track, timecode relative to the cluster, flags, then the frames.
+ * In decoding order, I, P, B, B, shown every 40 ms */
+static const guint8 mkv_keyframe[] = { 0x81, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x04, 0x65, 0x88, 0x84, 0x21 };
+static const guint8 mkv_p_frame[] = { 0x81, 0x00, 0x78, 0x00, 0x00, 0x00, 0x00, 0x03, 0x41, 0x9a, 0x02 };
+static const guint8 mkv_b_frame_1[] = { 0x81, 0x00, 0x28, 0x00, 0x00, 0x00, 0x00, 0x02, 0x01, 0x9e };
+static const guint8 mkv_b_frame_2[] = { 0x81, 0x00, 0x50, 0x00, 0x00, 0x00, 0x00, 0x02, 0x01, 0x9f };
+/* Three AAC frames of 5, 7 and 9 bytes, Xiph laced */
+static const guint8 mkv_audio[] = {
+	0x82, 0x00, 0x00, 0x82, 0x02, 0x05, 0x07,
+	0x21, 0x10, 0x04, 0x60, 0x8c,
+	0x21, 0x10, 0x04, 0x60, 0x8c, 0x1c, 0x00,
+	0x21, 0x10, 0x04, 0x60, 0x8c, 0x1c, 0x00, 0x00, 0x00
+};
+
+static GByteArray *
+build_mkv (guint64 timecode_scale)
+{
+	GByteArray *mkv, *segment, *info, *tracks, *entry, *settings, *cluster;
+
+	mkv = g_byte_array_new ();
+	append_element (mkv, 0x1a45dfa3, "\x42\x82\x88matroska", 11);
+
+	info = g_byte_array_new ();
+	append_uint_element (info, 0x2ad7b1, timecode_scale);
+
+	tracks = g_byte_array_new ();
+	entry = g_byte_array_new ();
+	append_uint_element (entry, 0xd7, 1);
+	append_uint_element (entry, 0x83, 1);
+	append_element (entry, 0x86, "V_MPEG4/ISO/AVC", 15);
+	append_element (entry, 0x63a2, mkv_avcc, sizeof (mkv_avcc));
+	settings = g_byte_array_new ();
+	append_uint_element (settings, 0xb0, 320);
+	append_uint_element (settings, 0xba, 240);
+	append_array_element (entry, 0xe0, settings);
+	append_array_element (tracks, 0xae, entry);
+	entry = g_byte_array_new ();
+	append_uint_element (entry, 0xd7, 2);
+	append_uint_element (entry, 0x83, 2);
+	append_element (entry, 0x86, "A_AAC", 5);
+	append_element (entry, 0x63a2, mkv_asc, sizeof (mkv_asc));
+	settings = g_byte_array_new ();
+	append_uint_element (settings, 0x9f, 2);
+	append_array_element (entry, 0xe1, settings);
+	append_array_element (tracks, 0xae, entry);
+
+	cluster = g_byte_array_new ();
+	append_uint_element (cluster, 0xe7, 0);
+	append_element (cluster, 0xa3, mkv_keyframe, sizeof (mkv_keyframe));
+	append_element (cluster, 0xa3, mkv_audio, sizeof (mkv_audio));
+	append_element (cluster, 0xa3, mkv_p_frame, sizeof (mkv_p_frame));
+	append_element (cluster, 0xa3, mkv_b_frame_1, sizeof (mkv_b_frame_1));
+	append_element (cluster, 0xa3, mkv_b_frame_2, sizeof (mkv_b_frame_2));
+
+	segment = g_byte_array_new ();
+	append_array_element (segment, 0x1549a966, info);
+	append_array_element (segment, 0x1654ae6b, tracks);
+	append_array_element (segment, 0x1f43b675, cluster);
+	append_array_element (mkv, 0x18538067, segment);
+
+	return mkv;
+}
+
+/* The first box of @type in [@data, @data + @length) */
+static const guint8 *
+find_box (const guint8 *data,
+	  gsize         length,
+	  const char   *type)
+{
+	guint32 size;
+	gsize pos = 0;
+
+	while (length - pos >= 8) {
+		memcpy (&size, data + pos, sizeof (size));
+		size = GUINT32_FROM_BE (size);
+		g_assert_cmpuint (size, >=, 8);
+		g_assert_cmpuint (size, <=, length - pos);
+		if (memcmp (data + pos + 4, type, 4) == 0)
+			return data + pos;
+		pos += size;
+	}
+	return NULL;
+}
+
+static guint32
+read_box_u32 (const guint8 *data)
+{
+	guint32 v;
+
+	memcpy (&v, data, sizeof (v));
+	return GUINT32_FROM_BE (v);
+}
+
+/* The track fragment's durations, sizes and composition offsets */
+static void
+check_trun (const guint8  *traf,
+	    guint32        track_id,
+	    guint          n_samples,
+	    const guint32 *durations,
+	    const guint32 *sizes,
+	    const guint32 *offsets)
+{
+	const guint8 *tfhd, *trun;
+	guint32 traf_size;
+	guint i;
+
+	traf_size = read_box_u32 (traf);
+	tfhd = find_box (traf + 8, traf_size - 8, "tfhd");
+	g_assert_nonnull (tfhd);
+	g_assert_cmpuint (read_box_u32 (tfhd + 12), ==, track_id);
+	trun = find_box (traf + 8, traf_size - 8, "trun");
+	g_assert_nonnull (trun);
+	g_assert_cmpuint (read_box_u32 (trun + 12), ==, n_samples);
+	for (i = 0; i < n_samples; i++) {
+		g_assert_cmpuint (read_box_u32 (trun + 20 + 16 * i), ==, durations[i]);
+		g_assert_cmpuint (read_box_u32 (trun + 20 + 16 * i + 4), ==, sizes[i]);
+		g_assert_cmpuint (read_box_u32 (trun + 20 + 16 * i + 12), ==, offsets[i]);
+	}
+}
+
+static void
+test_remux_mkv (void)
+{
+	static const guint32 video_durations[] = { 3600, 3600, 3600, 3600 };
+	static const guint32 video_sizes[] = { 8, 7, 6, 6 };
+	/* Decoding starts a frame early, for the P-frame to come
+	 * before the B-frames shown ahead of it */
+	static const guint32 video_offsets[] = { 3600, 10800, 0, 0 };
+	static const guint32 audio_durations[] = { 1024, 1024, 1024 };
+	static const guint32 audio_sizes[] = { 5, 7, 9 };
+	static const guint32 audio_offsets[] = { 0, 0, 0 };
+	RemoteDisplayHost *host;
+	RemoteDisplayRemux *remux;
+	GMappedFile *file;
+	GInetAddress *address;
+	SoupSession *session;
+	SoupMessage *msg;
+	SoupBuffer *body;
+	GByteArray *mkv;
+	GError *error = NULL;
+	const guint8 *moof, *traf;
+	char *path, *file_uri, *uri;
+	int fd;
+
+	mkv = build_mkv (1000000);
+	fd = g_file_open_tmp ("test-airplay-XXXXXX.mkv", &path, &error);
+	g_assert_no_error (error);
+	close (fd);
+	g_file_set_contents (path, (const char *) mkv->data, mkv->len, &error);
+	g_assert_no_error (error);
+	g_byte_array_unref (mkv);
+	file_uri = g_filename_to_uri (path, NULL, &error);
+	g_assert_no_error (error);
+
+	address = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+	host = remote_display_host_new (address, address);
+	g_object_set (G_OBJECT (host), "remux", TRUE, NULL);
+	uri = remote_display_host_file (host, file_uri, &error);
+	g_assert_no_error (error);
+	session = soup_session_new ();
+
+	msg = fetch (session, uri, NULL);
+	g_assert_cmpuint (msg->status_code, ==, SOUP_STATUS_OK);
+	g_assert_cmpstr (soup_message_headers_get_content_type (msg->response_headers, NULL), ==, "video/mp4");
+	body = soup_message_body_flatten (msg->response_body);
+
+	/* One fragment, with the video then the audio */
+	moof = find_box ((const guint8 *) body->data, body->length, "moof");
+	g_assert_nonnull (moof);
+	traf = find_box (moof + 8, read_box_u32 (moof) - 8, "traf");
+	g_assert_nonnull (traf);
+	check_trun (traf, 1, G_N_ELEMENTS (video_sizes), video_durations, video_sizes, video_offsets);
+	traf += read_box_u32 (traf);
+	g_assert_true (traf < moof + read_box_u32 (moof));
+	g_assert_true (memcmp (traf + 4, "traf", 4) == 0);
+	check_trun (traf, 2, G_N_ELEMENTS (audio_sizes), audio_durations, audio_sizes, audio_offsets);
+
+	soup_buffer_free (body);
+	g_object_unref (msg);
+	g_object_unref (session);
+	g_object_unref (host);
+	g_object_unref (address);
+
+	/* Block times in a scale that large can't be converted */
+	mkv = build_mkv (G_GUINT64_CONSTANT (1) << 62);
+	g_file_set_contents (path, (const char *) mkv->data, mkv->len, &error);
+	g_assert_no_error (error);
+	g_byte_array_unref (mkv);
+	file = g_mapped_file_new (path, FALSE, &error);
+	g_assert_no_error (error);
+	remux = remote_display_remux_new (file, &error);
+	g_assert_error (error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_PARSE);
+	g_assert_null (remux);
+	g_clear_error (&error);
+	g_mapped_file_unref (file);
+
+	g_unlink (path);
+	g_free (path);
+	g_free (file_uri);
+	g_free (uri);
+}
+
+int main (int argc, char **argv)
+{
+	g_test_init (&argc, &argv, NULL);
+
+	g_test_add_func ("/airplay/playback", test_playback);
+	g_test_add_func ("/airplay/errors", test_errors);
+	g_test_add_func ("/airplay/gone", test_gone);
+	g_test_add_func ("/airplay/group", test_group);
+	g_test_add_func ("/airplay/group-remove", test_group_remove);
+	g_test_add_func ("/airplay/faststart", test_faststart);
+	g_test_add_func ("/airplay/remux", test_remux);
+	g_test_add_func ("/airplay/remux/mkv", test_remux_mkv);
+
+	return g_test_run ();
+}
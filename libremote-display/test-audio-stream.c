@@ -0,0 +1,522 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+#include <glib.h>
+#include <string.h>
+#include <stdlib.h>
+#include <gio/gio.h>
+#include <avahi-common/address.h>
+#include <avahi-common/strlst.h>
+#include <libremote-display/remote-display.h>
+#include <libremote-display/remote-display-device-raop.h>
+#include <libremote-display/remote-display-alac.h>
+#include "test-util.h"
+
+#define SERVICE_NAME "5855CA1AE288@Kitchen"
+#define N_FRAMES     (REMOTE_DISPLAY_ALAC_SAMPLE_RATE / 2)
+#define N_PACKETS    10
+#define RTP_HEADER   12
+
+/* A stand-in RAOP receiver. The stream makes its RTSP requests
+ * synchronously, from its own thread, and stopping it waits for
+ * the TEARDOWN, so RTSP is answered from a thread too */
+typedef struct {
+	GSocketListener *listener;
+	guint16 port;
+	GThread *thread;
+	GSocket *data_socket;
+	GSocket *control_socket;
+	GSource *data_source;
+	GSource *control_source;
+
+	GMutex lock;
+	GPtrArray *methods;
+	char *volume;
+
+	/* Only used from the main thread */
+	guint n_packets;
+	guint n_syncs;
+	guint16 first_seq;
+	guint32 first_rtptime;
+} Receiver;
+
+static gint16 samples[N_FRAMES * REMOTE_DISPLAY_ALAC_CHANNELS];
+
+static guint32
+read_bits (const guint8 *data,
+	   guint        *pos,
+	   guint         n_bits)
+{
+	guint32 value = 0;
+	guint i;
+
+	for (i = 0; i < n_bits; i++, (*pos)++)
+		value = (value << 1) | ((data[*pos / 8] >> (7 - *pos % 8)) & 1);
+
+	return value;
+}
+
+/* Checks that @data is an uncompressed ALAC packet with the
+ * frames of samples[] starting at @first */
+static void
+check_alac_packet (const guint8 *data,
+		   gsize         size,
+		   guint         n_frames,
+		   guint         first)
+{
+	guint pos = 0, i;
+
+	g_assert_cmpuint (read_bits (data, &pos, 3), ==, 1);           /* Channel pair */
+	g_assert_cmpuint (read_bits (data, &pos, 4), ==, 0);
+	g_assert_cmpuint (read_bits (data, &pos, 12), ==, 0);
+	if (read_bits (data, &pos, 1)) {
+		g_assert_cmpuint (read_bits (data, &pos, 2), ==, 0);
+		g_assert_cmpuint (read_bits (data, &pos, 1), ==, 1);   /* Not compressed */
+		g_assert_cmpuint (read_bits (data, &pos, 32), ==, n_frames);
+	} else {
+		g_assert_cmpuint (read_bits (data, &pos, 2), ==, 0);
+		g_assert_cmpuint (read_bits (data, &pos, 1), ==, 1);
+		g_assert_cmpuint (n_frames, ==, REMOTE_DISPLAY_ALAC_FRAMES_PER_PACKET);
+	}
+
+	for (i = 0; i < n_frames; i++) {
+		g_assert_cmpint ((gint16) read_bits (data, &pos, 16), ==, samples[(first + i) * 2]);
+		g_assert_cmpint ((gint16) read_bits (data, &pos, 16), ==, samples[(first + i) * 2 + 1]);
+	}
+
+	g_assert_cmpuint (read_bits (data, &pos, 3), ==, 7);           /* End */
+	g_assert_cmpuint (size, ==, (pos + 7) / 8);
+}
+
+static gboolean
+data_cb (GSocket      *socket,
+	 GIOCondition  condition,
+	 gpointer      user_data)
+{
+	Receiver *receiver = user_data;
+	guint8 packet[RTP_HEADER + REMOTE_DISPLAY_ALAC_MAX_PACKET_SIZE];
+	guint16 seq;
+	guint32 rtptime;
+	gssize size;
+
+	while ((size = g_socket_receive (socket, (char *) packet, sizeof(packet), NULL, NULL)) > 0) {
+		g_assert_cmpint (size, >, RTP_HEADER);
+		g_assert_cmpuint (packet[0], ==, 0x80);
+		g_assert_cmpuint (packet[1] & 0x7f, ==, 96);
+
+		seq = (packet[2] << 8) | packet[3];
+		rtptime = ((guint32) packet[4] << 24) | (packet[5] << 16) | (packet[6] << 8) | packet[7];
+		if (receiver->n_packets == 0) {
+			/* The marker bit starts the stream */
+			g_assert_cmpuint (packet[1] & 0x80, ==, 0x80);
+			receiver->first_seq = seq;
+			receiver->first_rtptime = rtptime;
+		} else {
+			g_assert_cmpuint (packet[1] & 0x80, ==, 0);
+			g_assert_cmpuint ((guint16) (seq - receiver->first_seq), ==, receiver->n_packets);
+			g_assert_cmpuint (rtptime - receiver->first_rtptime, ==,
+					  receiver->n_packets * REMOTE_DISPLAY_ALAC_FRAMES_PER_PACKET);
+		}
+
+		/* The audio was all written before the stream started */
+		if (receiver->n_packets < N_PACKETS)
+			check_alac_packet (packet + RTP_HEADER, size - RTP_HEADER,
+					   REMOTE_DISPLAY_ALAC_FRAMES_PER_PACKET,
+					   receiver->n_packets * REMOTE_DISPLAY_ALAC_FRAMES_PER_PACKET);
+		receiver->n_packets++;
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+control_cb (GSocket      *socket,
+	    GIOCondition  condition,
+	    gpointer      user_data)
+{
+	Receiver *receiver = user_data;
+	guint8 packet[64];
+	gssize size;
+
+	while ((size = g_socket_receive (socket, (char *) packet, sizeof(packet), NULL, NULL)) > 0) {
+		g_assert_cmpint (size, ==, 20);
+		g_assert_cmpuint (packet[1], ==, 0x80 | 0x54);
+		receiver->n_syncs++;
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+static guint16
+get_port (GSocket *socket)
+{
+	GSocketAddress *address;
+	guint16 port;
+
+	address = g_socket_get_local_address (socket, NULL);
+	g_assert_nonnull (address);
+	port = g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (address));
+	g_object_unref (address);
+
+	return port;
+}
+
+static gpointer
+rtsp_thread (gpointer user_data)
+{
+	Receiver *receiver = user_data;
+	GSocketConnection *connection;
+	GDataInputStream *input;
+	GOutputStream *output;
+	GError *error = NULL;
+	gboolean done = FALSE;
+
+	connection = g_socket_listener_accept (receiver->listener, NULL, NULL, &error);
+	g_assert_no_error (error);
+	input = g_data_input_stream_new (g_io_stream_get_input_stream (G_IO_STREAM (connection)));
+	g_data_input_stream_set_newline_type (input, G_DATA_STREAM_NEWLINE_TYPE_CR_LF);
+	output = g_io_stream_get_output_stream (G_IO_STREAM (connection));
+
+	while (!done) {
+		char *line, *method, *cseq = NULL, *body = NULL;
+		gsize length = 0;
+		GString *reply;
+
+		line = g_data_input_stream_read_line (input, NULL, NULL, NULL);
+		if (!line)
+			break;
+		g_assert_true (g_str_has_suffix (line, " RTSP/1.0"));
+		method = g_strndup (line, strchr (line, ' ') - line);
+		g_free (line);
+
+		while ((line = g_data_input_stream_read_line (input, NULL, NULL, NULL)) != NULL &&
+		       *line != '\0') {
+			if (g_str_has_prefix (line, "CSeq: "))
+				cseq = g_strdup (line + strlen ("CSeq: "));
+			else if (g_str_has_prefix (line, "Content-Length: "))
+				length = strtoul (line + strlen ("Content-Length: "), NULL, 10);
+			g_free (line);
+		}
+		g_assert_nonnull (line);
+		g_free (line);
+		g_assert_nonnull (cseq);
+
+		if (length > 0) {
+			body = g_malloc0 (length + 1);
+			g_input_stream_read_all (G_INPUT_STREAM (input), body, length, NULL, NULL, &error);
+			g_assert_no_error (error);
+		}
+
+		reply = g_string_new ("RTSP/1.0 200 OK\r\n");
+		g_string_append_printf (reply, "CSeq: %s\r\n", cseq);
+		if (g_strcmp0 (method, "ANNOUNCE") == 0) {
+			g_assert_nonnull (strstr (body, "a=rtpmap:96 AppleLossless\r\n"));
+			g_assert_nonnull (strstr (body, "a=fmtp:96 " REMOTE_DISPLAY_ALAC_FMTP "\r\n"));
+		} else if (g_strcmp0 (method, "SETUP") == 0) {
+			g_string_append_printf (reply,
+						"Session: 1\r\n"
+						"Transport: RTP/AVP/UDP;unicast;mode=record;"
+						"server_port=%u;control_port=%u;timing_port=%u\r\n",
+						get_port (receiver->data_socket),
+						get_port (receiver->control_socket),
+						get_port (receiver->control_socket));
+		} else if (g_strcmp0 (method, "RECORD") == 0) {
+			g_string_append (reply, "Audio-Latency: 2205\r\n");
+		} else if (g_strcmp0 (method, "TEARDOWN") == 0) {
+			done = TRUE;
+		}
+		g_string_append (reply, "\r\n");
+		g_output_stream_write_all (output, reply->str, reply->len, NULL, NULL, &error);
+		g_assert_no_error (error);
+		g_string_free (reply, TRUE);
+
+		g_mutex_lock (&receiver->lock);
+		g_ptr_array_add (receiver->methods, method);
+		if (g_strcmp0 (method, "SET_PARAMETER") == 0) {
+			g_free (receiver->volume);
+			receiver->volume = g_strdup (body);
+		}
+		g_mutex_unlock (&receiver->lock);
+
+		g_free (cseq);
+		g_free (body);
+	}
+
+	g_object_unref (input);
+	g_object_unref (connection);
+
+	return NULL;
+}
+
+static GSocket *
+bind_udp_socket (void)
+{
+	GSocket *socket;
+	GInetAddress *loopback;
+	GSocketAddress *address;
+	GError *error = NULL;
+
+	socket = g_socket_new (G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_DATAGRAM,
+			       G_SOCKET_PROTOCOL_UDP, &error);
+	g_assert_no_error (error);
+	g_socket_set_blocking (socket, FALSE);
+	loopback = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+	address = g_inet_socket_address_new (loopback, 0);
+	g_socket_bind (socket, address, TRUE, &error);
+	g_assert_no_error (error);
+	g_object_unref (address);
+	g_object_unref (loopback);
+
+	return socket;
+}
+
+static GSource *
+watch_socket (GSocket           *socket,
+	      GSocketSourceFunc  func,
+	      Receiver          *receiver)
+{
+	GSource *source;
+
+	source = g_socket_create_source (socket, G_IO_IN, NULL);
+	g_source_set_callback (source, (GSourceFunc) func, receiver, NULL);
+	g_source_attach (source, NULL);
+
+	return source;
+}
+
+static void
+receiver_setup (Receiver *receiver)
+{
+	GInetAddress *loopback;
+	GSocketAddress *address, *effective;
+	GError *error = NULL;
+
+	g_mutex_init (&receiver->lock);
+	receiver->methods = g_ptr_array_new_with_free_func (g_free);
+
+	receiver->data_socket = bind_udp_socket ();
+	receiver->control_socket = bind_udp_socket ();
+	receiver->data_source = watch_socket (receiver->data_socket, data_cb, receiver);
+	receiver->control_source = watch_socket (receiver->control_socket, control_cb, receiver);
+
+	receiver->listener = g_socket_listener_new ();
+	loopback = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+	address = g_inet_socket_address_new (loopback, 0);
+	g_socket_listener_add_address (receiver->listener, address, G_SOCKET_TYPE_STREAM,
+				       G_SOCKET_PROTOCOL_TCP, NULL, &effective, &error);
+	g_assert_no_error (error);
+	receiver->port = g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (effective));
+	g_object_unref (effective);
+	g_object_unref (address);
+	g_object_unref (loopback);
+
+	receiver->thread = g_thread_new ("test-rtsp", rtsp_thread, receiver);
+}
+
+static void
+receiver_teardown (Receiver *receiver)
+{
+	g_source_destroy (receiver->data_source);
+	g_source_unref (receiver->data_source);
+	g_source_destroy (receiver->control_source);
+	g_source_unref (receiver->control_source);
+	g_object_unref (receiver->data_socket);
+	g_object_unref (receiver->control_socket);
+	g_object_unref (receiver->listener);
+	g_ptr_array_unref (receiver->methods);
+	g_free (receiver->volume);
+	g_mutex_clear (&receiver->lock);
+}
+
+static RemoteDisplayDevice *
+new_device (guint16 port)
+{
+	RemoteDisplayDevice *device;
+	AvahiStringList *txt;
+	AvahiAddress address;
+
+	txt = avahi_string_list_new ("et=0,1", "cn=0,1", "ss=16", "sr=44100", "ch=2", NULL);
+	avahi_address_parse ("127.0.0.1", AVAHI_PROTO_INET, &address);
+	device = remote_display_device_raop_new (1, AVAHI_PROTO_INET, SERVICE_NAME, txt,
+						 "kitchen.local", &address, port);
+	avahi_string_list_free (txt);
+
+	g_assert_nonnull (device);
+	g_assert_cmpuint (remote_display_device_get_capabilities (device), ==,
+			  REMOTE_DISPLAY_DEVICE_CAPABILITIES_AUDIO);
+
+	return device;
+}
+
+static gboolean
+volume_sent (Receiver *receiver)
+{
+	gboolean ret;
+
+	g_mutex_lock (&receiver->lock);
+	ret = receiver->volume != NULL;
+	g_mutex_unlock (&receiver->lock);
+
+	return ret;
+}
+
+static void
+test_alac (void)
+{
+	guint8 packet[REMOTE_DISPLAY_ALAC_MAX_PACKET_SIZE];
+	gsize size;
+
+	size = remote_display_alac_encode (samples, REMOTE_DISPLAY_ALAC_FRAMES_PER_PACKET, packet);
+	check_alac_packet (packet, size, REMOTE_DISPLAY_ALAC_FRAMES_PER_PACKET, 0);
+	g_assert_cmpuint (size, ==, REMOTE_DISPLAY_ALAC_MAX_PACKET_SIZE - 4);
+
+	/* Short packets say how many frames they hold */
+	size = remote_display_alac_encode (samples + 200, 10, packet);
+	check_alac_packet (packet, size, 10, 100);
+	g_assert_cmpuint (size, ==, 48);
+}
+
+static void
+test_stream (void)
+{
+	Receiver receiver = { 0, };
+	RemoteDisplayDevice *device;
+	RemoteDisplayAudioStream *stream;
+	GError *error = NULL;
+
+	receiver_setup (&receiver);
+	device = new_device (receiver.port);
+	stream = remote_display_audio_stream_new (device);
+	remote_display_audio_stream_set_volume (stream, 0.5);
+
+	remote_display_audio_stream_start (stream, &error);
+	g_assert_no_error (error);
+	g_assert_cmpuint (remote_display_audio_stream_write (stream, samples, N_FRAMES), ==, N_FRAMES);
+
+	test_wait_until (receiver.n_packets >= N_PACKETS && receiver.n_syncs > 0 && volume_sent (&receiver));
+
+	/* The receiver's latency is used */
+	g_assert_cmpint (remote_display_audio_stream_get_delay (stream), <,
+			 (gint64) (N_FRAMES + 2206) * G_USEC_PER_SEC / REMOTE_DISPLAY_ALAC_SAMPLE_RATE);
+	g_assert_cmpuint (remote_display_audio_stream_get_packets_sent (stream), >=, N_PACKETS);
+
+	/* Stopping tears the session down */
+	remote_display_audio_stream_stop (stream);
+	g_thread_join (receiver.thread);
+	g_assert_cmpuint (receiver.methods->len, ==, 5);
+	g_assert_cmpstr (g_ptr_array_index (receiver.methods, 0), ==, "ANNOUNCE");
+	g_assert_cmpstr (g_ptr_array_index (receiver.methods, 1), ==, "SETUP");
+	g_assert_cmpstr (g_ptr_array_index (receiver.methods, 2), ==, "RECORD");
+	g_assert_cmpstr (g_ptr_array_index (receiver.methods, 3), ==, "SET_PARAMETER");
+	g_assert_cmpstr (g_ptr_array_index (receiver.methods, 4), ==, "TEARDOWN");
+	g_assert_cmpstr (receiver.volume, ==, "volume: -15.000000\r\n");
+
+	receiver_teardown (&receiver);
+	g_object_unref (stream);
+	g_object_unref (device);
+}
+
+static void
+stopped_cb (RemoteDisplayAudioStream *stream,
+	    const GError             *error,
+	    guint                    *n_stopped)
+{
+	g_assert_nonnull (error);
+	(*n_stopped)++;
+}
+
+/* A port nothing listens on */
+static guint16
+get_closed_port (void)
+{
+	GSocket *socket;
+	GInetAddress *loopback;
+	GSocketAddress *address;
+	GError *error = NULL;
+	guint16 port;
+
+	socket = g_socket_new (G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP, &error);
+	g_assert_no_error (error);
+	loopback = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+	address = g_inet_socket_address_new (loopback, 0);
+	g_socket_bind (socket, address, FALSE, &error);
+	g_assert_no_error (error);
+	port = get_port (socket);
+	g_object_unref (address);
+	g_object_unref (loopback);
+	g_object_unref (socket);
+
+	return port;
+}
+
+/* Streams that stopped on their own can be started again, and
+ * a stop that wasn't reported yet isn't once stopped */
+static void
+test_stopped (void)
+{
+	RemoteDisplayDevice *device;
+	RemoteDisplayAudioStream *stream;
+	GError *error = NULL;
+	guint n_stopped = 0;
+	gint64 deadline;
+
+	device = new_device (get_closed_port ());
+	stream = remote_display_audio_stream_new (device);
+	g_signal_connect (stream, "stopped", G_CALLBACK (stopped_cb), &n_stopped);
+
+	remote_display_audio_stream_start (stream, &error);
+	g_assert_no_error (error);
+	test_wait_until (n_stopped == 1);
+	remote_display_audio_stream_start (stream, &error);
+	g_assert_no_error (error);
+	test_wait_until (n_stopped == 2);
+
+	remote_display_audio_stream_start (stream, &error);
+	g_assert_no_error (error);
+	deadline = g_get_monotonic_time () + TEST_TIMEOUT * G_USEC_PER_SEC;
+	while (!g_main_context_pending (NULL)) {
+		g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+		g_usleep (1000);
+	}
+	remote_display_audio_stream_stop (stream);
+	while (g_main_context_iteration (NULL, FALSE))
+		;
+	g_assert_cmpuint (n_stopped, ==, 2);
+
+	g_object_unref (stream);
+	g_object_unref (device);
+}
+
+int main (int argc, char **argv)
+{
+	guint i;
+
+	g_test_init (&argc, &argv, NULL);
+
+	for (i = 0; i < N_FRAMES; i++) {
+		samples[i * 2] = i;
+		samples[i * 2 + 1] = -i;
+	}
+
+	g_test_add_func ("/audio-stream/alac", test_alac);
+	g_test_add_func ("/audio-stream/stream", test_stream);
+	g_test_add_func ("/audio-stream/stopped", test_stopped);
+
+	return g_test_run ();
+}
@@ -0,0 +1,356 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+#include <glib.h>
+#include <string.h>
+#include <libsoup/soup.h>
+#include <libremote-display/remote-display.h>
+#include <libremote-display/remote-display-device-dlna.h>
+#include <libremote-display/remote-display-ssdp.h>
+#include "test-util.h"
+
+#define RENDERER_UDN "uuid:2fac1234-31f8-11b4-a222-08002b34c003"
+
+/* A stand-in media renderer, with just enough of UPnP */
+static const char description[] =
+	"<?xml version=\"1.0\"?>"
+	"<root xmlns=\"urn:schemas-upnp-org:device-1-0\">"
+	"<specVersion><major>1</major><minor>0</minor></specVersion>"
+	"<device>"
+	"<deviceType>" DLNA_RENDERER_TYPE "</deviceType>"
+	"<friendlyName>Test Renderer</friendlyName>"
+	"<modelName>Stand-in</modelName>"
+	"<UDN>" RENDERER_UDN "</UDN>"
+	"<serviceList>"
+	"<service>"
+	"<serviceType>urn:schemas-upnp-org:service:RenderingControl:1</serviceType>"
+	"<controlURL>control/rc</controlURL>"
+	"<eventSubURL>event/rc</eventSubURL>"
+	"</service>"
+	"<service>"
+	"<serviceType>urn:schemas-upnp-org:service:AVTransport:1</serviceType>"
+	"<controlURL>/control/avt</controlURL>"
+	"<eventSubURL>/event/avt</eventSubURL>"
+	"</service>"
+	"</serviceList>"
+	"</device>"
+	"</root>";
+
+static const char playing_event[] =
+	"<?xml version=\"1.0\"?>"
+	"<e:propertyset xmlns:e=\"urn:schemas-upnp-org:event-1-0\"><e:property><LastChange>"
+	"&lt;Event xmlns=&quot;urn:schemas-upnp-org:metadata-1-0/AVT/&quot;&gt;"
+	"&lt;InstanceID val=&quot;0&quot;&gt;&lt;TransportState val=&quot;PLAYING&quot;/&gt;&lt;/InstanceID&gt;"
+	"&lt;/Event&gt;"
+	"</LastChange></e:property></e:propertyset>";
+
+typedef struct {
+	GMainLoop *loop;
+	RemoteDisplayDlnaContext *context;
+	SoupServer *server;
+	SoupSession *session;
+	char *location;
+	GPtrArray *requests;
+	char *callback;
+	RemoteDisplayDevice *device;
+	RemoteDisplayDeviceState state;
+} Renderer;
+
+static void
+description_cb (SoupServer        *server,
+		SoupMessage       *msg,
+		const char        *path,
+		GHashTable        *query,
+		SoupClientContext *client,
+		gpointer           user_data)
+{
+	soup_message_set_status (msg, SOUP_STATUS_OK);
+	soup_message_set_response (msg, "text/xml", SOUP_MEMORY_STATIC,
+				   description, strlen (description));
+}
+
+static void
+control_cb (SoupServer        *server,
+	    SoupMessage       *msg,
+	    const char        *path,
+	    GHashTable        *query,
+	    SoupClientContext *client,
+	    gpointer           user_data)
+{
+	Renderer *renderer = user_data;
+	const char *action;
+
+	/* "urn:schemas-upnp-org:service:AVTransport:1#Play", quoted */
+	action = soup_message_headers_get_one (msg->request_headers, "SOAPAction");
+	g_assert_nonnull (action);
+	action = strchr (action, '#');
+	g_assert_nonnull (action);
+	g_ptr_array_add (renderer->requests, g_strndup (action + 1, strcspn (action + 1, "\"")));
+	soup_message_set_status (msg, SOUP_STATUS_OK);
+}
+
+static gboolean
+send_event_cb (gpointer user_data)
+{
+	Renderer *renderer = user_data;
+	SoupMessage *msg;
+
+	msg = soup_message_new ("NOTIFY", renderer->callback);
+	soup_message_headers_append (msg->request_headers, "NT", "upnp:event");
+	soup_message_headers_append (msg->request_headers, "NTS", "upnp:propchange");
+	soup_message_headers_append (msg->request_headers, "SID", "uuid:test-subscription");
+	soup_message_set_request (msg, "text/xml", SOUP_MEMORY_STATIC,
+				  playing_event, strlen (playing_event));
+	soup_session_queue_message (renderer->session, msg, NULL, NULL);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+event_cb (SoupServer        *server,
+	  SoupMessage       *msg,
+	  const char        *path,
+	  GHashTable        *query,
+	  SoupClientContext *client,
+	  gpointer           user_data)
+{
+	Renderer *renderer = user_data;
+	const char *callback;
+
+	g_assert_cmpstr (msg->method, ==, "SUBSCRIBE");
+	callback = soup_message_headers_get_one (msg->request_headers, "CALLBACK");
+	g_assert_nonnull (callback);
+	g_assert_cmpstr (soup_message_headers_get_one (msg->request_headers, "NT"), ==, "upnp:event");
+
+	g_ptr_array_add (renderer->requests, g_strdup ("SUBSCRIBE"));
+	renderer->callback = g_strndup (callback + 1, strlen (callback) - 2);
+
+	soup_message_headers_append (msg->response_headers, "SID", "uuid:test-subscription");
+	soup_message_headers_append (msg->response_headers, "TIMEOUT", "Second-1800");
+	soup_message_set_status (msg, SOUP_STATUS_OK);
+
+	g_idle_add (send_event_cb, renderer);
+}
+
+static void
+renderer_setup (Renderer *renderer)
+{
+	GError *error = NULL;
+	GSList *uris;
+	SoupURI *uri;
+
+	renderer->loop = g_main_loop_new (NULL, FALSE);
+	renderer->context = remote_display_dlna_context_new ();
+	renderer->requests = g_ptr_array_new_with_free_func (g_free);
+	renderer->session = soup_session_new ();
+	renderer->server = soup_server_new (NULL, NULL);
+	soup_server_add_handler (renderer->server, "/desc.xml", description_cb, renderer, NULL);
+	soup_server_add_handler (renderer->server, "/control", control_cb, renderer, NULL);
+	soup_server_add_handler (renderer->server, "/event/avt", event_cb, renderer, NULL);
+	soup_server_listen_local (renderer->server, 0, SOUP_SERVER_LISTEN_IPV4_ONLY, &error);
+	g_assert_no_error (error);
+
+	uris = soup_server_get_uris (renderer->server);
+	uri = uris->data;
+	renderer->location = g_strdup_printf ("http://127.0.0.1:%u/desc.xml", soup_uri_get_port (uri));
+	g_slist_free_full (uris, (GDestroyNotify) soup_uri_free);
+}
+
+static void
+renderer_teardown (Renderer *renderer)
+{
+	g_clear_object (&renderer->device);
+	remote_display_dlna_context_unref (renderer->context);
+	g_object_unref (renderer->server);
+	g_object_unref (renderer->session);
+	g_ptr_array_unref (renderer->requests);
+	g_main_loop_unref (renderer->loop);
+	g_free (renderer->location);
+	g_free (renderer->callback);
+}
+
+static void
+device_ready_cb (GObject      *source_object,
+		 GAsyncResult *result,
+		 gpointer      user_data)
+{
+	Renderer *renderer = user_data;
+	GError *error = NULL;
+
+	renderer->device = remote_display_device_dlna_new_finish (result, &error);
+	g_assert_no_error (error);
+	g_main_loop_quit (renderer->loop);
+}
+
+static void
+create_device (Renderer *renderer)
+{
+	remote_display_device_dlna_new_async (renderer->context, renderer->location, NULL,
+					      device_ready_cb, renderer);
+	test_run_loop (renderer->loop);
+	g_assert_nonnull (renderer->device);
+}
+
+static void
+test_description (void)
+{
+	Renderer renderer = { 0, };
+	char *name, *id;
+
+	renderer_setup (&renderer);
+	create_device (&renderer);
+
+	g_object_get (renderer.device, "name", &name, "id", &id, NULL);
+	g_assert_cmpstr (name, ==, "Test Renderer");
+	g_assert_cmpstr (id, ==, RENDERER_UDN);
+	g_assert_cmpint (remote_display_device_get_capabilities (renderer.device), ==,
+			 REMOTE_DISPLAY_DEVICE_CAPABILITIES_VIDEO);
+	g_free (name);
+	g_free (id);
+
+	renderer_teardown (&renderer);
+}
+
+static void
+state_changed_cb (RemoteDisplayDevice      *device,
+		  RemoteDisplayDeviceState  state,
+		  Renderer                 *renderer)
+{
+	renderer->state = state;
+	if (state == REMOTE_DISPLAY_DEVICE_STATE_PLAYING)
+		g_main_loop_quit (renderer->loop);
+}
+
+static void
+test_playback (void)
+{
+	Renderer renderer = { 0, };
+
+	renderer_setup (&renderer);
+	create_device (&renderer);
+
+	g_signal_connect (renderer.device, "state-changed",
+			  G_CALLBACK (state_changed_cb), &renderer);
+	remote_display_device_open_and_play (renderer.device, "http://example.com/video.mp4", 0);
+
+	test_wait_until (renderer.state == REMOTE_DISPLAY_DEVICE_STATE_PLAYING &&
+			 renderer.requests->len >= 3);
+
+	/* Queued requests arrive in order */
+	g_assert_cmpstr (g_ptr_array_index (renderer.requests, 0), ==, "SUBSCRIBE");
+	g_assert_cmpstr (g_ptr_array_index (renderer.requests, 1), ==, "SetAVTransportURI");
+	g_assert_cmpstr (g_ptr_array_index (renderer.requests, 2), ==, "Play");
+
+	renderer_teardown (&renderer);
+}
+
+static gboolean
+responder_cb (GSocket      *socket,
+	      GIOCondition  condition,
+	      gpointer      user_data)
+{
+	GSocketAddress *from;
+	char buffer[2048];
+	char *reply;
+	gssize len;
+
+	len = g_socket_receive_from (socket, &from, buffer, sizeof(buffer) - 1, NULL, NULL);
+	g_assert_cmpint (len, >, 0);
+	buffer[len] = '\0';
+	g_assert_true (g_str_has_prefix (buffer, "M-SEARCH * HTTP/1.1\r\n"));
+	g_assert_nonnull (strstr (buffer, "ST: " DLNA_RENDERER_TYPE "\r\n"));
+
+	reply = g_strdup_printf ("HTTP/1.1 200 OK\r\n"
+				 "CACHE-CONTROL: max-age=1800\r\n"
+				 "LOCATION: http://127.0.0.1:1234/desc.xml\r\n"
+				 "ST: " DLNA_RENDERER_TYPE "\r\n"
+				 "USN: " RENDERER_UDN "::" DLNA_RENDERER_TYPE "\r\n"
+				 "\r\n");
+	g_socket_send_to (socket, from, reply, strlen (reply), NULL, NULL);
+	g_object_unref (from);
+	g_free (reply);
+
+	return G_SOURCE_CONTINUE;
+}
+
+static void
+found_cb (RemoteDisplaySsdp *ssdp,
+	  const char        *usn,
+	  const char        *location,
+	  GMainLoop         *loop)
+{
+	g_assert_cmpstr (usn, ==, RENDERER_UDN "::" DLNA_RENDERER_TYPE);
+	g_assert_cmpstr (location, ==, "http://127.0.0.1:1234/desc.xml");
+	g_main_loop_quit (loop);
+}
+
+static void
+test_ssdp (void)
+{
+	RemoteDisplaySsdp *ssdp;
+	GSocketAddress *address, *bound;
+	GInetAddress *loopback;
+	GError *error = NULL;
+	GSocket *responder;
+	GSource *source;
+	GMainLoop *loop;
+
+	responder = g_socket_new (G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_DATAGRAM,
+				  G_SOCKET_PROTOCOL_UDP, &error);
+	g_assert_no_error (error);
+	loopback = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+	address = g_inet_socket_address_new (loopback, 0);
+	g_socket_bind (responder, address, FALSE, &error);
+	g_assert_no_error (error);
+	bound = g_socket_get_local_address (responder, &error);
+	g_assert_no_error (error);
+
+	source = g_socket_create_source (responder, G_IO_IN, NULL);
+	g_source_set_callback (source, (GSourceFunc) responder_cb, NULL, NULL);
+	g_source_attach (source, NULL);
+
+	loop = g_main_loop_new (NULL, FALSE);
+	ssdp = remote_display_ssdp_new (DLNA_RENDERER_TYPE);
+	remote_display_ssdp_set_target (ssdp, G_INET_SOCKET_ADDRESS (bound));
+	g_signal_connect (ssdp, "found", G_CALLBACK (found_cb), loop);
+	remote_display_ssdp_start (ssdp, &error);
+	g_assert_no_error (error);
+
+	test_run_loop (loop);
+
+	g_object_unref (ssdp);
+	g_main_loop_unref (loop);
+	g_source_destroy (source);
+	g_source_unref (source);
+	g_object_unref (responder);
+	g_object_unref (bound);
+	g_object_unref (address);
+	g_object_unref (loopback);
+}
+
+int main (int argc, char **argv)
+{
+	g_test_init (&argc, &argv, NULL);
+
+	g_test_add_func ("/dlna/description", test_description);
+	g_test_add_func ("/dlna/playback", test_playback);
+	g_test_add_func ("/dlna/ssdp", test_ssdp);
+
+	return g_test_run ();
+}
@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+#include <glib.h>
+#include <string.h>
+#include <libremote-display/remote-display-kernels.h>
+
+#define N_ITERATIONS 200
+
+/* Random sizes, covering the SIMD tails, with a padded stride */
+static guint8 *
+random_image (GRand *rand,
+	      guint *width,
+	      guint *height,
+	      guint *stride)
+{
+	guint8 *pixels;
+	gsize size, i;
+	gboolean saturated;
+
+	*width = g_rand_int_range (rand, 1, 160) * 2;
+	*height = g_rand_int_range (rand, 1, 24) * 2;
+	*stride = *width * 4 + g_rand_int_range (rand, 0, 16);
+
+	/* Saturated colours exercise the extremes of the fixed point maths */
+	saturated = g_rand_boolean (rand);
+	size = (gsize) *stride * *height;
+	pixels = g_malloc (size);
+	for (i = 0; i < size; i++)
+		pixels[i] = saturated ? (g_rand_boolean (rand) ? 0xff : 0) : g_rand_int (rand);
+
+	return pixels;
+}
+
+static void
+compare_planes (const guint8 *a,
+		const guint8 *b,
+		gsize         size,
+		const char   *impl,
+		const char   *kernel)
+{
+	if (memcmp (a, b, size) != 0)
+		g_error ("%s %s kernel differs from the scalar one", impl, kernel);
+}
+
+static void
+test_conversions (void)
+{
+	const RemoteDisplayKernels *scalar;
+	GRand *rand;
+	int impl;
+	guint i;
+
+	scalar = remote_display_kernels_get (REMOTE_DISPLAY_KERNELS_SCALAR);
+	rand = g_rand_new_with_seed (0x5eed);
+
+	for (i = 0; i < N_ITERATIONS; i++) {
+		guint width, height, stride;
+		guint8 *src, *ref, *out;
+		gboolean bgrx;
+		gsize y_size, c_size;
+
+		src = random_image (rand, &width, &height, &stride);
+		bgrx = g_rand_boolean (rand);
+		y_size = (gsize) width * height;
+		c_size = y_size / 4;
+
+		ref = g_malloc0 (y_size * 2);
+		out = g_malloc (y_size * 2);
+
+		for (impl = REMOTE_DISPLAY_KERNELS_SCALAR + 1; impl < REMOTE_DISPLAY_KERNELS_NUM_IMPLS; impl++) {
+			const RemoteDisplayKernels *kernels;
+
+			kernels = remote_display_kernels_get (impl);
+			if (kernels == NULL)
+				continue;
+
+			scalar->rgbx_to_i420 (src, stride, bgrx, width, height,
+					      ref, width,
+					      ref + y_size, width / 2,
+					      ref + y_size + c_size, width / 2);
+			memset (out, 0, y_size * 2);
+			kernels->rgbx_to_i420 (src, stride, bgrx, width, height,
+					       out, width,
+					       out + y_size, width / 2,
+					       out + y_size + c_size, width / 2);
+			compare_planes (ref, out, y_size * 2, kernels->name, "I420");
+
+			scalar->rgbx_to_nv12 (src, stride, bgrx, width, height,
+					      ref, width, ref + y_size, width);
+			memset (out, 0, y_size * 2);
+			kernels->rgbx_to_nv12 (src, stride, bgrx, width, height,
+					       out, width, out + y_size, width);
+			compare_planes (ref, out, y_size * 2, kernels->name, "NV12");
+
+			/* Treat the source as an 8-bit plane 4 times as wide */
+			scalar->halve_plane (src, stride, width * 2, height / 2, ref, width * 2);
+			memset (out, 0, y_size * 2);
+			kernels->halve_plane (src, stride, width * 2, height / 2, out, width * 2);
+			compare_planes (ref, out, y_size, kernels->name, "halving");
+		}
+
+		g_free (src);
+		g_free (ref);
+		g_free (out);
+	}
+
+	g_rand_free (rand);
+}
+
+static void
+test_scale_plane (void)
+{
+	guint8 src[64 * 64], dst[64 * 64];
+	guint i;
+
+	/* A flat plane stays flat whatever the ratio */
+	memset (src, 0x80, sizeof(src));
+	remote_display_kernels_scale_plane (src, 64, 64, 64, dst, 10, 10, 7);
+	for (i = 0; i < 10 * 7; i++)
+		g_assert_cmpuint (dst[i], ==, 0x80);
+	remote_display_kernels_scale_plane (src, 64, 8, 8, dst, 64, 64, 64);
+	for (i = 0; i < 64 * 64; i++)
+		g_assert_cmpuint (dst[i], ==, 0x80);
+
+	/* Same size is a copy */
+	for (i = 0; i < sizeof(src); i++)
+		src[i] = i * 7;
+	remote_display_kernels_scale_plane (src, 64, 64, 64, dst, 64, 64, 64);
+	g_assert (memcmp (src, dst, sizeof(src)) == 0);
+
+	/* Halving is a 2x2 box filter */
+	remote_display_kernels_scale_plane (src, 64, 64, 64, dst, 32, 32, 32);
+	g_assert_cmpuint (dst[0], ==, (src[0] + src[1] + src[64] + src[65] + 2) / 4);
+}
+
+int main (int argc, char **argv)
+{
+	g_test_init (&argc, &argv, NULL);
+
+	g_test_add_func ("/kernels/conversions", test_conversions);
+	g_test_add_func ("/kernels/scale-plane", test_scale_plane);
+
+	return g_test_run ();
+}
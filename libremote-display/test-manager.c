@@ -0,0 +1,751 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include "config.h"
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <gio/gio.h>
+#include <avahi-client/client.h>
+#include <avahi-client/publish.h>
+#include <avahi-common/address.h>
+#include <avahi-common/error.h>
+#include <avahi-glib/glib-watch.h>
+#include <libremote-display/remote-display.h>
+#include <libremote-display/remote-display-device-private.h>
+#include <libremote-display/remote-display-mock-airplay.h>
+#include "test-util.h"
+
+#define AIRPLAY_SERVICE "_airplay._tcp"
+#define RAOP_SERVICE    "_raop._tcp"
+#define DEVICE_ID       "58:55:CA:1A:E2:88"
+#define DEVICE_KEY      AIRPLAY_SERVICE "/" DEVICE_ID
+#define INSTANCE        "Living Room"
+
+/* As in remote-display-manager.c */
+#define CHANGES_DELAY    250                   /* milliseconds */
+#define MAX_RESOLVERS    8
+#define RESOLVE_TIMEOUT  5                     /* seconds */
+#define RESOLVE_ATTEMPTS 2
+#define EVENTS_PER_DISPATCH 32
+
+/* A receiver, advertised by a stand-in responder, and
+ * the manager that finds it */
+typedef struct {
+	TestResponder *responder;
+	RemoteDisplayMockAirplay *mock;
+	char *cache_path;
+
+	RemoteDisplayManager *manager;
+	GPtrArray *appeared;
+	guint n_appeared_provisional;
+	guint n_disappeared;
+} Network;
+
+static void
+network_setup (Network *network)
+{
+	GError *error = NULL;
+	char *target;
+	int fd;
+
+	network->responder = test_responder_new ();
+	target = test_responder_get_target (network->responder);
+	g_setenv ("REMOTE_DISPLAY_MDNS", "native", TRUE);
+	g_setenv ("REMOTE_DISPLAY_MDNS_TARGET", target, TRUE);
+	g_free (target);
+
+	fd = g_file_open_tmp ("test-manager-XXXXXX.ini", &network->cache_path, &error);
+	g_assert_no_error (error);
+	close (fd);
+	g_unlink (network->cache_path);
+	g_setenv ("REMOTE_DISPLAY_CACHE", network->cache_path, TRUE);
+
+	network->mock = remote_display_mock_airplay_new (DEVICE_ID);
+	remote_display_mock_airplay_start (network->mock, &error);
+	g_assert_no_error (error);
+
+	network->appeared = g_ptr_array_new_with_free_func (g_object_unref);
+}
+
+static void
+network_teardown (Network *network)
+{
+	g_clear_object (&network->manager);
+	g_clear_object (&network->mock);
+	test_responder_free (network->responder);
+	g_ptr_array_unref (network->appeared);
+	g_unlink (network->cache_path);
+	g_free (network->cache_path);
+}
+
+static void
+advertise_mock (Network                  *network,
+		RemoteDisplayMockAirplay *mock,
+		const char               *instance)
+{
+	char **txt;
+
+	txt = remote_display_mock_airplay_get_txt (mock);
+	test_responder_add (network->responder, AIRPLAY_SERVICE, instance,
+			    remote_display_mock_airplay_get_port (mock), txt);
+	g_strfreev (txt);
+}
+
+static void
+advertise (Network *network)
+{
+	advertise_mock (network, network->mock, INSTANCE);
+}
+
+static void
+device_appeared_cb (RemoteDisplayManager *manager,
+		    RemoteDisplayDevice  *device,
+		    Network              *network)
+{
+	gboolean provisional;
+
+	g_object_get (G_OBJECT (device), "provisional", &provisional, NULL);
+	if (provisional)
+		network->n_appeared_provisional++;
+	g_ptr_array_add (network->appeared, g_object_ref (device));
+}
+
+static void
+device_disappeared_cb (RemoteDisplayManager *manager,
+		       RemoteDisplayDevice  *device,
+		       Network              *network)
+{
+	network->n_disappeared++;
+}
+
+static void
+network_start_full (Network  *network,
+		    gboolean  discovery_thread)
+{
+	network->manager = g_object_new (REMOTE_DISPLAY_TYPE_MANAGER,
+					 "discovery-thread", discovery_thread,
+					 NULL);
+	g_signal_connect (network->manager, "device-appeared",
+			  G_CALLBACK (device_appeared_cb), network);
+	g_signal_connect (network->manager, "device-disappeared",
+			  G_CALLBACK (device_disappeared_cb), network);
+}
+
+static void
+network_start (Network *network)
+{
+	network_start_full (network, FALSE);
+}
+
+/* What the manager would have saved the last time it saw the receiver */
+static void
+write_cache (Network *network,
+	     gint64   last_seen)
+{
+	GKeyFile *cache;
+	GError *error = NULL;
+	char **txt, *candidate;
+
+	cache = g_key_file_new ();
+	g_key_file_set_string (cache, DEVICE_KEY, "Type", AIRPLAY_SERVICE);
+	g_key_file_set_string (cache, DEVICE_KEY, "Name", INSTANCE);
+	g_key_file_set_string (cache, DEVICE_KEY, "Hostname", "responder.local");
+	g_key_file_set_integer (cache, DEVICE_KEY, "Port", remote_display_mock_airplay_get_port (network->mock));
+	g_key_file_set_int64 (cache, DEVICE_KEY, "LastSeen", last_seen);
+	txt = remote_display_mock_airplay_get_txt (network->mock);
+	g_key_file_set_string_list (cache, DEVICE_KEY, "Txt", (const char * const *) txt, g_strv_length (txt));
+	g_strfreev (txt);
+	candidate = g_strdup_printf ("%u,%d,127.0.0.1", if_nametoindex ("lo"), AVAHI_PROTO_INET);
+	g_key_file_set_string_list (cache, DEVICE_KEY, "Candidates", (const char * const *) &candidate, 1);
+	g_free (candidate);
+
+	g_key_file_save_to_file (cache, network->cache_path, &error);
+	g_assert_no_error (error);
+	g_key_file_free (cache);
+}
+
+static gboolean
+is_provisional (RemoteDisplayDevice *device)
+{
+	gboolean provisional;
+
+	g_object_get (G_OBJECT (device), "provisional", &provisional, NULL);
+	return provisional;
+}
+
+static gboolean
+has_appeared (Network    *network,
+	      const char *name)
+{
+	guint i;
+
+	for (i = 0; i < network->appeared->len; i++) {
+		RemoteDisplayDevice *device = g_ptr_array_index (network->appeared, i);
+
+		if (g_strcmp0 (remote_display_device_get_name (device), name) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static guint64
+get_metric (Network    *network,
+	    const char *key)
+{
+	GVariant *metrics, *value;
+	guint64 ret = 0;
+
+	metrics = remote_display_manager_get_metrics (network->manager);
+	value = g_variant_lookup_value (metrics, key, NULL);
+	g_assert_nonnull (value);
+	if (g_variant_is_of_type (value, G_VARIANT_TYPE_UINT32))
+		ret = g_variant_get_uint32 (value);
+	else
+		ret = g_variant_get_uint64 (value);
+	g_variant_unref (value);
+	g_variant_unref (metrics);
+
+	return ret;
+}
+
+/* Cached receivers show up straight away, and
+ * are confirmed once found on the network */
+static void
+test_cache_confirm (void)
+{
+	Network network = { 0, };
+	RemoteDisplayDevice *device;
+	GKeyFile *cache;
+	GError *error = NULL;
+	gint64 last_seen;
+
+	network_setup (&network);
+	advertise (&network);
+	last_seen = g_get_real_time () / G_USEC_PER_SEC - 60;
+	write_cache (&network, last_seen);
+	network_start (&network);
+
+	test_wait_until (network.appeared->len == 1);
+	g_assert_cmpuint (network.n_appeared_provisional, ==, 1);
+	device = g_ptr_array_index (network.appeared, 0);
+	g_assert_cmpstr (remote_display_device_get_name (device), ==, INSTANCE);
+
+	test_wait_until (!is_provisional (device));
+	g_assert_cmpuint (network.appeared->len, ==, 1);
+	g_assert_cmpuint (network.n_disappeared, ==, 0);
+
+	/* The cache is saved on the way out, with the new sighting */
+	g_clear_object (&network.manager);
+	cache = g_key_file_new ();
+	g_key_file_load_from_file (cache, network.cache_path, G_KEY_FILE_NONE, &error);
+	g_assert_no_error (error);
+	g_assert_cmpint (g_key_file_get_int64 (cache, DEVICE_KEY, "LastSeen", NULL), >, last_seen);
+	g_key_file_free (cache);
+
+	network_teardown (&network);
+}
+
+/* Cached receivers that aren't found once browsing settled are retracted */
+static void
+test_cache_retract (void)
+{
+	Network network = { 0, };
+	RemoteDisplayDevice *device;
+	GPtrArray *devices;
+
+	network_setup (&network);
+	write_cache (&network, g_get_real_time () / G_USEC_PER_SEC - 60);
+	network_start (&network);
+
+	test_wait_until (network.appeared->len == 1);
+	device = g_ptr_array_index (network.appeared, 0);
+	g_assert (is_provisional (device));
+
+	test_wait_until (network.n_disappeared == 1);
+	devices = remote_display_manager_get_devices (network.manager);
+	g_assert_cmpuint (devices->len, ==, 0);
+	g_ptr_array_unref (devices);
+
+	network_teardown (&network);
+}
+
+/* Old entries aren't used */
+static void
+test_cache_expired (void)
+{
+	Network network = { 0, };
+
+	network_setup (&network);
+	advertise (&network);
+	write_cache (&network, g_get_real_time () / G_USEC_PER_SEC - 31 * 24 * 60 * 60);
+	network_start (&network);
+
+	test_wait_until (network.appeared->len == 1);
+	g_assert_cmpuint (network.n_appeared_provisional, ==, 0);
+
+	network_teardown (&network);
+}
+
+typedef struct {
+	gint64 first_appeared;
+	gint64 emitted;
+	guint n_emissions;
+	GPtrArray *added;
+	GPtrArray *removed;
+} Changes;
+
+static void
+changes_appeared_cb (RemoteDisplayManager *manager,
+		     RemoteDisplayDevice  *device,
+		     Changes              *changes)
+{
+	if (changes->first_appeared == 0)
+		changes->first_appeared = g_get_monotonic_time ();
+}
+
+static void
+devices_changed_cb (RemoteDisplayManager *manager,
+		    GPtrArray            *added,
+		    GPtrArray            *removed,
+		    Changes              *changes)
+{
+	guint i;
+
+	changes->n_emissions++;
+	changes->emitted = g_get_monotonic_time ();
+	for (i = 0; i < added->len; i++)
+		g_ptr_array_add (changes->added, g_object_ref (g_ptr_array_index (added, i)));
+	for (i = 0; i < removed->len; i++)
+		g_ptr_array_add (changes->removed, g_object_ref (g_ptr_array_index (removed, i)));
+}
+
+/* Receivers found together are announced in one go, once
+ * the batch had time to fill, and so are the ones leaving */
+static void
+test_devices_changed (void)
+{
+	Network network = { 0, };
+	RemoteDisplayMockAirplay *kitchen, *bedroom;
+	RemoteDisplayDevice *device;
+	Changes changes = { 0, };
+	GError *error = NULL;
+
+	network_setup (&network);
+	kitchen = remote_display_mock_airplay_new ("58:55:CA:1A:E2:89");
+	remote_display_mock_airplay_start (kitchen, &error);
+	g_assert_no_error (error);
+	bedroom = remote_display_mock_airplay_new ("58:55:CA:1A:E2:8A");
+	remote_display_mock_airplay_start (bedroom, &error);
+	g_assert_no_error (error);
+
+	advertise (&network);
+	advertise_mock (&network, kitchen, "Kitchen");
+	advertise_mock (&network, bedroom, "Bedroom");
+
+	changes.added = g_ptr_array_new_with_free_func (g_object_unref);
+	changes.removed = g_ptr_array_new_with_free_func (g_object_unref);
+	network_start (&network);
+	g_signal_connect (network.manager, "device-appeared",
+			  G_CALLBACK (changes_appeared_cb), &changes);
+	g_signal_connect (network.manager, "devices-changed",
+			  G_CALLBACK (devices_changed_cb), &changes);
+
+	test_wait_until (changes.n_emissions == 1);
+	g_assert_cmpuint (network.appeared->len, ==, 3);
+	g_assert_cmpuint (changes.added->len, ==, 3);
+	g_assert_cmpuint (changes.removed->len, ==, 0);
+	/* The main context's time can lag a little behind */
+	g_assert_cmpint (changes.emitted - changes.first_appeared, >=, (CHANGES_DELAY - 50) * 1000);
+
+	test_responder_remove (network.responder, AIRPLAY_SERVICE, "Kitchen");
+	test_wait_until (changes.n_emissions == 2);
+	g_assert_cmpuint (network.n_disappeared, ==, 1);
+	g_assert_cmpuint (changes.added->len, ==, 3);
+	g_assert_cmpuint (changes.removed->len, ==, 1);
+	device = g_ptr_array_index (changes.removed, 0);
+	g_assert_cmpstr (remote_display_device_get_name (device), ==, "Kitchen");
+
+	/* Only the available devices can be looked up */
+	g_assert_null (remote_display_manager_lookup_by_id (network.manager, "58:55:CA:1A:E2:89"));
+	device = remote_display_manager_lookup_by_id (network.manager, DEVICE_ID);
+	g_assert_nonnull (device);
+	g_assert_cmpstr (remote_display_device_get_name (device), ==, INSTANCE);
+
+	g_ptr_array_unref (changes.added);
+	g_ptr_array_unref (changes.removed);
+	network_teardown (&network);
+	g_object_unref (kitchen);
+	g_object_unref (bedroom);
+}
+
+/* Receivers that stop answering are hidden until they answer again */
+static void
+test_liveness (void)
+{
+	Network network = { 0, };
+	RemoteDisplayDevice *device;
+	Changes changes = { 0, };
+	GPtrArray *devices;
+
+	network_setup (&network);
+	advertise (&network);
+	changes.added = g_ptr_array_new_with_free_func (g_object_unref);
+	changes.removed = g_ptr_array_new_with_free_func (g_object_unref);
+	network_start (&network);
+	g_signal_connect (network.manager, "devices-changed",
+			  G_CALLBACK (devices_changed_cb), &changes);
+
+	test_wait_until (changes.n_emissions == 1);
+	device = g_ptr_array_index (network.appeared, 0);
+
+	/* Nothing listens on its port any more, so both probes are
+	 * refused, as after a command failed to connect */
+	g_clear_object (&network.mock);
+	remote_display_device_mark_failed (device);
+	test_wait_until (remote_display_device_get_reachability (device) == REMOTE_DISPLAY_DEVICE_REACHABILITY_UNREACHABLE);
+	g_assert_cmpuint (network.n_disappeared, ==, 1);
+	devices = remote_display_manager_get_devices (network.manager);
+	g_assert_cmpuint (devices->len, ==, 0);
+	g_ptr_array_unref (devices);
+	g_assert_cmpuint (get_metric (&network, "devices-known"), ==, 1);
+
+	test_wait_until (changes.n_emissions == 2);
+	g_assert_cmpuint (changes.removed->len, ==, 1);
+	g_assert (g_ptr_array_index (changes.removed, 0) == device);
+
+	/* It's the same device when it answers again */
+	remote_display_device_mark_alive (device);
+	g_assert_cmpuint (network.appeared->len, ==, 2);
+	g_assert (g_ptr_array_index (network.appeared, 1) == device);
+	devices = remote_display_manager_get_devices (network.manager);
+	g_assert_cmpuint (devices->len, ==, 1);
+	g_ptr_array_unref (devices);
+
+	test_wait_until (changes.n_emissions == 3);
+	g_assert_cmpuint (changes.added->len, ==, 2);
+
+	g_ptr_array_unref (changes.added);
+	g_ptr_array_unref (changes.removed);
+	network_teardown (&network);
+}
+
+static void
+thread_appeared_cb (RemoteDisplayManager *manager,
+		    RemoteDisplayDevice  *device,
+		    GThread              *thread)
+{
+	g_assert (g_thread_self () == thread);
+}
+
+/* Results found by the discovery thread are handed over to the
+ * manager's context together, but only a few at a time */
+#define N_RECEIVERS (EVENTS_PER_DISPATCH + 8)
+
+static void
+test_discovery_thread (void)
+{
+	Network network = { 0, };
+	Changes changes = { 0, };
+	char **txt, *device_id;
+	guint i, before, largest = 0;
+	guint timeout_id;
+
+	network_setup (&network);
+	txt = remote_display_mock_airplay_get_txt (network.mock);
+	device_id = txt[0];
+	for (i = 0; i < N_RECEIVERS; i++) {
+		char *instance;
+
+		instance = g_strdup_printf ("Receiver %02u", i);
+		txt[0] = g_strdup_printf ("deviceid=02:00:00:00:00:%02X", i);
+		test_responder_add (network.responder, AIRPLAY_SERVICE, instance,
+				    remote_display_mock_airplay_get_port (network.mock), txt);
+		g_free (txt[0]);
+		g_free (instance);
+	}
+	txt[0] = device_id;
+	g_strfreev (txt);
+
+	changes.added = g_ptr_array_new_with_free_func (g_object_unref);
+	changes.removed = g_ptr_array_new_with_free_func (g_object_unref);
+	network_start_full (&network, TRUE);
+	g_signal_connect (network.manager, "device-appeared",
+			  G_CALLBACK (thread_appeared_cb), g_thread_self ());
+	g_signal_connect (network.manager, "devices-changed",
+			  G_CALLBACK (devices_changed_cb), &changes);
+
+	/* Each iteration hands the results over at most once */
+	timeout_id = test_timeout_add ("the receivers");
+	while (network.appeared->len < N_RECEIVERS) {
+		before = network.appeared->len;
+		g_main_context_iteration (NULL, TRUE);
+		largest = MAX (largest, network.appeared->len - before);
+	}
+	g_source_remove (timeout_id);
+	/* The replies all came in before the first hand-over */
+	g_assert_cmpuint (largest, ==, EVENTS_PER_DISPATCH);
+
+	/* And the UI hears about them once */
+	test_wait_until (changes.n_emissions == 1);
+	g_assert_cmpuint (changes.added->len, ==, N_RECEIVERS);
+
+	g_ptr_array_unref (changes.added);
+	g_ptr_array_unref (changes.removed);
+	network_teardown (&network);
+}
+
+/* Receivers kept out by the filter are counted once, with all their
+ * services, and don't get in the way of the ones that match */
+static void
+test_filter (void)
+{
+	Network network = { 0, };
+	RemoteDisplayMockAirplay *kitchen;
+	GError *error = NULL;
+	const char *raop_txt[] = { "txtvers=1", "cn=0,1", "et=0,1", NULL };
+	guint resolves_skipped, devices_skipped;
+
+	network_setup (&network);
+	kitchen = remote_display_mock_airplay_new ("58:55:CA:1A:E2:89");
+	remote_display_mock_airplay_start (kitchen, &error);
+	g_assert_no_error (error);
+
+	advertise (&network);
+	test_responder_add (network.responder, RAOP_SERVICE, "5855CA1AE288@" INSTANCE,
+			    remote_display_mock_airplay_get_port (network.mock), (char **) raop_txt);
+	advertise_mock (&network, kitchen, "Kitchen");
+
+	network_start (&network);
+	remote_display_manager_set_filter (network.manager, 0, "Kitchen");
+
+	test_wait_until (network.appeared->len == 1);
+	g_assert_cmpstr (remote_display_device_get_name (g_ptr_array_index (network.appeared, 0)), ==, "Kitchen");
+
+	/* The first replies were handled by the time the next queries go out */
+	test_wait_until (test_responder_get_queries (network.responder, AIRPLAY_SERVICE) >= 2 &&
+			 test_responder_get_queries (network.responder, RAOP_SERVICE) >= 2);
+	remote_display_manager_get_filter_stats (network.manager, &resolves_skipped, &devices_skipped);
+	/* The native querier resolves while browsing */
+	g_assert_cmpuint (resolves_skipped, ==, 0);
+	g_assert_cmpuint (devices_skipped, ==, 1);
+	g_assert_cmpuint (get_metric (&network, "devices-skipped"), ==, 1);
+	g_assert_cmpuint (network.appeared->len, ==, 1);
+
+	network_teardown (&network);
+	g_object_unref (kitchen);
+}
+
+typedef struct {
+	gboolean done;
+	GError *error;
+} Command;
+
+static void
+open_and_play_cb (GObject      *source_object,
+		  GAsyncResult *result,
+		  gpointer      user_data)
+{
+	Command *command = user_data;
+
+	remote_display_device_open_and_play_finish (REMOTE_DISPLAY_DEVICE (source_object),
+						    result, &command->error);
+	command->done = TRUE;
+}
+
+static void
+pause_cb (GObject      *source_object,
+	  GAsyncResult *result,
+	  gpointer      user_data)
+{
+	Command *command = user_data;
+
+	remote_display_device_pause_finish (REMOTE_DISPLAY_DEVICE (source_object),
+					    result, &command->error);
+	command->done = TRUE;
+}
+
+/* The failures total doesn't go down when devices go away */
+static void
+test_failures_total (void)
+{
+	Network network = { 0, };
+	RemoteDisplayDevice *device;
+	Command command = { 0, };
+
+	network_setup (&network);
+	advertise (&network);
+	network_start (&network);
+
+	test_wait_until (network.appeared->len == 1);
+	device = g_ptr_array_index (network.appeared, 0);
+
+	/* Not hosted, so the receiver gets the URI as is */
+	remote_display_device_open_and_play_async (device, "http://127.0.0.1:9/video.mp4", 0,
+						   NULL, open_and_play_cb, &command);
+	test_wait_until (command.done);
+	g_assert_no_error (command.error);
+
+	remote_display_mock_airplay_set_errors (network.mock, 1.0, 503);
+	command.done = FALSE;
+	remote_display_device_pause_async (device, NULL, pause_cb, &command);
+	test_wait_until (command.done);
+	g_assert_error (command.error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_COMMAND_FAILED);
+	g_clear_error (&command.error);
+	g_assert_cmpuint (get_metric (&network, "command-failures"), ==, 1);
+
+	test_responder_remove (network.responder, AIRPLAY_SERVICE, INSTANCE);
+	test_wait_until (get_metric (&network, "devices-known") == 0);
+	g_assert_cmpuint (get_metric (&network, "command-failures"), ==, 1);
+
+	network_teardown (&network);
+}
+
+static void
+changes_context_cb (RemoteDisplayManager  *manager,
+		    GPtrArray             *added,
+		    GPtrArray             *removed,
+		    GMainContext         **context)
+{
+	*context = g_source_get_context (g_main_current_source ());
+}
+
+/* Managers created under a thread-default context run
+ * everything there, the responder runs in the default one */
+static void
+test_context (void)
+{
+	Network network = { 0, };
+	GMainContext *context, *changes_context = NULL;
+	gint64 deadline;
+
+	context = g_main_context_new ();
+	g_main_context_push_thread_default (context);
+
+	network_setup (&network);
+	advertise (&network);
+	network_start (&network);
+	g_signal_connect (network.manager, "devices-changed",
+			  G_CALLBACK (changes_context_cb), &changes_context);
+
+	deadline = g_get_monotonic_time () + TEST_TIMEOUT * G_USEC_PER_SEC;
+	while (!changes_context) {
+		g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+		g_main_context_iteration (context, FALSE);
+		g_main_context_iteration (NULL, FALSE);
+		g_usleep (1000);
+	}
+	g_assert_true (changes_context == context);
+
+	network_teardown (&network);
+	g_main_context_pop_thread_default (context);
+	g_main_context_unref (context);
+}
+
+/* Only MAX_RESOLVERS resolves run at once, and those that get no
+ * answer give their slot up after RESOLVE_TIMEOUT. Resolving is
+ * only scheduled when browsing through the Avahi daemon */
+static void
+test_resolve_slots (void)
+{
+	Network network = { 0, };
+	AvahiGLibPoll *glib_poll;
+	AvahiClient *client;
+	AvahiEntryGroup *group;
+	AvahiStringList *txt;
+	char **mock_txt;
+	gint64 published;
+	guint i;
+	int error;
+
+	glib_poll = avahi_glib_poll_new (NULL, G_PRIORITY_DEFAULT);
+	client = avahi_client_new (avahi_glib_poll_get (glib_poll), 0, NULL, NULL, &error);
+	if (!client || avahi_client_get_state (client) != AVAHI_CLIENT_S_RUNNING) {
+		g_test_skip ("No Avahi daemon to publish services with");
+		if (client)
+			avahi_client_free (client);
+		avahi_glib_poll_free (glib_poll);
+		return;
+	}
+
+	network_setup (&network);
+	g_setenv ("REMOTE_DISPLAY_MDNS", "avahi", TRUE);
+	g_unsetenv ("REMOTE_DISPLAY_MDNS_TARGET");
+
+	mock_txt = remote_display_mock_airplay_get_txt (network.mock);
+	txt = avahi_string_list_new_from_array ((const char **) mock_txt, -1);
+
+	/* Nothing answers for that host name, so those never resolve */
+	group = avahi_entry_group_new (client, NULL, NULL);
+	for (i = 0; i < MAX_RESOLVERS; i++) {
+		char *name;
+
+		name = g_strdup_printf ("Unresolvable %u", i);
+		g_assert_cmpint (avahi_entry_group_add_service_strlst (group, AVAHI_IF_UNSPEC, AVAHI_PROTO_INET, 0,
+								       name, AIRPLAY_SERVICE, NULL,
+								       "test-manager-unresolvable.local", 7000, txt),
+				 ==, AVAHI_OK);
+		g_free (name);
+	}
+	g_assert_cmpint (avahi_entry_group_commit (group), ==, AVAHI_OK);
+
+	network_start (&network);
+	test_wait_until (get_metric (&network, "resolves-in-flight") >= MAX_RESOLVERS);
+
+	/* So the receiver that does answer has to wait for a slot */
+	group = avahi_entry_group_new (client, NULL, NULL);
+	g_assert_cmpint (avahi_entry_group_add_service_strlst (group, AVAHI_IF_UNSPEC, AVAHI_PROTO_INET, 0,
+							       INSTANCE, AIRPLAY_SERVICE, NULL, NULL,
+							       remote_display_mock_airplay_get_port (network.mock), txt),
+			 ==, AVAHI_OK);
+	g_assert_cmpint (avahi_entry_group_commit (group), ==, AVAHI_OK);
+	published = g_get_monotonic_time ();
+
+	/* Unresolvable services are seen on every interface, each
+	 * taking a slot, and retried behind the ones still waiting */
+	test_wait_until_seconds (has_appeared (&network, INSTANCE), RESOLVE_TIMEOUT * RESOLVE_ATTEMPTS * 3);
+	g_assert_cmpint (g_get_monotonic_time () - published, >=, (RESOLVE_TIMEOUT - 1) * G_USEC_PER_SEC);
+
+	avahi_string_list_free (txt);
+	g_strfreev (mock_txt);
+	network_teardown (&network);
+	/* Also frees the entry groups, unpublishing the services */
+	avahi_client_free (client);
+	avahi_glib_poll_free (glib_poll);
+}
+
+int main (int argc, char **argv)
+{
+	g_test_init (&argc, &argv, NULL);
+
+	g_test_add_func ("/manager/cache/confirm", test_cache_confirm);
+	g_test_add_func ("/manager/cache/retract", test_cache_retract);
+	g_test_add_func ("/manager/cache/expired", test_cache_expired);
+	g_test_add_func ("/manager/devices-changed", test_devices_changed);
+	g_test_add_func ("/manager/resolve/slots", test_resolve_slots);
+	g_test_add_func ("/manager/liveness", test_liveness);
+	g_test_add_func ("/manager/discovery-thread", test_discovery_thread);
+	g_test_add_func ("/manager/filter", test_filter);
+	g_test_add_func ("/manager/metrics/failures", test_failures_total);
+	g_test_add_func ("/manager/context", test_context);
+
+	return g_test_run ();
+}
@@ -0,0 +1,404 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+#include <glib.h>
+#include <string.h>
+#include <gio/gio.h>
+#include <libremote-display/remote-display-mdns.h>
+#include "test-util.h"
+
+#define SERVICE_TYPE "_airplay._tcp"
+#define INSTANCE     "Living Room"
+#define HOST_NAME    "receiver.local"
+#define DEVICE_ID    "deviceid=58:55:CA:1A:E2:88"
+#define N_INSTANCES  64
+#define MAX_QUERY    1472
+
+/* A stand-in responder, which only knows about one service */
+typedef struct {
+	GMainLoop *loop;
+	GSocket *socket;
+	GSource *source;
+	GSocketAddress *address;
+	GSocketAddress *querier;
+	gboolean ptr_only;             /* Make the querier ask for the other records */
+	guint n_queries;
+	guint n_known_answers;
+	guint n_truncated;
+	gssize max_query_len;
+	guint16 last_type;
+
+	guint n_found;
+	guint n_removed;
+	char *name;
+	char *host_name;
+	char *address_str;
+	guint port;
+	char **txt;
+} Responder;
+
+static GByteArray *
+build_reply (gboolean ptr,
+	     gboolean srv_txt,
+	     gboolean a,
+	     guint32  ttl)
+{
+	GByteArray *packet, *rdata;
+	guint16 type_offset, instance_offset = 0;
+	guint16 n_records = 0;
+	guint8 loopback[] = { 127, 0, 0, 1 };
+
+	packet = test_dns_new_response ();
+
+	type_offset = packet->len;
+	if (ptr) {
+		test_dns_append_name (packet, NULL, SERVICE_TYPE ".local");
+		/* The instance name, compressed against the owner name */
+		rdata = g_byte_array_new ();
+		test_dns_append_label (rdata, INSTANCE);
+		test_dns_append_uint16 (rdata, 0xc000 | type_offset);
+		instance_offset = packet->len + 10;
+		test_dns_append_record (packet, 12, ttl, rdata);
+		g_byte_array_unref (rdata);
+		n_records++;
+	}
+
+	if (srv_txt) {
+		const char *strings[] = { DEVICE_ID, "features=0x5A7FFFF7", "model=AppleTV3,2" };
+		guint i;
+
+		if (instance_offset)
+			test_dns_append_uint16 (packet, 0xc000 | instance_offset);
+		else
+			test_dns_append_name (packet, INSTANCE, SERVICE_TYPE ".local");
+		rdata = g_byte_array_new ();
+		test_dns_append_uint16 (rdata, 0);
+		test_dns_append_uint16 (rdata, 0);
+		test_dns_append_uint16 (rdata, 7000);
+		test_dns_append_name (rdata, NULL, HOST_NAME);
+		test_dns_append_record (packet, 33, ttl, rdata);
+		g_byte_array_unref (rdata);
+
+		test_dns_append_name (packet, INSTANCE, SERVICE_TYPE ".local");
+		rdata = g_byte_array_new ();
+		for (i = 0; i < G_N_ELEMENTS (strings); i++)
+			test_dns_append_label (rdata, strings[i]);
+		test_dns_append_record (packet, 16, ttl, rdata);
+		g_byte_array_unref (rdata);
+		n_records += 2;
+	}
+
+	if (a) {
+		test_dns_append_name (packet, NULL, HOST_NAME);
+		rdata = g_byte_array_new ();
+		g_byte_array_append (rdata, loopback, sizeof(loopback));
+		test_dns_append_record (packet, 1, ttl, rdata);
+		g_byte_array_unref (rdata);
+		n_records++;
+	}
+
+	packet->data[6] = n_records >> 8;
+	packet->data[7] = n_records & 0xff;
+
+	return packet;
+}
+
+/* Lots of services at once, with long names */
+static GByteArray *
+build_ptrs (guint n_instances)
+{
+	GByteArray *packet, *rdata;
+	guint16 type_offset = 0;
+	guint i;
+
+	packet = test_dns_new_response ();
+	packet->data[6] = n_instances >> 8;
+	packet->data[7] = n_instances & 0xff;
+
+	for (i = 0; i < n_instances; i++) {
+		char *instance;
+
+		if (i == 0)
+			type_offset = test_dns_append_name (packet, NULL, SERVICE_TYPE ".local");
+		else
+			test_dns_append_uint16 (packet, 0xc000 | type_offset);
+		instance = g_strdup_printf ("Receiver number %u in the Living Room", i);
+		rdata = g_byte_array_new ();
+		test_dns_append_label (rdata, instance);
+		test_dns_append_uint16 (rdata, 0xc000 | type_offset);
+		test_dns_append_record (packet, 12, 120, rdata);
+		g_byte_array_unref (rdata);
+		g_free (instance);
+	}
+
+	return packet;
+}
+
+static void
+send_reply (Responder  *responder,
+	    GByteArray *packet)
+{
+	GError *error = NULL;
+
+	g_socket_send_to (responder->socket, responder->querier,
+			  (const char *) packet->data, packet->len, NULL, &error);
+	g_assert_no_error (error);
+	g_byte_array_unref (packet);
+}
+
+static gboolean
+responder_cb (GSocket      *socket,
+	      GIOCondition  condition,
+	      gpointer      user_data)
+{
+	Responder *responder = user_data;
+	guint8 buffer[9000];
+	GSocketAddress *from;
+	gsize offset = 12;
+	gssize len;
+
+	len = g_socket_receive_from (socket, &from, (char *) buffer, sizeof(buffer), NULL, NULL);
+	g_assert_cmpint (len, >, 12);
+	g_clear_object (&responder->querier);
+	responder->querier = from;
+	responder->max_query_len = MAX (responder->max_query_len, len);
+
+	/* A query, with the first question uncompressed */
+	g_assert_cmpint (buffer[2] & 0x80, ==, 0);
+	if (buffer[2] & 0x02)
+		responder->n_truncated++;
+
+	/* The known answers that didn't fit in the last one */
+	if (((buffer[4] << 8) | buffer[5]) == 0) {
+		responder->n_known_answers += (buffer[6] << 8) | buffer[7];
+		return G_SOURCE_CONTINUE;
+	}
+	while (buffer[offset] != 0)
+		offset += buffer[offset] + 1;
+	responder->last_type = (buffer[offset + 1] << 8) | buffer[offset + 2];
+	responder->n_known_answers = (buffer[6] << 8) | buffer[7];
+	responder->n_queries++;
+
+	switch (responder->last_type) {
+	case 12:
+		/* Our only service is already known */
+		if (responder->n_known_answers > 0)
+			break;
+		if (responder->ptr_only)
+			send_reply (responder, build_reply (TRUE, FALSE, FALSE, 120));
+		else
+			send_reply (responder, build_reply (TRUE, TRUE, TRUE, 120));
+		break;
+	case 33:
+		send_reply (responder, build_reply (FALSE, TRUE, FALSE, 120));
+		break;
+	case 1:
+		send_reply (responder, build_reply (FALSE, FALSE, TRUE, 120));
+		break;
+	default:
+		g_assert_not_reached ();
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+static void
+found_cb (RemoteDisplayMdns  *mdns,
+	  const char         *name,
+	  guint               ifindex,
+	  const char         *host_name,
+	  GInetAddress       *address,
+	  guint               port,
+	  char              **txt,
+	  Responder          *responder)
+{
+	responder->n_found++;
+	responder->name = g_strdup (name);
+	responder->host_name = g_strdup (host_name);
+	responder->address_str = g_inet_address_to_string (address);
+	responder->port = port;
+	responder->txt = g_strdupv (txt);
+	g_main_loop_quit (responder->loop);
+}
+
+static void
+removed_cb (RemoteDisplayMdns *mdns,
+	    const char        *name,
+	    guint              ifindex,
+	    Responder         *responder)
+{
+	g_assert_cmpstr (name, ==, INSTANCE);
+	responder->n_removed++;
+	g_main_loop_quit (responder->loop);
+}
+
+static void
+responder_setup (Responder *responder)
+{
+	GInetAddress *loopback;
+	GSocketAddress *address;
+	GError *error = NULL;
+
+	memset (responder, 0, sizeof(*responder));
+	responder->loop = g_main_loop_new (NULL, FALSE);
+	responder->socket = g_socket_new (G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_DATAGRAM,
+					  G_SOCKET_PROTOCOL_UDP, &error);
+	g_assert_no_error (error);
+	loopback = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+	address = g_inet_socket_address_new (loopback, 0);
+	g_socket_bind (responder->socket, address, FALSE, &error);
+	g_assert_no_error (error);
+	responder->address = g_socket_get_local_address (responder->socket, &error);
+	g_assert_no_error (error);
+	g_object_unref (address);
+	g_object_unref (loopback);
+
+	responder->source = g_socket_create_source (responder->socket, G_IO_IN, NULL);
+	g_source_set_callback (responder->source, (GSourceFunc) responder_cb, responder, NULL);
+	g_source_attach (responder->source, NULL);
+}
+
+static void
+responder_teardown (Responder *responder)
+{
+	g_source_destroy (responder->source);
+	g_source_unref (responder->source);
+	g_object_unref (responder->socket);
+	g_object_unref (responder->address);
+	g_clear_object (&responder->querier);
+	g_main_loop_unref (responder->loop);
+	g_free (responder->name);
+	g_free (responder->host_name);
+	g_free (responder->address_str);
+	g_strfreev (responder->txt);
+}
+
+static RemoteDisplayMdns *
+start_querier (Responder *responder)
+{
+	RemoteDisplayMdns *mdns;
+	GError *error = NULL;
+
+	mdns = remote_display_mdns_new (SERVICE_TYPE);
+	remote_display_mdns_set_target (mdns, G_INET_SOCKET_ADDRESS (responder->address));
+	g_signal_connect (mdns, "found", G_CALLBACK (found_cb), responder);
+	g_signal_connect (mdns, "removed", G_CALLBACK (removed_cb), responder);
+	remote_display_mdns_start (mdns, &error);
+	g_assert_no_error (error);
+
+	return mdns;
+}
+
+static void
+check_found (Responder *responder)
+{
+	g_assert_cmpuint (responder->n_found, ==, 1);
+	g_assert_cmpstr (responder->name, ==, INSTANCE);
+	g_assert_cmpstr (responder->host_name, ==, HOST_NAME);
+	g_assert_cmpstr (responder->address_str, ==, "127.0.0.1");
+	g_assert_cmpuint (responder->port, ==, 7000);
+	g_assert_cmpuint (g_strv_length (responder->txt), ==, 3);
+	g_assert_cmpstr (responder->txt[0], ==, DEVICE_ID);
+}
+
+static void
+test_browse (void)
+{
+	RemoteDisplayMdns *mdns;
+	Responder responder;
+
+	responder_setup (&responder);
+	mdns = start_querier (&responder);
+
+	test_run_loop (responder.loop);
+	check_found (&responder);
+
+	/* The next query lists the service as a known answer */
+	remote_display_mdns_query (mdns);
+	test_wait_until (responder.n_queries >= 2);
+	g_assert_cmpuint (responder.last_type, ==, 12);
+	g_assert_cmpuint (responder.n_known_answers, ==, 1);
+
+	/* Goodbye */
+	send_reply (&responder, build_reply (TRUE, FALSE, FALSE, 0));
+	test_run_loop (responder.loop);
+	g_assert_cmpuint (responder.n_removed, ==, 1);
+	g_assert_cmpuint (responder.n_found, ==, 1);
+
+	g_object_unref (mdns);
+	responder_teardown (&responder);
+}
+
+/* Known answers are split at the MTU, with the truncated
+ * bit telling responders that more are coming */
+static void
+test_known_answers (void)
+{
+	RemoteDisplayMdns *mdns;
+	Responder responder;
+
+	responder_setup (&responder);
+	mdns = start_querier (&responder);
+	test_run_loop (responder.loop);
+
+	send_reply (&responder, build_ptrs (N_INSTANCES));
+	/* The new services are resolved as soon as they're in */
+	test_wait_until (responder.last_type == 33);
+
+	responder.n_truncated = 0;
+	responder.max_query_len = 0;
+	remote_display_mdns_query (mdns);
+	test_wait_until (responder.n_known_answers == N_INSTANCES + 1);
+	g_assert_cmpuint (responder.n_truncated, >, 0);
+	g_assert_cmpint (responder.max_query_len, <=, MAX_QUERY);
+
+	g_object_unref (mdns);
+	responder_teardown (&responder);
+}
+
+static void
+test_resolve (void)
+{
+	RemoteDisplayMdns *mdns;
+	Responder responder;
+
+	responder_setup (&responder);
+	responder.ptr_only = TRUE;
+	mdns = start_querier (&responder);
+
+	/* The PTR query, then SRV and TXT, and the address last */
+	test_run_loop (responder.loop);
+	check_found (&responder);
+	g_assert_cmpuint (responder.n_queries, ==, 3);
+	g_assert_cmpuint (responder.last_type, ==, 1);
+
+	g_object_unref (mdns);
+	responder_teardown (&responder);
+}
+
+int main (int argc, char **argv)
+{
+	g_test_init (&argc, &argv, NULL);
+
+	g_test_add_func ("/mdns/browse", test_browse);
+	g_test_add_func ("/mdns/resolve", test_resolve);
+	g_test_add_func ("/mdns/known-answers", test_known_answers);
+
+	return g_test_run ();
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include "config.h"
+#include <glib.h>
+#include <gio/gio.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <ifaddrs.h>
+#include <libremote-display/remote-display-netif.h>
+
+static void
+test_shared (void)
+{
+	RemoteDisplayNetif *netif, *other;
+
+	netif = remote_display_netif_get ();
+	other = remote_display_netif_get ();
+	g_assert (netif == other);
+	g_object_unref (other);
+
+	/* A new monitor is created once the last user is gone */
+	g_object_add_weak_pointer (G_OBJECT (netif), (gpointer *) &netif);
+	g_object_unref (netif);
+	g_assert_null (netif);
+
+	netif = remote_display_netif_get ();
+	g_assert (REMOTE_DISPLAY_IS_NETIF (netif));
+	g_object_unref (netif);
+}
+
+static void
+test_loopback (void)
+{
+	RemoteDisplayNetif *netif;
+	GInetAddress *address;
+	guint ifindex;
+
+	ifindex = if_nametoindex ("lo");
+	if (ifindex == 0) {
+		g_test_skip ("No loopback interface");
+		return;
+	}
+
+	netif = remote_display_netif_get ();
+	address = remote_display_netif_lookup (netif, ifindex, G_SOCKET_FAMILY_IPV4);
+	g_assert_nonnull (address);
+	g_assert (g_inet_address_get_is_loopback (address));
+	g_object_unref (address);
+
+	/* Unknown interfaces don't have addresses */
+	g_assert_null (remote_display_netif_lookup (netif, 0, G_SOCKET_FAMILY_IPV4));
+	g_assert_null (remote_display_netif_lookup (netif, G_MAXUINT16, G_SOCKET_FAMILY_IPV4));
+	g_object_unref (netif);
+}
+
+/* Anything in 127.0.0.0/8 is on the loopback interface */
+static void
+test_subnet (void)
+{
+	RemoteDisplayNetif *netif;
+	GInetAddress *address;
+	guint ifindex;
+
+	ifindex = if_nametoindex ("lo");
+	if (ifindex == 0) {
+		g_test_skip ("No loopback interface");
+		return;
+	}
+
+	netif = remote_display_netif_get ();
+	address = g_inet_address_new_from_string ("127.1.2.3");
+	g_assert_cmpuint (remote_display_netif_find_subnet (netif, address), ==, ifindex);
+	g_object_unref (address);
+
+	/* Multicast addresses aren't on any subnet */
+	address = g_inet_address_new_from_string ("224.0.0.251");
+	g_assert_cmpuint (remote_display_netif_find_subnet (netif, address), ==, 0);
+	g_object_unref (address);
+	g_object_unref (netif);
+}
+
+/* Every interface with an IPv4 address has one in the cache,
+ * whether it came from netlink or getifaddrs */
+static void
+test_addresses (void)
+{
+	RemoteDisplayNetif *netif;
+	struct ifaddrs *ifaddr, *ifa;
+
+	g_assert_cmpint (getifaddrs (&ifaddr), ==, 0);
+	netif = remote_display_netif_get ();
+
+	for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
+		GInetAddress *address;
+		guint ifindex;
+
+		if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_INET)
+			continue;
+		ifindex = if_nametoindex (ifa->ifa_name);
+		if (ifindex == 0)
+			continue;
+
+		address = remote_display_netif_lookup (netif, ifindex, G_SOCKET_FAMILY_IPV4);
+		g_assert_nonnull (address);
+		g_assert_cmpint (g_inet_address_get_family (address), ==, G_SOCKET_FAMILY_IPV4);
+		g_object_unref (address);
+	}
+
+	g_object_unref (netif);
+	freeifaddrs (ifaddr);
+}
+
+int main (int argc, char **argv)
+{
+	g_test_init (&argc, &argv, NULL);
+
+	g_test_add_func ("/netif/shared", test_shared);
+	g_test_add_func ("/netif/loopback", test_loopback);
+	g_test_add_func ("/netif/addresses", test_addresses);
+	g_test_add_func ("/netif/subnet", test_subnet);
+
+	return g_test_run ();
+}
@@ -4,13 +4,65 @@
 #include <glib/gi18n.h>
 #include <glib.h>
 #include <stdlib.h>
+#include <math.h>
 #include <gio/gio.h>
 #include <libremote-display/remote-display.h>
 #include <libremote-display/remote-display-private.h>
+#include <libremote-display/remote-display-mock-airplay.h>
+#include "test-util.h"
+
+#define BENCHMARK_STEP_TIMEOUT 20            /* seconds */
+#define BENCHMARK_SEEK_TARGET  10000.0       /* ms */
 
 static GMainLoop *loop = NULL;
 static GList *files = NULL;
 static char *target_device = NULL;
+static gboolean mirror_screen = FALSE;
+static RemoteDisplayMirror *screen_mirror = NULL;
+static gboolean play_tone = FALSE;
+static RemoteDisplayAudioStream *tone_stream = NULL;
+static guint64 tone_position = 0;
+
+typedef enum {
+	METRIC_DISCOVERY,
+	METRIC_FIRST_BYTE,
+	METRIC_PLAYING,
+	METRIC_SEEK,
+	NUM_METRICS
+} BenchmarkMetric;
+
+static const char *metric_names[NUM_METRICS] = {
+	"discovery_ms",
+	"first_byte_ms",
+	"playing_ms",
+	"seek_playing_ms"
+};
+
+typedef enum {
+	STEP_DISCOVERY,
+	STEP_PLAY,
+	STEP_SEEK,
+	STEP_STOP
+} BenchmarkStep;
+
+/* One discovery, play, seek and stop cycle at a time */
+typedef struct {
+	guint cycles;
+	guint cycle;
+	guint failures;
+	char *uri;
+	RemoteDisplayMockAirplay *mock;
+	RemoteDisplayManager *manager;
+	RemoteDisplayDevice *device;
+	BenchmarkStep step;
+	gint64 start;
+	gboolean served;
+	gboolean seek_state_changed;
+	guint timeout_id;
+	GArray *samples[NUM_METRICS];
+} Benchmark;
+
+static Benchmark *benchmark = NULL;
 
 static const gchar *
 get_type_name (GType class_type, int type)
@@ -38,16 +90,119 @@ device_state_changed_cb (RemoteDisplayDevice      *device,
 	g_message ("state changed to %s (%d)", state_s, state);
 }
 
+static void
+mirror_frame_sent_cb (RemoteDisplayMirror *mirror,
+		      guint64              frame_number,
+		      gint64               latency,
+		      gpointer             user_data)
+{
+	g_print ("Frame %" G_GUINT64_FORMAT " sent, latency %" G_GINT64_FORMAT " µs, %" G_GUINT64_FORMAT " dropped\n",
+		 frame_number, latency, remote_display_mirror_get_frames_dropped (mirror));
+}
+
+static void
+mirror_stopped_cb (RemoteDisplayMirror *mirror,
+		   GError              *error,
+		   gpointer             user_data)
+{
+	g_print ("Mirroring stopped: %s\n", error ? error->message : "no error");
+	g_main_loop_quit (loop);
+}
+
+static void
+start_mirroring (RemoteDisplayDevice *device)
+{
+	RemoteDisplayFrameSource *source;
+	GError *error = NULL;
+
+	source = remote_display_test_source_new (1280, 720, 30);
+	screen_mirror = remote_display_mirror_new (device, source);
+	g_object_unref (source);
+
+	g_signal_connect (G_OBJECT (screen_mirror), "frame-sent",
+			  G_CALLBACK (mirror_frame_sent_cb), NULL);
+	g_signal_connect (G_OBJECT (screen_mirror), "stopped",
+			  G_CALLBACK (mirror_stopped_cb), NULL);
+	if (!remote_display_mirror_start (screen_mirror, &error)) {
+		g_print ("Failed to start mirroring: %s\n", error->message);
+		g_error_free (error);
+		g_main_loop_quit (loop);
+	}
+}
+
+static gboolean
+write_tone_cb (gpointer user_data)
+{
+	gint16 samples[4410 * 2];
+	guint i;
+
+	/* Stay half a second ahead */
+	while (remote_display_audio_stream_get_delay (tone_stream) < G_USEC_PER_SEC / 2) {
+		gsize written;
+
+		for (i = 0; i < G_N_ELEMENTS (samples) / 2; i++) {
+			gint16 value = sin (2 * G_PI * 440 * (tone_position + i) / 44100.0) * 8000;
+			samples[i * 2] = samples[i * 2 + 1] = value;
+		}
+		written = remote_display_audio_stream_write (tone_stream, samples, G_N_ELEMENTS (samples) / 2);
+		tone_position += written;
+		if (written < G_N_ELEMENTS (samples) / 2)
+			break;
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+static void
+tone_stopped_cb (RemoteDisplayAudioStream *stream,
+		 GError                   *error,
+		 gpointer                  user_data)
+{
+	g_print ("Audio streaming stopped: %s\n", error ? error->message : "no error");
+	g_main_loop_quit (loop);
+}
+
+static void
+start_tone (RemoteDisplayDevice *device)
+{
+	GError *error = NULL;
+
+	tone_stream = remote_display_audio_stream_new (device);
+	g_signal_connect (G_OBJECT (tone_stream), "stopped",
+			  G_CALLBACK (tone_stopped_cb), NULL);
+	if (!remote_display_audio_stream_start (tone_stream, &error)) {
+		g_print ("Failed to start audio streaming: %s\n", error->message);
+		g_error_free (error);
+		g_main_loop_quit (loop);
+		return;
+	}
+	g_timeout_add (20, write_tone_cb, NULL);
+}
+
 static void
 device_appeared_cb (RemoteDisplayManager *manager,
 		    RemoteDisplayDevice  *device,
 		    gpointer              user_data)
 {
 	if (target_device != NULL) {
+		RemoteDisplayDeviceCapabilities caps;
 		char *name;
 
+		/* Different kinds of devices can share a name */
 		g_object_get (G_OBJECT (device), "name", &name, NULL);
-		if (g_strcmp0 (name, target_device) == 0) {
+		caps = remote_display_device_get_capabilities (device);
+		if (g_strcmp0 (name, target_device) == 0 && mirror_screen) {
+			if (caps & REMOTE_DISPLAY_DEVICE_CAPABILITIES_SCREEN) {
+				g_print ("Device '%s' appeared, will start mirroring\n", name);
+				start_mirroring (device);
+			}
+		} else if (g_strcmp0 (name, target_device) == 0 && play_tone) {
+			if ((caps & REMOTE_DISPLAY_DEVICE_CAPABILITIES_AUDIO) && tone_stream == NULL) {
+				g_print ("Device '%s' appeared, will start playing a tone\n", name);
+				start_tone (device);
+			}
+		} else if (g_strcmp0 (name, target_device) == 0 &&
+			   (caps & REMOTE_DISPLAY_DEVICE_CAPABILITIES_VIDEO)) {
 			g_print ("Device '%s' appeared, will start playing", name);
 			g_signal_connect (G_OBJECT (device), "state-changed",
 					  G_CALLBACK (device_state_changed_cb), NULL);
@@ -75,6 +230,336 @@ device_disappeared_cb (RemoteDisplayManager *manager,
 	g_free (name);
 }
 
+static void
+benchmark_add_sample (BenchmarkMetric metric)
+{
+	gdouble ms;
+
+	ms = (g_get_monotonic_time () - benchmark->start) / 1000.0;
+	g_array_append_val (benchmark->samples[metric], ms);
+}
+
+static void
+print_number (const char *name,
+	      gdouble     value,
+	      gboolean    last)
+{
+	char buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+	/* Not localised, it's meant to be parsed */
+	g_print ("      \"%s\": %s%s\n", name,
+		 g_ascii_formatd (buf, sizeof (buf), "%.3f", value),
+		 last ? "" : ",");
+}
+
+static void
+benchmark_print_report (void)
+{
+	guint i, j;
+
+	g_print ("{\n");
+	g_print ("  \"cycles\": %u,\n", benchmark->cycles);
+	g_print ("  \"failures\": %u,\n", benchmark->failures);
+	g_print ("  \"metrics\": {\n");
+	for (i = 0; i < NUM_METRICS; i++) {
+		GArray *samples = benchmark->samples[i];
+		gdouble sum = 0.0, min = G_MAXDOUBLE, max = 0.0;
+
+		g_print ("    \"%s\": {\n", metric_names[i]);
+		g_print ("      \"samples\": %u%s\n", samples->len, samples->len ? "," : "");
+		if (samples->len > 0) {
+			for (j = 0; j < samples->len; j++) {
+				gdouble sample = g_array_index (samples, gdouble, j);
+
+				sum += sample;
+				min = MIN (min, sample);
+				max = MAX (max, sample);
+			}
+			print_number ("min", min, FALSE);
+			print_number ("mean", sum / samples->len, FALSE);
+			print_number ("p50", test_percentile (samples, 50), FALSE);
+			print_number ("p90", test_percentile (samples, 90), FALSE);
+			print_number ("p99", test_percentile (samples, 99), FALSE);
+			print_number ("max", max, TRUE);
+		}
+		g_print ("    }%s\n", i < NUM_METRICS - 1 ? "," : "");
+	}
+	g_print ("  }\n");
+	g_print ("}\n");
+}
+
+static void benchmark_next_cycle (void);
+static void benchmark_seek (void);
+
+static gboolean
+benchmark_timeout_cb (gpointer user_data)
+{
+	g_printerr ("Cycle %u timed out at step %d\n", benchmark->cycle, benchmark->step);
+	benchmark->timeout_id = 0;
+	benchmark->failures++;
+	benchmark_next_cycle ();
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+benchmark_set_step (BenchmarkStep step)
+{
+	benchmark->step = step;
+	benchmark->start = g_get_monotonic_time ();
+	if (benchmark->timeout_id)
+		g_source_remove (benchmark->timeout_id);
+	benchmark->timeout_id = g_timeout_add_seconds (BENCHMARK_STEP_TIMEOUT, benchmark_timeout_cb, NULL);
+}
+
+static void
+benchmark_fail (const char *what,
+		GError     *error)
+{
+	g_printerr ("Cycle %u: %s failed: %s\n", benchmark->cycle, what, error->message);
+	g_error_free (error);
+	benchmark->failures++;
+	benchmark_next_cycle ();
+}
+
+static void
+benchmark_stop_cb (GObject      *source_object,
+		   GAsyncResult *result,
+		   gpointer      user_data)
+{
+	GError *error = NULL;
+
+	/* Late, that cycle was abandoned */
+	if (REMOTE_DISPLAY_DEVICE (source_object) != benchmark->device)
+		return;
+
+	if (!remote_display_device_stop_finish (benchmark->device, result, &error)) {
+		benchmark_fail ("stop", error);
+		return;
+	}
+	benchmark_next_cycle ();
+}
+
+static void
+benchmark_seek_done (void)
+{
+	benchmark_add_sample (METRIC_SEEK);
+	benchmark_set_step (STEP_STOP);
+	remote_display_device_stop_async (benchmark->device, NULL, benchmark_stop_cb, NULL);
+}
+
+static void
+benchmark_seek_cb (GObject      *source_object,
+		   GAsyncResult *result,
+		   gpointer      user_data)
+{
+	GError *error = NULL;
+
+	if (REMOTE_DISPLAY_DEVICE (source_object) != benchmark->device)
+		return;
+
+	if (!remote_display_device_seek_finish (benchmark->device, result, &error)) {
+		benchmark_fail ("seek", error);
+		return;
+	}
+
+	/* Some receivers don't buffer again after seeking */
+	if (benchmark->step == STEP_SEEK && !benchmark->seek_state_changed)
+		benchmark_seek_done ();
+}
+
+static void
+benchmark_seek (void)
+{
+	benchmark_set_step (STEP_SEEK);
+	benchmark->seek_state_changed = FALSE;
+	remote_display_device_seek_async (benchmark->device, BENCHMARK_SEEK_TARGET,
+					  NULL, benchmark_seek_cb, NULL);
+}
+
+static void
+benchmark_state_changed_cb (RemoteDisplayDevice      *device,
+			    RemoteDisplayDeviceState  state,
+			    gpointer                  user_data)
+{
+	if (benchmark->step == STEP_PLAY && state == REMOTE_DISPLAY_DEVICE_STATE_PLAYING) {
+		benchmark_add_sample (METRIC_PLAYING);
+		benchmark_seek ();
+	} else if (benchmark->step == STEP_SEEK) {
+		if (state == REMOTE_DISPLAY_DEVICE_STATE_PLAYING && benchmark->seek_state_changed)
+			benchmark_seek_done ();
+		else if (state != REMOTE_DISPLAY_DEVICE_STATE_PLAYING)
+			benchmark->seek_state_changed = TRUE;
+	}
+}
+
+static void
+benchmark_media_served_cb (RemoteDisplayDevice *device,
+			   const char          *uri,
+			   gpointer             user_data)
+{
+	if (benchmark->step != STEP_PLAY || benchmark->served)
+		return;
+	benchmark->served = TRUE;
+	benchmark_add_sample (METRIC_FIRST_BYTE);
+}
+
+static void
+benchmark_play_cb (GObject      *source_object,
+		   GAsyncResult *result,
+		   gpointer      user_data)
+{
+	GError *error = NULL;
+
+	if (REMOTE_DISPLAY_DEVICE (source_object) != benchmark->device)
+		return;
+
+	if (!remote_display_device_open_and_play_finish (benchmark->device, result, &error))
+		benchmark_fail ("play", error);
+}
+
+static void
+benchmark_play (RemoteDisplayDevice *device)
+{
+	benchmark->device = g_object_ref (device);
+	g_signal_connect (G_OBJECT (device), "state-changed",
+			  G_CALLBACK (benchmark_state_changed_cb), NULL);
+	g_signal_connect (G_OBJECT (device), "media-served",
+			  G_CALLBACK (benchmark_media_served_cb), NULL);
+
+	benchmark_set_step (STEP_PLAY);
+	benchmark->served = FALSE;
+	remote_display_device_open_and_play_async (device, benchmark->uri, 0, NULL,
+						   benchmark_play_cb, NULL);
+}
+
+static void
+benchmark_provisional_cb (RemoteDisplayDevice *device,
+			  GParamSpec          *pspec,
+			  gpointer             user_data)
+{
+	gboolean provisional;
+
+	g_object_get (G_OBJECT (device), "provisional", &provisional, NULL);
+	if (provisional || benchmark->step != STEP_DISCOVERY || benchmark->device)
+		return;
+	g_signal_handlers_disconnect_by_func (device, benchmark_provisional_cb, NULL);
+	benchmark_add_sample (METRIC_DISCOVERY);
+	benchmark_play (device);
+}
+
+static void
+benchmark_device_appeared_cb (RemoteDisplayManager *manager,
+			      RemoteDisplayDevice  *device,
+			      gpointer              user_data)
+{
+	char *name;
+
+	if (benchmark->step != STEP_DISCOVERY || benchmark->device)
+		return;
+
+	g_object_get (G_OBJECT (device), "name", &name, NULL);
+	if (g_strcmp0 (name, target_device) == 0 &&
+	    (remote_display_device_get_capabilities (device) & REMOTE_DISPLAY_DEVICE_CAPABILITIES_VIDEO)) {
+		/* Cached devices don't count, they haven't been discovered */
+		g_signal_connect (G_OBJECT (device), "notify::provisional",
+				  G_CALLBACK (benchmark_provisional_cb), NULL);
+		benchmark_provisional_cb (device, NULL, NULL);
+	}
+	g_free (name);
+}
+
+static void
+benchmark_clear_cycle (void)
+{
+	if (benchmark->device) {
+		g_signal_handlers_disconnect_by_func (benchmark->device, benchmark_state_changed_cb, NULL);
+		g_signal_handlers_disconnect_by_func (benchmark->device, benchmark_media_served_cb, NULL);
+		g_signal_handlers_disconnect_by_func (benchmark->device, benchmark_provisional_cb, NULL);
+		g_clear_object (&benchmark->device);
+	}
+	g_clear_object (&benchmark->manager);
+}
+
+static void
+benchmark_next_cycle (void)
+{
+	RemoteDisplayDevice *device;
+
+	benchmark_clear_cycle ();
+
+	if (benchmark->cycle == benchmark->cycles) {
+		if (benchmark->timeout_id) {
+			g_source_remove (benchmark->timeout_id);
+			benchmark->timeout_id = 0;
+		}
+		g_main_loop_quit (loop);
+		return;
+	}
+	benchmark->cycle++;
+
+	benchmark_set_step (STEP_DISCOVERY);
+	if (benchmark->mock) {
+		/* Nothing to discover */
+		device = remote_display_mock_airplay_new_device (benchmark->mock, "Mock Receiver");
+		benchmark_play (device);
+		g_object_unref (device);
+		return;
+	}
+
+	/* A new manager each time, so that discovery starts over */
+	benchmark->manager = g_object_new (REMOTE_DISPLAY_TYPE_MANAGER, NULL);
+	remote_display_manager_set_filter (benchmark->manager, REMOTE_DISPLAY_DEVICE_CAPABILITIES_VIDEO,
+					   target_device);
+	g_signal_connect (G_OBJECT (benchmark->manager), "device-appeared",
+			  G_CALLBACK (benchmark_device_appeared_cb), NULL);
+}
+
+static gboolean
+benchmark_start (guint    cycles,
+		 gboolean use_mock,
+		 guint    mock_latency)
+{
+	GError *error = NULL;
+	GFile *file;
+	guint i;
+
+	benchmark = g_new0 (Benchmark, 1);
+	benchmark->cycles = cycles;
+	/* Local files get served, and timed */
+	file = g_file_new_for_commandline_arg (files->data);
+	benchmark->uri = g_file_get_uri (file);
+	g_object_unref (file);
+	for (i = 0; i < NUM_METRICS; i++)
+		benchmark->samples[i] = g_array_new (FALSE, FALSE, sizeof (gdouble));
+
+	if (use_mock) {
+		benchmark->mock = remote_display_mock_airplay_new ("58:55:CA:1A:E2:88");
+		remote_display_mock_airplay_set_latency (benchmark->mock, mock_latency);
+		if (!remote_display_mock_airplay_start (benchmark->mock, &error)) {
+			g_print ("Failed to start the mock receiver: %s\n", error->message);
+			g_error_free (error);
+			return FALSE;
+		}
+	}
+
+	benchmark_next_cycle ();
+	return TRUE;
+}
+
+static void
+benchmark_free (void)
+{
+	guint i;
+
+	benchmark_clear_cycle ();
+	g_clear_object (&benchmark->mock);
+	g_free (benchmark->uri);
+	for (i = 0; i < NUM_METRICS; i++)
+		g_array_unref (benchmark->samples[i]);
+	g_clear_pointer (&benchmark, g_free);
+}
+
 static void
 show_help (GOptionContext *context)
 {
@@ -97,12 +582,28 @@ int main (int argc, char **argv)
 	GError *error = NULL;
 	GOptionContext *context;
 	gboolean list_devices = FALSE;
+	gboolean list_cached = FALSE;
 	gboolean monitor_devices = FALSE;
+	gboolean discovery_thread = FALSE;
+	gboolean use_service = FALSE;
+	int benchmark_cycles = 0;
+	gboolean use_mock = FALSE;
+	int mock_latency = 0;
+	int metrics_port = -1;
 	char **params = NULL;
 	const GOptionEntry entries[] = {
 		{ "list-devices", 'l', 0, G_OPTION_ARG_NONE, &list_devices, "List devices on the network", NULL },
+		{ "cached", 0, 0, G_OPTION_ARG_NONE, &list_cached, "Only list cached devices, without waiting", NULL },
 		{ "monitor-devices", 'm', 0, G_OPTION_ARG_NONE, &monitor_devices, "Monitor devices on the network", NULL },
+		{ "discovery-thread", 0, 0, G_OPTION_ARG_NONE, &discovery_thread, "Discover devices in a separate thread", NULL },
+		{ "service", 0, 0, G_OPTION_ARG_NONE, &use_service, "Get devices from remote-display-daemon", NULL },
 		{ "device", 'd', 0, G_OPTION_ARG_STRING, &target_device, NULL },
+		{ "mirror", 0, 0, G_OPTION_ARG_NONE, &mirror_screen, "Mirror a test pattern to the device", NULL },
+		{ "tone", 0, 0, G_OPTION_ARG_NONE, &play_tone, "Play a tone on the device", NULL },
+		{ "benchmark", 0, 0, G_OPTION_ARG_INT, &benchmark_cycles, "Time discovery, play, seek and stop cycles, and print a JSON report", "CYCLES" },
+		{ "mock", 0, 0, G_OPTION_ARG_NONE, &use_mock, "Benchmark against a local mock AirPlay receiver", NULL },
+		{ "mock-latency", 0, 0, G_OPTION_ARG_INT, &mock_latency, "Delay the mock receiver's replies", "MS" },
+		{ "metrics-port", 0, 0, G_OPTION_ARG_INT, &metrics_port, "Serve metrics for Prometheus on a local port, 0 for any", "PORT" },
 		{ G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_STRING_ARRAY, &params, NULL, "[FILENAMES...]" },
 		{ NULL }
 	};
@@ -119,35 +620,82 @@ int main (int argc, char **argv)
 		return 1;
 	}
 
+	if (params) {
+		guint i;
+		for (i = 0; params[i]; i++)
+			files = g_list_prepend (files, params[i]);
+		files = g_list_reverse (files);
+	}
+
+	if (benchmark_cycles > 0) {
+		if (!files || (!target_device && !use_mock)) {
+			show_help (context);
+			return 1;
+		}
+
+		loop = g_main_loop_new (NULL, FALSE);
+		if (benchmark_start (benchmark_cycles, use_mock, MAX (mock_latency, 0)))
+			g_main_loop_run (loop);
+		if (benchmark->cycle > 0)
+			benchmark_print_report ();
+		benchmark_free ();
+		return 0;
+	}
+
 	//FIXME Do a better job at verifying options
 	if (!list_devices &&
 	    !monitor_devices &&
-	    (!target_device || !params)) {
+	    (!target_device || (!params && !mirror_screen && !play_tone))) {
 		show_help (context);
 		return 1;
 	}
 
-	manager = remote_display_manager_new ();
+	manager = g_object_new (REMOTE_DISPLAY_TYPE_MANAGER,
+				"discovery-thread", discovery_thread,
+				"use-service", use_service,
+				NULL);
 	g_signal_connect (G_OBJECT (manager), "device-appeared",
 			  G_CALLBACK (device_appeared_cb), NULL);
 	g_signal_connect (G_OBJECT (manager), "device-disappeared",
 			  G_CALLBACK (device_disappeared_cb), NULL);
+	if (target_device) {
+		const char *favourites[] = { target_device, NULL };
+		remote_display_manager_set_favourites (manager, favourites);
+	}
+	if (mirror_screen)
+		remote_display_manager_set_filter (manager, REMOTE_DISPLAY_DEVICE_CAPABILITIES_SCREEN, NULL);
+	else if (play_tone)
+		remote_display_manager_set_filter (manager, REMOTE_DISPLAY_DEVICE_CAPABILITIES_AUDIO, NULL);
+	if (metrics_port >= 0) {
+		char *uri;
+
+		uri = remote_display_manager_serve_metrics (manager, metrics_port, &error);
+		if (!uri) {
+			g_print ("Failed to serve metrics: %s\n", error->message);
+			g_error_free (error);
+			return 1;
+		}
+		g_print ("Serving metrics on %s\n", uri);
+		g_free (uri);
+	}
 
-	if (list_devices)
+	/* Cached devices are announced from an idle */
+	if (list_devices && list_cached)
+		g_idle_add_full (G_PRIORITY_LOW, stop_scanning_cb, NULL, NULL);
+	else if (list_devices)
 		g_timeout_add_seconds (1, stop_scanning_cb, NULL);
 	else if (monitor_devices)
 		;
-	else if (target_device && params) {
-		guint i;
-		for (i = 0; params[i]; i++)
-			files = g_list_prepend (files, params[i]);
-		files = g_list_reverse (files);
+	else if (target_device && (mirror_screen || play_tone))
+		g_print ("Waiting for device to appear\n");
+	else if (target_device && params)
 		g_print ("Waiting for device to appear\n");
-	}
 
 	loop = g_main_loop_new (NULL, FALSE);
 	g_main_loop_run (loop);
 
+	g_clear_object (&screen_mirror);
+	g_clear_object (&tone_stream);
 	g_object_unref (manager);
 
 	return 0;
@@ -0,0 +1,271 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <unistd.h>
+#include <gio/gio.h>
+#include <libremote-display/remote-display.h>
+#include <libremote-display/remote-display-device-private.h>
+#include <libremote-display/remote-display-device-proxy.h>
+#include <libremote-display/remote-display-mock-airplay.h>
+#include <libremote-display/remote-display-service.h>
+#include "test-util.h"
+
+#define AIRPLAY_SERVICE "_airplay._tcp"
+#define DEVICE_ID       "58:55:CA:1A:E2:88"
+#define INSTANCE        "Living Room"
+#define MEDIA_SIZE      (256 * 1024)
+
+/* The service, on a private bus, with the receiver it found,
+ * and a manager using it as a client */
+typedef struct {
+	GTestDBus *bus;
+	TestResponder *responder;
+	RemoteDisplayMockAirplay *mock;
+	char *cache_path;
+	char *path;
+	char *uri;
+
+	RemoteDisplayManager *manager;
+	RemoteDisplayService *service;
+	GDBusConnection *connection;
+	guint owner_id;
+	gboolean name_acquired;
+
+	RemoteDisplayManager *client;
+	RemoteDisplayDevice *device;
+	RemoteDisplayDeviceState state;
+
+	gboolean done;
+	GError *error;
+} Session;
+
+static gboolean
+is_provisional (RemoteDisplayDevice *device)
+{
+	gboolean provisional;
+
+	g_object_get (G_OBJECT (device), "provisional", &provisional, NULL);
+	return provisional;
+}
+
+static void
+name_acquired_cb (GDBusConnection *connection,
+		  const char      *name,
+		  gpointer         user_data)
+{
+	Session *session = user_data;
+
+	session->name_acquired = TRUE;
+}
+
+static void
+state_changed_cb (RemoteDisplayDevice      *device,
+		  RemoteDisplayDeviceState  state,
+		  Session                  *session)
+{
+	session->state = state;
+}
+
+static void
+session_setup (Session *session)
+{
+	GError *error = NULL;
+	RemoteDisplayDevice *device;
+	char *target, *data, **txt;
+	int fd;
+
+	session->bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+	g_test_dbus_up (session->bus);
+
+	session->responder = test_responder_new ();
+	target = test_responder_get_target (session->responder);
+	g_setenv ("REMOTE_DISPLAY_MDNS", "native", TRUE);
+	g_setenv ("REMOTE_DISPLAY_MDNS_TARGET", target, TRUE);
+	g_free (target);
+
+	fd = g_file_open_tmp ("test-service-XXXXXX.ini", &session->cache_path, &error);
+	g_assert_no_error (error);
+	close (fd);
+	g_unlink (session->cache_path);
+	g_setenv ("REMOTE_DISPLAY_CACHE", session->cache_path, TRUE);
+
+	/* Something for the receiver to fetch from the service's host */
+	fd = g_file_open_tmp ("test-service-XXXXXX.mp4", &session->path, &error);
+	g_assert_no_error (error);
+	close (fd);
+	data = g_malloc0 (MEDIA_SIZE);
+	g_file_set_contents (session->path, data, MEDIA_SIZE, &error);
+	g_assert_no_error (error);
+	g_free (data);
+	session->uri = g_filename_to_uri (session->path, NULL, &error);
+	g_assert_no_error (error);
+
+	session->mock = remote_display_mock_airplay_new (DEVICE_ID);
+	remote_display_mock_airplay_start (session->mock, &error);
+	g_assert_no_error (error);
+	txt = remote_display_mock_airplay_get_txt (session->mock);
+	test_responder_add (session->responder, AIRPLAY_SERVICE, INSTANCE,
+			    remote_display_mock_airplay_get_port (session->mock), txt);
+	g_strfreev (txt);
+
+	/* The service, only exported once it has the receiver, so
+	 * that the client gets it through GetDevices */
+	session->manager = remote_display_manager_new ();
+	test_wait_until ((device = remote_display_manager_lookup_by_id (session->manager, DEVICE_ID)) &&
+			 !is_provisional (device));
+
+	session->service = remote_display_service_new (session->manager);
+	session->connection = g_dbus_connection_new_for_address_sync (g_test_dbus_get_bus_address (session->bus),
+								      G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+								      G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+								      NULL, NULL, &error);
+	g_assert_no_error (error);
+	remote_display_service_export (session->service, session->connection, &error);
+	g_assert_no_error (error);
+	session->owner_id = g_bus_own_name_on_connection (session->connection,
+							  REMOTE_DISPLAY_DBUS_NAME,
+							  G_BUS_NAME_OWNER_FLAGS_NONE,
+							  name_acquired_cb, NULL,
+							  session, NULL);
+	test_wait_until (session->name_acquired);
+
+	session->client = g_object_new (REMOTE_DISPLAY_TYPE_MANAGER,
+					"use-service", TRUE,
+					NULL);
+	test_wait_until (remote_display_manager_lookup_by_id (session->client, DEVICE_ID));
+	session->device = g_object_ref (remote_display_manager_lookup_by_id (session->client, DEVICE_ID));
+	g_signal_connect (session->device, "state-changed",
+			  G_CALLBACK (state_changed_cb), session);
+}
+
+static void
+session_teardown (Session *session)
+{
+	g_clear_object (&session->device);
+	g_clear_object (&session->client);
+
+	g_bus_unown_name (session->owner_id);
+	remote_display_service_unexport (session->service);
+	g_clear_object (&session->service);
+	g_dbus_connection_close_sync (session->connection, NULL, NULL);
+	g_clear_object (&session->connection);
+	g_clear_object (&session->manager);
+
+	g_clear_object (&session->mock);
+	test_responder_free (session->responder);
+	g_unlink (session->cache_path);
+	g_free (session->cache_path);
+	g_unlink (session->path);
+	g_free (session->path);
+	g_free (session->uri);
+
+	g_test_dbus_down (session->bus);
+	g_object_unref (session->bus);
+}
+
+static void
+command_cb (GObject      *source_object,
+	    GAsyncResult *result,
+	    gpointer      user_data)
+{
+	Session *session = user_data;
+	RemoteDisplayDevice *device = REMOTE_DISPLAY_DEVICE (source_object);
+	gpointer tag;
+
+	tag = g_task_get_source_tag (G_TASK (result));
+	if (tag == remote_display_device_open_and_play_async)
+		remote_display_device_open_and_play_finish (device, result, &session->error);
+	else if (tag == remote_display_device_pause_async)
+		remote_display_device_pause_finish (device, result, &session->error);
+	else
+		g_assert_not_reached ();
+	session->done = TRUE;
+}
+
+static void
+wait_for_command (Session *session)
+{
+	test_wait_until (session->done);
+	session->done = FALSE;
+}
+
+/* The client mirrors the service's devices and their changes */
+static void
+test_devices (void)
+{
+	Session session = { 0, };
+	RemoteDisplayDevice *device;
+
+	session_setup (&session);
+
+	g_assert_true (REMOTE_DISPLAY_IS_DEVICE_PROXY (session.device));
+	g_assert_cmpstr (remote_display_device_get_name (session.device), ==, INSTANCE);
+	g_assert_cmpuint (remote_display_device_get_capabilities (session.device), ==,
+			  REMOTE_DISPLAY_DEVICE_CAPABILITIES_VIDEO);
+	g_assert_false (is_provisional (session.device));
+
+	device = remote_display_manager_lookup_by_id (session.manager, DEVICE_ID);
+	remote_display_device_set_provisional (device, TRUE);
+	test_wait_until (is_provisional (session.device));
+	remote_display_device_set_provisional (device, FALSE);
+	test_wait_until (!is_provisional (session.device));
+
+	test_responder_remove (session.responder, AIRPLAY_SERVICE, INSTANCE);
+	test_wait_until (remote_display_manager_lookup_by_id (session.client, DEVICE_ID) == NULL);
+
+	session_teardown (&session);
+}
+
+/* Commands go through the service, and the errors and state
+ * changes of its device come back */
+static void
+test_playback (void)
+{
+	Session session = { 0, };
+
+	session_setup (&session);
+
+	remote_display_device_open_and_play_async (session.device, session.uri, 0,
+						   NULL, command_cb, &session);
+	wait_for_command (&session);
+	g_assert_no_error (session.error);
+	test_wait_until (session.state == REMOTE_DISPLAY_DEVICE_STATE_PLAYING);
+	g_assert_cmpstr (remote_display_mock_airplay_get_state (session.mock), ==, "playing");
+
+	remote_display_mock_airplay_set_errors (session.mock, 1.0, 503);
+	remote_display_device_pause_async (session.device, NULL, command_cb, &session);
+	wait_for_command (&session);
+	g_assert_error (session.error, REMOTE_DISPLAY_ERROR, REMOTE_DISPLAY_ERROR_COMMAND_FAILED);
+	g_clear_error (&session.error);
+	g_assert_cmpuint (remote_display_device_get_command_failures (session.device), ==, 1);
+
+	session_teardown (&session);
+}
+
+int main (int argc, char **argv)
+{
+	g_test_init (&argc, &argv, NULL);
+
+	g_test_add_func ("/service/devices", test_devices);
+	g_test_add_func ("/service/playback", test_playback);
+
+	return g_test_run ();
+}
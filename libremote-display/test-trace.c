@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <gio/gio.h>
+#include <libremote-display/remote-display.h>
+#include <libremote-display/remote-display-mock-airplay.h>
+#include <libremote-display/remote-display-trace-replay.h>
+#include "test-util.h"
+
+#define DEVICE_ID  "58:55:CA:1A:E2:88"
+#define MEDIA_SIZE (64 * 1024)
+
+static char *trace_path;
+static char *media_path;
+static char *media_uri;
+
+typedef struct {
+	RemoteDisplayDeviceState state;
+	RemoteDisplayTraceReplayResults *results;
+	gboolean done;
+	GError *error;
+} Session;
+
+static void
+wait_for (gboolean *done)
+{
+	test_wait_until (*done);
+	*done = FALSE;
+}
+
+static void
+state_changed_cb (RemoteDisplayDevice      *device,
+		  RemoteDisplayDeviceState  state,
+		  Session                  *session)
+{
+	session->state = state;
+}
+
+static void
+command_cb (GObject      *source_object,
+	    GAsyncResult *result,
+	    gpointer      user_data)
+{
+	Session *session = user_data;
+
+	g_task_propagate_boolean (G_TASK (result), &session->error);
+	session->done = TRUE;
+}
+
+static void
+replay_cb (GObject      *source_object,
+	   GAsyncResult *result,
+	   gpointer      user_data)
+{
+	Session *session = user_data;
+
+	session->results = remote_display_trace_replay_finish (result, &session->error);
+	session->done = TRUE;
+}
+
+static void
+test_record_replay (void)
+{
+	RemoteDisplayMockAirplay *mock;
+	RemoteDisplayDevice *device;
+	RemoteDisplayTraceEntry *entry;
+	Session session = { 0, };
+	GError *error = NULL;
+	GPtrArray *entries;
+	guint i, requests, replies, events;
+
+	g_assert_true (remote_display_trace_is_recording ());
+
+	mock = remote_display_mock_airplay_new (DEVICE_ID);
+	remote_display_mock_airplay_start (mock, &error);
+	g_assert_no_error (error);
+	device = remote_display_mock_airplay_new_device (mock, "Mock Receiver");
+	g_signal_connect (device, "state-changed", G_CALLBACK (state_changed_cb), &session);
+
+	remote_display_device_open_and_play_async (device, media_uri, 0, NULL, command_cb, &session);
+	wait_for (&session.done);
+	g_assert_no_error (session.error);
+	test_wait_until (session.state == REMOTE_DISPLAY_DEVICE_STATE_PLAYING);
+	remote_display_device_pause_async (device, NULL, command_cb, &session);
+	wait_for (&session.done);
+	g_assert_no_error (session.error);
+	remote_display_device_stop_async (device, NULL, command_cb, &session);
+	wait_for (&session.done);
+	g_assert_no_error (session.error);
+
+	g_object_unref (device);
+	g_object_unref (mock);
+
+	entries = remote_display_trace_load (trace_path, &error);
+	g_assert_no_error (error);
+	requests = replies = events = 0;
+	for (i = 0; i < entries->len; i++) {
+		entry = g_ptr_array_index (entries, i);
+		g_assert_cmpstr (entry->device, ==, DEVICE_ID);
+		if (entry->type == REMOTE_DISPLAY_TRACE_REQUEST)
+			requests++;
+		else if (entry->type == REMOTE_DISPLAY_TRACE_REPLY)
+			replies++;
+		else
+			events++;
+	}
+	g_assert_cmpuint (requests, ==, 3);
+	g_assert_cmpuint (replies, ==, 3);
+	g_assert_cmpuint (events, >=, 2);
+	entry = g_ptr_array_index (entries, 0);
+	g_assert_cmpstr (entry->path, ==, "/play");
+	g_assert_true (strstr (entry->body, "Content-Location: http://") != NULL);
+
+	/* The recorded URI isn't served anymore */
+	remote_display_trace_replay_async (entries, NULL, media_uri, 4.0, NULL, replay_cb, &session);
+	wait_for (&session.done);
+	g_assert_no_error (session.error);
+	g_assert_cmpuint (session.results->requests, ==, 3);
+	g_assert_cmpuint (session.results->mismatches, ==, 0);
+	g_assert_cmpuint (session.results->events, ==, events);
+	g_assert_cmpuint (session.results->replayed_ms->len, ==, 3);
+
+	remote_display_trace_replay_results_free (session.results);
+	g_ptr_array_unref (entries);
+}
+
+static void
+test_replay_errors (void)
+{
+	Session session = { 0, };
+	GError *error = NULL;
+	GPtrArray *entries;
+	char *path;
+	int fd;
+
+	fd = g_file_open_tmp ("test-trace-XXXXXX.trace", &path, &error);
+	g_assert_no_error (error);
+	close (fd);
+	g_file_set_contents (path,
+			     "# remote-display trace 1\n"
+			     "0\t" DEVICE_ID "\trequest\tPOST\t/play\tStart-Position: 0.000000\\n\n"
+			     "200000\t" DEVICE_ID "\treply\t200\n"
+			     "250000\t" DEVICE_ID "\tevent\tplaying\n"
+			     "400000\t" DEVICE_ID "\trequest\tPOST\t/rate?value=0.000000\t\n"
+			     "650000\t" DEVICE_ID "\treply\t503\n",
+			     -1, &error);
+	g_assert_no_error (error);
+	entries = remote_display_trace_load (path, &error);
+	g_assert_no_error (error);
+	g_assert_cmpuint (entries->len, ==, 5);
+
+	/* The receiver answers as slowly as recorded, and refuses
+	 * the pause again */
+	remote_display_trace_replay_async (entries, DEVICE_ID, media_uri, 2.0, NULL, replay_cb, &session);
+	wait_for (&session.done);
+	g_assert_no_error (session.error);
+	g_assert_cmpuint (session.results->requests, ==, 2);
+	g_assert_cmpuint (session.results->mismatches, ==, 0);
+	g_assert_cmpuint (session.results->events, ==, 1);
+	g_assert_cmpfloat (g_array_index (session.results->recorded_ms, gdouble, 1), ==, 250.0);
+	g_assert_cmpfloat (g_array_index (session.results->replayed_ms, gdouble, 1), >=, 250.0);
+
+	remote_display_trace_replay_results_free (session.results);
+	g_ptr_array_unref (entries);
+
+	/* Truncated lines are refused */
+	g_file_set_contents (path, "0\t" DEVICE_ID "\treply\n", -1, &error);
+	g_assert_no_error (error);
+	entries = remote_display_trace_load (path, &error);
+	g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+	g_assert_null (entries);
+	g_clear_error (&error);
+
+	g_unlink (path);
+	g_free (path);
+}
+
+int main (int argc, char **argv)
+{
+	GError *error = NULL;
+	char *data;
+	int fd, ret;
+
+	/* Before anything gets recorded */
+	fd = g_file_open_tmp ("test-trace-XXXXXX.trace", &trace_path, &error);
+	g_assert_no_error (error);
+	close (fd);
+	g_setenv ("REMOTE_DISPLAY_RECORD", trace_path, TRUE);
+
+	fd = g_file_open_tmp ("test-trace-XXXXXX.mp4", &media_path, &error);
+	g_assert_no_error (error);
+	close (fd);
+	data = g_malloc0 (MEDIA_SIZE);
+	g_file_set_contents (media_path, data, MEDIA_SIZE, &error);
+	g_assert_no_error (error);
+	g_free (data);
+	media_uri = g_filename_to_uri (media_path, NULL, &error);
+	g_assert_no_error (error);
+
+	g_test_init (&argc, &argv, NULL);
+
+	g_test_add_func ("/trace/record-replay", test_record_replay);
+	g_test_add_func ("/trace/replay-errors", test_replay_errors);
+
+	ret = g_test_run ();
+
+	g_unlink (trace_path);
+	g_unlink (media_path);
+	g_free (trace_path);
+	g_free (media_path);
+	g_free (media_uri);
+
+	return ret;
+}
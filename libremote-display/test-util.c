@@ -0,0 +1,445 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+#include <string.h>
+#include "test-util.h"
+
+static gboolean
+timeout_cb (gpointer user_data)
+{
+	const char *what = user_data;
+
+	g_error ("Timed out waiting for %s", what);
+	return G_SOURCE_REMOVE;
+}
+
+guint
+test_timeout_add (const char *what)
+{
+	return test_timeout_add_seconds (what, TEST_TIMEOUT);
+}
+
+guint
+test_timeout_add_seconds (const char *what,
+			  guint       seconds)
+{
+	return g_timeout_add_seconds (seconds, timeout_cb, (gpointer) what);
+}
+
+void
+test_run_loop (GMainLoop *loop)
+{
+	guint timeout_id;
+
+	timeout_id = test_timeout_add ("the main loop to quit");
+	g_main_loop_run (loop);
+	g_source_remove (timeout_id);
+}
+
+static int
+compare_samples (gconstpointer a,
+		 gconstpointer b)
+{
+	gdouble da = *(const gdouble *) a;
+	gdouble db = *(const gdouble *) b;
+
+	return (da > db) - (da < db);
+}
+
+gdouble
+test_percentile (GArray *samples,
+		 guint   p)
+{
+	guint rank;
+
+	if (samples->len == 0)
+		return 0.0;
+	g_array_sort (samples, compare_samples);
+	rank = (p * samples->len + 99) / 100;
+	return g_array_index (samples, gdouble, MAX (rank, 1) - 1);
+}
+
+void
+test_dns_append_uint16 (GByteArray *packet,
+			guint16     value)
+{
+	guint8 data[2] = { value >> 8, value & 0xff };
+
+	g_byte_array_append (packet, data, 2);
+}
+
+void
+test_dns_append_uint32 (GByteArray *packet,
+			guint32     value)
+{
+	test_dns_append_uint16 (packet, value >> 16);
+	test_dns_append_uint16 (packet, value & 0xffff);
+}
+
+void
+test_dns_append_label (GByteArray *packet,
+		       const char *label)
+{
+	guint8 len = MIN (strlen (label), 63);
+
+	g_byte_array_append (packet, &len, 1);
+	g_byte_array_append (packet, (const guint8 *) label, len);
+}
+
+guint16
+test_dns_append_name (GByteArray *packet,
+		      const char *instance,
+		      const char *name)
+{
+	guint16 offset = packet->len;
+	char **labels;
+	guint i;
+
+	if (instance)
+		test_dns_append_label (packet, instance);
+	labels = g_strsplit (name, ".", -1);
+	for (i = 0; labels[i] != NULL; i++)
+		test_dns_append_label (packet, labels[i]);
+	g_strfreev (labels);
+	g_byte_array_append (packet, (const guint8 *) "", 1);
+
+	return offset;
+}
+
+void
+test_dns_append_record (GByteArray *packet,
+			guint16     type,
+			guint32     ttl,
+			GByteArray *rdata)
+{
+	test_dns_append_uint16 (packet, type);
+	test_dns_append_uint16 (packet, 0x0001);        /* IN */
+	test_dns_append_uint32 (packet, ttl);
+	test_dns_append_uint16 (packet, rdata->len);
+	g_byte_array_append (packet, rdata->data, rdata->len);
+}
+
+GByteArray *
+test_dns_new_response (void)
+{
+	GByteArray *packet;
+
+	packet = g_byte_array_new ();
+	test_dns_append_uint16 (packet, 0);
+	test_dns_append_uint16 (packet, 0x8400);        /* Authoritative answer */
+	test_dns_append_uint16 (packet, 0);
+	test_dns_append_uint16 (packet, 0);
+	test_dns_append_uint32 (packet, 0);
+
+	return packet;
+}
+
+#define RESPONDER_HOST_NAME "responder.local"
+#define RESPONDER_TTL       120                /* seconds */
+#define RESPONDER_MAX_PACKET 1400              /* bytes, as a responder on Ethernet would */
+
+#define TYPE_A              1
+#define TYPE_PTR            12
+#define TYPE_TXT            16
+#define TYPE_SRV            33
+
+typedef struct {
+	char *type;
+	char *instance;
+	guint16 port;
+	char **txt;
+} TestService;
+
+struct _TestResponder {
+	GSocket *socket;
+	GSource *source;
+	GPtrArray *services;
+	GHashTable *queriers;          /* key = service type, value = GSocketAddress */
+	GHashTable *n_queries;         /* key = service type, value = count */
+};
+
+static void
+test_service_free (TestService *service)
+{
+	g_free (service->type);
+	g_free (service->instance);
+	g_strfreev (service->txt);
+	g_free (service);
+}
+
+static void
+send_packet (TestResponder  *responder,
+	     GByteArray     *packet,
+	     guint16         n_records,
+	     GSocketAddress *querier)
+{
+	packet->data[6] = n_records >> 8;
+	packet->data[7] = n_records & 0xff;
+	g_socket_send_to (responder->socket, querier, (const char *) packet->data, packet->len, NULL, NULL);
+	g_byte_array_unref (packet);
+}
+
+/* Each packet carries the address, so that it stands on its own */
+static void
+send_services_packet (TestResponder  *responder,
+		      GByteArray     *packet,
+		      guint16         n_records,
+		      GSocketAddress *querier)
+{
+	GByteArray *rdata;
+	guint8 loopback[] = { 127, 0, 0, 1 };
+
+	test_dns_append_name (packet, NULL, RESPONDER_HOST_NAME);
+	rdata = g_byte_array_new ();
+	g_byte_array_append (rdata, loopback, sizeof(loopback));
+	test_dns_append_record (packet, TYPE_A, RESPONDER_TTL, rdata);
+	g_byte_array_unref (rdata);
+
+	send_packet (responder, packet, n_records + 1, querier);
+}
+
+static void
+send_services (TestResponder  *responder,
+	       const char     *type,
+	       GSocketAddress *querier)
+{
+	GByteArray *packet, *rdata;
+	guint16 n_records = 0;
+	char *domain;
+	guint i, j;
+
+	domain = g_strconcat (type, ".local", NULL);
+	packet = test_dns_new_response ();
+	for (i = 0; i < responder->services->len; i++) {
+		TestService *service = g_ptr_array_index (responder->services, i);
+
+		if (g_strcmp0 (service->type, type) != 0)
+			continue;
+
+		test_dns_append_name (packet, NULL, domain);
+		rdata = g_byte_array_new ();
+		test_dns_append_name (rdata, service->instance, domain);
+		test_dns_append_record (packet, TYPE_PTR, RESPONDER_TTL, rdata);
+		g_byte_array_unref (rdata);
+
+		test_dns_append_name (packet, service->instance, domain);
+		rdata = g_byte_array_new ();
+		test_dns_append_uint16 (rdata, 0);
+		test_dns_append_uint16 (rdata, 0);
+		test_dns_append_uint16 (rdata, service->port);
+		test_dns_append_name (rdata, NULL, RESPONDER_HOST_NAME);
+		test_dns_append_record (packet, TYPE_SRV, RESPONDER_TTL, rdata);
+		g_byte_array_unref (rdata);
+
+		test_dns_append_name (packet, service->instance, domain);
+		rdata = g_byte_array_new ();
+		for (j = 0; service->txt && service->txt[j] != NULL; j++)
+			test_dns_append_label (rdata, service->txt[j]);
+		test_dns_append_record (packet, TYPE_TXT, RESPONDER_TTL, rdata);
+		g_byte_array_unref (rdata);
+
+		n_records += 3;
+
+		if (packet->len >= RESPONDER_MAX_PACKET) {
+			send_services_packet (responder, packet, n_records, querier);
+			packet = test_dns_new_response ();
+			n_records = 0;
+		}
+	}
+
+	g_free (domain);
+
+	if (n_records == 0) {
+		g_byte_array_unref (packet);
+		return;
+	}
+
+	send_services_packet (responder, packet, n_records, querier);
+}
+
+static gboolean
+responder_cb (GSocket       *socket,
+	      GIOCondition   condition,
+	      TestResponder *responder)
+{
+	guint8 buffer[9000];
+	GSocketAddress *from = NULL;
+	GString *name;
+	gsize offset = 12;
+	gssize len;
+	guint i;
+
+	len = g_socket_receive_from (socket, &from, (char *) buffer, sizeof(buffer), NULL, NULL);
+	if (len <= 12 || (buffer[2] & 0x80) || ((buffer[4] << 8) | buffer[5]) == 0) {
+		g_clear_object (&from);
+		return G_SOURCE_CONTINUE;
+	}
+
+	/* The first question, which is never compressed */
+	name = g_string_new (NULL);
+	while (offset < (gsize) len && buffer[offset] != 0 && offset + 1 + buffer[offset] < (gsize) len) {
+		if (name->len > 0)
+			g_string_append_c (name, '.');
+		g_string_append_len (name, (const char *) buffer + offset + 1, buffer[offset]);
+		offset += buffer[offset] + 1;
+	}
+
+	/* Questions about a service, or its type */
+	for (i = 0; i < responder->services->len; i++) {
+		TestService *service = g_ptr_array_index (responder->services, i);
+		char *suffix;
+		gboolean matches;
+
+		suffix = g_strdup_printf ("%s.local", service->type);
+		matches = g_str_has_suffix (name->str, suffix);
+		g_free (suffix);
+		if (matches) {
+			guint n;
+
+			n = GPOINTER_TO_UINT (g_hash_table_lookup (responder->n_queries, service->type));
+			g_hash_table_insert (responder->n_queries, g_strdup (service->type), GUINT_TO_POINTER (n + 1));
+			g_hash_table_insert (responder->queriers, g_strdup (service->type), g_object_ref (from));
+			send_services (responder, service->type, from);
+			break;
+		}
+	}
+	g_string_free (name, TRUE);
+	g_object_unref (from);
+
+	return G_SOURCE_CONTINUE;
+}
+
+TestResponder *
+test_responder_new (void)
+{
+	TestResponder *responder;
+	GSocketAddress *address;
+	GInetAddress *loopback;
+	GError *error = NULL;
+
+	responder = g_new0 (TestResponder, 1);
+	responder->services = g_ptr_array_new_with_free_func ((GDestroyNotify) test_service_free);
+	responder->queriers = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+	responder->n_queries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+	responder->socket = g_socket_new (G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_DATAGRAM,
+					  G_SOCKET_PROTOCOL_UDP, &error);
+	g_assert_no_error (error);
+	g_socket_set_blocking (responder->socket, FALSE);
+	loopback = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+	address = g_inet_socket_address_new (loopback, 0);
+	g_socket_bind (responder->socket, address, FALSE, &error);
+	g_assert_no_error (error);
+	g_object_unref (address);
+	g_object_unref (loopback);
+
+	responder->source = g_socket_create_source (responder->socket, G_IO_IN, NULL);
+	g_source_set_callback (responder->source, (GSourceFunc) responder_cb, responder, NULL);
+	g_source_attach (responder->source, NULL);
+
+	return responder;
+}
+
+void
+test_responder_free (TestResponder *responder)
+{
+	g_source_destroy (responder->source);
+	g_source_unref (responder->source);
+	g_object_unref (responder->socket);
+	g_ptr_array_unref (responder->services);
+	g_hash_table_destroy (responder->queriers);
+	g_hash_table_destroy (responder->n_queries);
+	g_free (responder);
+}
+
+/* Returns "address:port", for REMOTE_DISPLAY_MDNS_TARGET */
+char *
+test_responder_get_target (TestResponder *responder)
+{
+	GSocketAddress *address;
+	char *target;
+
+	address = g_socket_get_local_address (responder->socket, NULL);
+	target = g_strdup_printf ("127.0.0.1:%u",
+				  g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (address)));
+	g_object_unref (address);
+
+	return target;
+}
+
+/* The service is sent with the replies to the next queries */
+void
+test_responder_add (TestResponder  *responder,
+		    const char     *type,
+		    const char     *instance,
+		    guint16         port,
+		    char          **txt)
+{
+	TestService *service;
+
+	service = g_new0 (TestService, 1);
+	service->type = g_strdup (type);
+	service->instance = g_strdup (instance);
+	service->port = port;
+	service->txt = g_strdupv (txt);
+	g_ptr_array_add (responder->services, service);
+}
+
+/* Says goodbye to the last querier for that type */
+void
+test_responder_remove (TestResponder *responder,
+		       const char    *type,
+		       const char    *instance)
+{
+	GSocketAddress *querier;
+	GByteArray *packet, *rdata;
+	char *domain;
+	guint i;
+
+	for (i = 0; i < responder->services->len; i++) {
+		TestService *service = g_ptr_array_index (responder->services, i);
+
+		if (g_strcmp0 (service->type, type) == 0 &&
+		    g_strcmp0 (service->instance, instance) == 0) {
+			g_ptr_array_remove_index (responder->services, i);
+			break;
+		}
+	}
+
+	querier = g_hash_table_lookup (responder->queriers, type);
+	if (!querier)
+		return;
+
+	domain = g_strconcat (type, ".local", NULL);
+	packet = test_dns_new_response ();
+	test_dns_append_name (packet, NULL, domain);
+	rdata = g_byte_array_new ();
+	test_dns_append_name (rdata, instance, domain);
+	test_dns_append_record (packet, TYPE_PTR, 0, rdata);
+	g_byte_array_unref (rdata);
+	g_free (domain);
+	send_packet (responder, packet, 1, querier);
+}
+
+guint
+test_responder_get_queries (TestResponder *responder,
+			    const char    *type)
+{
+	return GPOINTER_TO_UINT (g_hash_table_lookup (responder->n_queries, type));
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2015 Bastien Nocera <hadess@hadess.net>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option) any
+ * later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this package; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __TEST_UTIL_H__
+#define __TEST_UTIL_H__
+
+#include <glib.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define TEST_TIMEOUT 10                        /* seconds */
+
+/* Aborts the test if it's still waiting for @what after TEST_TIMEOUT */
+guint test_timeout_add (const char *what);
+
+/* The same, for waits known to take longer */
+guint test_timeout_add_seconds (const char *what,
+				guint       seconds);
+
+/* Runs @loop, failing the test if it doesn't quit in time */
+void test_run_loop (GMainLoop *loop);
+
+/* Iterates the default main context until @condition holds */
+#define test_wait_until(condition)					\
+	test_wait_until_seconds (condition, TEST_TIMEOUT)
+
+#define test_wait_until_seconds(condition, seconds) G_STMT_START {	\
+	guint test_timeout_id = test_timeout_add_seconds (#condition, (seconds)); \
+	while (!(condition))						\
+		g_main_context_iteration (NULL, TRUE);			\
+	g_source_remove (test_timeout_id);				\
+} G_STMT_END
+
+/* The nearest-rank @p percentile of @samples, an array of gdouble,
+ * which get sorted in place. 0 if there aren't any */
+gdouble test_percentile (GArray *samples,
+			 guint   p);
+
+/* DNS packet building, for the stand-in responders. Names are
+ * dotted, with an optional instance label in front that may
+ * contain dots itself. test_dns_append_name() returns the offset
+ * of the name, for compression pointers */
+GByteArray *test_dns_new_response  (void);
+void        test_dns_append_uint16 (GByteArray *packet,
+				    guint16     value);
+void        test_dns_append_uint32 (GByteArray *packet,
+				    guint32     value);
+void        test_dns_append_label  (GByteArray *packet,
+				    const char *label);
+guint16     test_dns_append_name   (GByteArray *packet,
+				    const char *instance,
+				    const char *name);
+void        test_dns_append_record (GByteArray *packet,
+				    guint16     type,
+				    guint32     ttl,
+				    GByteArray *rdata);
+
+/* A stand-in mDNS responder on the loopback interface, for
+ * REMOTE_DISPLAY_MDNS_TARGET. It answers every query for a service
+ * type with all the records of that type's services */
+typedef struct _TestResponder TestResponder;
+
+TestResponder *test_responder_new         (void);
+void           test_responder_free        (TestResponder  *responder);
+char          *test_responder_get_target  (TestResponder  *responder);
+void           test_responder_add         (TestResponder  *responder,
+					   const char     *type,
+					   const char     *instance,
+					   guint16         port,
+					   char          **txt);
+void           test_responder_remove      (TestResponder  *responder,
+					   const char     *type,
+					   const char     *instance);
+guint          test_responder_get_queries (TestResponder  *responder,
+					   const char     *type);
+
+G_END_DECLS
+
+#endif /* __TEST_UTIL_H__ */